@@ -0,0 +1,7018 @@
+/*!
+ * \brief
+ * Verifies and benchmarks the CPU kernels used by the DXIFR shim
+ *
+ * \file
+ *
+ * Each test first checks every SIMD kernel against its scalar reference over
+ * odd widths, odd heights and padded strides, then reports the throughput of
+ * every SIMD level the CPU supports. Run with -test <name> to pick one test.
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#pragma comment(lib, "winmm.lib")
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+
+#include "CpuFeatures.h"
+#include "YuvConvert.h"
+#include "NalScanner.h"
+#include "FramePacer.h"
+#include "FrameTrace.h"
+#include "Metrics.h"
+#include "TileHash.h"
+#include "FrameTiler.h"
+#include "RgbConvert.h"
+#include "FrameScaler.h"
+#if defined(_WIN32)
+#include "Bitmap.h"
+#endif
+#include "QpDeltaMap.h"
+#include "WorkerPool.h"
+#include "LockFreeRing.h"
+#include "BitstreamOutput.h"
+#include "NullVideoEncoder.h"
+#include "TsMuxer.h"
+#include "EncodePipeline.h"
+#include "EncodeInputBinder.h"
+#include "HttpStreamServer.h"
+#include "RtpPacketizer.h"
+#include "PlayerActivity.h"
+#include "BandwidthAllocator.h"
+#include "BandwidthSimulator.h"
+#include "EncodeSessionPool.h"
+#include "PlayerSession.h"
+#include "AsyncLog.h"
+#include "SimulcastStage.h"
+#include "ResolutionController.h"
+#include "Logger.h"
+
+// The shim's modules log through the logger its DLL defines; here they are
+// quiet, and the tests report what went wrong.
+simplelogger::Logger *logger = NULL;
+
+struct Options
+{
+    int width;
+    int height;
+    int iterations;
+    const char *test;
+    const char *trace;      // activity log for the bandwidth simulation
+};
+
+static double NowMs()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return now.QuadPart * 1000.0 / freq.QuadPart;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static unsigned int s_uRandState = 0x12345678;
+
+static void FillRandom(unsigned char *p, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        s_uRandState ^= s_uRandState << 13;
+        s_uRandState ^= s_uRandState >> 17;
+        s_uRandState ^= s_uRandState << 5;
+        p[i] = (unsigned char)s_uRandState;
+    }
+}
+
+// Levels to run for every test, in the order they are reported.
+static const SimdLevel s_aLevels[] = { SIMD_LEVEL_SCALAR, SIMD_LEVEL_SSE2, SIMD_LEVEL_SSE41, SIMD_LEVEL_AVX2, SIMD_LEVEL_NEON };
+
+////////////////////////////////////////////////////////////////////////////
+// I420 -> NV12 and YUV444 copies
+
+static int VerifyYuvConvert()
+{
+    static const int aWidths[] = { 1, 2, 3, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 129, 1279, 1280, 1281 };
+    static const int aHeights[] = { 1, 2, 3, 5, 64, 67 };
+    static const int aPads[] = { 0, 1, 7, 64 };
+    int nFailures = 0;
+
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (YuvSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+
+        for (size_t w = 0; w < sizeof(aWidths) / sizeof(aWidths[0]); w++)
+        for (size_t h = 0; h < sizeof(aHeights) / sizeof(aHeights[0]); h++)
+        for (size_t p = 0; p < sizeof(aPads) / sizeof(aPads[0]); p++)
+        {
+            int width = aWidths[w], height = aHeights[h], pad = aPads[p];
+            int chromaWidth = (width + 1) / 2;
+            int srcStrideY = width + pad;
+            int srcStrideUV = chromaWidth + pad / 2;
+            int dstStride = 2 * chromaWidth + pad;
+
+            std::vector<unsigned char> y(srcStrideY * height), u(srcStrideUV * height), v(srcStrideUV * height);
+            FillRandom(&y[0], y.size());
+            FillRandom(&u[0], u.size());
+            FillRandom(&v[0], v.size());
+
+            size_t dstSize = (size_t)dstStride * (height + height / 2);
+            std::vector<unsigned char> ref(dstSize, 0xCD), out(dstSize, 0xCD);
+            YuvI420ToNV12_C(&y[0], &u[0], &v[0], srcStrideY, srcStrideUV,
+                &ref[0], &ref[0] + dstStride * height, dstStride, width, height);
+            YuvI420ToNV12(&y[0], &u[0], &v[0], srcStrideY, srcStrideUV,
+                &out[0], &out[0] + dstStride * height, dstStride, width, height);
+            if (ref != out)
+            {
+                printf("  FAIL I420->NV12 %s %dx%d pad %d\n", GetSimdLevelName(s_aLevels[l]), width, height, pad);
+                nFailures++;
+            }
+
+            std::vector<unsigned char> src444(srcStrideY * height * 3), out444(dstStride * height * 3, 0xCD);
+            FillRandom(&src444[0], src444.size());
+            YuvCopyYUV444(&src444[0], &src444[srcStrideY * height], &src444[srcStrideY * height * 2], srcStrideY,
+                &out444[0], &out444[dstStride * height], &out444[dstStride * height * 2], dstStride, width, height);
+            for (int plane = 0; plane < 3; plane++)
+            for (int row = 0; row < height; row++)
+            {
+                if (memcmp(&src444[srcStrideY * (height * plane + row)], &out444[dstStride * (height * plane + row)], width))
+                {
+                    printf("  FAIL YUV444 copy %s %dx%d pad %d\n", GetSimdLevelName(s_aLevels[l]), width, height, pad);
+                    nFailures++;
+                    plane = 3;
+                    break;
+                }
+            }
+        }
+    }
+    YuvSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+static int RunYuvConvert(const Options &opt)
+{
+    int nFailures = VerifyYuvConvert();
+    printf("I420->NV12 verification: %s\n", nFailures ? "FAILED" : "passed");
+
+    int width = opt.width, height = opt.height;
+    int dstStride = (width + 255) & ~255;
+    std::vector<unsigned char> src(width * height * 3 / 2), dst(dstStride * height * 3 / 2);
+    FillRandom(&src[0], src.size());
+    unsigned char *pU = &src[width * height], *pV = pU + width * height / 4;
+
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (YuvSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+        double t0 = NowMs();
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            YuvI420ToNV12(&src[0], pU, pV, width, width / 2, &dst[0], &dst[dstStride * height], dstStride, width, height);
+        }
+        double ms = (NowMs() - t0) / opt.iterations;
+        printf("  %-7s %dx%d I420->NV12: %7.3f ms/frame, %6.2f GB/s\n", GetSimdLevelName(s_aLevels[l]),
+            width, height, ms, src.size() / (ms * 1.0e6));
+    }
+    YuvSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+static int RunYuvStriped(const Options &opt)
+{
+    int nFailures = 0;
+    int width = opt.width, height = opt.height;
+    int dstStride = (width + 255) & ~255;
+    std::vector<unsigned char> src(width * height * 3 / 2);
+    std::vector<unsigned char> ref(dstStride * height * 3 / 2, 0xCD), dst(dstStride * height * 3 / 2, 0xCD);
+    FillRandom(&src[0], src.size());
+    unsigned char *pU = &src[width * height], *pV = pU + width * height / 4;
+    YuvI420ToNV12_C(&src[0], pU, pV, width, width / 2, &ref[0], &ref[dstStride * height], dstStride, width, height);
+
+    int nCores = GetCpuFeatures().nLogicalCores;
+    for (int nThreads = 1; ; nThreads *= 2)
+    {
+        if (nThreads > nCores)
+            nThreads = nCores;
+        WorkerPool pool(nThreads);
+        YuvI420ToNV12Striped(&pool, &src[0], pU, pV, width, width / 2, &dst[0], &dst[dstStride * height], dstStride, width, height);
+        if (dst != ref)
+        {
+            printf("  FAIL striped I420->NV12 with %d threads\n", nThreads);
+            nFailures++;
+        }
+
+        double t0 = NowMs();
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            YuvI420ToNV12Striped(&pool, &src[0], pU, pV, width, width / 2, &dst[0], &dst[dstStride * height], dstStride, width, height);
+        }
+        double ms = (NowMs() - t0) / opt.iterations;
+        printf("  %2d threads %dx%d I420->NV12: %7.3f ms/frame, %6.2f GB/s\n", nThreads,
+            width, height, ms, src.size() / (ms * 1.0e6));
+        if (nThreads == nCores)
+            break;
+    }
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Zero-copy input binder
+
+// Logs every call as "name " and fails the nth call to RegisterHostBuffer
+// or MapInputResource (from 1) when asked to. Handles are made up and never
+// dereferenced.
+class MockEncodeResourceApi : public IEncodeResourceApi
+{
+public:
+    MockEncodeResourceApi() : m_nFailRegister(0), m_nFailMap(0), m_nRegistered(0), m_nMapped(0), m_nLastRegisterBytes(0), m_uNextHandle(0x1000), m_nLive(0) {}
+
+    virtual NVENCSTATUS CreateInputBuffer(uint32_t /*width*/, uint32_t /*height*/, NV_ENC_BUFFER_FORMAT /*bufferFmt*/, NV_ENC_INPUT_PTR *phInput)
+    {
+        m_log += "create ";
+        *phInput = NextHandle();
+        m_nLive++;
+        return NV_ENC_SUCCESS;
+    }
+    virtual NVENCSTATUS DestroyInputBuffer(NV_ENC_INPUT_PTR /*hInput*/)
+    {
+        m_log += "destroy ";
+        m_nLive--;
+        return NV_ENC_SUCCESS;
+    }
+    virtual NVENCSTATUS LockInputBuffer(NV_ENC_INPUT_PTR /*hInput*/, void **ppData, uint32_t *pPitch)
+    {
+        m_log += "lock ";
+        *ppData = m_aLocked;
+        *pPitch = 64;
+        return NV_ENC_SUCCESS;
+    }
+    virtual NVENCSTATUS UnlockInputBuffer(NV_ENC_INPUT_PTR /*hInput*/)
+    {
+        m_log += "unlock ";
+        return NV_ENC_SUCCESS;
+    }
+    virtual NVENCSTATUS RegisterHostBuffer(void * /*pHost*/, size_t nBytes, uint32_t /*width*/, uint32_t /*height*/, uint32_t /*pitch*/,
+                                           NV_ENC_BUFFER_FORMAT /*bufferFmt*/, NV_ENC_REGISTERED_PTR *phRegistered)
+    {
+        m_log += "register ";
+        m_nLastRegisterBytes = nBytes;
+        if (++m_nRegistered == m_nFailRegister)
+            return NV_ENC_ERR_RESOURCE_REGISTER_FAILED;
+        *phRegistered = NextHandle();
+        m_nLive++;
+        return NV_ENC_SUCCESS;
+    }
+    virtual NVENCSTATUS UnregisterHostBuffer(NV_ENC_REGISTERED_PTR /*hRegistered*/)
+    {
+        m_log += "unregister ";
+        m_nLive--;
+        return NV_ENC_SUCCESS;
+    }
+    virtual NVENCSTATUS MapInputResource(NV_ENC_REGISTERED_PTR /*hRegistered*/, NV_ENC_INPUT_PTR *phMapped)
+    {
+        m_log += "map ";
+        if (++m_nMapped == m_nFailMap)
+            return NV_ENC_ERR_MAP_FAILED;
+        *phMapped = NextHandle();
+        return NV_ENC_SUCCESS;
+    }
+    virtual NVENCSTATUS UnmapInputResource(NV_ENC_INPUT_PTR /*hMapped*/)
+    {
+        m_log += "unmap ";
+        return NV_ENC_SUCCESS;
+    }
+
+    // Returns the calls since the last TakeLog.
+    std::string TakeLog()
+    {
+        std::string log = m_log;
+        m_log.clear();
+        return log;
+    }
+
+    int             m_nFailRegister;
+    int             m_nFailMap;
+    int             m_nRegistered;
+    int             m_nMapped;
+    size_t          m_nLastRegisterBytes;
+
+    // Buffers created or registered and not yet destroyed or unregistered.
+    int LiveCount() const { return m_nLive; }
+
+private:
+    void *NextHandle()
+    {
+        m_uNextHandle += 0x10;
+        return (void *)m_uNextHandle;
+    }
+
+    std::string     m_log;
+    uintptr_t       m_uNextHandle;
+    int             m_nLive;
+    unsigned char   m_aLocked[64];
+};
+
+static bool CheckBinderCalls(MockEncodeResourceApi &api, const char *szCase, NVENCSTATUS nvStatus, NVENCSTATUS nvExpected,
+                             const char *szExpected)
+{
+    std::string log = api.TakeLog();
+    if (nvStatus == nvExpected && log == szExpected)
+        return true;
+    printf("  FAIL binder, %s: status %d, calls \"%s\", expected %d, \"%s\"\n", szCase, (int)nvStatus, log.c_str(), (int)nvExpected,
+        szExpected);
+    return false;
+}
+
+static bool CheckBinderState(const EncodeInputBuffer &input, const char *szCase, EncodeInputState eExpected)
+{
+    if (input.eState == eExpected)
+        return true;
+    printf("  FAIL binder, %s: state %d, expected %d\n", szCase, (int)input.eState, (int)eExpected);
+    return false;
+}
+
+static int VerifyInputBinder()
+{
+    int nFailures = 0;
+    MockEncodeResourceApi api;
+    EncodeInputBinder binder(&api);
+    static unsigned char s_aHost[3][64 * 32 * 3 / 2];
+
+    // A borrowed buffer is registered once, then mapped and unmapped around
+    // each frame; locking it for a copy is refused.
+    EncodeInputBuffer input;
+    memset(&input, 0, sizeof(input));
+    nFailures += !CheckBinderCalls(api, "register", binder.Register(&input, s_aHost[0], 64, 32, 64, NV_ENC_BUFFER_FORMAT_IYUV_PL),
+        NV_ENC_SUCCESS, "register ");
+    if (api.m_nLastRegisterBytes != sizeof(s_aHost[0]))
+    {
+        printf("  FAIL binder, registered %d bytes of I420 64x32\n", (int)api.m_nLastRegisterBytes);
+        nFailures++;
+    }
+    uint8_t *pData = NULL;
+    uint32_t uPitch = 0;
+    nFailures += !CheckBinderCalls(api, "lock borrowed", binder.BeginWrite(&input, &pData, &uPitch), NV_ENC_ERR_INVALID_CALL, "");
+    nFailures += !CheckBinderCalls(api, "unmap unmapped", binder.Unmap(&input), NV_ENC_ERR_INVALID_CALL, "");
+    for (int i = 0; i < 2; i++)
+    {
+        nFailures += !CheckBinderCalls(api, "map", binder.Map(&input), NV_ENC_SUCCESS, "map ");
+        nFailures += !CheckBinderState(input, "mapped", ENCODE_INPUT_MAPPED);
+        nFailures += !CheckBinderCalls(api, "map twice", binder.Map(&input), NV_ENC_ERR_INVALID_CALL, "");
+        nFailures += !CheckBinderCalls(api, "unmap", binder.Unmap(&input), NV_ENC_SUCCESS, "unmap ");
+        nFailures += !CheckBinderState(input, "unmapped", ENCODE_INPUT_REGISTERED);
+    }
+
+    // The same buffer coming back is a cache hit; a resize or another
+    // buffer replaces the registration.
+    nFailures += !CheckBinderCalls(api, "rebind same buffer",
+        binder.Rebind(&input, s_aHost[0], 64, 32, 64, NV_ENC_BUFFER_FORMAT_IYUV_PL), NV_ENC_SUCCESS, "");
+    nFailures += !CheckBinderCalls(api, "rebind resized",
+        binder.Rebind(&input, s_aHost[0], 32, 16, 32, NV_ENC_BUFFER_FORMAT_IYUV_PL), NV_ENC_SUCCESS, "unregister register ");
+    nFailures += !CheckBinderCalls(api, "rebind other buffer",
+        binder.Rebind(&input, s_aHost[1], 32, 16, 32, NV_ENC_BUFFER_FORMAT_IYUV_PL), NV_ENC_SUCCESS, "unregister register ");
+    static const struct { uint32_t width, height, pitch; NV_ENC_BUFFER_FORMAT bufferFmt; } s_aResized[] =
+    {
+        { 30, 16, 32, NV_ENC_BUFFER_FORMAT_IYUV_PL },
+        { 30, 14, 32, NV_ENC_BUFFER_FORMAT_IYUV_PL },
+        { 30, 14, 64, NV_ENC_BUFFER_FORMAT_IYUV_PL },
+        { 30, 14, 64, NV_ENC_BUFFER_FORMAT_NV12_PL },
+    };
+    for (int i = 0; i < (int)(sizeof(s_aResized) / sizeof(s_aResized[0])); i++)
+    {
+        nFailures += !CheckBinderCalls(api, "rebind with one thing changed", binder.Rebind(&input, s_aHost[1], s_aResized[i].width,
+            s_aResized[i].height, s_aResized[i].pitch, s_aResized[i].bufferFmt), NV_ENC_SUCCESS, "unregister register ");
+    }
+    nFailures += !CheckBinderCalls(api, "map before rebind", binder.Map(&input), NV_ENC_SUCCESS, "map ");
+    nFailures += !CheckBinderCalls(api, "rebind mapped",
+        binder.Rebind(&input, s_aHost[2], 32, 16, 32, NV_ENC_BUFFER_FORMAT_IYUV_PL), NV_ENC_ERR_INVALID_CALL, "");
+
+    // Releasing a mapped buffer unmaps it first.
+    nFailures += !CheckBinderCalls(api, "release mapped", binder.Release(&input), NV_ENC_SUCCESS, "unmap unregister ");
+    nFailures += !CheckBinderState(input, "released", ENCODE_INPUT_EMPTY);
+    nFailures += !CheckBinderCalls(api, "release empty", binder.Release(&input), NV_ENC_SUCCESS, "");
+
+    // A failed map leaves the buffer registered for the next frame.
+    binder.Register(&input, s_aHost[0], 64, 32, 64, NV_ENC_BUFFER_FORMAT_IYUV_PL);
+    api.TakeLog();
+    api.m_nFailMap = api.m_nMapped + 1;
+    nFailures += !CheckBinderCalls(api, "map failure", binder.Map(&input), NV_ENC_ERR_MAP_FAILED, "map ");
+    nFailures += !CheckBinderState(input, "after map failure", ENCODE_INPUT_REGISTERED);
+    binder.Release(&input);
+    api.TakeLog();
+
+    // A failed registration releases the buffers already registered and
+    // leaves all of them empty, so every frame is copied instead.
+    EncodeInputBuffer aInputs[3];
+    memset(aInputs, 0, sizeof(aInputs));
+    EncodeInputBuffer *apInputs[3] = { &aInputs[0], &aInputs[1], &aInputs[2] };
+    uint8_t *apHost[3] = { s_aHost[0], s_aHost[1], s_aHost[2] };
+    api.m_nFailRegister = api.m_nRegistered + 3;
+    nFailures += !CheckBinderCalls(api, "register failure",
+        binder.RebindAll(apInputs, apHost, 3, 64, 32, 64, NV_ENC_BUFFER_FORMAT_IYUV_PL), NV_ENC_ERR_RESOURCE_REGISTER_FAILED,
+        "register register register unregister unregister ");
+    for (int i = 0; i < 3; i++)
+    {
+        nFailures += !CheckBinderState(aInputs[i], "after register failure", ENCODE_INPUT_EMPTY);
+    }
+    nFailures += !CheckBinderCalls(api, "register all",
+        binder.RebindAll(apInputs, apHost, 3, 64, 32, 64, NV_ENC_BUFFER_FORMAT_IYUV_PL), NV_ENC_SUCCESS, "register register register ");
+    nFailures += !CheckBinderCalls(api, "register all again",
+        binder.RebindAll(apInputs, apHost, 3, 64, 32, 64, NV_ENC_BUFFER_FORMAT_IYUV_PL), NV_ENC_SUCCESS, "");
+    for (int i = 0; i < 3; i++)
+    {
+        binder.Release(&aInputs[i]);
+    }
+    api.TakeLog();
+
+    // Owned buffers are locked for the copy and never mapped.
+    nFailures += !CheckBinderCalls(api, "allocate", binder.Allocate(&input, 64, 32, NV_ENC_BUFFER_FORMAT_NV12_PL), NV_ENC_SUCCESS,
+        "create ");
+    nFailures += !CheckBinderCalls(api, "map owned", binder.Map(&input), NV_ENC_ERR_INVALID_CALL, "");
+    nFailures += !CheckBinderCalls(api, "rebind owned",
+        binder.Rebind(&input, s_aHost[0], 64, 32, 64, NV_ENC_BUFFER_FORMAT_IYUV_PL), NV_ENC_ERR_INVALID_CALL, "");
+    nFailures += !CheckBinderCalls(api, "lock", binder.BeginWrite(&input, &pData, &uPitch), NV_ENC_SUCCESS, "lock ");
+    nFailures += !CheckBinderCalls(api, "release locked", binder.Release(&input), NV_ENC_SUCCESS, "unlock destroy ");
+
+    if (api.LiveCount() != 0)
+    {
+        printf("  FAIL binder, %d buffers left registered or allocated\n", api.LiveCount());
+        nFailures++;
+    }
+    return nFailures;
+}
+
+static int RunInputBinder(const Options & /*opt*/)
+{
+    int nFailures = VerifyInputBinder();
+    printf("Input binder against a mock encoder: %s\n", nFailures ? "FAILED" : "passed");
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Encoder backends
+
+static void SetEnv(const char *szName, const char *szValue)
+{
+#if defined(_WIN32)
+    _putenv_s(szName, szValue);
+#else
+    setenv(szName, szValue, 1);
+#endif
+}
+
+// Splits an Annex-B stream into NAL units and checks that no payload contains
+// a start code or an unescaped 00 00 0x sequence. Returns the NAL types.
+static bool ParseAnnexB(const unsigned char *p, size_t size, std::vector<int> &aTypes, std::vector<size_t> &aSizes)
+{
+    size_t i = 0;
+    while (i + 4 <= size)
+    {
+        if (p[i] || p[i + 1] || p[i + 2] || p[i + 3] != 1)
+            return false;
+        size_t start = i + 4, end = start;
+        int nZeros = 0;
+        while (end < size)
+        {
+            if (nZeros >= 2 && p[end] <= 1)
+                break;
+            if (nZeros >= 2 && p[end] == 2)
+                return false;
+            nZeros = p[end] ? 0 : nZeros + 1;
+            end++;
+        }
+        if (end < size)
+            end -= nZeros;
+        if (end <= start)
+            return false;
+        aTypes.push_back(p[start] & 0x1F);
+        aSizes.push_back(end - i);
+        i = end;
+    }
+    return i == size;
+}
+
+static int VerifyNullEncoder()
+{
+    static const int aSizes[][2] = { { 1920, 1080 }, { 1280, 720 }, { 33, 17 }, { 3840, 2160 } };
+    int nFailures = 0;
+
+    for (size_t t = 0; t < sizeof(aSizes) / sizeof(aSizes[0]); t++)
+    {
+        int width = aSizes[t][0], height = aSizes[t][1], fps = 30, bitrate = 2000000;
+        CNullEncoder encoder;
+        if (encoder.EncodeMain(0, width, height, fps, bitrate))
+        {
+            printf("  FAIL null encoder EncodeMain %dx%d\n", width, height);
+            nFailures++;
+            continue;
+        }
+
+        for (int frame = 0; frame < 40; frame++)
+        {
+            std::vector<unsigned char> au = encoder.EncodeNextAccessUnit();
+            std::vector<int> aTypes;
+            std::vector<size_t> aNalSizes;
+            bool bIdr = frame == 0;
+            size_t target = (size_t)bitrate / 8 / fps * (bIdr ? NULL_ENCODER_IDR_SIZE_FACTOR : 1);
+
+            bool bOk = ParseAnnexB(&au[0], au.size(), aTypes, aNalSizes);
+            if (bIdr)
+                bOk = bOk && aTypes.size() >= 3 && aTypes[0] == 7 && aTypes[1] == 8 && aTypes[2] == 5;
+            else
+                bOk = bOk && aTypes.size() >= 1 && aTypes[0] == 1;
+            if (aTypes.size() == (bIdr ? 4u : 2u))
+                bOk = bOk && aTypes.back() == 12 && au.size() == target;
+            else
+                bOk = bOk && aTypes.size() == (bIdr ? 3u : 1u) && au.size() + 6 > target;
+            if (!bOk)
+            {
+                printf("  FAIL null encoder %dx%d frame %d: %d bytes, %d NAL units\n", width, height, frame,
+                    (int)au.size(), (int)aTypes.size());
+                nFailures++;
+                break;
+            }
+        }
+        encoder.Shutdown();
+    }
+    return nFailures;
+}
+
+static int RunEncoders(const Options &opt)
+{
+    // Keep the encoders off the network; the stream only has to be written.
+#if defined(_WIN32)
+    SetEnv(BITSTREAM_OUTPUT_ENV, "NUL");
+#else
+    SetEnv(BITSTREAM_OUTPUT_ENV, "/dev/null");
+#endif
+
+    int nFailures = VerifyNullEncoder();
+    printf("Null encoder stream verification: %s\n", nFailures ? "FAILED" : "passed");
+
+    int width = opt.width, height = opt.height;
+    std::vector<unsigned char> frame(width * height * 3 / 2);
+    FillRandom(&frame[0], frame.size());
+
+    static const VideoEncoderBackend aBackends[] = { VIDEO_ENCODER_NULL, VIDEO_ENCODER_X264, VIDEO_ENCODER_NVENC };
+    for (size_t b = 0; b < sizeof(aBackends) / sizeof(aBackends[0]); b++)
+    {
+        IVideoEncoder *pEncoder = CreateVideoEncoder(aBackends[b], 0);
+        if (!pEncoder)
+        {
+            printf("  %-6s not built in\n", GetVideoEncoderBackendName(aBackends[b]));
+            continue;
+        }
+        if (pEncoder->EncodeMain(0, width, height, 30, 2000000))
+        {
+            printf("  %-6s not available on this machine\n", GetVideoEncoderBackendName(aBackends[b]));
+            delete pEncoder;
+            continue;
+        }
+
+        double t0 = NowMs();
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            pEncoder->EncodeFrameLoop(&frame[0], (i % 30) == 29, 0, 1000000 + (i % 4) * 500000);
+        }
+        pEncoder->Shutdown();
+        double ms = (NowMs() - t0) / opt.iterations;
+        printf("  %-6s %dx%d: %7.3f ms/frame, %7.1f fps\n", GetVideoEncoderBackendName(aBackends[b]),
+            width, height, ms, 1000.0 / ms);
+        delete pEncoder;
+    }
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Encode pipeline depth
+
+// Sleeps most of the way, then yields, so short waits stay accurate with a
+// 1 ms (or coarser) scheduler tick.
+static void WaitUntilMs(double fTargetMs)
+{
+    for (;;)
+    {
+        double fRemaining = fTargetMs - NowMs();
+        if (fRemaining <= 0)
+            return;
+#if defined(_WIN32)
+        Sleep(fRemaining > 2 ? (DWORD)(fRemaining - 1) : 0);
+#else
+        if (fRemaining > 2)
+        {
+            timespec ts;
+            ts.tv_sec = (time_t)((fRemaining - 1) / 1000);
+            ts.tv_nsec = (long)(fmod(fRemaining - 1, 1000.0) * 1000000.0);
+            nanosleep(&ts, NULL);
+        }
+        else
+        {
+            sched_yield();
+        }
+#endif
+    }
+}
+
+// Stand-in for one NVENC input/output buffer pair. The "hardware" encodes one
+// frame at a time, so a frame is ready encodeMs after it was submitted or
+// after the previous frame was ready, whichever is later.
+struct SimEncodeBuffer
+{
+    double       fReadyMs;
+    unsigned int uFrame;
+};
+
+struct SimDrainState
+{
+    unsigned int uNextFrame;
+    int          nOutOfOrder;
+    unsigned int nReported;         // frames handed to DrainedSimBuffer
+    uint64_t     uLatencySumUs;
+};
+
+static void DrainSimBuffer(void *pContext, void *pItem)
+{
+    SimDrainState *pState = (SimDrainState *)pContext;
+    SimEncodeBuffer *pBuffer = (SimEncodeBuffer *)pItem;
+    WaitUntilMs(pBuffer->fReadyMs);
+    if (pBuffer->uFrame != pState->uNextFrame)
+        pState->nOutOfOrder++;
+    pState->uNextFrame = pBuffer->uFrame + 1;
+}
+
+static void DrainedSimBuffer(void *pContext, void * /*pItem*/, uint64_t uLatencyUs)
+{
+    SimDrainState *pState = (SimDrainState *)pContext;
+    pState->nReported++;
+    pState->uLatencySumUs += uLatencyUs;
+}
+
+static int RunEncodePipeline(const Options &opt)
+{
+    // 1080p low latency NVENC takes about 8 ms per frame; capture plus the
+    // NV12 upload about 6 ms. Serialized that is 14 ms a frame, pipelined the
+    // slower of the two.
+    const double fUploadMs = 6.0, fEncodeMs = 8.0;
+    const unsigned int uFrames = opt.iterations < 120 ? opt.iterations : 120;
+    int nFailures = 0;
+#if defined(_WIN32)
+    timeBeginPeriod(1);
+#endif
+
+    for (unsigned int uDepth = 1; uDepth <= 4; uDepth++)
+    {
+        SimEncodeBuffer aBuffers[4];
+        void *apItems[4];
+        for (unsigned int i = 0; i < uDepth; i++)
+            apItems[i] = &aBuffers[i];
+
+        SimDrainState state;
+        state.uNextFrame = 0;
+        state.nOutOfOrder = 0;
+        state.nReported = 0;
+        state.uLatencySumUs = 0;
+
+        EncodePipeline pipeline;
+        pipeline.SetDrainedFunc(DrainedSimBuffer);
+        pipeline.Start(apItems, uDepth, DrainSimBuffer, &state);
+        double fLastReadyMs = 0;
+        for (unsigned int i = 0; i < uFrames; i++)
+        {
+            SimEncodeBuffer *pBuffer = (SimEncodeBuffer *)pipeline.AcquireFree();
+            WaitUntilMs(NowMs() + fUploadMs);
+            if (i % 10 == 9)
+            {
+                // Exercise the failure path: the buffer goes back unsubmitted.
+                pipeline.CancelAcquire();
+                continue;
+            }
+            double fNow = NowMs();
+            fLastReadyMs = (fNow > fLastReadyMs ? fNow : fLastReadyMs) + fEncodeMs;
+            pBuffer->fReadyMs = fLastReadyMs;
+            pBuffer->uFrame = i - i / 10;
+            pipeline.Submit();
+        }
+        pipeline.WaitIdle();
+
+        EncodePipelineStats stats;
+        pipeline.GetStats(&stats);
+        pipeline.Stop();
+
+        unsigned int uSubmitted = uFrames - uFrames / 10;
+        if (stats.nFrames != uSubmitted || state.uNextFrame != uSubmitted || state.nOutOfOrder)
+        {
+            printf("  FAIL depth %u: %llu of %u frames drained, %d out of order\n", uDepth,
+                stats.nFrames, uSubmitted, state.nOutOfOrder);
+            nFailures++;
+        }
+        // The drained callback sees every frame's latency, the same values
+        // the statistics are built from.
+        double fReportedAvgMs = state.nReported ? state.uLatencySumUs / 1000.0 / state.nReported : 0;
+        if (state.nReported != uSubmitted || fReportedAvgMs != stats.fLatencyAvgMs)
+        {
+            printf("  FAIL depth %u: %u frames reported, latency avg %.3f ms against %.3f ms\n", uDepth,
+                state.nReported, fReportedAvgMs, stats.fLatencyAvgMs);
+            nFailures++;
+        }
+        printf("  depth %u: %6.1f fps, latency avg %5.1f ms max %5.1f ms, encoder blocked %6.1f ms\n", uDepth,
+            stats.nFrames * 1000.0 / stats.fElapsedMs, stats.fLatencyAvgMs, stats.fLatencyMaxMs, stats.fAcquireWaitMs);
+    }
+
+#if defined(_WIN32)
+    timeEndPeriod(1);
+#endif
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Buffer rings
+
+struct RingItem
+{
+    unsigned int uSeq;
+    double       fTime;
+};
+
+// The queue the encoder used before SpscRing, kept here as the baseline.
+template<class T>
+class CNvQueue {
+    T** m_pBuffer;
+    unsigned int m_uSize;
+    unsigned int m_uPendingCount;
+    unsigned int m_uAvailableIdx;
+    unsigned int m_uPendingndex;
+public:
+    CNvQueue() : m_pBuffer(NULL), m_uSize(0), m_uPendingCount(0), m_uAvailableIdx(0),
+        m_uPendingndex(0)
+    {
+    }
+
+    ~CNvQueue()
+    {
+        delete[] m_pBuffer;
+    }
+
+    bool Initialize(T *pItems, unsigned int uSize)
+    {
+        m_uSize = uSize;
+        m_uPendingCount = 0;
+        m_uAvailableIdx = 0;
+        m_uPendingndex = 0;
+        m_pBuffer = new T *[m_uSize];
+        for (unsigned int i = 0; i < m_uSize; i++)
+        {
+            m_pBuffer[i] = &pItems[i];
+        }
+        return true;
+    }
+
+
+    T * GetAvailable()
+    {
+        T *pItem = NULL;
+        if (m_uPendingCount == m_uSize)
+        {
+            return NULL;
+        }
+        pItem = m_pBuffer[m_uAvailableIdx];
+        m_uAvailableIdx = (m_uAvailableIdx + 1) % m_uSize;
+        m_uPendingCount += 1;
+        return pItem;
+    }
+
+    T* GetPending()
+    {
+        if (m_uPendingCount == 0)
+        {
+            return NULL;
+        }
+
+        T *pItem = m_pBuffer[m_uPendingndex];
+        m_uPendingndex = (m_uPendingndex + 1) % m_uSize;
+        m_uPendingCount -= 1;
+        return pItem;
+    }
+};
+
+// CNvQueue shared the obvious way: every access under one mutex, blocking on
+// condition variables. Items are filled and read with the lock held, since
+// CNvQueue reuses a slot as soon as GetPending returns it.
+class LockedNvQueue
+{
+public:
+    LockedNvQueue() : m_bClosed(false) {}
+
+    void Initialize(unsigned int uSize)
+    {
+        m_aItems.resize(uSize);
+        m_queue.Initialize(&m_aItems[0], uSize);
+    }
+
+    bool Produce(unsigned int uSeq, double fTime)
+    {
+        RingItem *pItem;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while ((pItem = m_queue.GetAvailable()) == NULL)
+            {
+                if (m_bClosed)
+                    return false;
+                m_cvFree.wait(lock);
+            }
+            pItem->uSeq = uSeq;
+            pItem->fTime = fTime;
+        }
+        m_cvPending.notify_one();
+        return true;
+    }
+
+    bool Consume(RingItem *pOut)
+    {
+        RingItem *pItem;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while ((pItem = m_queue.GetPending()) == NULL)
+            {
+                if (m_bClosed)
+                    return false;
+                m_cvPending.wait(lock);
+            }
+            *pOut = *pItem;
+        }
+        m_cvFree.notify_one();
+        return true;
+    }
+
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_bClosed = true;
+        }
+        m_cvFree.notify_all();
+        m_cvPending.notify_all();
+    }
+
+private:
+    std::vector<RingItem>       m_aItems;
+    CNvQueue<RingItem>          m_queue;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_cvFree;
+    std::condition_variable     m_cvPending;
+    bool                        m_bClosed;
+};
+
+// Same interface on top of SpscRing or MpmcRing.
+template<class Ring>
+class LockFreeQueue
+{
+public:
+    void Initialize(unsigned int uSize)
+    {
+        m_aItems.resize(uSize);
+        m_ring.Initialize(&m_aItems[0], uSize);
+    }
+
+    bool Produce(unsigned int uSeq, double fTime)
+    {
+        RingItem *pItem = m_ring.WaitAvailable();
+        if (!pItem)
+            return false;
+        pItem->uSeq = uSeq;
+        pItem->fTime = fTime;
+        m_ring.PushPending(pItem);
+        return true;
+    }
+
+    bool Consume(RingItem *pOut)
+    {
+        RingItem *pItem = m_ring.WaitPending();
+        if (!pItem)
+            return false;
+        *pOut = *pItem;
+        m_ring.ReleasePending(pItem);
+        return true;
+    }
+
+    void Close()
+    {
+        m_ring.Close();
+    }
+
+private:
+    std::vector<RingItem>       m_aItems;
+    Ring                        m_ring;
+};
+
+template<class Queue>
+struct RingThroughputRun
+{
+    Queue               *pQueue;
+    unsigned int         nItems;
+    int                  nProducers;
+    std::mutex           mutex;
+    unsigned long long   nConsumed;
+    unsigned long long   uSeqSum;
+    int                  nOutOfOrder;
+
+    // Producer p sends p, p + nProducers, ...
+    void Produce(int iProducer)
+    {
+        for (unsigned int uSeq = iProducer; uSeq < nItems; uSeq += nProducers)
+        {
+            pQueue->Produce(uSeq, 0);
+        }
+    }
+
+    void Consume()
+    {
+        RingItem item;
+        unsigned long long n = 0, uSum = 0;
+        unsigned int uNext = 0;
+        int nBad = 0;
+        while (pQueue->Consume(&item))
+        {
+            if (item.uSeq != uNext)
+                nBad++;
+            uNext = item.uSeq + 1;
+            uSum += item.uSeq;
+            n++;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        nConsumed += n;
+        uSeqSum += uSum;
+        nOutOfOrder += nBad;
+    }
+};
+
+// Pushes nItems through the queue and returns millions of items a second.
+// With one producer and one consumer the items must also arrive in order.
+template<class Queue>
+static double RunRingThroughput(const char *szName, int nProducers, int nConsumers, unsigned int nItems, int *pnFailures)
+{
+    Queue queue;
+    queue.Initialize(8);
+
+    RingThroughputRun<Queue> run;
+    run.pQueue = &queue;
+    run.nItems = nItems;
+    run.nProducers = nProducers;
+    run.nConsumed = 0;
+    run.uSeqSum = 0;
+    run.nOutOfOrder = 0;
+
+    double t0 = NowMs();
+    std::vector<std::thread> aConsumers, aProducers;
+    for (int i = 0; i < nConsumers; i++)
+        aConsumers.push_back(std::thread(&RingThroughputRun<Queue>::Consume, &run));
+    for (int i = 0; i < nProducers; i++)
+        aProducers.push_back(std::thread(&RingThroughputRun<Queue>::Produce, &run, i));
+    for (size_t i = 0; i < aProducers.size(); i++)
+        aProducers[i].join();
+    queue.Close();
+    for (size_t i = 0; i < aConsumers.size(); i++)
+        aConsumers[i].join();
+    double ms = NowMs() - t0;
+
+    unsigned long long uExpectedSum = (unsigned long long)nItems * (nItems - 1) / 2;
+    bool bInOrder = nProducers > 1 || nConsumers > 1 || run.nOutOfOrder == 0;
+    if (run.nConsumed != nItems || run.uSeqSum != uExpectedSum || !bInOrder)
+    {
+        printf("  FAIL %s %dx%d: %llu of %u items, %d out of order\n", szName, nProducers, nConsumers,
+            run.nConsumed, nItems, run.nOutOfOrder);
+        (*pnFailures)++;
+    }
+    return nItems / (ms * 1000.0);
+}
+
+template<class Queue>
+static void EchoRingItems(Queue *pIn, Queue *pOut)
+{
+    RingItem item;
+    while (pIn->Consume(&item))
+    {
+        pOut->Produce(item.uSeq, item.fTime);
+    }
+}
+
+// Bounces one item between two threads and returns the average one-way
+// handoff time in microseconds, which includes waking the other thread up.
+template<class Queue>
+static double RunRingPingPong(const char *szName, unsigned int nRoundTrips, int *pnFailures)
+{
+    Queue ping, pong;
+    ping.Initialize(8);
+    pong.Initialize(8);
+    std::thread echo(&EchoRingItems<Queue>, &ping, &pong);
+
+    int nBad = 0;
+    double t0 = NowMs();
+    for (unsigned int i = 0; i < nRoundTrips; i++)
+    {
+        RingItem item;
+        ping.Produce(i, 0);
+        if (!pong.Consume(&item) || item.uSeq != i)
+            nBad++;
+    }
+    double ms = NowMs() - t0;
+    ping.Close();
+    echo.join();
+
+    if (nBad)
+    {
+        printf("  FAIL %s ping-pong: %d bad round trips\n", szName, nBad);
+        (*pnFailures)++;
+    }
+    return ms * 1000.0 / (2.0 * nRoundTrips);
+}
+
+template<class Queue>
+static void ReportRing(const char *szName, bool bMpmc, const Options &opt, int *pnFailures)
+{
+    unsigned int nItems = (unsigned int)opt.iterations * 5000;
+    double fSpsc = RunRingThroughput<Queue>(szName, 1, 1, nItems, pnFailures);
+    double fHandoffUs = RunRingPingPong<Queue>(szName, (unsigned int)opt.iterations * 50, pnFailures);
+    if (bMpmc)
+    {
+        double fMpmc = RunRingThroughput<Queue>(szName, 2, 2, nItems, pnFailures);
+        printf("  %-16s 1x1 %6.2f Mitems/s, 2x2 %6.2f Mitems/s, handoff %6.2f us\n", szName, fSpsc, fMpmc, fHandoffUs);
+    }
+    else
+    {
+        printf("  %-16s 1x1 %6.2f Mitems/s,                       handoff %6.2f us\n", szName, fSpsc, fHandoffUs);
+    }
+}
+
+static int RunRings(const Options &opt)
+{
+    int nFailures = 0;
+    ReportRing<LockedNvQueue>("CNvQueue+mutex", true, opt, &nFailures);
+    ReportRing<LockFreeQueue<SpscRing<RingItem> > >("SpscRing", false, opt, &nFailures);
+    ReportRing<LockFreeQueue<MpmcRing<RingItem> > >("MpmcRing", true, opt, &nFailures);
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// MPEG-TS muxer
+
+struct TsDemuxedPes
+{
+    std::vector<unsigned char> payload;
+    long long pts;
+    long long pcr;              // -1 if the first packet had none
+    bool bRandomAccess;
+};
+
+// Minimal demuxer written against ISO/IEC 13818-1, independent of TsMuxer.
+// Checks packet framing, continuity counters and PSI; collects video PES.
+class TsDemuxer
+{
+public:
+    TsDemuxer() : m_pmtPid(-1), m_videoPid(-1), m_streamType(-1), m_pcrPid(-1), m_nErrors(0), m_bInPes(false)
+    {
+        memset(m_aCc, 0xFF, sizeof(m_aCc));
+    }
+
+    void Parse(const unsigned char *p, size_t size)
+    {
+        if (size % TS_PACKET_SIZE)
+            Error("stream is not a whole number of packets");
+        for (size_t i = 0; i + TS_PACKET_SIZE <= size; i += TS_PACKET_SIZE)
+            ParsePacket(p + i);
+        FinishPes();
+    }
+
+    std::vector<TsDemuxedPes> m_aPes;
+    int m_pmtPid, m_videoPid, m_streamType, m_pcrPid;
+    int m_nErrors;
+
+private:
+    void Error(const char *szWhat)
+    {
+        if (m_nErrors++ < 5)
+            printf("  FAIL ts demux: %s\n", szWhat);
+    }
+
+    static long long ReadTimestamp(const unsigned char *p)
+    {
+        return ((long long)(p[0] & 0x0E) << 29) | (p[1] << 22) | ((p[2] & 0xFE) << 14) | (p[3] << 7) | (p[4] >> 1);
+    }
+
+    void ParseSection(int pid, const unsigned char *p, size_t size)
+    {
+        size_t sectionLength = ((p[1] & 0x0F) << 8) | p[2];
+        if (sectionLength + 3 > size || TsCrc32(p, sectionLength + 3) != 0)
+        {
+            Error("bad PSI section or CRC");
+            return;
+        }
+        if (pid == 0 && p[0] == 0x00)
+            m_pmtPid = ((p[10] & 0x1F) << 8) | p[11];
+        else if (pid == m_pmtPid && p[0] == 0x02)
+        {
+            m_pcrPid = ((p[8] & 0x1F) << 8) | p[9];
+            size_t infoLength = ((p[10] & 0x0F) << 8) | p[11];
+            const unsigned char *pEs = p + 12 + infoLength;
+            m_streamType = pEs[0];
+            m_videoPid = ((pEs[1] & 0x1F) << 8) | pEs[2];
+        }
+    }
+
+    void ParsePacket(const unsigned char *p)
+    {
+        if (p[0] != 0x47)
+        {
+            Error("lost sync");
+            return;
+        }
+        bool bStart = (p[1] & 0x40) != 0;
+        int pid = ((p[1] & 0x1F) << 8) | p[2];
+        int afc = (p[3] >> 4) & 3, cc = p[3] & 0x0F;
+        if (afc & 1)
+        {
+            if (m_aCc[pid] != 0xFF && cc != ((m_aCc[pid] + 1) & 0x0F))
+                Error("continuity counter jump");
+            m_aCc[pid] = (unsigned char)cc;
+        }
+
+        const unsigned char *pPayload = p + 4;
+        long long pcr = -1;
+        bool bRandomAccess = false;
+        if (afc & 2)
+        {
+            int afLength = p[4];
+            if (afLength > 183)
+            {
+                Error("adaptation field too long");
+                return;
+            }
+            if (afLength > 0)
+            {
+                bRandomAccess = (p[5] & 0x40) != 0;
+                if (p[5] & 0x10)
+                {
+                    pcr = ((long long)p[6] << 25) | (p[7] << 17) | (p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+                    if (((p[10] & 1) << 8 | p[11]) != 0)
+                        Error("unexpected PCR extension");
+                }
+            }
+            pPayload += 1 + afLength;
+        }
+        size_t payloadSize = p + TS_PACKET_SIZE - pPayload;
+        if (!(afc & 1))
+            return;
+
+        if (pid == 0 || pid == m_pmtPid)
+        {
+            if (bStart)
+                ParseSection(pid, pPayload + 1 + pPayload[0], payloadSize - 1 - pPayload[0]);
+            return;
+        }
+        if (pid != m_videoPid)
+        {
+            Error("packet on unknown PID");
+            return;
+        }
+        if (bStart)
+        {
+            FinishPes();
+            TsDemuxedPes pes;
+            pes.pts = -1;
+            pes.pcr = pcr;
+            pes.bRandomAccess = bRandomAccess;
+            m_aPes.push_back(pes);
+            m_bInPes = true;
+        }
+        else if (pcr >= 0)
+        {
+            Error("PCR outside the first packet of a PES");
+        }
+        if (m_bInPes)
+            m_pending.insert(m_pending.end(), pPayload, pPayload + payloadSize);
+    }
+
+    void FinishPes()
+    {
+        if (m_aPes.empty() || m_pending.empty())
+            return;
+        const unsigned char *p = &m_pending[0];
+        TsDemuxedPes &pes = m_aPes.back();
+        if (m_pending.size() < 14 || p[0] || p[1] || p[2] != 1 || p[3] != 0xE0 || !(p[7] & 0x80))
+        {
+            Error("bad PES header");
+        }
+        else
+        {
+            size_t pesLength = (p[4] << 8) | p[5];
+            size_t headerEnd = 9 + p[8];
+            if (pesLength && pesLength + 6 != m_pending.size())
+                Error("PES_packet_length mismatch");
+            pes.pts = ReadTimestamp(p + 9);
+            pes.payload.assign(m_pending.begin() + headerEnd, m_pending.end());
+        }
+        m_pending.clear();
+    }
+
+    unsigned char m_aCc[8192];
+    std::vector<unsigned char> m_pending;
+    bool m_bInPes;
+};
+
+// Builds an access unit of one slice NAL of the given size, optionally led
+// by an access unit delimiter.
+static std::vector<unsigned char> MakeTestAccessUnit(TsStreamType eType, size_t size, bool bKeyframe, bool bAud)
+{
+    std::vector<unsigned char> au;
+    static const unsigned char aH264Aud[] = { 0, 0, 0, 1, 0x09, 0xF0 };
+    static const unsigned char aHevcAud[] = { 0, 0, 0, 1, 0x46, 0x01, 0x50 };
+    if (bAud && eType == TS_STREAM_HEVC)
+        au.assign(aHevcAud, aHevcAud + sizeof(aHevcAud));
+    else if (bAud)
+        au.assign(aH264Aud, aH264Aud + sizeof(aH264Aud));
+
+    size_t start = au.size();
+    au.resize(start + 4 + size);
+    FillRandom(&au[start + 4], size);
+    // Keep the random bytes from forming start codes.
+    for (size_t i = start + 4; i < au.size(); i++)
+        au[i] |= 0x80;
+    au[start + 3] = 1;
+    if (eType == TS_STREAM_HEVC)
+    {
+        au[start + 4] = (unsigned char)((bKeyframe ? 19 : 1) << 1);
+        if (size > 1)
+            au[start + 5] = 1;
+    }
+    else if (size)
+    {
+        au[start + 4] = bKeyframe ? 0x65 : 0x41;
+    }
+    return au;
+}
+
+static int VerifyTsMuxer(TsStreamType eType)
+{
+    const char *szType = eType == TS_STREAM_HEVC ? "HEVC" : "H.264";
+    TsMuxer muxer(eType);
+    std::vector<std::vector<unsigned char> > aAccessUnits;
+    std::vector<long long> aPts;
+    std::vector<unsigned char> ts;
+
+    // Sizes around packet and PES length boundaries, with and without AUD.
+    static const size_t aSizes[] = { 1, 2, 160, 161, 162, 170, 176, 183, 184, 185, 350, 351, 352, 368, 1000,
+                                     65000, 65535, 65536, 70000, 200000 };
+    for (size_t i = 0; i < sizeof(aSizes) / sizeof(aSizes[0]) * 2; i++)
+    {
+        size_t size = aSizes[i / 2];
+        bool bKeyframe = (i % 13) == 0;
+        aAccessUnits.push_back(MakeTestAccessUnit(eType, size, bKeyframe, (i & 1) != 0));
+        aPts.push_back((long long)i * 3003);
+        muxer.MuxAccessUnit(&aAccessUnits.back()[0], aAccessUnits.back().size(), aPts.back(), ts);
+    }
+
+    TsDemuxer demux;
+    demux.Parse(&ts[0], ts.size());
+    int nFailures = demux.m_nErrors ? 1 : 0;
+    if (demux.m_streamType != eType || demux.m_videoPid < 0 || demux.m_pcrPid != demux.m_videoPid)
+    {
+        printf("  FAIL %s PMT: stream type 0x%x, video PID %d, PCR PID %d\n", szType, demux.m_streamType,
+            demux.m_videoPid, demux.m_pcrPid);
+        nFailures++;
+    }
+    if (demux.m_aPes.size() != aAccessUnits.size())
+    {
+        printf("  FAIL %s: %d PES packets for %d access units\n", szType, (int)demux.m_aPes.size(), (int)aAccessUnits.size());
+        return nFailures + 1;
+    }
+
+    long long ptsDelay = (long long)TS_PTS_DELAY_MS * TS_CLOCK_HZ / 1000;
+    for (size_t i = 0; i < aAccessUnits.size(); i++)
+    {
+        const TsDemuxedPes &pes = demux.m_aPes[i];
+        std::vector<unsigned char> expected;
+        bool bHasAud = (i & 1) != 0;
+        if (!bHasAud)
+        {
+            std::vector<unsigned char> aud = MakeTestAccessUnit(eType, 0, false, true);
+            expected.assign(aud.begin(), aud.end() - 4);
+        }
+        expected.insert(expected.end(), aAccessUnits[i].begin(), aAccessUnits[i].end());
+        bool bKeyframe = ((i % 13) == 0);
+        if (pes.payload != expected || pes.pts != aPts[i] + ptsDelay || pes.pcr != aPts[i] || pes.bRandomAccess != bKeyframe)
+        {
+            printf("  FAIL %s access unit %d (%d bytes): payload %s, PTS %lld, PCR %lld, random access %d\n", szType,
+                (int)i, (int)aAccessUnits[i].size(), pes.payload == expected ? "ok" : "differs", pes.pts, pes.pcr,
+                (int)pes.bRandomAccess);
+            nFailures++;
+        }
+    }
+    return nFailures;
+}
+
+static int RunTsMuxer(const Options &opt)
+{
+    int nFailures = VerifyTsMuxer(TS_STREAM_H264) + VerifyTsMuxer(TS_STREAM_HEVC);
+    printf("TS round trip: %s\n", nFailures ? "FAILED" : "passed");
+
+    // A constant bitrate null stream at 20 Mbps and 60 fps.
+    CNullEncoder encoder(20000000 / 8 / 60);
+#if defined(_WIN32)
+    SetEnv(BITSTREAM_OUTPUT_ENV, "NUL");
+#else
+    SetEnv(BITSTREAM_OUTPUT_ENV, "/dev/null");
+#endif
+    encoder.EncodeMain(0, opt.width, opt.height, 60, 20000000);
+    std::vector<unsigned char> au = encoder.EncodeNextAccessUnit();
+    au = encoder.EncodeNextAccessUnit();
+    encoder.Shutdown();
+
+    TsMuxer muxer;
+    std::vector<unsigned char> ts;
+    double t0 = NowMs();
+    for (int i = 0; i < opt.iterations * 10; i++)
+    {
+        ts.clear();
+        muxer.MuxAccessUnit(&au[0], au.size(), (long long)i * 1500, ts);
+    }
+    double ms = (NowMs() - t0) / (opt.iterations * 10);
+    printf("  mux %d byte access units: %7.4f ms each, %7.2f MB/s, %4.1f%% TS overhead\n", (int)au.size(), ms,
+        au.size() / (ms * 1000.0), (ts.size() - au.size()) * 100.0 / au.size());
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+// Blocking loopback client reading a chunked HTTP response.
+class HttpTestClient
+{
+public:
+    HttpTestClient() : m_s(INVALID_SOCKET), m_pos(0), m_bChunked(false) {}
+    ~HttpTestClient() { Close(); }
+
+    // Sends a request; a non-zero receive buffer size makes a slow client.
+    bool Connect(int port, const char *szRequestLine, int receiveBuffer = 0)
+    {
+        m_s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (receiveBuffer)
+            setsockopt(m_s, SOL_SOCKET, SO_RCVBUF, (const char *)&receiveBuffer, sizeof(receiveBuffer));
+#if defined(_WIN32)
+        DWORD timeout = 5000;
+#else
+        timeval timeout = { 5, 0 };
+#endif
+        setsockopt(m_s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((unsigned short)port);
+        if (connect(m_s, (sockaddr *)&addr, sizeof(addr)) != 0)
+            return false;
+        std::string request = std::string(szRequestLine) + "\r\nHost: localhost\r\n\r\n";
+        return send(m_s, request.data(), (int)request.size(), 0) == (int)request.size();
+    }
+
+    void Close()
+    {
+        if (m_s != INVALID_SOCKET)
+            closesocket(m_s);
+        m_s = INVALID_SOCKET;
+    }
+
+    // Status code of the response, or -1.
+    int ReadStatus()
+    {
+        std::string header;
+        while (header.size() < 4 || header.compare(header.size() - 4, 4, "\r\n\r\n") != 0)
+        {
+            char c;
+            if (!Read(&c, 1))
+                return -1;
+            header += c;
+        }
+        m_bChunked = header.find("Transfer-Encoding: chunked") != std::string::npos;
+        return header.compare(0, 9, "HTTP/1.1 ") == 0 ? atoi(header.c_str() + 9) : -1;
+    }
+
+    // Reads the next chunk; false on a framing error, timeout or close. The
+    // last chunk is empty.
+    bool ReadChunk(std::vector<unsigned char> &aData)
+    {
+        std::string line;
+        char c = 0;
+        while (c != '\n')
+        {
+            if (!Read(&c, 1))
+                return false;
+            line += c;
+        }
+        char *pEnd;
+        unsigned long size = strtoul(line.c_str(), &pEnd, 16);
+        if (!m_bChunked || pEnd == line.c_str() || strcmp(pEnd, "\r\n") != 0)
+            return false;
+        aData.resize(size + 2);
+        if (!Read((char *)&aData[0], size + 2) || aData[size] != '\r' || aData[size + 1] != '\n')
+            return false;
+        aData.resize(size);
+        return true;
+    }
+
+    // Reads the rest of a response that ends when the server closes.
+    std::string ReadToClose()
+    {
+        std::string rest;
+        char c;
+        while (Read(&c, 1))
+        {
+            rest += c;
+        }
+        return rest;
+    }
+
+private:
+    bool Read(char *p, size_t size)
+    {
+        while (size)
+        {
+            if (m_pos == m_buffer.size())
+            {
+                char aBuffer[65536];
+                int n = recv(m_s, aBuffer, sizeof(aBuffer), 0);
+                if (n <= 0)
+                    return false;
+                m_buffer.assign(aBuffer, n);
+                m_pos = 0;
+            }
+            size_t n = std::min(size, m_buffer.size() - m_pos);
+            memcpy(p, m_buffer.data() + m_pos, n);
+            m_pos += n;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    SOCKET      m_s;
+    std::string m_buffer;
+    size_t      m_pos;
+    bool        m_bChunked;
+};
+
+// Test pieces carry their sequence number and keyframe flag; the rest is a
+// pattern derived from the sequence number.
+static std::vector<unsigned char> MakeHttpPiece(unsigned int seq, bool bKeyframe, size_t size)
+{
+    std::vector<unsigned char> piece(size);
+    memcpy(&piece[0], &seq, 4);
+    piece[4] = bKeyframe ? 1 : 0;
+    for (size_t i = 5; i < size; i++)
+    {
+        piece[i] = (unsigned char)(seq * 31 + i);
+    }
+    return piece;
+}
+
+static bool CheckHttpPiece(const std::vector<unsigned char> &piece, unsigned int *pSeq, bool *pbKeyframe)
+{
+    if (piece.size() < 5)
+        return false;
+    memcpy(pSeq, &piece[0], 4);
+    *pbKeyframe = piece[4] != 0;
+    return piece == MakeHttpPiece(*pSeq, *pbKeyframe, piece.size());
+}
+
+static void PublishHttpPiece(HttpStreamServer &server, int iStream, unsigned int seq, bool bKeyframe, size_t size)
+{
+    std::vector<unsigned char> piece = MakeHttpPiece(seq, bKeyframe, size);
+    server.Publish(iStream, &piece[0], piece.size(), bKeyframe);
+}
+
+// Events reach the server asynchronously; waits until pfnDone holds.
+template<class F>
+static bool WaitForHttpStats(HttpStreamServer &server, int iStream, F pfnDone)
+{
+    double fDeadlineMs = NowMs() + 5000;
+    HttpStreamStats stats;
+    while (NowMs() < fDeadlineMs)
+    {
+        if (server.GetStats(iStream, &stats) && pfnDone(stats))
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+struct ClientCountIs
+{
+    int nClients;
+    bool operator()(const HttpStreamStats &stats) const { return stats.nClients == nClients; }
+};
+
+static void CountJoin(void *pContext, int /*iStream*/)
+{
+    ++*(std::atomic<int> *)pContext;
+}
+
+static void MakeTestDocument(void *pContext, std::string *pBody)
+{
+    pBody->append((const char *)pContext);
+}
+
+static int VerifyHttpServer()
+{
+    int nFailures = 0;
+    std::atomic<int> nJoins(0);
+    HttpStreamServer server;
+    server.Start();
+    int pathPort = server.Listen(0, -1);
+    int streamPort = server.Listen(0, 1);
+    server.AddStream(0, CountJoin, &nJoins);
+    server.AddStream(1, CountJoin, &nJoins);
+    if (pathPort < 0 || streamPort < 0)
+    {
+        printf("  FAIL listen\n");
+        return 1;
+    }
+
+    // Requests the server must turn down.
+    const char *aszBad[] = { "GET /stream/7 HTTP/1.1", "GET /stream/ HTTP/1.1", "POST /stream/0 HTTP/1.1" };
+    const int aBadStatus[] = { 404, 404, 405 };
+    for (int i = 0; i < 3; i++)
+    {
+        HttpTestClient client;
+        int status = client.Connect(pathPort, aszBad[i]) ? client.ReadStatus() : -1;
+        if (status != aBadStatus[i])
+        {
+            printf("  FAIL \"%s\": status %d, expected %d\n", aszBad[i], status, aBadStatus[i]);
+            nFailures++;
+        }
+    }
+
+    // A client joining stream 0 by path starts at the first keyframe.
+    ClientCountIs oneClient = { 1 };
+    ClientCountIs noClient = { 0 };
+    {
+        HttpTestClient client;
+        if (!client.Connect(pathPort, "GET /stream/0?player=a HTTP/1.1") || client.ReadStatus() != 200
+            || !WaitForHttpStats(server, 0, oneClient))
+        {
+            printf("  FAIL joining /stream/0\n");
+            return nFailures + 1;
+        }
+        for (unsigned int seq = 0; seq < 10; seq++)
+        {
+            PublishHttpPiece(server, 0, seq, seq == 1, 100 + seq * 1000);
+        }
+        for (unsigned int expected = 1; expected < 10; expected++)
+        {
+            std::vector<unsigned char> piece;
+            unsigned int seq = 0;
+            bool bKeyframe = false;
+            if (!client.ReadChunk(piece) || !CheckHttpPiece(piece, &seq, &bKeyframe) || seq != expected)
+            {
+                printf("  FAIL /stream/0: piece %u arrived as %u (%d bytes)\n", expected, seq, (int)piece.size());
+                nFailures++;
+                break;
+            }
+        }
+    }
+    if (nJoins != 1)
+    {
+        printf("  FAIL %d join callbacks, expected 1\n", (int)nJoins);
+        nFailures++;
+    }
+
+    // A document is made again for every GET of its path, on any listener.
+    server.AddDocument("/status", "text/plain", MakeTestDocument, (void *)"first");
+    server.AddDocument("/status", "text/plain", MakeTestDocument, (void *)"all streams up");
+    const int anDocumentPorts[] = { pathPort, streamPort };
+    for (int i = 0; i < 2; i++)
+    {
+        HttpTestClient client;
+        int status = client.Connect(anDocumentPorts[i], "GET /status?x=1 HTTP/1.1") ? client.ReadStatus() : -1;
+        std::string body = status == 200 ? client.ReadToClose() : "";
+        if (body != "all streams up")
+        {
+            printf("  FAIL document on port %d: status %d, \"%s\"\n", anDocumentPorts[i], status, body.c_str());
+            nFailures++;
+        }
+    }
+
+    // Any path on a port bound to stream 1 gets stream 1.
+    {
+        HttpTestClient client;
+        std::vector<unsigned char> piece;
+        unsigned int seq = 0;
+        bool bKeyframe = false;
+        if (!client.Connect(streamPort, "GET / HTTP/1.1") || client.ReadStatus() != 200 || !WaitForHttpStats(server, 1, oneClient))
+        {
+            printf("  FAIL joining stream 1 by port\n");
+            nFailures++;
+        }
+        else
+        {
+            PublishHttpPiece(server, 1, 77, true, 5000);
+            if (!client.ReadChunk(piece) || !CheckHttpPiece(piece, &seq, &bKeyframe) || seq != 77)
+            {
+                printf("  FAIL stream 1 by port: got %u\n", seq);
+                nFailures++;
+            }
+        }
+    }
+
+    // A client that stops reading loses whole pieces and resumes at a
+    // keyframe; what it gets is intact and in order.
+    WaitForHttpStats(server, 0, noClient);
+    HttpTestClient slow;
+    if (!slow.Connect(pathPort, "GET /0.ts HTTP/1.1", 16384) || slow.ReadStatus() != 200 || !WaitForHttpStats(server, 0, oneClient))
+    {
+        printf("  FAIL joining /0.ts\n");
+        return nFailures + 1;
+    }
+    const unsigned int lastSeq = 620;
+    for (unsigned int seq = 100; seq <= lastSeq; seq++)
+    {
+        PublishHttpPiece(server, 0, seq, seq == 100 || seq == 600, 16384);
+    }
+    unsigned int prevSeq = 99;
+    int nGaps = 0;
+    while (prevSeq != lastSeq)
+    {
+        std::vector<unsigned char> piece;
+        unsigned int seq = 0;
+        bool bKeyframe = false;
+        if (!slow.ReadChunk(piece) || !CheckHttpPiece(piece, &seq, &bKeyframe) || seq <= prevSeq
+            || (seq != prevSeq + 1 && !bKeyframe))
+        {
+            printf("  FAIL slow client: piece %u (%d bytes) after %u\n", seq, (int)piece.size(), prevSeq);
+            nFailures++;
+            break;
+        }
+        nGaps += seq != prevSeq + 1;
+        prevSeq = seq;
+    }
+    HttpStreamStats stats;
+    server.GetStats(0, &stats);
+    if (!nGaps || !stats.nChunksDropped || nJoins != 4)
+    {
+        printf("  FAIL slow client: %d gaps, %llu dropped, %d joins\n", nGaps, stats.nChunksDropped, (int)nJoins);
+        nFailures++;
+    }
+
+    // Removing the stream ends the response.
+    server.RemoveStream(0);
+    std::vector<unsigned char> piece;
+    if (!slow.ReadChunk(piece) || !piece.empty())
+    {
+        printf("  FAIL no last chunk after RemoveStream\n");
+        nFailures++;
+    }
+    server.Stop();
+    return nFailures;
+}
+
+struct HttpFanoutReader
+{
+    HttpTestClient      client;
+    unsigned long long  nBytes;
+    bool                bOk;
+};
+
+static void ReadHttpFanout(HttpFanoutReader *pReader)
+{
+    std::vector<unsigned char> piece;
+    while (pReader->client.ReadChunk(piece) && !piece.empty())
+    {
+        pReader->nBytes += piece.size();
+    }
+}
+
+struct BytesSentAtLeast
+{
+    unsigned long long nBytes;
+    bool operator()(const HttpStreamStats &stats) const { return stats.nBytesSent >= nBytes; }
+};
+
+static int RunHttpServer(const Options &opt)
+{
+#if defined(_WIN32)
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    int nFailures = VerifyHttpServer();
+    printf("HTTP loopback: %s\n", nFailures ? "FAILED" : "passed");
+
+    HttpStreamServer server;
+    server.Start();
+    int port = server.Listen(0, -1);
+    server.AddStream(0);
+
+    // Latency of one small piece from Publish to the client.
+    {
+        HttpTestClient client;
+        ClientCountIs oneClient = { 1 };
+        client.Connect(port, "GET /stream/0 HTTP/1.1");
+        client.ReadStatus();
+        WaitForHttpStats(server, 0, oneClient);
+        std::vector<double> aLatencyMs;
+        std::vector<unsigned char> piece;
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            double t0 = NowMs();
+            PublishHttpPiece(server, 0, i, true, 1000);
+            if (!client.ReadChunk(piece))
+                break;
+            aLatencyMs.push_back(NowMs() - t0);
+        }
+        std::sort(aLatencyMs.begin(), aLatencyMs.end());
+        if (!aLatencyMs.empty())
+            printf("  publish to client: median %.3f ms, max %.3f ms\n", aLatencyMs[aLatencyMs.size() / 2], aLatencyMs.back());
+    }
+
+    // Fan-out of 64 KB pieces to several readers, publishing no further than
+    // 1 MB ahead of what has been sent so nothing is dropped.
+    ClientCountIs noClient = { 0 };
+    WaitForHttpStats(server, 0, noClient);
+    const int aReaders[] = { 1, 4, 16 };
+    for (int r = 0; r < 3; r++)
+    {
+        int nReaders = aReaders[r];
+        std::vector<HttpFanoutReader *> aReader;
+        std::vector<std::thread> aThreads;
+        for (int i = 0; i < nReaders; i++)
+        {
+            aReader.push_back(new HttpFanoutReader());
+            aReader[i]->nBytes = 0;
+            aReader[i]->client.Connect(port, "GET /stream/0 HTTP/1.1");
+            aReader[i]->client.ReadStatus();
+        }
+        ClientCountIs allClients = { nReaders };
+        WaitForHttpStats(server, 0, allClients);
+        HttpStreamStats before;
+        server.GetStats(0, &before);
+        for (int i = 0; i < nReaders; i++)
+        {
+            aThreads.push_back(std::thread(ReadHttpFanout, aReader[i]));
+        }
+
+        const size_t pieceSize = 65536;
+        const int nPieces = opt.iterations;
+        double t0 = NowMs();
+        for (int i = 0; i < nPieces; i++)
+        {
+            PublishHttpPiece(server, 0, i, i == 0, pieceSize);
+            BytesSentAtLeast caughtUp = { before.nBytesSent + ((unsigned long long)i * pieceSize - std::min((unsigned long long)i * pieceSize, 1048576ULL)) * nReaders };
+            WaitForHttpStats(server, 0, caughtUp);
+        }
+        BytesSentAtLeast allSent = { before.nBytesSent + (unsigned long long)nPieces * pieceSize * nReaders };
+        WaitForHttpStats(server, 0, allSent);
+        double ms = NowMs() - t0;
+
+        HttpStreamStats after;
+        server.GetStats(0, &after);
+
+        // Removing the stream ends the responses, so the readers finish.
+        server.RemoveStream(0);
+        for (int i = 0; i < nReaders; i++)
+        {
+            aThreads[i].join();
+        }
+        unsigned long long nReceived = 0;
+        for (int i = 0; i < nReaders; i++)
+        {
+            nReceived += aReader[i]->nBytes;
+            delete aReader[i];
+        }
+        printf("  %2d clients: %8.1f MB/s sent in total, %llu pieces dropped\n", nReaders,
+            (after.nBytesSent - before.nBytesSent) / (ms * 1000.0), after.nChunksDropped - before.nChunksDropped);
+        if (nReceived != (unsigned long long)nPieces * pieceSize * nReaders)
+        {
+            printf("  FAIL %d clients received %llu bytes\n", nReaders, nReceived);
+            nFailures++;
+        }
+        server.AddStream(0);
+    }
+    server.Stop();
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+// Reassembles access units from RFC 6184 packets, independently of
+// RtpPacketizer. NAL units come out with four byte start codes.
+class RtpDepacketizer
+{
+public:
+    RtpDepacketizer(size_t mtu)
+        : m_nErrors(0), m_nSingle(0), m_nStapA(0), m_nFuA(0), m_mtu(mtu), m_bHaveSequence(false), m_uSequence(0),
+          m_uTimestamp(0), m_bInFragment(false) {}
+
+    void Feed(const unsigned char *p, size_t size)
+    {
+        if (size <= RTP_HEADER_SIZE || size > m_mtu || (p[0] & 0xC0) != 0x80 || (p[1] & 0x7F) != RTP_PAYLOAD_TYPE_H264)
+        {
+            Error("bad packet");
+            return;
+        }
+        unsigned short uSequence = (unsigned short)((p[2] << 8) | p[3]);
+        unsigned int uTimestamp = ((unsigned int)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+        if (m_bHaveSequence && uSequence != (unsigned short)(m_uSequence + 1))
+            Error("sequence gap");
+        if (!m_au.empty() && uTimestamp != m_uTimestamp)
+            Error("timestamp changed inside an access unit");
+        m_bHaveSequence = true;
+        m_uSequence = uSequence;
+        m_uTimestamp = uTimestamp;
+
+        const unsigned char *pPayload = p + RTP_HEADER_SIZE;
+        size_t payloadSize = size - RTP_HEADER_SIZE;
+        int type = pPayload[0] & 0x1F;
+        if (type >= 1 && type <= 23)
+        {
+            AppendNal(pPayload, payloadSize);
+            m_nSingle++;
+        }
+        else if (type == 24)
+        {
+            for (size_t offset = 1; offset < payloadSize;)
+            {
+                size_t nalSize = offset + 2 <= payloadSize ? (pPayload[offset] << 8) | pPayload[offset + 1] : 0;
+                if (!nalSize || offset + 2 + nalSize > payloadSize)
+                {
+                    Error("bad STAP-A");
+                    break;
+                }
+                AppendNal(pPayload + offset + 2, nalSize);
+                offset += 2 + nalSize;
+            }
+            m_nStapA++;
+        }
+        else if (type == 28 && payloadSize > 2)
+        {
+            bool bStart = (pPayload[1] & 0x80) != 0;
+            bool bEnd = (pPayload[1] & 0x40) != 0;
+            if (bStart == m_bInFragment)
+                Error("FU-A start out of place");
+            if (bStart)
+            {
+                unsigned char header = (unsigned char)((pPayload[0] & 0xE0) | (pPayload[1] & 0x1F));
+                AppendNal(&header, 1);
+            }
+            m_au.insert(m_au.end(), pPayload + 2, pPayload + payloadSize);
+            m_bInFragment = !bEnd;
+            m_nFuA++;
+        }
+        else
+        {
+            Error("unexpected NAL type");
+        }
+
+        if (p[1] & 0x80)
+        {
+            if (m_bInFragment)
+                Error("access unit ends inside a FU-A");
+            m_aAccessUnits.push_back(m_au);
+            m_aTimestamps.push_back(uTimestamp);
+            m_au.clear();
+            m_bInFragment = false;
+        }
+    }
+
+    std::vector<std::vector<unsigned char> >    m_aAccessUnits;
+    std::vector<unsigned int>                   m_aTimestamps;
+    int                                         m_nErrors;
+    int                                         m_nSingle;
+    int                                         m_nStapA;
+    int                                         m_nFuA;
+
+private:
+    void AppendNal(const unsigned char *p, size_t size)
+    {
+        static const unsigned char aStartCode[] = { 0, 0, 0, 1 };
+        m_au.insert(m_au.end(), aStartCode, aStartCode + 4);
+        m_au.insert(m_au.end(), p, p + size);
+    }
+
+    void Error(const char *szWhat)
+    {
+        if (!m_nErrors)
+            printf("  RTP depacketizer: %s\n", szWhat);
+        m_nErrors++;
+    }
+
+    size_t                      m_mtu;
+    bool                        m_bHaveSequence;
+    unsigned short              m_uSequence;
+    unsigned int                m_uTimestamp;
+    bool                        m_bInFragment;
+    std::vector<unsigned char>  m_au;
+};
+
+// An Annex-B access unit with four byte start codes and NAL units of the
+// given sizes; the first byte of each is a NAL header.
+static std::vector<unsigned char> MakeRtpTestAccessUnit(const std::vector<size_t> &aNalSizes)
+{
+    std::vector<unsigned char> au;
+    for (size_t i = 0; i < aNalSizes.size(); i++)
+    {
+        size_t start = au.size();
+        au.resize(start + 4 + aNalSizes[i]);
+        au[start + 3] = 1;
+        FillRandom(&au[start + 4], aNalSizes[i]);
+        for (size_t j = start + 4; j < au.size(); j++)
+            au[j] |= 0x80;
+        au[start + 4] = (unsigned char)(((i * 0x20) & 0x60) | (1 + i % 23));
+    }
+    return au;
+}
+
+static std::vector<std::vector<size_t> > MakeRtpTestNalSizes(size_t mtu)
+{
+    size_t maxPayload = mtu - RTP_HEADER_SIZE;
+    size_t maxFragment = maxPayload - 2;
+    std::vector<std::vector<size_t> > aAccessUnits;
+    size_t aSizes[][6] =
+    {
+        { 2, 12, 4, 30, 500, 0 },                           // AUD, SPS, PPS, SEI, slice
+        { 1, 1, 1, 0 },
+        { maxPayload, 0 },                                  // largest single NAL unit
+        { maxPayload + 1, 0 },                              // smallest FU-A
+        { 1 + 2 * maxFragment, 1 + 2 * maxFragment + 1, 0 },
+        { 100, maxPayload - 1 - 2 - 2 - 100, 7, 0 },        // a STAP-A filled exactly
+        { 100, maxPayload - 1 - 2 - 2 - 100 + 1, 7, 0 },    // one byte too many
+        { 65535, 65536, 3, 0 },
+        { 200000, 0 },
+    };
+    for (size_t i = 0; i < sizeof(aSizes) / sizeof(aSizes[0]); i++)
+    {
+        std::vector<size_t> au;
+        for (size_t j = 0; aSizes[i][j]; j++)
+            au.push_back(aSizes[i][j]);
+        aAccessUnits.push_back(au);
+    }
+    for (size_t i = 0; i < 40; i++)
+    {
+        std::vector<size_t> au;
+        for (size_t j = 0; j <= i % 7; j++)
+            au.push_back(1 + (i * 7919 + j * 104729) % (i % 3 ? 4 * mtu : mtu / 3));
+        aAccessUnits.push_back(au);
+    }
+    return aAccessUnits;
+}
+
+static int VerifyRtpPacketizer(size_t mtu)
+{
+    std::vector<std::vector<size_t> > aNalSizes = MakeRtpTestNalSizes(mtu);
+    RtpPacketizer packetizer(0x12345678, RTP_PAYLOAD_TYPE_H264, mtu);
+    RtpDepacketizer depacketizer(mtu);
+    std::vector<std::vector<unsigned char> > aAccessUnits;
+    RtpPacketList packets;
+    int nFailures = 0;
+    for (size_t i = 0; i < aNalSizes.size(); i++)
+    {
+        aAccessUnits.push_back(MakeRtpTestAccessUnit(aNalSizes[i]));
+        packets.Clear();
+        packetizer.PacketizeAccessUnit(&aAccessUnits[i][0], aAccessUnits[i].size(), (unsigned int)(i * 1500 + 0xFFFF0000), packets);
+        for (size_t j = 0; j < packets.GetCount(); j++)
+        {
+            size_t size;
+            const unsigned char *p = packets.GetPacket(j, &size);
+            if (((p[1] & 0x80) != 0) != (j + 1 == packets.GetCount()))
+            {
+                printf("  FAIL MTU %d access unit %d: marker on packet %d of %d\n", (int)mtu, (int)i, (int)j, (int)packets.GetCount());
+                nFailures++;
+            }
+            depacketizer.Feed(p, size);
+        }
+    }
+
+    nFailures += depacketizer.m_nErrors ? 1 : 0;
+    if (depacketizer.m_aAccessUnits.size() != aAccessUnits.size() || !depacketizer.m_nSingle || !depacketizer.m_nStapA
+        || !depacketizer.m_nFuA)
+    {
+        printf("  FAIL MTU %d: %d access units for %d; %d single, %d STAP-A, %d FU-A packets\n", (int)mtu,
+            (int)depacketizer.m_aAccessUnits.size(), (int)aAccessUnits.size(), depacketizer.m_nSingle,
+            depacketizer.m_nStapA, depacketizer.m_nFuA);
+        return nFailures + 1;
+    }
+    for (size_t i = 0; i < aAccessUnits.size(); i++)
+    {
+        if (depacketizer.m_aAccessUnits[i] != aAccessUnits[i] || depacketizer.m_aTimestamps[i] != (unsigned int)(i * 1500 + 0xFFFF0000))
+        {
+            printf("  FAIL MTU %d access unit %d differs after reassembly\n", (int)mtu, (int)i);
+            nFailures++;
+        }
+    }
+    return nFailures;
+}
+
+// Sends access units to a socket on the loopback interface and reassembles
+// what arrives.
+static int VerifyRtpLoopback()
+{
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int receiveBuffer = 4 << 20;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char *)&receiveBuffer, sizeof(receiveBuffer));
+#if defined(_WIN32)
+    DWORD timeout = 2000;
+#else
+    timeval timeout = { 2, 0 };
+#endif
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrSize = sizeof(addr);
+    bind(s, (sockaddr *)&addr, sizeof(addr));
+    getsockname(s, (sockaddr *)&addr, &addrSize);
+
+    RtpSender sender;
+    if (!sender.Open("127.0.0.1", ntohs(addr.sin_port)))
+    {
+        closesocket(s);
+        printf("  FAIL RTP sender cannot open\n");
+        return 1;
+    }
+
+    RtpPacketizer packetizer(1, RTP_PAYLOAD_TYPE_H264, RTP_DEFAULT_MTU);
+    RtpDepacketizer depacketizer(RTP_DEFAULT_MTU);
+    std::vector<std::vector<size_t> > aNalSizes = MakeRtpTestNalSizes(RTP_DEFAULT_MTU);
+    std::vector<std::vector<unsigned char> > aAccessUnits;
+    RtpPacketList packets;
+    int nFailures = 0;
+    std::vector<unsigned char> buffer(65536);
+    for (size_t i = 0; i < aNalSizes.size() && !nFailures; i++)
+    {
+        aAccessUnits.push_back(MakeRtpTestAccessUnit(aNalSizes[i]));
+        packets.Clear();
+        packetizer.PacketizeAccessUnit(&aAccessUnits[i][0], aAccessUnits[i].size(), (unsigned int)i * 3000, packets);
+        if (sender.Send(packets) != packets.GetCount())
+        {
+            printf("  FAIL RTP send\n");
+            nFailures++;
+        }
+        for (size_t j = 0; j < packets.GetCount(); j++)
+        {
+            int n = recv(s, (char *)&buffer[0], (int)buffer.size(), 0);
+            if (n <= 0)
+            {
+                printf("  FAIL access unit %d: packet %d of %d lost on loopback\n", (int)i, (int)j, (int)packets.GetCount());
+                nFailures++;
+                break;
+            }
+            depacketizer.Feed(&buffer[0], n);
+        }
+    }
+    closesocket(s);
+
+    if (!nFailures && (depacketizer.m_nErrors || depacketizer.m_aAccessUnits != aAccessUnits))
+    {
+        printf("  FAIL access units differ after the loopback\n");
+        nFailures++;
+    }
+    return nFailures;
+}
+
+static int RunRtpPacketizer(const Options &opt)
+{
+#if defined(_WIN32)
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    int nFailures = VerifyRtpPacketizer(RTP_DEFAULT_MTU) + VerifyRtpPacketizer(200);
+    printf("RTP round trip: %s\n", nFailures ? "FAILED" : "passed");
+    int nLoopbackFailures = VerifyRtpLoopback();
+    printf("RTP loopback: %s\n", nLoopbackFailures ? "FAILED" : "passed");
+    nFailures += nLoopbackFailures;
+
+    // A 20 Mbps, 60 fps access unit of 1200 byte slices.
+    std::vector<size_t> aSlices(20000000 / 8 / 60 / 1200, 1180);
+    aSlices.insert(aSlices.begin(), 2);
+    std::vector<unsigned char> au = MakeRtpTestAccessUnit(aSlices);
+    RtpPacketizer packetizer(1);
+    RtpPacketList packets;
+    double t0 = NowMs();
+    for (int i = 0; i < opt.iterations * 10; i++)
+    {
+        packets.Clear();
+        packetizer.PacketizeAccessUnit(&au[0], au.size(), i * 1500, packets);
+    }
+    double ms = (NowMs() - t0) / (opt.iterations * 10);
+    printf("  packetize %d byte access units: %7.4f ms each, %7.2f MB/s, %d packets\n", (int)au.size(), ms,
+        au.size() / (ms * 1000.0), (int)packets.GetCount());
+
+    // Cost of sending, batched against one packet per call. Nobody reads the
+    // receiving socket, so loopback drops what does not fit.
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrSize = sizeof(addr);
+    bind(s, (sockaddr *)&addr, sizeof(addr));
+    getsockname(s, (sockaddr *)&addr, &addrSize);
+    RtpSender sender;
+    sender.Open("127.0.0.1", ntohs(addr.sin_port));
+    SOCKET single = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    connect(single, (sockaddr *)&addr, sizeof(addr));
+
+    int nRounds = opt.iterations;
+    t0 = NowMs();
+    for (int i = 0; i < nRounds; i++)
+    {
+        sender.Send(packets);
+    }
+    double batchedMs = NowMs() - t0;
+    t0 = NowMs();
+    for (int i = 0; i < nRounds; i++)
+    {
+        for (size_t j = 0; j < packets.GetCount(); j++)
+        {
+            size_t size;
+            const unsigned char *p = packets.GetPacket(j, &size);
+            send(single, (const char *)p, (int)size, 0);
+        }
+    }
+    double singleMs = NowMs() - t0;
+    double nPackets = (double)nRounds * packets.GetCount();
+    printf("  send: RtpSender %8.0f packets/s, one send per packet %8.0f packets/s\n", nPackets / batchedMs * 1000,
+        nPackets / singleMs * 1000);
+    closesocket(single);
+    closesocket(s);
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Annex-B start code search and the parameter set cache
+
+// Mostly zeros and ones, so start codes and near misses are everywhere.
+static void FillStartCodeNoise(unsigned char *p, size_t size)
+{
+    FillRandom(p, size);
+    for (size_t i = 0; i < size; i++)
+    {
+        p[i] = p[i] < 160 ? 0 : p[i] < 200 ? 1 : p[i];
+    }
+}
+
+static int VerifyNalFindStartCode()
+{
+    int nFailures = 0;
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (NalSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+
+        // A single start code at every position of every size, in zeros and
+        // in non-zero bytes; then noise, searched from every offset.
+        for (size_t size = 0; size <= 100 && !nFailures; size++)
+        for (int fill = 0; fill < 2; fill++)
+        for (size_t at = 0; at <= size; at++)
+        {
+            std::vector<unsigned char> buffer(size + 1, fill ? 0x55 : 0);
+            if (at + 3 <= size)
+            {
+                buffer[at] = 0;
+                buffer[at + 1] = 0;
+                buffer[at + 2] = 1;
+            }
+            if (NalFindStartCode(&buffer[0], size) != NalFindStartCode_C(&buffer[0], size))
+            {
+                printf("  FAIL start code %s size %d at %d\n", GetSimdLevelName(s_aLevels[l]), (int)size, (int)at);
+                nFailures++;
+                break;
+            }
+        }
+        for (int round = 0; round < 200 && !nFailures; round++)
+        {
+            std::vector<unsigned char> buffer(1 + round * 7);
+            FillStartCodeNoise(&buffer[0], buffer.size());
+            for (size_t offset = 0; offset < buffer.size(); offset++)
+            {
+                if (NalFindStartCode(&buffer[offset], buffer.size() - offset) != NalFindStartCode_C(&buffer[offset], buffer.size() - offset))
+                {
+                    printf("  FAIL start code %s noise size %d offset %d\n", GetSimdLevelName(s_aLevels[l]), (int)buffer.size(), (int)offset);
+                    nFailures++;
+                    break;
+                }
+            }
+        }
+    }
+    NalSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+// NAL units with 3 and 4 byte start codes, trailing zeros and empty units must
+// come out as the payloads that went in.
+static int VerifyNalScanner()
+{
+    int nFailures = 0;
+    for (int round = 0; round < 500; round++)
+    {
+        std::vector<std::vector<unsigned char> > aNals(1 + round % 9);
+        std::vector<unsigned char> stream;
+        for (size_t i = 0; i < aNals.size(); i++)
+        {
+            aNals[i].resize(1 + (s_uRandState >> 8) % (round % 3 ? 40 : 3000));
+            FillRandom(&aNals[i][0], aNals[i].size());
+            for (size_t j = 0; j < aNals[i].size(); j++)
+            {
+                aNals[i][j] |= 0x02;    // no emulation issues
+            }
+            unsigned char choice = aNals[i][0];
+            if (choice & 0x10)
+                stream.insert(stream.end(), (choice >> 5) & 3, 0);         // trailing zeros of the previous unit
+            if (choice & 0x01)
+                stream.push_back(0);
+            static const unsigned char aStartCode[] = { 0, 0, 1 };
+            stream.insert(stream.end(), aStartCode, aStartCode + 3);
+            if (choice & 0x04)
+                stream.insert(stream.end(), aStartCode, aStartCode + 3);   // empty unit
+            stream.insert(stream.end(), aNals[i].begin(), aNals[i].end());
+        }
+
+        NalScanner scanner(&stream[0], stream.size());
+        const unsigned char *pNal;
+        size_t nalSize;
+        size_t n = 0;
+        bool bOk = true;
+        while (scanner.Next(&pNal, &nalSize))
+        {
+            bOk = bOk && n < aNals.size() && nalSize == aNals[n].size() && memcmp(pNal, &aNals[n][0], nalSize) == 0;
+            n++;
+        }
+        if (!bOk || n != aNals.size())
+        {
+            printf("  FAIL NAL scanner round %d: %d of %d units\n", round, (int)n, (int)aNals.size());
+            nFailures++;
+        }
+    }
+    return nFailures;
+}
+
+static void AppendNal(std::vector<unsigned char> &stream, unsigned char header0, unsigned char header1, size_t size)
+{
+    static const unsigned char aStartCode[] = { 0, 0, 0, 1 };
+    stream.insert(stream.end(), aStartCode, aStartCode + 4);
+    stream.push_back(header0);
+    stream.push_back(header1);
+    stream.insert(stream.end(), size, (unsigned char)(header0 ^ header1 ^ 0x80));
+}
+
+// Feeds access units through a raw file output and compares what comes out.
+static int VerifyParameterSetCache(bool bHevc)
+{
+    const char *szName = bHevc ? "HEVC" : "H.264";
+    // NAL header bytes: AUD, parameter sets and a keyframe slice, then a
+    // non-keyframe slice.
+    unsigned char aud = bHevc ? 35 << 1 : 9;
+    unsigned char aParamTypes[3] = { 32, 33, 34 };
+    size_t nParamTypes = bHevc ? 3 : 2;
+    if (!bHevc)
+    {
+        aParamTypes[0] = 0x67;
+        aParamTypes[1] = 0x68;
+    }
+    unsigned char keyframe = bHevc ? 19 << 1 : 0x65;
+    unsigned char slice = bHevc ? 1 << 1 : 0x41;
+    unsigned char second = bHevc ? 1 : 0x11;
+
+    std::vector<unsigned char> encoderParams, streamParams, audKeyframe, keyframeOnly, pFrame, withParams;
+    for (size_t i = 0; i < nParamTypes; i++)
+    {
+        AppendNal(encoderParams, bHevc ? (unsigned char)(aParamTypes[i] << 1) : aParamTypes[i], second, 10 + i);
+        AppendNal(streamParams, bHevc ? (unsigned char)(aParamTypes[i] << 1) : aParamTypes[i], second, 20 + i);
+    }
+    AppendNal(audKeyframe, aud, second, 1);
+    AppendNal(audKeyframe, keyframe, second, 500);
+    AppendNal(keyframeOnly, keyframe, second, 300);
+    AppendNal(pFrame, slice, second, 100);
+    withParams = streamParams;
+    withParams.insert(withParams.end(), keyframeOnly.begin(), keyframeOnly.end());
+
+    // A PPS update alone, with a P frame and then with a keyframe, replaces
+    // the cached PPS and keeps the SPS (and VPS).
+    unsigned char pps = bHevc ? (unsigned char)(aParamTypes[nParamTypes - 1] << 1) : aParamTypes[nParamTypes - 1];
+    std::vector<unsigned char> newPps, newerPps, ppsPFrame, ppsKeyframe;
+    AppendNal(newPps, pps, second, 30);
+    AppendNal(newerPps, pps, second, 40);
+    ppsPFrame = newPps;
+    ppsPFrame.insert(ppsPFrame.end(), pFrame.begin(), pFrame.end());
+    ppsKeyframe = newerPps;
+    ppsKeyframe.insert(ppsKeyframe.end(), keyframeOnly.begin(), keyframeOnly.end());
+    std::vector<unsigned char> streamSps(streamParams.begin(), streamParams.end() - (4 + 2 + 20 + (nParamTypes - 1)));
+
+    // The expected output: the encoder's sets after the AUD, nothing added
+    // to a P frame or to a keyframe with its own sets, which then replace
+    // the cache for the next keyframe.
+    std::vector<unsigned char> expected(audKeyframe.begin(), audKeyframe.begin() + 7);
+    expected.insert(expected.end(), encoderParams.begin(), encoderParams.end());
+    expected.insert(expected.end(), audKeyframe.begin() + 7, audKeyframe.end());
+    expected.insert(expected.end(), pFrame.begin(), pFrame.end());
+    expected.insert(expected.end(), withParams.begin(), withParams.end());
+    expected.insert(expected.end(), streamParams.begin(), streamParams.end());
+    expected.insert(expected.end(), keyframeOnly.begin(), keyframeOnly.end());
+    expected.insert(expected.end(), ppsPFrame.begin(), ppsPFrame.end());
+    expected.insert(expected.end(), streamSps.begin(), streamSps.end());
+    expected.insert(expected.end(), newPps.begin(), newPps.end());
+    expected.insert(expected.end(), keyframeOnly.begin(), keyframeOnly.end());
+    expected.insert(expected.end(), streamSps.begin(), streamSps.end());
+    expected.insert(expected.end(), ppsKeyframe.begin(), ppsKeyframe.end());
+
+    FILE *fOutput = tmpfile();
+    if (!fOutput)
+    {
+        printf("  FAIL %s tmpfile\n", szName);
+        return 1;
+    }
+    BitstreamOutput output(fOutput, true, bHevc ? TS_STREAM_HEVC : TS_STREAM_H264);
+    output.SetParameterSets(&encoderParams[0], encoderParams.size());
+    output.WriteAccessUnit(&audKeyframe[0], audKeyframe.size(), 0);
+    output.WriteAccessUnit(&pFrame[0], pFrame.size(), 1);
+    output.WriteAccessUnit(&withParams[0], withParams.size(), 2);
+    output.WriteAccessUnit(&keyframeOnly[0], keyframeOnly.size(), 3);
+    output.WriteAccessUnit(&ppsPFrame[0], ppsPFrame.size(), 4);
+    output.WriteAccessUnit(&keyframeOnly[0], keyframeOnly.size(), 5);
+    output.WriteAccessUnit(&ppsKeyframe[0], ppsKeyframe.size(), 6);
+
+    fflush(fOutput);
+    std::vector<unsigned char> written(expected.size() + 1);
+    rewind(fOutput);
+    written.resize(fread(&written[0], 1, written.size(), fOutput));
+    if (written != expected)
+    {
+        printf("  FAIL %s parameter sets: %d bytes written, %d expected\n", szName, (int)written.size(), (int)expected.size());
+        return 1;
+    }
+    return 0;
+}
+
+// A viewer joining over HTTP turns into one keyframe request, and none once
+// the output is gone.
+static int VerifyJoinKeyframeRequest()
+{
+    int nFailures = 0;
+    HttpStreamServer server;
+    server.Start();
+    int port = server.Listen(0, 0);
+    BitstreamOutput *pOutput = new BitstreamOutput(&server, 0, TS_STREAM_H264);
+    server.AddStream(0, BitstreamOutput::OnViewerJoin, pOutput);
+
+    ClientCountIs oneClient = { 1 };
+    HttpTestClient client;
+    if (pOutput->TakeKeyframeRequest() || !client.Connect(port, "GET / HTTP/1.1") || client.ReadStatus() != 200
+        || !WaitForHttpStats(server, 0, oneClient))
+    {
+        printf("  FAIL join: no viewer\n");
+        nFailures++;
+    }
+    else if (!pOutput->TakeKeyframeRequest() || pOutput->TakeKeyframeRequest())
+    {
+        printf("  FAIL join: expected exactly one keyframe request\n");
+        nFailures++;
+    }
+
+    // RemoveStream returns only once the server is done with the stream.
+    delete pOutput;
+    HttpTestClient late;
+    if (late.Connect(port, "GET / HTTP/1.1") && late.ReadStatus() == 200)
+    {
+        printf("  FAIL join: stream still served after its output closed\n");
+        nFailures++;
+    }
+    server.Stop();
+    return nFailures;
+}
+
+static int RunNalScanner(const Options &opt)
+{
+#if defined(_WIN32)
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    int nFailures = VerifyNalFindStartCode() + VerifyNalScanner();
+    printf("Start code search: %s\n", nFailures ? "FAILED" : "passed");
+    int nCacheFailures = VerifyParameterSetCache(false) + VerifyParameterSetCache(true) + VerifyJoinKeyframeRequest();
+    printf("Parameter set cache and join keyframe: %s\n", nCacheFailures ? "FAILED" : "passed");
+    nFailures += nCacheFailures;
+
+    // Slice data is noise with emulation prevention, so the search runs to the
+    // end of the access unit.
+    std::vector<unsigned char> au((size_t)opt.width * opt.height / 8);
+    FillRandom(&au[0], au.size());
+    for (size_t i = 2; i < au.size(); i++)
+    {
+        if (au[i - 2] == 0 && au[i - 1] == 0 && au[i] <= 3)
+            au[i] = 0x03;
+    }
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (NalSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+        double t0 = NowMs();
+        size_t found = 0;
+        for (int i = 0; i < opt.iterations * 10; i++)
+        {
+            found += NalFindStartCode(&au[0], au.size());
+        }
+        double ms = (NowMs() - t0) / (opt.iterations * 10);
+        printf("  %-6s scan %d bytes: %7.4f ms, %8.1f MB/s%s\n", GetSimdLevelName(s_aLevels[l]), (int)au.size(), ms,
+            au.size() / (ms * 1000.0), found == au.size() * opt.iterations * 10 ? "" : " (found a start code)");
+    }
+    NalSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Player activity channel
+
+// Every field of report n is derived from n, so a reader can tell a torn
+// snapshot from a consistent one.
+static void ReportActivityPattern(PlayerActivitySlot *pSlot, uint32_t n)
+{
+    PlayerActivityReport(pSlot, (PlayerActivityState)(1 + n % 3), 1000000 + (uint64_t)n * 1000);
+}
+
+static bool IsActivityPattern(const PlayerActivitySnapshot &snapshot)
+{
+    if (snapshot.uUpdateUs < 1000000 || (snapshot.uUpdateUs - 1000000) % 1000)
+        return false;
+    uint32_t n = (uint32_t)((snapshot.uUpdateUs - 1000000) / 1000);
+    // The last input and shot are the latest reports of those states.
+    uint32_t lastInput = n % 3 ? n : n - 1;
+    uint32_t lastShot = n - (n + 1) % 3;
+    return snapshot.eState == (PlayerActivityState)(1 + n % 3)
+        && (n < 1 || snapshot.uLastInputUs == 1000000 + (uint64_t)lastInput * 1000)
+        && (n < 2 || snapshot.uLastShotUs == 1000000 + (uint64_t)lastShot * 1000);
+}
+
+struct ActivityWriterRun
+{
+    PlayerActivitySlot     *pSlot;
+    uint32_t                nReports;
+    std::atomic<bool>       bDone;
+};
+
+static void WriteActivity(ActivityWriterRun *pRun)
+{
+    for (uint32_t n = 0; n < pRun->nReports; n++)
+    {
+        ReportActivityPattern(pRun->pSlot, n);
+    }
+    pRun->bDone = true;
+}
+
+static int VerifyPlayerActivity()
+{
+    int nFailures = 0;
+    if (sizeof(PlayerActivitySlot) != 64)
+    {
+        printf("  FAIL slot is %d bytes, not one cache line\n", (int)sizeof(PlayerActivitySlot));
+        nFailures++;
+    }
+
+    // The table follows a BOOL in AppParam; its slots still start lines.
+    struct { int bFlag; PlayerActivityTable table; } appParam;
+    for (int i = 0; i < PLAYER_ACTIVITY_MAX_PLAYERS; i++)
+    {
+        if ((uintptr_t)&appParam.table.aSlots[i] % PLAYER_ACTIVITY_CACHE_LINE)
+        {
+            printf("  FAIL slot %d is not aligned to a cache line\n", i);
+            nFailures++;
+            break;
+        }
+    }
+
+    // The legacy files, as the old input logger wrote them.
+    static const struct { const char *szContent; bool bOk; PlayerActivityState eState; } s_aLegacy[] =
+    {
+        { "3", true, PLAYER_ACTIVITY_SHOOTING },
+        { "1\n2\n", true, PLAYER_ACTIVITY_INPUT },
+        { "3\r\n2\r\n1\r\n", true, PLAYER_ACTIVITY_IDLE },
+        { "1\n2\n1\n2\n1\n2\n1\n2\n1\n2\n3\n", true, PLAYER_ACTIVITY_SHOOTING },
+        { "", false, PLAYER_ACTIVITY_NONE },
+        { "\n\n", false, PLAYER_ACTIVITY_NONE },
+        { "2\n0\n", false, PLAYER_ACTIVITY_NONE },
+        { "2\n13\n", false, PLAYER_ACTIVITY_NONE },
+        { "2\nx\n", false, PLAYER_ACTIVITY_NONE },
+    };
+    char szLegacyFile[64];
+    sprintf(szLegacyFile, "perfshim_legacy_%u.txt", (unsigned int)(NowMs() * 1000));
+    for (int i = 0; i < (int)(sizeof(s_aLegacy) / sizeof(s_aLegacy[0])); i++)
+    {
+        FILE *f = fopen(szLegacyFile, "wb");
+        if (!f)
+            break;
+        fputs(s_aLegacy[i].szContent, f);
+        fclose(f);
+        PlayerActivityState eState = PLAYER_ACTIVITY_NONE;
+        bool bOk = PlayerActivityReadLegacyFile(szLegacyFile, &eState);
+        if (bOk != s_aLegacy[i].bOk || eState != s_aLegacy[i].eState)
+        {
+            printf("  FAIL legacy file %d: %s state %d\n", i, bOk ? "read" : "not read", (int)eState);
+            nFailures++;
+        }
+    }
+
+    // The file is read again only after PLAYER_ACTIVITY_LEGACY_POLL_US; in
+    // between the slot keeps the last state.
+    PlayerActivitySlot legacySlot;
+    memset((void *)&legacySlot, 0, sizeof(legacySlot));
+    uint64_t uNextPollUs = 0;
+    static const struct { const char *szContent; uint64_t uNowUs; bool bRead; PlayerActivityState eState; } s_aPolls[] =
+    {
+        { "2\n", 1000000, true, PLAYER_ACTIVITY_INPUT },
+        { "3\n", 1000000 + PLAYER_ACTIVITY_LEGACY_POLL_US - 1, false, PLAYER_ACTIVITY_INPUT },
+        { "3\n", 1000000 + PLAYER_ACTIVITY_LEGACY_POLL_US, true, PLAYER_ACTIVITY_SHOOTING },
+        { "1\n", 1000000 + PLAYER_ACTIVITY_LEGACY_POLL_US + 1, false, PLAYER_ACTIVITY_SHOOTING },
+    };
+    for (int i = 0; i < (int)(sizeof(s_aPolls) / sizeof(s_aPolls[0])); i++)
+    {
+        FILE *f = fopen(szLegacyFile, "wb");
+        if (!f)
+            break;
+        fputs(s_aPolls[i].szContent, f);
+        fclose(f);
+        bool bRead = PlayerActivityPollLegacyFile(szLegacyFile, &legacySlot, &uNextPollUs, s_aPolls[i].uNowUs);
+        PlayerActivitySnapshot legacy;
+        if (bRead != s_aPolls[i].bRead || !PlayerActivityRead(&legacySlot, &legacy) || legacy.eState != s_aPolls[i].eState)
+        {
+            printf("  FAIL legacy poll %d: %s, state %d\n", i, bRead ? "read" : "not read", (int)legacy.eState);
+            nFailures++;
+        }
+    }
+    remove(szLegacyFile);
+    PlayerActivityState eMissing;
+    if (PlayerActivityReadLegacyFile(szLegacyFile, &eMissing))
+    {
+        printf("  FAIL missing legacy file read\n");
+        nFailures++;
+    }
+
+    // Two views of one named mapping, as the daemon and the encoder have.
+    char szName[64];
+    sprintf(szName, "PerfShimActivity_%u", (unsigned int)(NowMs() * 1000));
+    PlayerActivityMapping daemon, encoder;
+    if (!daemon.Create(szName) || !encoder.Open(szName) || daemon.GetTable() == encoder.GetTable())
+    {
+        printf("  FAIL shared mapping %s\n", szName);
+        return nFailures + 1;
+    }
+    PlayerActivitySnapshot snapshot;
+    PlayerActivitySlot *pWriter = &daemon.GetTable()->aSlots[1];
+    const PlayerActivitySlot *pReader = &encoder.GetTable()->aSlots[1];
+    if (!PlayerActivityRead(pReader, &snapshot) || snapshot.uSequence != 0 || snapshot.eState != PLAYER_ACTIVITY_NONE)
+    {
+        printf("  FAIL new slot is not empty\n");
+        nFailures++;
+    }
+
+    // Shooting holds for PLAYER_ACTIVITY_SHOT_HOLD_US, then the state shows.
+    PlayerActivityReport(pWriter, PLAYER_ACTIVITY_SHOOTING, 5000000);
+    PlayerActivityReport(pWriter, PLAYER_ACTIVITY_IDLE, 6000000);
+    bool bOk = PlayerActivityRead(pReader, &snapshot) && snapshot.uSequence == 4 && snapshot.uLastInputUs == 5000000
+        && PlayerActivityEffectiveState(snapshot, 6000000) == PLAYER_ACTIVITY_SHOOTING
+        && PlayerActivityEffectiveState(snapshot, 5000000 + PLAYER_ACTIVITY_SHOT_HOLD_US) == PLAYER_ACTIVITY_IDLE;
+    if (!bOk)
+    {
+        printf("  FAIL shot hold\n");
+        nFailures++;
+    }
+
+    // A writer that died mid-update leaves the sequence odd; reads give up.
+    pWriter->uSequence.store(pWriter->uSequence.load() + 1);
+    if (PlayerActivityRead(pReader, &snapshot))
+    {
+        printf("  FAIL read during an update\n");
+        nFailures++;
+    }
+    pWriter->uSequence.store(0);
+
+    // A writer thread hammers the slot; no snapshot may mix two reports.
+    ActivityWriterRun run;
+    run.pSlot = pWriter;
+    run.nReports = 2000000;
+    run.bDone = false;
+    std::thread writer(WriteActivity, &run);
+    unsigned int nReads = 0, nGaveUp = 0, nTorn = 0;
+    while (!run.bDone)
+    {
+        if (!PlayerActivityRead(pReader, &snapshot))
+            nGaveUp++;
+        else if (snapshot.uSequence && !IsActivityPattern(snapshot))
+            nTorn++;
+        nReads++;
+    }
+    writer.join();
+    if (nTorn || !PlayerActivityRead(pReader, &snapshot) || !IsActivityPattern(snapshot)
+        || snapshot.uUpdateUs != 1000000 + (uint64_t)(run.nReports - 1) * 1000)
+    {
+        printf("  FAIL %u of %u concurrent reads torn\n", nTorn, nReads);
+        nFailures++;
+    }
+    printf("  %u reads during %u reports, %u gave up\n", nReads, run.nReports, nGaveUp);
+    return nFailures;
+}
+
+static int RunPlayerActivity(const Options &opt)
+{
+    int nFailures = VerifyPlayerActivity();
+    printf("Player activity channel: %s\n", nFailures ? "FAILED" : "passed");
+
+    // One read per frame per player, against what it replaces: opening the
+    // player's text file, seeking to its end and reading one character.
+    static PlayerActivityTable s_table;
+    PlayerActivityTable *pTable = &s_table;
+    PlayerActivityReport(&pTable->aSlots[0], PLAYER_ACTIVITY_INPUT, PlayerActivityNowUs());
+    int nReads = opt.iterations * 10000;
+    int sum = 0;
+    double t0 = NowMs();
+    for (int i = 0; i < nReads; i++)
+    {
+        PlayerActivitySnapshot snapshot;
+        PlayerActivityRead(&pTable->aSlots[0], &snapshot);
+        sum += PlayerActivityEffectiveState(snapshot, PlayerActivityNowUs());
+    }
+    double readNs = (NowMs() - t0) * 1000000.0 / nReads;
+
+    char szFileName[64];
+    sprintf(szFileName, "perfshim_activity_%u.txt", (unsigned int)(NowMs() * 1000));
+    FILE *f = fopen(szFileName, "wb");
+    if (f)
+    {
+        fputs("1\n2\n", f);
+        fclose(f);
+    }
+    int nFileReads = opt.iterations * 50;
+    t0 = NowMs();
+    for (int i = 0; i < nFileReads && f; i++)
+    {
+        FILE *fIn = fopen(szFileName, "rb");
+        fseek(fIn, -2, SEEK_END);
+        sum += fgetc(fIn);
+        fclose(fIn);
+    }
+    double fileNs = (NowMs() - t0) * 1000000.0 / nFileReads;
+    remove(szFileName);
+    printf("  shared memory read %8.1f ns, file poll %8.1f ns (%d)\n", readNs, fileNs, sum & 1);
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Bandwidth allocation
+
+static bool CheckWaterFill(const char *szCase, const float *afWeights, int nPlayers, uint32_t uBudgetBps, const uint32_t *aExpected)
+{
+    BandwidthConfig config;
+    GetDefaultBandwidthConfig(&config);
+    uint32_t aBps[BANDWIDTH_MAX_PLAYERS];
+    WaterFillBandwidth(afWeights, nPlayers, uBudgetBps, config.uMinBps, config.uMaxBps, aBps);
+    uint64_t uSum = 0;
+    bool bOk = true;
+    for (int i = 0; i < nPlayers; i++)
+    {
+        // Shares are truncated to whole bits per second.
+        bOk = bOk && aBps[i] <= aExpected[i] && aBps[i] + 1 >= aExpected[i];
+        uSum += aBps[i];
+    }
+    if (!bOk || uSum > uBudgetBps)
+    {
+        printf("  FAIL water fill, %s:", szCase);
+        for (int i = 0; i < nPlayers; i++)
+        {
+            printf(" %u", aBps[i]);
+        }
+        printf("\n");
+        return false;
+    }
+    return true;
+}
+
+static int VerifyWaterFill()
+{
+    int nFailures = 0;
+    const float afProportional[] = { 1, 2, 3 };
+    const uint32_t aProportional[] = { 1000000, 2000000, 3000000 };
+    nFailures += !CheckWaterFill("proportional", afProportional, 3, 6000000, aProportional);
+    const float afLow[] = { 1, 100 };
+    const uint32_t aLow[] = { 300000, 3700000 };
+    nFailures += !CheckWaterFill("minimum", afLow, 2, 4000000, aLow);
+    const float afHigh[] = { 1, 1, 10 };
+    const uint32_t aHigh[] = { 2000000, 2000000, 8000000 };
+    nFailures += !CheckWaterFill("maximum", afHigh, 3, 12000000, aHigh);
+    const float afZero[] = { 0, 0 };
+    const uint32_t aZero[] = { 1000000, 1000000 };
+    nFailures += !CheckWaterFill("zero weights", afZero, 2, 2000000, aZero);
+    const float afShort[] = { 1, 2, 3 };
+    const uint32_t aShort[] = { 200000, 200000, 200000 };
+    nFailures += !CheckWaterFill("budget below the minimum", afShort, 3, 600000, aShort);
+    return nFailures;
+}
+
+static bool CheckTargets(BandwidthAllocator &allocator, const char *szCase, int nPlayers, const uint32_t *aExpected)
+{
+    bool bOk = true;
+    for (int i = 0; i < nPlayers; i++)
+    {
+        uint32_t uTargetBps = 0;
+        bool bTaken = allocator.TakeTarget(i, &uTargetBps);
+        if (aExpected[i])
+            bOk = bOk && bTaken && uTargetBps + 1 >= aExpected[i] && uTargetBps <= aExpected[i];
+        else
+            bOk = bOk && !bTaken;
+    }
+    if (!bOk)
+        printf("  FAIL allocator, %s\n", szCase);
+    return bOk;
+}
+
+// A zero in the expected targets means no new target.
+static int VerifyBandwidthAllocator()
+{
+    int nFailures = 0;
+    BandwidthConfig config;
+    GetDefaultBandwidthConfig(&config);
+    config.uTotalBps = 4000000;
+    config.fHysteresis = 0.1f;
+    config.uMinReconfigureMs = 1000;
+    config.afStateWeights[PLAYER_ACTIVITY_SHOOTING] = 2.1f;
+    BandwidthAllocator allocator(CreateBandwidthPolicy(BANDWIDTH_POLICY_WEIGHTED), config);
+    allocator.AddPlayer(0);
+    allocator.AddPlayer(1);
+
+    allocator.Tick(10000);
+    const uint32_t aFirst[] = { 2000000, 2000000 };
+    nFailures += !CheckTargets(allocator, "first targets", 2, aFirst);
+    const uint32_t aNone[] = { 0, 0, 0 };
+    nFailures += !CheckTargets(allocator, "target taken twice", 2, aNone);
+
+    allocator.ReportActivity(0, PLAYER_ACTIVITY_IDLE);
+    allocator.ReportActivity(1, PLAYER_ACTIVITY_INPUT);
+    allocator.Tick(10100);
+    nFailures += !CheckTargets(allocator, "rate limit", 2, aNone);
+    allocator.Tick(11000);
+    const uint32_t aWeighted[] = { 1333333, 2666666 };
+    nFailures += !CheckTargets(allocator, "weighted targets", 2, aWeighted);
+
+    // A player joins within the rate limit; the others give way at once to
+    // stay within the budget.
+    allocator.AddPlayer(2);
+    allocator.Tick(11100);
+    const uint32_t aJoin[] = { 800000, 1600000, 1600000 };
+    nFailures += !CheckTargets(allocator, "join over budget", 3, aJoin);
+
+    // 2.1 against 2 is within the hysteresis.
+    allocator.ReportActivity(1, PLAYER_ACTIVITY_SHOOTING);
+    allocator.Tick(13000);
+    nFailures += !CheckTargets(allocator, "hysteresis", 3, aNone);
+
+    BandwidthPlayerStats stats;
+    uint64_t uSum = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        if (allocator.GetPlayerStats(i, &stats))
+            uSum += stats.uTargetBps;
+    }
+    if (!allocator.GetPlayerStats(0, &stats) || stats.nReconfigures != 3 || uSum > config.uTotalBps)
+    {
+        printf("  FAIL allocator stats, %u reconfigurations, %llu bps\n", stats.nReconfigures, (unsigned long long)uSum);
+        nFailures++;
+    }
+    return nFailures;
+}
+
+// What the allocator logs, the simulator reads back.
+static int VerifyActivityLogReplay()
+{
+    char szFileName[64];
+    sprintf(szFileName, "perfshim_bandwidth_%u.log", (unsigned int)(NowMs() * 1000));
+    BandwidthConfig config;
+    GetDefaultBandwidthConfig(&config);
+    {
+        BandwidthAllocator allocator(CreateBandwidthPolicy(BANDWIDTH_POLICY_WEIGHTED), config);
+        FILE *fLog = fopen(szFileName, "w");
+        if (!fLog)
+        {
+            printf("  FAIL cannot write %s\n", szFileName);
+            return 1;
+        }
+        allocator.SetActivityLog(fLog);
+        allocator.AddPlayer(0);
+        allocator.AddPlayer(3);
+        allocator.Tick(5000);
+        allocator.ReportActivity(3, PLAYER_ACTIVITY_SHOOTING);
+        allocator.Tick(5100);
+        allocator.Tick(5200);
+        allocator.ReportActivity(0, PLAYER_ACTIVITY_IDLE);
+        allocator.Tick(5300);
+    }
+
+    std::vector<ActivityEvent> aEvents;
+    bool bLoaded = LoadActivityTrace(szFileName, aEvents);
+    remove(szFileName);
+    const ActivityEvent aExpected[] =
+    {
+        { 0, 0, PLAYER_ACTIVITY_NONE },
+        { 0, 3, PLAYER_ACTIVITY_NONE },
+        { 100, 3, PLAYER_ACTIVITY_SHOOTING },
+        { 300, 0, PLAYER_ACTIVITY_IDLE },
+    };
+    bool bOk = bLoaded && aEvents.size() == sizeof(aExpected) / sizeof(aExpected[0]);
+    for (size_t i = 0; bOk && i < aEvents.size(); i++)
+    {
+        bOk = aEvents[i].uTimeMs == aExpected[i].uTimeMs && aEvents[i].iPlayer == aExpected[i].iPlayer
+            && aEvents[i].eState == aExpected[i].eState;
+    }
+    if (!bOk)
+    {
+        printf("  FAIL activity log replay, %d events\n", (int)aEvents.size());
+        return 1;
+    }
+    return 0;
+}
+
+struct BandwidthEncoderRun
+{
+    BandwidthAllocator     *pAllocator;
+    int                     index;
+    std::atomic<bool>      *pbStop;
+    uint32_t                nTargets;
+    uint32_t                uLastTargetBps;
+};
+
+// Reports changing activity and picks up targets as an encoder thread does.
+static void RunBandwidthEncoder(BandwidthEncoderRun *pRun)
+{
+    uint32_t n = 0;
+    while (!*pRun->pbStop)
+    {
+        pRun->pAllocator->ReportActivity(pRun->index, (PlayerActivityState)(1 + (n++ / 1000 + pRun->index) % 3));
+        uint32_t uTargetBps;
+        if (pRun->pAllocator->TakeTarget(pRun->index, &uTargetBps))
+        {
+            pRun->nTargets++;
+            pRun->uLastTargetBps = uTargetBps;
+        }
+        std::this_thread::yield();
+    }
+}
+
+static int VerifyBandwidthThreads()
+{
+    BandwidthConfig config;
+    GetDefaultBandwidthConfig(&config);
+    config.uMinReconfigureMs = 0;
+    BandwidthAllocator allocator(CreateBandwidthPolicy(BANDWIDTH_POLICY_WEIGHTED), config);
+    allocator.Start();
+
+    const int nEncoders = 4;
+    std::atomic<bool> bStop(false);
+    BandwidthEncoderRun aRuns[nEncoders];
+    std::vector<std::thread> aThreads;
+    for (int i = 0; i < nEncoders; i++)
+    {
+        allocator.AddPlayer(i);
+        aRuns[i].pAllocator = &allocator;
+        aRuns[i].index = i;
+        aRuns[i].pbStop = &bStop;
+        aRuns[i].nTargets = 0;
+        aRuns[i].uLastTargetBps = 0;
+        aThreads.push_back(std::thread(RunBandwidthEncoder, &aRuns[i]));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5 * BANDWIDTH_TICK_MS));
+    allocator.Stop();
+    bStop = true;
+    uint32_t nTargets = 0;
+    bool bOk = true;
+    for (int i = 0; i < nEncoders; i++)
+    {
+        aThreads[i].join();
+        // The thread may have stopped between the last publication and its take.
+        uint32_t uTargetBps;
+        if (allocator.TakeTarget(i, &uTargetBps))
+            aRuns[i].uLastTargetBps = uTargetBps;
+        BandwidthPlayerStats stats;
+        bOk = bOk && aRuns[i].nTargets > 0 && allocator.GetPlayerStats(i, &stats)
+            && stats.uTargetBps == aRuns[i].uLastTargetBps;
+        nTargets += aRuns[i].nTargets;
+    }
+    printf("  %d encoder threads took %u targets\n", nEncoders, nTargets);
+    if (!bOk)
+    {
+        printf("  FAIL encoder threads missed their targets\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int RunBandwidth(const Options &opt)
+{
+    int nFailures = VerifyWaterFill() + VerifyBandwidthAllocator() + VerifyActivityLogReplay() + VerifyBandwidthThreads();
+    printf("Bandwidth allocator: %s\n", nFailures ? "FAILED" : "passed");
+
+    std::vector<ActivityEvent> aEvents;
+    if (opt.trace)
+    {
+        if (!LoadActivityTrace(opt.trace, aEvents))
+        {
+            printf("  FAIL cannot read %s\n", opt.trace);
+            return nFailures + 1;
+        }
+    }
+    else
+    {
+        MakeSyntheticActivityTrace(4, 10 * 60 * 1000, 1, aEvents);
+    }
+
+    struct SimCase
+    {
+        const char         *szName;
+        BandwidthPolicyType eType;
+        float               fHysteresis;
+        uint32_t            uMinReconfigureMs;
+    };
+    BandwidthConfig config;
+    GetDefaultBandwidthConfig(&config);
+    const SimCase aCases[] =
+    {
+        { "undamped", BANDWIDTH_POLICY_WEIGHTED, 0, 0 },
+        { "hysteresis", BANDWIDTH_POLICY_WEIGHTED, config.fHysteresis, 0 },
+        { "default", BANDWIDTH_POLICY_WEIGHTED, config.fHysteresis, config.uMinReconfigureMs },
+        { "equal", BANDWIDTH_POLICY_EQUAL, config.fHysteresis, config.uMinReconfigureMs },
+    };
+    const int nCases = sizeof(aCases) / sizeof(aCases[0]);
+    BandwidthSimReport aReports[nCases];
+    printf("  %d events, %s\n", (int)aEvents.size(), opt.trace ? opt.trace : "synthetic trace");
+    printf("  %-10s %7s %12s %9s %9s %11s %11s\n", "", "players", "reconf/min", "fairness", "tracking", "utilization", "over budget");
+    double t0 = NowMs();
+    for (int i = 0; i < nCases; i++)
+    {
+        config.fHysteresis = aCases[i].fHysteresis;
+        config.uMinReconfigureMs = aCases[i].uMinReconfigureMs;
+        SimulateBandwidth(aEvents, aCases[i].eType, config, &aReports[i]);
+        const BandwidthSimReport &report = aReports[i];
+        printf("  %-10s %7d %12.2f %9.3f %8.1f%% %10.1f%% %10.1f%%\n", aCases[i].szName, report.nPlayers,
+            report.fReconfiguresPerPlayerMinute, report.fFairness, report.fTrackingError * 100, report.fUtilization * 100,
+            report.fOverBudget * 100);
+        if (report.fOverBudget > 0)
+        {
+            printf("  FAIL %s went over budget\n", aCases[i].szName);
+            nFailures++;
+        }
+    }
+    printf("  %d simulations in %.1f ms\n", nCases, NowMs() - t0);
+
+    // The damping must pay for itself on the synthetic trace.
+    if (!opt.trace && (aReports[2].nReconfigures * 2 > aReports[0].nReconfigures || aReports[2].fFairness < 0.9))
+    {
+        printf("  FAIL damping: %u reconfigurations against %u undamped\n", aReports[2].nReconfigures, aReports[0].nReconfigures);
+        nFailures++;
+    }
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Frame pacing
+
+static bool StopAtOnce(void *, uint32_t)
+{
+    return false;
+}
+
+static void Stall(double ms)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds((long long)(ms * 1000)));
+}
+
+static bool CheckPacerStats(FramePacer &pacer, const char *szCase, uint64_t nFrames, uint64_t nOverruns, uint64_t nDropped)
+{
+    FramePacerStats stats;
+    pacer.GetStats(&stats);
+    uint64_t nBinned = 0;
+    for (int i = 0; i < FRAME_PACER_HISTOGRAM_BINS; i++)
+    {
+        nBinned += stats.anLateness[i];
+    }
+    if (stats.nFrames != nFrames || stats.nOverruns != nOverruns || stats.nDropped != nDropped || nBinned != nFrames)
+    {
+        printf("  FAIL %s: %llu frames, %llu overruns, %llu dropped\n", szCase, (unsigned long long)stats.nFrames,
+            (unsigned long long)stats.nOverruns, (unsigned long long)stats.nDropped);
+        return false;
+    }
+    return true;
+}
+
+static int VerifyFramePacer()
+{
+    int nFailures = 0;
+
+    // 20 fps, so a stall of 3.5 periods after frame 1 misses three deadlines.
+    // Dropping runs frame 4 at once and keeps the grid: frame 5 is due at
+    // 250 ms. The margins leave room for sleeps that overshoot on a loaded
+    // machine.
+    {
+        double t0 = NowMs();
+        FramePacer pacer(20, 1, FRAME_PACER_DROP);
+        pacer.Wait();
+        Stall(175);
+        pacer.Wait();
+        pacer.Wait();
+        double ms = NowMs() - t0;
+        nFailures += !CheckPacerStats(pacer, "drop", 3, 1, 2);
+        // Frame 4 started 25 ms late.
+        FramePacerStats stats;
+        pacer.GetStats(&stats);
+        if (stats.anLateness[FRAME_PACER_HISTOGRAM_BINS - 1] != 1 || stats.uMaxLatenessNs < 25000000)
+        {
+            printf("  FAIL drop: overrun not in the last lateness bin\n");
+            nFailures++;
+        }
+        if (ms < 250 || ms > 260)
+        {
+            printf("  FAIL drop: frame due at 250 ms came at %.2f ms\n", ms);
+            nFailures++;
+        }
+    }
+
+    // Catching up runs three missed frames back to back and drops the rest.
+    {
+        FramePacer pacer(20, 1, FRAME_PACER_CATCH_UP);
+        pacer.Wait();
+        Stall(275);
+        double t0 = NowMs();
+        for (int i = 0; i < 3; i++)
+        {
+            pacer.Wait();
+        }
+        double burstMs = NowMs() - t0;
+        nFailures += !CheckPacerStats(pacer, "catch up", 4, 3, 2);
+        if (burstMs > 5)
+        {
+            printf("  FAIL catch up: took %.2f ms for frames already due\n", burstMs);
+            nFailures++;
+        }
+    }
+
+    // Deadlines come from the start, so 29.97 fps does not drift; whole
+    // millisecond periods would be 22 ms short after 60 frames.
+    {
+        double t0 = NowMs();
+        FramePacer pacer(30000, 1001);
+        for (int i = 0; i < 60; i++)
+        {
+            pacer.Wait();
+        }
+        double ms = NowMs() - t0;
+        FramePacerStats stats;
+        pacer.GetStats(&stats);
+        if (fabs(ms - 60 * 1001 / 30.0) > 10 || stats.nOverruns)
+        {
+            printf("  FAIL 30000/1001: 60 frames in %.2f ms, %llu overruns\n", ms, (unsigned long long)stats.nOverruns);
+            nFailures++;
+        }
+    }
+
+    // No frame rate means no waiting, and a sleep that gives up stops Wait.
+    {
+        FramePacer unpaced(0);
+        double t0 = NowMs();
+        for (int i = 0; i < 1000; i++)
+        {
+            unpaced.Wait();
+        }
+        FramePacer stopped(1);
+        bool bWaited = stopped.Wait(StopAtOnce, NULL);
+        double ms = NowMs() - t0;
+        if (ms > 50 || bWaited)
+        {
+            printf("  FAIL unpaced and stopped waits took %.2f ms\n", ms);
+            nFailures++;
+        }
+    }
+    return nFailures;
+}
+
+// The loop FramePacer replaced: deadlines in whole milliseconds from a frame
+// count, sleeping whatever is left, so a stall is followed by a burst.
+static void PaceLegacy(int fps, int nFrames, int iStallFrame, double stallMs, std::vector<double> &aStartMs)
+{
+    unsigned int uTimeZero = (unsigned int)NowMs();
+    for (int i = 0; i < nFrames; i++)
+    {
+        aStartMs.push_back(NowMs());
+        if (i == iStallFrame)
+            Stall(stallMs);
+        int delta = (int)((uTimeZero + (i + 1) * 1000 / fps) - (unsigned int)NowMs());
+        if (delta > 0)
+            Stall(delta);
+    }
+}
+
+static void PaceFrames(FramePacer &pacer, int nFrames, int iStallFrame, double stallMs, std::vector<double> &aStartMs)
+{
+    for (int i = 0; i < nFrames; i++)
+    {
+        aStartMs.push_back(NowMs());
+        if (i == iStallFrame)
+            Stall(stallMs);
+        pacer.Wait();
+    }
+}
+
+// Frames that started less than half a period after the one before, and the
+// standard deviation of the intervals outside the stall.
+static void PrintPacing(const char *szName, int fps, int iStallFrame, const std::vector<double> &aStartMs)
+{
+    double periodMs = 1000.0 / fps;
+    int nBurst = 0, nIntervals = 0;
+    double sum = 0, sumSquares = 0;
+    for (size_t i = 1; i < aStartMs.size(); i++)
+    {
+        double intervalMs = aStartMs[i] - aStartMs[i - 1];
+        nBurst += intervalMs < periodMs / 2 ? 1 : 0;
+        if ((int)i - 1 == iStallFrame)
+            continue;
+        sum += intervalMs;
+        sumSquares += intervalMs * intervalMs;
+        nIntervals++;
+    }
+    double mean = sum / nIntervals;
+    double jitter = sumSquares / nIntervals - mean * mean;
+    printf("  %-10s %4d frames in %8.1f ms, %3d in bursts, interval jitter %6.3f ms\n", szName, (int)aStartMs.size(),
+        aStartMs.back() - aStartMs.front(), nBurst, jitter > 0 ? sqrt(jitter) : 0);
+}
+
+static int RunFramePacer(const Options &opt)
+{
+    int nFailures = VerifyFramePacer();
+    printf("Frame pacer: %s\n", nFailures ? "FAILED" : "passed");
+
+    // A 60 fps loop that stalls for 200 ms a third of the way through.
+    const int fps = 60;
+    int nFrames = opt.iterations < 60 ? 60 : opt.iterations / 2;
+    int iStallFrame = nFrames / 3;
+    const double stallMs = 200;
+    std::vector<double> aStartMs;
+    PaceLegacy(fps, nFrames, iStallFrame, stallMs, aStartMs);
+    PrintPacing("legacy", fps, iStallFrame, aStartMs);
+
+    FramePacerPolicy aePolicies[] = { FRAME_PACER_DROP, FRAME_PACER_CATCH_UP };
+    const char *aszPolicies[] = { "drop", "catch up" };
+    for (int i = 0; i < 2; i++)
+    {
+        FramePacer pacer(fps, 1, aePolicies[i]);
+        aStartMs.clear();
+        PaceFrames(pacer, nFrames, iStallFrame, stallMs, aStartMs);
+        PrintPacing(aszPolicies[i], fps, iStallFrame, aStartMs);
+        FramePacerStats stats;
+        pacer.GetStats(&stats);
+        printf("  ");
+        PrintFramePacerStats(stdout, stats);
+    }
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Tile change detection
+
+static int VerifyTileHashRows()
+{
+    static const int aWidths[] = { 1, 3, 4, 5, 15, 16, 17, 31, 32, 33, 63, 64, 65, 683, 960, 1920 };
+    static const int aHeights[] = { 1, 2, 32, 64 };
+    static const int aPads[] = { 0, 1, 7, 64 };
+    int nFailures = 0;
+
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (TileHashSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+        for (size_t w = 0; w < sizeof(aWidths) / sizeof(aWidths[0]); w++)
+        {
+            for (size_t h = 0; h < sizeof(aHeights) / sizeof(aHeights[0]); h++)
+            {
+                for (size_t p = 0; p < sizeof(aPads) / sizeof(aPads[0]); p++)
+                {
+                    int width = aWidths[w], height = aHeights[h], stride = width + aPads[p];
+                    std::vector<unsigned char> src(stride * height);
+                    FillRandom(&src[0], src.size());
+                    std::vector<uint32_t> ref((width + 3) / 4, TILE_HASH_SEED), lanes(ref.size(), TILE_HASH_SEED);
+                    TileHashRows_C(&src[0], stride, width, height, &ref[0]);
+                    TileHashRows(&src[0], stride, width, height, &lanes[0]);
+                    if (lanes != ref)
+                    {
+                        printf("  FAIL tile hash %s %dx%d pad %d\n", GetSimdLevelName(s_aLevels[l]), width, height, aPads[p]);
+                        nFailures++;
+                    }
+                }
+            }
+        }
+    }
+    TileHashSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+// Returns the number of tiles whose dirty flag is not what the change at
+// tile (tx, ty), or no change if tx < 0, calls for.
+static int CheckDirtyMask(const TileChangeDetector &detector, int tx, int ty)
+{
+    int nWrong = 0;
+    for (int y = 0; y < detector.GetTilesY(); y++)
+    {
+        for (int x = 0; x < detector.GetTilesX(); x++)
+        {
+            nWrong += detector.GetDirtyMask()[y * detector.GetTilesX() + x] != (x == tx && y == ty);
+        }
+    }
+    return nWrong;
+}
+
+// Flips single bytes of every plane, at the corners of the frame and around
+// tile edges, and checks that exactly the tile holding the byte is dirty.
+static int VerifyTileChangeDetector(int width, int height)
+{
+    int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+    std::vector<unsigned char> frame(width * height + 2 * chromaWidth * chromaHeight);
+    FillRandom(&frame[0], frame.size());
+    unsigned char *apPlanes[3] = { &frame[0], &frame[width * height], &frame[width * height + chromaWidth * chromaHeight] };
+    int nFailures = 0;
+
+    TileChangeDetector detector;
+    detector.Init(width, height);
+    int nTiles = detector.GetTilesX() * detector.GetTilesY();
+    if (detector.GetTilesX() != (width + 63) / 64 || detector.GetTilesY() != (height + 63) / 64)
+    {
+        printf("  FAIL %dx%d: %dx%d tiles\n", width, height, detector.GetTilesX(), detector.GetTilesY());
+        return 1;
+    }
+    int nFirst = detector.Update(apPlanes[0], apPlanes[1], apPlanes[2], width, chromaWidth);
+    int nSame = detector.Update(apPlanes[0], apPlanes[1], apPlanes[2], width, chromaWidth);
+    if (nFirst != nTiles || nSame != 0 || CheckDirtyMask(detector, -1, -1))
+    {
+        printf("  FAIL %dx%d: first frame %d dirty of %d, same frame %d dirty\n", width, height, nFirst, nTiles, nSame);
+        nFailures++;
+    }
+
+    struct Probe
+    {
+        int plane;
+        int x;
+        int y;
+    };
+    const Probe aProbes[] =
+    {
+        { 0, 0, 0 }, { 0, 63, 63 }, { 0, 64, 64 }, { 0, 65, 127 }, { 0, width - 1, height - 1 }, { 0, width - 1, 0 },
+        { 1, 0, 0 }, { 1, 31, 31 }, { 1, 32, 33 }, { 1, chromaWidth - 1, chromaHeight - 1 },
+        { 2, 0, 32 }, { 2, 33, 0 }, { 2, chromaWidth - 1, chromaHeight - 1 },
+    };
+    for (size_t i = 0; i < sizeof(aProbes) / sizeof(aProbes[0]); i++)
+    {
+        const Probe &probe = aProbes[i];
+        int planeWidth = probe.plane ? chromaWidth : width, planeHeight = probe.plane ? chromaHeight : height;
+        int tileSize = probe.plane ? 32 : 64;
+        if (probe.x >= planeWidth || probe.y >= planeHeight)
+            continue;
+        unsigned char *p = apPlanes[probe.plane] + probe.y * planeWidth + probe.x;
+        // The change and the change back each dirty the tile once.
+        for (int flip = 0; flip < 2; flip++)
+        {
+            *p ^= 0x80 >> (i % 8);
+            int nDirty = detector.Update(apPlanes[0], apPlanes[1], apPlanes[2], width, chromaWidth);
+            if (nDirty != 1 || CheckDirtyMask(detector, probe.x / tileSize, probe.y / tileSize))
+            {
+                printf("  FAIL %dx%d: byte (%d, %d) of plane %d dirtied %d tiles\n", width, height, probe.x, probe.y, probe.plane, nDirty);
+                nFailures++;
+            }
+        }
+    }
+
+    // Tile rows one at a time, as a frame comes in, then a reset encoder.
+    apPlanes[0][width * (height - 1)] ^= 1;
+    int nDirty = 0;
+    for (int ty = 0; ty < detector.GetTilesY(); ty++)
+    {
+        nDirty += detector.UpdateTileRows(apPlanes[0], apPlanes[1], apPlanes[2], width, chromaWidth, ty, 1);
+    }
+    if (nDirty != 1 || CheckDirtyMask(detector, 0, detector.GetTilesY() - 1))
+    {
+        printf("  FAIL %dx%d: tile rows one at a time dirtied %d tiles\n", width, height, nDirty);
+        nFailures++;
+    }
+    detector.Invalidate();
+    nDirty = detector.Update(apPlanes[0], apPlanes[1], apPlanes[2], width, chromaWidth);
+    if (nDirty != nTiles)
+    {
+        printf("  FAIL %dx%d: %d of %d tiles dirty after Invalidate\n", width, height, nDirty, nTiles);
+        nFailures++;
+    }
+    return nFailures;
+}
+
+static int RunTileHash(const Options &opt)
+{
+    int nFailures = VerifyTileHashRows();
+    printf("Tile hash verification: %s\n", nFailures ? "FAILED" : "passed");
+
+    static const int aSizes[][2] = { { 1920, 1080 }, { 1366, 769 }, { 64, 64 }, { 65, 1 }, { 129, 130 } };
+    int nDetectorFailures = 0;
+    for (size_t i = 0; i < sizeof(aSizes) / sizeof(aSizes[0]); i++)
+    {
+        nDetectorFailures += VerifyTileChangeDetector(aSizes[i][0], aSizes[i][1]);
+    }
+    printf("Tile change detector: %s\n", nDetectorFailures ? "FAILED" : "passed");
+    nFailures += nDetectorFailures;
+
+    // The shim hashes every captured frame, so this is the cost of every
+    // frame, skipped or not; the budget is well under 1 ms at 1080p.
+    int width = opt.width, height = opt.height;
+    std::vector<unsigned char> frame(width * height * 3 / 2);
+    FillRandom(&frame[0], frame.size());
+    unsigned char *pU = &frame[width * height], *pV = pU + width * height / 4;
+    TileChangeDetector detector;
+    detector.Init(width, height);
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (TileHashSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+        detector.Update(&frame[0], pU, pV, width, width / 2);
+        double t0 = NowMs();
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            detector.Update(&frame[0], pU, pV, width, width / 2);
+        }
+        double ms = (NowMs() - t0) / opt.iterations;
+        printf("  %-7s %dx%d %dx%d tiles: %7.3f ms/frame, %6.2f GB/s\n", GetSimdLevelName(s_aLevels[l]),
+            width, height, detector.GetTilesX(), detector.GetTilesY(), ms, frame.size() / (ms * 1.0e6));
+    }
+    TileHashSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// QP delta maps
+
+static int VerifyQpDeltaKernel()
+{
+    static const int aSizes[] = { 1, 15, 16, 17, 31, 32, 33, 100, 8160 };
+    // Defaults, no active spell, active up to static, static never reached.
+    static const QpDeltaConfig aConfigs[] =
+    {
+        { -2, 4, -3, 2, 15 }, { -1, 1, 0, 0, 1 }, { -5, 6, -6, 5, 5 }, { -2, 4, -3, 2, 255 },
+    };
+    int nFailures = 0;
+
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (QpDeltaSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+        for (size_t c = 0; c < sizeof(aConfigs) / sizeof(aConfigs[0]); c++)
+        {
+            for (size_t s = 0; s < sizeof(aSizes) / sizeof(aSizes[0]); s++)
+            {
+                int n = aSizes[s];
+                std::vector<uint8_t> dirty(n), hud(n), age(n), refAge, refMap(n), map(n);
+                FillRandom(&dirty[0], n);
+                FillRandom(&hud[0], n);
+                FillRandom(&age[0], n);
+                for (int i = 0; i < n; i++)
+                {
+                    // Mostly clean, a few HUD macroblocks, and the ages
+                    // around the saturation point too.
+                    dirty[i] = dirty[i] < 64 ? dirty[i] + 1 : 0;
+                    hud[i] = hud[i] < 32 ? hud[i] + 1 : 0;
+                    if (i % 7 == 0)
+                        age[i] = 254 + i % 2;
+                }
+                refAge = age;
+                QpDeltaUpdate_C(&dirty[0], &hud[0], &refAge[0], (int8_t *)&refMap[0], n, aConfigs[c]);
+                QpDeltaUpdate(&dirty[0], &hud[0], &age[0], (int8_t *)&map[0], n, aConfigs[c]);
+                if (age != refAge || map != refMap)
+                {
+                    printf("  FAIL QP delta %s config %d size %d\n", GetSimdLevelName(s_aLevels[l]), (int)c, n);
+                    nFailures++;
+                }
+            }
+        }
+    }
+    QpDeltaSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+// Expected map: iOutside everywhere but in the rectangles, given as
+// { mbX0, mbX1, mbY0, mbY1, delta } with the ends excluded.
+static std::vector<int8_t> ExpectedQpDeltaMap(const QpDeltaMapBuilder &builder, int8_t iOutside, const int (*aRects)[5], int nRects)
+{
+    std::vector<int8_t> map(builder.GetMapSize(), iOutside);
+    for (int r = 0; r < nRects; r++)
+    {
+        for (int mbY = aRects[r][2]; mbY < aRects[r][3]; mbY++)
+        {
+            for (int mbX = aRects[r][0]; mbX < aRects[r][1]; mbX++)
+            {
+                map[mbY * builder.GetWidthInMbs() + mbX] = (int8_t)aRects[r][4];
+            }
+        }
+    }
+    return map;
+}
+
+static int CountWrongDeltas(const std::vector<int8_t> &expected, const int8_t *pMap)
+{
+    int nWrong = 0;
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+        nWrong += pMap[i] != expected[i];
+    }
+    return nWrong;
+}
+
+static int VerifyQpDeltaMapBuilder()
+{
+    QpDeltaConfig config;
+    GetDefaultQpDeltaConfig(&config);
+    int nFailures = 0;
+
+    // Ages from the first frame on, a changed tile, HUD regions, then the
+    // 128x128 blocks of an NvFBC diff map.
+    QpDeltaMapBuilder builder;
+    builder.Init(1920, 1080, 3, config);
+    std::vector<uint8_t> tiles(30 * 17, 0);
+    if (builder.GetWidthInMbs() != 120 || builder.GetHeightInMbs() != 68 || builder.GetMapSize() != 120 * 68)
+    {
+        printf("  FAIL 1920x1080 map is %dx%d\n", builder.GetWidthInMbs(), builder.GetHeightInMbs());
+        return 1;
+    }
+    for (int frame = 1; frame <= config.uStaticFrames; frame++)
+    {
+        const int8_t *pMap = builder.Build(&tiles[0], 30, 17, 64);
+        int8_t iExpected = frame < config.uActiveFrames ? config.iActiveDelta : frame < config.uStaticFrames ? 0 : config.iStaticDelta;
+        int nWrong = CountWrongDeltas(ExpectedQpDeltaMap(builder, iExpected, NULL, 0), pMap);
+        if (nWrong)
+        {
+            printf("  FAIL static frame %d: %d macroblocks off %d\n", frame, nWrong, iExpected);
+            nFailures++;
+        }
+    }
+    const int aTile[][5] = { { 12, 16, 8, 12, config.iActiveDelta } };
+    tiles[2 * 30 + 3] = 1;
+    int nWrong = CountWrongDeltas(ExpectedQpDeltaMap(builder, config.iStaticDelta, aTile, 1), builder.Build(&tiles[0], 30, 17, 64));
+    // The tile stays active for uActiveFrames; the HUD wins over both.
+    const int aTileHud[][5] = { { 12, 16, 8, 12, config.iActiveDelta }, { 6, 9, 3, 5, config.iHudDelta }, { 12, 14, 10, 17, config.iHudDelta } };
+    builder.AddHudRegion(100, 50, 40, 20);
+    builder.AddHudRegion(200, 170, 20, 100);
+    tiles[2 * 30 + 3] = 0;
+    nWrong += CountWrongDeltas(ExpectedQpDeltaMap(builder, config.iStaticDelta, aTileHud, 3), builder.Build(&tiles[0], 30, 17, 64));
+    if (nWrong)
+    {
+        printf("  FAIL changed tile and HUD regions: %d macroblocks wrong\n", nWrong);
+        nFailures++;
+    }
+    const int aBlock[][5] = { { 8, 16, 8, 16, config.iActiveDelta } };
+    std::vector<uint8_t> blocks(15 * 9, 0);
+    blocks[1 * 15 + 1] = 1;
+    builder.Init(1920, 1080, 2, config);
+    for (int frame = 0; frame < config.uStaticFrames; frame++)
+    {
+        builder.Build(&tiles[0], 30, 17, 64);
+    }
+    nWrong = CountWrongDeltas(ExpectedQpDeltaMap(builder, config.iStaticDelta, aBlock, 1), builder.Build(&blocks[0], 15, 9, 128));
+    if (nWrong)
+    {
+        printf("  FAIL 128x128 diff map: %d macroblocks wrong\n", nWrong);
+        nFailures++;
+    }
+
+    // Partial tiles and macroblocks on the edges of an odd size.
+    const int aEdge[][5] = { { 84, 86, 48, 49, config.iActiveDelta } };
+    builder.Init(1366, 769, 2, config);
+    if (builder.GetWidthInMbs() != 86 || builder.GetHeightInMbs() != 49)
+    {
+        printf("  FAIL 1366x769 map is %dx%d\n", builder.GetWidthInMbs(), builder.GetHeightInMbs());
+        return nFailures + 1;
+    }
+    std::vector<uint8_t> oddTiles(22 * 13, 0);
+    for (int frame = 0; frame < config.uStaticFrames; frame++)
+    {
+        builder.Build(&oddTiles[0], 22, 13, 64);
+    }
+    oddTiles[12 * 22 + 21] = 1;
+    nWrong = CountWrongDeltas(ExpectedQpDeltaMap(builder, config.iStaticDelta, aEdge, 1), builder.Build(&oddTiles[0], 22, 13, 64));
+    if (nWrong)
+    {
+        printf("  FAIL 1366x769: %d macroblocks wrong\n", nWrong);
+        nFailures++;
+    }
+
+    // A map is left alone until nBuffers - 1 more have been built.
+    builder.Init(640, 480, 3, config);
+    std::vector<uint8_t> small(10 * 8, 1);
+    const int8_t *apMaps[4];
+    apMaps[0] = builder.Build(&small[0], 10, 8, 64);
+    std::vector<int8_t> first(apMaps[0], apMaps[0] + builder.GetMapSize());
+    small.assign(small.size(), 0);
+    for (int i = 1; i < 4; i++)
+    {
+        apMaps[i] = builder.Build(&small[0], 10, 8, 64);
+        if (i == 2 && memcmp(&first[0], apMaps[0], first.size()))
+        {
+            printf("  FAIL map overwritten while in use\n");
+            nFailures++;
+        }
+    }
+    if (apMaps[1] == apMaps[0] || apMaps[2] == apMaps[0] || apMaps[2] == apMaps[1] || apMaps[3] != apMaps[0])
+    {
+        printf("  FAIL map ring does not go round 3 buffers\n");
+        nFailures++;
+    }
+    return nFailures;
+}
+
+static int RunQpDeltaMap(const Options &opt)
+{
+    int nFailures = VerifyQpDeltaKernel();
+    nFailures += VerifyQpDeltaMapBuilder();
+    printf("QP delta maps: %s\n", nFailures ? "FAILED" : "passed");
+
+    // Built on the encoder thread right before submission, from the tile
+    // mask of a frame where a tenth of the tiles changed.
+    int width = opt.width, height = opt.height;
+    int nTilesX = (width + TILE_HASH_SIZE - 1) / TILE_HASH_SIZE, nTilesY = (height + TILE_HASH_SIZE - 1) / TILE_HASH_SIZE;
+    std::vector<uint8_t> tiles(nTilesX * nTilesY);
+    FillRandom(&tiles[0], tiles.size());
+    for (size_t i = 0; i < tiles.size(); i++)
+    {
+        tiles[i] = tiles[i] < 26;
+    }
+    QpDeltaConfig config;
+    GetDefaultQpDeltaConfig(&config);
+    QpDeltaMapBuilder builder;
+    builder.Init(width, height, 3, config);
+    builder.AddHudRegion(0, 0, width / 4, height / 8);
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (QpDeltaSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+        double t0 = NowMs();
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            builder.Build(&tiles[0], nTilesX, nTilesY, TILE_HASH_SIZE);
+        }
+        double us = (NowMs() - t0) * 1000.0 / opt.iterations;
+        printf("  %-7s %dx%d %dx%d macroblocks: %7.2f us/map\n", GetSimdLevelName(s_aLevels[l]),
+            width, height, builder.GetWidthInMbs(), builder.GetHeightInMbs(), us);
+    }
+    QpDeltaSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Encoder session pool
+
+struct MockEncodeSession
+{
+    void               *pContext;
+    EncodeSessionKey    key;
+    int                 iBitrate;       // of the player it was last opened or reset for
+    int                 nResets;
+    std::atomic<int>    nUsers;         // players holding it, never more than 1
+};
+
+// Counts what a real device would hold: contexts, sessions and the buffers
+// allocated with them.
+class MockEncodeSessionDevice : public IEncodeSessionDevice
+{
+public:
+    MockEncodeSessionDevice() : nContexts(0), nSessions(0), nBuffers(0), bFailReset(false) {}
+
+    virtual void *CreateContext(int iDevice)
+    {
+        nContexts++;
+        return (void *)(size_t)(0x1000 + iDevice);
+    }
+    virtual void DestroyContext(void *)
+    {
+        nContexts--;
+    }
+    virtual void *OpenSession(void *pContext, const EncodeSessionKey &key, const void *pParams)
+    {
+        MockEncodeSession *pSession = new MockEncodeSession;
+        pSession->pContext = pContext;
+        pSession->key = key;
+        pSession->iBitrate = *(const int *)pParams;
+        pSession->nResets = 0;
+        pSession->nUsers = 0;
+        nSessions++;
+        nBuffers += key.nBuffers;
+        return pSession;
+    }
+    virtual bool ResetSession(void *pSession, const void *pParams)
+    {
+        if (bFailReset)
+            return false;
+        MockEncodeSession *pMock = (MockEncodeSession *)pSession;
+        pMock->iBitrate = *(const int *)pParams;
+        pMock->nResets++;
+        return true;
+    }
+    virtual void CloseSession(void *pSession)
+    {
+        MockEncodeSession *pMock = (MockEncodeSession *)pSession;
+        nSessions--;
+        nBuffers -= pMock->key.nBuffers;
+        delete pMock;
+    }
+
+    std::atomic<int>    nContexts;
+    std::atomic<int>    nSessions;
+    std::atomic<int>    nBuffers;
+    bool                bFailReset;
+};
+
+static EncodeSessionKey MakeSessionKey(int iDevice, uint32_t uWidth, uint32_t uHeight, uint32_t nBuffers)
+{
+    EncodeSessionKey key;
+    key.iDevice = iDevice;
+    key.uWidth = uWidth;
+    key.uHeight = uHeight;
+    key.uCodec = 0;
+    key.uFormat = 0;
+    key.nBuffers = nBuffers;
+    return key;
+}
+
+static bool CheckSessionPool(EncodeSessionPool &pool, MockEncodeSessionDevice &device, const char *szCase,
+                             int nContexts, int nSessions, int nBuffers, uint32_t nOpened, uint32_t nReused, uint32_t nLeased)
+{
+    EncodeSessionPoolStats stats;
+    pool.GetStats(&stats);
+    if (device.nContexts != nContexts || device.nSessions != nSessions || device.nBuffers != nBuffers
+        || stats.nOpened != nOpened || stats.nReused != nReused || stats.nLeased != nLeased
+        || stats.nLeased + stats.nIdle != (uint32_t)nSessions)
+    {
+        printf("  FAIL %s: %d contexts, %d sessions, %d buffers, %u opened, %u reused, %u leased, %u idle"
+            " (expected %d, %d, %d, %u, %u, %u)\n", szCase, (int)device.nContexts, (int)device.nSessions, (int)device.nBuffers,
+            stats.nOpened, stats.nReused, stats.nLeased, stats.nIdle, nContexts, nSessions, nBuffers, nOpened, nReused, nLeased);
+        return false;
+    }
+    return true;
+}
+
+static int VerifyEncodeSessionPool()
+{
+    int nFailures = 0;
+    MockEncodeSessionDevice device;
+    {
+        EncodeSessionPool pool(&device, 6, 6);
+        const EncodeSessionKey key = MakeSessionKey(0, 1920, 1080, 2);
+
+        // Four players join: one context, a session and its buffers each.
+        MockEncodeSession *apSessions[4];
+        int aBitrates[4] = { 1000000, 2000000, 3000000, 4000000 };
+        for (int i = 0; i < 4; i++)
+        {
+            apSessions[i] = (MockEncodeSession *)pool.Lease(key, &aBitrates[i]);
+        }
+        bool bDistinct = apSessions[0] != apSessions[1] && apSessions[0] != apSessions[2] && apSessions[0] != apSessions[3]
+            && apSessions[1] != apSessions[2] && apSessions[1] != apSessions[3] && apSessions[2] != apSessions[3];
+        if (!apSessions[0] || !apSessions[3] || !bDistinct || apSessions[3]->iBitrate != 4000000)
+        {
+            printf("  FAIL four players do not get sessions of their own\n");
+            return 1;
+        }
+        nFailures += !CheckSessionPool(pool, device, "4 players joined", 1, 4, 8, 4, 0, 4);
+
+        // Two leave and two others join: the sessions come back reset for the
+        // new players, nothing is opened, closed or reallocated.
+        pool.Recycle(apSessions[1]);
+        pool.Recycle(apSessions[2]);
+        nFailures += !CheckSessionPool(pool, device, "2 players left", 1, 4, 8, 4, 0, 2);
+        int aRejoin[2] = { 5000000, 6000000 };
+        MockEncodeSession *pRejoin0 = (MockEncodeSession *)pool.Lease(key, &aRejoin[0]);
+        MockEncodeSession *pRejoin1 = (MockEncodeSession *)pool.Lease(key, &aRejoin[1]);
+        bool bRecycled = (pRejoin0 == apSessions[1] || pRejoin0 == apSessions[2]) && (pRejoin1 == apSessions[1] || pRejoin1 == apSessions[2])
+            && pRejoin0 != pRejoin1;
+        if (!bRecycled || pRejoin0->iBitrate != 5000000 || pRejoin1->iBitrate != 6000000 || pRejoin0->nResets != 1)
+        {
+            printf("  FAIL rejoining players do not get the recycled sessions, reset\n");
+            nFailures++;
+        }
+        nFailures += !CheckSessionPool(pool, device, "2 players rejoined", 1, 4, 8, 4, 2, 4);
+
+        // A session with more buffers than asked for is good enough; one with
+        // fewer is not, and neither is one of another size or device.
+        pool.Recycle(pRejoin0);
+        MockEncodeSession *pFewer = (MockEncodeSession *)pool.Lease(MakeSessionKey(0, 1920, 1080, 1), &aBitrates[0]);
+        if (pFewer != pRejoin0)
+        {
+            printf("  FAIL a session with spare buffers is not reused\n");
+            nFailures++;
+        }
+        pool.Recycle(pFewer);
+        MockEncodeSession *pMore = (MockEncodeSession *)pool.Lease(MakeSessionKey(0, 1920, 1080, 3), &aBitrates[0]);
+        MockEncodeSession *pSmaller = (MockEncodeSession *)pool.Lease(MakeSessionKey(0, 1280, 720, 2), &aBitrates[0]);
+        if (pMore == pRejoin0 || pSmaller == pRejoin0 || !pMore || !pSmaller)
+        {
+            printf("  FAIL a session is reused for more buffers or another size\n");
+            nFailures++;
+        }
+        nFailures += !CheckSessionPool(pool, device, "other keys", 1, 6, 13, 6, 3, 5);
+
+        // The pool is full: a new key takes the place of the idle session of
+        // another key, and once none is idle leasing fails.
+        MockEncodeSession *pOther = (MockEncodeSession *)pool.Lease(MakeSessionKey(1, 1920, 1080, 2), &aBitrates[0]);
+        if (!pOther || pOther->pContext == apSessions[0]->pContext)
+        {
+            printf("  FAIL device 1 does not get a context and session of its own\n");
+            nFailures++;
+        }
+        nFailures += !CheckSessionPool(pool, device, "full pool, idle session evicted", 2, 6, 13, 7, 3, 6);
+        if (pool.Lease(key, &aBitrates[0]))
+        {
+            printf("  FAIL leased a seventh session from a pool of six\n");
+            nFailures++;
+        }
+
+        // A session that cannot be reset is replaced.
+        pool.Recycle(pMore);
+        device.bFailReset = true;
+        MockEncodeSession *pReplaced = (MockEncodeSession *)pool.Lease(MakeSessionKey(0, 1920, 1080, 3), &aBitrates[2]);
+        device.bFailReset = false;
+        if (!pReplaced || pReplaced->nResets != 0 || pReplaced->iBitrate != 3000000)
+        {
+            printf("  FAIL a session that failed to reset is not replaced\n");
+            nFailures++;
+        }
+        nFailures += !CheckSessionPool(pool, device, "reset failed", 2, 6, 13, 8, 3, 6);
+
+        // Trim closes the idle sessions only; the contexts stay.
+        pool.Recycle(pSmaller);
+        pool.Recycle(pOther);
+        pool.Trim();
+        nFailures += !CheckSessionPool(pool, device, "trimmed", 2, 4, 9, 8, 3, 4);
+    }
+    // The destructor closes the sessions still leased and the contexts.
+    if (device.nContexts || device.nSessions || device.nBuffers)
+    {
+        printf("  FAIL pool destroyed with %d contexts, %d sessions and %d buffers left\n",
+            (int)device.nContexts, (int)device.nSessions, (int)device.nBuffers);
+        nFailures++;
+    }
+
+    // Idle sessions beyond nMaxIdle are closed when recycled.
+    {
+        EncodeSessionPool pool(&device, 4, 1);
+        const EncodeSessionKey key = MakeSessionKey(0, 640, 480, 4);
+        int iBitrate = 500000;
+        void *pFirst = pool.Lease(key, &iBitrate);
+        void *pSecond = pool.Lease(key, &iBitrate);
+        pool.Recycle(pFirst);
+        pool.Recycle(pSecond);
+        nFailures += !CheckSessionPool(pool, device, "1 idle kept", 1, 1, 4, 2, 0, 0);
+    }
+    return nFailures;
+}
+
+struct SessionChurnRun
+{
+    EncodeSessionPool  *pPool;
+    int                 nRounds;
+    std::atomic<int>   *pnShared;       // leases that found their session in use
+};
+
+// A player leaving and joining nRounds times.
+static void ChurnSessions(SessionChurnRun *pRun)
+{
+    const EncodeSessionKey key = MakeSessionKey(0, 1920, 1080, 2);
+    int iBitrate = 2000000;
+    for (int i = 0; i < pRun->nRounds; i++)
+    {
+        MockEncodeSession *pSession = (MockEncodeSession *)pRun->pPool->Lease(key, &iBitrate);
+        if (!pSession)
+            continue;
+        if (pSession->nUsers.fetch_add(1) != 0)
+            (*pRun->pnShared)++;
+        pSession->nUsers.fetch_sub(1);
+        pRun->pPool->Recycle(pSession);
+    }
+}
+
+static int VerifyEncodeSessionChurn(int nThreads, int nRounds, double *pfUsPerLease)
+{
+    MockEncodeSessionDevice device;
+    EncodeSessionPool pool(&device);
+    std::atomic<int> nShared(0);
+    std::vector<SessionChurnRun> aRuns(nThreads);
+    std::vector<std::thread> aThreads;
+    double t0 = NowMs();
+    for (int i = 0; i < nThreads; i++)
+    {
+        aRuns[i].pPool = &pool;
+        aRuns[i].nRounds = nRounds;
+        aRuns[i].pnShared = &nShared;
+        aThreads.push_back(std::thread(ChurnSessions, &aRuns[i]));
+    }
+    for (int i = 0; i < nThreads; i++)
+    {
+        aThreads[i].join();
+    }
+    *pfUsPerLease = (NowMs() - t0) * 1000.0 / ((double)nThreads * nRounds);
+
+    EncodeSessionPoolStats stats;
+    pool.GetStats(&stats);
+    int nFailures = 0;
+    if (nShared || stats.nOpened > (uint32_t)nThreads || stats.nOpened + stats.nReused != (uint32_t)(nThreads * nRounds)
+        || stats.nLeased || device.nContexts != 1)
+    {
+        printf("  FAIL %d players churning: %d shared leases, %u opened, %u reused, %u leased, %d contexts\n",
+            nThreads, (int)nShared, stats.nOpened, stats.nReused, stats.nLeased, (int)device.nContexts);
+        nFailures++;
+    }
+    return nFailures;
+}
+
+static int RunEncodeSessionPool(const Options &opt)
+{
+    int nFailures = VerifyEncodeSessionPool();
+    printf("Encode session pool: %s\n", nFailures ? "FAILED" : "passed");
+
+    // Players leaving and joining at once, each lease served by a session
+    // another player just gave back.
+    int nRounds = opt.iterations * 100;
+    const int anThreads[] = { 1, 4, 16 };
+    for (size_t i = 0; i < sizeof(anThreads) / sizeof(anThreads[0]); i++)
+    {
+        double fUs = 0;
+        nFailures += VerifyEncodeSessionChurn(anThreads[i], nRounds, &fUs);
+        printf("  %2d players: %7.3f us per lease and recycle\n", anThreads[i], fUs);
+    }
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Player sessions
+////////////////////////////////////////////////////////////////////////////
+
+// Stands in for the swap chain of player i, spaced like heap objects.
+static const void *MakePlayerKey(int i)
+{
+    return (const void *)(uintptr_t)(0x10000 + i * 0x1a0);
+}
+
+static int VerifyPlayerSessionRegistry()
+{
+    int nFailures = 0;
+
+    if (sizeof(PlayerSession) % PLAYER_SESSION_CACHE_LINE)
+    {
+        printf("  FAIL a session is %d bytes, not whole cache lines\n", (int)sizeof(PlayerSession));
+        nFailures++;
+    }
+
+    PlayerSessionRegistry registry(4);
+    for (int i = 0; i < 4; i++)
+    {
+        bool bNew = false;
+        PlayerSession *p = registry.Acquire(MakePlayerKey(i), &bNew);
+        if (!p || !bNew || p->index != i || ((uintptr_t)p % PLAYER_SESSION_CACHE_LINE))
+        {
+            printf("  FAIL player %d got index %d, new %d, at %p\n", i, p ? p->index : -1, (int)bNew, (void *)p);
+            nFailures++;
+        }
+    }
+    bool bNew = true;
+    if (registry.Acquire(MakePlayerKey(2), &bNew) != registry.Find(MakePlayerKey(2)) || bNew)
+    {
+        printf("  FAIL acquiring a known key again\n");
+        nFailures++;
+    }
+    if (registry.Acquire(MakePlayerKey(4)) || registry.Find(MakePlayerKey(4)) || registry.GetCount() != 4)
+    {
+        printf("  FAIL a fifth player in a registry of 4\n");
+        nFailures++;
+    }
+
+    // A player that leaves frees its index for the next one.
+    registry.Find(MakePlayerKey(1))->pEncoder = &registry;
+    if (!registry.Remove(MakePlayerKey(1)) || registry.Remove(MakePlayerKey(1)) || registry.Find(MakePlayerKey(1))
+        || registry.GetAt(1))
+    {
+        printf("  FAIL removing player 1\n");
+        nFailures++;
+    }
+    PlayerSession *pNext = registry.Acquire(MakePlayerKey(7));
+    if (!pNext || pNext->index != 1 || pNext->pEncoder || registry.GetAt(1) != pNext
+        || registry.Find(MakePlayerKey(0))->index != 0 || registry.Find(MakePlayerKey(3))->index != 3)
+    {
+        printf("  FAIL the next player did not get index 1 back\n");
+        nFailures++;
+    }
+
+    // The last player left still has to be found among the tombstones.
+    registry.Remove(MakePlayerKey(0));
+    registry.Remove(MakePlayerKey(2));
+    registry.Remove(MakePlayerKey(3));
+    if (registry.Find(MakePlayerKey(7)) != pNext || registry.GetCount() != 1)
+    {
+        printf("  FAIL the last player is lost\n");
+        nFailures++;
+    }
+    registry.Remove(MakePlayerKey(7));
+    if (registry.GetCount() || registry.Acquire(MakePlayerKey(5))->index != 0)
+    {
+        printf("  FAIL the registry is not empty after everyone left\n");
+        nFailures++;
+    }
+
+    // Indices past the bandwidth and activity tables are never handed out.
+    PlayerSessionRegistry capped(PLAYER_SESSION_LIMIT * 2);
+    int nAdmitted = 0;
+    for (int i = 0; i < PLAYER_SESSION_LIMIT + 4; i++)
+    {
+        PlayerSession *p = capped.Acquire(MakePlayerKey(i));
+        if (p && p->index < BANDWIDTH_MAX_PLAYERS && p->index < PLAYER_ACTIVITY_MAX_PLAYERS)
+            nAdmitted++;
+    }
+    if (capped.GetMaxSessions() != PLAYER_SESSION_LIMIT || nAdmitted != PLAYER_SESSION_LIMIT
+        || capped.GetCount() != PLAYER_SESSION_LIMIT)
+    {
+        printf("  FAIL a registry of %d admitted %d players\n", PLAYER_SESSION_LIMIT * 2, capped.GetCount());
+        nFailures++;
+    }
+
+    // Many players coming and going leave tombstones behind; every lookup
+    // must still agree with a plain list of the players present.
+    PlayerSessionRegistry churn(16);
+    std::vector<int> aPresent;
+    uint32_t uSeed = 1;
+    for (int round = 0; round < 20000 && !nFailures; round++)
+    {
+        uSeed = uSeed * 1103515245 + 12345;
+        int iPlayer = (int)((uSeed >> 8) % 64);
+        std::vector<int>::iterator it = std::find(aPresent.begin(), aPresent.end(), iPlayer);
+        if (it != aPresent.end())
+        {
+            churn.Remove(MakePlayerKey(iPlayer));
+            aPresent.erase(it);
+        }
+        else if (aPresent.size() < 16)
+        {
+            if (churn.Acquire(MakePlayerKey(iPlayer)))
+            {
+                aPresent.push_back(iPlayer);
+            }
+            else
+            {
+                printf("  FAIL no session for a player with %d present\n", (int)aPresent.size());
+                nFailures++;
+            }
+        }
+
+        for (int i = 0; i < 64; i++)
+        {
+            bool bPresent = std::find(aPresent.begin(), aPresent.end(), i) != aPresent.end();
+            PlayerSession *p = churn.Find(MakePlayerKey(i));
+            if (bPresent != (p != NULL) || (p && p->pKey.load() != MakePlayerKey(i)))
+            {
+                printf("  FAIL round %d: player %d %s but found %p\n", round, i, bPresent ? "present" : "absent", (void *)p);
+                nFailures++;
+                break;
+            }
+        }
+    }
+    if (churn.GetCount() != (int)aPresent.size())
+    {
+        printf("  FAIL %d sessions counted for %d players\n", churn.GetCount(), (int)aPresent.size());
+        nFailures++;
+    }
+    return nFailures;
+}
+
+struct PresentRun
+{
+    PlayerSessionRegistry  *pRegistry;
+    int                     iPlayer;
+    int                     nFrames;
+    std::atomic<int>       *pnWrong;
+};
+
+// Present's lookup and counting, one thread per player.
+static void PresentFrames(PresentRun *pRun)
+{
+    const void *pKey = MakePlayerKey(pRun->iPlayer);
+    PlayerSession *pFirst = pRun->pRegistry->Find(pKey);
+    for (int i = 0; i < pRun->nFrames; i++)
+    {
+        PlayerSession *p = pRun->pRegistry->Find(pKey);
+        if (p != pFirst)
+        {
+            (*pRun->pnWrong)++;
+            continue;
+        }
+        p->nPresents.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Players presenting while others join and leave. Returns the nanoseconds
+// per lookup and count.
+static int VerifyPlayerSessionPresents(int nPlayers, int nFrames, double *pfNsPerPresent)
+{
+    PlayerSessionRegistry registry(nPlayers + 1);
+    for (int i = 0; i < nPlayers; i++)
+    {
+        registry.Acquire(MakePlayerKey(i));
+    }
+
+    std::atomic<int> nWrong(0);
+    std::atomic<bool> bStop(false);
+    std::thread churner([&]()
+    {
+        for (int i = 0; !bStop; i++)
+        {
+            registry.Acquire(MakePlayerKey(1000 + i % 7));
+            registry.Remove(MakePlayerKey(1000 + i % 7));
+        }
+    });
+
+    std::vector<PresentRun> aRuns(nPlayers);
+    std::vector<std::thread> aThreads;
+    double t0 = NowMs();
+    for (int i = 0; i < nPlayers; i++)
+    {
+        aRuns[i].pRegistry = &registry;
+        aRuns[i].iPlayer = i;
+        aRuns[i].nFrames = nFrames;
+        aRuns[i].pnWrong = &nWrong;
+        aThreads.push_back(std::thread(PresentFrames, &aRuns[i]));
+    }
+    for (int i = 0; i < nPlayers; i++)
+    {
+        aThreads[i].join();
+    }
+    *pfNsPerPresent = (NowMs() - t0) * 1e6 / ((double)nPlayers * nFrames);
+    bStop = true;
+    churner.join();
+
+    int nFailures = 0;
+    for (int i = 0; i < nPlayers; i++)
+    {
+        PlayerSession *p = registry.Find(MakePlayerKey(i));
+        if (!p || p->index != i || p->nPresents.load() != (uint64_t)nFrames)
+        {
+            printf("  FAIL player %d: index %d, %llu presents of %d\n", i, p ? p->index : -1,
+                p ? (unsigned long long)p->nPresents.load() : 0ull, nFrames);
+            nFailures++;
+        }
+    }
+    if (nWrong)
+    {
+        printf("  FAIL %d lookups returned another session\n", (int)nWrong);
+        nFailures++;
+    }
+    return nFailures;
+}
+
+struct PackedCounterRun
+{
+    std::atomic<uint64_t>  *pCounter;
+    int                     nFrames;
+};
+
+static void CountPacked(PackedCounterRun *pRun)
+{
+    for (int i = 0; i < pRun->nFrames; i++)
+    {
+        pRun->pCounter->fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// The counters of all players next to each other, as in a global array.
+static double TimePackedCounters(int nPlayers, int nFrames)
+{
+    std::vector<std::atomic<uint64_t> > aCounters(nPlayers);
+    std::vector<PackedCounterRun> aRuns(nPlayers);
+    std::vector<std::thread> aThreads;
+    double t0 = NowMs();
+    for (int i = 0; i < nPlayers; i++)
+    {
+        aCounters[i] = 0;
+        aRuns[i].pCounter = &aCounters[i];
+        aRuns[i].nFrames = nFrames;
+        aThreads.push_back(std::thread(CountPacked, &aRuns[i]));
+    }
+    for (int i = 0; i < nPlayers; i++)
+    {
+        aThreads[i].join();
+    }
+    return (NowMs() - t0) * 1e6 / ((double)nPlayers * nFrames);
+}
+
+static int RunPlayerSessions(const Options &opt)
+{
+    int nFailures = VerifyPlayerSessionRegistry();
+    printf("Player session registry: %s\n", nFailures ? "FAILED" : "passed");
+
+    // Lookup and count per Present with every player presenting at once;
+    // packed counters are the global arrays the sessions replace.
+    int nFrames = opt.iterations * 20000;
+    // The most players leave one session free for the players joining and
+    // leaving meanwhile.
+    const int anPlayers[] = { 1, 4, PLAYER_SESSION_LIMIT - 1 };
+    for (size_t i = 0; i < sizeof(anPlayers) / sizeof(anPlayers[0]); i++)
+    {
+        double fNs = 0;
+        nFailures += VerifyPlayerSessionPresents(anPlayers[i], nFrames, &fNs);
+        double fPackedNs = TimePackedCounters(anPlayers[i], nFrames);
+        printf("  %2d players: %7.1f ns per present with lookup, %7.1f ns per packed counter\n", anPlayers[i], fNs, fPackedNs);
+    }
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Frame trace
+////////////////////////////////////////////////////////////////////////////
+
+#if !defined(FRAME_TRACE_DISABLED)
+
+static const char *s_aszTraceStages[] = { "Capture", "Convert", "Encode", "Output" };
+
+// Checks that the events of every thread nest, stay in time order and keep
+// to frames that only go up. Returns the number of begin events.
+static int CheckTraceEvents(const std::vector<FrameTraceEvent> &aEvents, const char *szWhen, int *pnFailures)
+{
+    int nBegins = 0;
+    std::vector<const char *> stack;
+    for (size_t i = 0; i < aEvents.size(); i++)
+    {
+        const FrameTraceEvent &event = aEvents[i];
+        bool bNewThread = i == 0 || event.uThread != aEvents[i - 1].uThread;
+        if (bNewThread)
+            stack.clear();
+        const char *szError = NULL;
+        if (!bNewThread && (event.uTimeNs < aEvents[i - 1].uTimeNs || event.uFrame < aEvents[i - 1].uFrame))
+            szError = "out of order";
+        else if (!event.szName)
+            szError = "without a name";
+        else if (event.phase == FRAME_TRACE_BEGIN)
+            stack.push_back(event.szName), nBegins++;
+        else if (event.phase == FRAME_TRACE_INSTANT)
+            continue;
+        else if (event.phase != FRAME_TRACE_END || stack.empty() || stack.back() != event.szName)
+            szError = "not nested";
+        else
+            stack.pop_back();
+        if (szError)
+        {
+            printf("  FAIL %s: event %d of thread %u (%c %s, frame %u) %s\n", szWhen, (int)i, event.uThread, event.phase,
+                event.szName ? event.szName : "?", event.uFrame, szError);
+            (*pnFailures)++;
+            return nBegins;
+        }
+    }
+    return nBegins;
+}
+
+// Records nFrames frames of nested stages as a pipeline thread would.
+static void RecordTraceFrames(int nFrames)
+{
+    for (int i = 1; i <= nFrames; i++)
+    {
+        FRAME_TRACE_FRAME(i);
+        FRAME_TRACE_SCOPE("Frame");
+        for (int j = 0; j < 4; j++)
+        {
+            FRAME_TRACE_SCOPE(s_aszTraceStages[j]);
+        }
+    }
+}
+
+static int VerifyFrameTrace()
+{
+    int nFailures = 0;
+    FrameTraceReset();
+    FrameTraceEnable(false);
+    RecordTraceFrames(10);
+    std::vector<FrameTraceEvent> aEvents;
+    FrameTraceSnapshot(&aEvents, NULL);
+    if (!aEvents.empty())
+    {
+        printf("  FAIL %d events recorded while disabled\n", (int)aEvents.size());
+        nFailures++;
+    }
+
+    FrameTraceEnable(true);
+    FRAME_TRACE_THREAD_NAME("Main \"test\"");
+    RecordTraceFrames(10);
+    FRAME_TRACE_INSTANT_EVENT("Skip");
+    FrameTraceSnapshot(&aEvents, NULL);
+    int nBegins = CheckTraceEvents(aEvents, "10 frames", &nFailures);
+    if (aEvents.size() != 101 || nBegins != 50 || aEvents[0].uFrame != 1 || aEvents[1].szName != s_aszTraceStages[0]
+        || aEvents[100].phase != FRAME_TRACE_INSTANT || aEvents[100].uFrame != 10)
+    {
+        printf("  FAIL 10 frames: %d events, %d begins\n", (int)aEvents.size(), nBegins);
+        nFailures++;
+    }
+
+    std::string json;
+    FrameTraceWriteChromeJson(&json);
+    size_t nPhases = 0;
+    for (size_t pos = json.find("\"ph\":"); pos != std::string::npos; pos = json.find("\"ph\":", pos + 1))
+    {
+        nPhases++;
+    }
+    if (json.compare(0, 17, "{\"displayTimeUnit") != 0 || json.find("\"traceEvents\":[") == std::string::npos
+        || nPhases != 102 || json.find("\"name\":\"Main \\\"test\\\"\"") == std::string::npos
+        || json.find("\"name\":\"Convert\",\"ph\":\"B\",\"ts\":") == std::string::npos
+        || json.find("\"ph\":\"i\",\"s\":\"t\"") == std::string::npos || json.find("\"frame\":10}") == std::string::npos
+        || json.compare(json.size() - 3, 3, "]}\n") != 0)
+    {
+        printf("  FAIL Chrome JSON, %d events: %.200s\n", (int)nPhases, json.c_str());
+        nFailures++;
+    }
+
+    // A full ring keeps the newest events; the end events whose begin was
+    // overwritten are left out.
+    FrameTraceReset();
+    RecordTraceFrames(FRAME_TRACE_RING_EVENTS / 10 + 7);
+    FrameTraceSnapshot(&aEvents, NULL);
+    CheckTraceEvents(aEvents, "full ring", &nFailures);
+    if (aEvents.size() < FRAME_TRACE_RING_EVENTS - 10 || aEvents.size() > FRAME_TRACE_RING_EVENTS
+        || aEvents.back().uFrame != FRAME_TRACE_RING_EVENTS / 10 + 7 || aEvents[0].phase != FRAME_TRACE_BEGIN)
+    {
+        printf("  FAIL full ring: %d events, last of frame %u\n", (int)aEvents.size(), aEvents.empty() ? 0 : aEvents.back().uFrame);
+        nFailures++;
+    }
+    FrameTraceReset();
+    return nFailures;
+}
+
+// Threads recording while the trace is exported over and over: every
+// snapshot must be consistent.
+static int VerifyFrameTraceConcurrent(int nThreads, double *pfNsPerEvent)
+{
+    int nFailures = 0;
+    FrameTraceReset();
+    FrameTraceEnable(true);
+    const int nFrames = FRAME_TRACE_RING_EVENTS;
+    std::vector<std::thread> aThreads;
+    std::atomic<int> nDone(0);
+    double t0 = NowMs();
+    for (int i = 0; i < nThreads; i++)
+    {
+        aThreads.push_back(std::thread([&]()
+        {
+            RecordTraceFrames(nFrames);
+            nDone++;
+        }));
+    }
+    std::vector<FrameTraceEvent> aEvents;
+    int nSnapshots = 0;
+    while (nDone < nThreads && !nFailures)
+    {
+        FrameTraceSnapshot(&aEvents, NULL);
+        CheckTraceEvents(aEvents, "while recording", &nFailures);
+        nSnapshots++;
+    }
+    for (int i = 0; i < nThreads; i++)
+    {
+        aThreads[i].join();
+    }
+    *pfNsPerEvent = (NowMs() - t0) * 1e6 / ((double)nThreads * nFrames * 10);
+    FrameTraceReset();
+    return nFailures;
+}
+
+#endif
+
+static int RunFrameTrace(const Options &opt)
+{
+#if defined(FRAME_TRACE_DISABLED)
+    // Built without tracing: the calls are stubs and nothing is recorded.
+    (void)opt;
+    std::string json;
+    FrameTraceWriteChromeJson(&json);
+    int nFailures = FrameTraceEnableFromEnv() || FrameTraceGetFrame() || json != "{\"traceEvents\":[]}";
+    printf("Frame trace: compiled out, %s\n", nFailures ? "FAILED" : "passed");
+    return nFailures;
+#else
+    int nFailures = VerifyFrameTrace();
+    printf("Frame trace: %s\n", nFailures ? "FAILED" : "passed");
+
+    const int anThreads[] = { 1, 4 };
+    for (size_t i = 0; i < sizeof(anThreads) / sizeof(anThreads[0]); i++)
+    {
+        double fNs = 0;
+        nFailures += VerifyFrameTraceConcurrent(anThreads[i], &fNs);
+        printf("  %d threads, exported meanwhile: %6.1f ns per event\n", anThreads[i], fNs);
+    }
+
+    // The cost on the frame path, recording and not. Reading the clock is
+    // most of it, so that is shown too.
+    int nFrames = opt.iterations * 10000;
+    const bool abEnabled[] = { true, false };
+    for (int i = 0; i < 2; i++)
+    {
+        FrameTraceEnable(abEnabled[i]);
+        double t0 = NowMs();
+        RecordTraceFrames(nFrames);
+        double fNs = (NowMs() - t0) * 1e6 / ((double)nFrames * 10);
+        printf("  %-8s %6.1f ns per event\n", abEnabled[i] ? "enabled" : "disabled", fNs);
+    }
+    uint64_t uSum = 0;
+    double t0 = NowMs();
+    for (int i = 0; i < nFrames * 10; i++)
+    {
+        uSum += FramePacer::NowNs();
+    }
+    printf("  clock    %6.1f ns per read%s\n", (NowMs() - t0) * 1e6 / ((double)nFrames * 10), uSum ? "" : " ");
+    FrameTraceReset();
+    return nFailures;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Asynchronous log
+////////////////////////////////////////////////////////////////////////////
+
+struct LoggedLine
+{
+    int level;
+    std::string time;
+    std::string text;
+};
+
+// Keeps what the drain writes. Only the draining thread calls it.
+class TestLogSink : public AsyncLogSink
+{
+public:
+    TestLogSink() : nFlushes(0) {}
+
+    virtual void WriteLine(int level, const char *szTime, const char *szLine, size_t nLength)
+    {
+        LoggedLine line;
+        line.level = level;
+        line.time = szTime;
+        line.text.assign(szLine, nLength);
+        aLines.push_back(line);
+    }
+
+    virtual void FlushLines()
+    {
+        nFlushes++;
+    }
+
+    std::vector<LoggedLine> aLines;
+    int nFlushes;
+};
+
+// Throws the lines away, for timing what logging costs the thread that logs.
+class NullLogSink : public AsyncLogSink
+{
+public:
+    virtual void WriteLine(int /*level*/, const char * /*szTime*/, const char * /*szLine*/, size_t /*nLength*/) {}
+};
+
+static bool PostLine(AsyncLogSink *pSink, int level, const std::string &text)
+{
+    return AsyncLogPost(pSink, level, AsyncLogNow(), 0, text.data(), text.size());
+}
+
+// Sums the "(N lines of this thread dropped before" notes of the lines.
+static uint64_t CountNotedDrops(const std::vector<LoggedLine> &aLines)
+{
+    uint64_t nDropped = 0;
+    for (size_t i = 0; i < aLines.size(); i++)
+    {
+        size_t pos = aLines[i].text.find(" (");
+        unsigned int n = 0;
+        while (pos != std::string::npos)
+        {
+            if (sscanf(aLines[i].text.c_str() + pos, " (%u lines of this thread dropped", &n) == 1)
+                nDropped += n;
+            pos = aLines[i].text.find(" (", pos + 1);
+        }
+    }
+    return nDropped;
+}
+
+static bool IsLogTime(const std::string &time)
+{
+    return time.size() == 8 && time[2] == ':' && time[5] == ':' && isdigit((unsigned char)time[0])
+        && isdigit((unsigned char)time[7]);
+}
+
+static int VerifyAsyncLogLines()
+{
+    int nFailures = 0;
+    TestLogSink sink;
+
+    // Lines of every length, so that records end at every offset before the
+    // end of the ring and padding is skipped. Drained often enough that none
+    // is dropped.
+    std::vector<std::string> aPosted;
+    for (int i = 0; i < 3000; i++)
+    {
+        std::string text((size_t)(i * 7 % (ASYNC_LOG_LINE_MAX + 1)), 'a' + i % 26);
+        if (!text.empty())
+            text[0] = 'A' + i % 26;
+        if (PostLine(&sink, i % 5, text))
+            aPosted.push_back(text);
+        if (i % 50 == 49)
+            AsyncLogFlush();
+    }
+    AsyncLogFlush();
+    size_t nWrong = 0;
+    for (size_t i = 0; i < aPosted.size() && i < sink.aLines.size(); i++)
+    {
+        if (sink.aLines[i].text.compare(0, aPosted[i].size(), aPosted[i]) != 0 || !IsLogTime(sink.aLines[i].time))
+            nWrong++;
+    }
+    if (aPosted.size() != 3000 || sink.aLines.size() != aPosted.size() || nWrong || !sink.nFlushes)
+    {
+        printf("  FAIL every length: %d lines posted, %d written, %d wrong\n", (int)aPosted.size(), (int)sink.aLines.size(),
+            (int)nWrong);
+        nFailures++;
+    }
+
+    // Lines of different threads come out by time, not thread by thread. The
+    // log thread may drain between the posts, so this gets a few tries.
+    std::string order;
+    for (int iTry = 0; iTry < 3 && order != "first second third"; iTry++)
+    {
+        TestLogSink orderSink;
+        uint64_t uNow = AsyncLogNow();
+        AsyncLogPost(&orderSink, 2, uNow + 2, 0, "second", 6);
+        std::thread thread([&]()
+        {
+            AsyncLogPost(&orderSink, 2, uNow + 1, 0, "first", 5);
+            AsyncLogPost(&orderSink, 2, uNow + 3, 0, "third", 5);
+        });
+        thread.join();
+        AsyncLogFlush();
+        order.clear();
+        for (size_t i = 0; i < orderSink.aLines.size(); i++)
+        {
+            order += (i ? " " : "") + orderSink.aLines[i].text;
+        }
+    }
+    if (order != "first second third")
+    {
+        printf("  FAIL two threads written as \"%s\"\n", order.c_str());
+        nFailures++;
+    }
+
+    // Formatting cuts long lines instead of allocating.
+    AsyncLogStream stream;
+    stream << std::string(ASYNC_LOG_LINE_MAX + 100, 'x') << 42;
+    if (stream.GetLength() != ASYNC_LOG_LINE_MAX || stream.GetLine()[ASYNC_LOG_LINE_MAX - 1] != 'x')
+    {
+        printf("  FAIL long line kept %d bytes\n", (int)stream.GetLength());
+        nFailures++;
+    }
+    AsyncLogStream shortStream;
+    shortStream << "frame " << 7 << ' ' << 1.5;
+    if (std::string(shortStream.GetLine(), shortStream.GetLength()) != "frame 7 1.5")
+    {
+        printf("  FAIL formatted \"%.*s\"\n", (int)shortStream.GetLength(), shortStream.GetLine());
+        nFailures++;
+    }
+    return nFailures;
+}
+
+// A thread that logs far faster than the ring drains loses lines, never
+// waits, and says how many it lost with the next line that fits.
+static int VerifyAsyncLogDrops()
+{
+    int nFailures = 0;
+    TestLogSink sink;
+    AsyncLogStats before, after;
+    AsyncLogFlush();
+    AsyncLogGetStats(&before);
+    int nPosted = 0;
+    std::thread thread([&]()
+    {
+        for (int i = 0; i < 2000; i++)
+        {
+            char szLine[32];
+            sprintf(szLine, "line %d ", i);
+            nPosted += PostLine(&sink, 1, szLine + std::string(400, 'd'));
+        }
+        AsyncLogFlush();
+        nPosted += PostLine(&sink, 1, "line 2000");
+    });
+    thread.join();
+    AsyncLogFlush();
+    AsyncLogGetStats(&after);
+
+    // What is missing between the lines written is what they say was
+    // dropped.
+    int iNext = 0, nMissing = 0;
+    for (size_t i = 0; i < sink.aLines.size(); i++)
+    {
+        int iLine = -1;
+        sscanf(sink.aLines[i].text.c_str(), "line %d", &iLine);
+        nMissing += iLine < iNext ? 1000000 : iLine - iNext;
+        iNext = iLine + 1;
+    }
+    uint64_t nDropped = after.nDropped - before.nDropped;
+    if (nDropped == 0 || nPosted + nDropped != 2001 || sink.aLines.size() != (size_t)nPosted || iNext != 2001
+        || (uint64_t)nMissing != nDropped || CountNotedDrops(sink.aLines) != nDropped
+        || sink.aLines.back().text.compare(0, 11, "line 2000 (") != 0)
+    {
+        printf("  FAIL full ring: %d posted, %d dropped, %d written, %d missing, %d noted\n", nPosted, (int)nDropped,
+            (int)sink.aLines.size(), nMissing, (int)CountNotedDrops(sink.aLines));
+        nFailures++;
+    }
+    return nFailures;
+}
+
+static int VerifyAsyncLogRateLimit()
+{
+    int nFailures = 0;
+    const char *szFile = "RateLimit.cpp";
+    uint64_t uTimeUs = 4000000000ull * 1000000;
+    int nAllowed = 0;
+    uint32_t nSuppressed = 0, nTotalSuppressed = 0;
+    for (int i = 0; i < 50; i++)
+    {
+        nAllowed += AsyncLogAllow(szFile, 10, uTimeUs + i * 1000, &nSuppressed);
+        nTotalSuppressed += nSuppressed;
+    }
+    bool bOtherSite = AsyncLogAllow(szFile, 11, uTimeUs, &nSuppressed);
+    bool bNextSecond = AsyncLogAllow(szFile, 10, uTimeUs + 1000000, &nSuppressed);
+    if (nAllowed != ASYNC_LOG_RATE_LIMIT || nTotalSuppressed || !bOtherSite || !bNextSecond
+        || nSuppressed != 50 - ASYNC_LOG_RATE_LIMIT)
+    {
+        printf("  FAIL rate limit: %d of 50 allowed, then %s with %u held back\n", nAllowed, bNextSecond ? "allowed" : "not",
+            nSuppressed);
+        nFailures++;
+    }
+    return nFailures;
+}
+
+// Threads logging while the main thread drains: each thread's lines come
+// out in order, none twice.
+static int VerifyAsyncLogThreads(int nThreads, int nLines)
+{
+    int nFailures = 0;
+    TestLogSink sink;
+    std::vector<std::thread> aThreads;
+    std::atomic<int> nDone(0);
+    for (int t = 0; t < nThreads; t++)
+    {
+        aThreads.push_back(std::thread([&, t]()
+        {
+            char szLine[64];
+            for (int i = 0; i < nLines; i++)
+            {
+                sprintf(szLine, "thread %d line %d", t, i);
+                PostLine(&sink, 2, szLine);
+            }
+            nDone++;
+        }));
+    }
+    while (nDone < nThreads)
+    {
+        AsyncLogFlush();
+    }
+    for (int t = 0; t < nThreads; t++)
+    {
+        aThreads[t].join();
+    }
+    AsyncLogFlush();
+
+    std::vector<int> aiNext(nThreads, 0);
+    int nLost = 0;
+    for (size_t i = 0; i < sink.aLines.size() && !nFailures; i++)
+    {
+        int t = -1, iLine = -1;
+        sscanf(sink.aLines[i].text.c_str(), "thread %d line %d", &t, &iLine);
+        if (t < 0 || t >= nThreads || iLine < aiNext[t])
+        {
+            printf("  FAIL %d threads: \"%s\" out of order\n", nThreads, sink.aLines[i].text.c_str());
+            nFailures++;
+            break;
+        }
+        nLost += iLine - aiNext[t];
+        aiNext[t] = iLine + 1;
+    }
+    if (!nFailures && (uint64_t)nLost != CountNotedDrops(sink.aLines))
+    {
+        printf("  FAIL %d threads: %d lines missing, %d said dropped\n", nThreads, nLost, (int)CountNotedDrops(sink.aLines));
+        nFailures++;
+    }
+    return nFailures;
+}
+
+// More threads than there are rings, one after the other: each gives its
+// ring up when it exits, and the next one takes it over once it is drained.
+static int VerifyAsyncLogRingReuse()
+{
+    int nFailures = 0;
+    TestLogSink sink;
+    AsyncLogStats before, after;
+    AsyncLogFlush();
+    AsyncLogGetStats(&before);
+    const int nThreads = ASYNC_LOG_MAX_THREADS + 8;
+    for (int t = 0; t < nThreads; t++)
+    {
+        std::thread thread([&, t]()
+        {
+            char szLine[64];
+            sprintf(szLine, "short-lived thread %d", t);
+            PostLine(&sink, 2, szLine);
+        });
+        thread.join();
+        AsyncLogFlush();
+    }
+    AsyncLogGetStats(&after);
+
+    int nOrdered = 0;
+    for (size_t i = 0; i < sink.aLines.size(); i++)
+    {
+        int t = -1;
+        sscanf(sink.aLines[i].text.c_str(), "short-lived thread %d", &t);
+        nOrdered += t == (int)i;
+    }
+    if (nOrdered != nThreads || after.nRings > before.nRings + 1 || !after.nFreeRings)
+    {
+        printf("  FAIL %d short-lived threads: %d lines in order, %u rings before and %u after, %u free\n", nThreads,
+            nOrdered, before.nRings, after.nRings, after.nFreeRings);
+        nFailures++;
+    }
+    return nFailures;
+}
+
+// LOG_* through a file logger: level filter, lead, rate limit, and every
+// line written by the time the logger is deleted.
+static int VerifyLoggerMacros()
+{
+    int nFailures = 0;
+    char szFileName[64];
+    sprintf(szFileName, "perfshim_log_%u.log", (unsigned int)(NowMs() * 1000));
+    simplelogger::Logger *pLogger = simplelogger::LoggerFactory::CreateFileLogger(szFileName, simplelogger::INFO);
+    // The warning wakes the log thread; the rest is still queued when the
+    // logger is deleted.
+    LOG_WARN(pLogger, "warning");
+    LOG_DEBUG(pLogger, "not written");
+    LOG_INFO(pLogger, "frame " << 12 << " took " << 3.5 << " ms");
+    for (int i = 0; i < 100; i++)
+    {
+        LOG_INFO(pLogger, "info " << i);
+    }
+    LOG_INFO(pLogger, "last");
+    delete pLogger;
+
+    std::vector<std::string> aLines;
+    FILE *f = fopen(szFileName, "rb");
+    char szLine[1024];
+    while (f && fgets(szLine, sizeof(szLine), f))
+    {
+        aLines.push_back(szLine);
+    }
+    if (f)
+        fclose(f);
+    remove(szFileName);
+
+    int nInfos = 0;
+    for (size_t i = 0; i < aLines.size(); i++)
+    {
+        nInfos += aLines[i].find("] info ") != std::string::npos;
+    }
+    if (aLines.size() < 4 || aLines[0].compare(0, 8, "[WARN ][") != 0 || aLines[0].compare(16, 100, "] warning\n") != 0
+        || aLines[1].compare(0, 8, "[INFO ][") != 0 || aLines[1].compare(16, 100, "] frame 12 took 3.5 ms\n") != 0
+        || aLines[2].compare(0, 24, "[INFO ][" + aLines[1].substr(8, 8) + "] info 0") != 0
+        || nInfos < ASYNC_LOG_RATE_LIMIT || nInfos > 2 * ASYNC_LOG_RATE_LIMIT || aLines.back().compare(16, 100, "] last\n") != 0)
+    {
+        printf("  FAIL file logger: %d lines, %d rate limited, first \"%s\"\n", (int)aLines.size(), nInfos,
+            aLines.empty() ? "" : aLines[0].c_str());
+        nFailures++;
+    }
+    return nFailures;
+}
+
+static int RunAsyncLog(const Options &opt)
+{
+    int nFailures = VerifyAsyncLogLines();
+    nFailures += VerifyAsyncLogDrops();
+    nFailures += VerifyAsyncLogRateLimit();
+    nFailures += VerifyAsyncLogThreads(4, 5000);
+    nFailures += VerifyAsyncLogRingReuse();
+    nFailures += VerifyLoggerMacros();
+    printf("Asynchronous log: %s\n", nFailures ? "FAILED" : "passed");
+
+    // What a line costs the thread that logs: formatting and queueing it,
+    // against opening, appending to and closing a file as NvEncoder did.
+    NullLogSink sink;
+    int nLines = opt.iterations * 1000;
+    double t0 = NowMs();
+    for (int i = 0; i < nLines; i++)
+    {
+        AsyncLogStream stream;
+        stream << "Encode pipeline: depth " << 3 << ", " << i << " frames";
+        AsyncLogPost(&sink, 2, AsyncLogNow(), 0, stream.GetLine(), stream.GetLength());
+        if (i % 500 == 499)
+            AsyncLogFlush();
+    }
+    double fQueuedNs = (NowMs() - t0) * 1e6 / nLines;
+    AsyncLogFlush();
+
+    uint32_t nSuppressed = 0;
+    int nAllowed = 0;
+    t0 = NowMs();
+    for (int i = 0; i < nLines; i++)
+    {
+        nAllowed += AsyncLogAllow(__FILE__, __LINE__, AsyncLogNow(), &nSuppressed);
+    }
+    double fLimitedNs = (NowMs() - t0) * 1e6 / nLines;
+
+    char szFileName[64];
+    sprintf(szFileName, "perfshim_log_%u.log", (unsigned int)(NowMs() * 1000));
+    int nOpened = nLines / 10 < 1000 ? nLines / 10 : 1000;
+    t0 = NowMs();
+    for (int i = 0; i < nOpened; i++)
+    {
+        FILE *f = fopen(szFileName, "a");
+        if (f)
+        {
+            fprintf(f, "Encode pipeline: depth %d, %d frames\n", 3, i);
+            fclose(f);
+        }
+    }
+    double fOpenedNs = (NowMs() - t0) * 1e6 / (nOpened ? nOpened : 1);
+    remove(szFileName);
+
+    printf("  queued          %8.1f ns per line\n", fQueuedNs);
+    printf("  rate limited    %8.1f ns per line (%d of %d let through)\n", fLimitedNs, nAllowed, nLines);
+    printf("  open/append     %8.1f ns per line\n", fOpenedNs);
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Metrics
+////////////////////////////////////////////////////////////////////////////
+
+// Every value lands in the bucket whose bounds hold it, buckets are at most
+// an eighth of their lower bound wide, and powers of two are bounds.
+static int VerifyMetricBuckets()
+{
+    int nFailures = 0;
+    std::vector<uint64_t> aValues;
+    for (uint64_t v = 0; v <= 5000; v++)
+    {
+        aValues.push_back(v);
+    }
+    for (int k = 2; k < 64; k++)
+    {
+        uint64_t uPower = (uint64_t)1 << k;
+        aValues.push_back(uPower - 1);
+        aValues.push_back(uPower);
+        aValues.push_back(uPower + 1);
+        aValues.push_back(uPower + uPower / 3);
+    }
+    aValues.push_back(UINT64_MAX);
+    for (size_t i = 0; i < aValues.size() && nFailures < 5; i++)
+    {
+        uint64_t v = aValues[i];
+        int iBucket = MetricHistogram::GetBucket(v);
+        uint64_t uLowerUs = iBucket ? MetricHistogram::GetBucketBoundUs(iBucket - 1) : 0;
+        uint64_t uUpperUs = MetricHistogram::GetBucketBoundUs(iBucket);
+        if (iBucket < 0 || iBucket >= METRICS_HISTOGRAM_BUCKETS || v > uUpperUs || (v && v <= uLowerUs)
+            || (iBucket >= 2 * METRICS_HISTOGRAM_SUB_COUNT && uUpperUs - uLowerUs > uLowerUs / METRICS_HISTOGRAM_SUB_COUNT))
+        {
+            printf("  FAIL value %llu in bucket %d, (%llu, %llu]\n", (unsigned long long)v, iBucket,
+                (unsigned long long)uLowerUs, (unsigned long long)uUpperUs);
+            nFailures++;
+        }
+        if (v > 1 && !(v & (v - 1)) && uUpperUs != v)
+        {
+            printf("  FAIL power of two %llu is not a bucket bound\n", (unsigned long long)v);
+            nFailures++;
+        }
+    }
+    return nFailures;
+}
+
+static int VerifyMetricHistogram()
+{
+    int nFailures = 0;
+    MetricHistogram histogram;
+    MetricHistogramSnapshot snapshot;
+    histogram.GetSnapshot(&snapshot);
+    if (snapshot.nCount || snapshot.GetQuantileUs(0.5))
+    {
+        printf("  FAIL empty histogram: count %llu\n", (unsigned long long)snapshot.nCount);
+        nFailures++;
+    }
+
+    // 1 to 10000 us, shuffled.
+    const int nValues = 10000;
+    for (int i = 0; i < nValues; i++)
+    {
+        histogram.Record((uint64_t)(i * 7919 % nValues) + 1);
+    }
+    histogram.GetSnapshot(&snapshot);
+    if (snapshot.nCount != nValues || snapshot.uSumUs != (uint64_t)nValues * (nValues + 1) / 2 || snapshot.uMaxUs != nValues)
+    {
+        printf("  FAIL count %llu, sum %llu, max %llu\n", (unsigned long long)snapshot.nCount,
+            (unsigned long long)snapshot.uSumUs, (unsigned long long)snapshot.uMaxUs);
+        nFailures++;
+    }
+    const double afQuantiles[] = { 0.01, 0.5, 0.9, 0.99, 0.999, 1.0 };
+    for (size_t i = 0; i < sizeof(afQuantiles) / sizeof(afQuantiles[0]); i++)
+    {
+        // The true quantile, up to the width of its bucket.
+        double fExact = afQuantiles[i] * nValues;
+        uint64_t uUs = snapshot.GetQuantileUs(afQuantiles[i]);
+        if (uUs < fExact || uUs > fExact * (1.0 + 1.0 / METRICS_HISTOGRAM_SUB_COUNT) + 1)
+        {
+            printf("  FAIL p%g %llu us, %g expected\n", afQuantiles[i] * 100, (unsigned long long)uUs, fExact);
+            nFailures++;
+        }
+    }
+    if (snapshot.GetQuantileUs(1.0) != snapshot.uMaxUs)
+    {
+        printf("  FAIL p100 %llu us is not the largest value\n", (unsigned long long)snapshot.GetQuantileUs(1.0));
+        nFailures++;
+    }
+
+    // With few values the rank rounds up: the median of 10, 20, 30 is 20.
+    MetricHistogram small;
+    small.Record(30);
+    small.Record(10);
+    small.Record(20);
+    MetricHistogramSnapshot smallSnapshot;
+    small.GetSnapshot(&smallSnapshot);
+    if (smallSnapshot.GetQuantileUs(0.5) != 20 || smallSnapshot.GetQuantileUs(0.34) != 20 || smallSnapshot.GetQuantileUs(0.33) != 10
+        || smallSnapshot.GetQuantileUs(0.9) != 30)
+    {
+        printf("  FAIL quantiles of 10, 20, 30: %llu %llu %llu\n", (unsigned long long)smallSnapshot.GetQuantileUs(0.33),
+            (unsigned long long)smallSnapshot.GetQuantileUs(0.5), (unsigned long long)smallSnapshot.GetQuantileUs(0.9));
+        nFailures++;
+    }
+
+    for (int k = 0; k < 16; k++)
+    {
+        uint64_t uBoundUs = (uint64_t)1 << k;
+        uint64_t nExpected = uBoundUs < nValues ? uBoundUs : nValues;
+        if (snapshot.CountAtOrBelow(uBoundUs) != nExpected)
+        {
+            printf("  FAIL %llu values at or below %llu us, %llu expected\n", (unsigned long long)snapshot.CountAtOrBelow(uBoundUs),
+                (unsigned long long)uBoundUs, (unsigned long long)nExpected);
+            nFailures++;
+        }
+    }
+    return nFailures;
+}
+
+static bool Contains(const std::string &text, const char *sz)
+{
+    return text.find(sz) != std::string::npos;
+}
+
+// Checks the exposition format line by line: each series after the TYPE of
+// its family, histogram buckets cumulative up to +Inf, which equals _count.
+static int CheckPrometheusText(const std::string &text)
+{
+    std::string family;
+    std::string type;
+    unsigned long long nLastBucket = 0;
+    size_t pos = 0;
+    int iLine = 0;
+    while (pos < text.size())
+    {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos)
+        {
+            printf("  FAIL Prometheus text does not end with a line feed\n");
+            return 1;
+        }
+        std::string line = text.substr(pos, end - pos);
+        pos = end + 1;
+        iLine++;
+
+        const char *szError = NULL;
+        if (line.compare(0, 7, "# HELP ") == 0)
+        {
+            family = line.substr(7, line.find(' ', 7) - 7);
+            type.clear();
+            continue;
+        }
+        if (line.compare(0, 7, "# TYPE ") == 0)
+        {
+            if (line.compare(7, family.size() + 1, family + " ") != 0)
+                szError = "TYPE of another family than its HELP";
+            type = line.substr(8 + family.size());
+            if (type != "counter" && type != "gauge" && type != "histogram")
+                szError = "unknown type";
+            nLastBucket = 0;
+        }
+        else
+        {
+            size_t nameEnd = line.find_first_of("{ ");
+            size_t valueStart = line.rfind(' ');
+            std::string name = line.substr(0, nameEnd);
+            char *szEnd = NULL;
+            double fValue = valueStart == std::string::npos ? 0 : strtod(line.c_str() + valueStart + 1, &szEnd);
+            bool bHistogramPart = type == "histogram"
+                && (name == family + "_bucket" || name == family + "_sum" || name == family + "_count");
+            if (type.empty() || (name != family && !bHistogramPart))
+                szError = "series outside its family";
+            else if (!szEnd || *szEnd || nameEnd == std::string::npos)
+                szError = "no value";
+            else if (line[nameEnd] == '{' && line[valueStart - 1] != '}')
+                szError = "labels not closed";
+            else if (name == family + "_bucket")
+            {
+                if (fValue < nLastBucket)
+                    szError = "buckets not cumulative";
+                nLastBucket = (unsigned long long)fValue;
+            }
+            else if (name == family + "_count")
+            {
+                if (fValue != nLastBucket)
+                    szError = "_count is not the +Inf bucket";
+                nLastBucket = 0;
+            }
+        }
+        if (szError)
+        {
+            printf("  FAIL Prometheus line %d %s: %s\n", iLine, szError, line.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int VerifyMetricsRegistry()
+{
+    int nFailures = 0;
+    MetricsRegistry registry;
+    MetricCounter *pFrames0 = registry.GetCounter("test_frames_total", "Frames.\nCounted.", "player=\"0\"");
+    MetricCounter *pFrames1 = registry.GetCounter("test_frames_total", "Frames.", "player=\"1\"");
+    MetricGauge *pDepth = registry.GetGauge("test_depth", "Depth.");
+    MetricHistogram *pLatency = registry.GetHistogram("test_latency_seconds", "Latency.", "player=\"1\"");
+    MetricGauge *pClash = registry.GetGauge("test_frames_total", "Clash.", "player=\"0\"");
+    if (!pFrames0 || pFrames0 == pFrames1 || registry.GetCounter("test_frames_total", "", "player=\"0\"") != pFrames0
+        || !pClash || (void *)pClash == (void *)pFrames0)
+    {
+        printf("  FAIL registering the same name and labels twice\n");
+        nFailures++;
+    }
+
+    pFrames0->Add(3);
+    pFrames1->Add();
+    pDepth->Set(7);
+    pDepth->Add(-2);
+    pClash->Set(99);
+    pLatency->Record(10);
+    pLatency->Record(16);
+    pLatency->Record(17);
+    pLatency->Record(1500000);
+    pLatency->Record(10000000);
+
+    std::string text;
+    registry.WritePrometheus(&text);
+    nFailures += CheckPrometheusText(text);
+    const char *aszExpected[] =
+    {
+        "# HELP test_frames_total Frames.\\nCounted.\n# TYPE test_frames_total counter\n",
+        "\ntest_frames_total{player=\"0\"} 3\ntest_frames_total{player=\"1\"} 1\n",
+        "# TYPE test_depth gauge\ntest_depth 5\n",
+        "# TYPE test_latency_seconds histogram\n",
+        "\ntest_latency_seconds_bucket{player=\"1\",le=\"1.6e-05\"} 2\n",
+        "\ntest_latency_seconds_bucket{player=\"1\",le=\"3.2e-05\"} 3\n",
+        "\ntest_latency_seconds_bucket{player=\"1\",le=\"1.048576\"} 3\n",
+        "\ntest_latency_seconds_bucket{player=\"1\",le=\"2.097152\"} 4\n",
+        "\ntest_latency_seconds_bucket{player=\"1\",le=\"4.194304\"} 4\n",
+        "\ntest_latency_seconds_bucket{player=\"1\",le=\"+Inf\"} 5\n",
+        "\ntest_latency_seconds_sum{player=\"1\"} 11.500043\ntest_latency_seconds_count{player=\"1\"} 5\n",
+    };
+    for (size_t i = 0; i < sizeof(aszExpected) / sizeof(aszExpected[0]); i++)
+    {
+        if (!Contains(text, aszExpected[i]))
+        {
+            printf("  FAIL Prometheus text lacks \"%s\":\n%s", aszExpected[i], text.c_str());
+            nFailures++;
+            break;
+        }
+    }
+    if (Contains(text, " 99\n") || Contains(text, "Clash"))
+    {
+        printf("  FAIL a metric registered under a name of another type is exported\n");
+        nFailures++;
+    }
+
+    // The snapshot rates are per second since the one before.
+    std::string snapshot;
+    registry.WriteSnapshot(&snapshot);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    pFrames0->Add(100);
+    snapshot.clear();
+    registry.WriteSnapshot(&snapshot);
+    size_t pos = snapshot.find("player=\"0\"  103  ");
+    double fRate = pos == std::string::npos ? 0 : atof(snapshot.c_str() + pos + 17);
+    if (fRate < 100 / 0.5 || fRate > 100 / 0.045 || !Contains(snapshot, "player=\"1\"  count 5 mean 2300.009 ")
+        || !Contains(snapshot, "\ntest_depth\n  -  5\n"))
+    {
+        printf("  FAIL snapshot, rate %.1f/s:\n%s", fRate, snapshot.c_str());
+        nFailures++;
+    }
+
+    char szPath[64];
+    sprintf(szPath, "perfshim_metrics_%u.txt", (unsigned int)(NowMs() * 1000));
+    std::string written;
+    if (registry.WriteSnapshotFile(szPath))
+    {
+        FILE *f = fopen(szPath, "rb");
+        char aBuffer[4096];
+        size_t n = f ? fread(aBuffer, 1, sizeof(aBuffer), f) : 0;
+        written.assign(aBuffer, n);
+        if (f)
+            fclose(f);
+    }
+    std::string tempPath = std::string(szPath) + ".tmp";
+    FILE *fTemp = fopen(tempPath.c_str(), "rb");
+    if (!Contains(written, "\ntest_frames_total\n  player=\"0\"  103  0.") || fTemp)
+    {
+        printf("  FAIL snapshot file%s:\n%s", fTemp ? ", temporary file left" : "", written.c_str());
+        nFailures++;
+    }
+    if (fTemp)
+        fclose(fTemp);
+    remove(szPath);
+    remove(tempPath.c_str());
+    return nFailures;
+}
+
+// The pipeline records every drained frame and its depth gauge returns to 0;
+// an output counts the bytes it writes.
+static int VerifyMetricsWiring()
+{
+    int nFailures = 0;
+    MetricsRegistry registry;
+    MetricHistogram *pLatency = registry.GetHistogram("pipeline_latency_seconds", "");
+    MetricGauge *pDepth = registry.GetGauge("pipeline_queue_depth", "");
+
+    SimEncodeBuffer aBuffers[3];
+    void *apItems[3] = { &aBuffers[0], &aBuffers[1], &aBuffers[2] };
+    SimDrainState state;
+    state.uNextFrame = 0;
+    state.nOutOfOrder = 0;
+    EncodePipeline pipeline;
+    pipeline.SetMetrics(pLatency, pDepth);
+    pipeline.Start(apItems, 3, DrainSimBuffer, &state);
+    int64_t iMaxDepth = 0;
+    const unsigned int uFrames = 20;
+    for (unsigned int i = 0; i < uFrames; i++)
+    {
+        SimEncodeBuffer *pBuffer = (SimEncodeBuffer *)pipeline.AcquireFree();
+        pBuffer->fReadyMs = NowMs() + 2;
+        pBuffer->uFrame = i;
+        pipeline.Submit();
+        int64_t iDepth = pDepth->Get();
+        iMaxDepth = iDepth > iMaxDepth ? iDepth : iMaxDepth;
+    }
+    pipeline.WaitIdle();
+    pipeline.Stop();
+    MetricHistogramSnapshot snapshot;
+    pLatency->GetSnapshot(&snapshot);
+    if (snapshot.nCount != uFrames || snapshot.GetQuantileUs(0.5) < 1500 || pDepth->Get() != 0 || iMaxDepth < 2 || iMaxDepth > 3)
+    {
+        printf("  FAIL pipeline: %llu latencies, median %llu us, depth %lld, at most %lld\n", (unsigned long long)snapshot.nCount,
+            (unsigned long long)snapshot.GetQuantileUs(0.5), (long long)pDepth->Get(), (long long)iMaxDepth);
+        nFailures++;
+    }
+
+    // Outputs opened for a player count into the shared registry.
+#if defined(_WIN32)
+    SetEnv(BITSTREAM_OUTPUT_ENV, "NUL");
+#else
+    SetEnv(BITSTREAM_OUTPUT_ENV, "/dev/null");
+#endif
+    MetricCounter *pBytes = MetricsRegistry::GetShared()->GetCounter("dxifrshim_output_bytes_total", "", "player=\"61\"");
+    uint64_t nBytesBefore = pBytes->Get();
+    BitstreamOutput *pOutput = OpenBitstreamOutput(61);
+    static const uint8_t s_aFrame[] = { 0, 0, 0, 1, 0x09, 0x30, 0, 0, 1, 0x41, 0x9a, 0x02, 0x03, 0x04 };
+    for (int i = 0; pOutput && i < 10; i++)
+    {
+        pOutput->WriteAccessUnit(s_aFrame, sizeof(s_aFrame), i);
+    }
+    if (pOutput)
+        CloseBitstreamOutput(pOutput);
+    if (!pOutput || pBytes->Get() - nBytesBefore != 10 * sizeof(s_aFrame))
+    {
+        printf("  FAIL output counted %llu bytes, %d expected\n", (unsigned long long)(pBytes->Get() - nBytesBefore),
+            (int)(10 * sizeof(s_aFrame)));
+        nFailures++;
+    }
+    return nFailures;
+}
+
+struct MetricsPlayerRun
+{
+    MetricCounter      *pFrames;
+    MetricCounter      *pShared;
+    MetricHistogram    *pLatency;
+    int                 nFrames;
+};
+
+static void UpdatePlayerMetrics(MetricsPlayerRun *pRun)
+{
+    for (int i = 0; i < pRun->nFrames; i++)
+    {
+        pRun->pFrames->Add();
+        pRun->pShared->Add();
+        pRun->pLatency->Record((uint64_t)(i % 20000) + 1);
+    }
+}
+
+// Players update their metrics while they are exported over and over; every
+// export must be well formed and the totals exact afterwards.
+static int VerifyMetricsConcurrent(int nPlayers, int nFrames)
+{
+    int nFailures = 0;
+    MetricsRegistry registry;
+    MetricCounter *pShared = registry.GetCounter("test_all_frames_total", "");
+    std::vector<MetricsPlayerRun> aRuns(nPlayers);
+    for (int i = 0; i < nPlayers; i++)
+    {
+        char szLabels[32];
+        sprintf(szLabels, "player=\"%d\"", i);
+        aRuns[i].pFrames = registry.GetCounter("test_frames_total", "", szLabels);
+        aRuns[i].pShared = pShared;
+        aRuns[i].pLatency = registry.GetHistogram("test_latency_seconds", "", szLabels);
+        aRuns[i].nFrames = nFrames;
+    }
+    std::vector<std::thread> aThreads;
+    for (int i = 0; i < nPlayers; i++)
+    {
+        aThreads.push_back(std::thread(UpdatePlayerMetrics, &aRuns[i]));
+    }
+    for (int i = 0; i < 20 && !nFailures; i++)
+    {
+        std::string text;
+        registry.WritePrometheus(&text);
+        nFailures += CheckPrometheusText(text);
+    }
+    for (int i = 0; i < nPlayers; i++)
+    {
+        aThreads[i].join();
+    }
+
+    MetricHistogramSnapshot snapshot;
+    for (int i = 0; i < nPlayers; i++)
+    {
+        aRuns[i].pLatency->GetSnapshot(&snapshot);
+        if (aRuns[i].pFrames->Get() != (uint64_t)nFrames || snapshot.nCount != (uint64_t)nFrames)
+        {
+            printf("  FAIL player %d: %llu frames, %llu latencies\n", i, (unsigned long long)aRuns[i].pFrames->Get(),
+                (unsigned long long)snapshot.nCount);
+            nFailures++;
+        }
+    }
+    if (pShared->Get() != (uint64_t)nPlayers * nFrames)
+    {
+        printf("  FAIL shared counter %llu\n", (unsigned long long)pShared->Get());
+        nFailures++;
+    }
+    return nFailures;
+}
+
+static int RunMetrics(const Options &opt)
+{
+    int nFailures = VerifyMetricBuckets();
+    nFailures += VerifyMetricHistogram();
+    nFailures += VerifyMetricsRegistry();
+    nFailures += VerifyMetricsWiring();
+    nFailures += VerifyMetricsConcurrent(4, 20000);
+    printf("Metrics: %s\n", nFailures ? "FAILED" : "passed");
+
+    // What the encoder loop pays per update, and what a scrape costs with
+    // the metrics of 16 players registered.
+    MetricsRegistry registry;
+    MetricCounter *pCounter = registry.GetCounter("bench_frames_total", "");
+    MetricGauge *pGauge = registry.GetGauge("bench_bitrate_bps", "");
+    MetricHistogram *pHistogram = registry.GetHistogram("bench_encode_seconds", "");
+    int nUpdates = opt.iterations * 100000;
+    double t0 = NowMs();
+    for (int i = 0; i < nUpdates; i++)
+    {
+        pCounter->Add();
+    }
+    double fCounterNs = (NowMs() - t0) * 1e6 / nUpdates;
+    t0 = NowMs();
+    for (int i = 0; i < nUpdates; i++)
+    {
+        pGauge->Set(i);
+    }
+    double fGaugeNs = (NowMs() - t0) * 1e6 / nUpdates;
+    t0 = NowMs();
+    for (int i = 0; i < nUpdates; i++)
+    {
+        pHistogram->Record((uint64_t)(i & 0xffff) * 37);
+    }
+    double fHistogramNs = (NowMs() - t0) * 1e6 / nUpdates;
+
+    for (int i = 0; i < 16; i++)
+    {
+        char szLabels[32];
+        sprintf(szLabels, "player=\"%d\"", i);
+        registry.GetCounter("bench_frames_total", "", szLabels)->Add(i);
+        registry.GetCounter("bench_bytes_total", "", szLabels)->Add(i);
+        registry.GetGauge("bench_bitrate_bps", "", szLabels)->Set(i);
+        registry.GetHistogram("bench_encode_seconds", "", szLabels)->Record(i * 1000);
+        registry.GetHistogram("bench_latency_seconds", "", szLabels)->Record(i * 1000);
+    }
+    int nScrapes = opt.iterations * 10;
+    size_t nBytes = 0;
+    t0 = NowMs();
+    for (int i = 0; i < nScrapes; i++)
+    {
+        std::string text;
+        registry.WritePrometheus(&text);
+        nBytes = text.size();
+    }
+    double fScrapeUs = (NowMs() - t0) * 1e3 / nScrapes;
+
+    printf("  counter add     %8.1f ns\n", fCounterNs);
+    printf("  gauge set       %8.1f ns\n", fGaugeNs);
+    printf("  histogram       %8.1f ns per value\n", fHistogramNs);
+    printf("  scrape          %8.1f us for 16 players (%d bytes)\n", fScrapeUs, (int)nBytes);
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Split-screen tiles
+
+static bool CheckTiles(const FrameTiler &tiler, const char *szCase, const int (*aExpected)[4], int nTiles)
+{
+    bool bOk = tiler.GetTileCount() == nTiles;
+    for (int i = 0; bOk && i < nTiles; i++)
+    {
+        const FrameTile &tile = tiler.GetTile(i);
+        bOk = tile.x == aExpected[i][0] && tile.y == aExpected[i][1] &&
+              tile.width == aExpected[i][2] && tile.height == aExpected[i][3];
+    }
+    if (!bOk)
+    {
+        printf("  FAIL tiler %s: %d tiles\n", szCase, tiler.GetTileCount());
+    }
+    return bOk;
+}
+
+static int VerifyFrameTilerLayout()
+{
+    int nFailures = 0;
+    FrameTiler tiler;
+
+    static const int aQuad[][4] = { { 0, 0, 960, 540 }, { 960, 0, 960, 540 }, { 0, 540, 960, 540 }, { 960, 540, 960, 540 } };
+    nFailures += !(tiler.Init(1920, 1080, 2, 2, 960, 540, 4) && CheckTiles(tiler, "2x2", aQuad, 4));
+
+    // Three players on a 2x2 grid leave the last cell empty.
+    nFailures += !(tiler.Init(1920, 1080, 2, 2, 960, 540, 3) && CheckTiles(tiler, "3 on 2x2", aQuad, 3));
+
+    static const int aRow[][4] = { { 0, 0, 640, 1080 }, { 640, 0, 640, 1080 }, { 1280, 0, 640, 1080 } };
+    nFailures += !(tiler.Init(1920, 1080, 1, 3, 640, 1080, 3) && CheckTiles(tiler, "1x3", aRow, 3));
+
+    // Odd cells: every tile starts and ends on an even pixel.
+    static const int aOdd[][4] = { { 0, 0, 640, 360 }, { 640, 0, 640, 360 }, { 0, 360, 640, 360 }, { 640, 360, 640, 360 } };
+    nFailures += !(tiler.Init(1283, 723, 2, 2, 641, 361, 4) && CheckTiles(tiler, "odd cells", aOdd, 4));
+
+    // Layouts that do not fit are refused and leave no tiles.
+    static const int aBad[][7] =
+    {
+        { 1920, 1080, 2, 2, 960, 540, 5 },      // more players than cells
+        { 1920, 1080, 1, 2, 960, 540, 3 },      // same, with room for them in the frame
+        { 1920, 1080, 2, 2, 962, 540, 4 },      // too wide
+        { 1920, 1080, 3, 1, 1920, 361, 3 },     // too tall
+        { 1920, 1080, 0, 2, 960, 540, 1 },      // no rows
+        { 1920, 1080, 1, 1, 1, 1080, 1 },       // narrower than a chroma pixel
+        { 1920, 1080, 1, 1, 1920, 1080, 0 },    // no players
+    };
+    for (size_t i = 0; i < sizeof(aBad) / sizeof(aBad[0]); i++)
+    {
+        const int *p = aBad[i];
+        if (tiler.Init(p[0], p[1], p[2], p[3], p[4], p[5], p[6]) || tiler.GetTileCount())
+        {
+            printf("  FAIL tiler accepted bad layout %d\n", (int)i);
+            nFailures++;
+        }
+    }
+    return nFailures;
+}
+
+// Every tile, copied out of its view or converted straight from it, has to
+// match a crop made pixel by pixel.
+static int VerifyFrameTilerViews(int width, int height, int rows, int cols, int nTiles)
+{
+    int nFailures = 0;
+    std::vector<unsigned char> frame(width * height * 3 / 2);
+    FillRandom(&frame[0], frame.size());
+    const unsigned char *pU = &frame[width * height], *pV = pU + width * height / 4;
+
+    FrameTiler tiler;
+    if (!tiler.Init(width, height, rows, cols, width / cols, height / rows, nTiles))
+    {
+        printf("  FAIL tiler %dx%d on %dx%d\n", rows, cols, width, height);
+        return 1;
+    }
+    for (int i = 0; i < nTiles; i++)
+    {
+        const FrameTile &tile = tiler.GetTile(i);
+        int tw = tile.width, th = tile.height;
+        std::vector<unsigned char> ref(tw * th * 3 / 2);
+        unsigned char *pRefU = &ref[tw * th], *pRefV = pRefU + tw * th / 4;
+        for (int y = 0; y < th; y++)
+        {
+            for (int x = 0; x < tw; x++)
+            {
+                ref[y * tw + x] = frame[(tile.y + y) * width + tile.x + x];
+            }
+        }
+        for (int y = 0; y < th / 2; y++)
+        {
+            for (int x = 0; x < tw / 2; x++)
+            {
+                pRefU[y * tw / 2 + x] = pU[(tile.y / 2 + y) * width / 2 + tile.x / 2 + x];
+                pRefV[y * tw / 2 + x] = pV[(tile.y / 2 + y) * width / 2 + tile.x / 2 + x];
+            }
+        }
+
+        // Zero-copy: the view is the captured frame itself.
+        YuvI420View view = tiler.GetTileView(&frame[0], i);
+        if (view.pY != &frame[tile.y * width + tile.x] || view.strideY != width || view.strideUV != width / 2 ||
+            view.width != tw || view.height != th)
+        {
+            printf("  FAIL tile %d of %dx%d does not point into the frame\n", i, width, height);
+            nFailures++;
+            continue;
+        }
+
+        std::vector<unsigned char> copy(ref.size(), 0xCD);
+        YuvCopyView(view, &copy[0]);
+        if (copy != ref)
+        {
+            printf("  FAIL tile %d of %dx%d copied from its view\n", i, width, height);
+            nFailures++;
+        }
+
+        int dstStride = (tw + 255) & ~255;
+        std::vector<unsigned char> nv12Ref(dstStride * th * 3 / 2, 0xCD), nv12(dstStride * th * 3 / 2, 0xCD);
+        YuvI420ToNV12_C(&ref[0], pRefU, pRefV, tw, tw / 2, &nv12Ref[0], &nv12Ref[dstStride * th], dstStride, tw, th);
+        YuvI420ToNV12(view.pY, view.pU, view.pV, view.strideY, view.strideUV, &nv12[0], &nv12[dstStride * th], dstStride, tw, th);
+        if (nv12 != nv12Ref)
+        {
+            printf("  FAIL tile %d of %dx%d converted from its view\n", i, width, height);
+            nFailures++;
+        }
+    }
+    return nFailures;
+}
+
+static int VerifyFrameTilerChanges()
+{
+    int nFailures = 0;
+    int width = 1920, height = 1080;
+    std::vector<unsigned char> frame(width * height * 3 / 2);
+    FillRandom(&frame[0], frame.size());
+    unsigned char *pU = &frame[width * height], *pV = pU + width * height / 4;
+    FrameTiler tiler;
+    tiler.Init(width, height, 2, 2, width / 2, height / 2, 4);
+    TileChangeDetector detector;
+    detector.Init(width, height);
+    detector.Update(&frame[0], pU, pV, width, width / 2);
+
+    // 540 is not a multiple of 64, so the hash tile row at 512..575 straddles
+    // the top and the bottom tiles; a change there is in both.
+    static const int aChanges[][6] =
+    {
+        // x, y, then which of the four tiles changed
+        { 10, 10, 1, 0, 0, 0 },
+        { 1900, 10, 0, 1, 0, 0 },
+        { 1000, 1070, 0, 0, 0, 1 },
+        { 100, 530, 1, 0, 1, 0 },
+    };
+    for (size_t c = 0; c < sizeof(aChanges) / sizeof(aChanges[0]); c++)
+    {
+        frame[aChanges[c][1] * width + aChanges[c][0]] ^= 0xFF;
+        detector.Update(&frame[0], pU, pV, width, width / 2);
+        for (int i = 0; i < 4; i++)
+        {
+            int nChanged = tiler.CountChangedHashTiles(i, detector);
+            if ((nChanged != 0) != (aChanges[c][2 + i] != 0) || nChanged > 1)
+            {
+                printf("  FAIL change %d: tile %d has %d changed hash tiles\n", (int)c, i, nChanged);
+                nFailures++;
+            }
+        }
+    }
+    detector.Update(&frame[0], pU, pV, width, width / 2);
+    for (int i = 0; i < 4; i++)
+    {
+        if (tiler.CountChangedHashTiles(i, detector))
+        {
+            printf("  FAIL tile %d changed on an unchanged frame\n", i);
+            nFailures++;
+        }
+    }
+    return nFailures;
+}
+
+// The null encoder takes a tile like a frame.
+static int VerifyNullEncoderView()
+{
+    std::vector<unsigned char> frame(1920 * 1080 * 3 / 2);
+    FrameTiler tiler;
+    tiler.Init(1920, 1080, 2, 2, 960, 540, 4);
+    CNullEncoder encoder;
+    if (encoder.EncodeMain(3, 960, 540, 30, 2000000))
+    {
+        printf("  FAIL null encoder EncodeMain 960x540\n");
+        return 1;
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        encoder.EncodeView(tiler.GetTileView(&frame[0], 3), false, 3, 2000000);
+    }
+    int nFrames = (int)encoder.GetFrameCount();
+    encoder.Shutdown();
+    if (nFrames != 10)
+    {
+        printf("  FAIL null encoder encoded %d of 10 tiles\n", nFrames);
+        return 1;
+    }
+    return 0;
+}
+
+// What the encoders of a split screen read per captured frame: before, each
+// player's ffmpeg was sent the whole frame through a pipe and cropped its
+// tile; now each tile is converted from its view into the encoder's input.
+struct TileConvertJob
+{
+    const FrameTiler           *pTiler;
+    const unsigned char        *pFrame;
+    std::vector<unsigned char> *aSurfaces;
+    int                         dstStride;
+
+    void operator()(int i)
+    {
+        YuvI420View view = pTiler->GetTileView(pFrame, i);
+        unsigned char *pDst = &aSurfaces[i][0];
+        YuvI420ToNV12(view.pY, view.pU, view.pV, view.strideY, view.strideUV,
+                      pDst, pDst + dstStride * view.height, dstStride, view.width, view.height);
+    }
+};
+
+static int RunFrameTiler(const Options &opt)
+{
+    int nFailures = VerifyFrameTilerLayout();
+    static const int aLayouts[][5] = { { 1920, 1080, 2, 2, 4 }, { 1920, 1080, 2, 2, 3 }, { 1280, 720, 1, 4, 4 }, { 1286, 726, 3, 3, 9 } };
+    for (size_t i = 0; i < sizeof(aLayouts) / sizeof(aLayouts[0]); i++)
+    {
+        nFailures += VerifyFrameTilerViews(aLayouts[i][0], aLayouts[i][1], aLayouts[i][2], aLayouts[i][3], aLayouts[i][4]);
+    }
+    nFailures += VerifyFrameTilerChanges();
+    nFailures += VerifyNullEncoderView();
+    printf("Split-screen tiles: %s\n", nFailures ? "FAILED" : "passed");
+
+    int width = opt.width, height = opt.height;
+    std::vector<unsigned char> frame(width * height * 3 / 2);
+    FillRandom(&frame[0], frame.size());
+    static const int aGrids[][2] = { { 1, 2 }, { 2, 2 }, { 3, 3 } };
+    for (size_t g = 0; g < sizeof(aGrids) / sizeof(aGrids[0]); g++)
+    {
+        int rows = aGrids[g][0], cols = aGrids[g][1], nTiles = rows * cols;
+        FrameTiler tiler;
+        if (!tiler.Init(width, height, rows, cols, width / cols, height / rows, nTiles))
+            continue;
+        int tw = tiler.GetTile(0).width, th = tiler.GetTile(0).height;
+        int dstStride = (tw + 255) & ~255;
+        std::vector<std::vector<unsigned char> > aSurfaces(nTiles, std::vector<unsigned char>(dstStride * th * 3 / 2));
+        std::vector<unsigned char> pipe(frame.size()), crop(tw * th * 3 / 2);
+
+        // Each player's copy of the frame, its crop, then its conversion.
+        double t0 = NowMs();
+        for (int it = 0; it < opt.iterations; it++)
+        {
+            for (int i = 0; i < nTiles; i++)
+            {
+                memcpy(&pipe[0], &frame[0], frame.size());
+                YuvCopyView(tiler.GetTileView(&pipe[0], i), &crop[0]);
+                unsigned char *pDst = &aSurfaces[i][0];
+                YuvI420ToNV12(&crop[0], &crop[tw * th], &crop[tw * th * 5 / 4], tw, tw / 2,
+                              pDst, pDst + dstStride * th, dstStride, tw, th);
+            }
+        }
+        double fPipeMs = (NowMs() - t0) / opt.iterations;
+
+        TileConvertJob job = { &tiler, &frame[0], &aSurfaces[0], dstStride };
+        t0 = NowMs();
+        for (int it = 0; it < opt.iterations; it++)
+        {
+            for (int i = 0; i < nTiles; i++)
+            {
+                job(i);
+            }
+        }
+        double fViewMs = (NowMs() - t0) / opt.iterations;
+
+        WorkerPool *pPool = WorkerPool::GetShared();
+        t0 = NowMs();
+        for (int it = 0; it < opt.iterations; it++)
+        {
+            pPool->ParallelFor(nTiles, job);
+        }
+        double fParallelMs = (NowMs() - t0) / opt.iterations;
+
+        printf("  %dx%d of %dx%d: full frame per player %7.3f ms, views %7.3f ms, views on %d threads %7.3f ms\n",
+            rows, cols, tw, th, fPipeMs, fViewMs, pPool->GetThreadCount(), fParallelMs);
+    }
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// RGB -> YUV conversion
+
+static const RgbFormat s_aRgbFormats[] = { RGB_FORMAT_BGRA, RGB_FORMAT_RGBA, RGB_FORMAT_ARGB, RGB_FORMAT_RGB, RGB_FORMAT_BGR };
+static const char *s_aRgbFormatNames[] = { "BGRA", "RGBA", "ARGB", "RGB", "BGR" };
+
+// Writes r, g and b of one pixel in the byte order of a format.
+static void PutRgbPixel(unsigned char *p, RgbFormat eFormat, int r, int g, int b)
+{
+    switch (eFormat)
+    {
+    case RGB_FORMAT_BGRA: p[0] = (unsigned char)b; p[1] = (unsigned char)g; p[2] = (unsigned char)r; p[3] = 0x5A; break;
+    case RGB_FORMAT_RGBA: p[0] = (unsigned char)r; p[1] = (unsigned char)g; p[2] = (unsigned char)b; p[3] = 0x5A; break;
+    case RGB_FORMAT_ARGB: p[0] = 0x5A; p[1] = (unsigned char)r; p[2] = (unsigned char)g; p[3] = (unsigned char)b; break;
+    case RGB_FORMAT_RGB:  p[0] = (unsigned char)r; p[1] = (unsigned char)g; p[2] = (unsigned char)b; break;
+    case RGB_FORMAT_BGR:  p[0] = (unsigned char)b; p[1] = (unsigned char)g; p[2] = (unsigned char)r; break;
+    }
+}
+
+// Every kernel level against the scalar one, for all formats, matrices and
+// ranges, at widths around the vector sizes and with padded strides. The
+// destinations start filled with 0xCD, so a write past a row shows up too.
+static int VerifyRgbKernels()
+{
+    static const int aWidths[] = { 1, 2, 3, 7, 8, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65, 129 };
+    static const int aHeights[] = { 1, 2, 3, 5 };
+    static const int aPads[] = { 0, 1, 13 };
+    int nFailures = 0;
+
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (RgbSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+
+        for (size_t f = 0; f < sizeof(s_aRgbFormats) / sizeof(s_aRgbFormats[0]); f++)
+        for (int c = 0; c < 4; c++)
+        for (size_t w = 0; w < sizeof(aWidths) / sizeof(aWidths[0]); w++)
+        for (size_t h = 0; h < sizeof(aHeights) / sizeof(aHeights[0]); h++)
+        for (size_t p = 0; p < sizeof(aPads) / sizeof(aPads[0]); p++)
+        {
+            RgbFormat eFormat = s_aRgbFormats[f];
+            YuvMatrix eMatrix = c & 1 ? YUV_MATRIX_BT709 : YUV_MATRIX_BT601;
+            YuvRange eRange = c & 2 ? YUV_RANGE_FULL : YUV_RANGE_LIMITED;
+            int width = aWidths[w], height = aHeights[h], pad = aPads[p];
+            int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+            int srcStride = width * RgbGetBytesPerPixel(eFormat) + pad;
+            std::vector<unsigned char> src(srcStride * height);
+            FillRandom(&src[0], src.size());
+
+            const char *szLayout = NULL;
+            int dstStride = 2 * chromaWidth + pad, dstStrideUV = chromaWidth + pad;
+            size_t size420 = (size_t)dstStride * (height + chromaHeight);
+            std::vector<unsigned char> ref(size420, 0xCD), out(size420, 0xCD);
+            RgbToNV12_C(&src[0], srcStride, eFormat, &ref[0], &ref[dstStride * height], dstStride, width, height, eMatrix, eRange);
+            RgbToNV12(&src[0], srcStride, eFormat, &out[0], &out[dstStride * height], dstStride, width, height, eMatrix, eRange);
+            if (ref != out)
+                szLayout = "NV12";
+
+            size_t sizeI420 = (size_t)dstStride * height + 2 * dstStrideUV * chromaHeight;
+            ref.assign(sizeI420, 0xCD);
+            out.assign(sizeI420, 0xCD);
+            size_t offsetU = (size_t)dstStride * height, offsetV = offsetU + dstStrideUV * chromaHeight;
+            RgbToI420_C(&src[0], srcStride, eFormat, &ref[0], &ref[offsetU], &ref[offsetV], dstStride, dstStrideUV,
+                width, height, eMatrix, eRange);
+            RgbToI420(&src[0], srcStride, eFormat, &out[0], &out[offsetU], &out[offsetV], dstStride, dstStrideUV,
+                width, height, eMatrix, eRange);
+            if (ref != out)
+                szLayout = "I420";
+
+            size_t planeSize = (size_t)dstStride * height;
+            ref.assign(3 * planeSize, 0xCD);
+            out.assign(3 * planeSize, 0xCD);
+            RgbToYUV444_C(&src[0], srcStride, eFormat, &ref[0], &ref[planeSize], &ref[2 * planeSize], dstStride,
+                width, height, eMatrix, eRange);
+            RgbToYUV444(&src[0], srcStride, eFormat, &out[0], &out[planeSize], &out[2 * planeSize], dstStride,
+                width, height, eMatrix, eRange);
+            if (ref != out)
+                szLayout = "YUV444";
+
+            if (szLayout)
+            {
+                printf("  FAIL %s->%s %s %s %s %dx%d pad %d\n", s_aRgbFormatNames[f], szLayout, GetSimdLevelName(s_aLevels[l]),
+                    eMatrix == YUV_MATRIX_BT709 ? "BT.709" : "BT.601", eRange == YUV_RANGE_FULL ? "full" : "limited",
+                    width, height, pad);
+                nFailures++;
+            }
+        }
+    }
+    RgbSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+// Returns true if a converted value is within 1 of the exact one, clamped
+// to a byte as the kernels clamp.
+static bool NearReference(int value, double exact)
+{
+    exact = exact < 0.0 ? 0.0 : (exact > 255.0 ? 255.0 : exact);
+    return fabs(value - exact) <= 1.0;
+}
+
+// The scalar kernels against RgbToYuvReference: every luma sample, and every
+// chroma sample against the exact chroma of its block's average colour. The
+// picture has random pixels, the primaries, black, white and a grey ramp;
+// greys must come out exactly, with chroma at 128.
+static int VerifyRgbAccuracy(RgbFormat eFormat, YuvMatrix eMatrix, YuvRange eRange)
+{
+    const int width = 67, height = 41;
+    int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+    int bpp = RgbGetBytesPerPixel(eFormat), srcStride = width * bpp + 3;
+    std::vector<int> rgb(width * height * 3);
+    std::vector<unsigned char> src(srcStride * height);
+    static const int aFixed[][3] = { { 255, 0, 0 }, { 0, 255, 0 }, { 0, 0, 255 }, { 255, 255, 0 }, { 0, 255, 255 }, { 255, 0, 255 } };
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int *p = &rgb[(y * width + x) * 3];
+            unsigned char random[3];
+            FillRandom(random, 3);
+            p[0] = random[0];
+            p[1] = random[1];
+            p[2] = random[2];
+            if (y == 0)
+            {
+                // The top row is a grey ramp from black to white.
+                p[0] = p[1] = p[2] = x * 255 / (width - 1);
+            }
+            else if (y < 3 && x < 12)
+            {
+                const int *pFixed = aFixed[x / 2];
+                p[0] = pFixed[0];
+                p[1] = pFixed[1];
+                p[2] = pFixed[2];
+            }
+            PutRgbPixel(&src[y * srcStride + x * bpp], eFormat, p[0], p[1], p[2]);
+        }
+    }
+
+    std::vector<unsigned char> dstY(width * height), dstU(chromaWidth * chromaHeight), dstV(chromaWidth * chromaHeight);
+    std::vector<unsigned char> dst444(3 * width * height);
+    RgbToI420_C(&src[0], srcStride, eFormat, &dstY[0], &dstU[0], &dstV[0], width, chromaWidth, width, height, eMatrix, eRange);
+    RgbToYUV444_C(&src[0], srcStride, eFormat, &dst444[0], &dst444[width * height], &dst444[2 * width * height], width,
+        width, height, eMatrix, eRange);
+
+    int nWrong = 0;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const int *p = &rgb[(y * width + x) * 3];
+            double fY, fU, fV;
+            RgbToYuvReference(p[0], p[1], p[2], eMatrix, eRange, &fY, &fU, &fV);
+            int i = y * width + x;
+            int u444 = dst444[width * height + i], v444 = dst444[2 * width * height + i];
+            if (!NearReference(dstY[i], fY) || dst444[i] != dstY[i] || !NearReference(u444, fU) || !NearReference(v444, fV))
+                nWrong++;
+            if (y == 0 && (dstY[i] != (int)floor(fY + 0.5) || u444 != 128 || v444 != 128))
+                nWrong++;
+        }
+    }
+    for (int cy = 0; cy < chromaHeight; cy++)
+    {
+        for (int cx = 0; cx < chromaWidth; cx++)
+        {
+            // A last odd column or row is averaged with itself.
+            int ax[2] = { 2 * cx, 2 * cx + 1 < width ? 2 * cx + 1 : 2 * cx };
+            int ay[2] = { 2 * cy, 2 * cy + 1 < height ? 2 * cy + 1 : 2 * cy };
+            double sum[3] = { 0.0, 0.0, 0.0 };
+            for (int j = 0; j < 4; j++)
+            {
+                const int *p = &rgb[(ay[j / 2] * width + ax[j % 2]) * 3];
+                sum[0] += p[0] / 4.0;
+                sum[1] += p[1] / 4.0;
+                sum[2] += p[2] / 4.0;
+            }
+            double fY, fU, fV;
+            RgbToYuvReference(sum[0], sum[1], sum[2], eMatrix, eRange, &fY, &fU, &fV);
+            int i = cy * chromaWidth + cx;
+            if (!NearReference(dstU[i], fU) || !NearReference(dstV[i], fV))
+                nWrong++;
+        }
+    }
+    // Black and white rows of the grey ramp land on the ends of the range.
+    int black = eRange == YUV_RANGE_FULL ? 0 : 16, white = eRange == YUV_RANGE_FULL ? 255 : 235;
+    if (dstY[0] != black || dstY[width - 1] != white)
+        nWrong++;
+
+    if (nWrong)
+    {
+        printf("  FAIL %s %s %s: %d samples off the reference\n", s_aRgbFormatNames[eFormat],
+            eMatrix == YUV_MATRIX_BT709 ? "BT.709" : "BT.601", eRange == YUV_RANGE_FULL ? "full" : "limited", nWrong);
+        return 1;
+    }
+    return 0;
+}
+
+// What a conversion costs without the kernels: the exact formulas per
+// pixel, in double precision, as Bitmap.cpp does for its YUV dumps.
+static void RgbToNV12Float(const unsigned char *pSrc, int srcStride, unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+                           int width, int height)
+{
+    for (int y = 0; y < height; y += 2)
+    {
+        for (int x = 0; x < width; x += 2)
+        {
+            double sumU = 0.0, sumV = 0.0;
+            for (int j = 0; j < 4; j++)
+            {
+                const unsigned char *p = pSrc + (y + j / 2) * srcStride + (x + j % 2) * 4;
+                double fY, fU, fV;
+                RgbToYuvReference(p[2], p[1], p[0], YUV_MATRIX_BT709, YUV_RANGE_LIMITED, &fY, &fU, &fV);
+                pDstY[(y + j / 2) * dstStride + x + j % 2] = (unsigned char)(fY + 0.5);
+                sumU += fU;
+                sumV += fV;
+            }
+            pDstUV[y / 2 * dstStride + x] = (unsigned char)(sumU / 4.0 + 0.5);
+            pDstUV[y / 2 * dstStride + x + 1] = (unsigned char)(sumV / 4.0 + 0.5);
+        }
+    }
+}
+
+static int RunRgbConvert(const Options &opt)
+{
+    int nFailures = VerifyRgbKernels();
+    int nAccuracyFailures = 0;
+    for (size_t f = 0; f < sizeof(s_aRgbFormats) / sizeof(s_aRgbFormats[0]); f++)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            nAccuracyFailures += VerifyRgbAccuracy(s_aRgbFormats[f], c & 1 ? YUV_MATRIX_BT709 : YUV_MATRIX_BT601,
+                c & 2 ? YUV_RANGE_FULL : YUV_RANGE_LIMITED);
+        }
+    }
+    printf("RGB->YUV verification: %s\n", nFailures || nAccuracyFailures ? "FAILED" : "passed");
+    nFailures += nAccuracyFailures;
+
+    int width = opt.width & ~1, height = opt.height & ~1;
+    int srcStride = width * 4, dstStride = (width + 255) & ~255;
+    std::vector<unsigned char> src(srcStride * height), dst(dstStride * height * 3);
+    FillRandom(&src[0], src.size());
+    unsigned char *pDstUV = &dst[dstStride * height];
+
+    int nFloatIterations = opt.iterations / 10 + 1;
+    double t0 = NowMs();
+    for (int i = 0; i < nFloatIterations; i++)
+    {
+        RgbToNV12Float(&src[0], srcStride, &dst[0], pDstUV, dstStride, width, height);
+    }
+    double ms = (NowMs() - t0) / nFloatIterations;
+    printf("  %-7s %dx%d BGRA->NV12: %7.3f ms/frame, %6.2f GB/s\n", "double", width, height, ms, src.size() / (ms * 1.0e6));
+
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (RgbSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+        t0 = NowMs();
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            RgbToNV12(&src[0], srcStride, RGB_FORMAT_BGRA, &dst[0], pDstUV, dstStride, width, height,
+                YUV_MATRIX_BT709, YUV_RANGE_LIMITED);
+        }
+        ms = (NowMs() - t0) / opt.iterations;
+        double fNV12Ms = ms;
+
+        t0 = NowMs();
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            RgbToYUV444(&src[0], srcStride, RGB_FORMAT_BGRA, &dst[0], &dst[dstStride * height], &dst[2 * dstStride * height],
+                dstStride, width, height, YUV_MATRIX_BT709, YUV_RANGE_LIMITED);
+        }
+        ms = (NowMs() - t0) / opt.iterations;
+        printf("  %-7s %dx%d BGRA->NV12: %7.3f ms/frame, %6.2f GB/s; ->YUV444: %7.3f ms/frame\n", GetSimdLevelName(s_aLevels[l]),
+            width, height, fNV12Ms, src.size() / (fNV12Ms * 1.0e6), ms);
+    }
+    RgbSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// YUV -> BGR bitmap dumps
+
+static const YuvLayout s_aYuvLayouts[] = { YUV_LAYOUT_I420, YUV_LAYOUT_NV12, YUV_LAYOUT_YUV444 };
+static const char *s_aYuvLayoutNames[] = { "I420", "NV12", "YUV444" };
+
+// Every kernel level against the scalar one, with the row written into a
+// buffer filled with 0xCD so that a write past 3 * width bytes shows up.
+static int VerifyYuvRowToBGR()
+{
+    static const int aWidths[] = { 1, 2, 3, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65, 129, 1283 };
+    int nFailures = 0;
+
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (RgbSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+
+        for (size_t f = 0; f < sizeof(s_aYuvLayouts) / sizeof(s_aYuvLayouts[0]); f++)
+        for (int c = 0; c < 4; c++)
+        for (size_t w = 0; w < sizeof(aWidths) / sizeof(aWidths[0]); w++)
+        {
+            YuvMatrix eMatrix = c & 1 ? YUV_MATRIX_BT709 : YUV_MATRIX_BT601;
+            YuvRange eRange = c & 2 ? YUV_RANGE_FULL : YUV_RANGE_LIMITED;
+            int width = aWidths[w];
+            std::vector<unsigned char> y(width), u(width + 1), v(width + 1);
+            FillRandom(&y[0], y.size());
+            FillRandom(&u[0], u.size());
+            FillRandom(&v[0], v.size());
+            std::vector<unsigned char> ref(3 * width + 64, 0xCD), out(3 * width + 64, 0xCD);
+            YuvRowToBGR_C(&y[0], &u[0], &v[0], s_aYuvLayouts[f], &ref[0], width, eMatrix, eRange);
+            YuvRowToBGR(&y[0], &u[0], &v[0], s_aYuvLayouts[f], &out[0], width, eMatrix, eRange);
+            if (ref != out)
+            {
+                printf("  FAIL %s->BGR %s %s %s width %d\n", s_aYuvLayoutNames[f], GetSimdLevelName(s_aLevels[l]),
+                    eMatrix == YUV_MATRIX_BT709 ? "BT.709" : "BT.601", eRange == YUV_RANGE_FULL ? "full" : "limited", width);
+                nFailures++;
+            }
+        }
+    }
+    RgbSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+// The scalar kernel against YuvToRgbReference for random samples, and greys
+// (chroma at 128) for every luma value, which must come out exactly grey.
+static int VerifyYuvToBGRAccuracy(YuvMatrix eMatrix, YuvRange eRange)
+{
+    const int width = 4096;
+    std::vector<unsigned char> y(width), u(width), v(width), bgr(3 * width);
+    FillRandom(&y[0], width);
+    FillRandom(&u[0], width);
+    FillRandom(&v[0], width);
+    for (int x = 0; x < 256; x++)
+    {
+        y[x] = (unsigned char)x;
+        u[x] = v[x] = 128;
+    }
+    YuvRowToBGR_C(&y[0], &u[0], &v[0], YUV_LAYOUT_YUV444, &bgr[0], width, eMatrix, eRange);
+
+    int nWrong = 0;
+    for (int x = 0; x < width; x++)
+    {
+        double r, g, b;
+        YuvToRgbReference(y[x], u[x], v[x], eMatrix, eRange, &r, &g, &b);
+        const unsigned char *p = &bgr[3 * x];
+        if (!NearReference(p[0], b) || !NearReference(p[1], g) || !NearReference(p[2], r))
+            nWrong++;
+        if (x < 256 && (p[0] != p[1] || p[1] != p[2]))
+            nWrong++;
+    }
+    if (nWrong)
+    {
+        printf("  FAIL YUV->BGR %s %s: %d pixels off the reference\n", eMatrix == YUV_MATRIX_BT709 ? "BT.709" : "BT.601",
+            eRange == YUV_RANGE_FULL ? "full" : "limited", nWrong);
+        return 1;
+    }
+    return 0;
+}
+
+// A test picture with ramps, a checkerboard and chroma over its whole range,
+// so that the golden images cover clamping on both sides.
+struct GoldenYuvFrame
+{
+    int                         width;
+    int                         height;
+    std::vector<unsigned char>  y;
+    std::vector<unsigned char>  u;      // (width + 1) / 2 by (height + 1) / 2
+    std::vector<unsigned char>  v;
+};
+
+static void MakeGoldenYuvFrame(int width, int height, GoldenYuvFrame *pFrame)
+{
+    int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+    pFrame->width = width;
+    pFrame->height = height;
+    pFrame->y.resize(width * height);
+    pFrame->u.resize(chromaWidth * chromaHeight);
+    pFrame->v.resize(chromaWidth * chromaHeight);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            pFrame->y[y * width + x] = (unsigned char)(x * 3 + y * 5 + ((x ^ y) & 16) * 4);
+        }
+    }
+    for (int y = 0; y < chromaHeight; y++)
+    {
+        for (int x = 0; x < chromaWidth; x++)
+        {
+            pFrame->u[y * chromaWidth + x] = (unsigned char)(x * 7 - y * 2);
+            pFrame->v[y * chromaWidth + x] = (unsigned char)(y * 9 + (x / 16) * 37);
+        }
+    }
+}
+
+static void PutLittleEndian(std::vector<unsigned char> &bytes, uint32_t value, int nBytes)
+{
+    for (int i = 0; i < nBytes; i++)
+    {
+        bytes.push_back((unsigned char)((uint64_t)value >> (8 * i)));
+    }
+}
+
+// The bitmap file SaveYUV420, SaveNV12 or SaveYUV444 writes for the golden
+// frame, laid out in the given format first.
+static std::vector<unsigned char> MakeGoldenBitmap(const GoldenYuvFrame &frame, YuvLayout eLayout, std::vector<unsigned char> *pYuv)
+{
+    int width = frame.width, height = frame.height;
+    int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+    std::vector<unsigned char> &yuv = *pYuv;
+    yuv.assign(frame.y.begin(), frame.y.end());
+    if (eLayout == YUV_LAYOUT_I420)
+    {
+        yuv.insert(yuv.end(), frame.u.begin(), frame.u.end());
+        yuv.insert(yuv.end(), frame.v.begin(), frame.v.end());
+    }
+    else if (eLayout == YUV_LAYOUT_NV12)
+    {
+        // Pitch == width, so an odd width leaves the last V of a row at the
+        // start of the next; NV12 dumps come from even surfaces.
+        yuv.resize(width * height + width * chromaHeight);
+        for (int y = 0; y < chromaHeight; y++)
+        {
+            for (int x = 0; 2 * x < width; x++)
+            {
+                yuv[width * height + y * width + 2 * x] = frame.u[y * chromaWidth + x];
+                if (2 * x + 1 < width)
+                    yuv[width * height + y * width + 2 * x + 1] = frame.v[y * chromaWidth + x];
+            }
+        }
+    }
+    else
+    {
+        yuv.resize(3 * width * height);
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                yuv[width * height + y * width + x] = frame.u[y / 2 * chromaWidth + x / 2];
+                yuv[2 * width * height + y * width + x] = frame.v[y / 2 * chromaWidth + x / 2];
+            }
+        }
+    }
+
+    int rowSize = (width * 3 + 3) & ~3;
+    std::vector<unsigned char> bitmap;
+    bitmap.push_back('B');
+    bitmap.push_back('M');
+    PutLittleEndian(bitmap, 54 + rowSize * height, 4);
+    PutLittleEndian(bitmap, 0, 4);
+    PutLittleEndian(bitmap, 54, 4);
+    PutLittleEndian(bitmap, 40, 4);
+    PutLittleEndian(bitmap, width, 4);
+    PutLittleEndian(bitmap, height, 4);
+    PutLittleEndian(bitmap, 1, 2);
+    PutLittleEndian(bitmap, 24, 2);
+    PutLittleEndian(bitmap, 0, 4);
+    PutLittleEndian(bitmap, rowSize * height, 4);
+    PutLittleEndian(bitmap, 0, 16);
+    bitmap.resize(54 + rowSize * height, 0);
+
+    YuvRange eRange = width * height < 1280 * 720 ? YUV_RANGE_FULL : YUV_RANGE_LIMITED;
+    const unsigned char *pU = &yuv[width * height];
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char *pChromaU, *pChromaV;
+        if (eLayout == YUV_LAYOUT_I420)
+        {
+            pChromaU = pU + y / 2 * chromaWidth;
+            pChromaV = pU + chromaWidth * chromaHeight + y / 2 * chromaWidth;
+        }
+        else if (eLayout == YUV_LAYOUT_NV12)
+        {
+            pChromaU = pU + y / 2 * width;
+            pChromaV = NULL;
+        }
+        else
+        {
+            pChromaU = pU + y * width;
+            pChromaV = pU + width * height + y * width;
+        }
+        YuvRowToBGR(&yuv[y * width], pChromaU, pChromaV, eLayout, &bitmap[54 + (height - 1 - y) * rowSize], width,
+            YUV_MATRIX_BT709, eRange);
+    }
+    return bitmap;
+}
+
+// FNV-1a.
+static uint64_t HashBytes(const std::vector<unsigned char> &bytes)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < bytes.size(); i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+#if defined(_WIN32)
+static bool SaveGoldenBitmap(const char *szFileName, YuvLayout eLayout, std::vector<unsigned char> &yuv, int width, int height)
+{
+    switch (eLayout)
+    {
+    case YUV_LAYOUT_I420:
+        return SaveYUV420(szFileName, &yuv[0], width, height);
+    case YUV_LAYOUT_NV12:
+        return SaveNV12(szFileName, &yuv[0], width, height, width);
+    default:
+        return SaveYUV444(szFileName, &yuv[0], width, height);
+    }
+}
+#endif
+
+// The bitmaps of the golden frame at every level and in every layout must
+// hash to the recorded values: one full range frame, one limited range (720p
+// and up) frame with odd sizes. The same picture in I420, NV12 and YUV444
+// gives the same bitmap. On Windows the files Bitmap.cpp writes are compared
+// too.
+static int VerifyGoldenBitmaps()
+{
+    struct Golden
+    {
+        int         width;
+        int         height;
+        uint64_t    hash;
+    };
+    static const Golden aGolden[] =
+    {
+        { 68, 36, 0xa2e710d99538bb12ULL },
+        { 1283, 721, 0xc97e82eea2c9e5f0ULL },
+    };
+    int nFailures = 0;
+
+    for (size_t g = 0; g < sizeof(aGolden) / sizeof(aGolden[0]); g++)
+    {
+        GoldenYuvFrame frame;
+        MakeGoldenYuvFrame(aGolden[g].width, aGolden[g].height, &frame);
+        for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+        {
+            if (RgbSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+                continue;
+            for (size_t f = 0; f < sizeof(s_aYuvLayouts) / sizeof(s_aYuvLayouts[0]); f++)
+            {
+                // NV12 with an odd width does not hold the same picture.
+                if (s_aYuvLayouts[f] == YUV_LAYOUT_NV12 && (frame.width & 1))
+                    continue;
+                std::vector<unsigned char> yuv;
+                std::vector<unsigned char> bitmap = MakeGoldenBitmap(frame, s_aYuvLayouts[f], &yuv);
+                uint64_t hash = HashBytes(bitmap);
+                if (hash != aGolden[g].hash)
+                {
+                    printf("  FAIL golden %dx%d %s %s: hash 0x%llxULL\n", frame.width, frame.height, s_aYuvLayoutNames[f],
+                        GetSimdLevelName(s_aLevels[l]), (unsigned long long)hash);
+                    nFailures++;
+                }
+#if defined(_WIN32)
+                char szFileName[64];
+                sprintf(szFileName, "perfshim_golden_%u.bmp", (unsigned int)(NowMs() * 1000));
+                std::vector<unsigned char> written;
+                if (SaveGoldenBitmap(szFileName, s_aYuvLayouts[f], yuv, frame.width, frame.height))
+                {
+                    FILE *f = fopen(szFileName, "rb");
+                    written.resize(bitmap.size() + 1);
+                    written.resize(f ? fread(&written[0], 1, written.size(), f) : 0);
+                    if (f)
+                        fclose(f);
+                }
+                remove(szFileName);
+                if (written != bitmap)
+                {
+                    printf("  FAIL golden %dx%d %s %s: file written differs\n", frame.width, frame.height, s_aYuvLayoutNames[f],
+                        GetSimdLevelName(s_aLevels[l]));
+                    nFailures++;
+                }
+#endif
+            }
+        }
+    }
+    RgbSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+// The dump path before the row kernels, without the file: NV12 to a YUV444
+// copy, then doubles per pixel into a bitmap sized copy of the frame.
+static void LegacyNV12ToBitmap(const unsigned char *pNV12, int width, int height, unsigned char *pYuv444, unsigned char *pBitmap)
+{
+    unsigned char *oU = pYuv444 + width * height, *oV = oU + width * height;
+    const unsigned char *iU = pNV12 + width * height;
+    for (int row = 0; row < height; ++row)
+    {
+        for (int col = 0; col < width; ++col)
+        {
+            int inputIdx = (height - row - 1) * width + col;
+            int inputChIdx = ((height / 2 - row / 2 - 1) * (width / 2) + col / 2) * 2;
+            pYuv444[inputIdx] = pNV12[inputIdx];
+            oU[inputIdx] = iU[inputChIdx];
+            oV[inputIdx] = iU[inputChIdx + 1];
+        }
+    }
+    for (int row = 0; row < height; ++row)
+    {
+        for (int col = 0; col < width; ++col)
+        {
+            int inputIdx = (height - row - 1) * width + col;
+            unsigned char *p = pBitmap + 3 * (row * width + col);
+            double y = 1.164 * (pYuv444[inputIdx] - 16), u = oU[inputIdx] - 128, v = oV[inputIdx] - 128;
+            double r = y + 1.793 * v, g = y - 0.213 * u - 0.534 * v, b = y + 2.115 * u;
+            p[2] = (unsigned char)(r > 255 ? 255 : (r < 0 ? 0 : r));
+            p[1] = (unsigned char)(g > 255 ? 255 : (g < 0 ? 0 : g));
+            p[0] = (unsigned char)(b > 255 ? 255 : (b < 0 ? 0 : b));
+        }
+    }
+}
+
+static int RunBitmapDump(const Options &opt)
+{
+    int nFailures = VerifyYuvRowToBGR();
+    for (int c = 0; c < 4; c++)
+    {
+        nFailures += VerifyYuvToBGRAccuracy(c & 1 ? YUV_MATRIX_BT709 : YUV_MATRIX_BT601, c & 2 ? YUV_RANGE_FULL : YUV_RANGE_LIMITED);
+    }
+    nFailures += VerifyGoldenBitmaps();
+    printf("YUV->BGR verification and golden bitmaps: %s\n", nFailures ? "FAILED" : "passed");
+
+    int width = opt.width & ~3, height = opt.height & ~1;
+    std::vector<unsigned char> nv12(width * height * 3 / 2), yuv444(width * height * 3), bitmap(width * height * 3);
+    FillRandom(&nv12[0], nv12.size());
+    const unsigned char *pUV = &nv12[width * height];
+
+    int nLegacyIterations = opt.iterations / 10 + 1;
+    double t0 = NowMs();
+    for (int i = 0; i < nLegacyIterations; i++)
+    {
+        LegacyNV12ToBitmap(&nv12[0], width, height, &yuv444[0], &bitmap[0]);
+    }
+    double ms = (NowMs() - t0) / nLegacyIterations;
+    printf("  %-7s %dx%d NV12->BGR: %7.3f ms/frame (through a YUV444 copy, in doubles)\n", "legacy", width, height, ms);
+
+    for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+    {
+        if (RgbSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+            continue;
+        t0 = NowMs();
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            for (int y = 0; y < height; y++)
+            {
+                YuvRowToBGR(&nv12[y * width], pUV + y / 2 * width, NULL, YUV_LAYOUT_NV12, &bitmap[(height - 1 - y) * width * 3],
+                    width, YUV_MATRIX_BT709, YUV_RANGE_LIMITED);
+            }
+        }
+        ms = (NowMs() - t0) / opt.iterations;
+        printf("  %-7s %dx%d NV12->BGR: %7.3f ms/frame, %6.2f GB/s written\n", GetSimdLevelName(s_aLevels[l]),
+            width, height, ms, bitmap.size() / (ms * 1.0e6));
+    }
+    RgbSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Simulcast downscaling
+
+static const ScaleFilter s_aScaleFilters[] = { SCALE_FILTER_BOX, SCALE_FILTER_BILINEAR, SCALE_FILTER_LANCZOS2 };
+
+// Source and destination sizes of the scaler checks: the ladder of a 1080p
+// and a 720p player, odd sizes, the largest ratio and an upscale.
+static const int s_aScaleSizes[][4] =
+{
+    { 1920, 1080, 960, 540 },
+    { 1920, 1080, 640, 360 },
+    { 1920, 1080, 480, 270 },
+    { 1280, 720, 854, 480 },
+    { 1283, 721, 301, 97 },
+    { 37, 29, 5, 4 },
+    { 64, 48, 8, 6 },
+    { 60, 34, 200, 150 },
+};
+
+// A plane with smooth gradients, noise, and a white box with hard edges, so
+// the filters ring and the passes have to clamp.
+static void MakeScaleTestPlane(unsigned char *p, int width, int height, int stride)
+{
+    for (int y = 0; y < height; y++)
+    {
+        unsigned char noise[4096];
+        FillRandom(noise, width < 4096 ? width : 4096);
+        for (int x = 0; x < width; x++)
+        {
+            double v = 128 + 90 * sin(x * 0.05) * cos(y * 0.07) + (noise[x & 4095] % 41) - 20;
+            if (x > width / 3 && x < width / 2 && y > height / 3 && y < height / 2)
+                v = 255;
+            p[y * stride + x] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+        }
+    }
+}
+
+// Weight of source pixel j, which covers j to j + 1, for output pixel i,
+// worked out from the filter definitions rather than FrameScaler's taps.
+static double ReferenceScaleWeight(ScaleFilter eFilter, int srcSize, int dstSize, int i, int j)
+{
+    double scale = (double)srcSize / dstSize, stretch = scale > 1 ? scale : 1;
+    double center = (i + 0.5) * scale, d = (j + 0.5 - center) / stretch;
+    switch (eFilter)
+    {
+    case SCALE_FILTER_BOX:
+    {
+        double lo = std::max((double)j, center - stretch / 2), hi = std::min(j + 1.0, center + stretch / 2);
+        return hi > lo ? hi - lo : 0;
+    }
+    case SCALE_FILTER_BILINEAR:
+        return std::max(0.0, 1 - fabs(d));
+    default:
+    {
+        if (fabs(d) >= 2)
+            return 0;
+        if (d == 0)
+            return 1;
+        const double pi = 3.14159265358979323846;
+        return sin(pi * d) / (pi * d) * sin(pi * d / 2) / (pi * d / 2);
+    }
+    }
+}
+
+// Filters size samples p[0], p[step], ... into dstSize samples, repeating
+// the edges, and clamps the results to 0-255 as the 8-bit passes do.
+static void ReferenceScaleLine(ScaleFilter eFilter, const double *p, int step, int srcSize, double *pDst, int dstStep, int dstSize)
+{
+    double scale = (double)srcSize / dstSize, stretch = scale > 1 ? scale : 1;
+    for (int i = 0; i < dstSize; i++)
+    {
+        int center = (int)((i + 0.5) * scale), reach = (int)(2 * stretch) + 2;
+        double sum = 0, total = 0;
+        for (int j = center - reach; j <= center + reach; j++)
+        {
+            double w = ReferenceScaleWeight(eFilter, srcSize, dstSize, i, j);
+            sum += w * p[std::min(std::max(j, 0), srcSize - 1) * step];
+            total += w;
+        }
+        double v = sum / total;
+        pDst[i * dstStep] = v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+}
+
+// Every kernel level gives the scalar result, within the destination rows
+// only, from a plane with a pitch.
+static int VerifyScaleKernels()
+{
+    int nFailures = 0;
+    for (size_t s = 0; s < sizeof(s_aScaleSizes) / sizeof(s_aScaleSizes[0]); s++)
+    {
+        int srcWidth = s_aScaleSizes[s][0], srcHeight = s_aScaleSizes[s][1];
+        int dstWidth = s_aScaleSizes[s][2], dstHeight = s_aScaleSizes[s][3];
+        int srcStride = srcWidth + 13, dstStride = dstWidth + 7;
+        std::vector<unsigned char> src(srcStride * srcHeight);
+        FillRandom(&src[0], src.size());
+        MakeScaleTestPlane(&src[0], srcWidth, srcHeight, srcStride);
+        for (size_t f = 0; f < sizeof(s_aScaleFilters) / sizeof(s_aScaleFilters[0]); f++)
+        {
+            PlaneScaler scaler;
+            if (!scaler.Init(srcWidth, srcHeight, dstWidth, dstHeight, s_aScaleFilters[f]))
+            {
+                printf("  FAIL %s scaler %dx%d to %dx%d\n", GetScaleFilterName(s_aScaleFilters[f]), srcWidth, srcHeight, dstWidth, dstHeight);
+                nFailures++;
+                continue;
+            }
+            std::vector<unsigned char> ref(dstStride * dstHeight, 0xCD);
+            scaler.Scale_C(&src[0], srcStride, &ref[0], dstStride);
+            for (int y = 0; y < dstHeight; y++)
+            {
+                if (ref[y * dstStride + dstWidth] != 0xCD)
+                {
+                    printf("  FAIL %s scaler %dx%d to %dx%d wrote past row %d\n", GetScaleFilterName(s_aScaleFilters[f]),
+                        srcWidth, srcHeight, dstWidth, dstHeight, y);
+                    nFailures++;
+                    break;
+                }
+            }
+            for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+            {
+                if (ScalerSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+                    continue;
+                std::vector<unsigned char> dst(dstStride * dstHeight, 0xCD);
+                scaler.Scale(&src[0], srcStride, &dst[0], dstStride);
+                if (dst != ref)
+                {
+                    printf("  FAIL %s scaler %dx%d to %dx%d %s\n", GetScaleFilterName(s_aScaleFilters[f]),
+                        srcWidth, srcHeight, dstWidth, dstHeight, GetSimdLevelName(s_aLevels[l]));
+                    nFailures++;
+                }
+            }
+        }
+    }
+    ScalerSetSimdLevel(GetBestSimdLevel());
+    return nFailures;
+}
+
+// The two 8-bit passes stay within 2 of a reference in doubles, and within 1
+// on average much less; a box scaled by 2 is the rounded 2x2 mean within 1,
+// and a flat plane stays exactly flat.
+static int VerifyScaleAccuracy()
+{
+    int nFailures = 0;
+    for (size_t s = 0; s < sizeof(s_aScaleSizes) / sizeof(s_aScaleSizes[0]); s++)
+    {
+        int srcWidth = s_aScaleSizes[s][0], srcHeight = s_aScaleSizes[s][1];
+        int dstWidth = s_aScaleSizes[s][2], dstHeight = s_aScaleSizes[s][3];
+        if (srcWidth * srcHeight > 1280 * 720)
+            continue;
+        std::vector<unsigned char> src(srcWidth * srcHeight), dst(dstWidth * dstHeight);
+        MakeScaleTestPlane(&src[0], srcWidth, srcHeight, srcWidth);
+        std::vector<double> fSrc(src.begin(), src.end()), fRows(srcWidth * dstHeight), fDst(dstWidth * dstHeight);
+
+        for (size_t f = 0; f < sizeof(s_aScaleFilters) / sizeof(s_aScaleFilters[0]); f++)
+        {
+            ScaleFilter eFilter = s_aScaleFilters[f];
+            PlaneScaler scaler;
+            scaler.Init(srcWidth, srcHeight, dstWidth, dstHeight, eFilter);
+            scaler.Scale(&src[0], srcWidth, &dst[0], dstWidth);
+            for (int x = 0; x < srcWidth; x++)
+            {
+                ReferenceScaleLine(eFilter, &fSrc[x], srcWidth, srcHeight, &fRows[x], srcWidth, dstHeight);
+            }
+            for (int y = 0; y < dstHeight; y++)
+            {
+                ReferenceScaleLine(eFilter, &fRows[y * srcWidth], 1, srcWidth, &fDst[y * dstWidth], 1, dstWidth);
+            }
+
+            double fMaxError = 0, fSumError = 0;
+            for (int i = 0; i < dstWidth * dstHeight; i++)
+            {
+                double fError = fabs(dst[i] - fDst[i]);
+                fMaxError = std::max(fMaxError, fError);
+                fSumError += fError;
+            }
+            double fMeanError = fSumError / (dstWidth * dstHeight);
+            if (fMaxError > 2 || fMeanError > 0.5)
+            {
+                printf("  FAIL %s %dx%d to %dx%d: error max %.2f mean %.3f against doubles\n", GetScaleFilterName(eFilter),
+                    srcWidth, srcHeight, dstWidth, dstHeight, fMaxError, fMeanError);
+                nFailures++;
+            }
+
+            std::vector<unsigned char> flat(srcWidth * srcHeight, 77);
+            scaler.Scale(&flat[0], srcWidth, &dst[0], dstWidth);
+            if (std::count(dst.begin(), dst.end(), 77) != (int)dst.size())
+            {
+                printf("  FAIL %s %dx%d to %dx%d: a flat plane is not flat\n", GetScaleFilterName(eFilter),
+                    srcWidth, srcHeight, dstWidth, dstHeight);
+                nFailures++;
+            }
+        }
+    }
+
+    int width = 66, height = 38, nWrong = 0;
+    std::vector<unsigned char> src(width * height), dst(width * height / 4);
+    MakeScaleTestPlane(&src[0], width, height, width);
+    PlaneScaler box;
+    box.Init(width, height, width / 2, height / 2, SCALE_FILTER_BOX);
+    box.Scale(&src[0], width, &dst[0], width / 2);
+    for (int y = 0; y < height / 2; y++)
+    {
+        for (int x = 0; x < width / 2; x++)
+        {
+            const unsigned char *p = &src[2 * y * width + 2 * x];
+            double fMean = (p[0] + p[1] + p[width] + p[width + 1]) / 4.0;
+            nWrong += fabs(dst[y * width / 2 + x] - fMean) > 1;
+        }
+    }
+    if (nWrong)
+    {
+        printf("  FAIL box by 2: %d pixels off the 2x2 mean\n", nWrong);
+        nFailures++;
+    }
+    return nFailures;
+}
+
+// An I420 tile scales plane by plane into a contiguous frame; sizes that do
+// not fit are refused.
+static int VerifyFrameScaler()
+{
+    int nFailures = 0;
+    int width = 1280, height = 720;
+    std::vector<unsigned char> frame(width * height * 3 / 2);
+    FillRandom(&frame[0], frame.size());
+    FrameTiler tiler;
+    tiler.Init(width, height, 2, 2, width / 2, height / 2, 4);
+    YuvI420View view = tiler.GetTileView(&frame[0], 3);
+
+    FrameScaler scaler;
+    if (!scaler.Init(view.width, view.height, 320, 180, SCALE_FILTER_LANCZOS2))
+    {
+        printf("  FAIL frame scaler %dx%d to 320x180\n", view.width, view.height);
+        return 1;
+    }
+    std::vector<unsigned char> dst(scaler.GetFrameSize() + 1, 0xCD), ref(320 * 180 * 3 / 2);
+    scaler.Scale(view, &dst[0]);
+    PlaneScaler luma, chroma;
+    luma.Init(view.width, view.height, 320, 180, SCALE_FILTER_LANCZOS2);
+    chroma.Init(view.width / 2, view.height / 2, 160, 90, SCALE_FILTER_LANCZOS2);
+    luma.Scale_C(view.pY, view.strideY, &ref[0], 320);
+    chroma.Scale_C(view.pU, view.strideUV, &ref[320 * 180], 160);
+    chroma.Scale_C(view.pV, view.strideUV, &ref[320 * 180 * 5 / 4], 160);
+    if (dst.back() != 0xCD || !std::equal(ref.begin(), ref.end(), dst.begin()))
+    {
+        printf("  FAIL frame scaler tile to 320x180\n");
+        nFailures++;
+    }
+
+    static const int aBad[][4] = { { 640, 360, 321, 180 }, { 640, 360, 320, 0 }, { 1920, 1080, 200, 134 }, { 64, 64, 1024, 64 } };
+    for (size_t b = 0; b < sizeof(aBad) / sizeof(aBad[0]); b++)
+    {
+        FrameScaler bad;
+        if (bad.Init(aBad[b][0], aBad[b][1], aBad[b][2], aBad[b][3], SCALE_FILTER_BOX))
+        {
+            printf("  FAIL frame scaler took %dx%d to %dx%d\n", aBad[b][0], aBad[b][1], aBad[b][2], aBad[b][3]);
+            nFailures++;
+        }
+    }
+    return nFailures;
+}
+
+static int VerifySimulcastLadder()
+{
+    struct LadderCase
+    {
+        const char *szLadder;
+        int         width;
+        int         height;
+        int         nRenditions;
+        int         aSizes[SIMULCAST_MAX_RENDITIONS][2];
+    };
+    static const LadderCase aCases[] =
+    {
+        { "2,4", 1920, 1080, 2, { { 960, 540 }, { 480, 270 } } },
+        { "1280x720,640x360,426x240", 1920, 1080, 3, { { 1280, 720 }, { 640, 360 }, { 426, 240 } } },
+        { "3", 1283, 721, 1, { { 426, 240 } } },
+        { "2", 960, 540, 1, { { 480, 270 } } },
+        { "", 1920, 1080, 0, { { 0, 0 } } },
+        { "2,4,6,8", 1920, 1080, 0, { { 0, 0 } } },
+        { "1", 1920, 1080, 0, { { 0, 0 } } },
+        { "3840x2160", 1920, 1080, 0, { { 0, 0 } } },
+        { "16", 1920, 1080, 0, { { 0, 0 } } },
+        { "960x", 1920, 1080, 0, { { 0, 0 } } },
+        { "2;4", 1920, 1080, 0, { { 0, 0 } } },
+    };
+    int nFailures = 0;
+    for (size_t c = 0; c < sizeof(aCases) / sizeof(aCases[0]); c++)
+    {
+        const LadderCase &lc = aCases[c];
+        SimulcastRendition aRenditions[SIMULCAST_MAX_RENDITIONS];
+        int n = SimulcastParseLadder(lc.szLadder, lc.width, lc.height, aRenditions);
+        bool bOk = n == lc.nRenditions;
+        for (int r = 0; r < n && bOk; r++)
+        {
+            bOk = aRenditions[r].width == lc.aSizes[r][0] && aRenditions[r].height == lc.aSizes[r][1];
+        }
+        if (!bOk)
+        {
+            printf("  FAIL ladder \"%s\" of %dx%d: %d renditions\n", lc.szLadder, lc.width, lc.height, n);
+            nFailures++;
+        }
+    }
+
+    SimulcastRendition half = { 960, 540 }, tiny = { 192, 108 };
+    if (SimulcastRenditionBitrate(4000000, 1920, 1080, half) != (int)(4000000 * pow(0.25, 0.75)) ||
+        SimulcastRenditionBitrate(1000000, 1920, 1080, tiny) != SIMULCAST_MIN_BITRATE)
+    {
+        printf("  FAIL rendition bitrates\n");
+        nFailures++;
+    }
+    return nFailures;
+}
+
+// Renditions on the null encoder: every frame handed over is encoded by
+// each, bitrates follow the player, and frames that come while they are
+// still scaling are skipped rather than waited for.
+static int VerifySimulcastStage()
+{
+    int nFailures = 0;
+    int width = 640, height = 360;
+    std::vector<unsigned char> frame(width * height * 3 / 2);
+    FillRandom(&frame[0], frame.size());
+    YuvI420View view = YuvFrameView(&frame[0], width, height);
+
+    SimulcastRendition aRenditions[SIMULCAST_MAX_RENDITIONS];
+    int nRenditions = SimulcastParseLadder("2,4", width, height, aRenditions);
+    SimulcastStage stage;
+    if (!stage.Start(7, width, height, aRenditions, nRenditions, SCALE_FILTER_BILINEAR, VIDEO_ENCODER_NULL, 30, 2000000))
+    {
+        printf("  FAIL simulcast stage did not start\n");
+        return 1;
+    }
+    int nAccepted = 0;
+    for (int i = 0; i < 20; i++)
+    {
+        nAccepted += stage.Submit(view, i < 10 ? 2000000 : 1000000, i);
+        stage.Flush();
+    }
+    for (int r = 0; r < nRenditions; r++)
+    {
+        if (stage.GetEncodedFrames(r) != 20 || stage.GetBitrate(r) != SimulcastRenditionBitrate(1000000, width, height, aRenditions[r]))
+        {
+            printf("  FAIL rendition %d encoded %d of 20 frames at %d bps\n", r, (int)stage.GetEncodedFrames(r), stage.GetBitrate(r));
+            nFailures++;
+        }
+    }
+    if (nAccepted != 20 || stage.GetSkippedFrames())
+    {
+        printf("  FAIL %d of 20 frames handed over one at a time\n", nAccepted);
+        nFailures++;
+    }
+
+    nAccepted = 0;
+    for (int i = 0; i < 200; i++)
+    {
+        nAccepted += stage.Submit(view, 1000000, 20 + i);
+    }
+    stage.Flush();
+    for (int r = 0; r < nRenditions; r++)
+    {
+        if (stage.GetEncodedFrames(r) != (uint64_t)(20 + nAccepted))
+        {
+            printf("  FAIL rendition %d encoded %d of %d frames\n", r, (int)stage.GetEncodedFrames(r), 20 + nAccepted);
+            nFailures++;
+        }
+    }
+    if (nAccepted < 1 || stage.GetSkippedFrames() != (uint64_t)(200 - nAccepted))
+    {
+        printf("  FAIL %d of 200 frames handed over back to back, %d skipped\n", nAccepted, (int)stage.GetSkippedFrames());
+        nFailures++;
+    }
+    stage.Stop();
+
+    SimulcastStage bad;
+    SimulcastRendition odd = { 321, 180 };
+    if (bad.Start(7, width, height, &odd, 1, SCALE_FILTER_BOX, VIDEO_ENCODER_NULL, 30, 2000000) || bad.GetRenditionCount())
+    {
+        printf("  FAIL simulcast stage started an odd rendition\n");
+        nFailures++;
+    }
+    return nFailures;
+}
+
+static int RunFrameScaler(const Options &opt)
+{
+    // Keep the renditions' encoders off the network.
+#if defined(_WIN32)
+    SetEnv(BITSTREAM_OUTPUT_ENV, "NUL");
+#else
+    SetEnv(BITSTREAM_OUTPUT_ENV, "/dev/null");
+#endif
+
+    int nFailures = VerifyScaleKernels();
+    nFailures += VerifyScaleAccuracy();
+    nFailures += VerifyFrameScaler();
+    nFailures += VerifySimulcastLadder();
+    nFailures += VerifySimulcastStage();
+    printf("Scaler kernels against doubles, simulcast renditions: %s\n", nFailures ? "FAILED" : "passed");
+
+    int width = opt.width & ~1, height = opt.height & ~1;
+    std::vector<unsigned char> frame(width * height * 3 / 2);
+    FillRandom(&frame[0], frame.size());
+    YuvI420View view = YuvFrameView(&frame[0], width, height);
+    static const int aDivisors[] = { 2, 3, 4 };
+    for (size_t f = 0; f < sizeof(s_aScaleFilters) / sizeof(s_aScaleFilters[0]); f++)
+    {
+        for (size_t d = 0; d < sizeof(aDivisors) / sizeof(aDivisors[0]); d++)
+        {
+            FrameScaler scaler;
+            if (!scaler.Init(width, height, width / aDivisors[d] & ~1, height / aDivisors[d] & ~1, s_aScaleFilters[f]))
+                continue;
+            std::vector<unsigned char> dst(scaler.GetFrameSize());
+            printf("  %-8s %dx%d to %dx%d:", GetScaleFilterName(s_aScaleFilters[f]), width, height, scaler.GetDstWidth(), scaler.GetDstHeight());
+            for (size_t l = 0; l < sizeof(s_aLevels) / sizeof(s_aLevels[0]); l++)
+            {
+                if (ScalerSetSimdLevel(s_aLevels[l]) != s_aLevels[l])
+                    continue;
+                int nIterations = s_aLevels[l] == SIMD_LEVEL_SCALAR ? opt.iterations / 10 + 1 : opt.iterations;
+                double t0 = NowMs();
+                for (int i = 0; i < nIterations; i++)
+                {
+                    scaler.Scale(view, &dst[0]);
+                }
+                printf(" %s %.3f ms", GetSimdLevelName(s_aLevels[l]), (NowMs() - t0) / nIterations);
+            }
+            printf("\n");
+        }
+    }
+    ScalerSetSimdLevel(GetBestSimdLevel());
+
+    // What the encoder thread pays per frame for a 2, 3 and 4 ladder: the
+    // copy it hands over, against scaling the three renditions itself.
+    SimulcastRendition aRenditions[SIMULCAST_MAX_RENDITIONS];
+    int nRenditions = SimulcastParseLadder("2,3,4", width, height, aRenditions);
+    SimulcastStage stage;
+    if (nRenditions && stage.Start(0, width, height, aRenditions, nRenditions, SCALE_FILTER_LANCZOS2, VIDEO_ENCODER_NULL, 30, 4000000))
+    {
+        double fSubmitMs = 0;
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            double t0 = NowMs();
+            stage.Submit(view, 4000000, i);
+            fSubmitMs += NowMs() - t0;
+            stage.Flush();
+        }
+        stage.Stop();
+
+        FrameScaler aScalers[SIMULCAST_MAX_RENDITIONS];
+        std::vector<unsigned char> dst(width * height);
+        double t0 = NowMs();
+        for (int i = 0; i < opt.iterations; i++)
+        {
+            for (int r = 0; r < nRenditions; r++)
+            {
+                if (i == 0)
+                    aScalers[r].Init(width, height, aRenditions[r].width, aRenditions[r].height, SCALE_FILTER_LANCZOS2);
+                aScalers[r].Scale(view, &dst[0]);
+            }
+        }
+        printf("  %d renditions of %dx%d: encoder thread %.3f ms/frame handing over, %.3f ms/frame scaling inline\n",
+            nRenditions, width, height, fSubmitMs / opt.iterations, (NowMs() - t0) / opt.iterations);
+    }
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Adaptive resolution
+
+static int VerifyResolutionLadder()
+{
+    struct LadderCase
+    {
+        const char *szLadder;
+        int         width;
+        int         height;
+        int         nSteps;
+        int         aSizes[RESOLUTION_MAX_STEPS][2];
+    };
+    static const LadderCase aCases[] =
+    {
+        { NULL, 1920, 1080, 4, { { 1920, 1080 }, { 1440, 810 }, { 960, 540 }, { 640, 360 } } },
+        { "1", 1920, 1080, 4, { { 1920, 1080 }, { 1440, 810 }, { 960, 540 }, { 640, 360 } } },
+        { "", 640, 360, 3, { { 640, 360 }, { 480, 270 }, { 320, 180 } } },
+        { "0", 1920, 1080, 1, { { 1920, 1080 } } },
+        { "1280x720,853x481", 1920, 1080, 3, { { 1920, 1080 }, { 1280, 720 }, { 852, 480 } } },
+        { "1280x720,1280x720", 1920, 1080, 1, { { 1920, 1080 } } },
+        { "854x480,1280x720", 1920, 1080, 1, { { 1920, 1080 } } },
+        { "3840x2160", 1920, 1080, 1, { { 1920, 1080 } } },
+        { "320x180", 3840, 2160, 1, { { 3840, 2160 } } },
+        { "256x144", 1280, 720, 1, { { 1280, 720 } } },
+        { "2", 1920, 1080, 1, { { 1920, 1080 } } },
+        { "1280x720;960x540", 1920, 1080, 1, { { 1920, 1080 } } },
+    };
+    int nFailures = 0;
+    for (size_t c = 0; c < sizeof(aCases) / sizeof(aCases[0]); c++)
+    {
+        const LadderCase &lc = aCases[c];
+        ResolutionStep aSteps[RESOLUTION_MAX_STEPS];
+        int n = ResolutionParseLadder(lc.szLadder, lc.width, lc.height, aSteps);
+        bool bOk = n == lc.nSteps;
+        for (int s = 0; s < n && bOk; s++)
+        {
+            bOk = aSteps[s].width == lc.aSizes[s][0] && aSteps[s].height == lc.aSizes[s][1];
+        }
+        if (!bOk)
+        {
+            printf("  FAIL ladder \"%s\" of %dx%d: %d steps\n", lc.szLadder ? lc.szLadder : "", lc.width, lc.height, n);
+            nFailures++;
+        }
+    }
+    return nFailures;
+}
+
+// An encoder that takes afEncodeMs[step] per frame and writes the target
+// bitrate, or uDemandBps scaled to the picture if the content needs more.
+// The first frame at a new size is a keyframe 16 times the size of the
+// others. fNoise spreads both by up to that fraction either way.
+struct ResolutionSimEncoder
+{
+    double      afEncodeMs[RESOLUTION_MAX_STEPS];
+    uint32_t    uDemandBps;         // at the capture size
+    double      fNoise;
+    uint32_t    uSeed;
+    bool        bKeyframe;
+};
+
+static double ResolutionSimNoise(ResolutionSimEncoder *pEncoder)
+{
+    pEncoder->uSeed = pEncoder->uSeed * 1103515245 + 12345;
+    return 1 + pEncoder->fNoise * (((pEncoder->uSeed >> 8) & 0xffff) / 32767.5 - 1);
+}
+
+// Runs nFrames frames asking for uTargetBps. Returns the step changes.
+static uint32_t SimulateResolution(ResolutionController &controller, ResolutionSimEncoder *pEncoder, const ResolutionStep *aSteps,
+                                   uint32_t uTargetBps, int nFrames, int fps)
+{
+    uint32_t nChanges = 0;
+    for (int i = 0; i < nFrames; i++)
+    {
+        int iStep = controller.GetStep();
+        double fShare = (double)aSteps[iStep].width * aSteps[iStep].height / ((double)aSteps[0].width * aSteps[0].height);
+        double fBps = std::max((double)uTargetBps, pEncoder->uDemandBps * fShare);
+        double fBytes = fBps / 8 / fps * ResolutionSimNoise(pEncoder);
+        if (pEncoder->bKeyframe)
+        {
+            fBytes *= 16;
+            pEncoder->bKeyframe = false;
+        }
+        double fEncodeMs = pEncoder->afEncodeMs[iStep] * ResolutionSimNoise(pEncoder);
+        if (controller.Update(uTargetBps, fEncodeMs, (uint32_t)fBytes))
+        {
+            pEncoder->bKeyframe = true;
+            nChanges++;
+        }
+    }
+    return nChanges;
+}
+
+static bool CheckResolution(const ResolutionController &controller, const char *szCase, uint32_t nChanges, uint32_t nExpectedChanges,
+                            int iExpectedStep, ResolutionReason eExpectedReason)
+{
+    if (nChanges == nExpectedChanges && controller.GetStep() == iExpectedStep && controller.GetLastReason() == eExpectedReason)
+        return true;
+    printf("  FAIL %s: %u changes to step %d (%s)\n", szCase, nChanges, controller.GetStep(),
+        GetResolutionReasonName(controller.GetLastReason()));
+    return false;
+}
+
+// 1080p30 on the default ladder, with encode times in proportion to the
+// pixels unless a case says otherwise.
+static int VerifyResolutionController()
+{
+    const int fps = 30;
+    ResolutionStep aSteps[RESOLUTION_MAX_STEPS];
+    int nSteps = ResolutionParseLadder(NULL, 1920, 1080, aSteps);
+    ResolutionConfig config;
+    GetDefaultResolutionConfig(&config);
+    ResolutionSimEncoder proportional = { { 6, 3.4, 1.5, 0.7 }, 0, 0, 1, false };
+    int nFailures = 0;
+
+    // A drop in bandwidth goes to the step that fits within a window; the
+    // way back up is one step per hold.
+    {
+        ResolutionController controller;
+        controller.Init(aSteps, nSteps, fps, config);
+        ResolutionSimEncoder encoder = proportional;
+        uint32_t n = SimulateResolution(controller, &encoder, aSteps, 6000000, 300, fps);
+        nFailures += !CheckResolution(controller, "enough bandwidth", n, 0, 0, RESOLUTION_REASON_NONE);
+        n = SimulateResolution(controller, &encoder, aSteps, 500000, config.uWindowFrames, fps);
+        nFailures += !CheckResolution(controller, "bandwidth drop", n, 1, 3, RESOLUTION_REASON_BITRATE);
+        n = SimulateResolution(controller, &encoder, aSteps, 6000000, config.uUpHoldFrames - 1, fps);
+        nFailures += !CheckResolution(controller, "recovery within the hold", n, 0, 3, RESOLUTION_REASON_BITRATE);
+        n = SimulateResolution(controller, &encoder, aSteps, 6000000, 2 * config.uUpHoldFrames + 1, fps);
+        nFailures += !CheckResolution(controller, "recovery", n, 3, 0, RESOLUTION_REASON_HEADROOM);
+    }
+
+    // Encoding 1080p takes 90% of the frame interval. 1440x810 fits, and
+    // 1080p is not tried again: scaled up from 1440x810 its time is over
+    // the budget.
+    {
+        ResolutionController controller;
+        controller.Init(aSteps, nSteps, fps, config);
+        ResolutionSimEncoder encoder = { { 30, 13, 6, 3 }, 0, 0, 1, false };
+        uint32_t n = SimulateResolution(controller, &encoder, aSteps, 20000000, config.uDownHoldFrames, fps);
+        nFailures += !CheckResolution(controller, "encode overload", n, 1, 1, RESOLUTION_REASON_ENCODE_TIME);
+        n = SimulateResolution(controller, &encoder, aSteps, 20000000, 60 * fps, fps);
+        nFailures += !CheckResolution(controller, "encode overload held", n, 0, 1, RESOLUTION_REASON_ENCODE_TIME);
+    }
+
+    // 1080p looks affordable from 1440x810 but is not: each undone try
+    // doubles the wait before the next, up to its cap.
+    {
+        ResolutionController controller;
+        controller.Init(aSteps, nSteps, fps, config);
+        ResolutionSimEncoder encoder = { { 28, 8, 4, 2 }, 0, 0, 1, false };
+        uint32_t n = SimulateResolution(controller, &encoder, aSteps, 20000000, 120 * fps, fps);
+        if (n > 10 || controller.GetUpHoldFrames() != config.uUpHoldFrames * RESOLUTION_MAX_UP_HOLD)
+        {
+            printf("  FAIL undone steps up: %u changes in 2 minutes, up hold %u frames\n", n, controller.GetUpHoldFrames());
+            nFailures++;
+        }
+    }
+
+    // A keyframe alone does not count as overshooting; content that needs
+    // twice the target at 1080p does.
+    {
+        ResolutionController controller;
+        controller.Init(aSteps, nSteps, fps, config);
+        ResolutionSimEncoder encoder = proportional;
+        uint32_t n = SimulateResolution(controller, &encoder, aSteps, 4000000, 300, fps);
+        encoder.bKeyframe = true;
+        n += SimulateResolution(controller, &encoder, aSteps, 4000000, 300, fps);
+        nFailures += !CheckResolution(controller, "keyframe", n, 0, 0, RESOLUTION_REASON_NONE);
+        encoder.uDemandBps = 9000000;
+        n = SimulateResolution(controller, &encoder, aSteps, 4000000, 600, fps);
+        nFailures += !CheckResolution(controller, "overshoot", n, 1, 1, RESOLUTION_REASON_OVERSHOOT);
+    }
+
+    // At the bottom of the ladder, output over the target keeps the step
+    // even with the bits for the next one up.
+    {
+        ResolutionController controller;
+        controller.Init(aSteps, nSteps, fps, config);
+        ResolutionSimEncoder encoder = proportional;
+        uint32_t n = SimulateResolution(controller, &encoder, aSteps, 200000, 2 * config.uDownHoldFrames, fps);
+        nFailures += !CheckResolution(controller, "bottom of the ladder", n, 1, nSteps - 1, RESOLUTION_REASON_BITRATE);
+        encoder.uDemandBps = 72000000;
+        n = SimulateResolution(controller, &encoder, aSteps, 5000000, 600, fps);
+        nFailures += !CheckResolution(controller, "overshoot at the bottom", n, 0, nSteps - 1, RESOLUTION_REASON_BITRATE);
+    }
+
+    // Nothing to adapt on a ladder of one step.
+    {
+        ResolutionController controller;
+        controller.Init(aSteps, 1, fps, config);
+        ResolutionSimEncoder encoder = proportional;
+        uint32_t n = SimulateResolution(controller, &encoder, aSteps, 100000, 300, fps);
+        nFailures += !CheckResolution(controller, "single step", n, 0, 0, RESOLUTION_REASON_NONE);
+    }
+    return nFailures;
+}
+
+// A bandwidth that wanders around the 1080p threshold, a new target every
+// window: the hysteresis and holds against switching on every crossing.
+static uint32_t SimulateNoisyBandwidth(const ResolutionConfig &config, uint32_t uMeanBps, double fSpread, int nSeconds)
+{
+    const int fps = 30;
+    ResolutionStep aSteps[RESOLUTION_MAX_STEPS];
+    int nSteps = ResolutionParseLadder(NULL, 1920, 1080, aSteps);
+    ResolutionController controller;
+    controller.Init(aSteps, nSteps, fps, config);
+    ResolutionSimEncoder encoder = { { 6, 3.4, 1.5, 0.7 }, 0, 0.2, 7, false };
+    ResolutionSimEncoder target = { { 0 }, 0, fSpread, 11, false };
+    uint32_t nChanges = 0;
+    for (int i = 0; i < nSeconds * fps; i += config.uWindowFrames)
+    {
+        uint32_t uTargetBps = (uint32_t)(uMeanBps * ResolutionSimNoise(&target));
+        nChanges += SimulateResolution(controller, &encoder, aSteps, uTargetBps, config.uWindowFrames, fps);
+    }
+    return nChanges;
+}
+
+static int RunResolution(const Options & /*opt*/)
+{
+    int nFailures = VerifyResolutionLadder() + VerifyResolutionController();
+    printf("Resolution controller: %s\n", nFailures ? "FAILED" : "passed");
+
+    ResolutionConfig config;
+    GetDefaultResolutionConfig(&config);
+    ResolutionConfig undamped = config;
+    undamped.fUpBitsPerPixel = undamped.fMinBitsPerPixel;
+    undamped.fEncodeUpBudget = undamped.fEncodeBudget;
+    undamped.uDownHoldFrames = 0;
+    undamped.uUpHoldFrames = 0;
+
+    // 2.5 Mbps is 0.04 bits per pixel at 1080p30.
+    printf("  1080p30, 10 minutes of bandwidth at 2.5 Mbps +-25%%, a new target every %u frames:\n", config.uWindowFrames);
+    uint32_t nUndamped = SimulateNoisyBandwidth(undamped, 2500000, 0.25, 600);
+    uint32_t nDamped = SimulateNoisyBandwidth(config, 2500000, 0.25, 600);
+    printf("  %-10s %6u resolution changes\n  %-10s %6u resolution changes\n", "undamped", nUndamped, "default", nDamped);
+    if (nDamped > 2 || nUndamped < 10 * (nDamped + 1))
+    {
+        printf("  FAIL damping: %u changes against %u undamped\n", nDamped, nUndamped);
+        nFailures++;
+    }
+    return nFailures;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct PerfTest
+{
+    const char *name;
+    const char *description;
+    int (*pfnRun)(const Options &opt);
+};
+
+static const PerfTest s_aTests[] =
+{
+    { "yuv", "I420->NV12 and YUV444 input surface conversion", RunYuvConvert },
+    { "stripes", "I420->NV12 split into stripes across a worker pool", RunYuvStriped },
+    { "binder", "Zero-copy input registration, map and unmap order against a mock encoder API", RunInputBinder },
+    { "encode", "Encoder backends through IVideoEncoder, null stream checked", RunEncoders },
+    { "pipeline", "Encode pipeline depth against a simulated encoder", RunEncodePipeline },
+    { "ring", "Lock-free buffer rings against CNvQueue under a mutex", RunRings },
+    { "ts", "MPEG-TS muxer round trip through an independent demuxer", RunTsMuxer },
+    { "http", "HTTP stream server over loopback, slow client dropped to a keyframe", RunHttpServer },
+    { "rtp", "RFC 6184 packetizer reassembled bit-exactly, batched UDP send", RunRtpPacketizer },
+    { "nal", "SIMD start code search, parameter sets added for late joiners", RunNalScanner },
+    { "activity", "Seqlock player activity slots in shared memory against file polling", RunPlayerActivity },
+    { "bandwidth", "Bandwidth allocator checked, policies replayed over an activity trace", RunBandwidth },
+    { "pacer", "Frame pacer overrun policies against millisecond pacing after a stall", RunFramePacer },
+    { "tiles", "SIMD tile hashes, only the changed 64x64 tiles of an I420 frame marked", RunTileHash },
+    { "qpmap", "QP delta maps from tile changes and HUD regions, ring of map buffers", RunQpDeltaMap },
+    { "sessions", "Encoder sessions leased and recycled on a mock device, one context per device", RunEncodeSessionPool },
+    { "players", "Player sessions found without a lock per Present, counters a cache line apart", RunPlayerSessions },
+    { "trace", "Per-thread frame trace rings exported as Chrome JSON while recording", RunFrameTrace },
+    { "log", "Per-thread log rings drained in the background, rate limit per call site", RunAsyncLog },
+    { "metrics", "Per-player counters and HDR histograms, Prometheus text checked line by line", RunMetrics },
+    { "split", "Split-screen tiles encoded from views of the frame against a full copy per player", RunFrameTiler },
+    { "rgb", "Fixed-point RGB->NV12, I420 and YUV444 kernels against a double-precision reference", RunRgbConvert },
+    { "bmp", "YUV->BGR rows for bitmap dumps against a YUV444 copy in doubles, golden bitmaps", RunBitmapDump },
+    { "scale", "Box, bilinear and Lanczos-2 downscalers against doubles, simulcast renditions off the encoder thread", RunFrameScaler },
+    { "resolution", "Resolution ladder stepped by bitrate, encode time and overshoot, hysteresis against a noisy link", RunResolution },
+};
+
+static void PrintHelp()
+{
+    printf("PerfShimKernels [-test <name>] [-width <w>] [-height <h>] [-iterations <n>] [-trace <activity log>]\n");
+    printf("Tests:\n");
+    for (size_t i = 0; i < sizeof(s_aTests) / sizeof(s_aTests[0]); i++)
+    {
+        printf("  %-10s %s\n", s_aTests[i].name, s_aTests[i].description);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+    opt.width = 1920;
+    opt.height = 1080;
+    opt.iterations = 200;
+    opt.test = NULL;
+    opt.trace = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-test") && i + 1 < argc)
+            opt.test = argv[++i];
+        else if (!strcmp(argv[i], "-width") && i + 1 < argc)
+            opt.width = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-height") && i + 1 < argc)
+            opt.height = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-iterations") && i + 1 < argc)
+            opt.iterations = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-trace") && i + 1 < argc)
+            opt.trace = argv[++i];
+        else
+        {
+            PrintHelp();
+            return 1;
+        }
+    }
+
+    printf("CPU: best SIMD level %s, %d logical cores\n", GetSimdLevelName(GetBestSimdLevel()), GetCpuFeatures().nLogicalCores);
+
+    int nFailures = 0;
+    for (size_t i = 0; i < sizeof(s_aTests) / sizeof(s_aTests[0]); i++)
+    {
+        if (opt.test && strcmp(opt.test, s_aTests[i].name))
+            continue;
+        printf("== %s ==\n", s_aTests[i].name);
+        nFailures += s_aTests[i].pfnRun(opt);
+    }
+    return nFailures ? 1 : 0;
+}
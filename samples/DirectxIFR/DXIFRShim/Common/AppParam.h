@@ -19,6 +19,7 @@
 
 #include <tchar.h>
 #include "ControlInfo.h"
+#include "PlayerActivity.h"
 
 #define N_USER_INPUT 16
 
@@ -57,6 +58,10 @@ struct AppParam
 	UserInput aui[N_USER_INPUT];
 
 	BOOL bForceCdeclInEnumDevicesCallback;
+
+	// Written by the input daemon, one slot per player, each aligned to a
+	// cache line. See PlayerActivity.h.
+	PlayerActivityTable activity;
 };
 
 class AppParamManager
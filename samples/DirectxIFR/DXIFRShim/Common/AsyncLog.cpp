@@ -0,0 +1,498 @@
+/*!
+ * \brief
+ * Per-thread log rings written out by a background thread
+ *
+ * \file
+ *
+ * See AsyncLog.h.
+ */
+
+#include "AsyncLog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#define ASYNC_LOG_TLS __declspec(thread)
+#else
+#include <pthread.h>
+#define ASYNC_LOG_TLS __thread
+#endif
+
+#define ASYNC_LOG_CACHE_LINE 64
+
+// A line in a ring, followed by its text. Copied in and out with memcpy, so
+// it need not be aligned.
+struct AsyncLogRecord
+{
+    uint32_t                uSize;          // with the text, a multiple of 8 bytes
+    uint16_t                uLength;
+    uint8_t                 level;
+    uint8_t                 uReserved;
+    uint32_t                nSuppressed;
+    uint32_t                nDropped;       // lines of the thread dropped just before
+    uint64_t                uTimeUs;
+    AsyncLogSink           *pSink;          // NULL: padding up to the end of the ring
+};
+
+struct AsyncLogRing
+{
+    char                    aPadding0[ASYNC_LOG_CACHE_LINE];
+    std::atomic<uint64_t>   uWritten;       // bytes so far; stored by the writer
+    std::atomic<uint64_t>   nPosted;
+    std::atomic<uint64_t>   nDropped;
+    uint32_t                nUnreported;    // dropped since the last line posted
+    char                    aPadding1[ASYNC_LOG_CACHE_LINE];
+    std::atomic<uint64_t>   uRead;          // bytes so far; stored by the drain
+    char                    aPadding2[ASYNC_LOG_CACHE_LINE];
+    std::atomic<int>        state;          // ASYNC_LOG_RING_*
+    bool                    bShared;        // writers take mutex
+    std::mutex              mutex;
+    uint64_t                aBytes[ASYNC_LOG_RING_BYTES / sizeof(uint64_t)];
+};
+
+// A ring goes from in use to exited when its thread ends, to free once the
+// drain has caught up with it, and back to in use when GetRing hands it out.
+#define ASYNC_LOG_RING_IN_USE   0
+#define ASYNC_LOG_RING_EXITED   1
+#define ASYNC_LOG_RING_FREE     2
+
+// Created once and never destroyed, like the other shared objects of the
+// shim: the background thread may still use them while the process exits.
+struct AsyncLogFlusher
+{
+    std::mutex              drainMutex;
+    std::mutex              wakeMutex;
+    std::condition_variable wake;
+    std::vector<AsyncLogSink *> apSinks;    // written to this round; drainMutex
+};
+
+static std::mutex s_ringsMutex;
+static AsyncLogRing *s_apRings[ASYNC_LOG_MAX_THREADS + 1];
+static std::atomic<int> s_nRings(0);
+static std::atomic<AsyncLogFlusher *> s_pFlusher(NULL);
+static std::atomic<bool> s_bWake(false);
+static std::atomic<uint64_t> s_nWritten(0);
+static std::atomic<uint64_t> s_nSuppressed(0);
+static std::atomic<uint64_t> s_aRateSites[ASYNC_LOG_RATE_SITES];  // second << 32 | lines
+
+static ASYNC_LOG_TLS AsyncLogRing *t_pRing;
+
+// Calls ReleaseRing with the ring of a thread when the thread exits.
+#if defined(_WIN32)
+static DWORD s_dwRingKey = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t s_ringKey;
+static bool s_bRingKey = false;
+#endif
+
+// The last second formatted, kept by the drain.
+static uint64_t s_uTimeSecond = ~(uint64_t)0;
+static char s_szTime[16];
+
+uint64_t AsyncLogNow()
+{
+#if defined(_WIN32)
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    uint64_t u100Ns = (uint64_t)ft.dwHighDateTime << 32 | ft.dwLowDateTime;
+    return (u100Ns - 116444736000000000ull) / 10;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+bool AsyncLogAllow(const char *szFile, int nLine, uint64_t uTimeUs, uint32_t *pnSuppressed)
+{
+    *pnSuppressed = 0;
+    uint64_t uKey = ((uint64_t)(uintptr_t)szFile + (uint64_t)nLine * 0x9E3779B1u) * 0x9E3779B97F4A7C15ull;
+    std::atomic<uint64_t> &site = s_aRateSites[(uKey >> 40) & (ASYNC_LOG_RATE_SITES - 1)];
+    uint32_t uSecond = (uint32_t)(uTimeUs / 1000000);
+
+    uint64_t uOld = site.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        uint32_t nLines = (uint32_t)uOld;
+        uint64_t uNew;
+        bool bAllow;
+        uint32_t nSuppressed = 0;
+        if ((uint32_t)(uOld >> 32) != uSecond)
+        {
+            uNew = (uint64_t)uSecond << 32 | 1;
+            bAllow = true;
+            nSuppressed = nLines > ASYNC_LOG_RATE_LIMIT ? nLines - ASYNC_LOG_RATE_LIMIT : 0;
+        }
+        else
+        {
+            uNew = nLines == 0xFFFFFFFF ? uOld : uOld + 1;
+            bAllow = nLines < ASYNC_LOG_RATE_LIMIT;
+        }
+        if (site.compare_exchange_weak(uOld, uNew, std::memory_order_relaxed))
+        {
+            *pnSuppressed = nSuppressed;
+            return bAllow;
+        }
+    }
+}
+
+static AsyncLogRing *NewRing(bool bShared)
+{
+    AsyncLogRing *pRing = new AsyncLogRing;
+    pRing->uWritten.store(0, std::memory_order_relaxed);
+    pRing->nPosted.store(0, std::memory_order_relaxed);
+    pRing->nDropped.store(0, std::memory_order_relaxed);
+    pRing->nUnreported = 0;
+    pRing->uRead.store(0, std::memory_order_relaxed);
+    pRing->state.store(ASYNC_LOG_RING_IN_USE, std::memory_order_relaxed);
+    pRing->bShared = bShared;
+    return pRing;
+}
+
+// Runs on a thread that exits; the drain frees the ring once it has written
+// the lines left in it.
+#if defined(_WIN32)
+static void WINAPI ReleaseRing(void *pValue)
+#else
+static void ReleaseRing(void *pValue)
+#endif
+{
+    AsyncLogRing *pRing = (AsyncLogRing *)pValue;
+    if (pRing)
+        pRing->state.store(ASYNC_LOG_RING_EXITED, std::memory_order_release);
+    t_pRing = NULL;
+}
+
+// Has ReleaseRing called when the calling thread exits. s_ringsMutex held.
+static void ReleaseRingAtExit(AsyncLogRing *pRing)
+{
+#if defined(_WIN32)
+    if (s_dwRingKey == FLS_OUT_OF_INDEXES)
+        s_dwRingKey = FlsAlloc(ReleaseRing);
+    if (s_dwRingKey != FLS_OUT_OF_INDEXES)
+        FlsSetValue(s_dwRingKey, pRing);
+#else
+    if (!s_bRingKey)
+        s_bRingKey = pthread_key_create(&s_ringKey, ReleaseRing) == 0;
+    if (s_bRingKey)
+        pthread_setspecific(s_ringKey, pRing);
+#endif
+}
+
+// The ring of the calling thread, on its first line a free one or else a new
+// one. Threads past ASYNC_LOG_MAX_THREADS get the shared one, which comes
+// last.
+static AsyncLogRing *GetRing()
+{
+    if (t_pRing)
+        return t_pRing;
+
+    std::lock_guard<std::mutex> lock(s_ringsMutex);
+    int nRings = s_nRings.load(std::memory_order_relaxed);
+    for (int i = 0; i < nRings && i < ASYNC_LOG_MAX_THREADS; i++)
+    {
+        // Only the drain frees a ring and only GetRing takes one, under
+        // s_ringsMutex.
+        AsyncLogRing *pRing = s_apRings[i];
+        if (pRing->state.load(std::memory_order_acquire) == ASYNC_LOG_RING_FREE)
+        {
+            pRing->nUnreported = 0;
+            pRing->state.store(ASYNC_LOG_RING_IN_USE, std::memory_order_relaxed);
+            t_pRing = pRing;
+            ReleaseRingAtExit(pRing);
+            return t_pRing;
+        }
+    }
+    if (nRings < ASYNC_LOG_MAX_THREADS)
+    {
+        t_pRing = NewRing(false);
+        s_apRings[nRings] = t_pRing;
+        s_nRings.store(nRings + 1, std::memory_order_release);
+        ReleaseRingAtExit(t_pRing);
+        return t_pRing;
+    }
+    if (nRings == ASYNC_LOG_MAX_THREADS)
+    {
+        s_apRings[nRings] = NewRing(true);
+        s_nRings.store(nRings + 1, std::memory_order_release);
+    }
+    t_pRing = s_apRings[ASYNC_LOG_MAX_THREADS];
+    return t_pRing;
+}
+
+static bool WriteRecord(AsyncLogRing *pRing, AsyncLogSink *pSink, int level, uint64_t uTimeUs, uint32_t nSuppressed,
+                        const char *szLine, size_t nLength)
+{
+    uint32_t uSize = (uint32_t)((sizeof(AsyncLogRecord) + nLength + 7) & ~(size_t)7);
+    uint64_t uWrite = pRing->uWritten.load(std::memory_order_relaxed);
+    uint64_t uRead = pRing->uRead.load(std::memory_order_acquire);
+    uint32_t uOffset = (uint32_t)(uWrite & (ASYNC_LOG_RING_BYTES - 1));
+    uint32_t uTail = ASYNC_LOG_RING_BYTES - uOffset;
+
+    // A line is never split: if it does not fit before the end of the ring,
+    // the rest of the ring is skipped. A tail too short for a record is
+    // skipped without saying so; the drain skips it too.
+    uint32_t uSkip = uTail < uSize ? uTail : 0;
+    if (uWrite + uSkip + uSize - uRead > ASYNC_LOG_RING_BYTES)
+    {
+        pRing->nDropped.store(pRing->nDropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        pRing->nUnreported++;
+        return false;
+    }
+
+    char *pBytes = (char *)pRing->aBytes;
+    AsyncLogRecord record;
+    memset(&record, 0, sizeof(record));
+    if (uSkip >= sizeof(AsyncLogRecord))
+    {
+        record.uSize = uSkip;
+        memcpy(pBytes + uOffset, &record, sizeof(record));
+    }
+    uWrite += uSkip;
+    uOffset = (uint32_t)(uWrite & (ASYNC_LOG_RING_BYTES - 1));
+
+    record.uSize = uSize;
+    record.uLength = (uint16_t)nLength;
+    record.level = (uint8_t)level;
+    record.nSuppressed = nSuppressed;
+    record.nDropped = pRing->nUnreported;
+    record.uTimeUs = uTimeUs;
+    record.pSink = pSink;
+    memcpy(pBytes + uOffset, &record, sizeof(record));
+    memcpy(pBytes + uOffset + sizeof(record), szLine, nLength);
+    pRing->nUnreported = 0;
+    pRing->nPosted.store(pRing->nPosted.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    pRing->uWritten.store(uWrite + uSize, std::memory_order_release);
+    return true;
+}
+
+// Reads the first line at or after *puRead and before uEnd, moving *puRead
+// past padding. Returns false if there is none.
+static bool PeekRecord(AsyncLogRing *pRing, uint64_t *puRead, uint64_t uEnd, AsyncLogRecord *pRecord)
+{
+    const char *pBytes = (const char *)pRing->aBytes;
+    while (*puRead < uEnd)
+    {
+        uint32_t uOffset = (uint32_t)(*puRead & (ASYNC_LOG_RING_BYTES - 1));
+        uint32_t uTail = ASYNC_LOG_RING_BYTES - uOffset;
+        if (uTail < sizeof(AsyncLogRecord))
+        {
+            *puRead += uTail;
+            continue;
+        }
+        memcpy(pRecord, pBytes + uOffset, sizeof(AsyncLogRecord));
+        if (pRecord->pSink)
+            return true;
+        *puRead += pRecord->uSize;
+    }
+    return false;
+}
+
+static const char *FormatTime(uint64_t uTimeUs)
+{
+    uint64_t uSecond = uTimeUs / 1000000;
+    if (uSecond != s_uTimeSecond)
+    {
+        time_t t = (time_t)uSecond;
+        struct tm tm;
+#if defined(_WIN32)
+        localtime_s(&tm, &t);
+#else
+        localtime_r(&t, &tm);
+#endif
+        sprintf(s_szTime, "%02d:%02d:%02d", tm.tm_hour, tm.tm_min, tm.tm_sec);
+        s_uTimeSecond = uSecond;
+    }
+    return s_szTime;
+}
+
+static void WriteLine(AsyncLogFlusher *pFlusher, AsyncLogRing *pRing, uint64_t uRead, const AsyncLogRecord &record)
+{
+    char szLine[ASYNC_LOG_LINE_MAX + 128];
+    const char *pText = (const char *)pRing->aBytes + (uRead & (ASYNC_LOG_RING_BYTES - 1)) + sizeof(AsyncLogRecord);
+    size_t nLength = record.uLength;
+    memcpy(szLine, pText, nLength);
+    if (record.nSuppressed)
+    {
+        nLength += sprintf(szLine + nLength, " (%u more from here held back)", record.nSuppressed);
+        s_nSuppressed.fetch_add(record.nSuppressed, std::memory_order_relaxed);
+    }
+    if (record.nDropped)
+        nLength += sprintf(szLine + nLength, " (%u lines of this thread dropped before, the log was full)", record.nDropped);
+    szLine[nLength] = '\0';
+
+    record.pSink->WriteLine(record.level, FormatTime(record.uTimeUs), szLine, nLength);
+    s_nWritten.fetch_add(1, std::memory_order_relaxed);
+
+    std::vector<AsyncLogSink *> &apSinks = pFlusher->apSinks;
+    size_t i = 0;
+    while (i < apSinks.size() && apSinks[i] != record.pSink)
+    {
+        i++;
+    }
+    if (i == apSinks.size())
+        apSinks.push_back(record.pSink);
+}
+
+// Writes the lines of all rings up to where they were when it started,
+// oldest first.
+static void DrainLocked(AsyncLogFlusher *pFlusher)
+{
+    static uint64_t s_auRead[ASYNC_LOG_MAX_THREADS + 1];
+    static uint64_t s_auEnd[ASYNC_LOG_MAX_THREADS + 1];
+    static AsyncLogRecord s_aHeads[ASYNC_LOG_MAX_THREADS + 1];
+    static bool s_abHead[ASYNC_LOG_MAX_THREADS + 1];
+
+    int nRings = s_nRings.load(std::memory_order_acquire);
+    for (int i = 0; i < nRings; i++)
+    {
+        s_auRead[i] = s_apRings[i]->uRead.load(std::memory_order_relaxed);
+        s_auEnd[i] = s_apRings[i]->uWritten.load(std::memory_order_acquire);
+        s_abHead[i] = PeekRecord(s_apRings[i], &s_auRead[i], s_auEnd[i], &s_aHeads[i]);
+    }
+
+    for (;;)
+    {
+        int iOldest = -1;
+        for (int i = 0; i < nRings; i++)
+        {
+            if (s_abHead[i] && (iOldest < 0 || s_aHeads[i].uTimeUs < s_aHeads[iOldest].uTimeUs))
+                iOldest = i;
+        }
+        if (iOldest < 0)
+            break;
+
+        AsyncLogRing *pRing = s_apRings[iOldest];
+        WriteLine(pFlusher, pRing, s_auRead[iOldest], s_aHeads[iOldest]);
+        s_auRead[iOldest] += s_aHeads[iOldest].uSize;
+        s_abHead[iOldest] = PeekRecord(pRing, &s_auRead[iOldest], s_auEnd[iOldest], &s_aHeads[iOldest]);
+        pRing->uRead.store(s_auRead[iOldest], std::memory_order_release);
+    }
+
+    // A ring whose thread has exited cannot fill any more; once its lines
+    // are written it is free.
+    for (int i = 0; i < nRings; i++)
+    {
+        AsyncLogRing *pRing = s_apRings[i];
+        if (pRing->state.load(std::memory_order_acquire) == ASYNC_LOG_RING_EXITED
+            && pRing->uRead.load(std::memory_order_relaxed) == pRing->uWritten.load(std::memory_order_acquire))
+        {
+            pRing->state.store(ASYNC_LOG_RING_FREE, std::memory_order_release);
+        }
+    }
+
+    for (size_t i = 0; i < pFlusher->apSinks.size(); i++)
+    {
+        pFlusher->apSinks[i]->FlushLines();
+    }
+    pFlusher->apSinks.clear();
+}
+
+void AsyncLogFlush()
+{
+    AsyncLogFlusher *pFlusher = s_pFlusher.load(std::memory_order_acquire);
+    if (!pFlusher)
+        return;
+    std::lock_guard<std::mutex> lock(pFlusher->drainMutex);
+    DrainLocked(pFlusher);
+}
+
+static void FlushThread(AsyncLogFlusher *pFlusher)
+{
+    std::unique_lock<std::mutex> lock(pFlusher->wakeMutex);
+    for (;;)
+    {
+        // Posting does not take wakeMutex, so a wake-up may be missed; the
+        // line then waits for the timeout.
+        pFlusher->wake.wait_for(lock, std::chrono::milliseconds(ASYNC_LOG_FLUSH_MS),
+                                []() { return s_bWake.load(std::memory_order_relaxed); });
+        s_bWake.store(false, std::memory_order_relaxed);
+        lock.unlock();
+        AsyncLogFlush();
+        lock.lock();
+    }
+}
+
+// The background thread may be gone by now, killed while it held the drain
+// mutex; then the lines are lost rather than the exit hung.
+static void FlushAtExit()
+{
+    AsyncLogFlusher *pFlusher = s_pFlusher.load(std::memory_order_acquire);
+    if (pFlusher && pFlusher->drainMutex.try_lock())
+    {
+        DrainLocked(pFlusher);
+        pFlusher->drainMutex.unlock();
+    }
+}
+
+static AsyncLogFlusher *StartFlusher()
+{
+    AsyncLogFlusher *pFlusher = s_pFlusher.load(std::memory_order_acquire);
+    if (pFlusher)
+        return pFlusher;
+
+    std::lock_guard<std::mutex> lock(s_ringsMutex);
+    pFlusher = s_pFlusher.load(std::memory_order_relaxed);
+    if (!pFlusher)
+    {
+        pFlusher = new AsyncLogFlusher;
+        std::thread(FlushThread, pFlusher).detach();
+        atexit(FlushAtExit);
+        s_pFlusher.store(pFlusher, std::memory_order_release);
+    }
+    return pFlusher;
+}
+
+bool AsyncLogPost(AsyncLogSink *pSink, int level, uint64_t uTimeUs, uint32_t nSuppressed,
+                  const char *szLine, size_t nLength)
+{
+    if (!pSink)
+        return false;
+    if (nLength > ASYNC_LOG_LINE_MAX)
+        nLength = ASYNC_LOG_LINE_MAX;
+
+    AsyncLogFlusher *pFlusher = StartFlusher();
+    AsyncLogRing *pRing = GetRing();
+    bool bPosted;
+    if (pRing->bShared)
+    {
+        std::lock_guard<std::mutex> lock(pRing->mutex);
+        bPosted = WriteRecord(pRing, pSink, level, uTimeUs, nSuppressed, szLine, nLength);
+    }
+    else
+    {
+        bPosted = WriteRecord(pRing, pSink, level, uTimeUs, nSuppressed, szLine, nLength);
+    }
+
+    if (level >= ASYNC_LOG_URGENT_LEVEL && !s_bWake.load(std::memory_order_relaxed))
+    {
+        s_bWake.store(true, std::memory_order_relaxed);
+        pFlusher->wake.notify_one();
+    }
+    return bPosted;
+}
+
+void AsyncLogGetStats(AsyncLogStats *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+    int nRings = s_nRings.load(std::memory_order_acquire);
+    for (int i = 0; i < nRings; i++)
+    {
+        pStats->nPosted += s_apRings[i]->nPosted.load(std::memory_order_relaxed);
+        pStats->nDropped += s_apRings[i]->nDropped.load(std::memory_order_relaxed);
+        pStats->nFreeRings += s_apRings[i]->state.load(std::memory_order_relaxed) == ASYNC_LOG_RING_FREE;
+    }
+    pStats->nRings = (uint32_t)nRings;
+    pStats->nWritten = s_nWritten.load(std::memory_order_relaxed);
+    pStats->nSuppressed = s_nSuppressed.load(std::memory_order_relaxed);
+}
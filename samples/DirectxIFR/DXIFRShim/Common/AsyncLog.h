@@ -0,0 +1,142 @@
+/*!
+ * \brief
+ * Per-thread log rings written out by a background thread
+ *
+ * \file
+ *
+ * LOG_* (Logger.h) used to take the logger's critical section, format the
+ * time with localtime_s, then write and flush the stream, all on the thread
+ * that logged, so a frame loop that logged waited for the file or the socket
+ * and for every other thread logging. Now the thread that logs formats the
+ * message into an AsyncLogStream on its stack and copies it into a ring of
+ * its own; a background thread takes the lines out of all rings, oldest
+ * first, and writes them to their AsyncLogSink.
+ *
+ * Each ring has one writer, the thread it belongs to, and one reader,
+ * whichever thread holds the drain mutex: the background thread, or one that
+ * called AsyncLogFlush. Neither waits for the other. A line that does not fit
+ * in the ring is dropped rather than waited for, and the next line of that
+ * thread that fits says how many were. Threads past ASYNC_LOG_MAX_THREADS
+ * share one more ring under a mutex.
+ *
+ * A thread that exits gives its ring up. Once the drain has written its last
+ * lines the ring is free, and the next thread to log takes it over, so
+ * threads that come and go do not use up the rings.
+ *
+ * Warnings and errors wake the background thread at once; other lines wait
+ * for its next round, at most ASYNC_LOG_FLUSH_MS later. Lines still queued
+ * when the process exits are written by an atexit handler if it can.
+ *
+ * A line carries the time it was posted at, in microseconds; the background
+ * thread turns it into local time only when the second changes.
+ *
+ * AsyncLogAllow lets ASYNC_LOG_RATE_LIMIT lines a second through from each
+ * call site, and the first line let through after some were held back says
+ * how many. Call sites are told apart by a hash of file and line into
+ * ASYNC_LOG_RATE_SITES counters, so two of them may share a limit.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ostream>
+#include <streambuf>
+
+// Bytes of each thread's ring; a power of two.
+#define ASYNC_LOG_RING_BYTES        65536
+
+// Longer lines are cut.
+#define ASYNC_LOG_LINE_MAX          512
+
+// Threads with a ring of their own.
+#define ASYNC_LOG_MAX_THREADS       256
+
+// How long a line below ASYNC_LOG_URGENT_LEVEL may wait to be written.
+#define ASYNC_LOG_FLUSH_MS          20
+#define ASYNC_LOG_URGENT_LEVEL      3
+
+// Lines a second from one call site, and the counters call sites hash to.
+#define ASYNC_LOG_RATE_LIMIT        20
+#define ASYNC_LOG_RATE_SITES        1024
+
+class AsyncLogSink
+{
+public:
+    virtual ~AsyncLogSink() {}
+
+    // Writes one line, without its newline. szTime is the local time it was
+    // posted at, "hh:mm:ss". Only ever called by the thread draining.
+    virtual void WriteLine(int level, const char *szTime, const char *szLine, size_t nLength) = 0;
+
+    // Called once the lines of a round are written.
+    virtual void FlushLines() {}
+};
+
+struct AsyncLogStats
+{
+    uint64_t    nPosted;
+    uint64_t    nWritten;
+    uint64_t    nDropped;       // the ring was full
+    uint64_t    nSuppressed;    // held back by AsyncLogAllow, as reported so far
+    uint32_t    nRings;         // created so far, the shared one included
+    uint32_t    nFreeRings;     // given up by their thread and drained
+};
+
+// Microseconds since 1970, what lines are stamped with.
+uint64_t AsyncLogNow();
+
+// Whether a line from szFile:nLine at uTimeUs is within the rate limit. If it
+// is, *pnSuppressed gets the lines of that site held back before it.
+bool AsyncLogAllow(const char *szFile, int nLine, uint64_t uTimeUs, uint32_t *pnSuppressed);
+
+// Queues a line for pSink without waiting for it; returns false if the ring
+// of the calling thread is full and the line was dropped. pSink must outlive
+// the line: flush before destroying it.
+bool AsyncLogPost(AsyncLogSink *pSink, int level, uint64_t uTimeUs, uint32_t nSuppressed,
+                  const char *szLine, size_t nLength);
+
+// Writes every line posted so far, on the calling thread.
+void AsyncLogFlush();
+
+void AsyncLogGetStats(AsyncLogStats *pStats);
+
+// The stream buffer of AsyncLogStream: a line on the stack, cut at
+// ASYNC_LOG_LINE_MAX.
+class AsyncLogBuffer : public std::streambuf
+{
+public:
+    AsyncLogBuffer()
+    {
+        setp(m_aLine, m_aLine + ASYNC_LOG_LINE_MAX);
+    }
+
+    const char *GetLine() const { return m_aLine; }
+    size_t GetLength() const { return (size_t)(pptr() - pbase()); }
+
+protected:
+    virtual int_type overflow(int_type c)
+    {
+        return traits_type::not_eof(c);
+    }
+
+private:
+    char            m_aLine[ASYNC_LOG_LINE_MAX];
+
+    AsyncLogBuffer(const AsyncLogBuffer &);
+    AsyncLogBuffer &operator=(const AsyncLogBuffer &);
+};
+
+// Formats one line with operator<< without allocating.
+class AsyncLogStream : private AsyncLogBuffer, public std::ostream
+{
+public:
+    AsyncLogStream() : std::ostream(static_cast<AsyncLogBuffer *>(this)) {}
+
+    using AsyncLogBuffer::GetLine;
+    using AsyncLogBuffer::GetLength;
+
+private:
+    AsyncLogStream(const AsyncLogStream &);
+    AsyncLogStream &operator=(const AsyncLogStream &);
+};
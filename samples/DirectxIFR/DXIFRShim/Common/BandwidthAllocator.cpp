@@ -0,0 +1,409 @@
+/*!
+ * \brief
+ * Splits the streaming bandwidth between the players
+ *
+ * \file
+ *
+ * See BandwidthAllocator.h.
+ */
+
+#include "BandwidthAllocator.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static double NowMs()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return now.QuadPart * 1000.0 / freq.QuadPart;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+void GetDefaultBandwidthConfig(BandwidthConfig *pConfig)
+{
+    pConfig->uBpsPerPlayer = 2000000;
+    pConfig->uTotalBps = 0;
+    pConfig->uMinBps = 300000;
+    pConfig->uMaxBps = 8000000;
+    pConfig->fHysteresis = 0.15f;
+    pConfig->uMinReconfigureMs = 2000;
+    pConfig->afStateWeights[PLAYER_ACTIVITY_NONE] = 2;
+    pConfig->afStateWeights[PLAYER_ACTIVITY_IDLE] = 1;
+    pConfig->afStateWeights[PLAYER_ACTIVITY_INPUT] = 2;
+    pConfig->afStateWeights[PLAYER_ACTIVITY_SHOOTING] = 3;
+}
+
+void WaterFillBandwidth(const float *afWeights, int nPlayers, uint32_t uBudgetBps, uint32_t uMinBps, uint32_t uMaxBps,
+                        uint32_t *aBps)
+{
+    if (nPlayers <= 0)
+        return;
+    if ((uint64_t)uMinBps * nPlayers >= uBudgetBps)
+    {
+        for (int i = 0; i < nPlayers; i++)
+        {
+            aBps[i] = uBudgetBps / nPlayers;
+        }
+        return;
+    }
+
+    // Clamp the players whose share falls below the minimum, then those above
+    // the maximum, and split again what is left between the others; each
+    // round fixes at least one player.
+    bool abFixed[BANDWIDTH_MAX_PLAYERS] = { false };
+    double fRemaining = uBudgetBps;
+    for (;;)
+    {
+        double fWeights = 0;
+        int nFree = 0;
+        for (int i = 0; i < nPlayers; i++)
+        {
+            if (!abFixed[i])
+            {
+                fWeights += afWeights[i] > 0 ? afWeights[i] : 0;
+                nFree++;
+            }
+        }
+        if (!nFree)
+            return;
+
+        bool bClamped = false;
+        for (int pass = 0; pass < 2 && !bClamped; pass++)
+        {
+            for (int i = 0; i < nPlayers; i++)
+            {
+                if (abFixed[i])
+                    continue;
+                double fWeight = afWeights[i] > 0 ? afWeights[i] : 0;
+                double fShare = fWeights > 0 ? fRemaining * fWeight / fWeights : fRemaining / nFree;
+                uint32_t uClamp = pass == 0 ? uMinBps : uMaxBps;
+                if (pass == 0 ? fShare < uMinBps : fShare > uMaxBps)
+                {
+                    aBps[i] = uClamp;
+                    abFixed[i] = true;
+                    fRemaining -= uClamp;
+                    bClamped = true;
+                }
+            }
+        }
+        if (bClamped)
+            continue;
+
+        for (int i = 0; i < nPlayers; i++)
+        {
+            if (!abFixed[i])
+            {
+                double fWeight = afWeights[i] > 0 ? afWeights[i] : 0;
+                double fShare = fWeights > 0 ? fRemaining * fWeight / fWeights : fRemaining / nFree;
+                aBps[i] = fShare > 0 ? (uint32_t)fShare : 0;
+            }
+        }
+        return;
+    }
+}
+
+class WeightedBandwidthPolicy : public IBandwidthPolicy
+{
+public:
+    virtual void Allocate(const BandwidthConfig &config, const PlayerActivityState *aStates, int nPlayers,
+                          uint32_t uBudgetBps, uint32_t *aBps)
+    {
+        float afWeights[BANDWIDTH_MAX_PLAYERS];
+        for (int i = 0; i < nPlayers; i++)
+        {
+            afWeights[i] = config.afStateWeights[aStates[i] <= PLAYER_ACTIVITY_SHOOTING ? aStates[i] : PLAYER_ACTIVITY_NONE];
+        }
+        WaterFillBandwidth(afWeights, nPlayers, uBudgetBps, config.uMinBps, config.uMaxBps, aBps);
+    }
+};
+
+class EqualBandwidthPolicy : public IBandwidthPolicy
+{
+public:
+    virtual void Allocate(const BandwidthConfig &config, const PlayerActivityState *, int nPlayers,
+                          uint32_t uBudgetBps, uint32_t *aBps)
+    {
+        float afWeights[BANDWIDTH_MAX_PLAYERS];
+        for (int i = 0; i < nPlayers; i++)
+        {
+            afWeights[i] = 1;
+        }
+        WaterFillBandwidth(afWeights, nPlayers, uBudgetBps, config.uMinBps, config.uMaxBps, aBps);
+    }
+};
+
+static const char *s_aPolicyNames[] = { "weighted", "equal" };
+
+BandwidthPolicyType GetBandwidthPolicyType()
+{
+    const char *szName = getenv(BANDWIDTH_POLICY_ENV);
+    if (szName)
+    {
+        for (int i = 0; i < (int)(sizeof(s_aPolicyNames) / sizeof(s_aPolicyNames[0])); i++)
+        {
+            if (!strcmp(szName, s_aPolicyNames[i]))
+                return (BandwidthPolicyType)i;
+        }
+    }
+    return BANDWIDTH_POLICY_WEIGHTED;
+}
+
+const char *GetBandwidthPolicyName(BandwidthPolicyType eType)
+{
+    if (eType < 0 || eType >= (int)(sizeof(s_aPolicyNames) / sizeof(s_aPolicyNames[0])))
+        return "unknown";
+    return s_aPolicyNames[eType];
+}
+
+IBandwidthPolicy *CreateBandwidthPolicy(BandwidthPolicyType eType)
+{
+    switch (eType)
+    {
+    case BANDWIDTH_POLICY_EQUAL:
+        return new EqualBandwidthPolicy();
+    default:
+        return new WeightedBandwidthPolicy();
+    }
+}
+
+BandwidthAllocator::BandwidthAllocator(IBandwidthPolicy *pPolicy, const BandwidthConfig &config)
+{
+    m_pPolicy = pPolicy;
+    m_config = config;
+    for (int i = 0; i < BANDWIDTH_MAX_PLAYERS; i++)
+    {
+        Player &player = m_aPlayers[i];
+        player.eState = PLAYER_ACTIVITY_NONE;
+        player.uTargetBps = 0;
+        player.bChanged = false;
+        player.bActive = false;
+        player.bAllocated = false;
+        player.uTarget = 0;
+        player.uLastChangeMs = 0;
+        player.nReconfigures = 0;
+        player.eLoggedState = -1;
+    }
+    m_fActivityLog = NULL;
+    m_uLogStartMs = (uint64_t)-1;
+    m_bStop = false;
+}
+
+BandwidthAllocator::~BandwidthAllocator()
+{
+    Stop();
+    if (m_fActivityLog)
+        fclose(m_fActivityLog);
+    delete m_pPolicy;
+}
+
+void BandwidthAllocator::Start()
+{
+    if (m_thread.joinable())
+        return;
+    m_bStop = false;
+    m_thread = std::thread(&BandwidthAllocator::ThreadProc, this);
+}
+
+void BandwidthAllocator::Stop()
+{
+    if (!m_thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bStop = true;
+    }
+    m_stopCondition.notify_all();
+    m_thread.join();
+}
+
+void BandwidthAllocator::ThreadProc()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_bStop)
+    {
+        lock.unlock();
+        Tick((uint64_t)NowMs());
+        lock.lock();
+        m_stopCondition.wait_for(lock, std::chrono::milliseconds(BANDWIDTH_TICK_MS));
+    }
+}
+
+// A new player's first target comes with the next tick; the others' shares
+// shrink at the same time, whatever the hysteresis and rate limit say.
+void BandwidthAllocator::AddPlayer(int index)
+{
+    if (index < 0 || index >= BANDWIDTH_MAX_PLAYERS)
+        return;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Player &player = m_aPlayers[index];
+    player.bActive = true;
+    player.bAllocated = false;
+    player.eState = PLAYER_ACTIVITY_NONE;
+    player.bChanged = false;
+}
+
+void BandwidthAllocator::RemovePlayer(int index)
+{
+    if (index < 0 || index >= BANDWIDTH_MAX_PLAYERS)
+        return;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_aPlayers[index].bActive = false;
+}
+
+void BandwidthAllocator::ReportActivity(int index, PlayerActivityState eState)
+{
+    if (index >= 0 && index < BANDWIDTH_MAX_PLAYERS)
+        m_aPlayers[index].eState.store(eState, std::memory_order_relaxed);
+}
+
+bool BandwidthAllocator::TakeTarget(int index, uint32_t *puTargetBps)
+{
+    if (index < 0 || index >= BANDWIDTH_MAX_PLAYERS)
+        return false;
+    Player &player = m_aPlayers[index];
+    if (!player.bChanged.load(std::memory_order_relaxed) || !player.bChanged.exchange(false))
+        return false;
+    *puTargetBps = player.uTargetBps.load(std::memory_order_acquire);
+    return true;
+}
+
+void BandwidthAllocator::Tick(uint64_t uNowMs)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    int aIndices[BANDWIDTH_MAX_PLAYERS];
+    PlayerActivityState aStates[BANDWIDTH_MAX_PLAYERS];
+    int nPlayers = 0;
+    for (int i = 0; i < BANDWIDTH_MAX_PLAYERS; i++)
+    {
+        if (!m_aPlayers[i].bActive)
+            continue;
+        aIndices[nPlayers] = i;
+        aStates[nPlayers] = (PlayerActivityState)m_aPlayers[i].eState.load(std::memory_order_relaxed);
+        nPlayers++;
+
+        if (m_fActivityLog && aStates[nPlayers - 1] != m_aPlayers[i].eLoggedState)
+        {
+            if (m_uLogStartMs == (uint64_t)-1)
+                m_uLogStartMs = uNowMs;
+            fprintf(m_fActivityLog, "%llu %d %d\n", (unsigned long long)(uNowMs - m_uLogStartMs), i, (int)aStates[nPlayers - 1]);
+            fflush(m_fActivityLog);
+            m_aPlayers[i].eLoggedState = aStates[nPlayers - 1];
+        }
+    }
+    if (!nPlayers)
+        return;
+
+    uint32_t uBudget = m_config.uTotalBps ? m_config.uTotalBps : m_config.uBpsPerPlayer * nPlayers;
+    uint32_t aWanted[BANDWIDTH_MAX_PLAYERS];
+    m_pPolicy->Allocate(m_config, aStates, nPlayers, uBudget, aWanted);
+
+    // Hold small and too frequent changes.
+    uint32_t aNext[BANDWIDTH_MAX_PLAYERS];
+    uint64_t uSum = 0;
+    for (int i = 0; i < nPlayers; i++)
+    {
+        const Player &player = m_aPlayers[aIndices[i]];
+        aNext[i] = aWanted[i];
+        if (player.bAllocated)
+        {
+            uint32_t uDelta = aWanted[i] > player.uTarget ? aWanted[i] - player.uTarget : player.uTarget - aWanted[i];
+            if (uDelta <= m_config.fHysteresis * player.uTarget || uNowMs - player.uLastChangeMs < m_config.uMinReconfigureMs)
+                aNext[i] = player.uTarget;
+        }
+        uSum += aNext[i];
+    }
+
+    // Let the largest held decreases through until the budget holds.
+    while (uSum > uBudget)
+    {
+        int iLargest = -1;
+        for (int i = 0; i < nPlayers; i++)
+        {
+            if (aNext[i] > aWanted[i] && (iLargest < 0 || aNext[i] - aWanted[i] > aNext[iLargest] - aWanted[iLargest]))
+                iLargest = i;
+        }
+        if (iLargest < 0)
+            break;
+        uSum -= aNext[iLargest] - aWanted[iLargest];
+        aNext[iLargest] = aWanted[iLargest];
+    }
+
+    for (int i = 0; i < nPlayers; i++)
+    {
+        Player &player = m_aPlayers[aIndices[i]];
+        if (player.bAllocated && aNext[i] == player.uTarget)
+            continue;
+        player.bAllocated = true;
+        player.uTarget = aNext[i];
+        player.uLastChangeMs = uNowMs;
+        player.nReconfigures++;
+        player.uTargetBps.store(aNext[i], std::memory_order_release);
+        player.bChanged.store(true, std::memory_order_release);
+    }
+}
+
+void BandwidthAllocator::SetActivityLog(FILE *fLog)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fActivityLog)
+        fclose(m_fActivityLog);
+    m_fActivityLog = fLog;
+    m_uLogStartMs = (uint64_t)-1;
+    for (int i = 0; i < BANDWIDTH_MAX_PLAYERS; i++)
+    {
+        m_aPlayers[i].eLoggedState = -1;
+    }
+}
+
+bool BandwidthAllocator::GetPlayerStats(int index, BandwidthPlayerStats *pStats)
+{
+    if (index < 0 || index >= BANDWIDTH_MAX_PLAYERS)
+        return false;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const Player &player = m_aPlayers[index];
+    pStats->bActive = player.bActive;
+    pStats->eState = (PlayerActivityState)player.eState.load(std::memory_order_relaxed);
+    pStats->uTargetBps = player.bAllocated ? player.uTarget : 0;
+    pStats->nReconfigures = player.nReconfigures;
+    return true;
+}
+
+static std::mutex s_sharedAllocatorMutex;
+static BandwidthAllocator *s_pSharedAllocator = NULL;
+
+BandwidthAllocator *BandwidthAllocator::GetShared()
+{
+    std::lock_guard<std::mutex> lock(s_sharedAllocatorMutex);
+    if (!s_pSharedAllocator)
+    {
+        BandwidthConfig config;
+        GetDefaultBandwidthConfig(&config);
+        s_pSharedAllocator = new BandwidthAllocator(CreateBandwidthPolicy(GetBandwidthPolicyType()), config);
+        const char *szLog = getenv(BANDWIDTH_ACTIVITY_LOG_ENV);
+        if (szLog && *szLog)
+        {
+            FILE *fLog = fopen(szLog, "w");
+            if (fLog)
+                s_pSharedAllocator->SetActivityLog(fLog);
+            else
+                fprintf(stderr, "BandwidthAllocator: cannot open %s\n", szLog);
+        }
+        s_pSharedAllocator->Start();
+    }
+    return s_pSharedAllocator;
+}
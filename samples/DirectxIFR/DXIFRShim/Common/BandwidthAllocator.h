@@ -0,0 +1,152 @@
+/*!
+ * \brief
+ * Splits the streaming bandwidth between the players
+ *
+ * \file
+ *
+ * Encoder threads report their player's activity every frame and pick up a
+ * new target bitrate when there is one; both are a single atomic access. The
+ * allocator recomputes the targets on a tick of its own, every
+ * BANDWIDTH_TICK_MS:
+ * - the policy splits the budget between the players, each getting at least
+ *   uMinBps and at most uMaxBps unless the budget cannot cover the minimum;
+ * - a target that moves by less than fHysteresis, or whose player was
+ *   reconfigured less than uMinReconfigureMs ago, is held, so the encoders
+ *   are not reconfigured for every small or short-lived change;
+ * - held decreases go through anyway when the budget would be overrun.
+ * The budget is uBpsPerPlayer for every player unless uTotalBps is set.
+ *
+ * The policy is picked with DXIFRSHIM_BANDWIDTH_POLICY ("weighted", the
+ * default, or "equal"). If DXIFRSHIM_ACTIVITY_LOG names a file, every change
+ * of a player's activity is logged there for BandwidthSimulator to replay.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "PlayerActivity.h"
+
+#define BANDWIDTH_MAX_PLAYERS       16
+#define BANDWIDTH_TICK_MS           100
+#define BANDWIDTH_POLICY_ENV        "DXIFRSHIM_BANDWIDTH_POLICY"
+#define BANDWIDTH_ACTIVITY_LOG_ENV  "DXIFRSHIM_ACTIVITY_LOG"
+
+struct BandwidthConfig
+{
+    uint32_t    uBpsPerPlayer;      // budget for each player
+    uint32_t    uTotalBps;          // fixed budget instead, if not 0
+    uint32_t    uMinBps;
+    uint32_t    uMaxBps;
+    float       fHysteresis;        // relative change below which a target is held
+    uint32_t    uMinReconfigureMs;  // per player
+    float       afStateWeights[4];  // indexed by PlayerActivityState
+};
+
+// 2 Mbps per player, 300 kbps to 8 Mbps each, 15% hysteresis, a
+// reconfiguration every 2 s at most, and weights 1, 2 and 3 for idle, input
+// and shooting. Players that have not reported count as giving input.
+void GetDefaultBandwidthConfig(BandwidthConfig *pConfig);
+
+enum BandwidthPolicyType
+{
+    BANDWIDTH_POLICY_WEIGHTED,      // in proportion to the activity weights
+    BANDWIDTH_POLICY_EQUAL,         // the same for everyone
+};
+
+class IBandwidthPolicy
+{
+public:
+    virtual ~IBandwidthPolicy() {}
+
+    // Fills aBps for nPlayers players whose activities are aStates.
+    virtual void Allocate(const BandwidthConfig &config, const PlayerActivityState *aStates, int nPlayers,
+                          uint32_t uBudgetBps, uint32_t *aBps) = 0;
+};
+
+BandwidthPolicyType GetBandwidthPolicyType();
+const char *GetBandwidthPolicyName(BandwidthPolicyType eType);
+IBandwidthPolicy *CreateBandwidthPolicy(BandwidthPolicyType eType);
+
+// Splits uBudgetBps in proportion to afWeights, with every share clamped to
+// [uMinBps, uMaxBps]; what a clamped player cannot take goes to the others.
+// If the budget cannot cover uMinBps for everyone it is split equally.
+void WaterFillBandwidth(const float *afWeights, int nPlayers, uint32_t uBudgetBps, uint32_t uMinBps, uint32_t uMaxBps,
+                        uint32_t *aBps);
+
+struct BandwidthPlayerStats
+{
+    bool                    bActive;
+    PlayerActivityState     eState;
+    uint32_t                uTargetBps;     // 0 until the first tick
+    uint32_t                nReconfigures;  // target changes published
+};
+
+class BandwidthAllocator
+{
+public:
+    // Takes ownership of pPolicy.
+    BandwidthAllocator(IBandwidthPolicy *pPolicy, const BandwidthConfig &config);
+    ~BandwidthAllocator();
+
+    // Runs Tick every BANDWIDTH_TICK_MS on a thread of its own.
+    void Start();
+    void Stop();
+
+    void AddPlayer(int index);
+    void RemovePlayer(int index);
+
+    // Encoder thread, every frame.
+    void ReportActivity(int index, PlayerActivityState eState);
+
+    // Returns true, once, when player index has a new target. Encoder thread.
+    bool TakeTarget(int index, uint32_t *puTargetBps);
+
+    // Recomputes the targets as of uNowMs. The simulator calls it directly
+    // instead of starting the tick thread.
+    void Tick(uint64_t uNowMs);
+
+    // Logs "<ms> <player> <state>" for every change of activity. Takes
+    // ownership of fLog.
+    void SetActivityLog(FILE *fLog);
+
+    bool GetPlayerStats(int index, BandwidthPlayerStats *pStats);
+
+    // The allocator shared by all encoder threads of the process, started on
+    // first use.
+    static BandwidthAllocator *GetShared();
+
+private:
+    struct Player
+    {
+        std::atomic<int>        eState;         // written by the encoder thread
+        std::atomic<uint32_t>   uTargetBps;     // read by the encoder thread
+        std::atomic<bool>       bChanged;
+        bool                    bActive;
+        bool                    bAllocated;     // uTarget is valid
+        uint32_t                uTarget;
+        uint64_t                uLastChangeMs;
+        uint32_t                nReconfigures;
+        int                     eLoggedState;
+    };
+
+    void ThreadProc();
+
+    IBandwidthPolicy           *m_pPolicy;
+    BandwidthConfig             m_config;
+    Player                      m_aPlayers[BANDWIDTH_MAX_PLAYERS];
+    FILE                       *m_fActivityLog;
+    uint64_t                    m_uLogStartMs;      // time of the first log line, or -1
+    std::mutex                  m_mutex;            // everything but the atomics
+    std::condition_variable     m_stopCondition;
+    bool                        m_bStop;
+    std::thread                 m_thread;
+
+    BandwidthAllocator(const BandwidthAllocator &);
+    BandwidthAllocator &operator=(const BandwidthAllocator &);
+};
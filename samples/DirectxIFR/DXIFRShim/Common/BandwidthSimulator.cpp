@@ -0,0 +1,185 @@
+/*!
+ * \brief
+ * Offline replay of player activity through the bandwidth allocator
+ *
+ * \file
+ *
+ * See BandwidthSimulator.h.
+ */
+
+#include "BandwidthSimulator.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+static bool EventBefore(const ActivityEvent &a, const ActivityEvent &b)
+{
+    return a.uTimeMs < b.uTimeMs;
+}
+
+bool LoadActivityTrace(const char *szPath, std::vector<ActivityEvent> &aEvents)
+{
+    FILE *f = fopen(szPath, "r");
+    if (!f)
+        return false;
+
+    aEvents.clear();
+    char szLine[256];
+    bool bOk = true;
+    while (bOk && fgets(szLine, sizeof(szLine), f))
+    {
+        char *p = szLine + strspn(szLine, " \t");
+        if (*p == '#' || *p == '\r' || *p == '\n' || !*p)
+            continue;
+        unsigned long long uTimeMs;
+        int iPlayer, state;
+        bOk = sscanf(p, "%llu %d %d", &uTimeMs, &iPlayer, &state) == 3 && iPlayer >= 0 && iPlayer < BANDWIDTH_MAX_PLAYERS
+            && state >= PLAYER_ACTIVITY_NONE && state <= PLAYER_ACTIVITY_SHOOTING;
+        ActivityEvent event;
+        event.uTimeMs = uTimeMs;
+        event.iPlayer = iPlayer;
+        event.eState = (PlayerActivityState)state;
+        aEvents.push_back(event);
+    }
+    fclose(f);
+    std::stable_sort(aEvents.begin(), aEvents.end(), EventBefore);
+    return bOk;
+}
+
+static uint32_t NextRandom(uint32_t *puState)
+{
+    *puState = *puState * 1664525 + 1013904223;
+    return *puState >> 8;
+}
+
+static uint64_t RandomMs(uint32_t *puState, uint32_t uMinMs, uint32_t uMaxMs)
+{
+    return uMinMs + NextRandom(puState) % (uMaxMs - uMinMs + 1);
+}
+
+void MakeSyntheticActivityTrace(int nPlayers, uint64_t uDurationMs, uint32_t uSeed, std::vector<ActivityEvent> &aEvents)
+{
+    aEvents.clear();
+    for (int iPlayer = 0; iPlayer < nPlayers && iPlayer < BANDWIDTH_MAX_PLAYERS; iPlayer++)
+    {
+        uint32_t uState = uSeed * 2654435761u + iPlayer;
+        PlayerActivityState eState = PLAYER_ACTIVITY_IDLE;
+        uint64_t uTimeMs = 0;
+        while (uTimeMs < uDurationMs)
+        {
+            ActivityEvent event;
+            event.uTimeMs = uTimeMs;
+            event.iPlayer = iPlayer;
+            event.eState = eState;
+            aEvents.push_back(event);
+
+            // Shooting lasts at least the shot hold; input often comes in
+            // bursts shorter than a reconfiguration interval.
+            uint32_t uRoll = NextRandom(&uState) % 100;
+            if (eState == PLAYER_ACTIVITY_IDLE)
+            {
+                uTimeMs += RandomMs(&uState, 1000, 8000);
+                eState = uRoll < 70 ? PLAYER_ACTIVITY_INPUT : PLAYER_ACTIVITY_SHOOTING;
+            }
+            else if (eState == PLAYER_ACTIVITY_INPUT)
+            {
+                uTimeMs += uRoll < 40 ? RandomMs(&uState, 100, 400) : RandomMs(&uState, 500, 4000);
+                eState = NextRandom(&uState) % 100 < 50 ? PLAYER_ACTIVITY_IDLE : PLAYER_ACTIVITY_SHOOTING;
+            }
+            else
+            {
+                uTimeMs += RandomMs(&uState, PLAYER_ACTIVITY_SHOT_HOLD_US / 1000, 2 * PLAYER_ACTIVITY_SHOT_HOLD_US / 1000);
+                eState = uRoll < 60 ? PLAYER_ACTIVITY_INPUT : PLAYER_ACTIVITY_IDLE;
+            }
+        }
+    }
+    std::stable_sort(aEvents.begin(), aEvents.end(), EventBefore);
+}
+
+void SimulateBandwidth(const std::vector<ActivityEvent> &aEvents, BandwidthPolicyType eType, const BandwidthConfig &config,
+                       BandwidthSimReport *pReport)
+{
+    memset(pReport, 0, sizeof(*pReport));
+    if (aEvents.empty())
+        return;
+
+    BandwidthAllocator allocator(CreateBandwidthPolicy(eType), config);
+    IBandwidthPolicy *pReference = CreateBandwidthPolicy(eType);
+
+    bool abJoined[BANDWIDTH_MAX_PLAYERS] = { false };
+    PlayerActivityState aeStates[BANDWIDTH_MAX_PLAYERS];
+    uint32_t auEncoderBps[BANDWIDTH_MAX_PLAYERS] = { 0 };
+    uint64_t uStartMs = aEvents.front().uTimeMs;
+    uint64_t uEndMs = aEvents.back().uTimeMs + BANDWIDTH_TICK_MS;
+    size_t iEvent = 0;
+    int nTicks = 0;
+    double fFairness = 0, fTrackingError = 0, fUtilization = 0;
+    int nOverBudget = 0;
+
+    for (uint64_t uNowMs = uStartMs; uNowMs <= uEndMs; uNowMs += BANDWIDTH_TICK_MS)
+    {
+        for (; iEvent < aEvents.size() && aEvents[iEvent].uTimeMs <= uNowMs; iEvent++)
+        {
+            const ActivityEvent &event = aEvents[iEvent];
+            if (!abJoined[event.iPlayer])
+            {
+                allocator.AddPlayer(event.iPlayer);
+                abJoined[event.iPlayer] = true;
+                pReport->nPlayers++;
+            }
+            aeStates[event.iPlayer] = event.eState;
+            allocator.ReportActivity(event.iPlayer, event.eState);
+        }
+        allocator.Tick(uNowMs);
+
+        PlayerActivityState aeActive[BANDWIDTH_MAX_PLAYERS];
+        uint32_t auEncoder[BANDWIDTH_MAX_PLAYERS], auShare[BANDWIDTH_MAX_PLAYERS];
+        int nActive = 0;
+        for (int i = 0; i < BANDWIDTH_MAX_PLAYERS; i++)
+        {
+            if (!abJoined[i])
+                continue;
+            uint32_t uTargetBps;
+            if (allocator.TakeTarget(i, &uTargetBps))
+                auEncoderBps[i] = uTargetBps;
+            aeActive[nActive] = aeStates[i];
+            auEncoder[nActive] = auEncoderBps[i];
+            nActive++;
+        }
+
+        uint32_t uBudget = config.uTotalBps ? config.uTotalBps : config.uBpsPerPlayer * nActive;
+        pReference->Allocate(config, aeActive, nActive, uBudget, auShare);
+        double fSum = 0, fSumSquares = 0, fError = 0, fUsed = 0;
+        for (int i = 0; i < nActive; i++)
+        {
+            double fRatio = auShare[i] ? (double)auEncoder[i] / auShare[i] : 1;
+            fSum += fRatio;
+            fSumSquares += fRatio * fRatio;
+            fError += auEncoder[i] > auShare[i] ? auEncoder[i] - auShare[i] : auShare[i] - auEncoder[i];
+            fUsed += auEncoder[i];
+        }
+        fFairness += fSumSquares > 0 ? fSum * fSum / (nActive * fSumSquares) : 1;
+        fTrackingError += fError / uBudget;
+        fUtilization += fUsed / uBudget;
+        nOverBudget += fUsed > uBudget ? 1 : 0;
+        nTicks++;
+    }
+    delete pReference;
+
+    for (int i = 0; i < BANDWIDTH_MAX_PLAYERS; i++)
+    {
+        BandwidthPlayerStats stats;
+        if (allocator.GetPlayerStats(i, &stats) && stats.bActive)
+        {
+            pReport->anReconfigures[i] = stats.nReconfigures;
+            pReport->nReconfigures += stats.nReconfigures;
+        }
+    }
+    pReport->uDurationMs = uEndMs - uStartMs;
+    pReport->fReconfiguresPerPlayerMinute = pReport->nReconfigures * 60000.0 / ((double)pReport->uDurationMs * pReport->nPlayers);
+    pReport->fFairness = fFairness / nTicks;
+    pReport->fTrackingError = fTrackingError / nTicks;
+    pReport->fUtilization = fUtilization / nTicks;
+    pReport->fOverBudget = (double)nOverBudget / nTicks;
+}
@@ -0,0 +1,59 @@
+/*!
+ * \brief
+ * Offline replay of player activity through the bandwidth allocator
+ *
+ * \file
+ *
+ * Tunes allocator policies without a GPU or players. An activity trace, as
+ * logged through DXIFRSHIM_ACTIVITY_LOG or made up by
+ * MakeSyntheticActivityTrace, drives a BandwidthAllocator on a simulated
+ * clock, ticking every BANDWIDTH_TICK_MS. The encoders are assumed to take a
+ * new target as soon as it is published. The report compares their bitrates
+ * with what the policy alone, without hysteresis or rate limit, would give:
+ * - fFairness is Jain's index of each player's bitrate over its undamped
+ *   share, averaged over the ticks; 1 means every player gets the same
+ *   fraction of its share;
+ * - fTrackingError is the bitrate away from the undamped shares, as a
+ *   fraction of the budget;
+ * - fUtilization and fOverBudget are the budget used on average and the
+ *   fraction of ticks spent over it.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "BandwidthAllocator.h"
+
+struct ActivityEvent
+{
+    uint64_t                uTimeMs;
+    int                     iPlayer;
+    PlayerActivityState     eState;
+};
+
+// Reads "<ms> <player> <state>" lines; # starts a comment. Returns false if
+// the file cannot be read or a line does not parse.
+bool LoadActivityTrace(const char *szPath, std::vector<ActivityEvent> &aEvents);
+
+// Idle, input and shooting spells of random length, with short bursts of
+// input in between, for nPlayers players.
+void MakeSyntheticActivityTrace(int nPlayers, uint64_t uDurationMs, uint32_t uSeed, std::vector<ActivityEvent> &aEvents);
+
+struct BandwidthSimReport
+{
+    int                     nPlayers;
+    uint64_t                uDurationMs;
+    uint32_t                nReconfigures;
+    uint32_t                anReconfigures[BANDWIDTH_MAX_PLAYERS];
+    double                  fReconfiguresPerPlayerMinute;
+    double                  fFairness;
+    double                  fTrackingError;
+    double                  fUtilization;
+    double                  fOverBudget;
+};
+
+// Players join with their first event.
+void SimulateBandwidth(const std::vector<ActivityEvent> &aEvents, BandwidthPolicyType eType, const BandwidthConfig &config,
+                       BandwidthSimReport *pReport);
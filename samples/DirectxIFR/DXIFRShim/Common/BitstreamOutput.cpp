@@ -0,0 +1,357 @@
+/*!
+ * \brief
+ * Destination of each player's encoded stream
+ *
+ * \file
+ *
+ * See BitstreamOutput.h.
+ */
+
+#include "BitstreamOutput.h"
+#include "FrameTrace.h"
+#include "HttpStreamServer.h"
+#include "Metrics.h"
+#include "NalScanner.h"
+#include "RtpPacketizer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sstream>
+#include <string>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// NAL unit types that matter here.
+#define H264_NAL_IDR            5
+#define H264_NAL_SPS            7
+#define H264_NAL_PPS            8
+#define H264_NAL_AUD            9
+#define HEVC_NAL_IRAP_FIRST     16
+#define HEVC_NAL_IRAP_LAST      21
+#define HEVC_NAL_VPS            32
+#define HEVC_NAL_SPS            33
+#define HEVC_NAL_PPS            34
+#define HEVC_NAL_AUD            35
+
+static const uint8_t s_startCode[4] = { 0, 0, 0, 1 };
+
+static double NowMs()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return now.QuadPart * 1000.0 / freq.QuadPart;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static bool EndsWith(const std::string &s, const char *szSuffix)
+{
+    size_t n = strlen(szSuffix);
+    return s.size() >= n && s.compare(s.size() - n, n, szSuffix) == 0;
+}
+
+BitstreamOutput::BitstreamOutput(FILE *fOutput, bool bRaw, TsStreamType eStreamType)
+    : m_muxer(eStreamType)
+{
+    m_fOutput = fOutput;
+    m_bRaw = bRaw;
+    m_pServer = NULL;
+    m_iStream = -1;
+    m_pRtpSender = NULL;
+    m_pRtpPacketizer = NULL;
+    m_pRtpPackets = NULL;
+    m_bHevc = (eStreamType == TS_STREAM_HEVC);
+    m_bKeyframeRequested = false;
+    m_fStartMs = -1;
+    m_pBytesCounter = NULL;
+    m_nBytesWritten = 0;
+}
+
+BitstreamOutput::BitstreamOutput(HttpStreamServer *pServer, int iStream, TsStreamType eStreamType)
+    : m_muxer(eStreamType)
+{
+    m_fOutput = NULL;
+    m_bRaw = false;
+    m_pServer = pServer;
+    m_iStream = iStream;
+    m_pRtpSender = NULL;
+    m_pRtpPacketizer = NULL;
+    m_pRtpPackets = NULL;
+    m_bHevc = (eStreamType == TS_STREAM_HEVC);
+    m_bKeyframeRequested = false;
+    m_fStartMs = -1;
+    m_pBytesCounter = NULL;
+    m_nBytesWritten = 0;
+}
+
+BitstreamOutput::BitstreamOutput(RtpSender *pRtpSender, uint32_t uSsrc)
+    : m_muxer(TS_STREAM_H264)
+{
+    m_fOutput = NULL;
+    m_bRaw = true;
+    m_pServer = NULL;
+    m_iStream = -1;
+    m_pRtpSender = pRtpSender;
+    m_pRtpPacketizer = new RtpPacketizer(uSsrc);
+    m_pRtpPackets = new RtpPacketList();
+    m_bHevc = false;
+    m_bKeyframeRequested = false;
+    m_fStartMs = -1;
+    m_pBytesCounter = NULL;
+    m_nBytesWritten = 0;
+}
+
+BitstreamOutput::~BitstreamOutput()
+{
+    if (m_pServer)
+    {
+        m_pServer->RemoveStream(m_iStream);
+    }
+    else if (m_pRtpSender)
+    {
+        delete m_pRtpSender;
+        delete m_pRtpPacketizer;
+        delete m_pRtpPackets;
+    }
+    else
+    {
+        fclose(m_fOutput);
+    }
+}
+
+void BitstreamOutput::WriteAccessUnit(const uint8_t *pData, size_t size)
+{
+    double fNowMs = NowMs();
+    if (m_fStartMs < 0)
+        m_fStartMs = fNowMs;
+    WriteAccessUnit(pData, size, (int64_t)((fNowMs - m_fStartMs) * (TS_CLOCK_HZ / 1000)));
+}
+
+void BitstreamOutput::WriteAccessUnit(const uint8_t *pData, size_t size, int64_t pts90k)
+{
+    FRAME_TRACE_SCOPE("Output");
+    pData = AddParameterSets(pData, size, &size);
+    if (m_pBytesCounter)
+        m_pBytesCounter->Add(size);
+    m_nBytesWritten += size;
+
+    if (m_pRtpSender)
+    {
+        FRAME_TRACE_BEGIN_EVENT("Packetize");
+        m_pRtpPackets->Clear();
+        m_pRtpPacketizer->PacketizeAccessUnit(pData, size, (uint32_t)pts90k, *m_pRtpPackets);
+        FRAME_TRACE_END_EVENT("Packetize");
+        FRAME_TRACE_SCOPE("Send");
+        m_pRtpSender->Send(*m_pRtpPackets);
+        return;
+    }
+    if (m_bRaw)
+    {
+        fwrite(pData, 1, size, m_fOutput);
+        return;
+    }
+
+    // One write per access unit; m_aPackets keeps its capacity.
+    m_aPackets.clear();
+    FRAME_TRACE_BEGIN_EVENT("Mux");
+    bool bKeyframe = m_muxer.MuxAccessUnit(pData, size, pts90k, m_aPackets);
+    FRAME_TRACE_END_EVENT("Mux");
+    FRAME_TRACE_SCOPE("Send");
+    if (m_pServer)
+        m_pServer->Publish(m_iStream, &m_aPackets[0], m_aPackets.size(), bKeyframe);
+    else
+        fwrite(&m_aPackets[0], 1, m_aPackets.size(), m_fOutput);
+}
+
+void BitstreamOutput::SetParameterSets(const uint8_t *pData, size_t size)
+{
+    for (int i = 0; i < BITSTREAM_PARAMETER_SET_TYPES; i++)
+    {
+        m_aParameterSets[i].clear();
+    }
+    NalScanner scanner(pData, size);
+    const uint8_t *pNal;
+    size_t nalSize;
+    while (scanner.Next(&pNal, &nalSize))
+    {
+        int iType = GetParameterSetType(pNal);
+        if (iType >= 0)
+        {
+            m_aParameterSets[iType].insert(m_aParameterSets[iType].end(), s_startCode, s_startCode + sizeof(s_startCode));
+            m_aParameterSets[iType].insert(m_aParameterSets[iType].end(), pNal, pNal + nalSize);
+        }
+    }
+}
+
+void BitstreamOutput::SetBytesCounter(MetricCounter *pCounter)
+{
+    m_pBytesCounter = pCounter;
+}
+
+void BitstreamOutput::RequestKeyframe()
+{
+    m_bKeyframeRequested = true;
+}
+
+bool BitstreamOutput::TakeKeyframeRequest()
+{
+    // Cheap check first; encoders poll this every frame.
+    return m_bKeyframeRequested.load(std::memory_order_relaxed) && m_bKeyframeRequested.exchange(false);
+}
+
+bool BitstreamOutput::IsKeyframeRequested() const
+{
+    return m_bKeyframeRequested.load(std::memory_order_relaxed);
+}
+
+void BitstreamOutput::OnViewerJoin(void *pContext, int)
+{
+    ((BitstreamOutput *)pContext)->RequestKeyframe();
+}
+
+// Returns 0 for a VPS, 1 for an SPS, 2 for a PPS and -1 for anything else.
+int BitstreamOutput::GetParameterSetType(const uint8_t *pNal) const
+{
+    if (m_bHevc)
+    {
+        int type = (pNal[0] >> 1) & 0x3F;
+        return type >= HEVC_NAL_VPS && type <= HEVC_NAL_PPS ? type - HEVC_NAL_VPS : -1;
+    }
+    int type = pNal[0] & 0x1F;
+    return type == H264_NAL_SPS || type == H264_NAL_PPS ? type - H264_NAL_SPS + 1 : -1;
+}
+
+// Updates the parameter set cache from the access unit and, if it is a
+// keyframe missing parameter sets of some type, returns a copy with the
+// cached ones of those types added after the access unit delimiter. Anything
+// else is returned as is.
+const uint8_t *BitstreamOutput::AddParameterSets(const uint8_t *pData, size_t size, size_t *pSize)
+{
+    *pSize = size;
+
+    bool bKeyframe = false;
+    bool abSeen[BITSTREAM_PARAMETER_SET_TYPES] = { false, false, false };
+    bool bParameterSets = false;
+    size_t insertAt = 0;
+    NalScanner scanner(pData, size);
+    const uint8_t *pNal;
+    size_t nalSize;
+    while (scanner.Next(&pNal, &nalSize))
+    {
+        int type = m_bHevc ? (pNal[0] >> 1) & 0x3F : pNal[0] & 0x1F;
+        bool bAud = m_bHevc ? type == HEVC_NAL_AUD : type == H264_NAL_AUD;
+        int iType = GetParameterSetType(pNal);
+        if (bAud && !bKeyframe && !bParameterSets)
+        {
+            insertAt = pNal + nalSize - pData;
+        }
+        else if (iType >= 0)
+        {
+            // The first set of a type in an access unit replaces the cached
+            // ones of that type.
+            if (!abSeen[iType])
+                m_aParameterSets[iType].clear();
+            abSeen[iType] = true;
+            bParameterSets = true;
+            m_aParameterSets[iType].insert(m_aParameterSets[iType].end(), s_startCode, s_startCode + sizeof(s_startCode));
+            m_aParameterSets[iType].insert(m_aParameterSets[iType].end(), pNal, pNal + nalSize);
+        }
+        else if (m_bHevc ? type >= HEVC_NAL_IRAP_FIRST && type <= HEVC_NAL_IRAP_LAST : type == H264_NAL_IDR)
+        {
+            bKeyframe = true;
+        }
+    }
+
+    if (!bKeyframe)
+        return pData;
+    bool bMissing = false;
+    for (int i = 0; i < BITSTREAM_PARAMETER_SET_TYPES; i++)
+    {
+        bMissing = bMissing || (!abSeen[i] && !m_aParameterSets[i].empty());
+    }
+    if (!bMissing)
+        return pData;
+
+    m_aPrefixed.assign(pData, pData + insertAt);
+    for (int i = 0; i < BITSTREAM_PARAMETER_SET_TYPES; i++)
+    {
+        if (!abSeen[i])
+            m_aPrefixed.insert(m_aPrefixed.end(), m_aParameterSets[i].begin(), m_aParameterSets[i].end());
+    }
+    m_aPrefixed.insert(m_aPrefixed.end(), pData + insertAt, pData + size);
+    *pSize = m_aPrefixed.size();
+    return &m_aPrefixed[0];
+}
+
+static BitstreamOutput *CountBytes(BitstreamOutput *pOutput, int index)
+{
+    char szLabels[32];
+    sprintf(szLabels, "player=\"%d\"", index);
+    pOutput->SetBytesCounter(MetricsRegistry::GetShared()->GetCounter("dxifrshim_output_bytes_total",
+        "Bytes of encoded access units written out, parameter sets included.", szLabels));
+    return pOutput;
+}
+
+BitstreamOutput *OpenBitstreamOutput(int index, TsStreamType eStreamType)
+{
+    const char *szFileName = getenv(BITSTREAM_OUTPUT_ENV);
+    if (szFileName && *szFileName)
+    {
+        std::string path(szFileName);
+        size_t pos = path.find("%d");
+        if (pos != std::string::npos)
+        {
+            std::stringstream indexString;
+            indexString << index;
+            path.replace(pos, 2, indexString.str());
+        }
+        FILE *fOutput = fopen(path.c_str(), "wb");
+        if (!fOutput)
+            return NULL;
+        bool bRaw = EndsWith(path, ".h264") || EndsWith(path, ".264") || EndsWith(path, ".hevc") || EndsWith(path, ".265");
+        return CountBytes(new BitstreamOutput(fOutput, bRaw, eStreamType), index);
+    }
+
+    const char *szRtp = getenv(BITSTREAM_RTP_ENV);
+    if (szRtp && *szRtp)
+    {
+        std::string destination(szRtp);
+        size_t colon = destination.rfind(':');
+        if (colon == std::string::npos || eStreamType != TS_STREAM_H264)
+        {
+            fprintf(stderr, "RTP output needs host:port and H.264\n");
+            return NULL;
+        }
+        RtpSender *pSender = new RtpSender();
+        if (!pSender->Open(destination.substr(0, colon).c_str(), (unsigned short)(atoi(destination.c_str() + colon + 1) + 2 * index)))
+        {
+            delete pSender;
+            return NULL;
+        }
+        uint32_t uSsrc = (uint32_t)(NowMs() * 1000) ^ ((uint32_t)index * 0x9E3779B9);
+        return CountBytes(new BitstreamOutput(pSender, uSsrc), index);
+    }
+
+    // Without a shared port every player listens on its own.
+    HttpStreamServer *pServer = HttpStreamServer::GetShared();
+    const char *szPort = getenv(HTTP_STREAM_PORT_ENV);
+    if (!(szPort && *szPort) && pServer->Listen((unsigned short)(BITSTREAM_FIRST_PORT + index), index) < 0)
+        return NULL;
+    BitstreamOutput *pOutput = new BitstreamOutput(pServer, index, eStreamType);
+    pServer->AddStream(index, BitstreamOutput::OnViewerJoin, pOutput);
+    return CountBytes(pOutput, index);
+}
+
+void CloseBitstreamOutput(BitstreamOutput *pOutput)
+{
+    delete pOutput;
+}
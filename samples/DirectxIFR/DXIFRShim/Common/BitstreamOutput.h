@@ -0,0 +1,122 @@
+/*!
+ * \brief
+ * Destination of each player's encoded stream
+ *
+ * \file
+ *
+ * Every access unit is muxed into MPEG-TS in process. By default the
+ * transport stream is served by the shared HttpStreamServer, on port
+ * BITSTREAM_FIRST_PORT + index, or at /stream/<index> on the port in
+ * DXIFRSHIM_HTTP_PORT if that is set. If the DXIFRSHIM_OUTPUT environment
+ * variable is set, the stream is written to that file instead; a %d in the
+ * name is replaced by the player index. Files ending in .h264 or .hevc get
+ * the raw Annex-B stream. Benchmarks use e.g. DXIFRSHIM_OUTPUT=/dev/null.
+ *
+ * If DXIFRSHIM_RTP is set to host:port instead, H.264 streams are sent as
+ * RTP over UDP to that host, player i on port + 2 * i, without the TS layer.
+ *
+ * The output keeps the latest parameter set of each type (VPS, SPS and
+ * PPS), whether given by the encoder or seen in the stream, and puts the ones
+ * a keyframe comes without in front of it, so a viewer can start decoding at
+ * any keyframe. A set replaces the cached one of its type only, so e.g. a PPS
+ * update keeps the SPS. When an HTTP viewer joins, the output asks the encoder for a
+ * keyframe rather than have the viewer wait for the next one.
+ *
+ * Outputs opened by OpenBitstreamOutput count the bytes of the access units
+ * they write in dxifrshim_output_bytes_total, labelled with the player.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <vector>
+
+#include "TsMuxer.h"
+
+class HttpStreamServer;
+class MetricCounter;
+class RtpPacketizer;
+class RtpSender;
+struct RtpPacketList;
+
+#define BITSTREAM_OUTPUT_ENV "DXIFRSHIM_OUTPUT"
+#define BITSTREAM_RTP_ENV "DXIFRSHIM_RTP"
+
+// Port of player 0 when every player has its own port.
+#define BITSTREAM_FIRST_PORT 30000
+
+// VPS, SPS and PPS; H.264 has no VPS.
+#define BITSTREAM_PARAMETER_SET_TYPES 3
+
+class BitstreamOutput
+{
+public:
+    BitstreamOutput(FILE *fOutput, bool bRaw, TsStreamType eStreamType);
+    BitstreamOutput(HttpStreamServer *pServer, int iStream, TsStreamType eStreamType);
+    // Takes ownership of pRtpSender.
+    BitstreamOutput(RtpSender *pRtpSender, uint32_t uSsrc);
+    ~BitstreamOutput();
+
+    // Writes one Annex-B access unit, timestamped with the time it arrives.
+    void WriteAccessUnit(const uint8_t *pData, size_t size);
+
+    // Same with an explicit presentation time in 90 kHz units.
+    void WriteAccessUnit(const uint8_t *pData, size_t size, int64_t pts90k);
+
+    // Replaces the cached parameter sets with an Annex-B buffer holding them,
+    // as returned by the encoder's sequence header query.
+    void SetParameterSets(const uint8_t *pData, size_t size);
+
+    // Counts the bytes of every access unit written from now on in pCounter.
+    void SetBytesCounter(MetricCounter *pCounter);
+
+    // Bytes of every access unit written so far. Any thread.
+    uint64_t GetBytesWritten() const { return m_nBytesWritten; }
+
+    // Asks the encoder to make the next frame a keyframe. Any thread.
+    void RequestKeyframe();
+
+    // Returns whether a keyframe was asked for since the last call. Encoders
+    // call it once per frame.
+    bool TakeKeyframeRequest();
+
+    // Same without taking the request.
+    bool IsKeyframeRequested() const;
+
+    // HttpStreamServer join callback; pContext is the BitstreamOutput.
+    static void OnViewerJoin(void *pContext, int iStream);
+
+private:
+    const uint8_t *AddParameterSets(const uint8_t *pData, size_t size, size_t *pSize);
+    int GetParameterSetType(const uint8_t *pNal) const;
+
+    FILE                   *m_fOutput;
+    bool                    m_bRaw;
+    HttpStreamServer       *m_pServer;
+    int                     m_iStream;
+    RtpSender              *m_pRtpSender;
+    RtpPacketizer          *m_pRtpPacketizer;
+    RtpPacketList          *m_pRtpPackets;
+    TsMuxer                 m_muxer;
+    bool                    m_bHevc;
+    // By GetParameterSetType, Annex-B with start codes; more than one unit
+    // when an access unit carried several of a type, e.g. PPS of other ids.
+    std::vector<uint8_t>    m_aParameterSets[BITSTREAM_PARAMETER_SET_TYPES];
+    std::vector<uint8_t>    m_aPrefixed;        // keyframe with cached parameter sets added
+    std::vector<uint8_t>    m_aPackets;
+    std::atomic<bool>       m_bKeyframeRequested;
+    double                  m_fStartMs;
+    MetricCounter          *m_pBytesCounter;
+    std::atomic<uint64_t>   m_nBytesWritten;
+
+    BitstreamOutput(const BitstreamOutput &);
+    BitstreamOutput &operator=(const BitstreamOutput &);
+};
+
+// Returns NULL if the file or port cannot be opened.
+BitstreamOutput *OpenBitstreamOutput(int index, TsStreamType eStreamType = TS_STREAM_H264);
+
+// Flushes and closes an output returned by OpenBitstreamOutput.
+void CloseBitstreamOutput(BitstreamOutput *pOutput);
@@ -0,0 +1,201 @@
+/*!
+ * \brief
+ * Ownership of encoder input buffers
+ *
+ * \file
+ *
+ * See EncodeInputBinder.h.
+ */
+
+#include "EncodeInputBinder.h"
+
+size_t GetEncodeInputFrameSize(NV_ENC_BUFFER_FORMAT bufferFmt, uint32_t pitch, uint32_t height)
+{
+    switch (bufferFmt)
+    {
+    case NV_ENC_BUFFER_FORMAT_YUV444_PL:
+        return (size_t)pitch * height * 3;
+    case NV_ENC_BUFFER_FORMAT_NV12_PL:
+    case NV_ENC_BUFFER_FORMAT_YV12_PL:
+    case NV_ENC_BUFFER_FORMAT_IYUV_PL:
+        return (size_t)pitch * height * 3 / 2;
+    default:
+        return (size_t)pitch * height * 4;
+    }
+}
+
+NVENCSTATUS EncodeInputBinder::Allocate(EncodeInputBuffer *pInput, uint32_t width, uint32_t height, NV_ENC_BUFFER_FORMAT bufferFmt)
+{
+    if (pInput->eState != ENCODE_INPUT_EMPTY)
+    {
+        return NV_ENC_ERR_INVALID_CALL;
+    }
+
+    NVENCSTATUS nvStatus = m_pApi->CreateInputBuffer(width, height, bufferFmt, &pInput->hInputSurface);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        pInput->hInputSurface = NULL;
+        return nvStatus;
+    }
+    pInput->dwWidth = width;
+    pInput->dwHeight = height;
+    pInput->bufferFmt = bufferFmt;
+    pInput->pHostBuffer = NULL;
+    pInput->uHostPitch = 0;
+    pInput->nvRegisteredResource = NULL;
+    pInput->eState = ENCODE_INPUT_OWNED;
+    return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS EncodeInputBinder::Register(EncodeInputBuffer *pInput, uint8_t *pHost, uint32_t width, uint32_t height, uint32_t pitch,
+                                        NV_ENC_BUFFER_FORMAT bufferFmt)
+{
+    if (pInput->eState != ENCODE_INPUT_EMPTY || !pHost)
+    {
+        return NV_ENC_ERR_INVALID_CALL;
+    }
+
+    NV_ENC_REGISTERED_PTR hRegistered = NULL;
+    NVENCSTATUS nvStatus = m_pApi->RegisterHostBuffer(pHost, GetEncodeInputFrameSize(bufferFmt, pitch, height),
+        width, height, pitch, bufferFmt, &hRegistered);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        return nvStatus;
+    }
+    pInput->dwWidth = width;
+    pInput->dwHeight = height;
+    pInput->bufferFmt = bufferFmt;
+    pInput->pHostBuffer = pHost;
+    pInput->uHostPitch = pitch;
+    pInput->nvRegisteredResource = hRegistered;
+    pInput->hInputSurface = NULL;
+    pInput->eState = ENCODE_INPUT_REGISTERED;
+    return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS EncodeInputBinder::Rebind(EncodeInputBuffer *pInput, uint8_t *pHost, uint32_t width, uint32_t height, uint32_t pitch,
+                                      NV_ENC_BUFFER_FORMAT bufferFmt)
+{
+    if (pInput->eState == ENCODE_INPUT_REGISTERED)
+    {
+        if (pInput->pHostBuffer == pHost && pInput->dwWidth == width && pInput->dwHeight == height &&
+            pInput->uHostPitch == pitch && pInput->bufferFmt == bufferFmt)
+        {
+            return NV_ENC_SUCCESS;
+        }
+        Release(pInput);
+    }
+    else if (pInput->eState != ENCODE_INPUT_EMPTY)
+    {
+        // Owned, or mapped for a frame still being encoded.
+        return NV_ENC_ERR_INVALID_CALL;
+    }
+    return Register(pInput, pHost, width, height, pitch, bufferFmt);
+}
+
+NVENCSTATUS EncodeInputBinder::RebindAll(EncodeInputBuffer *const *apInputs, uint8_t *const *ppHost, int nInputs, uint32_t width,
+                                         uint32_t height, uint32_t pitch, NV_ENC_BUFFER_FORMAT bufferFmt)
+{
+    NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
+    for (int i = 0; i < nInputs && nvStatus == NV_ENC_SUCCESS; i++)
+    {
+        nvStatus = Rebind(apInputs[i], ppHost[i], width, height, pitch, bufferFmt);
+    }
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        for (int i = 0; i < nInputs; i++)
+        {
+            Release(apInputs[i]);
+        }
+    }
+    return nvStatus;
+}
+
+NVENCSTATUS EncodeInputBinder::BeginWrite(EncodeInputBuffer *pInput, uint8_t **ppData, uint32_t *pPitch)
+{
+    if (pInput->eState != ENCODE_INPUT_OWNED)
+    {
+        return NV_ENC_ERR_INVALID_CALL;
+    }
+
+    NVENCSTATUS nvStatus = m_pApi->LockInputBuffer(pInput->hInputSurface, (void **)ppData, pPitch);
+    if (nvStatus == NV_ENC_SUCCESS)
+    {
+        pInput->eState = ENCODE_INPUT_OWNED_LOCKED;
+    }
+    return nvStatus;
+}
+
+NVENCSTATUS EncodeInputBinder::EndWrite(EncodeInputBuffer *pInput)
+{
+    if (pInput->eState != ENCODE_INPUT_OWNED_LOCKED)
+    {
+        return NV_ENC_ERR_INVALID_CALL;
+    }
+
+    NVENCSTATUS nvStatus = m_pApi->UnlockInputBuffer(pInput->hInputSurface);
+    pInput->eState = ENCODE_INPUT_OWNED;
+    return nvStatus;
+}
+
+NVENCSTATUS EncodeInputBinder::Map(EncodeInputBuffer *pInput)
+{
+    if (pInput->eState != ENCODE_INPUT_REGISTERED)
+    {
+        return NV_ENC_ERR_INVALID_CALL;
+    }
+
+    NVENCSTATUS nvStatus = m_pApi->MapInputResource(pInput->nvRegisteredResource, &pInput->hInputSurface);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        pInput->hInputSurface = NULL;
+        return nvStatus;
+    }
+    pInput->eState = ENCODE_INPUT_MAPPED;
+    return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS EncodeInputBinder::Unmap(EncodeInputBuffer *pInput)
+{
+    if (pInput->eState != ENCODE_INPUT_MAPPED)
+    {
+        return NV_ENC_ERR_INVALID_CALL;
+    }
+
+    NVENCSTATUS nvStatus = m_pApi->UnmapInputResource(pInput->hInputSurface);
+    pInput->hInputSurface = NULL;
+    pInput->eState = ENCODE_INPUT_REGISTERED;
+    return nvStatus;
+}
+
+NVENCSTATUS EncodeInputBinder::Release(EncodeInputBuffer *pInput)
+{
+    NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
+
+    switch (pInput->eState)
+    {
+    case ENCODE_INPUT_OWNED_LOCKED:
+        EndWrite(pInput);
+        // fall through
+    case ENCODE_INPUT_OWNED:
+        nvStatus = m_pApi->DestroyInputBuffer(pInput->hInputSurface);
+        break;
+
+    case ENCODE_INPUT_MAPPED:
+        Unmap(pInput);
+        // fall through
+    case ENCODE_INPUT_REGISTERED:
+        nvStatus = m_pApi->UnregisterHostBuffer(pInput->nvRegisteredResource);
+        break;
+
+    default:
+        break;
+    }
+
+    pInput->hInputSurface = NULL;
+    pInput->nvRegisteredResource = NULL;
+    pInput->pHostBuffer = NULL;
+    pInput->uHostPitch = 0;
+    pInput->eState = ENCODE_INPUT_EMPTY;
+    return nvStatus;
+}
@@ -0,0 +1,86 @@
+/*!
+ * \brief
+ * Ownership of encoder input buffers
+ *
+ * \file
+ *
+ * An encoder input buffer is either owned by the encoder (allocated with
+ * NvEncCreateInputBuffer, the frame is copied into it) or borrowed from the
+ * capture side (a page-locked host buffer registered with
+ * NvEncRegisterResource and mapped for each frame, so no copy is made).
+ * EncodeInputBinder tracks which one each EncodeInputBuffer is and which
+ * state it is in, and only talks to NVENC through IEncodeResourceApi so it
+ * can be driven by a mock on a machine without a GPU.
+ */
+
+#pragma once
+
+#include "inc/NvHWEncoder.h"
+
+// The subset of NVENC (and CUDA) calls needed to own or borrow input buffers.
+class IEncodeResourceApi
+{
+public:
+    virtual ~IEncodeResourceApi() {}
+
+    virtual NVENCSTATUS CreateInputBuffer(uint32_t width, uint32_t height, NV_ENC_BUFFER_FORMAT bufferFmt, NV_ENC_INPUT_PTR *phInput) = 0;
+    virtual NVENCSTATUS DestroyInputBuffer(NV_ENC_INPUT_PTR hInput) = 0;
+    virtual NVENCSTATUS LockInputBuffer(NV_ENC_INPUT_PTR hInput, void **ppData, uint32_t *pPitch) = 0;
+    virtual NVENCSTATUS UnlockInputBuffer(NV_ENC_INPUT_PTR hInput) = 0;
+
+    // Registers a host buffer of nBytes bytes as an encoder input resource.
+    virtual NVENCSTATUS RegisterHostBuffer(void *pHost, size_t nBytes, uint32_t width, uint32_t height, uint32_t pitch,
+                                           NV_ENC_BUFFER_FORMAT bufferFmt, NV_ENC_REGISTERED_PTR *phRegistered) = 0;
+    virtual NVENCSTATUS UnregisterHostBuffer(NV_ENC_REGISTERED_PTR hRegistered) = 0;
+    virtual NVENCSTATUS MapInputResource(NV_ENC_REGISTERED_PTR hRegistered, NV_ENC_INPUT_PTR *phMapped) = 0;
+    virtual NVENCSTATUS UnmapInputResource(NV_ENC_INPUT_PTR hMapped) = 0;
+};
+
+// Size in bytes of a frame of the given format with the given luma pitch.
+size_t GetEncodeInputFrameSize(NV_ENC_BUFFER_FORMAT bufferFmt, uint32_t pitch, uint32_t height);
+
+class EncodeInputBinder
+{
+public:
+    explicit EncodeInputBinder(IEncodeResourceApi *pApi) : m_pApi(pApi) {}
+
+    // Allocates an encoder-owned input buffer.
+    NVENCSTATUS Allocate(EncodeInputBuffer *pInput, uint32_t width, uint32_t height, NV_ENC_BUFFER_FORMAT bufferFmt);
+
+    // Registers a borrowed host buffer; pHost must stay valid until Release.
+    NVENCSTATUS Register(EncodeInputBuffer *pInput, uint8_t *pHost, uint32_t width, uint32_t height, uint32_t pitch,
+                         NV_ENC_BUFFER_FORMAT bufferFmt);
+
+    // Register for a buffer that may already be registered: the same host
+    // buffer at the same size and format is kept as is, and a registration
+    // of another buffer or size (after a resize) is replaced. On failure
+    // pInput is left empty, so the frame can be copied instead.
+    NVENCSTATUS Rebind(EncodeInputBuffer *pInput, uint8_t *pHost, uint32_t width, uint32_t height, uint32_t pitch,
+                       NV_ENC_BUFFER_FORMAT bufferFmt);
+
+    // Rebinds apInputs[i] to ppHost[i], all or nothing: if one fails, every
+    // input is released and the error returned.
+    NVENCSTATUS RebindAll(EncodeInputBuffer *const *apInputs, uint8_t *const *ppHost, int nInputs, uint32_t width, uint32_t height,
+                          uint32_t pitch, NV_ENC_BUFFER_FORMAT bufferFmt);
+
+    // Owned buffers only: locks the buffer for the CPU to write the frame.
+    NVENCSTATUS BeginWrite(EncodeInputBuffer *pInput, uint8_t **ppData, uint32_t *pPitch);
+    NVENCSTATUS EndWrite(EncodeInputBuffer *pInput);
+
+    // Borrowed buffers only: maps the registration so hInputSurface can be
+    // encoded. The buffer must stay mapped until the output has been read.
+    NVENCSTATUS Map(EncodeInputBuffer *pInput);
+    NVENCSTATUS Unmap(EncodeInputBuffer *pInput);
+
+    // Destroys an owned buffer or unregisters a borrowed one, unmapping or
+    // unlocking it first if needed. Safe to call on an empty buffer.
+    NVENCSTATUS Release(EncodeInputBuffer *pInput);
+
+    static bool IsBorrowed(const EncodeInputBuffer *pInput)
+    {
+        return pInput->eState == ENCODE_INPUT_REGISTERED || pInput->eState == ENCODE_INPUT_MAPPED;
+    }
+
+private:
+    IEncodeResourceApi *m_pApi;
+};
@@ -0,0 +1,174 @@
+/*!
+ * \brief
+ * N-deep encode pipeline with a dedicated output-drain thread
+ *
+ * \file
+ *
+ * See EncodePipeline.h.
+ */
+
+#include "EncodePipeline.h"
+#include "Metrics.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static double NowMs()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return now.QuadPart * 1000.0 / freq.QuadPart;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+EncodePipeline::EncodePipeline()
+{
+    m_pAcquired = NULL;
+    m_pfnDrain = NULL;
+    m_pfnDrained = NULL;
+    m_pContext = NULL;
+    m_nDrained = 0;
+    m_fStartTime = 0;
+    m_uLatencySumUs = 0;
+    m_uLatencyMaxUs = 0;
+    m_uAcquireWaitUs = 0;
+    m_pLatencyMetric = NULL;
+    m_pQueueDepthMetric = NULL;
+    m_bRunning = false;
+}
+
+EncodePipeline::~EncodePipeline()
+{
+    Stop();
+}
+
+void EncodePipeline::SetMetrics(MetricHistogram *pLatency, MetricGauge *pQueueDepth)
+{
+    m_pLatencyMetric = pLatency;
+    m_pQueueDepthMetric = pQueueDepth;
+}
+
+void EncodePipeline::SetDrainedFunc(DrainedFunc pfnDrained)
+{
+    m_pfnDrained = pfnDrained;
+}
+
+bool EncodePipeline::Start(void **ppItems, unsigned int uDepth, DrainFunc pfnDrain, void *pContext)
+{
+    if (m_bRunning || !uDepth || !pfnDrain)
+        return false;
+
+    m_aSlots.resize(uDepth);
+    for (unsigned int i = 0; i < uDepth; i++)
+    {
+        m_aSlots[i].pItem = ppItems[i];
+        m_aSlots[i].fSubmitTime = 0;
+    }
+    m_ring.Initialize(&m_aSlots[0], uDepth);
+    m_pAcquired = NULL;
+    m_pfnDrain = pfnDrain;
+    m_pContext = pContext;
+    m_nDrained = 0;
+    m_fStartTime = NowMs();
+    m_uLatencySumUs = 0;
+    m_uLatencyMaxUs = 0;
+    m_uAcquireWaitUs = 0;
+    m_bRunning = true;
+    m_drainThread = std::thread(&EncodePipeline::DrainLoop, this);
+    return true;
+}
+
+void EncodePipeline::Stop()
+{
+    if (!m_bRunning)
+        return;
+
+    m_ring.Close();
+    m_drainThread.join();
+    m_bRunning = false;
+}
+
+void *EncodePipeline::AcquireFree()
+{
+    m_pAcquired = m_ring.GetAvailable();
+    if (!m_pAcquired)
+    {
+        double fWaitStart = NowMs();
+        m_pAcquired = m_ring.WaitAvailable();
+        uint64_t uWaitUs = (uint64_t)((NowMs() - fWaitStart) * 1000);
+        m_uAcquireWaitUs.fetch_add(uWaitUs, std::memory_order_relaxed);
+    }
+    return m_pAcquired ? m_pAcquired->pItem : NULL;
+}
+
+void EncodePipeline::CancelAcquire()
+{
+    if (m_pAcquired)
+    {
+        m_ring.CancelAvailable(m_pAcquired);
+        m_pAcquired = NULL;
+    }
+}
+
+void EncodePipeline::Submit()
+{
+    if (m_pAcquired)
+    {
+        m_pAcquired->fSubmitTime = NowMs();
+        if (m_pQueueDepthMetric)
+            m_pQueueDepthMetric->Add(1);
+        m_ring.PushPending(m_pAcquired);
+        m_pAcquired = NULL;
+    }
+}
+
+void EncodePipeline::WaitIdle()
+{
+    m_ring.WaitEmpty();
+}
+
+void EncodePipeline::GetStats(EncodePipelineStats *pStats)
+{
+    uint64_t nDrained = m_nDrained.load(std::memory_order_relaxed);
+    pStats->uDepth = (unsigned int)m_aSlots.size();
+    pStats->nFrames = nDrained;
+    pStats->fElapsedMs = NowMs() - m_fStartTime;
+    pStats->fLatencyAvgMs = nDrained ? m_uLatencySumUs.load(std::memory_order_relaxed) / 1000.0 / nDrained : 0;
+    pStats->fLatencyMaxMs = m_uLatencyMaxUs.load(std::memory_order_relaxed) / 1000.0;
+    pStats->fAcquireWaitMs = m_uAcquireWaitUs.load(std::memory_order_relaxed) / 1000.0;
+}
+
+// WaitPending only returns NULL once Stop closed the ring and everything
+// submitted before has been written out.
+void EncodePipeline::DrainLoop()
+{
+    Slot *pSlot;
+    while ((pSlot = m_ring.WaitPending()) != NULL)
+    {
+        m_pfnDrain(m_pContext, pSlot->pItem);
+        uint64_t uLatencyUs = (uint64_t)((NowMs() - pSlot->fSubmitTime) * 1000);
+        m_uLatencySumUs.fetch_add(uLatencyUs, std::memory_order_relaxed);
+        uint64_t uMaxUs = m_uLatencyMaxUs.load(std::memory_order_relaxed);
+        while (uLatencyUs > uMaxUs &&
+               !m_uLatencyMaxUs.compare_exchange_weak(uMaxUs, uLatencyUs, std::memory_order_relaxed))
+        {
+        }
+        m_nDrained.fetch_add(1, std::memory_order_relaxed);
+        if (m_pLatencyMetric)
+            m_pLatencyMetric->Record(uLatencyUs);
+        if (m_pQueueDepthMetric)
+            m_pQueueDepthMetric->Add(-1);
+        if (m_pfnDrained)
+            m_pfnDrained(m_pContext, pSlot->pItem, uLatencyUs);
+        m_ring.ReleasePending(pSlot);
+    }
+}
@@ -0,0 +1,117 @@
+/*!
+ * \brief
+ * N-deep encode pipeline with a dedicated output-drain thread
+ *
+ * \file
+ *
+ * The encoder thread takes a free buffer with AcquireFree, fills and submits
+ * it to the hardware, then hands it over with Submit. A drain thread takes
+ * submitted buffers in order, waits for their output (pfnDrain, which blocks
+ * on the buffer's completion event and writes the bitstream downstream) and
+ * returns them to the free list. The encoder thread only blocks when all
+ * uDepth buffers are in flight, so a deeper pipeline trades latency for
+ * throughput; GetStats reports both. Buffers are handed over through an
+ * SpscRing and the statistics are atomic counters, so neither thread takes a
+ * lock per frame.
+ *
+ * SetMetrics also records each frame's latency into a histogram and keeps a
+ * gauge at the number of buffers in flight, for the metrics endpoint.
+ * SetDrainedFunc hands the same per-frame latency to the caller, on the drain
+ * thread, before the buffer goes back to the free list.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "LockFreeRing.h"
+
+class MetricGauge;
+class MetricHistogram;
+
+struct EncodePipelineStats
+{
+    unsigned int        uDepth;
+    unsigned long long  nFrames;
+    double              fElapsedMs;         // since Start
+    double              fLatencyAvgMs;      // Submit until pfnDrain returned
+    double              fLatencyMaxMs;
+    double              fAcquireWaitMs;     // total time AcquireFree blocked
+};
+
+class EncodePipeline
+{
+public:
+    typedef void (*DrainFunc)(void *pContext, void *pItem);
+    typedef void (*DrainedFunc)(void *pContext, void *pItem, uint64_t uLatencyUs);
+
+    EncodePipeline();
+    ~EncodePipeline();
+
+    // Either may be NULL. Call before Start.
+    void SetMetrics(MetricHistogram *pLatency, MetricGauge *pQueueDepth);
+
+    // Called after pfnDrain with the frame's Submit-to-output latency. May be
+    // NULL. Call before Start.
+    void SetDrainedFunc(DrainedFunc pfnDrained);
+
+    // Starts the drain thread. ppItems holds uDepth caller-owned buffers,
+    // handed out by AcquireFree in this order, round robin.
+    bool Start(void **ppItems, unsigned int uDepth, DrainFunc pfnDrain, void *pContext);
+
+    // Drains every submitted buffer and joins the drain thread.
+    void Stop();
+
+    bool IsRunning() const { return m_bRunning; }
+
+    // Returns the next free buffer, blocking while all of them are in flight.
+    void *AcquireFree();
+
+    // Gives back the buffer returned by the last AcquireFree without
+    // submitting it, e.g. because filling it failed.
+    void CancelAcquire();
+
+    // Hands the buffer returned by the last AcquireFree to the drain thread.
+    void Submit();
+
+    // Blocks until every submitted buffer has been drained.
+    void WaitIdle();
+
+    void GetStats(EncodePipelineStats *pStats);
+
+private:
+    struct Slot
+    {
+        void   *pItem;
+        double  fSubmitTime;
+    };
+
+    void DrainLoop();
+
+    std::vector<Slot>           m_aSlots;
+    SpscRing<Slot>              m_ring;
+    Slot                       *m_pAcquired;        // encoder thread only
+    DrainFunc                   m_pfnDrain;
+    DrainedFunc                 m_pfnDrained;
+    void                       *m_pContext;
+
+    // Statistics in microseconds, updated once per frame with relaxed
+    // atomics; GetStats may see a frame counted in one and not yet in
+    // another.
+    std::atomic<uint64_t>       m_nDrained;
+    double                      m_fStartTime;
+    std::atomic<uint64_t>       m_uLatencySumUs;
+    std::atomic<uint64_t>       m_uLatencyMaxUs;
+    std::atomic<uint64_t>       m_uAcquireWaitUs;
+    MetricHistogram            *m_pLatencyMetric;
+    MetricGauge                *m_pQueueDepthMetric;
+
+    std::thread                 m_drainThread;
+    bool                        m_bRunning;
+
+    EncodePipeline(const EncodePipeline &);
+    EncodePipeline &operator=(const EncodePipeline &);
+};
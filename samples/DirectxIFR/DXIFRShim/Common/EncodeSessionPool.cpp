@@ -0,0 +1,197 @@
+/*!
+ * \brief
+ * Encoder sessions shared by the players of a process
+ *
+ * \file
+ *
+ * See EncodeSessionPool.h.
+ */
+
+#include "EncodeSessionPool.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static bool IsSameKind(const EncodeSessionKey &session, const EncodeSessionKey &key)
+{
+    return session.iDevice == key.iDevice && session.uWidth == key.uWidth && session.uHeight == key.uHeight
+        && session.uCodec == key.uCodec && session.uFormat == key.uFormat && session.nBuffers >= key.nBuffers;
+}
+
+EncodeSessionPool::EncodeSessionPool(IEncodeSessionDevice *pDevice, int nMaxSessions, int nMaxIdle)
+{
+    m_pDevice = pDevice;
+    m_nMaxSessions = nMaxSessions > 0 ? nMaxSessions : 1;
+    m_nMaxIdle = nMaxIdle >= 0 ? nMaxIdle : 0;
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+EncodeSessionPool::~EncodeSessionPool()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (!m_aSessions.empty())
+    {
+        CloseLocked((int)m_aSessions.size() - 1);
+    }
+    for (size_t i = 0; i < m_aContexts.size(); i++)
+    {
+        m_pDevice->DestroyContext(m_aContexts[i].pContext);
+    }
+    m_aContexts.clear();
+}
+
+void *EncodeSessionPool::GetContext(int iDevice)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return GetContextLocked(iDevice);
+}
+
+void *EncodeSessionPool::GetContextLocked(int iDevice)
+{
+    for (size_t i = 0; i < m_aContexts.size(); i++)
+    {
+        if (m_aContexts[i].iDevice == iDevice)
+            return m_aContexts[i].pContext;
+    }
+
+    // A failure is not remembered, so the next player tries again.
+    Context context;
+    context.iDevice = iDevice;
+    context.pContext = m_pDevice->CreateContext(iDevice);
+    if (!context.pContext)
+    {
+        fprintf(stderr, "EncodeSessionPool: cannot create a context on device %d\n", iDevice);
+        return NULL;
+    }
+    m_aContexts.push_back(context);
+    m_stats.nContexts++;
+    return context.pContext;
+}
+
+void *EncodeSessionPool::Lease(const EncodeSessionKey &key, const void *pParams)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (int i = 0; i < (int)m_aSessions.size(); i++)
+    {
+        Session &session = m_aSessions[i];
+        if (session.bLeased || !IsSameKind(session.key, key))
+            continue;
+
+        if (m_pDevice->ResetSession(session.pSession, pParams))
+        {
+            session.bLeased = true;
+            m_stats.nReused++;
+            return session.pSession;
+        }
+        fprintf(stderr, "EncodeSessionPool: cannot reset an idle session, closing it\n");
+        CloseLocked(i--);
+    }
+
+    int i = OpenLocked(key, pParams);
+    if (i < 0)
+        return NULL;
+    m_aSessions[i].bLeased = true;
+    return m_aSessions[i].pSession;
+}
+
+void EncodeSessionPool::Recycle(void *pSession)
+{
+    if (!pSession)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (int i = 0; i < (int)m_aSessions.size(); i++)
+    {
+        if (m_aSessions[i].pSession != pSession)
+            continue;
+
+        if (!m_aSessions[i].bLeased)
+        {
+            fprintf(stderr, "EncodeSessionPool: session recycled twice\n");
+            return;
+        }
+        m_aSessions[i].bLeased = false;
+        if (CountIdleLocked(NULL) > m_nMaxIdle)
+        {
+            CloseLocked(i);
+        }
+        return;
+    }
+    fprintf(stderr, "EncodeSessionPool: recycling a session of another pool\n");
+}
+
+void EncodeSessionPool::Trim()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (int i = (int)m_aSessions.size() - 1; i >= 0; i--)
+    {
+        if (!m_aSessions[i].bLeased)
+            CloseLocked(i);
+    }
+}
+
+void EncodeSessionPool::GetStats(EncodeSessionPoolStats *pStats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    *pStats = m_stats;
+    pStats->nIdle = CountIdleLocked(NULL);
+    pStats->nLeased = (uint32_t)m_aSessions.size() - pStats->nIdle;
+}
+
+// Opens an idle session for key, closing an idle one of another key if the
+// pool is full. Returns its index, or -1.
+int EncodeSessionPool::OpenLocked(const EncodeSessionKey &key, const void *pParams)
+{
+    if ((int)m_aSessions.size() >= m_nMaxSessions)
+    {
+        int iVictim = -1;
+        for (int i = 0; i < (int)m_aSessions.size() && iVictim < 0; i++)
+        {
+            if (!m_aSessions[i].bLeased && !IsSameKind(m_aSessions[i].key, key))
+                iVictim = i;
+        }
+        if (iVictim < 0)
+        {
+            fprintf(stderr, "EncodeSessionPool: all %d sessions are in use\n", m_nMaxSessions);
+            return -1;
+        }
+        CloseLocked(iVictim);
+    }
+
+    void *pContext = GetContextLocked(key.iDevice);
+    if (!pContext)
+        return -1;
+
+    Session session;
+    session.pSession = m_pDevice->OpenSession(pContext, key, pParams);
+    if (!session.pSession)
+    {
+        fprintf(stderr, "EncodeSessionPool: cannot open a %ux%u session on device %d\n", key.uWidth, key.uHeight, key.iDevice);
+        return -1;
+    }
+    session.key = key;
+    session.bLeased = false;
+    m_aSessions.push_back(session);
+    m_stats.nOpened++;
+    return (int)m_aSessions.size() - 1;
+}
+
+void EncodeSessionPool::CloseLocked(int i)
+{
+    m_pDevice->CloseSession(m_aSessions[i].pSession);
+    m_aSessions.erase(m_aSessions.begin() + i);
+    m_stats.nClosed++;
+}
+
+// Idle sessions of the kind of *pKey, or all of them if pKey is NULL.
+int EncodeSessionPool::CountIdleLocked(const EncodeSessionKey *pKey)
+{
+    int n = 0;
+    for (size_t i = 0; i < m_aSessions.size(); i++)
+    {
+        if (!m_aSessions[i].bLeased && (!pKey || IsSameKind(m_aSessions[i].key, *pKey)))
+            n++;
+    }
+    return n;
+}
@@ -0,0 +1,128 @@
+/*!
+ * \brief
+ * Encoder sessions shared by the players of a process
+ *
+ * \file
+ *
+ * Creating a CUDA context, opening an NVENC session and allocating its input
+ * and bitstream buffers takes long and costs device memory, so players do not
+ * do it themselves. EncodeSessionPool keeps one context per device for the
+ * life of the pool and leases sessions, buffers included, to players:
+ * - a player that joins gets an idle session opened for the same key if there
+ *   is one, reset for its parameters, and a new one otherwise;
+ * - a player that leaves recycles its session, which stays open and keeps its
+ *   buffers for the next player, up to nMaxIdle idle sessions;
+ * - at most nMaxSessions are open at once; an idle session of another key is
+ *   closed to make room for a new one.
+ * The pool only talks to the device through IEncodeSessionDevice, so the
+ * lease and recycle logic can be driven by a mock on a machine without a GPU.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+// Sessions a pool keeps open at most, leased or idle.
+#define ENCODE_SESSION_MAX          16
+
+// What a session is opened for. A session is only leased again for the same
+// device, size, codec and format, and at least as many buffers.
+struct EncodeSessionKey
+{
+    int         iDevice;
+    uint32_t    uWidth;
+    uint32_t    uHeight;
+    uint32_t    uCodec;
+    uint32_t    uFormat;
+    uint32_t    nBuffers;           // input and bitstream buffer pairs
+};
+
+// The device calls the pool makes; pParams is whatever the caller of Lease
+// passed, handed on as is.
+class IEncodeSessionDevice
+{
+public:
+    virtual ~IEncodeSessionDevice() {}
+
+    // Returns the new context of device iDevice, or NULL.
+    virtual void *CreateContext(int iDevice) = 0;
+    virtual void DestroyContext(void *pContext) = 0;
+
+    // Opens a session on pContext and allocates key.nBuffers buffer pairs.
+    // Returns the session, or NULL.
+    virtual void *OpenSession(void *pContext, const EncodeSessionKey &key, const void *pParams) = 0;
+
+    // Readies an idle session for a new player. A session that fails is
+    // closed and another one opened.
+    virtual bool ResetSession(void *pSession, const void *pParams) = 0;
+
+    virtual void CloseSession(void *pSession) = 0;
+};
+
+struct EncodeSessionPoolStats
+{
+    uint32_t    nContexts;          // created so far
+    uint32_t    nOpened;            // sessions opened so far
+    uint32_t    nReused;            // leases served by an idle session
+    uint32_t    nClosed;
+    uint32_t    nLeased;            // right now
+    uint32_t    nIdle;              // right now
+};
+
+class EncodeSessionPool
+{
+public:
+    // Does not own pDevice.
+    EncodeSessionPool(IEncodeSessionDevice *pDevice, int nMaxSessions = ENCODE_SESSION_MAX, int nMaxIdle = ENCODE_SESSION_MAX);
+
+    // Closes every session, leased or not, then the contexts.
+    ~EncodeSessionPool();
+
+    // Returns the context of device iDevice, creating it on first use, or
+    // NULL if it cannot be created.
+    void *GetContext(int iDevice);
+
+    // Leases a session for key, or returns NULL if none can be opened.
+    void *Lease(const EncodeSessionKey &key, const void *pParams);
+
+    // Takes back a leased session. The caller must be done with it: nothing
+    // in flight and nothing of the player's left registered.
+    void Recycle(void *pSession);
+
+    // Closes every idle session.
+    void Trim();
+
+    void GetStats(EncodeSessionPoolStats *pStats);
+
+private:
+    struct Context
+    {
+        int         iDevice;
+        void       *pContext;
+    };
+
+    struct Session
+    {
+        void               *pSession;
+        EncodeSessionKey    key;
+        bool                bLeased;
+    };
+
+    void *GetContextLocked(int iDevice);
+    int OpenLocked(const EncodeSessionKey &key, const void *pParams);
+    void CloseLocked(int i);
+    int CountIdleLocked(const EncodeSessionKey *pKey);
+
+    IEncodeSessionDevice       *m_pDevice;
+    int                         m_nMaxSessions;
+    int                         m_nMaxIdle;
+    std::vector<Context>        m_aContexts;
+    std::vector<Session>        m_aSessions;
+    EncodeSessionPoolStats      m_stats;
+    std::mutex                  m_mutex;
+
+    EncodeSessionPool(const EncodeSessionPool &);
+    EncodeSessionPool &operator=(const EncodeSessionPool &);
+};
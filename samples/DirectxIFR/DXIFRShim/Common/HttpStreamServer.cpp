@@ -0,0 +1,1053 @@
+/*!
+ * \brief
+ * Non-blocking HTTP/1.1 server streaming every player's output
+ *
+ * \file
+ *
+ * See HttpStreamServer.h.
+ */
+
+#include "HttpStreamServer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET socket_t;
+#define SOCKET_WOULD_BLOCK(e) ((e) == WSAEWOULDBLOCK)
+#define SEND_FLAGS 0
+static int LastSocketError() { return WSAGetLastError(); }
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define SOCKET_WOULD_BLOCK(e) ((e) == EAGAIN || (e) == EWOULDBLOCK || (e) == EINTR)
+#define SEND_FLAGS MSG_NOSIGNAL
+static int LastSocketError() { return errno; }
+#endif
+
+// Most events handled per wait.
+#define HTTP_MAX_EVENTS 64
+
+static const char s_szResponseHeader[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: video/mp2t\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char s_szLastChunk[] = "0\r\n\r\n";
+
+struct HttpEndpoint
+{
+    socket_t    s;
+    bool        bListener;
+    bool        bClosed;
+
+    HttpEndpoint(socket_t s, bool bListener) : s(s), bListener(bListener), bClosed(false) {}
+    virtual ~HttpEndpoint() {}
+};
+
+struct HttpListener : HttpEndpoint
+{
+    int         iStream;        // -1 routes by path
+
+    HttpListener(socket_t s, int iStream) : HttpEndpoint(s, true), iStream(iStream) {}
+};
+
+struct HttpChunk
+{
+    std::vector<uint8_t>    aData;  // as sent, including any chunk framing
+    bool                    bKeyframe;
+};
+
+struct HttpClient : HttpEndpoint
+{
+    int                                     iListenerStream;
+    HttpStream                             *pStream;        // NULL until the request is answered
+    std::string                             request;
+    std::deque<std::shared_ptr<HttpChunk> > queue;
+    size_t                                  queuedBytes;
+    size_t                                  sentOfFront;
+    bool                                    bResponding;
+    bool                                    bWaitKeyframe;
+    bool                                    bWantWrite;
+    bool                                    bCloseWhenSent;
+
+    HttpClient(socket_t s, int iListenerStream)
+        : HttpEndpoint(s, false), iListenerStream(iListenerStream), pStream(NULL),
+          queuedBytes(0), sentOfFront(0), bResponding(false), bWaitKeyframe(false),
+          bWantWrite(false), bCloseWhenSent(false) {}
+};
+
+struct HttpStream
+{
+    int                         iStream;
+    HttpStreamServer::JoinFunc  pfnJoin;
+    void                       *pJoinContext;
+    std::vector<HttpClient *>   aClients;
+    HttpStreamStats             stats;
+    bool                        bStatsChanged;
+};
+
+static std::shared_ptr<HttpChunk> MakeChunk(const char *pData, size_t size, bool bKeyframe)
+{
+    std::shared_ptr<HttpChunk> pChunk(new HttpChunk);
+    pChunk->aData.assign((const uint8_t *)pData, (const uint8_t *)pData + size);
+    pChunk->bKeyframe = bKeyframe;
+    return pChunk;
+}
+
+static void PushChunk(HttpClient *pClient, const std::shared_ptr<HttpChunk> &pChunk)
+{
+    pClient->queue.push_back(pChunk);
+    pClient->queuedBytes += pChunk->aData.size();
+}
+
+static bool SetNonBlocking(socket_t s)
+{
+#if defined(_WIN32)
+    u_long uNonBlocking = 1;
+    return ioctlsocket(s, FIONBIO, &uNonBlocking) == 0;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags != -1 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+struct HttpPollEvent
+{
+    HttpEndpoint   *pEndpoint;  // NULL for a wake
+    bool            bRead;
+    bool            bWrite;
+    bool            bError;
+};
+
+// Level-triggered readiness of the server's sockets plus a wake signal other
+// threads can raise. Every socket is watched for reading; writing only while
+// it has data queued.
+class HttpPoller
+{
+public:
+    HttpPoller();
+    ~HttpPoller();
+
+    bool Initialize();
+    void Add(HttpEndpoint *pEndpoint);
+    void SetWrite(HttpEndpoint *pEndpoint, bool bWrite);
+    void Remove(HttpEndpoint *pEndpoint);
+    void Wait(int timeoutMs, std::vector<HttpPollEvent> &aEvents);
+    void Wake();
+    void ClearWake();
+
+private:
+#if defined(_WIN32)
+    std::map<socket_t, std::pair<HttpEndpoint *, bool> > m_sockets;
+    std::vector<WSAPOLLFD>      m_aFds;
+    std::vector<HttpEndpoint *> m_aEndpoints;
+    socket_t                    m_wakeSocket;
+#else
+    int                         m_epoll;
+    int                         m_wakeFd;
+#endif
+};
+
+#if defined(_WIN32)
+
+HttpPoller::HttpPoller()
+{
+    m_wakeSocket = INVALID_SOCKET;
+}
+
+HttpPoller::~HttpPoller()
+{
+    if (m_wakeSocket != INVALID_SOCKET)
+        closesocket(m_wakeSocket);
+}
+
+// WSAPoll cannot wait on an event, so the wake signal is a datagram a UDP
+// socket connected to itself sends to itself.
+bool HttpPoller::Initialize()
+{
+    m_wakeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (m_wakeSocket == INVALID_SOCKET)
+        return false;
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int addrSize = sizeof(addr);
+    return bind(m_wakeSocket, (sockaddr *)&addr, sizeof(addr)) == 0
+        && getsockname(m_wakeSocket, (sockaddr *)&addr, &addrSize) == 0
+        && connect(m_wakeSocket, (sockaddr *)&addr, sizeof(addr)) == 0
+        && SetNonBlocking(m_wakeSocket);
+}
+
+void HttpPoller::Add(HttpEndpoint *pEndpoint)
+{
+    m_sockets[pEndpoint->s] = std::make_pair(pEndpoint, false);
+}
+
+void HttpPoller::SetWrite(HttpEndpoint *pEndpoint, bool bWrite)
+{
+    m_sockets[pEndpoint->s].second = bWrite;
+}
+
+void HttpPoller::Remove(HttpEndpoint *pEndpoint)
+{
+    m_sockets.erase(pEndpoint->s);
+}
+
+void HttpPoller::Wait(int timeoutMs, std::vector<HttpPollEvent> &aEvents)
+{
+    m_aFds.clear();
+    m_aEndpoints.clear();
+    WSAPOLLFD fd = { m_wakeSocket, POLLRDNORM, 0 };
+    m_aFds.push_back(fd);
+    m_aEndpoints.push_back(NULL);
+    for (std::map<socket_t, std::pair<HttpEndpoint *, bool> >::iterator it = m_sockets.begin(); it != m_sockets.end(); ++it)
+    {
+        fd.fd = it->first;
+        fd.events = POLLRDNORM | (it->second.second ? POLLWRNORM : 0);
+        m_aFds.push_back(fd);
+        m_aEndpoints.push_back(it->second.first);
+    }
+
+    aEvents.clear();
+    if (WSAPoll(&m_aFds[0], (ULONG)m_aFds.size(), timeoutMs) <= 0)
+        return;
+    for (size_t i = 0; i < m_aFds.size(); i++)
+    {
+        SHORT revents = m_aFds[i].revents;
+        if (!revents)
+            continue;
+        HttpPollEvent event;
+        event.pEndpoint = m_aEndpoints[i];
+        event.bRead = (revents & POLLRDNORM) != 0;
+        event.bWrite = (revents & POLLWRNORM) != 0;
+        event.bError = (revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+        aEvents.push_back(event);
+    }
+}
+
+void HttpPoller::Wake()
+{
+    char c = 0;
+    send(m_wakeSocket, &c, 1, 0);
+}
+
+void HttpPoller::ClearWake()
+{
+    char aBuffer[64];
+    while (recv(m_wakeSocket, aBuffer, sizeof(aBuffer), 0) > 0)
+    {
+    }
+}
+
+#else
+
+HttpPoller::HttpPoller()
+{
+    m_epoll = -1;
+    m_wakeFd = -1;
+}
+
+HttpPoller::~HttpPoller()
+{
+    if (m_wakeFd != -1)
+        close(m_wakeFd);
+    if (m_epoll != -1)
+        close(m_epoll);
+}
+
+bool HttpPoller::Initialize()
+{
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epoll == -1 || m_wakeFd == -1)
+        return false;
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    return epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeFd, &event) == 0;
+}
+
+void HttpPoller::Add(HttpEndpoint *pEndpoint)
+{
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = pEndpoint;
+    epoll_ctl(m_epoll, EPOLL_CTL_ADD, pEndpoint->s, &event);
+}
+
+void HttpPoller::SetWrite(HttpEndpoint *pEndpoint, bool bWrite)
+{
+    epoll_event event;
+    event.events = EPOLLIN | (bWrite ? (uint32_t)EPOLLOUT : 0);
+    event.data.ptr = pEndpoint;
+    epoll_ctl(m_epoll, EPOLL_CTL_MOD, pEndpoint->s, &event);
+}
+
+void HttpPoller::Remove(HttpEndpoint *pEndpoint)
+{
+    epoll_ctl(m_epoll, EPOLL_CTL_DEL, pEndpoint->s, NULL);
+}
+
+void HttpPoller::Wait(int timeoutMs, std::vector<HttpPollEvent> &aEvents)
+{
+    epoll_event aReady[HTTP_MAX_EVENTS];
+    aEvents.clear();
+    int n = epoll_wait(m_epoll, aReady, HTTP_MAX_EVENTS, timeoutMs);
+    for (int i = 0; i < n; i++)
+    {
+        HttpPollEvent event;
+        event.pEndpoint = (HttpEndpoint *)aReady[i].data.ptr;
+        event.bRead = (aReady[i].events & EPOLLIN) != 0;
+        event.bWrite = (aReady[i].events & EPOLLOUT) != 0;
+        event.bError = (aReady[i].events & (EPOLLERR | EPOLLHUP)) != 0;
+        aEvents.push_back(event);
+    }
+}
+
+void HttpPoller::Wake()
+{
+    uint64_t one = 1;
+    ssize_t n = write(m_wakeFd, &one, sizeof(one));
+    (void)n;
+}
+
+void HttpPoller::ClearWake()
+{
+    uint64_t count;
+    ssize_t n = read(m_wakeFd, &count, sizeof(count));
+    (void)n;
+}
+
+#endif
+
+// Sends as much of the queue as the socket takes in one call. Returns the
+// bytes sent, 0 if the socket is full, or -1 on error.
+static int SendQueue(socket_t s, const std::deque<std::shared_ptr<HttpChunk> > &queue, size_t sentOfFront)
+{
+    size_t nBuffers = std::min(queue.size(), (size_t)HTTP_SEND_BATCH);
+#if defined(_WIN32)
+    WSABUF aBuffers[HTTP_SEND_BATCH];
+    for (size_t i = 0; i < nBuffers; i++)
+    {
+        size_t skip = i ? 0 : sentOfFront;
+        aBuffers[i].buf = (char *)&queue[i]->aData[skip];
+        aBuffers[i].len = (ULONG)(queue[i]->aData.size() - skip);
+    }
+    DWORD nSent = 0;
+    if (WSASend(s, aBuffers, (DWORD)nBuffers, &nSent, 0, NULL, NULL) == 0)
+        return (int)nSent;
+#else
+    iovec aBuffers[HTTP_SEND_BATCH];
+    for (size_t i = 0; i < nBuffers; i++)
+    {
+        size_t skip = i ? 0 : sentOfFront;
+        aBuffers[i].iov_base = &queue[i]->aData[skip];
+        aBuffers[i].iov_len = queue[i]->aData.size() - skip;
+    }
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = aBuffers;
+    message.msg_iovlen = nBuffers;
+    ssize_t nSent = sendmsg(s, &message, SEND_FLAGS);
+    if (nSent >= 0)
+        return (int)nSent;
+#endif
+    return SOCKET_WOULD_BLOCK(LastSocketError()) ? 0 : -1;
+}
+
+// Stream a request is for when the listener routes by path: the number the
+// last path segment starts with, ignoring any query. -1 if there is none.
+static int ParseStreamPath(const std::string &path)
+{
+    std::string segment = path.substr(0, path.find('?'));
+    size_t slash = segment.rfind('/');
+    if (slash != std::string::npos)
+        segment = segment.substr(slash + 1);
+    if (segment.empty() || segment[0] < '0' || segment[0] > '9')
+        return -1;
+    return atoi(segment.c_str());
+}
+
+HttpStreamServer::HttpStreamServer()
+{
+#if defined(_WIN32)
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    m_pPoller = new HttpPoller();
+    m_uPosted = 0;
+    m_uCompleted = 0;
+    m_bStop = false;
+    m_bRunning = false;
+}
+
+HttpStreamServer::~HttpStreamServer()
+{
+    Stop();
+
+    // Listeners opened but never picked up by the event loop.
+    for (size_t i = 0; i < m_aCommands.size(); i++)
+    {
+        if (m_aCommands[i].eType == COMMAND_LISTEN)
+        {
+            closesocket(m_aCommands[i].pListener->s);
+            delete m_aCommands[i].pListener;
+        }
+    }
+    delete m_pPoller;
+#if defined(_WIN32)
+    WSACleanup();
+#endif
+}
+
+bool HttpStreamServer::Start()
+{
+    if (m_bRunning)
+        return true;
+    if (!m_pPoller->Initialize())
+    {
+        fprintf(stderr, "HttpStreamServer: cannot create the poller\n");
+        return false;
+    }
+    m_bStop = false;
+    m_thread = std::thread(&HttpStreamServer::EventLoop, this);
+    m_bRunning = true;
+    return true;
+}
+
+void HttpStreamServer::Stop()
+{
+    if (!m_bRunning)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bStop = true;
+    }
+    m_completedCondition.notify_all();
+    m_pPoller->Wake();
+    m_thread.join();
+    m_bRunning = false;
+
+    while (!m_aClients.empty())
+    {
+        CloseClient(m_aClients.back());
+    }
+    for (std::map<int, HttpStream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        delete it->second;
+    }
+    m_streams.clear();
+    for (size_t i = 0; i < m_aListeners.size(); i++)
+    {
+        CloseEndpoint(m_aListeners[i]);
+    }
+    m_aListeners.clear();
+    for (size_t i = 0; i < m_aClosed.size(); i++)
+    {
+        delete m_aClosed[i];
+    }
+    m_aClosed.clear();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.clear();
+}
+
+int HttpStreamServer::Listen(unsigned short uPort, int iStream)
+{
+    socket_t s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET)
+        return -1;
+
+#if !defined(_WIN32)
+    // On Windows SO_REUSEADDR would let another process take the port.
+    int reuse = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+#endif
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(uPort);
+    socklen_t addrSize = sizeof(addr);
+    if (bind(s, (sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(s, SOMAXCONN) != 0
+        || !SetNonBlocking(s)
+        || getsockname(s, (sockaddr *)&addr, &addrSize) != 0)
+    {
+        fprintf(stderr, "HttpStreamServer: cannot listen on port %u\n", uPort);
+        closesocket(s);
+        return -1;
+    }
+
+    Command command;
+    command.eType = COMMAND_LISTEN;
+    command.iStream = iStream;
+    command.pListener = new HttpListener(s, iStream);
+    command.pfnJoin = NULL;
+    command.pJoinContext = NULL;
+    PostCommand(command);
+    return ntohs(addr.sin_port);
+}
+
+void HttpStreamServer::AddStream(int iStream, JoinFunc pfnJoin, void *pJoinContext)
+{
+    Command command;
+    command.eType = COMMAND_ADD_STREAM;
+    command.iStream = iStream;
+    command.pListener = NULL;
+    command.pfnJoin = pfnJoin;
+    command.pJoinContext = pJoinContext;
+    PostCommand(command);
+}
+
+// Waits for the event loop to run the command, unless called from a join
+// callback on the event loop itself.
+void HttpStreamServer::RemoveStream(int iStream)
+{
+    Command command;
+    command.eType = COMMAND_REMOVE_STREAM;
+    command.iStream = iStream;
+    command.pListener = NULL;
+    command.pfnJoin = NULL;
+    command.pJoinContext = NULL;
+    unsigned long long uTicket = PostCommand(command);
+
+    if (!m_bRunning || std::this_thread::get_id() == m_thread.get_id())
+        return;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_uCompleted < uTicket && !m_bStop)
+    {
+        m_completedCondition.wait(lock);
+    }
+}
+
+void HttpStreamServer::Publish(int iStream, const uint8_t *pData, size_t size, bool bKeyframe)
+{
+    if (!size)
+        return;
+
+    // Framed once here, outside the lock, and shared by every client.
+    char szSize[16];
+    int sizeLength = sprintf(szSize, "%X\r\n", (unsigned)size);
+    std::shared_ptr<HttpChunk> pChunk(new HttpChunk);
+    pChunk->aData.resize(sizeLength + size + 2);
+    uint8_t *p = &pChunk->aData[0];
+    memcpy(p, szSize, sizeLength);
+    memcpy(p + sizeLength, pData, size);
+    p[sizeLength + size] = '\r';
+    p[sizeLength + size + 1] = '\n';
+    pChunk->bKeyframe = bKeyframe;
+
+    Command command;
+    command.eType = COMMAND_PUBLISH;
+    command.iStream = iStream;
+    command.pListener = NULL;
+    command.pfnJoin = NULL;
+    command.pJoinContext = NULL;
+    command.pChunk = pChunk;
+    PostCommand(command);
+}
+
+bool HttpStreamServer::GetStats(int iStream, HttpStreamStats *pStats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<int, HttpStreamStats>::iterator it = m_stats.find(iStream);
+    if (it == m_stats.end())
+        return false;
+    *pStats = it->second;
+    return true;
+}
+
+static std::mutex s_sharedServerMutex;
+static HttpStreamServer *s_pSharedServer = NULL;
+
+void HttpStreamServer::AddDocument(const char *szPath, const char *szContentType, DocumentFunc pfnMake, void *pContext)
+{
+    Document document;
+    document.contentType = szContentType;
+    document.pfnMake = pfnMake;
+    document.pContext = pContext;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_documents[szPath] = document;
+}
+
+// Makes the whole response to a GET of path if a document is bound to it.
+bool HttpStreamServer::FindDocument(const std::string &path, std::string *pResponse)
+{
+    Document document;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<std::string, Document>::const_iterator it = m_documents.find(path);
+        if (it == m_documents.end())
+            return false;
+        document = it->second;
+    }
+
+    std::string body;
+    document.pfnMake(document.pContext, &body);
+    char szLength[32];
+    sprintf(szLength, "%lu", (unsigned long)body.size());
+    *pResponse = "HTTP/1.1 200 OK\r\nContent-Type: " + document.contentType + "\r\nContent-Length: " + szLength
+        + "\r\nConnection: close\r\n\r\n" + body;
+    return true;
+}
+
+HttpStreamServer *HttpStreamServer::GetShared()
+{
+    std::lock_guard<std::mutex> lock(s_sharedServerMutex);
+    if (!s_pSharedServer)
+    {
+        s_pSharedServer = new HttpStreamServer();
+        s_pSharedServer->Start();
+        const char *szPort = getenv(HTTP_STREAM_PORT_ENV);
+        if (szPort && *szPort)
+        {
+            s_pSharedServer->Listen((unsigned short)atoi(szPort), -1);
+        }
+    }
+    return s_pSharedServer;
+}
+
+// The event loop is only woken when the queue goes from empty to not empty;
+// it clears the wake signal before taking the queue, so nothing is missed.
+// Returns the number of commands posted up to and including this one.
+unsigned long long HttpStreamServer::PostCommand(const Command &command)
+{
+    bool bWake;
+    unsigned long long uTicket;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        bWake = m_aCommands.empty();
+        m_aCommands.push_back(command);
+        uTicket = ++m_uPosted;
+    }
+    if (bWake)
+        m_pPoller->Wake();
+    return uTicket;
+}
+
+void HttpStreamServer::EventLoop()
+{
+    std::vector<HttpPollEvent> aEvents;
+    for (;;)
+    {
+        m_pPoller->Wait(HTTP_POLL_TIMEOUT_MS, aEvents);
+        for (size_t i = 0; i < aEvents.size(); i++)
+        {
+            HttpEndpoint *pEndpoint = aEvents[i].pEndpoint;
+            if (!pEndpoint)
+            {
+                m_pPoller->ClearWake();
+                continue;
+            }
+            if (pEndpoint->bClosed)
+                continue;
+            if (pEndpoint->bListener)
+            {
+                AcceptClients((HttpListener *)pEndpoint);
+                continue;
+            }
+
+            HttpClient *pClient = (HttpClient *)pEndpoint;
+            if (aEvents[i].bError)
+            {
+                CloseClient(pClient);
+                continue;
+            }
+            if (aEvents[i].bRead)
+                ReadRequest(pClient);
+            if (aEvents[i].bWrite && !pClient->bClosed)
+                FlushClient(pClient);
+        }
+
+        RunCommands();
+
+        for (size_t i = 0; i < m_aClosed.size(); i++)
+        {
+            delete m_aClosed[i];
+        }
+        m_aClosed.clear();
+        PublishStats();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_bStop)
+            break;
+    }
+}
+
+void HttpStreamServer::RunCommands()
+{
+    std::vector<Command> aCommands;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        aCommands.swap(m_aCommands);
+    }
+
+    for (size_t i = 0; i < aCommands.size(); i++)
+    {
+        const Command &command = aCommands[i];
+        std::map<int, HttpStream *>::iterator it = m_streams.find(command.iStream);
+        HttpStream *pStream = (it != m_streams.end()) ? it->second : NULL;
+
+        switch (command.eType)
+        {
+        case COMMAND_LISTEN:
+            m_pPoller->Add(command.pListener);
+            m_aListeners.push_back(command.pListener);
+            break;
+
+        case COMMAND_ADD_STREAM:
+            if (!pStream)
+            {
+                pStream = new HttpStream();
+                pStream->iStream = command.iStream;
+                pStream->pfnJoin = command.pfnJoin;
+                pStream->pJoinContext = command.pJoinContext;
+                memset(&pStream->stats, 0, sizeof(pStream->stats));
+                pStream->bStatsChanged = true;
+                m_streams[command.iStream] = pStream;
+            }
+            break;
+
+        case COMMAND_REMOVE_STREAM:
+            if (pStream)
+            {
+                // Clients get the last chunk and are closed once it is sent.
+                std::vector<HttpClient *> aClients = pStream->aClients;
+                for (size_t j = 0; j < aClients.size(); j++)
+                {
+                    HttpClient *pClient = aClients[j];
+                    pClient->pStream = NULL;
+                    PushChunk(pClient, MakeChunk(s_szLastChunk, strlen(s_szLastChunk), false));
+                    pClient->bCloseWhenSent = true;
+                    FlushClient(pClient);
+                }
+                delete pStream;
+                m_streams.erase(it);
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_stats.erase(command.iStream);
+                }
+            }
+            for (size_t j = 0; j < m_aListeners.size();)
+            {
+                if (m_aListeners[j]->iStream == command.iStream)
+                {
+                    CloseEndpoint(m_aListeners[j]);
+                    m_aListeners.erase(m_aListeners.begin() + j);
+                }
+                else
+                {
+                    j++;
+                }
+            }
+            break;
+
+        case COMMAND_PUBLISH:
+            if (pStream)
+            {
+                // Flushing may close a client, which removes it from aClients.
+                std::vector<HttpClient *> aClients = pStream->aClients;
+                for (size_t j = 0; j < aClients.size(); j++)
+                {
+                    if (aClients[j]->bClosed)
+                        continue;
+                    Enqueue(aClients[j], command.pChunk);
+                    FlushClient(aClients[j]);
+                }
+            }
+            break;
+        }
+    }
+
+    if (!aCommands.empty())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_uCompleted += aCommands.size();
+        }
+        m_completedCondition.notify_all();
+    }
+}
+
+void HttpStreamServer::AcceptClients(HttpListener *pListener)
+{
+    for (;;)
+    {
+        socket_t s = accept(pListener->s, NULL, NULL);
+        if (s == INVALID_SOCKET)
+            return;
+        if (!SetNonBlocking(s))
+        {
+            closesocket(s);
+            continue;
+        }
+        int noDelay = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
+
+        HttpClient *pClient = new HttpClient(s, pListener->iStream);
+        m_pPoller->Add(pClient);
+        m_aClients.push_back(pClient);
+    }
+}
+
+void HttpStreamServer::ReadRequest(HttpClient *pClient)
+{
+    char aBuffer[4096];
+    for (;;)
+    {
+        int n = recv(pClient->s, aBuffer, sizeof(aBuffer), 0);
+        if (n > 0)
+        {
+            // Anything after the request header is ignored.
+            if (!pClient->bResponding)
+                pClient->request.append(aBuffer, n);
+            continue;
+        }
+        if (n == 0 || !SOCKET_WOULD_BLOCK(LastSocketError()))
+        {
+            CloseClient(pClient);
+            return;
+        }
+        break;
+    }
+    if (pClient->bResponding)
+        return;
+
+    const char *szError = NULL;
+    int iStream = -1;
+    size_t headerEnd = pClient->request.find("\r\n\r\n");
+    if (headerEnd == std::string::npos)
+    {
+        if (pClient->request.size() <= HTTP_MAX_REQUEST_BYTES)
+            return;
+        szError = "431 Request Header Fields Too Large";
+    }
+    else
+    {
+        // Request line: method, path, version.
+        std::string line = pClient->request.substr(0, pClient->request.find("\r\n"));
+        size_t pathStart = line.find(' ');
+        size_t pathEnd = (pathStart == std::string::npos) ? std::string::npos : line.find(' ', pathStart + 1);
+        if (pathEnd == std::string::npos)
+        {
+            szError = "400 Bad Request";
+        }
+        else if (line.compare(0, pathStart, "GET") != 0)
+        {
+            szError = "405 Method Not Allowed";
+        }
+        else
+        {
+            std::string path = line.substr(pathStart + 1, pathEnd - pathStart - 1);
+            std::string document;
+            if (FindDocument(path.substr(0, path.find('?')), &document))
+            {
+                pClient->bResponding = true;
+                pClient->request.clear();
+                PushChunk(pClient, MakeChunk(document.data(), document.size(), false));
+                pClient->bCloseWhenSent = true;
+                FlushClient(pClient);
+                return;
+            }
+
+            iStream = pClient->iListenerStream;
+            if (iStream < 0)
+                iStream = ParseStreamPath(path);
+            if (iStream < 0 || m_streams.find(iStream) == m_streams.end())
+                szError = "404 Not Found";
+        }
+    }
+
+    pClient->bResponding = true;
+    pClient->request.clear();
+    if (szError)
+    {
+        std::string response = std::string("HTTP/1.1 ") + szError + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        PushChunk(pClient, MakeChunk(response.data(), response.size(), false));
+        pClient->bCloseWhenSent = true;
+        FlushClient(pClient);
+        return;
+    }
+    StartResponse(pClient, iStream);
+}
+
+void HttpStreamServer::StartResponse(HttpClient *pClient, int iStream)
+{
+    HttpStream *pStream = m_streams[iStream];
+    pClient->pStream = pStream;
+    pStream->aClients.push_back(pClient);
+    pStream->stats.nClients++;
+    pStream->bStatsChanged = true;
+
+    PushChunk(pClient, MakeChunk(s_szResponseHeader, strlen(s_szResponseHeader), false));
+    FlushClient(pClient);
+    if (!pClient->bClosed)
+        WaitForKeyframe(pClient);
+}
+
+void HttpStreamServer::WaitForKeyframe(HttpClient *pClient)
+{
+    pClient->bWaitKeyframe = true;
+    pClient->pStream->stats.nJoins++;
+    pClient->pStream->bStatsChanged = true;
+    if (pClient->pStream->pfnJoin)
+        pClient->pStream->pfnJoin(pClient->pStream->pJoinContext, pClient->pStream->iStream);
+}
+
+void HttpStreamServer::Enqueue(HttpClient *pClient, const std::shared_ptr<HttpChunk> &pChunk)
+{
+    HttpStream *pStream = pClient->pStream;
+    size_t size = pChunk->aData.size();
+
+    if (!pClient->bWaitKeyframe && pClient->queuedBytes && pClient->queuedBytes + size > HTTP_CLIENT_QUEUE_BYTES)
+    {
+        // Too far behind: drop what has not started to go out. The chunk in
+        // flight has to be finished to keep the chunked framing intact.
+        size_t keep = pClient->sentOfFront ? 1 : 0;
+        for (size_t i = keep; i < pClient->queue.size(); i++)
+        {
+            pClient->queuedBytes -= pClient->queue[i]->aData.size();
+        }
+        pStream->stats.nChunksDropped += pClient->queue.size() - keep;
+        pClient->queue.resize(keep);
+        pStream->bStatsChanged = true;
+
+        // A keyframe is where the client can pick up again anyway.
+        if (!pChunk->bKeyframe)
+            WaitForKeyframe(pClient);
+    }
+
+    if (pClient->bWaitKeyframe)
+    {
+        if (!pChunk->bKeyframe)
+        {
+            pStream->stats.nChunksDropped++;
+            pStream->bStatsChanged = true;
+            return;
+        }
+        pClient->bWaitKeyframe = false;
+    }
+
+    PushChunk(pClient, pChunk);
+}
+
+void HttpStreamServer::FlushClient(HttpClient *pClient)
+{
+    if (pClient->bClosed)
+        return;
+    while (!pClient->queue.empty())
+    {
+        int nSent = SendQueue(pClient->s, pClient->queue, pClient->sentOfFront);
+        if (nSent < 0)
+        {
+            CloseClient(pClient);
+            return;
+        }
+        if (nSent == 0)
+            break;
+
+        if (pClient->pStream)
+        {
+            pClient->pStream->stats.nBytesSent += nSent;
+            pClient->pStream->bStatsChanged = true;
+        }
+        size_t remaining = nSent;
+        while (remaining)
+        {
+            size_t frontLeft = pClient->queue.front()->aData.size() - pClient->sentOfFront;
+            if (remaining < frontLeft)
+            {
+                pClient->sentOfFront += remaining;
+                break;
+            }
+            remaining -= frontLeft;
+            pClient->queuedBytes -= pClient->queue.front()->aData.size();
+            pClient->queue.pop_front();
+            pClient->sentOfFront = 0;
+        }
+    }
+
+    if (pClient->queue.empty())
+    {
+        pClient->queuedBytes = 0;
+        if (pClient->bCloseWhenSent)
+        {
+            CloseClient(pClient);
+            return;
+        }
+    }
+    bool bWantWrite = !pClient->queue.empty();
+    if (bWantWrite != pClient->bWantWrite)
+    {
+        m_pPoller->SetWrite(pClient, bWantWrite);
+        pClient->bWantWrite = bWantWrite;
+    }
+}
+
+void HttpStreamServer::CloseClient(HttpClient *pClient)
+{
+    if (pClient->bClosed)
+        return;
+    HttpStream *pStream = pClient->pStream;
+    if (pStream)
+    {
+        pStream->aClients.erase(std::find(pStream->aClients.begin(), pStream->aClients.end(), pClient));
+        pStream->stats.nClients--;
+        pStream->bStatsChanged = true;
+        pClient->pStream = NULL;
+    }
+    m_aClients.erase(std::find(m_aClients.begin(), m_aClients.end(), pClient));
+    CloseEndpoint(pClient);
+}
+
+// The endpoint is deleted after the current batch of events, which may still
+// refer to it.
+void HttpStreamServer::CloseEndpoint(HttpEndpoint *pEndpoint)
+{
+    if (pEndpoint->bClosed)
+        return;
+    m_pPoller->Remove(pEndpoint);
+    closesocket(pEndpoint->s);
+    pEndpoint->bClosed = true;
+    m_aClosed.push_back(pEndpoint);
+}
+
+void HttpStreamServer::PublishStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (std::map<int, HttpStream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        if (it->second->bStatsChanged)
+        {
+            m_stats[it->first] = it->second->stats;
+            it->second->bStatsChanged = false;
+        }
+    }
+}
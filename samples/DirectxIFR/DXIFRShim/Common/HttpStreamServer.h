@@ -0,0 +1,172 @@
+/*!
+ * \brief
+ * Non-blocking HTTP/1.1 server streaming every player's output
+ *
+ * \file
+ *
+ * One event-loop thread (epoll on Linux, WSAPoll on Windows) serves all
+ * streams. A listener either belongs to one stream, so any GET on its port
+ * gets that stream, or routes by URL path, where the last path segment
+ * starts with the stream id (/stream/3, /3.ts). Each response is an endless
+ * chunked transfer, one chunk per Publish.
+ *
+ * Publish may be called from any thread: the data is framed as a chunk once
+ * and shared by every client of the stream. Each client has its own send
+ * queue of at most HTTP_CLIENT_QUEUE_BYTES. A client that falls that far
+ * behind loses everything queued that it has not started sending, and then
+ * receives nothing until the next keyframe, as does a client that just
+ * joined. The stream's join callback fires in both cases so the encoder can
+ * make a keyframe instead of waiting for the next one.
+ *
+ * A path can also be bound to a document, such as a trace or statistics,
+ * which is made on the event loop thread for each GET of that path on any
+ * listener and sent in one response.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bytes a client may have queued before it is dropped to the next keyframe.
+#define HTTP_CLIENT_QUEUE_BYTES (2 * 1024 * 1024)
+
+// Longest request header accepted.
+#define HTTP_MAX_REQUEST_BYTES  8192
+
+// Upper bound on how long the event loop sleeps when idle.
+#define HTTP_POLL_TIMEOUT_MS    1000
+
+// Buffers handed to one gathering send.
+#define HTTP_SEND_BATCH         16
+
+// Port the shared server routes all streams on by path, if set.
+#define HTTP_STREAM_PORT_ENV    "DXIFRSHIM_HTTP_PORT"
+
+struct HttpStreamStats
+{
+    int                 nClients;
+    int                 nJoins;             // clients that started waiting for a keyframe
+    unsigned long long  nBytesSent;
+    unsigned long long  nChunksDropped;     // summed over clients, including those skipped while waiting
+};
+
+struct HttpEndpoint;
+struct HttpClient;
+struct HttpListener;
+struct HttpChunk;
+struct HttpStream;
+class HttpPoller;
+
+class HttpStreamServer
+{
+public:
+    typedef void (*JoinFunc)(void *pContext, int iStream);
+    typedef void (*DocumentFunc)(void *pContext, std::string *pBody);
+
+    HttpStreamServer();
+    ~HttpStreamServer();
+
+    // Starts the event loop thread.
+    bool Start();
+
+    // Closes every connection and joins the event loop thread.
+    void Stop();
+
+    // Listens on uPort (0 picks a free port) for stream iStream, or routes by
+    // path if iStream is -1. Returns the bound port, or -1.
+    int Listen(unsigned short uPort, int iStream);
+
+    // Makes iStream available to clients. pfnJoin, if set, is called on the
+    // event loop thread whenever a client of iStream starts waiting for a
+    // keyframe.
+    void AddStream(int iStream, JoinFunc pfnJoin = NULL, void *pJoinContext = NULL);
+
+    // Ends the responses of iStream's clients and closes listeners bound to it.
+    // Once it returns, the join callback of iStream is no longer called.
+    void RemoveStream(int iStream);
+
+    // Sends one piece of iStream to its clients. bKeyframe marks where a
+    // client that is waiting for a keyframe can start.
+    void Publish(int iStream, const uint8_t *pData, size_t size, bool bKeyframe);
+
+    bool GetStats(int iStream, HttpStreamStats *pStats);
+
+    // Answers GET szPath (exactly, query aside) with what pfnMake appends to
+    // the body. pfnMake blocks every stream while it runs, so it should be
+    // quick. Adding a path again replaces its document.
+    void AddDocument(const char *szPath, const char *szContentType, DocumentFunc pfnMake, void *pContext);
+
+    // Server shared by all players. The first call starts it and, if the
+    // DXIFRSHIM_HTTP_PORT environment variable is set, listens on that port
+    // by path. The shared server is never destroyed.
+    static HttpStreamServer *GetShared();
+
+private:
+    enum CommandType
+    {
+        COMMAND_LISTEN,
+        COMMAND_ADD_STREAM,
+        COMMAND_REMOVE_STREAM,
+        COMMAND_PUBLISH,
+    };
+
+    struct Document
+    {
+        std::string                 contentType;
+        DocumentFunc                pfnMake;
+        void                       *pContext;
+    };
+
+    struct Command
+    {
+        CommandType                 eType;
+        int                         iStream;
+        HttpListener               *pListener;
+        JoinFunc                    pfnJoin;
+        void                       *pJoinContext;
+        std::shared_ptr<HttpChunk>  pChunk;
+    };
+
+    unsigned long long PostCommand(const Command &command);
+    void EventLoop();
+    void RunCommands();
+    void AcceptClients(HttpListener *pListener);
+    void ReadRequest(HttpClient *pClient);
+    void StartResponse(HttpClient *pClient, int iStream);
+    void Enqueue(HttpClient *pClient, const std::shared_ptr<HttpChunk> &pChunk);
+    void FlushClient(HttpClient *pClient);
+    void CloseClient(HttpClient *pClient);
+    void WaitForKeyframe(HttpClient *pClient);
+    void CloseEndpoint(HttpEndpoint *pEndpoint);
+    void PublishStats();
+    bool FindDocument(const std::string &path, std::string *pResponse);
+
+    HttpPoller                     *m_pPoller;
+    std::map<int, HttpStream *>     m_streams;          // event loop thread only
+    std::vector<HttpListener *>     m_aListeners;       // event loop thread only
+    std::vector<HttpClient *>       m_aClients;         // event loop thread only
+    std::vector<HttpEndpoint *>     m_aClosed;          // deleted after each event batch
+
+    std::mutex                      m_mutex;            // guards everything below
+    std::vector<Command>            m_aCommands;
+    unsigned long long              m_uPosted;          // commands posted so far
+    unsigned long long              m_uCompleted;       // commands run so far
+    std::condition_variable         m_completedCondition;
+    std::map<int, HttpStreamStats>  m_stats;
+    std::map<std::string, Document> m_documents;
+    bool                            m_bStop;
+
+    std::thread                     m_thread;
+    bool                            m_bRunning;
+
+    HttpStreamServer(const HttpStreamServer &);
+    HttpStreamServer &operator=(const HttpStreamServer &);
+};
@@ -4,7 +4,12 @@
  *
  * \file
  *
- * This logger can log either into a file, or the standard output.
+ * This logger can log either into a file, the standard output or a UDP port.
+ *
+ * LOG_* formats the line on the calling thread and queues it; the file, the
+ * console or the socket is written by a background thread (AsyncLog.h). Each
+ * call site logs at most ASYNC_LOG_RATE_LIMIT lines a second. Levels below
+ * LOG_COMPILED_LEVEL are compiled out, TRACE by default in release builds.
  *
  * \copyright
  * CopyRight 1993-2016 NVIDIA Corporation.  All rights reserved.
@@ -19,62 +24,82 @@
 #include <fstream>
 #include <string>
 #include <sstream>
-#include <time.h>
+#include <stdio.h>
+#include "AsyncLog.h"
+
+#if defined(_WIN32)
 #include <winsock.h>
 #include <windows.h>
 
 #pragma comment(lib, "ws2_32.lib")
+#endif
+
+#define LOG_LEVEL_TRACE	0
+#define LOG_LEVEL_DEBUG	1
+#define LOG_LEVEL_INFO	2
+#define LOG_LEVEL_WARN	3
+#define LOG_LEVEL_ERR	4
+
+#ifndef LOG_COMPILED_LEVEL
+#if defined(NDEBUG)
+#define LOG_COMPILED_LEVEL	LOG_LEVEL_DEBUG
+#else
+#define LOG_COMPILED_LEVEL	LOG_LEVEL_TRACE
+#endif
+#endif
 
 namespace simplelogger{
 
 enum LogLevel {
-	TRACE,
-	DEBUG,
-	INFO,
-	WARN,
-	ERR
+	TRACE = LOG_LEVEL_TRACE,
+	DEBUG = LOG_LEVEL_DEBUG,
+	INFO = LOG_LEVEL_INFO,
+	WARN = LOG_LEVEL_WARN,
+	ERR = LOG_LEVEL_ERR
 };
 
-class Logger {
+class Logger : public AsyncLogSink {
 public:
-	Logger(LogLevel level, bool bPrintTimeStamp) : level(level), bPrintTimeStamp(bPrintTimeStamp) {
-		InitializeCriticalSection(&cs);
-	}
-	virtual ~Logger() {
-		DeleteCriticalSection(&cs);
-	}
+	Logger(LogLevel level, bool bPrintTimeStamp) : level(level), bPrintTimeStamp(bPrintTimeStamp) {}
+	virtual ~Logger() {}
 	virtual std::ostream& GetStream() = 0;
 	virtual void FlushStream() {}
 	bool ShouldLogFor(LogLevel l) {
 		return l >= level;
 	}
-	char* GetLead(LogLevel l, char *szFile, int nLine, char *szFunc) {
+	const char* GetLead(LogLevel l, const char *szTime) {
 		if (l < TRACE || l > ERR) {
 			return "[?????] ";
 		}
-		char *szLevels[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+		const char *szLevels[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
 		if (bPrintTimeStamp) {
-			time_t t = time(NULL);
-			struct tm tm;
-			localtime_s(&tm, &t);
-			sprintf_s(szLead, sizeof(szLead), "[%-5s][%02d:%02d:%02d] ", 
-				szLevels[l], tm.tm_hour, tm.tm_min, tm.tm_sec);
+			sprintf(szLead, "[%-5s][%s] ", szLevels[l], szTime);
 		} else {
-			sprintf_s(szLead, sizeof(szLead), "[%-5s] ", szLevels[l]);
+			sprintf(szLead, "[%-5s] ", szLevels[l]);
 		}
 		return szLead;
 	}
-	void EnterCriticalSection() {
-		::EnterCriticalSection(&cs);
+	void Post(LogLevel l, uint64_t uTimeUs, uint32_t nSuppressed, const AsyncLogStream &stream) {
+		AsyncLogPost(this, l, uTimeUs, nSuppressed, stream.GetLine(), stream.GetLength());
+	}
+	// Writes out what was logged so far. Derived loggers call it first thing
+	// in their destructor, while their stream is still there.
+	void Drain() {
+		AsyncLogFlush();
 	}
-	void LeaveCriticalSection() {
-		::LeaveCriticalSection(&cs);
+	virtual void WriteLine(int l, const char *szTime, const char *szLine, size_t nLength) {
+		std::ostream &stream = GetStream();
+		stream << GetLead((LogLevel)l, szTime);
+		stream.write(szLine, nLength) << '\n';
+		FlushStream();
+	}
+	virtual void FlushLines() {
+		GetStream().flush();
 	}
 private:
 	LogLevel level;
 	char szLead[80];
 	bool bPrintTimeStamp;
-	CRITICAL_SECTION cs;
 };
 
 class LoggerFactory {
@@ -87,10 +112,12 @@ public:
 			bool bPrintTimeStamp = true) {
 		return new ConsoleLogger(level, bPrintTimeStamp);
 	}
+#if defined(_WIN32)
 	static Logger* CreateUdpLogger(char *szHost, unsigned uPort, LogLevel level = DEBUG, 
 			bool bPrintTimeStamp = true) {
 		return new UdpLogger(szHost, uPort, level, bPrintTimeStamp);
 	}
+#endif
 private:
 	LoggerFactory() {}
 
@@ -102,7 +129,9 @@ private:
 			pFileOut->open(strFilePath.c_str());
 		}
 		~FileLogger() {
+			Drain();
 			pFileOut->close();
+			delete pFileOut;
 		}
 		std::ostream& GetStream() {
 			return *pFileOut;
@@ -115,11 +144,15 @@ private:
 	public:
 		ConsoleLogger(LogLevel level, bool bPrintTimeStamp) 
 		: Logger(level, bPrintTimeStamp) {}
+		~ConsoleLogger() {
+			Drain();
+		}
 		std::ostream& GetStream() {
 			return std::cout;
 		}
 	};
 
+#if defined(_WIN32)
 	class UdpLogger : public Logger {
 	private:
 		class UdpOstream : public std::ostream {
@@ -164,35 +197,64 @@ private:
 	public:
 		UdpLogger(char *szHost, unsigned uPort, LogLevel level, bool bPrintTimeStamp) 
 		: Logger(level, bPrintTimeStamp), udpOut(szHost, uPort) {}
+		~UdpLogger() {
+			Drain();
+		}
 		UdpOstream& GetStream() {
 			return udpOut;
 		}
+		// One datagram per line.
 		virtual void FlushStream() {
 			udpOut.Flush();
 		}
 	private:
 		UdpOstream udpOut;
 	};
+#endif
 };
 
 }
 
+// The line is formatted on the stack and queued; nothing waits for the
+// stream. Lines past the rate limit of their call site are not formatted.
 #define LOG(pLogger, event, level) \
 	do {													\
 		if (!pLogger || !pLogger->ShouldLogFor(level)) {	\
 			break;											\
 		}													\
-		pLogger->EnterCriticalSection();					\
-		pLogger->GetStream()								\
-			<< pLogger->GetLead(level, __FILE__, __LINE__,	\
-				__FUNCTION__)								\
-			<< event << std::endl;							\
-		pLogger->FlushStream();								\
-		pLogger->LeaveCriticalSection();					\
+		uint64_t uLogTimeUs = AsyncLogNow();				\
+		uint32_t nLogSuppressed = 0;						\
+		if (!AsyncLogAllow(__FILE__, __LINE__, uLogTimeUs,	\
+				&nLogSuppressed)) {							\
+			break;											\
+		}													\
+		AsyncLogStream logStream;							\
+		logStream << event;									\
+		pLogger->Post(level, uLogTimeUs, nLogSuppressed,	\
+			logStream);										\
 	} while (0);
 
+// Compiled out below LOG_COMPILED_LEVEL, event and all.
+#define LOG_NONE(pLogger, event)	do {} while (0);
+
+#if LOG_COMPILED_LEVEL <= LOG_LEVEL_TRACE
 #define LOG_TRACE(pLogger, event)	LOG(pLogger, event, simplelogger::TRACE)
+#else
+#define LOG_TRACE(pLogger, event)	LOG_NONE(pLogger, event)
+#endif
+#if LOG_COMPILED_LEVEL <= LOG_LEVEL_DEBUG
 #define LOG_DEBUG(pLogger, event)	LOG(pLogger, event, simplelogger::DEBUG)
+#else
+#define LOG_DEBUG(pLogger, event)	LOG_NONE(pLogger, event)
+#endif
+#if LOG_COMPILED_LEVEL <= LOG_LEVEL_INFO
 #define LOG_INFO(pLogger, event)	LOG(pLogger, event, simplelogger::INFO)
+#else
+#define LOG_INFO(pLogger, event)	LOG_NONE(pLogger, event)
+#endif
+#if LOG_COMPILED_LEVEL <= LOG_LEVEL_WARN
 #define LOG_WARN(pLogger, event)	LOG(pLogger, event, simplelogger::WARN)
+#else
+#define LOG_WARN(pLogger, event)	LOG_NONE(pLogger, event)
+#endif
 #define LOG_ERROR(pLogger, event)	LOG(pLogger, event, simplelogger::ERR)
@@ -0,0 +1,282 @@
+/*!
+ * \brief
+ * Encoder backend that produces a synthetic H.264 stream
+ *
+ * \file
+ *
+ * See NullVideoEncoder.h. The stream is constrained baseline, CAVLC, one
+ * slice per picture, pic_order_cnt_type 2 and a single reference frame.
+ * IDR macroblocks are I_16x16 with DC prediction and no residual (8 bits
+ * each), which decodes to mid grey; P slices are one mb_skip_run.
+ */
+
+#include "NullVideoEncoder.h"
+#include "BitstreamOutput.h"
+
+#define NAL_TYPE_SLICE   1
+#define NAL_TYPE_IDR     5
+#define NAL_TYPE_SPS     7
+#define NAL_TYPE_PPS     8
+#define NAL_TYPE_FILLER 12
+
+// Start code, NAL header and rbsp trailing byte of a filler NAL.
+#define FILLER_NAL_OVERHEAD 6
+
+// Writes the RBSP of one NAL unit, then appends it to an Annex-B stream with
+// emulation prevention.
+class NalWriter
+{
+public:
+    NalWriter() : m_uBits(0), m_nBits(0) {}
+
+    void PutBits(uint32_t uValue, int nBits)
+    {
+        for (int i = nBits - 1; i >= 0; i--)
+        {
+            m_uBits = (m_uBits << 1) | ((uValue >> i) & 1);
+            if (++m_nBits == 8)
+            {
+                m_aRbsp.push_back((uint8_t)m_uBits);
+                m_uBits = 0;
+                m_nBits = 0;
+            }
+        }
+    }
+
+    void PutUE(uint32_t uValue)
+    {
+        uint32_t uCode = uValue + 1;
+        int nLength = 0;
+        for (uint32_t u = uCode; u > 1; u >>= 1)
+            nLength++;
+        PutBits(0, nLength);
+        PutBits(uCode, nLength + 1);
+    }
+
+    void PutSE(int iValue)
+    {
+        PutUE(iValue > 0 ? 2 * iValue - 1 : -2 * iValue);
+    }
+
+    void PutTrailingBits()
+    {
+        PutBits(1, 1);
+        while (m_nBits)
+            PutBits(0, 1);
+    }
+
+    void Flush(uint8_t nalRefIdc, uint8_t nalType, std::vector<uint8_t> &aOut)
+    {
+        static const uint8_t aStartCode[] = { 0, 0, 0, 1 };
+        aOut.insert(aOut.end(), aStartCode, aStartCode + sizeof(aStartCode));
+        aOut.push_back((uint8_t)((nalRefIdc << 5) | nalType));
+
+        int nZeros = 0;
+        for (size_t i = 0; i < m_aRbsp.size(); i++)
+        {
+            if (nZeros == 2 && m_aRbsp[i] <= 3)
+            {
+                aOut.push_back(3);
+                nZeros = 0;
+            }
+            aOut.push_back(m_aRbsp[i]);
+            nZeros = m_aRbsp[i] ? 0 : nZeros + 1;
+        }
+        m_aRbsp.clear();
+    }
+
+private:
+    std::vector<uint8_t> m_aRbsp;
+    uint32_t             m_uBits;
+    int                  m_nBits;
+};
+
+CNullEncoder::CNullEncoder(uint32_t uFrameBytes)
+{
+    m_pOutput = NULL;
+    m_uFixedFrameBytes = uFrameBytes;
+    m_uWidthInMbs = 0;
+    m_uHeightInMbs = 0;
+    m_uCropRight = 0;
+    m_uCropBottom = 0;
+    m_iFps = 30;
+    m_iBitrate = 0;
+    m_uFrameCount = 0;
+    m_uIdrPicId = 0;
+    m_uFrameNum = 0;
+}
+
+CNullEncoder::~CNullEncoder()
+{
+    Shutdown();
+}
+
+int CNullEncoder::EncodeMain(int index, int width, int height, int fps, int initialBitrate,
+                             uint8_t ** /*ppCaptureBuffers*/, int /*nCaptureBuffers*/)
+{
+    if (width <= 0 || height <= 0 || fps <= 0)
+        return 1;
+
+    m_uWidthInMbs = (width + 15) / 16;
+    m_uHeightInMbs = (height + 15) / 16;
+    // Cropping is in chroma sample units for 4:2:0.
+    m_uCropRight = (m_uWidthInMbs * 16 - width) / 2;
+    m_uCropBottom = (m_uHeightInMbs * 16 - height) / 2;
+    m_iFps = fps;
+    m_iBitrate = initialBitrate;
+    m_uFrameCount = 0;
+    m_uIdrPicId = 0;
+    m_uFrameNum = 0;
+
+    m_pOutput = OpenBitstreamOutput(index);
+    return m_pOutput ? 0 : 1;
+}
+
+uint32_t CNullEncoder::GetTargetBytes(bool bIdr) const
+{
+    uint32_t uBytes = m_uFixedFrameBytes ? m_uFixedFrameBytes : (uint32_t)((int64_t)m_iBitrate / 8 / m_iFps);
+    return bIdr ? uBytes * NULL_ENCODER_IDR_SIZE_FACTOR : uBytes;
+}
+
+const std::vector<uint8_t>& CNullEncoder::EncodeNextAccessUnit()
+{
+    NalWriter nal;
+    uint32_t uMbs = m_uWidthInMbs * m_uHeightInMbs;
+    bool bIdr = (m_uFrameCount == 0) || (m_pOutput && m_pOutput->TakeKeyframeRequest());
+
+    m_aAccessUnit.clear();
+
+    if (bIdr)
+    {
+        // SPS: constrained baseline, level 4.0 (5.1 above 1080p).
+        nal.PutBits(66, 8);                         // profile_idc
+        nal.PutBits(0xC0, 8);                       // constraint_set0/1
+        nal.PutBits(uMbs > 8192 ? 51 : 40, 8);      // level_idc
+        nal.PutUE(0);                               // seq_parameter_set_id
+        nal.PutUE(0);                               // log2_max_frame_num_minus4
+        nal.PutUE(2);                               // pic_order_cnt_type
+        nal.PutUE(1);                               // max_num_ref_frames
+        nal.PutBits(0, 1);                          // gaps_in_frame_num_value_allowed_flag
+        nal.PutUE(m_uWidthInMbs - 1);
+        nal.PutUE(m_uHeightInMbs - 1);
+        nal.PutBits(1, 1);                          // frame_mbs_only_flag
+        nal.PutBits(1, 1);                          // direct_8x8_inference_flag
+        if (m_uCropRight || m_uCropBottom)
+        {
+            nal.PutBits(1, 1);
+            nal.PutUE(0);
+            nal.PutUE(m_uCropRight);
+            nal.PutUE(0);
+            nal.PutUE(m_uCropBottom);
+        }
+        else
+        {
+            nal.PutBits(0, 1);
+        }
+        nal.PutBits(0, 1);                          // vui_parameters_present_flag
+        nal.PutTrailingBits();
+        nal.Flush(3, NAL_TYPE_SPS, m_aAccessUnit);
+
+        nal.PutUE(0);                               // pic_parameter_set_id
+        nal.PutUE(0);                               // seq_parameter_set_id
+        nal.PutBits(0, 1);                          // entropy_coding_mode_flag
+        nal.PutBits(0, 1);                          // bottom_field_pic_order_in_frame_present_flag
+        nal.PutUE(0);                               // num_slice_groups_minus1
+        nal.PutUE(0);                               // num_ref_idx_l0_default_active_minus1
+        nal.PutUE(0);                               // num_ref_idx_l1_default_active_minus1
+        nal.PutBits(0, 1);                          // weighted_pred_flag
+        nal.PutBits(0, 2);                          // weighted_bipred_idc
+        nal.PutSE(0);                               // pic_init_qp_minus26
+        nal.PutSE(0);                               // pic_init_qs_minus26
+        nal.PutSE(0);                               // chroma_qp_index_offset
+        nal.PutBits(1, 1);                          // deblocking_filter_control_present_flag
+        nal.PutBits(0, 1);                          // constrained_intra_pred_flag
+        nal.PutBits(0, 1);                          // redundant_pic_cnt_present_flag
+        nal.PutTrailingBits();
+        nal.Flush(3, NAL_TYPE_PPS, m_aAccessUnit);
+
+        m_uFrameNum = 0;
+        nal.PutUE(0);                               // first_mb_in_slice
+        nal.PutUE(7);                               // slice_type: I, all slices
+        nal.PutUE(0);                               // pic_parameter_set_id
+        nal.PutBits(0, 4);                          // frame_num
+        nal.PutUE(m_uIdrPicId);                     // idr_pic_id, differs between neighbouring IDRs
+        m_uIdrPicId ^= 1;
+        nal.PutBits(0, 1);                          // no_output_of_prior_pics_flag
+        nal.PutBits(0, 1);                          // long_term_reference_flag
+        nal.PutSE(0);                               // slice_qp_delta
+        nal.PutUE(1);                               // disable_deblocking_filter_idc
+        for (uint32_t i = 0; i < uMbs; i++)
+        {
+            nal.PutUE(3);                           // mb_type I_16x16_2_0_0 (DC)
+            nal.PutUE(0);                           // intra_chroma_pred_mode DC
+            nal.PutSE(0);                           // mb_qp_delta
+            nal.PutBits(1, 1);                      // DC coeff_token: no coefficients
+        }
+        nal.PutTrailingBits();
+        nal.Flush(3, NAL_TYPE_IDR, m_aAccessUnit);
+    }
+    else
+    {
+        m_uFrameNum = (m_uFrameNum + 1) & 15;
+        nal.PutUE(0);                               // first_mb_in_slice
+        nal.PutUE(5);                               // slice_type: P, all slices
+        nal.PutUE(0);                               // pic_parameter_set_id
+        nal.PutBits(m_uFrameNum, 4);                // frame_num
+        nal.PutBits(0, 1);                          // num_ref_idx_active_override_flag
+        nal.PutBits(0, 1);                          // ref_pic_list_modification_flag_l0
+        nal.PutBits(0, 1);                          // adaptive_ref_pic_marking_mode_flag
+        nal.PutSE(0);                               // slice_qp_delta
+        nal.PutUE(1);                               // disable_deblocking_filter_idc
+        nal.PutUE(uMbs);                            // mb_skip_run
+        nal.PutTrailingBits();
+        nal.Flush(2, NAL_TYPE_SLICE, m_aAccessUnit);
+    }
+
+    uint32_t uTarget = GetTargetBytes(bIdr);
+    if (m_aAccessUnit.size() + FILLER_NAL_OVERHEAD <= uTarget)
+    {
+        size_t nFiller = uTarget - m_aAccessUnit.size() - FILLER_NAL_OVERHEAD;
+        static const uint8_t aFillerHeader[] = { 0, 0, 0, 1, NAL_TYPE_FILLER };
+        m_aAccessUnit.insert(m_aAccessUnit.end(), aFillerHeader, aFillerHeader + sizeof(aFillerHeader));
+        m_aAccessUnit.insert(m_aAccessUnit.end(), nFiller, 0xFF);
+        m_aAccessUnit.push_back(0x80);
+    }
+
+    m_uFrameCount++;
+    return m_aAccessUnit;
+}
+
+void CNullEncoder::EncodeFrameLoop(uint8_t * /*buffer*/, bool isReconfiguringBitrate, int /*index*/, int targetBitrate)
+{
+    const std::vector<uint8_t> &aAccessUnit = EncodeNextAccessUnit();
+    if (m_pOutput)
+    {
+        m_pOutput->WriteAccessUnit(&aAccessUnit[0], aAccessUnit.size());
+    }
+
+    if (isReconfiguringBitrate)
+    {
+        m_iBitrate = targetBitrate;
+    }
+}
+
+// The picture is never read, so a tile is encoded like a whole frame.
+void CNullEncoder::EncodeView(const YuvI420View & /*view*/, bool isReconfiguringBitrate, int index, int targetBitrate)
+{
+    EncodeFrameLoop(NULL, isReconfiguringBitrate, index, targetBitrate);
+}
+
+bool CNullEncoder::SkipFrame(int /*index*/)
+{
+    return !m_pOutput || !m_pOutput->IsKeyframeRequested();
+}
+
+void CNullEncoder::Shutdown()
+{
+    if (m_pOutput)
+    {
+        CloseBitstreamOutput(m_pOutput);
+        m_pOutput = NULL;
+    }
+}
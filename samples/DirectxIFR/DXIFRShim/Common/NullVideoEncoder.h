@@ -0,0 +1,61 @@
+/*!
+ * \brief
+ * Encoder backend that produces a synthetic H.264 stream
+ *
+ * \file
+ *
+ * CNullEncoder ignores the frame content and writes a valid, decodable
+ * Annex-B stream: SPS, PPS and a flat grey IDR first, then P frames made of
+ * skipped macroblocks, with another IDR whenever the output asks for a
+ * keyframe. Each access unit is padded with a filler-data NAL to
+ * the size the bitrate gives (or to a fixed size), so everything downstream of
+ * the encoder sees realistic traffic without a GPU and at almost no CPU cost.
+ */
+
+#pragma once
+
+#include "VideoEncoder.h"
+
+#include <vector>
+
+class BitstreamOutput;
+
+// The IDR frame is this many times larger than a P frame.
+#define NULL_ENCODER_IDR_SIZE_FACTOR 4
+
+class CNullEncoder : public IVideoEncoder
+{
+public:
+    // uFrameBytes != 0 pads every P frame to that size instead of bitrate / fps.
+    explicit CNullEncoder(uint32_t uFrameBytes = 0);
+    virtual ~CNullEncoder();
+
+    virtual int  EncodeMain(int index, int width, int height, int fps, int initialBitrate,
+                            uint8_t **ppCaptureBuffers = NULL, int nCaptureBuffers = 0);
+    virtual void EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, int index, int targetBitrate);
+    virtual void EncodeView(const YuvI420View &view, bool isReconfiguringBitrate, int index, int targetBitrate);
+    virtual bool SkipFrame(int index);
+    virtual void Shutdown();
+
+    // Builds the access unit of the next frame into m_aAccessUnit without
+    // writing it anywhere. Exposed for benchmarks.
+    const std::vector<uint8_t>& EncodeNextAccessUnit();
+
+    uint32_t GetFrameCount() const { return m_uFrameCount; }
+
+private:
+    uint32_t GetTargetBytes(bool bIdr) const;
+
+    BitstreamOutput      *m_pOutput;
+    uint32_t              m_uFixedFrameBytes;
+    uint32_t              m_uWidthInMbs;
+    uint32_t              m_uHeightInMbs;
+    uint32_t              m_uCropRight;
+    uint32_t              m_uCropBottom;
+    int                   m_iFps;
+    int                   m_iBitrate;
+    uint32_t              m_uFrameCount;
+    uint32_t              m_uFrameNum;
+    uint32_t              m_uIdrPicId;
+    std::vector<uint8_t>  m_aAccessUnit;
+};
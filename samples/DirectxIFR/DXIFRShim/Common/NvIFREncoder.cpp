@@ -29,9 +29,19 @@
 #include "NvIFREncoder.h"
 #include <thread>
 #include <atomic>
-#include <ctime>
 
-#include "../DXGI/NvEncoder.h"
+#include "VideoEncoder.h"
+#include "PlayerActivity.h"
+#include "BandwidthAllocator.h"
+#include "FramePacer.h"
+#include "TileHash.h"
+#include "FrameTrace.h"
+#include "HttpStreamServer.h"
+#include "BitstreamOutput.h"
+#include "Metrics.h"
+#include "WorkerPool.h"
+#include "SimulcastStage.h"
+#include <vector>
 
 #pragma comment(lib, "winmm.lib")
 
@@ -39,22 +49,15 @@ extern simplelogger::Logger *logger;
 
 // Nvidia GRID capture variables
 #define NUMFRAMESINFLIGHT 1 // Limit is 3? Putting 4 causes an invalid parameter error to be thrown.
-#define MAX_PLAYERS 4
-HANDLE gpuEvent[MAX_PLAYERS];
-uint8_t *bufferArray[MAX_PLAYERS];
 
 // Streaming constants
 #define STREAM_FRAME_RATE 30 // Number of images per second
 
-// Input and Output video size
-int bufferWidth;
-int bufferHeight;
-
-// Bit rate switching variables
-const int bandwidthPerPlayer = 2000000;
-int totalBandwidthAvailable = 0;
-int sumWeight = 0;
-int playerInputArray[MAX_PLAYERS] = { 0 };
+// Unchanged frames skipped in a row before one is encoded anyway, so the
+// stream never goes quiet for long and a change the tile hashes missed heals.
+#define STATIC_FRAME_MAX_SKIP STREAM_FRAME_RATE
+// Set to 0 to encode every frame.
+#define STATIC_FRAME_SKIP_ENV "DXIFRSHIM_SKIP_STATIC"
 
 // Function to use to measure time elapsed
 LONGLONG g_llBegin1 = 0;
@@ -78,11 +81,132 @@ double GetFloatingDate1()
     return(((double)(llNow - g_llBegin1) / (double)g_llPerfFrequency1));
 }
 
+// Serves the trace at /trace of the HTTP stream server.
+static void MakeTraceDocument(void *, std::string *pBody)
+{
+    FrameTraceWriteChromeJson(pBody);
+}
+
+// Serves the metrics of every player at /metrics of the HTTP stream server.
+static void MakeMetricsDocument(void *, std::string *pBody)
+{
+    MetricsRegistry::GetShared()->WritePrometheus(pBody);
+}
+
+static bool IsEnvSet(const char *szName)
+{
+    const char *szValue = getenv(szName);
+    return szValue && *szValue;
+}
+
+// Sleeps for the frame pacer unless the encoder is stopped first.
+static bool WaitForStop(void *pContext, uint32_t uMs)
+{
+    return WaitForSingleObject((HANDLE)pContext, uMs) == WAIT_TIMEOUT;
+}
+
+// One player on the captured frame: the whole of it, or its tile of a split
+// screen. Each has an encoder, a bitrate and metrics of its own.
+struct ScreenPlayer
+{
+    int                 index;
+    YuvI420View         view;
+    IVideoEncoder      *pEncoder;
+    int                 currentBitrate;
+    bool                bReconfigure;
+    bool                bEncode;            // this frame
+    int                 nStaticFrames;
+    uint64_t            nSkippedFrames;
+    uint64_t            nPacerDropped;
+    SimulcastStage     *pSimulcast;         // NULL without lower renditions
+
+    MetricCounter      *pCapturedMetric;
+    MetricCounter      *pEncodedMetric;
+    MetricCounter      *pSkippedMetric;
+    MetricGauge        *pBitrateMetric;
+    MetricHistogram    *pEncodeMetric;
+    MetricCounter      *pCaptureDroppedMetric;
+    MetricCounter      *pPacerDroppedMetric;
+};
+
+// Looking the metrics up takes the registry's lock; updating them in the
+// loop does not.
+static void GetPlayerMetrics(ScreenPlayer *pPlayer)
+{
+    MetricsRegistry *pMetrics = MetricsRegistry::GetShared();
+    char szLabels[64];
+    sprintf(szLabels, "player=\"%d\"", pPlayer->index);
+    pPlayer->pCapturedMetric = pMetrics->GetCounter("dxifrshim_frames_captured_total",
+        "Frames read back from the render target.", szLabels);
+    pPlayer->pEncodedMetric = pMetrics->GetCounter("dxifrshim_frames_encoded_total",
+        "Frames handed to the encoder.", szLabels);
+    pPlayer->pSkippedMetric = pMetrics->GetCounter("dxifrshim_frames_skipped_total",
+        "Captured frames not encoded because nothing changed.", szLabels);
+    pPlayer->pBitrateMetric = pMetrics->GetGauge("dxifrshim_target_bitrate_bps",
+        "Bitrate the encoder is asked for.", szLabels);
+    pPlayer->pEncodeMetric = pMetrics->GetHistogram("dxifrshim_encode_seconds",
+        "Time the encoder thread takes to hand a frame to the encoder.", szLabels);
+    static const char s_szDroppedHelp[] = "Frames lost because the capture failed, or deadlines skipped because the loop fell behind.";
+    sprintf(szLabels, "player=\"%d\",reason=\"capture\"", pPlayer->index);
+    pPlayer->pCaptureDroppedMetric = pMetrics->GetCounter("dxifrshim_frames_dropped_total", s_szDroppedHelp, szLabels);
+    sprintf(szLabels, "player=\"%d\",reason=\"pacer\"", pPlayer->index);
+    pPlayer->pPacerDroppedMetric = pMetrics->GetCounter("dxifrshim_frames_dropped_total", s_szDroppedHelp, szLabels);
+}
+
+// Encodes the tiles of a split screen that changed, one task per tile. Each
+// encoder converts only its own tile into its input surface.
+struct TileEncodeJob
+{
+    ScreenPlayer   *aPlayers;
+    uint32_t        uFrame;
+
+    void operator()(int i)
+    {
+        ScreenPlayer &player = aPlayers[i];
+        if (!player.bEncode)
+            return;
+
+        FRAME_TRACE_FRAME(uFrame);
+        FRAME_TRACE_SCOPE("Encode");
+        uint64_t uEncodeStartNs = FramePacer::NowNs();
+        player.pEncoder->EncodeView(player.view, player.bReconfigure, player.index, player.currentBitrate);
+        player.pEncodeMetric->Record((FramePacer::NowNs() - uEncodeStartNs) / 1000);
+        player.pEncodedMetric->Add();
+    }
+};
+
 BOOL NvIFREncoder::StartEncoder(int index, int windowWidth, int windowHeight)
 {
+    // Tracing records from the first player on; the trace can be fetched at
+    // any time while streaming over HTTP, and is written out when a player
+    // stops.
+    szTracePath = FrameTraceEnableFromEnv();
+    if (szTracePath && getenv(HTTP_STREAM_PORT_ENV))
+    {
+        HttpStreamServer::GetShared()->AddDocument("/trace", "application/json", MakeTraceDocument, NULL);
+    }
+
+    // Metrics are served wherever the streams are, and written to a file
+    // every few seconds if DXIFRSHIM_METRICS_FILE says where.
+    if (IsEnvSet(HTTP_STREAM_PORT_ENV) || !(IsEnvSet(BITSTREAM_OUTPUT_ENV) || IsEnvSet(BITSTREAM_RTP_ENV)))
+    {
+        HttpStreamServer::GetShared()->AddDocument("/metrics", METRICS_PROMETHEUS_CONTENT_TYPE, MakeMetricsDocument, NULL);
+    }
+    MetricsRegistry::GetShared()->StartSnapshotFileFromEnv();
+
     bufferWidth = windowWidth;
     bufferHeight = windowHeight;
 
+    // A split screen is cut up here rather than by the players' encoders;
+    // a layout that does not fit the frame streams the whole frame instead.
+    nPlayers = 1;
+    if (pAppParam && pAppParam->numPlayers > 1 &&
+        tiler.Init(bufferWidth, bufferHeight, pAppParam->rows, pAppParam->cols,
+                   pAppParam->splitWidth, pAppParam->splitHeight, pAppParam->numPlayers))
+    {
+        nPlayers = tiler.GetTileCount();
+    }
+
     hevtStopEncoder = CreateEvent(NULL, TRUE, FALSE, NULL);
     if (!hevtStopEncoder) {
         LOG_ERROR(logger, "Failed to create hevtStopEncoder");
@@ -98,7 +222,6 @@ BOOL NvIFREncoder::StartEncoder(int index, int windowWidth, int windowHeight)
     bInitEncoderSuccessful = FALSE;
 
     indexToUse = index;
-    totalBandwidthAvailable += bandwidthPerPlayer;
     hthEncoder = (HANDLE)_beginthread(EncoderThreadStartProc, 0, this);
 
     if (!hthEncoder) {
@@ -109,6 +232,11 @@ BOOL NvIFREncoder::StartEncoder(int index, int windowWidth, int windowHeight)
     CloseHandle(hevtInitEncoderDone);
     hevtInitEncoderDone = NULL;
 
+    if (bInitEncoderSuccessful) {
+        for (int i = 0; i < nPlayers; i++) {
+            BandwidthAllocator::GetShared()->AddPlayer(index + i);
+        }
+    }
     return bInitEncoderSuccessful;
 }
 
@@ -118,11 +246,19 @@ void NvIFREncoder::StopEncoder()
         return;
     }
 
+    for (int i = 0; i < nPlayers; i++) {
+        BandwidthAllocator::GetShared()->RemovePlayer(indexToUse + i);
+    }
     bStopEncoder = TRUE;
     SetEvent(hevtStopEncoder);
     WaitForSingleObject(hthEncoder, INFINITE);
     CloseHandle(hevtStopEncoder);
     hevtStopEncoder = NULL;
+
+    if (szTracePath)
+    {
+        FrameTraceExport(szTracePath);
+    }
 }
 
 void NvIFREncoder::EncoderThreadProc(int index)
@@ -145,8 +281,8 @@ void NvIFREncoder::EncoderThreadProc(int index)
     params.eFormat = NVIFR_FORMAT_YUV_420;
     params.eSysStereoFormat = NVIFR_SYS_STEREO_NONE;
     params.dwNBuffers = NUMFRAMESINFLIGHT;
-    params.ppPageLockedSysmemBuffers = &bufferArray[index];
-    params.ppTransferCompletionEvents = &gpuEvent[index];
+    params.ppPageLockedSysmemBuffers = &pSysmemBuffer;
+    params.ppTransferCompletionEvents = &gpuEvent;
 
     NVIFRRESULT nr = pIFR->NvIFRSetUpTargetBufferToSys(&params);
 
@@ -162,91 +298,141 @@ void NvIFREncoder::EncoderThreadProc(int index)
     SetEvent(hevtInitEncoderDone);
 
     // Initialization of Nvidia Codec SDK parameters
-    int currentBitrate = 2500000;
-    int targetBitrate = currentBitrate;
-
-    // To sleep if encoding is going faster than framerate of the game
-    UINT uFrameCount = 0;
-    DWORD dwTimeZero = timeGetTime();
-
-    char c = '0';
-    int timeBeforeIdle = 3;
-    bool isIdling = false;
-    time_t shootingStartTime = std::time(0);
-    time_t idleStartTime = 0;
-
-    // To read the player input data for adaptive bitrate
-    TCHAR szPath[MAX_PATH];
-    GetCurrentDirectory(MAX_PATH, szPath);
-    ostringstream oss;
-    oss << szPath << "\\test" << index << ".txt";    
-    ifstream fin;
-
-    // Setup Nvidia Video Codec SDK
-    CNvEncoder nvEncoder(index);
-    nvEncoder.EncodeMain(index, bufferWidth, bufferHeight, STREAM_FRAME_RATE, currentBitrate);
+    // The bandwidth allocator sends the first target within a tick.
+    const int initialBitrate = 2500000;
+
+    // To sleep if encoding is going faster than framerate of the game. A
+    // frame that overran skips the deadlines it missed instead of bursting.
+    FramePacer pacer(STREAM_FRAME_RATE);
+
+    // To skip the frames where nothing changed, such as a paused game or a
+    // menu, and tell the encoder which tiles did change.
+    TileChangeDetector changeDetector;
+    changeDetector.Init(bufferWidth, bufferHeight);
+    const char *szSkipStatic = getenv(STATIC_FRAME_SKIP_ENV);
+    bool bSkipStatic = !szSkipStatic || strcmp(szSkipStatic, "0");
+
+    // To read the player input data for adaptive bitrate. The input daemon
+    // writes it into the launcher's shared memory, or into a mapping of its
+    // own when there is no launcher. Until it writes a player's slot, the
+    // player's legacy activity file is reported into a slot of our own.
+    PlayerActivityTable *pActivityTable = pAppParam ? &pAppParam->activity : NULL;
+    PlayerActivityMapping activityMapping;
+    const char *szActivityShm = getenv(PLAYER_ACTIVITY_SHM_ENV);
+    if (szActivityShm && *szActivityShm && activityMapping.Open(szActivityShm))
+    {
+        pActivityTable = activityMapping.GetTable();
+    }
+    bool bActivity = index + nPlayers <= PLAYER_ACTIVITY_MAX_PLAYERS;
+    if (!bActivity)
+    {
+        LOG_WARN(logger, "No player activity for player " << index);
+        pActivityTable = NULL;
+    }
+    else if (!pActivityTable)
+    {
+        LOG_INFO(logger, "Player activity for player " << index << " from " << PLAYER_ACTIVITY_LEGACY_FILE << " files only");
+    }
+    PlayerActivitySlot aLegacyActivity[PLAYER_ACTIVITY_MAX_PLAYERS];
+    memset((void *)aLegacyActivity, 0, sizeof(aLegacyActivity));
+    uint64_t auLegacyPollUs[PLAYER_ACTIVITY_MAX_PLAYERS] = {};
+    char aszLegacyFile[PLAYER_ACTIVITY_MAX_PLAYERS][32];
+    for (int i = 0; i < nPlayers && bActivity; i++)
+    {
+        sprintf(aszLegacyFile[i], PLAYER_ACTIVITY_LEGACY_FILE, index + i);
+    }
 
-    while (!bStopEncoder)
+    // Setup the encoder backend (NVENC unless DXIFRSHIM_ENCODER says otherwise)
+    // of every player. Only a player that has the whole frame can encode
+    // straight from the capture buffer.
+    VideoEncoderBackend eBackend = GetVideoEncoderBackend();
+    const char *szSimulcast = getenv(SIMULCAST_ENV);
+    ScaleFilter eScaleFilter = SimulcastGetFilter();
+    std::vector<ScreenPlayer> aPlayers(nPlayers);
+    for (int i = 0; i < nPlayers; i++)
     {
-        fin.open(oss.str());
-        if (fin.is_open())
+        ScreenPlayer &player = aPlayers[i];
+        memset(&player, 0, sizeof(player));
+        player.index = index + i;
+        player.pEncoder = CreateVideoEncoder(eBackend, player.index);
+        if (!player.pEncoder)
         {
-            // Always read the value at the end of the file
-            fin.seekg(-3, ios::end); // -1 and -2 gets \n on the last line
-            fin.get(c);
-            fin.close();
-        
-            // If we shoot, we should refresh the shooting start time
-            if (c == '3')
-            {
-                shootingStartTime = std::time(0);
-            }
-        
-            // We cannot let any other movement e.g. "c = 2" through if we have recently shot
-            if ((std::time(0) - shootingStartTime) < timeBeforeIdle)
-            {
-                c = '3';
-            }
-            // No input from player - is idling
-            else if (c == '1')
-            {
-                if (isIdling == false)
-                {
-                    // Start the countdown
-                    idleStartTime = std::time(0);
-                    isIdling = true;
-                }
-                // We have idled for more than 3 seconds
-                else if ((std::time(0) - idleStartTime) >= timeBeforeIdle)
-                {
-                    c = '1';
-                }
-            }
-            // If there is input, allow countdown to restart
-            else if (c == '3' || c == '2')
+            LOG_ERROR(logger, "Encoder backend " << GetVideoEncoderBackendName(eBackend) << " is not built in.");
+            for (int j = 0; j < i; j++)
             {
-                isIdling = false; // There is input. 
+                delete aPlayers[j].pSimulcast;
+                delete aPlayers[j].pEncoder;
             }
-        
-            playerInputArray[index] = (c - '0');
+            CleanupNvIFR();
+            return;
+        }
+        player.currentBitrate = initialBitrate;
+        if (nPlayers == 1)
+        {
+            player.pEncoder->EncodeMain(player.index, bufferWidth, bufferHeight, STREAM_FRAME_RATE, initialBitrate, &pSysmemBuffer, NUMFRAMESINFLIGHT);
+            player.view = YuvFrameView(pSysmemBuffer, bufferWidth, bufferHeight);
         }
         else
         {
-            LOG_ERROR(logger, "Failed to open file " << index);
+            const FrameTile &tile = tiler.GetTile(i);
+            player.pEncoder->EncodeMain(player.index, tile.width, tile.height, STREAM_FRAME_RATE, initialBitrate);
+            player.view = tiler.GetTileView(pSysmemBuffer, i);
         }
-        
-        // Index 0 will do the summing of the array.
-        // This will pose problems in the future if player 0 can 
-        // just leave while the other players are playing.
-        if (index == 0)
+        GetPlayerMetrics(&player);
+        player.pBitrateMetric->Set(initialBitrate);
+
+        // Lower renditions of the player's picture, each scaled and encoded
+        // on a thread of its own; a ladder that does not fit the picture
+        // leaves the player with its own stream only.
+        SimulcastRendition aRenditions[SIMULCAST_MAX_RENDITIONS];
+        int nRenditions = SimulcastParseLadder(szSimulcast, player.view.width, player.view.height, aRenditions);
+        if (nRenditions)
         {
-            sumWeight = 0;
-            for (int i = 0; i < MAX_PLAYERS; i++)
+            player.pSimulcast = new SimulcastStage;
+            if (!player.pSimulcast->Start(player.index, player.view.width, player.view.height, aRenditions, nRenditions,
+                                          eScaleFilter, eBackend, STREAM_FRAME_RATE, initialBitrate))
             {
-                sumWeight += playerInputArray[i];
+                LOG_WARN(logger, "Player " << player.index << " streams without its " << nRenditions << " lower renditions");
+                delete player.pSimulcast;
+                player.pSimulcast = NULL;
             }
         }
+    }
+    if (nPlayers > 1)
+    {
+        LOG_INFO(logger, "Players " << index << " to " << index + nPlayers - 1 << " share a "
+            << pAppParam->rows << "x" << pAppParam->cols << " split screen");
+    }
+
+    char szThreadName[32];
+    sprintf(szThreadName, "Encoder %d", index);
+    FRAME_TRACE_THREAD_NAME(szThreadName);
+    uint32_t uFrame = 0;
+    FramePacerStats pacerStats;
 
+    pacer.Reset();
+    while (!bStopEncoder)
+    {
+        uFrame++;
+        FRAME_TRACE_FRAME(uFrame);
+
+        // A torn or missing read keeps the previous value.
+        for (int i = 0; i < nPlayers && bActivity; i++)
+        {
+            const PlayerActivitySlot *pSlot = pActivityTable ? &pActivityTable->aSlots[index + i] : NULL;
+            if (!pSlot || !pSlot->uSequence.load(std::memory_order_acquire))
+            {
+                PlayerActivityPollLegacyFile(aszLegacyFile[i], &aLegacyActivity[i], &auLegacyPollUs[i], PlayerActivityNowUs());
+                pSlot = &aLegacyActivity[i];
+            }
+            PlayerActivitySnapshot activity;
+            if (PlayerActivityRead(pSlot, &activity))
+            {
+                BandwidthAllocator::GetShared()->ReportActivity(index + i, PlayerActivityEffectiveState(activity, PlayerActivityNowUs()));
+            }
+        }
+
+        FRAME_TRACE_BEGIN_EVENT("Capture");
         if (!UpdateBackBuffer())
         {
             LOG_DEBUG(logger, "UpdateBackBuffer() failed");
@@ -256,8 +442,8 @@ void NvIFREncoder::EncoderThreadProc(int index)
 
         if (res == NVIFR_SUCCESS)
         {
-            HANDLE ahevt[] = { gpuEvent[index], hevtStopEncoder };
-            //DWORD dwRet = WaitForSingleObject(gpuEvent[index], INFINITE);
+            HANDLE ahevt[] = { gpuEvent, hevtStopEncoder };
+            //DWORD dwRet = WaitForSingleObject(gpuEvent, INFINITE);
             DWORD dwRet = WaitForMultipleObjects(sizeof(ahevt) / sizeof(ahevt[0]), ahevt, FALSE, INFINITE);
             if (dwRet != WAIT_OBJECT_0)// If not signalled
             {
@@ -265,50 +451,130 @@ void NvIFREncoder::EncoderThreadProc(int index)
                 {
                     LOG_WARN(logger, "Abnormally break from encoding loop, dwRet=" << dwRet);
                 }
+                for (int i = 0; i < nPlayers; i++)
+                {
+                    delete aPlayers[i].pSimulcast;
+                    delete aPlayers[i].pEncoder;
+                }
                 return;
             }
-            ResetEvent(gpuEvent[index]);
-
-            // Adaptive bitrate - independent of other players
-            //if (playerInputArray[index] == 3) { // shooting
-            //    targetBitrate = 5000000;
-            //}
-            //else if (playerInputArray[index] == 2) { // mouse movement or any other keyboard key
-            //    targetBitrate = 2500000;
-            //}
-            //else if (playerInputArray[index] == 1) { // no input
-            //    targetBitrate = 500000;
-            //}
-
-            // Adaptive bitrate - depends on other players
-            float weight = (float)playerInputArray[index] / (float)sumWeight;
-            targetBitrate = (int)(weight * totalBandwidthAvailable);
-            
-            if (targetBitrate != currentBitrate)
+            ResetEvent(gpuEvent);
+            FRAME_TRACE_END_EVENT("Capture");
+
+            uint8_t *pY = pSysmemBuffer;
+            FRAME_TRACE_BEGIN_EVENT("TileHash");
+            int nDirtyTiles = changeDetector.Update(pY, pY + bufferWidth * bufferHeight, pY + bufferWidth * bufferHeight * 5 / 4,
+                                                    bufferWidth, bufferWidth / 2);
+            FRAME_TRACE_END_EVENT("TileHash");
+
+            int nEncode = 0;
+            for (int i = 0; i < nPlayers; i++)
+            {
+                ScreenPlayer &player = aPlayers[i];
+                player.pCapturedMetric->Add();
+
+                // Adaptive bitrate - the allocator splits the bandwidth between
+                // the players and rate-limits the reconfigurations.
+                uint32_t uTargetBitrate;
+                player.bReconfigure = BandwidthAllocator::GetShared()->TakeTarget(player.index, &uTargetBitrate);
+                if (player.bReconfigure)
+                {
+                    player.currentBitrate = (int)uTargetBitrate;
+                    player.pBitrateMetric->Set(player.currentBitrate);
+                }
+
+                // An unchanged frame is neither converted nor encoded; the output
+                // timestamps come from the clock, so the stream just runs at a
+                // lower frame rate for a while. A tile counts as unchanged when
+                // none of the hash tiles it overlaps changed.
+                int nPlayerDirtyTiles = nPlayers == 1 ? nDirtyTiles : tiler.CountChangedHashTiles(i, changeDetector);
+                player.bEncode = !(bSkipStatic && !nPlayerDirtyTiles && !player.bReconfigure &&
+                                   player.nStaticFrames < STATIC_FRAME_MAX_SKIP && player.pEncoder->SkipFrame(player.index));
+                if (!player.bEncode)
+                {
+                    FRAME_TRACE_INSTANT_EVENT("Skip");
+                    player.nStaticFrames++;
+                    player.nSkippedFrames++;
+                    player.pSkippedMetric->Add();
+                }
+                else
+                {
+                    player.nStaticFrames = 0;
+                    nEncode++;
+                }
+            }
+
+            if (nPlayers == 1 && nEncode)
             {
-                nvEncoder.EncodeFrameLoop(bufferArray[index], true, index, targetBitrate);
-                currentBitrate = targetBitrate;
+                ScreenPlayer &player = aPlayers[0];
+                FRAME_TRACE_SCOPE("Encode");
+                player.pEncoder->SetChangedTiles(changeDetector.GetDirtyMask(), changeDetector.GetTilesX(), changeDetector.GetTilesY());
+                uint64_t uEncodeStartNs = FramePacer::NowNs();
+                player.pEncoder->EncodeFrameLoop(pSysmemBuffer, player.bReconfigure, player.index, player.currentBitrate);
+                player.pEncodeMetric->Record((FramePacer::NowNs() - uEncodeStartNs) / 1000);
+                player.pEncodedMetric->Add();
             }
-            else
+            else if (nEncode)
             {
-                nvEncoder.EncodeFrameLoop(bufferArray[index], false, index, targetBitrate);
+                // The tiles are encoded side by side; the capture buffer is
+                // not touched again until they are all done.
+                TileEncodeJob job = { &aPlayers[0], uFrame };
+                WorkerPool::GetShared()->ParallelFor(nPlayers, job);
             }
-            //write_video_frame(ocArray[index], /*&ostArray[index], */bufferArray[index], index);
+
+            // The renditions get the frame once the players' own encoders
+            // are done with it, and scale it while the next one is captured.
+            for (int i = 0; i < nPlayers; i++)
+            {
+                ScreenPlayer &player = aPlayers[i];
+                if (player.bEncode && player.pSimulcast)
+                {
+                    FRAME_TRACE_SCOPE("Simulcast");
+                    player.pSimulcast->Submit(player.view, player.currentBitrate, uFrame);
+                }
+            }
+            //write_video_frame(ocArray[index], /*&ostArray[index], */pSysmemBuffer, index);
         }
         else
         {
+            FRAME_TRACE_END_EVENT("Capture");
             LOG_ERROR(logger, "NvIFRTransferRenderTargetToSys failed, res=" << res);
+            for (int i = 0; i < nPlayers; i++)
+            {
+                aPlayers[i].pCaptureDroppedMetric->Add();
+            }
         }
 
         // This sleeps the thread if we are producing frames faster than the desired framerate
-        int delta = (int)((dwTimeZero + ++uFrameCount * 1000 / STREAM_FRAME_RATE) - timeGetTime());
-        if (delta > 0) {
-            WaitForSingleObject(hevtStopEncoder, delta);
+        FRAME_TRACE_BEGIN_EVENT("Pace");
+        pacer.Wait(WaitForStop, hevtStopEncoder);
+        FRAME_TRACE_END_EVENT("Pace");
+        pacer.GetStats(&pacerStats);
+        for (int i = 0; i < nPlayers; i++)
+        {
+            aPlayers[i].pPacerDroppedMetric->Add(pacerStats.nDropped - aPlayers[i].nPacerDropped);
+            aPlayers[i].nPacerDropped = pacerStats.nDropped;
         }
     }
     LOG_DEBUG(logger, "Quit encoding loop");
 
-    nvEncoder.ShutdownNvEncoder();
+    pacer.GetStats(&pacerStats);
+    LOG_INFO(logger, "Player " << index << " pacing: " << pacerStats.nFrames << " frames, " << pacerStats.nOverruns
+        << " overruns, " << pacerStats.nDropped << " dropped, lateness mean " << pacerStats.fMeanLatenessUs
+        << " us max " << pacerStats.uMaxLatenessNs / 1000 << " us, interval jitter " << pacerStats.fIntervalJitterUs << " us");
+    for (int i = 0; i < nPlayers; i++)
+    {
+        ScreenPlayer &player = aPlayers[i];
+        LOG_INFO(logger, "Player " << player.index << " skipped " << player.nSkippedFrames << " unchanged frames");
+        if (player.pSimulcast)
+        {
+            LOG_INFO(logger, "Player " << player.index << " renditions skipped " << player.pSimulcast->GetSkippedFrames()
+                << " frames still scaling the last one");
+            delete player.pSimulcast;
+        }
+        player.pEncoder->Shutdown();
+        delete player.pEncoder;
+    }
     CleanupNvIFR();
 }
 
@@ -28,6 +28,7 @@
 #include <d3d10_1.h>
 #include <d3d11.h>
 #include <windows.h>
+#include <stdint.h>
 #include <NvIFR/NvIFR.h>
 #include <NvIFR/NvIFRToSys.h>
 #include <NvIFRLibrary.h>
@@ -35,6 +36,7 @@
 #include "AppParam.h"
 #include "GridAdapter.h"
 #include "Streamer.h"
+#include "FrameTiler.h"
 
 class NvIFREncoder {
 public:
@@ -48,6 +50,8 @@ public:
 		bStopEncoder(TRUE), pIFR(NULL), hSharedTexture(NULL),
 		szClassName("NvIFREncoder"),
 		pBitStreamBuffer(NULL),
+		gpuEvent(NULL), pSysmemBuffer(NULL), bufferWidth(0), bufferHeight(0),
+		szTracePath(NULL), nPlayers(1),
 		bInitEncoderSuccessful(FALSE), hevtInitEncoderDone(NULL), hthEncoder(NULL), hevtStopEncoder(NULL)
 	{}
 	virtual ~NvIFREncoder() 
@@ -185,9 +189,20 @@ private:
 	const void *pPresenter;
 
 	int indexToUse;
+
+	// What NvIFR transfers this player's frames to, and the event it sets
+	// when a transfer is done.
+	HANDLE gpuEvent;
+	uint8_t *pSysmemBuffer;
+	int bufferWidth, bufferHeight;
+
+	// Where the trace goes when the encoder stops, if tracing is on.
+	const char *szTracePath;
 	
-	std::vector<FILE*> PipeList;
-	HANDLE FFMPEGThread;
+	// Players sharing the captured frame, from indexToUse on. More than one
+	// when the launcher asks for a split screen; each then encodes its tile.
+	FrameTiler tiler;
+	int nPlayers;
 
 	BYTE *pBitStreamBuffer;
 
@@ -0,0 +1,216 @@
+/*!
+ * \brief
+ * Player activity shared between the input daemon and the encoders
+ *
+ * \file
+ *
+ * See PlayerActivity.h.
+ */
+
+#include "PlayerActivity.h"
+#include "Logger.h"
+
+#include <stdio.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+extern simplelogger::Logger *logger;
+
+uint64_t PlayerActivityNowUs()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void PlayerActivityReport(PlayerActivitySlot *pSlot, PlayerActivityState eState, uint64_t uNowUs)
+{
+    uint32_t uSequence = pSlot->uSequence.load(std::memory_order_relaxed);
+    pSlot->uSequence.store(uSequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    pSlot->uState.store(eState, std::memory_order_relaxed);
+    pSlot->uUpdateUs.store(uNowUs, std::memory_order_relaxed);
+    if (eState >= PLAYER_ACTIVITY_INPUT)
+        pSlot->uLastInputUs.store(uNowUs, std::memory_order_relaxed);
+    if (eState == PLAYER_ACTIVITY_SHOOTING)
+        pSlot->uLastShotUs.store(uNowUs, std::memory_order_relaxed);
+
+    pSlot->uSequence.store(uSequence + 2, std::memory_order_release);
+}
+
+bool PlayerActivityRead(const PlayerActivitySlot *pSlot, PlayerActivitySnapshot *pSnapshot)
+{
+    for (int i = 0; i < PLAYER_ACTIVITY_READ_ATTEMPTS; i++)
+    {
+        uint32_t uSequence = pSlot->uSequence.load(std::memory_order_acquire);
+        if (uSequence & 1)
+            continue;
+
+        pSnapshot->eState = (PlayerActivityState)pSlot->uState.load(std::memory_order_relaxed);
+        pSnapshot->uUpdateUs = pSlot->uUpdateUs.load(std::memory_order_relaxed);
+        pSnapshot->uLastInputUs = pSlot->uLastInputUs.load(std::memory_order_relaxed);
+        pSnapshot->uLastShotUs = pSlot->uLastShotUs.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (pSlot->uSequence.load(std::memory_order_relaxed) == uSequence)
+        {
+            pSnapshot->uSequence = uSequence;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PlayerActivityReadLegacyFile(const char *szPath, PlayerActivityState *peState)
+{
+    FILE *fp = fopen(szPath, "rb");
+    if (!fp)
+        return false;
+
+    // The last line and its line break fit in the tail.
+    char aTail[16];
+    size_t nTail = 0;
+    if (fseek(fp, -(long)sizeof(aTail), SEEK_END) != 0)
+        fseek(fp, 0, SEEK_SET);
+    nTail = fread(aTail, 1, sizeof(aTail), fp);
+    fclose(fp);
+
+    while (nTail && (aTail[nTail - 1] == '\n' || aTail[nTail - 1] == '\r' || aTail[nTail - 1] == ' '))
+    {
+        nTail--;
+    }
+    if (!nTail || aTail[nTail - 1] < '0' + PLAYER_ACTIVITY_IDLE || aTail[nTail - 1] > '0' + PLAYER_ACTIVITY_SHOOTING
+        || (nTail > 1 && aTail[nTail - 2] != '\n' && aTail[nTail - 2] != '\r'))
+    {
+        return false;
+    }
+    *peState = (PlayerActivityState)(aTail[nTail - 1] - '0');
+    return true;
+}
+
+bool PlayerActivityPollLegacyFile(const char *szPath, PlayerActivitySlot *pSlot, uint64_t *puNextPollUs, uint64_t uNowUs)
+{
+    if (uNowUs < *puNextPollUs)
+        return false;
+
+    *puNextPollUs = uNowUs + PLAYER_ACTIVITY_LEGACY_POLL_US;
+    PlayerActivityState eState;
+    if (PlayerActivityReadLegacyFile(szPath, &eState))
+        PlayerActivityReport(pSlot, eState, uNowUs);
+    return true;
+}
+
+PlayerActivityState PlayerActivityEffectiveState(const PlayerActivitySnapshot &snapshot, uint64_t uNowUs)
+{
+    if (snapshot.uLastShotUs && uNowUs - snapshot.uLastShotUs < PLAYER_ACTIVITY_SHOT_HOLD_US)
+        return PLAYER_ACTIVITY_SHOOTING;
+    return snapshot.eState;
+}
+
+PlayerActivityMapping::PlayerActivityMapping()
+{
+    m_pTable = NULL;
+    m_hMapping = NULL;
+    m_fd = -1;
+    m_bOwner = false;
+}
+
+PlayerActivityMapping::~PlayerActivityMapping()
+{
+    Close();
+}
+
+bool PlayerActivityMapping::Create(const char *szName)
+{
+    return Map(szName, true);
+}
+
+bool PlayerActivityMapping::Open(const char *szName)
+{
+    return Map(szName, false);
+}
+
+bool PlayerActivityMapping::Map(const char *szName, bool bCreate)
+{
+    Close();
+    size_t size = sizeof(PlayerActivityTable);
+#if defined(_WIN32)
+    m_name = szName;
+    if (bCreate)
+        m_hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, szName);
+    else
+        m_hMapping = OpenFileMappingA(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, szName);
+    if (!m_hMapping)
+    {
+        LOG_ERROR(logger, "PlayerActivityMapping: cannot " << (bCreate ? "create " : "open ") << szName);
+        return false;
+    }
+    m_pTable = (PlayerActivityTable *)MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+#else
+    // POSIX names start with a slash.
+    m_name = szName[0] == '/' ? szName : std::string("/") + szName;
+    m_fd = shm_open(m_name.c_str(), bCreate ? O_RDWR | O_CREAT : O_RDWR, 0600);
+    if (m_fd < 0)
+    {
+        LOG_ERROR(logger, "PlayerActivityMapping: cannot " << (bCreate ? "create " : "open ") << m_name);
+        return false;
+    }
+    m_bOwner = bCreate;
+
+    // Truncating first zeroes whatever a crashed owner left behind.
+    struct stat st;
+    if ((bCreate && (ftruncate(m_fd, 0) != 0 || ftruncate(m_fd, size) != 0))
+        || fstat(m_fd, &st) != 0 || (size_t)st.st_size < size)
+    {
+        LOG_ERROR(logger, "PlayerActivityMapping: " << m_name << " is too small");
+        Close();
+        return false;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    m_pTable = p == MAP_FAILED ? NULL : (PlayerActivityTable *)p;
+#endif
+    if (!m_pTable)
+    {
+        LOG_ERROR(logger, "PlayerActivityMapping: cannot map " << m_name);
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void PlayerActivityMapping::Close()
+{
+#if defined(_WIN32)
+    if (m_pTable)
+        UnmapViewOfFile(m_pTable);
+    if (m_hMapping)
+        CloseHandle(m_hMapping);
+#else
+    if (m_pTable)
+        munmap(m_pTable, sizeof(PlayerActivityTable));
+    if (m_fd >= 0)
+        close(m_fd);
+    if (m_bOwner)
+        shm_unlink(m_name.c_str());
+#endif
+    m_pTable = NULL;
+    m_hMapping = NULL;
+    m_fd = -1;
+    m_bOwner = false;
+}
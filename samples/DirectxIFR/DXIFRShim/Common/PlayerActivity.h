@@ -0,0 +1,146 @@
+/*!
+ * \brief
+ * Player activity shared between the input daemon and the encoders
+ *
+ * \file
+ *
+ * The input daemon reports what each player is doing (idle, giving input,
+ * shooting) and the encoder threads read it once per frame to weight the
+ * bitrate. Each player has a slot of its own, written by one process and read
+ * under a sequence lock: the writer makes the sequence odd, updates the
+ * fields and makes it even again; a reader retries if the sequence was odd
+ * or changed while it read. Neither side makes a system call or takes a
+ * lock, and a reader never sees half an update.
+ *
+ * The table lives at the end of AppParam, in the launcher's shared memory,
+ * whose name is in the GRID_AppParam_MemName environment variable. Without
+ * the launcher, PlayerActivityMapping creates or opens a named mapping of
+ * its own (POSIX shared memory, or a file mapping on Windows); the encoders
+ * use it if DXIFRSHIM_ACTIVITY_SHM names one.
+ *
+ * Until the input daemon writes a player's slot, the encoders fall back to
+ * the file the old input logger appends a "1", "2" or "3" line to per
+ * report, test<index>.txt in the current directory. They read it every
+ * PLAYER_ACTIVITY_LEGACY_POLL_US rather than every frame.
+ *
+ * Times are in microseconds of PlayerActivityNowUs, a monotonic clock that
+ * every process on the machine shares.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// As many as PLAYER_SESSION_MAX; a player of a higher index reports nothing.
+#define PLAYER_ACTIVITY_MAX_PLAYERS     16
+#define PLAYER_ACTIVITY_SHM_ENV         "DXIFRSHIM_ACTIVITY_SHM"
+#define PLAYER_ACTIVITY_LEGACY_FILE     "test%d.txt"
+
+// The bandwidth allocator's tick; reading the file more often changes
+// nothing.
+#define PLAYER_ACTIVITY_LEGACY_POLL_US  100000
+
+#define PLAYER_ACTIVITY_CACHE_LINE      64
+#if defined(_MSC_VER)
+#define PLAYER_ACTIVITY_ALIGNED         __declspec(align(PLAYER_ACTIVITY_CACHE_LINE))
+#else
+#define PLAYER_ACTIVITY_ALIGNED         __attribute__((aligned(PLAYER_ACTIVITY_CACHE_LINE)))
+#endif
+
+// A player counts as shooting for this long after the last shot.
+#define PLAYER_ACTIVITY_SHOT_HOLD_US    3000000
+
+// Reads give up after this many attempts, e.g. if the writer died mid-update.
+#define PLAYER_ACTIVITY_READ_ATTEMPTS   64
+
+// Also the bitrate weight of each state.
+enum PlayerActivityState
+{
+    PLAYER_ACTIVITY_NONE = 0,       // nothing reported yet
+    PLAYER_ACTIVITY_IDLE = 1,
+    PLAYER_ACTIVITY_INPUT = 2,      // mouse movement or keys other than fire
+    PLAYER_ACTIVITY_SHOOTING = 3,
+};
+
+// One cache line per player, so writers of different players do not share
+// lines: the slot is aligned to a line, and so is every struct it is in. The
+// shared memory it lives in is page aligned. All fields are atomic so that
+// the reads the sequence lock discards are not data races.
+struct PLAYER_ACTIVITY_ALIGNED PlayerActivitySlot
+{
+    std::atomic<uint32_t>   uSequence;      // odd while an update is in progress
+    std::atomic<uint32_t>   uState;         // PlayerActivityState
+    std::atomic<uint64_t>   uUpdateUs;      // time of the last report
+    std::atomic<uint64_t>   uLastInputUs;   // time of the last input or shooting report
+    std::atomic<uint64_t>   uLastShotUs;    // time of the last shooting report
+    uint8_t                 aPadding[32];
+};
+
+struct PlayerActivityTable
+{
+    PlayerActivitySlot      aSlots[PLAYER_ACTIVITY_MAX_PLAYERS];
+};
+
+// A consistent copy of a slot.
+struct PlayerActivitySnapshot
+{
+    uint32_t                uSequence;      // changes with every report; 0 if none yet
+    PlayerActivityState     eState;
+    uint64_t                uUpdateUs;
+    uint64_t                uLastInputUs;
+    uint64_t                uLastShotUs;
+};
+
+uint64_t PlayerActivityNowUs();
+
+// Records a state change or a repeat of the current state. Only one thread
+// of one process may write a given slot.
+void PlayerActivityReport(PlayerActivitySlot *pSlot, PlayerActivityState eState, uint64_t uNowUs);
+
+// Returns false if no consistent copy could be read.
+bool PlayerActivityRead(const PlayerActivitySlot *pSlot, PlayerActivitySnapshot *pSnapshot);
+
+// Reads the state from the last line of a legacy activity file. Returns
+// false if the file cannot be read or its last line is not a state.
+bool PlayerActivityReadLegacyFile(const char *szPath, PlayerActivityState *peState);
+
+// Reads a legacy activity file into pSlot if *puNextPollUs has passed, and
+// sets it to PLAYER_ACTIVITY_LEGACY_POLL_US later; 0 reads at once. Between
+// reads pSlot keeps the last state. Returns true if it read the file.
+bool PlayerActivityPollLegacyFile(const char *szPath, PlayerActivitySlot *pSlot, uint64_t *puNextPollUs, uint64_t uNowUs);
+
+// The state to weight the bitrate with: shooting while within the hold time
+// of the last shot, otherwise the reported state.
+PlayerActivityState PlayerActivityEffectiveState(const PlayerActivitySnapshot &snapshot, uint64_t uNowUs);
+
+// A PlayerActivityTable in named shared memory of its own.
+class PlayerActivityMapping
+{
+public:
+    PlayerActivityMapping();
+    ~PlayerActivityMapping();
+
+    // Creates the mapping, zeroed, and removes the name again on Close.
+    bool Create(const char *szName);
+
+    // Opens a mapping another process created.
+    bool Open(const char *szName);
+
+    void Close();
+
+    PlayerActivityTable *GetTable() { return m_pTable; }
+
+private:
+    bool Map(const char *szName, bool bCreate);
+
+    PlayerActivityTable    *m_pTable;
+    void                   *m_hMapping;     // Windows file mapping handle
+    int                     m_fd;           // POSIX shared memory descriptor
+    bool                    m_bOwner;
+    std::string             m_name;
+
+    PlayerActivityMapping(const PlayerActivityMapping &);
+    PlayerActivityMapping &operator=(const PlayerActivityMapping &);
+};
@@ -0,0 +1,229 @@
+/*!
+ * \brief
+ * Per-player state of the shim, looked up by swap chain
+ *
+ * \file
+ *
+ * See PlayerSession.h.
+ */
+
+#include "PlayerSession.h"
+#include "Logger.h"
+
+#include <stdlib.h>
+#include <new>
+
+extern simplelogger::Logger *logger;
+
+// Marks a table entry whose session was removed: Find probes past it, Acquire
+// fills it.
+static PlayerSession s_tombstone;
+#define TOMBSTONE (&s_tombstone)
+
+PlayerSessionRegistry::PlayerSessionRegistry(int nMaxSessions)
+{
+    m_nMaxSessions = nMaxSessions < 1 ? 1 : nMaxSessions > PLAYER_SESSION_LIMIT ? PLAYER_SESSION_LIMIT : nMaxSessions;
+
+    m_pStorage = new char[sizeof(PlayerSession) * m_nMaxSessions + PLAYER_SESSION_CACHE_LINE];
+    uintptr_t uAligned = ((uintptr_t)m_pStorage + PLAYER_SESSION_CACHE_LINE - 1) & ~(uintptr_t)(PLAYER_SESSION_CACHE_LINE - 1);
+    m_aSessions = (PlayerSession *)uAligned;
+    for (int i = 0; i < m_nMaxSessions; i++)
+    {
+        PlayerSession *p = new (&m_aSessions[i]) PlayerSession;
+        p->pKey.store(NULL, std::memory_order_relaxed);
+        p->index = i;
+        p->pEncoder = NULL;
+        p->nPresents.store(0, std::memory_order_relaxed);
+        p->nEncoderStarts.store(0, std::memory_order_relaxed);
+        p->nEncoderFailures.store(0, std::memory_order_relaxed);
+    }
+
+    uint32_t uTableSize = 1;
+    while (uTableSize < 2 * (uint32_t)m_nMaxSessions)
+    {
+        uTableSize *= 2;
+    }
+    m_apTable = new std::atomic<PlayerSession *>[uTableSize];
+    for (uint32_t i = 0; i < uTableSize; i++)
+    {
+        m_apTable[i].store(NULL, std::memory_order_relaxed);
+    }
+    m_uTableMask = uTableSize - 1;
+    m_nSessions = 0;
+    m_nTombstones = 0;
+    m_bFullReported = false;
+}
+
+PlayerSessionRegistry::~PlayerSessionRegistry()
+{
+    delete[] m_apTable;
+    for (int i = 0; i < m_nMaxSessions; i++)
+    {
+        m_aSessions[i].~PlayerSession();
+    }
+    delete[] m_pStorage;
+}
+
+// Fibonacci hashing of the pointer; its low bits are the same for every
+// swap chain, since they are aligned.
+uint32_t PlayerSessionRegistry::GetHome(const void *pKey) const
+{
+    return (uint32_t)(((uint64_t)(uintptr_t)pKey >> 4) * 0x9E3779B97F4A7C15ull >> 32) & m_uTableMask;
+}
+
+PlayerSession *PlayerSessionRegistry::Find(const void *pKey)
+{
+    if (!pKey)
+        return NULL;
+
+    uint32_t i = GetHome(pKey);
+    for (uint32_t n = 0; n <= m_uTableMask; n++, i = (i + 1) & m_uTableMask)
+    {
+        PlayerSession *p = m_apTable[i].load(std::memory_order_acquire);
+        if (!p)
+            return NULL;
+        // The key is checked again since the session may have been removed,
+        // or even acquired by another swap chain, since the entry was read.
+        if (p != TOMBSTONE && p->pKey.load(std::memory_order_acquire) == pKey)
+            return p;
+    }
+    return NULL;
+}
+
+PlayerSession *PlayerSessionRegistry::Acquire(const void *pKey, bool *pbNew)
+{
+    if (pbNew)
+        *pbNew = false;
+    if (!pKey)
+        return NULL;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    PlayerSession *p = Find(pKey);
+    if (p)
+        return p;
+
+    if (m_nSessions >= m_nMaxSessions)
+    {
+        // A window left out tries again on every Present; say it once.
+        if (!m_bFullReported)
+            LOG_ERROR(logger, "PlayerSessionRegistry: all " << m_nMaxSessions
+                              << " sessions are in use, turning a new player away");
+        m_bFullReported = true;
+        return NULL;
+    }
+    for (int i = 0; i < m_nMaxSessions && !p; i++)
+    {
+        if (!m_aSessions[i].pKey.load(std::memory_order_relaxed))
+            p = &m_aSessions[i];
+    }
+
+    p->pEncoder = NULL;
+    p->nPresents.store(0, std::memory_order_relaxed);
+    p->nEncoderStarts.store(0, std::memory_order_relaxed);
+    p->nEncoderFailures.store(0, std::memory_order_relaxed);
+    p->pKey.store(pKey, std::memory_order_release);
+
+    // pKey is not in the table, so the first entry that is free or a
+    // tombstone will do. The table is twice as large as the sessions, so
+    // there is one.
+    uint32_t i = GetHome(pKey);
+    for (;;)
+    {
+        PlayerSession *pEntry = m_apTable[i].load(std::memory_order_relaxed);
+        if (!pEntry || pEntry == TOMBSTONE)
+        {
+            if (pEntry)
+                m_nTombstones--;
+            break;
+        }
+        i = (i + 1) & m_uTableMask;
+    }
+    m_apTable[i].store(p, std::memory_order_release);
+    m_nSessions++;
+
+    if (pbNew)
+        *pbNew = true;
+    return p;
+}
+
+bool PlayerSessionRegistry::Remove(const void *pKey)
+{
+    if (!pKey)
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint32_t i = GetHome(pKey);
+    for (uint32_t n = 0; n <= m_uTableMask; n++, i = (i + 1) & m_uTableMask)
+    {
+        PlayerSession *p = m_apTable[i].load(std::memory_order_relaxed);
+        if (!p)
+            return false;
+        if (p == TOMBSTONE || p->pKey.load(std::memory_order_relaxed) != pKey)
+            continue;
+
+        m_apTable[i].store(TOMBSTONE, std::memory_order_release);
+        p->pKey.store(NULL, std::memory_order_release);
+        m_nSessions--;
+        m_nTombstones++;
+        m_bFullReported = false;
+
+        // A tombstone cannot be cleared while another session may lie past
+        // it, but with no sessions left there is nothing to cut off.
+        if (!m_nSessions)
+        {
+            for (uint32_t j = 0; j <= m_uTableMask; j++)
+            {
+                m_apTable[j].store(NULL, std::memory_order_release);
+            }
+            m_nTombstones = 0;
+        }
+        return true;
+    }
+    return false;
+}
+
+PlayerSession *PlayerSessionRegistry::GetAt(int index)
+{
+    if (index < 0 || index >= m_nMaxSessions || !m_aSessions[index].pKey.load(std::memory_order_acquire))
+        return NULL;
+    return &m_aSessions[index];
+}
+
+int PlayerSessionRegistry::GetCount()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nSessions;
+}
+
+// Created once and never destroyed, like the other shared objects of the
+// shim. Present calls this every frame, so it only locks the first time.
+static std::mutex s_sharedRegistryMutex;
+static std::atomic<PlayerSessionRegistry *> s_pSharedRegistry(NULL);
+
+PlayerSessionRegistry *PlayerSessionRegistry::GetShared()
+{
+    PlayerSessionRegistry *pRegistry = s_pSharedRegistry.load(std::memory_order_acquire);
+    if (pRegistry)
+        return pRegistry;
+
+    std::lock_guard<std::mutex> lock(s_sharedRegistryMutex);
+    pRegistry = s_pSharedRegistry.load(std::memory_order_relaxed);
+    if (!pRegistry)
+    {
+        int nMaxSessions = PLAYER_SESSION_MAX;
+        const char *szMax = getenv(PLAYER_SESSION_MAX_ENV);
+        if (szMax && *szMax)
+        {
+            nMaxSessions = atoi(szMax);
+            if (nMaxSessions < 1 || nMaxSessions > PLAYER_SESSION_LIMIT)
+            {
+                LOG_WARN(logger, "PlayerSessionRegistry: " << PLAYER_SESSION_MAX_ENV << "=" << szMax << " is not in 1.."
+                                 << PLAYER_SESSION_LIMIT << ", using " << PLAYER_SESSION_MAX);
+                nMaxSessions = PLAYER_SESSION_MAX;
+            }
+        }
+        pRegistry = new PlayerSessionRegistry(nMaxSessions);
+        s_pSharedRegistry.store(pRegistry, std::memory_order_release);
+    }
+    return pRegistry;
+}
@@ -0,0 +1,110 @@
+/*!
+ * \brief
+ * Per-player state of the shim, looked up by swap chain
+ *
+ * \file
+ *
+ * Every swap chain the game presents with is a player. The first Present of
+ * a swap chain acquires a PlayerSession for it, which gives the player its
+ * index (the lowest free one: it picks the output stream, the bandwidth share
+ * and the activity slot) and holds its encoder and counters until the swap
+ * chain is released.
+ *
+ * Present looks its session up on every frame, from as many threads as there
+ * are players, so Find takes no lock: the sessions are in an open addressing
+ * hash table of atomic pointers, twice as large as the number of sessions,
+ * probed linearly. Acquire and Remove take a mutex and leave a tombstone
+ * where a session was removed, which the next Acquire reuses; the tombstones
+ * are cleared when the last session goes. A session is never freed while the
+ * registry lives, so a Find racing a Remove sees either the session or
+ * nothing, never freed memory.
+ *
+ * Each session starts on a cache line of its own and is padded to a whole
+ * number of lines, so the counters of different players never share one.
+ *
+ * The number of sessions is fixed when the registry is created; that of the
+ * shared registry can be set with DXIFRSHIM_MAX_PLAYERS. A player index also
+ * picks a bandwidth share and an activity slot, so the registry never holds
+ * more sessions than those tables have entries.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+
+#include "BandwidthAllocator.h"
+#include "PlayerActivity.h"
+
+#define PLAYER_SESSION_MAX          16
+#define PLAYER_SESSION_LIMIT        (BANDWIDTH_MAX_PLAYERS < PLAYER_ACTIVITY_MAX_PLAYERS ? \
+                                     BANDWIDTH_MAX_PLAYERS : PLAYER_ACTIVITY_MAX_PLAYERS)
+#define PLAYER_SESSION_MAX_ENV      "DXIFRSHIM_MAX_PLAYERS"
+#define PLAYER_SESSION_CACHE_LINE   64
+
+struct PlayerSessionFields
+{
+    std::atomic<const void *>   pKey;           // the swap chain; NULL while free
+    int                         index;          // the player, 0 to GetMaxSessions() - 1
+
+    // Owned by the thread that presents with pKey; the registry only clears
+    // it when the session is acquired.
+    void                       *pEncoder;
+
+    // Written by the presenting thread, read by anyone.
+    std::atomic<uint64_t>       nPresents;
+    std::atomic<uint64_t>       nEncoderStarts;
+    std::atomic<uint64_t>       nEncoderFailures;
+};
+
+struct PlayerSession : PlayerSessionFields
+{
+    char                        aPadding[PLAYER_SESSION_CACHE_LINE - sizeof(PlayerSessionFields) % PLAYER_SESSION_CACHE_LINE];
+};
+
+class PlayerSessionRegistry
+{
+public:
+    PlayerSessionRegistry(int nMaxSessions = PLAYER_SESSION_MAX);
+    ~PlayerSessionRegistry();
+
+    // Returns the session of pKey, or NULL. Lock-free; the session stays
+    // valid until pKey is removed.
+    PlayerSession *Find(const void *pKey);
+
+    // Returns the session of pKey, acquiring the lowest free index for it if
+    // there is none yet, or NULL if every session is in use. *pbNew, if
+    // given, tells whether the session was just acquired.
+    PlayerSession *Acquire(const void *pKey, bool *pbNew = NULL);
+
+    // Frees the session of pKey, and with it its index. The caller must be
+    // done with the session and its encoder. Returns false if pKey has none.
+    bool Remove(const void *pKey);
+
+    // Returns the session of player index, or NULL if it is free.
+    PlayerSession *GetAt(int index);
+
+    int GetCount();
+    int GetMaxSessions() const { return m_nMaxSessions; }
+
+    // The registry of the swap chains of the process, sized by
+    // DXIFRSHIM_MAX_PLAYERS.
+    static PlayerSessionRegistry *GetShared();
+
+private:
+    uint32_t GetHome(const void *pKey) const;
+
+    int                                 m_nMaxSessions;
+    char                               *m_pStorage;     // m_aSessions, unaligned
+    PlayerSession                      *m_aSessions;    // indexed by player
+    std::atomic<PlayerSession *>       *m_apTable;
+    uint32_t                            m_uTableMask;
+    int                                 m_nSessions;
+    int                                 m_nTombstones;
+    bool                                m_bFullReported;
+    std::mutex                          m_mutex;
+
+    PlayerSessionRegistry(const PlayerSessionRegistry &);
+    PlayerSessionRegistry &operator=(const PlayerSessionRegistry &);
+};
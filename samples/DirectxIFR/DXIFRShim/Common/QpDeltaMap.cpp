@@ -0,0 +1,304 @@
+/*!
+ * \brief
+ * Per-macroblock QP delta maps built from where the frame changes
+ *
+ * \file
+ *
+ * See QpDeltaMap.h.
+ */
+
+#include "QpDeltaMap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(SIMD_ARCH_X86)
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+#if defined(SIMD_ARCH_NEON)
+#include <arm_neon.h>
+#endif
+
+void GetDefaultQpDeltaConfig(QpDeltaConfig *pConfig)
+{
+    pConfig->iActiveDelta = -2;
+    pConfig->iStaticDelta = 4;
+    pConfig->iHudDelta = -3;
+    pConfig->uActiveFrames = 2;
+    pConfig->uStaticFrames = 15;
+}
+
+bool IsQpDeltaMapEnabled()
+{
+    const char *szValue = getenv(QP_DELTA_ENV);
+    return !szValue || strcmp(szValue, "0");
+}
+
+static volatile int s_nSimdLevel = -1;
+
+SimdLevel QpDeltaSetSimdLevel(SimdLevel level)
+{
+    SimdLevel clamped = ClampSimdLevel(level);
+    s_nSimdLevel = clamped;
+    return clamped;
+}
+
+SimdLevel QpDeltaGetSimdLevel()
+{
+    int level = s_nSimdLevel;
+    if (level < 0)
+    {
+        level = GetBestSimdLevel();
+        s_nSimdLevel = level;
+    }
+    return (SimdLevel)level;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Scalar reference kernel
+
+void QpDeltaUpdate_C(const uint8_t *pDirty, const uint8_t *pHud, uint8_t *pAge, int8_t *pMap, int n,
+                     const QpDeltaConfig &config)
+{
+    for (int i = 0; i < n; i++)
+    {
+        uint8_t age = pDirty[i] ? 0 : (pAge[i] == 255 ? 255 : pAge[i] + 1);
+        pAge[i] = age;
+        if (pHud[i])
+            pMap[i] = config.iHudDelta;
+        else if (age < config.uActiveFrames)
+            pMap[i] = config.iActiveDelta;
+        else if (age >= config.uStaticFrames)
+            pMap[i] = config.iStaticDelta;
+        else
+            pMap[i] = 0;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// SIMD kernels. Bytes have no unsigned compare, but a >= b exactly when
+// max(a, b) == a. Active and static never overlap since uActiveFrames is at
+// most uStaticFrames, so their deltas can be or-ed together. The tail is left
+// to the scalar kernel.
+
+#if defined(SIMD_ARCH_X86)
+static void Update_SSE2(const uint8_t *pDirty, const uint8_t *pHud, uint8_t *pAge, int8_t *pMap, int n,
+                        const QpDeltaConfig &config)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i activeFrames = _mm_set1_epi8((char)config.uActiveFrames);
+    const __m128i staticFrames = _mm_set1_epi8((char)config.uStaticFrames);
+    const __m128i activeDelta = _mm_set1_epi8(config.iActiveDelta);
+    const __m128i staticDelta = _mm_set1_epi8(config.iStaticDelta);
+    const __m128i hudDelta = _mm_set1_epi8(config.iHudDelta);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i clean = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pDirty + i)), zero);
+        __m128i age = _mm_and_si128(clean, _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(pAge + i)), one));
+        _mm_storeu_si128((__m128i *)(pAge + i), age);
+        __m128i notActive = _mm_cmpeq_epi8(_mm_max_epu8(age, activeFrames), age);
+        __m128i isStatic = _mm_cmpeq_epi8(_mm_max_epu8(age, staticFrames), age);
+        __m128i delta = _mm_or_si128(_mm_andnot_si128(notActive, activeDelta), _mm_and_si128(isStatic, staticDelta));
+        __m128i notHud = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pHud + i)), zero);
+        delta = _mm_or_si128(_mm_and_si128(notHud, delta), _mm_andnot_si128(notHud, hudDelta));
+        _mm_storeu_si128((__m128i *)(pMap + i), delta);
+    }
+    QpDeltaUpdate_C(pDirty + i, pHud + i, pAge + i, pMap + i, n - i, config);
+}
+
+SIMD_TARGET_AVX2
+static void Update_AVX2(const uint8_t *pDirty, const uint8_t *pHud, uint8_t *pAge, int8_t *pMap, int n,
+                        const QpDeltaConfig &config)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i activeFrames = _mm256_set1_epi8((char)config.uActiveFrames);
+    const __m256i staticFrames = _mm256_set1_epi8((char)config.uStaticFrames);
+    const __m256i activeDelta = _mm256_set1_epi8(config.iActiveDelta);
+    const __m256i staticDelta = _mm256_set1_epi8(config.iStaticDelta);
+    const __m256i hudDelta = _mm256_set1_epi8(config.iHudDelta);
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i clean = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(pDirty + i)), zero);
+        __m256i age = _mm256_and_si256(clean, _mm256_adds_epu8(_mm256_loadu_si256((const __m256i *)(pAge + i)), one));
+        _mm256_storeu_si256((__m256i *)(pAge + i), age);
+        __m256i notActive = _mm256_cmpeq_epi8(_mm256_max_epu8(age, activeFrames), age);
+        __m256i isStatic = _mm256_cmpeq_epi8(_mm256_max_epu8(age, staticFrames), age);
+        __m256i delta = _mm256_or_si256(_mm256_andnot_si256(notActive, activeDelta), _mm256_and_si256(isStatic, staticDelta));
+        __m256i notHud = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(pHud + i)), zero);
+        delta = _mm256_blendv_epi8(hudDelta, delta, notHud);
+        _mm256_storeu_si256((__m256i *)(pMap + i), delta);
+    }
+    Update_SSE2(pDirty + i, pHud + i, pAge + i, pMap + i, n - i, config);
+}
+#endif
+
+#if defined(SIMD_ARCH_NEON)
+static void Update_NEON(const uint8_t *pDirty, const uint8_t *pHud, uint8_t *pAge, int8_t *pMap, int n,
+                        const QpDeltaConfig &config)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    const uint8x16_t activeFrames = vdupq_n_u8(config.uActiveFrames);
+    const uint8x16_t staticFrames = vdupq_n_u8(config.uStaticFrames);
+    const uint8x16_t activeDelta = vdupq_n_u8((uint8_t)config.iActiveDelta);
+    const uint8x16_t staticDelta = vdupq_n_u8((uint8_t)config.iStaticDelta);
+    const uint8x16_t hudDelta = vdupq_n_u8((uint8_t)config.iHudDelta);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t clean = vceqq_u8(vld1q_u8(pDirty + i), zero);
+        uint8x16_t age = vandq_u8(clean, vqaddq_u8(vld1q_u8(pAge + i), one));
+        vst1q_u8(pAge + i, age);
+        uint8x16_t delta = vorrq_u8(vandq_u8(vcltq_u8(age, activeFrames), activeDelta),
+                                    vandq_u8(vcgeq_u8(age, staticFrames), staticDelta));
+        delta = vbslq_u8(vceqq_u8(vld1q_u8(pHud + i), zero), delta, hudDelta);
+        vst1q_u8((uint8_t *)pMap + i, delta);
+    }
+    QpDeltaUpdate_C(pDirty + i, pHud + i, pAge + i, pMap + i, n - i, config);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+// Dispatcher
+
+void QpDeltaUpdate(const uint8_t *pDirty, const uint8_t *pHud, uint8_t *pAge, int8_t *pMap, int n,
+                   const QpDeltaConfig &config)
+{
+    switch (QpDeltaGetSimdLevel())
+    {
+#if defined(SIMD_ARCH_X86)
+    case SIMD_LEVEL_AVX2:
+        Update_AVX2(pDirty, pHud, pAge, pMap, n, config);
+        break;
+    case SIMD_LEVEL_SSE41:
+    case SIMD_LEVEL_SSSE3:
+    case SIMD_LEVEL_SSE2:
+        Update_SSE2(pDirty, pHud, pAge, pMap, n, config);
+        break;
+#endif
+#if defined(SIMD_ARCH_NEON)
+    case SIMD_LEVEL_NEON:
+        Update_NEON(pDirty, pHud, pAge, pMap, n, config);
+        break;
+#endif
+    default:
+        QpDeltaUpdate_C(pDirty, pHud, pAge, pMap, n, config);
+        break;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Map builder
+
+QpDeltaMapBuilder::QpDeltaMapBuilder()
+{
+    GetDefaultQpDeltaConfig(&m_config);
+    m_nMbsX = 0;
+    m_nMbsY = 0;
+    m_nBuffers = 0;
+    m_iNext = 0;
+}
+
+void QpDeltaMapBuilder::Init(int width, int height, int nBuffers, const QpDeltaConfig &config)
+{
+    m_config = config;
+    if (m_config.uActiveFrames > m_config.uStaticFrames)
+    {
+        m_config.uActiveFrames = m_config.uStaticFrames;
+    }
+    m_nMbsX = (width + QP_DELTA_MB_SIZE - 1) / QP_DELTA_MB_SIZE;
+    m_nMbsY = (height + QP_DELTA_MB_SIZE - 1) / QP_DELTA_MB_SIZE;
+    m_nBuffers = nBuffers > 1 ? nBuffers : 2;
+    m_iNext = 0;
+    m_aAge.assign(m_nMbsX * m_nMbsY, 0);
+    m_aHud.assign(m_nMbsX * m_nMbsY, 0);
+    m_aDirty.assign(m_nMbsX * m_nMbsY, 0);
+    m_aMaps.assign(m_nMbsX * m_nMbsY * m_nBuffers, 0);
+}
+
+void QpDeltaMapBuilder::AddHudRegion(int x, int y, int width, int height)
+{
+    if (x < 0)
+    {
+        width += x;
+        x = 0;
+    }
+    if (y < 0)
+    {
+        height += y;
+        y = 0;
+    }
+    int mbX0 = x / QP_DELTA_MB_SIZE, mbY0 = y / QP_DELTA_MB_SIZE;
+    int mbX1 = (x + width + QP_DELTA_MB_SIZE - 1) / QP_DELTA_MB_SIZE;
+    int mbY1 = (y + height + QP_DELTA_MB_SIZE - 1) / QP_DELTA_MB_SIZE;
+    mbX1 = mbX1 < m_nMbsX ? mbX1 : m_nMbsX;
+    mbY1 = mbY1 < m_nMbsY ? mbY1 : m_nMbsY;
+    for (int mbY = mbY0; mbY < mbY1; mbY++)
+    {
+        for (int mbX = mbX0; mbX < mbX1; mbX++)
+        {
+            m_aHud[mbY * m_nMbsX + mbX] = 1;
+        }
+    }
+}
+
+bool QpDeltaMapBuilder::AddHudRegionsFromEnv()
+{
+    const char *szRegions = getenv(QP_DELTA_HUD_ENV);
+    if (!szRegions)
+        return true;
+    for (const char *p = szRegions; *p; )
+    {
+        int x, y, width, height, nChars = 0;
+        if (sscanf(p, " %d , %d , %d , %d %n", &x, &y, &width, &height, &nChars) != 4 || width <= 0 || height <= 0)
+        {
+            fprintf(stderr, "QpDeltaMapBuilder: cannot parse %s=%s\n", QP_DELTA_HUD_ENV, szRegions);
+            return false;
+        }
+        AddHudRegion(x, y, width, height);
+        p += nChars;
+        if (*p == ';')
+            p++;
+        else if (*p)
+        {
+            fprintf(stderr, "QpDeltaMapBuilder: cannot parse %s=%s\n", QP_DELTA_HUD_ENV, szRegions);
+            return false;
+        }
+    }
+    return true;
+}
+
+const int8_t *QpDeltaMapBuilder::Build(const uint8_t *pChangeMask, int nBlocksX, int nBlocksY, int blockSize)
+{
+    int nMbsPerBlock = blockSize / QP_DELTA_MB_SIZE;
+    if (nMbsPerBlock < 1)
+        nMbsPerBlock = 1;
+
+    // Blocks outside the mask count as changed.
+    for (int mbY = 0; mbY < m_nMbsY; mbY++)
+    {
+        uint8_t *pDirty = &m_aDirty[mbY * m_nMbsX];
+        int blockY = mbY / nMbsPerBlock;
+        if (mbY % nMbsPerBlock && mbY)
+        {
+            memcpy(pDirty, pDirty - m_nMbsX, m_nMbsX);
+            continue;
+        }
+        for (int mbX = 0; mbX < m_nMbsX; mbX++)
+        {
+            int blockX = mbX / nMbsPerBlock;
+            pDirty[mbX] = blockX >= nBlocksX || blockY >= nBlocksY || pChangeMask[blockY * nBlocksX + blockX];
+        }
+    }
+
+    int8_t *pMap = &m_aMaps[m_iNext * GetMapSize()];
+    m_iNext = (m_iNext + 1) % m_nBuffers;
+    QpDeltaUpdate(&m_aDirty[0], &m_aHud[0], &m_aAge[0], pMap, (int)GetMapSize(), m_config);
+    return pMap;
+}
@@ -0,0 +1,115 @@
+/*!
+ * \brief
+ * Per-macroblock QP delta maps built from where the frame changes
+ *
+ * \file
+ *
+ * NVENC adds a signed QP delta per 16x16 macroblock on top of the QP its
+ * rate control picks. QpDeltaMapBuilder derives that map from a change mask,
+ * the dirty tiles of TileChangeDetector or an NvFBC diff map, at whatever
+ * block size it comes in. Each macroblock keeps the number of frames since
+ * it last changed:
+ * - one that changed in the last uActiveFrames frames gets iActiveDelta,
+ *   finer, since that is where the viewer looks;
+ * - one unchanged for uStaticFrames frames or more gets iStaticDelta,
+ *   coarser;
+ * - anything inside a HUD region gets iHudDelta whatever it does, so static
+ *   text and gauges stay sharp.
+ * Rate control then spends the bits saved on static areas where the picture
+ * moves.
+ *
+ * The per-macroblock pass dispatches at runtime to AVX2, SSE2 or NEON like
+ * the Util kernels. Maps go round a ring of buffers: the one just built is
+ * left alone for nBuffers - 1 more builds, so a map the encoder still reads
+ * is never overwritten and building never waits for the encoder.
+ *
+ * HUD regions can be given in DXIFRSHIM_QP_HUD as "x,y,w,h" rectangles in
+ * pixels, separated by semicolons. DXIFRSHIM_QP_DELTA=0 turns the maps off.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "CpuFeatures.h"
+
+#define QP_DELTA_MB_SIZE        16
+#define QP_DELTA_ENV            "DXIFRSHIM_QP_DELTA"
+#define QP_DELTA_HUD_ENV        "DXIFRSHIM_QP_HUD"
+
+struct QpDeltaConfig
+{
+    int8_t      iActiveDelta;
+    int8_t      iStaticDelta;
+    int8_t      iHudDelta;
+    uint8_t     uActiveFrames;      // at most uStaticFrames
+    uint8_t     uStaticFrames;
+};
+
+// -2 for macroblocks that changed in the last 2 frames, +4 once they have
+// been static for 15, and -3 in HUD regions.
+void GetDefaultQpDeltaConfig(QpDeltaConfig *pConfig);
+
+// Reads DXIFRSHIM_QP_DELTA.
+bool IsQpDeltaMapEnabled();
+
+// Updates n macroblocks: pAge is the frames since each last changed, which
+// pDirty (non-zero if changed) resets and which saturates at 255, and pMap
+// gets the delta for the new age, or iHudDelta where pHud is non-zero.
+void QpDeltaUpdate(const uint8_t *pDirty, const uint8_t *pHud, uint8_t *pAge, int8_t *pMap, int n,
+                   const QpDeltaConfig &config);
+
+// Scalar reference implementation, used to verify the SIMD kernels.
+void QpDeltaUpdate_C(const uint8_t *pDirty, const uint8_t *pHud, uint8_t *pAge, int8_t *pMap, int n,
+                     const QpDeltaConfig &config);
+
+// Forces the kernels to a given level (clamped to what the CPU supports) and
+// returns the level now in use. Meant for benchmarks and verification only.
+SimdLevel QpDeltaSetSimdLevel(SimdLevel level);
+
+// Returns the level the dispatcher currently uses.
+SimdLevel QpDeltaGetSimdLevel();
+
+class QpDeltaMapBuilder
+{
+public:
+    QpDeltaMapBuilder();
+
+    // Sizes the maps for width x height frames and forgets the HUD regions.
+    // Every macroblock counts as having just changed.
+    void Init(int width, int height, int nBuffers, const QpDeltaConfig &config);
+
+    // Marks the macroblocks a rectangle in pixels touches as HUD.
+    void AddHudRegion(int x, int y, int width, int height);
+
+    // Adds the regions in DXIFRSHIM_QP_HUD. Returns false if it does not
+    // parse; the regions before the error are kept.
+    bool AddHudRegionsFromEnv();
+
+    // Ages every macroblock by a frame, resets those the change mask marks
+    // and builds the map of the next frame. pChangeMask has one byte per
+    // blockSize x blockSize block, row by row, and blockSize is a multiple of
+    // QP_DELTA_MB_SIZE. The map stays valid for nBuffers - 1 more builds.
+    const int8_t *Build(const uint8_t *pChangeMask, int nBlocksX, int nBlocksY, int blockSize);
+
+    int GetWidthInMbs() const { return m_nMbsX; }
+    int GetHeightInMbs() const { return m_nMbsY; }
+
+    // Bytes in a map, one per macroblock.
+    uint32_t GetMapSize() const { return (uint32_t)(m_nMbsX * m_nMbsY); }
+
+private:
+    QpDeltaConfig               m_config;
+    int                         m_nMbsX;
+    int                         m_nMbsY;
+    std::vector<uint8_t>        m_aAge;
+    std::vector<uint8_t>        m_aHud;
+    std::vector<uint8_t>        m_aDirty;   // the change mask at macroblock resolution
+    std::vector<int8_t>         m_aMaps;    // the ring, map after map
+    int                         m_nBuffers;
+    int                         m_iNext;
+
+    QpDeltaMapBuilder(const QpDeltaMapBuilder &);
+    QpDeltaMapBuilder &operator=(const QpDeltaMapBuilder &);
+};
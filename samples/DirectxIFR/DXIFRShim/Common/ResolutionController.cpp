@@ -0,0 +1,239 @@
+/*!
+ * \brief
+ * Steps the encoded resolution down and up with the bitrate and encode time
+ *
+ * \file
+ *
+ * See ResolutionController.h.
+ */
+
+#include "ResolutionController.h"
+#include "FrameScaler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void GetDefaultResolutionConfig(ResolutionConfig *pConfig)
+{
+    pConfig->fMinBitsPerPixel = 0.04f;
+    pConfig->fUpBitsPerPixel = 0.07f;
+    pConfig->fEncodeBudget = 0.8f;
+    pConfig->fEncodeUpBudget = 0.5f;
+    pConfig->fOvershoot = 1.5f;
+    pConfig->nOvershootWindows = 2;
+    pConfig->uWindowFrames = 15;
+    pConfig->uDownHoldFrames = 30;
+    pConfig->uUpHoldFrames = 150;
+}
+
+int ResolutionParseLadder(const char *szLadder, int srcWidth, int srcHeight, ResolutionStep *aSteps)
+{
+    aSteps[0].width = srcWidth;
+    aSteps[0].height = srcHeight;
+    if (szLadder && !strcmp(szLadder, "0"))
+        return 1;
+
+    int nSteps = 1;
+    if (!szLadder || !*szLadder || !strcmp(szLadder, "1"))
+    {
+        static const int s_aScale[][2] = { { 3, 4 }, { 1, 2 }, { 1, 3 } };
+        for (int i = 0; i < (int)(sizeof(s_aScale) / sizeof(s_aScale[0])); i++)
+        {
+            int width = (srcWidth * s_aScale[i][0] / s_aScale[i][1]) & ~1;
+            int height = (srcHeight * s_aScale[i][0] / s_aScale[i][1]) & ~1;
+            if (width < RESOLUTION_MIN_WIDTH || height < RESOLUTION_MIN_HEIGHT)
+                break;
+            aSteps[nSteps].width = width;
+            aSteps[nSteps].height = height;
+            nSteps++;
+        }
+        return nSteps;
+    }
+
+    const char *p = szLadder;
+    while (*p)
+    {
+        char *pEnd = NULL;
+        int width = (int)strtol(p, &pEnd, 10), height = 0;
+        if (pEnd != p && *pEnd == 'x')
+        {
+            const char *pHeight = pEnd + 1;
+            height = (int)strtol(pHeight, &pEnd, 10);
+            if (pEnd == pHeight)
+                height = 0;
+        }
+        if ((*pEnd && *pEnd != ',') || width < 2 || height < 2)
+        {
+            fprintf(stderr, "ResolutionController: %s=%s: \"%s\" is not a size\n", RESOLUTION_ENV, szLadder, p);
+            return 1;
+        }
+        if (nSteps == RESOLUTION_MAX_STEPS)
+        {
+            fprintf(stderr, "ResolutionController: %s=%s has more than %d sizes\n", RESOLUTION_ENV, szLadder, RESOLUTION_MAX_STEPS - 1);
+            return 1;
+        }
+
+        width &= ~1;
+        height &= ~1;
+        const ResolutionStep &last = aSteps[nSteps - 1];
+        if (width > last.width || height > last.height || (width == last.width && height == last.height) ||
+            width < RESOLUTION_MIN_WIDTH || height < RESOLUTION_MIN_HEIGHT ||
+            width * SCALE_MAX_RATIO < srcWidth || height * SCALE_MAX_RATIO < srcHeight)
+        {
+            fprintf(stderr, "ResolutionController: %s=%s: %dx%d is not a smaller step than %dx%d\n", RESOLUTION_ENV, szLadder,
+                    width, height, last.width, last.height);
+            return 1;
+        }
+        aSteps[nSteps].width = width;
+        aSteps[nSteps].height = height;
+        nSteps++;
+        p = *pEnd ? pEnd + 1 : pEnd;
+    }
+    return nSteps;
+}
+
+int ResolutionGetLadder(int srcWidth, int srcHeight, ResolutionStep *aSteps)
+{
+    return ResolutionParseLadder(getenv(RESOLUTION_ENV), srcWidth, srcHeight, aSteps);
+}
+
+const char *GetResolutionReasonName(ResolutionReason eReason)
+{
+    switch (eReason)
+    {
+    case RESOLUTION_REASON_BITRATE:     return "bitrate";
+    case RESOLUTION_REASON_ENCODE_TIME: return "encode time";
+    case RESOLUTION_REASON_OVERSHOOT:   return "overshoot";
+    case RESOLUTION_REASON_HEADROOM:    return "headroom";
+    default:                            return "none";
+    }
+}
+
+ResolutionController::ResolutionController()
+{
+    memset(m_aSteps, 0, sizeof(m_aSteps));
+    m_nSteps = 0;
+    m_fps = 0;
+    GetDefaultResolutionConfig(&m_config);
+    m_iStep = 0;
+    m_eLastReason = RESOLUTION_REASON_NONE;
+    m_nChanges = 0;
+    m_uFramesAtStep = 0;
+    m_uUpHold = 0;
+    m_bSteppedUp = false;
+    m_nOvershoots = 0;
+    m_nFrames = 0;
+    m_fEncodeMs = 0;
+    m_nBytes = 0;
+}
+
+bool ResolutionController::Init(const ResolutionStep *aSteps, int nSteps, int fps, const ResolutionConfig &config)
+{
+    if (nSteps < 1 || nSteps > RESOLUTION_MAX_STEPS || fps <= 0)
+        return false;
+
+    memcpy(m_aSteps, aSteps, nSteps * sizeof(aSteps[0]));
+    m_nSteps = nSteps;
+    m_fps = fps;
+    m_config = config;
+    if (!m_config.uWindowFrames)
+        m_config.uWindowFrames = 1;
+    m_iStep = 0;
+    m_eLastReason = RESOLUTION_REASON_NONE;
+    m_nChanges = 0;
+    m_uFramesAtStep = 0;
+    m_uUpHold = m_config.uUpHoldFrames;
+    m_bSteppedUp = false;
+    m_nOvershoots = 0;
+    m_nFrames = 0;
+    m_fEncodeMs = 0;
+    m_nBytes = 0;
+    return true;
+}
+
+// Without a target every step has bits to spare.
+double ResolutionController::BitsPerPixel(int iStep, uint32_t uTargetBps) const
+{
+    if (!uTargetBps)
+        return 1e9;
+    return uTargetBps / (Pixels(iStep) * m_fps);
+}
+
+void ResolutionController::SwitchTo(int iStep, ResolutionReason eReason)
+{
+    // A step up undone within its hold did not fit; the next try waits
+    // longer.
+    if (iStep > m_iStep && m_bSteppedUp && m_uFramesAtStep < m_uUpHold)
+    {
+        m_uUpHold *= 2;
+        if (m_uUpHold > m_config.uUpHoldFrames * RESOLUTION_MAX_UP_HOLD)
+            m_uUpHold = m_config.uUpHoldFrames * RESOLUTION_MAX_UP_HOLD;
+    }
+    m_bSteppedUp = iStep < m_iStep;
+    m_iStep = iStep;
+    m_eLastReason = eReason;
+    m_nChanges++;
+    m_uFramesAtStep = 0;
+    m_nOvershoots = 0;
+}
+
+bool ResolutionController::Update(uint32_t uTargetBps, double fEncodeMs, uint32_t uBytes)
+{
+    if (m_nSteps < 2)
+        return false;
+
+    m_nFrames++;
+    m_fEncodeMs += fEncodeMs;
+    m_nBytes += uBytes;
+    m_uFramesAtStep++;
+    if (m_bSteppedUp && m_uFramesAtStep >= m_uUpHold)
+    {
+        m_bSteppedUp = false;
+        m_uUpHold = m_config.uUpHoldFrames;
+    }
+    if (m_nFrames < m_config.uWindowFrames)
+        return false;
+
+    double fLoad = m_fEncodeMs / m_nFrames * m_fps / 1000;
+    double fOutputBps = (double)m_nBytes * 8 * m_fps / m_nFrames;
+    bool bOvershoot = uTargetBps && fOutputBps > uTargetBps * (double)m_config.fOvershoot;
+    m_nOvershoots = bOvershoot ? m_nOvershoots + 1 : 0;
+    m_nFrames = 0;
+    m_fEncodeMs = 0;
+    m_nBytes = 0;
+
+    if (m_iStep + 1 < m_nSteps && m_uFramesAtStep >= m_config.uDownHoldFrames)
+    {
+        // A drop in bandwidth goes straight to the step that fits it.
+        if (BitsPerPixel(m_iStep, uTargetBps) < m_config.fMinBitsPerPixel)
+        {
+            int iStep = m_iStep + 1;
+            while (iStep + 1 < m_nSteps && BitsPerPixel(iStep, uTargetBps) < m_config.fMinBitsPerPixel)
+            {
+                iStep++;
+            }
+            SwitchTo(iStep, RESOLUTION_REASON_BITRATE);
+            return true;
+        }
+        if (fLoad > m_config.fEncodeBudget)
+        {
+            SwitchTo(m_iStep + 1, RESOLUTION_REASON_ENCODE_TIME);
+            return true;
+        }
+        if (m_nOvershoots >= m_config.nOvershootWindows)
+        {
+            SwitchTo(m_iStep + 1, RESOLUTION_REASON_OVERSHOOT);
+            return true;
+        }
+    }
+
+    if (m_iStep > 0 && m_uFramesAtStep >= m_uUpHold && !bOvershoot &&
+        BitsPerPixel(m_iStep - 1, uTargetBps) >= m_config.fUpBitsPerPixel &&
+        fLoad * Pixels(m_iStep - 1) / Pixels(m_iStep) <= m_config.fEncodeUpBudget)
+    {
+        SwitchTo(m_iStep - 1, RESOLUTION_REASON_HEADROOM);
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,141 @@
+/*!
+ * \brief
+ * Steps the encoded resolution down and up with the bitrate and encode time
+ *
+ * \file
+ *
+ * A player on a thin link is better served with a smaller, cleaner picture
+ * than with a full size one the encoder starves. The controller walks a
+ * ladder of sizes, the capture size first, and the encoder scales each frame
+ * to the current step and reconfigures NVENC when it changes (sizes up to the
+ * capture size need no new session).
+ *
+ * Every frame the encoder reports the bitrate it is asked for, the time its
+ * thread spent on the frame and the bytes written out since the last frame.
+ * Every uWindowFrames frames the controller decides on the averages:
+ * - down to the largest step that still gets fMinBitsPerPixel, when the
+ *   current one does not;
+ * - down one step when encoding takes more than fEncodeBudget of the frame
+ *   interval, or the output overshoots the target by fOvershoot in
+ *   nOvershootWindows windows in a row (a keyframe alone overshoots one);
+ * - up one step when the next one up gets fUpBitsPerPixel, its encode time,
+ *   taken to grow with the pixels, stays within fEncodeUpBudget, and the
+ *   output did not overshoot.
+ * The gap between the down and up thresholds is the hysteresis. On top of
+ * it a step is held for uDownHoldFrames after any change before going down
+ * and uUpHoldFrames before going up, and a step up that has to be undone
+ * within its hold doubles the up hold, up to RESOLUTION_MAX_UP_HOLD times,
+ * so a size that does not fit is not retried every few seconds.
+ *
+ * DXIFRSHIM_ADAPTIVE_RESOLUTION=0 keeps the capture size; a list of sizes
+ * ("1280x720,960x540") replaces the default ladder of 3/4, 1/2 and 1/3 of
+ * it. Steps are never smaller than RESOLUTION_MIN_WIDTH x
+ * RESOLUTION_MIN_HEIGHT, nor than the capture by more than SCALE_MAX_RATIO.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define RESOLUTION_ENV "DXIFRSHIM_ADAPTIVE_RESOLUTION"
+
+// Steps of a ladder, the capture size included.
+#define RESOLUTION_MAX_STEPS 6
+
+#define RESOLUTION_MIN_WIDTH 320
+#define RESOLUTION_MIN_HEIGHT 180
+
+// Largest multiple of uUpHoldFrames a step up is held back by.
+#define RESOLUTION_MAX_UP_HOLD 8
+
+struct ResolutionStep
+{
+    int     width;
+    int     height;
+};
+
+struct ResolutionConfig
+{
+    float       fMinBitsPerPixel;   // below this a step goes down
+    float       fUpBitsPerPixel;    // a step up needs this
+    float       fEncodeBudget;      // of the frame interval, above this a step goes down
+    float       fEncodeUpBudget;    // a step up must stay within this
+    float       fOvershoot;         // output over target
+    uint32_t    nOvershootWindows;
+    uint32_t    uWindowFrames;
+    uint32_t    uDownHoldFrames;
+    uint32_t    uUpHoldFrames;
+};
+
+// 0.04 bits per pixel down and 0.07 up, 80% of the frame interval down and
+// 50% up, 1.5 times the target over 2 windows, 15 frame windows, and steps
+// held for 30 frames down and 150 up.
+void GetDefaultResolutionConfig(ResolutionConfig *pConfig);
+
+// Parses a ladder for a capture of srcWidth x srcHeight into aSteps, which
+// has room for RESOLUTION_MAX_STEPS, capture size first. NULL, empty or "1"
+// is the default ladder and "0" the capture size alone. Sizes are rounded
+// down to even and must shrink from one step to the next. Returns the number
+// of steps, or 1, and says why on stderr, if the ladder is wrong.
+int ResolutionParseLadder(const char *szLadder, int srcWidth, int srcHeight, ResolutionStep *aSteps);
+
+// Reads DXIFRSHIM_ADAPTIVE_RESOLUTION.
+int ResolutionGetLadder(int srcWidth, int srcHeight, ResolutionStep *aSteps);
+
+enum ResolutionReason
+{
+    RESOLUTION_REASON_NONE,
+    RESOLUTION_REASON_BITRATE,      // too few bits per pixel
+    RESOLUTION_REASON_ENCODE_TIME,
+    RESOLUTION_REASON_OVERSHOOT,
+    RESOLUTION_REASON_HEADROOM,     // up: bits and time to spare
+};
+
+const char *GetResolutionReasonName(ResolutionReason eReason);
+
+class ResolutionController
+{
+public:
+    ResolutionController();
+
+    // Starts at step 0. Returns false if there are no steps or fps is not
+    // positive.
+    bool Init(const ResolutionStep *aSteps, int nSteps, int fps, const ResolutionConfig &config);
+
+    // Reports one frame: the bitrate asked for, the time from submitting it
+    // until its output was written and the bytes it produced. Returns true
+    // when the step has changed; the encoder switches before its next frame.
+    bool Update(uint32_t uTargetBps, double fEncodeMs, uint32_t uBytes);
+
+    int GetStep() const { return m_iStep; }
+    int GetStepCount() const { return m_nSteps; }
+    const ResolutionStep &GetSize() const { return m_aSteps[m_iStep]; }
+    ResolutionReason GetLastReason() const { return m_eLastReason; }
+    uint32_t GetChanges() const { return m_nChanges; }
+
+    // Up hold in frames, as doubled by undone steps up.
+    uint32_t GetUpHoldFrames() const { return m_uUpHold; }
+
+private:
+    double BitsPerPixel(int iStep, uint32_t uTargetBps) const;
+    double Pixels(int iStep) const { return (double)m_aSteps[iStep].width * m_aSteps[iStep].height; }
+    void SwitchTo(int iStep, ResolutionReason eReason);
+
+    ResolutionStep      m_aSteps[RESOLUTION_MAX_STEPS];
+    int                 m_nSteps;
+    int                 m_fps;
+    ResolutionConfig    m_config;
+
+    int                 m_iStep;
+    ResolutionReason    m_eLastReason;
+    uint32_t            m_nChanges;
+    uint32_t            m_uFramesAtStep;
+    uint32_t            m_uUpHold;
+    bool                m_bSteppedUp;       // the current step was reached going up
+    uint32_t            m_nOvershoots;      // windows in a row
+
+    // The current window.
+    uint32_t            m_nFrames;
+    double              m_fEncodeMs;
+    uint64_t            m_nBytes;
+};
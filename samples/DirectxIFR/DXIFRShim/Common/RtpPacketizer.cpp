@@ -0,0 +1,247 @@
+/*!
+ * \brief
+ * RTP packetization of H.264 access units (RFC 6184) and a UDP sender
+ *
+ * \file
+ *
+ * See RtpPacketizer.h.
+ */
+
+#include "RtpPacketizer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "NalScanner.h"
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET socket_t;
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+typedef int socket_t;
+#define closesocket close
+#endif
+
+// Largest NAL unit of a STAP-A, whose sizes are 16 bits.
+#define RTP_STAP_A_MAX_NAL      0xFFFF
+
+struct NalUnit
+{
+    const uint8_t  *p;
+    size_t          size;
+};
+
+// Splits an Annex-B buffer into its NAL units, without start codes.
+static void SplitNalUnits(const uint8_t *pData, size_t size, std::vector<NalUnit> &aNals)
+{
+    aNals.clear();
+    NalScanner scanner(pData, size);
+    NalUnit nal;
+    while (scanner.Next(&nal.p, &nal.size))
+    {
+        aNals.push_back(nal);
+    }
+}
+
+RtpPacketizer::RtpPacketizer(uint32_t uSsrc, uint8_t payloadType, size_t mtu)
+{
+    m_uSsrc = uSsrc;
+    m_payloadType = payloadType;
+    m_mtu = mtu;
+    m_uSequence = (uint16_t)uSsrc;
+}
+
+uint8_t *RtpPacketizer::BeginPacket(RtpPacketList &packets, uint32_t timestamp, size_t payloadSize)
+{
+    size_t offset = packets.aData.size();
+    packets.aData.resize(offset + RTP_HEADER_SIZE + payloadSize);
+    packets.aOffsets.push_back(packets.aData.size());
+
+    uint8_t *p = &packets.aData[offset];
+    p[0] = 0x80;                                        // version 2
+    p[1] = m_payloadType;
+    p[2] = (uint8_t)(m_uSequence >> 8);
+    p[3] = (uint8_t)m_uSequence;
+    p[4] = (uint8_t)(timestamp >> 24);
+    p[5] = (uint8_t)(timestamp >> 16);
+    p[6] = (uint8_t)(timestamp >> 8);
+    p[7] = (uint8_t)timestamp;
+    p[8] = (uint8_t)(m_uSsrc >> 24);
+    p[9] = (uint8_t)(m_uSsrc >> 16);
+    p[10] = (uint8_t)(m_uSsrc >> 8);
+    p[11] = (uint8_t)m_uSsrc;
+    m_uSequence++;
+    return p + RTP_HEADER_SIZE;
+}
+
+void RtpPacketizer::PacketizeAccessUnit(const uint8_t *pData, size_t size, uint32_t timestamp, RtpPacketList &packets)
+{
+    std::vector<NalUnit> aNals;
+    SplitNalUnits(pData, size, aNals);
+
+    size_t firstPacket = packets.GetCount();
+    size_t maxPayload = m_mtu - RTP_HEADER_SIZE;
+    for (size_t i = 0; i < aNals.size();)
+    {
+        const NalUnit &nal = aNals[i];
+        if (nal.size <= maxPayload)
+        {
+            // Aggregate as many of the following NAL units as fit.
+            size_t stapSize = 1;
+            size_t end = i;
+            while (end < aNals.size() && aNals[end].size <= RTP_STAP_A_MAX_NAL
+                && stapSize + 2 + aNals[end].size <= maxPayload)
+            {
+                stapSize += 2 + aNals[end].size;
+                end++;
+            }
+
+            if (end - i >= 2)
+            {
+                uint8_t *p = BeginPacket(packets, timestamp, stapSize);
+                uint8_t forbidden = 0, nri = 0;
+                size_t offset = 1;
+                for (size_t j = i; j < end; j++)
+                {
+                    forbidden |= aNals[j].p[0] & 0x80;
+                    nri = (aNals[j].p[0] & 0x60) > nri ? aNals[j].p[0] & 0x60 : nri;
+                    p[offset] = (uint8_t)(aNals[j].size >> 8);
+                    p[offset + 1] = (uint8_t)aNals[j].size;
+                    memcpy(p + offset + 2, aNals[j].p, aNals[j].size);
+                    offset += 2 + aNals[j].size;
+                }
+                p[0] = (uint8_t)(forbidden | nri | RTP_NAL_STAP_A);
+                i = end;
+            }
+            else
+            {
+                memcpy(BeginPacket(packets, timestamp, nal.size), nal.p, nal.size);
+                i++;
+            }
+            continue;
+        }
+
+        // FU-A: the NAL header is split between the FU indicator and the FU
+        // header; the rest of the NAL unit is spread over the fragments.
+        uint8_t indicator = (uint8_t)((nal.p[0] & 0xE0) | RTP_NAL_FU_A);
+        uint8_t type = nal.p[0] & 0x1F;
+        size_t maxFragment = maxPayload - 2;
+        for (size_t done = 1; done < nal.size;)
+        {
+            size_t fragment = nal.size - done < maxFragment ? nal.size - done : maxFragment;
+            uint8_t *p = BeginPacket(packets, timestamp, 2 + fragment);
+            p[0] = indicator;
+            p[1] = (uint8_t)((done == 1 ? 0x80 : 0) | (done + fragment == nal.size ? 0x40 : 0) | type);
+            memcpy(p + 2, nal.p + done, fragment);
+            done += fragment;
+        }
+        i++;
+    }
+
+    if (packets.GetCount() > firstPacket)
+    {
+        packets.aData[packets.aOffsets[packets.GetCount() - 1] + 1] |= 0x80;
+    }
+}
+
+RtpSender::RtpSender()
+{
+#if defined(_WIN32)
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    m_s = -1;
+}
+
+RtpSender::~RtpSender()
+{
+    Close();
+#if defined(_WIN32)
+    WSACleanup();
+#endif
+}
+
+bool RtpSender::Open(const char *szHost, unsigned short uPort)
+{
+    Close();
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *pResult = NULL;
+    if (getaddrinfo(szHost, NULL, &hints, &pResult) != 0 || !pResult)
+    {
+        fprintf(stderr, "RtpSender: cannot resolve %s\n", szHost);
+        return false;
+    }
+    sockaddr_in addr = *(sockaddr_in *)pResult->ai_addr;
+    addr.sin_port = htons(uPort);
+    freeaddrinfo(pResult);
+
+    socket_t s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == (socket_t)-1)
+        return false;
+    m_s = (intptr_t)s;
+
+    // Room for a keyframe's packets, which go out in one burst.
+    int sendBuffer = 1 << 20;
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char *)&sendBuffer, sizeof(sendBuffer));
+    if (connect(s, (sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "RtpSender: cannot connect to %s:%u\n", szHost, uPort);
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void RtpSender::Close()
+{
+    if (m_s != -1)
+        closesocket((socket_t)m_s);
+    m_s = -1;
+}
+
+size_t RtpSender::Send(const RtpPacketList &packets)
+{
+    size_t nPackets = packets.GetCount();
+    size_t nSent = 0;
+#if defined(_WIN32)
+    for (; nSent < nPackets; nSent++)
+    {
+        size_t size;
+        const uint8_t *p = packets.GetPacket(nSent, &size);
+        if (send((socket_t)m_s, (const char *)p, (int)size, 0) != (int)size)
+            break;
+    }
+#else
+    mmsghdr aMessages[RTP_SEND_BATCH];
+    iovec aBuffers[RTP_SEND_BATCH];
+    while (nSent < nPackets)
+    {
+        unsigned int nBatch = (unsigned int)(nPackets - nSent < RTP_SEND_BATCH ? nPackets - nSent : RTP_SEND_BATCH);
+        memset(aMessages, 0, sizeof(aMessages[0]) * nBatch);
+        for (unsigned int i = 0; i < nBatch; i++)
+        {
+            size_t size;
+            aBuffers[i].iov_base = (void *)packets.GetPacket(nSent + i, &size);
+            aBuffers[i].iov_len = size;
+            aMessages[i].msg_hdr.msg_iov = &aBuffers[i];
+            aMessages[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = sendmmsg((socket_t)m_s, aMessages, nBatch, 0);
+        if (n <= 0)
+            break;
+        nSent += n;
+    }
+#endif
+    return nSent;
+}
@@ -0,0 +1,90 @@
+/*!
+ * \brief
+ * RTP packetization of H.264 access units (RFC 6184) and a UDP sender
+ *
+ * \file
+ *
+ * The packetizer works in non-interleaved mode. Each NAL unit of an Annex-B
+ * access unit goes out in one of three ways:
+ * - on its own, if it fits;
+ * - in a STAP-A, together with the NAL units that follow it, if two or more
+ *   of them fit in one packet;
+ * - split into FU-A fragments, if it does not fit.
+ * All packets of an access unit carry its 90 kHz timestamp, and the last one
+ * has the marker bit set. No packet, RTP header included, is larger than the
+ * MTU given to the packetizer.
+ *
+ * RtpSender sends a whole access unit's packets over a connected UDP socket,
+ * RTP_SEND_BATCH packets per sendmmsg call on Linux. Windows has no
+ * sendmmsg, so there each packet is one send.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define RTP_HEADER_SIZE         12
+#define RTP_DEFAULT_MTU         1200    // packet size with the RTP header, leaving room for UDP/IP and tunnels
+#define RTP_PAYLOAD_TYPE_H264   96      // first dynamic payload type
+#define RTP_CLOCK_HZ            90000
+#define RTP_SEND_BATCH          32
+
+#define RTP_NAL_STAP_A          24
+#define RTP_NAL_FU_A            28
+
+// Packets stored back to back: packet i is aData[aOffsets[i], aOffsets[i + 1]).
+struct RtpPacketList
+{
+    std::vector<uint8_t>    aData;
+    std::vector<size_t>     aOffsets;
+
+    RtpPacketList() { Clear(); }
+    void Clear() { aData.clear(); aOffsets.assign(1, 0); }
+    size_t GetCount() const { return aOffsets.size() - 1; }
+    const uint8_t *GetPacket(size_t i, size_t *pSize) const
+    {
+        *pSize = aOffsets[i + 1] - aOffsets[i];
+        return &aData[aOffsets[i]];
+    }
+};
+
+class RtpPacketizer
+{
+public:
+    RtpPacketizer(uint32_t uSsrc, uint8_t payloadType = RTP_PAYLOAD_TYPE_H264, size_t mtu = RTP_DEFAULT_MTU);
+
+    // Appends the packets of one Annex-B access unit to packets.
+    void PacketizeAccessUnit(const uint8_t *pData, size_t size, uint32_t timestamp, RtpPacketList &packets);
+
+    uint16_t GetNextSequence() const { return m_uSequence; }
+
+private:
+    uint8_t *BeginPacket(RtpPacketList &packets, uint32_t timestamp, size_t payloadSize);
+
+    uint32_t    m_uSsrc;
+    uint8_t     m_payloadType;
+    size_t      m_mtu;
+    uint16_t    m_uSequence;
+};
+
+class RtpSender
+{
+public:
+    RtpSender();
+    ~RtpSender();
+
+    // Sends to szHost (a name or dotted address) on uPort.
+    bool Open(const char *szHost, unsigned short uPort);
+    void Close();
+
+    // Returns the number of packets sent.
+    size_t Send(const RtpPacketList &packets);
+
+private:
+    intptr_t    m_s;
+
+    RtpSender(const RtpSender &);
+    RtpSender &operator=(const RtpSender &);
+};
@@ -0,0 +1,334 @@
+/*!
+ * \brief
+ * Lower resolution renditions of a player's stream
+ *
+ * \file
+ *
+ * See SimulcastStage.h.
+ */
+
+#include "SimulcastStage.h"
+#include "FramePacer.h"
+#include "FrameTrace.h"
+#include "Metrics.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int SimulcastParseLadder(const char *szLadder, int srcWidth, int srcHeight, SimulcastRendition *aRenditions)
+{
+    int nRenditions = 0;
+    const char *p = szLadder;
+    while (p && *p)
+    {
+        char *pEnd = NULL;
+        int width = (int)strtol(p, &pEnd, 10), height = 0;
+        if (pEnd != p && *pEnd == 'x')
+        {
+            const char *pHeight = pEnd + 1;
+            height = (int)strtol(pHeight, &pEnd, 10);
+            if (pEnd == pHeight)
+                height = 0;
+        }
+        else if (pEnd != p && width > 0)
+        {
+            height = srcHeight / width;
+            width = srcWidth / width;
+        }
+        if ((*pEnd && *pEnd != ',') || width < 2 || height < 2)
+        {
+            fprintf(stderr, "SimulcastStage: %s=%s: \"%s\" is not a size or a divisor\n", SIMULCAST_ENV, szLadder, p);
+            return 0;
+        }
+        if (nRenditions == SIMULCAST_MAX_RENDITIONS)
+        {
+            fprintf(stderr, "SimulcastStage: %s=%s has more than %d renditions\n", SIMULCAST_ENV, szLadder, SIMULCAST_MAX_RENDITIONS);
+            return 0;
+        }
+
+        width &= ~1;
+        height &= ~1;
+        if (width > srcWidth || height > srcHeight || (width == srcWidth && height == srcHeight) ||
+            width * SCALE_MAX_RATIO < srcWidth || height * SCALE_MAX_RATIO < srcHeight)
+        {
+            fprintf(stderr, "SimulcastStage: %s=%s: %dx%d is not a smaller rendition of %dx%d\n",
+                    SIMULCAST_ENV, szLadder, width, height, srcWidth, srcHeight);
+            return 0;
+        }
+        aRenditions[nRenditions].width = width;
+        aRenditions[nRenditions].height = height;
+        nRenditions++;
+        p = *pEnd ? pEnd + 1 : pEnd;
+    }
+    return nRenditions;
+}
+
+ScaleFilter SimulcastGetFilter()
+{
+    ScaleFilter eFilter = SCALE_FILTER_LANCZOS2;
+    const char *szName = getenv(SIMULCAST_FILTER_ENV);
+    if (szName && *szName && !ScaleFilterFromName(szName, &eFilter))
+    {
+        fprintf(stderr, "SimulcastStage: %s=%s is not box, bilinear or lanczos2, using %s\n",
+                SIMULCAST_FILTER_ENV, szName, GetScaleFilterName(eFilter));
+    }
+    return eFilter;
+}
+
+int SimulcastRenditionBitrate(int playerBitrate, int srcWidth, int srcHeight, const SimulcastRendition &rendition)
+{
+    double share = (double)rendition.width * rendition.height / ((double)srcWidth * srcHeight);
+    int bitrate = (int)(playerBitrate * pow(share, 0.75));
+    return bitrate > SIMULCAST_MIN_BITRATE ? bitrate : SIMULCAST_MIN_BITRATE;
+}
+
+SimulcastStage::SimulcastStage()
+{
+    m_srcWidth = 0;
+    m_srcHeight = 0;
+    memset(&m_source, 0, sizeof(m_source));
+    m_uSeq = 0;
+    m_uFrame = 0;
+    m_playerBitrate = 0;
+    m_nStarting = 0;
+    m_nFailed = 0;
+    m_nScaling = 0;
+    m_nEncoding = 0;
+    m_bStop = false;
+    m_nSkipped = 0;
+    m_pSkippedMetric = NULL;
+}
+
+SimulcastStage::~SimulcastStage()
+{
+    Stop();
+}
+
+bool SimulcastStage::Start(int index, int srcWidth, int srcHeight, const SimulcastRendition *aRenditions, int nRenditions,
+                           ScaleFilter eFilter, VideoEncoderBackend eBackend, int fps, int playerBitrate)
+{
+    if (!m_aRenditions.empty() || nRenditions < 1 || nRenditions > SIMULCAST_MAX_RENDITIONS)
+        return false;
+
+    m_srcWidth = srcWidth;
+    m_srcHeight = srcHeight;
+    m_aSource.resize((size_t)srcWidth * srcHeight * 3 / 2);
+    m_source = YuvFrameView(&m_aSource[0], srcWidth, srcHeight);
+    m_playerBitrate = playerBitrate;
+    m_bStop = false;
+
+    MetricsRegistry *pMetrics = MetricsRegistry::GetShared();
+    char szLabels[64];
+    sprintf(szLabels, "player=\"%d\",reason=\"simulcast\"", index);
+    m_pSkippedMetric = pMetrics->GetCounter("dxifrshim_frames_dropped_total",
+        "Frames lost because the capture failed, or deadlines skipped because the loop fell behind.", szLabels);
+
+    for (int r = 0; r < nRenditions; r++)
+    {
+        Rendition *pRendition = new Rendition;
+        pRendition->iStream = index + (r + 1) * SIMULCAST_STREAM_STRIDE;
+        pRendition->size = aRenditions[r];
+        if (!pRendition->scaler.Init(srcWidth, srcHeight, aRenditions[r].width, aRenditions[r].height, eFilter))
+        {
+            delete pRendition;
+            Stop();
+            return false;
+        }
+        pRendition->aFrame.resize(pRendition->scaler.GetFrameSize());
+        pRendition->pEncoder = NULL;
+        pRendition->bitrate = SimulcastRenditionBitrate(playerBitrate, srcWidth, srcHeight, aRenditions[r]);
+        pRendition->nEncoded = 0;
+
+        sprintf(szLabels, "player=\"%d\"", pRendition->iStream);
+        pRendition->pEncodedMetric = pMetrics->GetCounter("dxifrshim_frames_encoded_total",
+            "Frames handed to the encoder.", szLabels);
+        pRendition->pBitrateMetric = pMetrics->GetGauge("dxifrshim_target_bitrate_bps",
+            "Bitrate the encoder is asked for.", szLabels);
+        pRendition->pScaleMetric = pMetrics->GetHistogram("dxifrshim_scale_seconds",
+            "Time a simulcast rendition takes to scale a frame down.", szLabels);
+        pRendition->pEncodeMetric = pMetrics->GetHistogram("dxifrshim_encode_seconds",
+            "Time the encoder thread takes to hand a frame to the encoder.", szLabels);
+        pRendition->pBitrateMetric->Set(pRendition->bitrate);
+        m_aRenditions.push_back(pRendition);
+    }
+
+    // The encoders are created, used and shut down on their renditions'
+    // threads, as the players' are on the encoder thread.
+    m_nStarting = nRenditions;
+    m_nFailed = 0;
+    for (int r = 0; r < nRenditions; r++)
+    {
+        m_aRenditions[r]->thread = std::thread(&SimulcastStage::RenditionLoop, this, m_aRenditions[r], eBackend, fps);
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_nStarting)
+        {
+            m_cvDone.wait(lock);
+        }
+    }
+    if (m_nFailed)
+    {
+        Stop();
+        return false;
+    }
+    return true;
+}
+
+bool SimulcastStage::Submit(const YuvI420View &view, int playerBitrate, uint32_t uFrame)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_aRenditions.empty())
+            return false;
+        if (m_nScaling)
+        {
+            m_nSkipped++;
+            m_pSkippedMetric->Add();
+            return false;
+        }
+    }
+
+    // Nothing reads the copy until the frame is handed over below.
+    YuvCopyView(view, &m_aSource[0]);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_uSeq++;
+        m_uFrame = uFrame;
+        m_playerBitrate = playerBitrate;
+        m_nScaling = (int)m_aRenditions.size();
+        m_nEncoding += (int)m_aRenditions.size();
+    }
+    m_cvFrame.notify_all();
+    return true;
+}
+
+void SimulcastStage::RenditionLoop(Rendition *pRendition, VideoEncoderBackend eBackend, int fps)
+{
+    char szThreadName[32];
+    sprintf(szThreadName, "Rendition %d", pRendition->iStream);
+    FRAME_TRACE_THREAD_NAME(szThreadName);
+
+    pRendition->pEncoder = CreateVideoEncoder(eBackend, pRendition->iStream);
+    if (pRendition->pEncoder)
+    {
+        pRendition->pEncoder->EncodeMain(pRendition->iStream, pRendition->size.width, pRendition->size.height,
+                                         fps, pRendition->bitrate);
+    }
+    else
+    {
+        fprintf(stderr, "SimulcastStage: encoder backend %s is not built in\n", GetVideoEncoderBackendName(eBackend));
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_nStarting--;
+        m_nFailed += pRendition->pEncoder == NULL;
+    }
+    m_cvDone.notify_all();
+    if (!pRendition->pEncoder)
+        return;
+
+    uint32_t uSeen = 0;
+    for (;;)
+    {
+        uint32_t uFrame;
+        int playerBitrate;
+        {
+            // A frame handed over before the stop is still encoded.
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_uSeq == uSeen && !m_bStop)
+            {
+                m_cvFrame.wait(lock);
+            }
+            if (m_uSeq == uSeen)
+                break;
+            uSeen = m_uSeq;
+            uFrame = m_uFrame;
+            playerBitrate = m_playerBitrate;
+        }
+
+        FRAME_TRACE_FRAME(uFrame);
+        {
+            FRAME_TRACE_SCOPE("Scale");
+            uint64_t uScaleStartNs = FramePacer::NowNs();
+            pRendition->scaler.Scale(m_source, &pRendition->aFrame[0]);
+            pRendition->pScaleMetric->Record((FramePacer::NowNs() - uScaleStartNs) / 1000);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_nScaling--;
+        }
+
+        int bitrate = SimulcastRenditionBitrate(playerBitrate, m_srcWidth, m_srcHeight, pRendition->size);
+        bool bReconfigure;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            bReconfigure = bitrate != pRendition->bitrate;
+            pRendition->bitrate = bitrate;
+        }
+        if (bReconfigure)
+        {
+            pRendition->pBitrateMetric->Set(bitrate);
+        }
+        {
+            FRAME_TRACE_SCOPE("Encode");
+            uint64_t uEncodeStartNs = FramePacer::NowNs();
+            pRendition->pEncoder->EncodeFrameLoop(&pRendition->aFrame[0], bReconfigure, pRendition->iStream, bitrate);
+            pRendition->pEncodeMetric->Record((FramePacer::NowNs() - uEncodeStartNs) / 1000);
+            pRendition->pEncodedMetric->Add();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            pRendition->nEncoded++;
+            m_nEncoding--;
+        }
+        m_cvDone.notify_all();
+    }
+
+    pRendition->pEncoder->Shutdown();
+    delete pRendition->pEncoder;
+    pRendition->pEncoder = NULL;
+}
+
+void SimulcastStage::Flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_nEncoding)
+    {
+        m_cvDone.wait(lock);
+    }
+}
+
+void SimulcastStage::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bStop = true;
+    }
+    m_cvFrame.notify_all();
+    for (size_t r = 0; r < m_aRenditions.size(); r++)
+    {
+        if (m_aRenditions[r]->thread.joinable())
+        {
+            m_aRenditions[r]->thread.join();
+        }
+        delete m_aRenditions[r];
+    }
+    m_aRenditions.clear();
+    m_nScaling = 0;
+    m_nEncoding = 0;
+}
+
+uint64_t SimulcastStage::GetEncodedFrames(int r)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_aRenditions[r]->nEncoded;
+}
+
+int SimulcastStage::GetBitrate(int r)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_aRenditions[r]->bitrate;
+}
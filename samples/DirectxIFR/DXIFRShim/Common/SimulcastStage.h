@@ -0,0 +1,145 @@
+/*!
+ * \brief
+ * Lower resolution renditions of a player's stream
+ *
+ * \file
+ *
+ * DXIFRSHIM_SIMULCAST lists up to SIMULCAST_MAX_RENDITIONS renditions to
+ * stream besides the captured picture, as sizes ("960x540,640x360") or as
+ * divisors of the player's size ("2,4"), so spectators on a weak link can
+ * pick a smaller stream. Rendition r (from 1) of player i goes out as stream
+ * i + r * SIMULCAST_STREAM_STRIDE (see BitstreamOutput.h): with the default
+ * HTTP output, player 0's first rendition is on port 30100.
+ *
+ * Each rendition has a thread of its own that scales the frame down, with
+ * the filter DXIFRSHIM_SIMULCAST_FILTER names (box, bilinear or lanczos2,
+ * the default; see FrameScaler.h), and an encoder session and output stream
+ * of its own. The encoder thread only copies the player's picture for them.
+ * A frame that arrives while a rendition is still scaling the last one is
+ * skipped by all the renditions, so a slow rendition lowers their frame rate
+ * and never the player's.
+ *
+ * A rendition's bitrate follows the player's target, scaled by its share of
+ * the pixels to the power of 3/4 since small pictures need more bits per
+ * pixel. The bandwidth allocator does not count the renditions.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "FrameScaler.h"
+#include "FrameTiler.h"
+#include "VideoEncoder.h"
+
+class MetricCounter;
+class MetricGauge;
+class MetricHistogram;
+
+#define SIMULCAST_ENV "DXIFRSHIM_SIMULCAST"
+#define SIMULCAST_FILTER_ENV "DXIFRSHIM_SIMULCAST_FILTER"
+
+#define SIMULCAST_MAX_RENDITIONS 3
+
+// Stream index of rendition r of player i is i + r * SIMULCAST_STREAM_STRIDE.
+#define SIMULCAST_STREAM_STRIDE 100
+
+// No rendition is asked for less.
+#define SIMULCAST_MIN_BITRATE 150000
+
+struct SimulcastRendition
+{
+    int     width;
+    int     height;
+};
+
+// Parses a ladder for a player of srcWidth x srcHeight into aRenditions,
+// which has room for SIMULCAST_MAX_RENDITIONS. Sizes are rounded down to even
+// and must be smaller than the player's, by at most SCALE_MAX_RATIO. Returns
+// the number of renditions, or 0, and says why on stderr, if the ladder is
+// wrong; an empty or NULL ladder is 0 renditions.
+int SimulcastParseLadder(const char *szLadder, int srcWidth, int srcHeight, SimulcastRendition *aRenditions);
+
+// Reads DXIFRSHIM_SIMULCAST_FILTER.
+ScaleFilter SimulcastGetFilter();
+
+// Bitrate of a rendition when the player is asked for playerBitrate.
+int SimulcastRenditionBitrate(int playerBitrate, int srcWidth, int srcHeight, const SimulcastRendition &rendition);
+
+class SimulcastStage
+{
+public:
+    SimulcastStage();
+    ~SimulcastStage();
+
+    // Starts the renditions of player index, whose pictures are srcWidth x
+    // srcHeight. Each thread creates its encoder with eBackend and opens its
+    // stream before Start returns. Returns false if a rendition could not
+    // start; none are left running then.
+    bool Start(int index, int srcWidth, int srcHeight, const SimulcastRendition *aRenditions, int nRenditions,
+               ScaleFilter eFilter, VideoEncoderBackend eBackend, int fps, int playerBitrate);
+
+    // Hands the player's picture for frame uFrame to the renditions, or
+    // returns false if they are still scaling the last one and skip it.
+    bool Submit(const YuvI420View &view, int playerBitrate, uint32_t uFrame);
+
+    // Waits until every frame handed over has been encoded.
+    void Flush();
+
+    // Encodes what was handed over, then shuts the encoders down.
+    void Stop();
+
+    int GetRenditionCount() const { return (int)m_aRenditions.size(); }
+    uint64_t GetSkippedFrames() const { return m_nSkipped; }
+
+    // Frames rendition r (from 0 here) has encoded, and its bitrate.
+    uint64_t GetEncodedFrames(int r);
+    int GetBitrate(int r);
+
+private:
+    struct Rendition
+    {
+        int                         iStream;
+        SimulcastRendition          size;
+        FrameScaler                 scaler;
+        std::vector<unsigned char>  aFrame;
+        IVideoEncoder              *pEncoder;
+        int                         bitrate;        // guarded by m_mutex
+        uint64_t                    nEncoded;       // guarded by m_mutex
+        std::thread                 thread;
+
+        MetricCounter              *pEncodedMetric;
+        MetricGauge                *pBitrateMetric;
+        MetricHistogram            *pScaleMetric;
+        MetricHistogram            *pEncodeMetric;
+    };
+
+    void RenditionLoop(Rendition *pRendition, VideoEncoderBackend eBackend, int fps);
+
+    int                         m_srcWidth;
+    int                         m_srcHeight;
+    std::vector<Rendition *>    m_aRenditions;
+    std::vector<unsigned char>  m_aSource;          // copy of the player's picture
+    YuvI420View                 m_source;
+
+    std::mutex                  m_mutex;
+    std::condition_variable     m_cvFrame;          // to the renditions
+    std::condition_variable     m_cvDone;           // from them
+    uint32_t                    m_uSeq;             // frames handed over
+    uint32_t                    m_uFrame;
+    int                         m_playerBitrate;
+    int                         m_nStarting;
+    int                         m_nFailed;
+    int                         m_nScaling;         // renditions still reading m_aSource
+    int                         m_nEncoding;        // renditions not done with the frame
+    bool                        m_bStop;
+    uint64_t                    m_nSkipped;
+    MetricCounter              *m_pSkippedMetric;
+
+    SimulcastStage(const SimulcastStage &);
+    SimulcastStage &operator=(const SimulcastStage &);
+};
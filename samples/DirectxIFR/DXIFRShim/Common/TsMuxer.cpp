@@ -0,0 +1,272 @@
+/*!
+ * \brief
+ * MPEG-2 transport stream muxer for one H.264 or HEVC elementary stream
+ *
+ * \file
+ *
+ * See TsMuxer.h.
+ */
+
+#include "TsMuxer.h"
+
+#include <string.h>
+
+#include "NalScanner.h"
+
+#define TS_HEADER_SIZE      4
+#define TS_PAYLOAD_SIZE     (TS_PACKET_SIZE - TS_HEADER_SIZE)
+
+// Adaptation field length byte, flags byte and PCR.
+#define TS_PCR_FIELD_SIZE   8
+
+#define PES_HEADER_SIZE     14
+
+#define H264_NAL_IDR        5
+#define H264_NAL_AUD        9
+#define HEVC_NAL_IRAP_FIRST 16
+#define HEVC_NAL_IRAP_LAST  21
+#define HEVC_NAL_AUD        35
+
+// Access unit delimiters allowing any slice type.
+static const uint8_t s_aH264Aud[] = { 0, 0, 0, 1, 0x09, 0xF0 };
+static const uint8_t s_aHevcAud[] = { 0, 0, 0, 1, 0x46, 0x01, 0x50 };
+
+uint32_t TsCrc32(const uint8_t *pData, size_t size)
+{
+    uint32_t uCrc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++)
+    {
+        uCrc ^= (uint32_t)pData[i] << 24;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            uCrc = (uCrc & 0x80000000) ? (uCrc << 1) ^ 0x04C11DB7 : uCrc << 1;
+        }
+    }
+    return uCrc;
+}
+
+// Calls pfn(nalType) for every NAL unit of an Annex-B buffer until it
+// returns true; returns whether it did.
+template<class F>
+static bool AnyNal(TsStreamType eStreamType, const uint8_t *pData, size_t size, F pfn)
+{
+    NalScanner scanner(pData, size);
+    const uint8_t *pNal;
+    size_t nalSize;
+    while (scanner.Next(&pNal, &nalSize))
+    {
+        int nalType = (eStreamType == TS_STREAM_HEVC) ? (pNal[0] >> 1) & 0x3F : pNal[0] & 0x1F;
+        if (pfn(nalType))
+            return true;
+    }
+    return false;
+}
+
+static bool IsKeyframeNal(TsStreamType eStreamType, int nalType)
+{
+    if (eStreamType == TS_STREAM_HEVC)
+        return nalType >= HEVC_NAL_IRAP_FIRST && nalType <= HEVC_NAL_IRAP_LAST;
+    return nalType == H264_NAL_IDR;
+}
+
+struct KeyframeNalTest
+{
+    TsStreamType eStreamType;
+    bool operator()(int nalType) const { return IsKeyframeNal(eStreamType, nalType); }
+};
+
+struct FirstNalTest
+{
+    int *pFirstType;
+    bool operator()(int nalType) const { *pFirstType = nalType; return true; }
+};
+
+bool TsMuxer::IsKeyframe(TsStreamType eStreamType, const uint8_t *pData, size_t size)
+{
+    KeyframeNalTest test = { eStreamType };
+    return AnyNal(eStreamType, pData, size, test);
+}
+
+TsMuxer::TsMuxer(TsStreamType eStreamType)
+{
+    m_eStreamType = eStreamType;
+    m_ccPat = 0;
+    m_ccPmt = 0;
+    m_ccVideo = 0;
+    m_bPsiSent = false;
+    m_lastPsiPts = 0;
+}
+
+static void PutTimestamp(uint8_t *p, uint8_t prefix, int64_t ts)
+{
+    p[0] = (uint8_t)(prefix | ((ts >> 29) & 0x0E) | 1);
+    p[1] = (uint8_t)(ts >> 22);
+    p[2] = (uint8_t)((ts >> 14) | 1);
+    p[3] = (uint8_t)(ts >> 7);
+    p[4] = (uint8_t)((ts << 1) | 1);
+}
+
+static void PutPcr(uint8_t *p, int64_t pcrBase)
+{
+    p[0] = (uint8_t)(pcrBase >> 25);
+    p[1] = (uint8_t)(pcrBase >> 17);
+    p[2] = (uint8_t)(pcrBase >> 9);
+    p[3] = (uint8_t)(pcrBase >> 1);
+    p[4] = (uint8_t)(((pcrBase & 1) << 7) | 0x7E);     // 6 reserved bits, extension 0
+    p[5] = 0;
+}
+
+void TsMuxer::WriteSection(uint16_t pid, uint8_t &cc, const uint8_t *pSection, size_t size, std::vector<uint8_t> &aOut)
+{
+    size_t offset = aOut.size();
+    aOut.resize(offset + TS_PACKET_SIZE, 0xFF);
+    uint8_t *p = &aOut[offset];
+    p[0] = TS_SYNC_BYTE;
+    p[1] = (uint8_t)(0x40 | (pid >> 8));
+    p[2] = (uint8_t)pid;
+    p[3] = (uint8_t)(0x10 | cc);
+    p[4] = 0;                                           // pointer_field
+    memcpy(p + 5, pSection, size);
+    cc = (cc + 1) & 0x0F;
+}
+
+void TsMuxer::WritePsi(std::vector<uint8_t> &aOut)
+{
+    uint8_t aPat[] =
+    {
+        0x00, 0xB0, 13,                                 // table_id, section_length
+        0x00, 0x01,                                     // transport_stream_id
+        0xC1, 0x00, 0x00,                               // version 0, current, section 0 of 0
+        (uint8_t)(TS_PROGRAM_NUMBER >> 8), (uint8_t)TS_PROGRAM_NUMBER,
+        (uint8_t)(0xE0 | (TS_PID_PMT >> 8)), (uint8_t)TS_PID_PMT,
+        0, 0, 0, 0,
+    };
+    uint8_t aPmt[] =
+    {
+        0x02, 0xB0, 18,
+        (uint8_t)(TS_PROGRAM_NUMBER >> 8), (uint8_t)TS_PROGRAM_NUMBER,
+        0xC1, 0x00, 0x00,
+        (uint8_t)(0xE0 | (TS_PID_VIDEO >> 8)), (uint8_t)TS_PID_VIDEO,  // PCR_PID
+        0xF0, 0x00,                                     // program_info_length
+        (uint8_t)m_eStreamType,
+        (uint8_t)(0xE0 | (TS_PID_VIDEO >> 8)), (uint8_t)TS_PID_VIDEO,
+        0xF0, 0x00,                                     // ES_info_length
+        0, 0, 0, 0,
+    };
+
+    uint8_t *aSections[] = { aPat, aPmt };
+    size_t aSizes[] = { sizeof(aPat), sizeof(aPmt) };
+    for (int i = 0; i < 2; i++)
+    {
+        uint32_t uCrc = TsCrc32(aSections[i], aSizes[i] - 4);
+        uint8_t *pCrc = aSections[i] + aSizes[i] - 4;
+        pCrc[0] = (uint8_t)(uCrc >> 24);
+        pCrc[1] = (uint8_t)(uCrc >> 16);
+        pCrc[2] = (uint8_t)(uCrc >> 8);
+        pCrc[3] = (uint8_t)uCrc;
+    }
+
+    WriteSection(TS_PID_PAT, m_ccPat, aPat, sizeof(aPat), aOut);
+    WriteSection(TS_PID_PMT, m_ccPmt, aPmt, sizeof(aPmt), aOut);
+}
+
+bool TsMuxer::MuxAccessUnit(const uint8_t *pData, size_t size, int64_t pts90k, std::vector<uint8_t> &aOut)
+{
+    bool bKeyframe = IsKeyframe(m_eStreamType, pData, size);
+    if (!m_bPsiSent || bKeyframe || pts90k - m_lastPsiPts >= (int64_t)TS_PSI_INTERVAL_MS * TS_CLOCK_HZ / 1000)
+    {
+        WritePsi(aOut);
+        m_bPsiSent = true;
+        m_lastPsiPts = pts90k;
+    }
+
+    // The PES header and, if needed, an access unit delimiter go in front of
+    // the access unit.
+    uint8_t aPrefix[PES_HEADER_SIZE + sizeof(s_aHevcAud)];
+    size_t prefixSize = PES_HEADER_SIZE;
+
+    int firstNalType = -1;
+    FirstNalTest firstNal = { &firstNalType };
+    AnyNal(m_eStreamType, pData, size, firstNal);
+    if (firstNalType != (m_eStreamType == TS_STREAM_HEVC ? HEVC_NAL_AUD : H264_NAL_AUD))
+    {
+        const uint8_t *pAud = (m_eStreamType == TS_STREAM_HEVC) ? s_aHevcAud : s_aH264Aud;
+        size_t audSize = (m_eStreamType == TS_STREAM_HEVC) ? sizeof(s_aHevcAud) : sizeof(s_aH264Aud);
+        memcpy(aPrefix + PES_HEADER_SIZE, pAud, audSize);
+        prefixSize += audSize;
+    }
+
+    int64_t pts = (pts90k + (int64_t)TS_PTS_DELAY_MS * TS_CLOCK_HZ / 1000) & 0x1FFFFFFFFLL;
+    int64_t pcrBase = pts90k & 0x1FFFFFFFFLL;
+
+    // PES_packet_length may be 0 (unbounded) for video when it does not fit.
+    size_t pesLength = prefixSize - 6 + size;
+    aPrefix[0] = 0;
+    aPrefix[1] = 0;
+    aPrefix[2] = 1;
+    aPrefix[3] = TS_STREAM_ID_VIDEO;
+    aPrefix[4] = pesLength > 0xFFFF ? 0 : (uint8_t)(pesLength >> 8);
+    aPrefix[5] = pesLength > 0xFFFF ? 0 : (uint8_t)pesLength;
+    aPrefix[6] = 0x84;                                  // data_alignment_indicator
+    aPrefix[7] = 0x80;                                  // PTS only
+    aPrefix[8] = 5;                                     // PES_header_data_length
+    PutTimestamp(aPrefix + 9, 0x20, pts);
+
+    size_t total = prefixSize + size;
+    size_t done = 0;
+    while (done < total)
+    {
+        bool bFirst = (done == 0);
+        size_t remaining = total - done;
+        size_t adaptationSize = bFirst ? TS_PCR_FIELD_SIZE : 0;
+        size_t payloadSize = TS_PAYLOAD_SIZE - adaptationSize;
+        if (remaining < payloadSize)
+        {
+            // Stuff the last packet through its adaptation field.
+            adaptationSize += payloadSize - remaining;
+            payloadSize = remaining;
+        }
+
+        size_t offset = aOut.size();
+        aOut.resize(offset + TS_PACKET_SIZE);
+        uint8_t *p = &aOut[offset];
+        p[0] = TS_SYNC_BYTE;
+        p[1] = (uint8_t)((bFirst ? 0x40 : 0) | (TS_PID_VIDEO >> 8));
+        p[2] = (uint8_t)TS_PID_VIDEO;
+        p[3] = (uint8_t)((adaptationSize ? 0x30 : 0x10) | m_ccVideo);
+        m_ccVideo = (m_ccVideo + 1) & 0x0F;
+        p += TS_HEADER_SIZE;
+
+        if (adaptationSize)
+        {
+            p[0] = (uint8_t)(adaptationSize - 1);
+            if (adaptationSize > 1)
+            {
+                p[1] = 0;
+                uint8_t *pStuffing = p + 2;
+                if (bFirst)
+                {
+                    p[1] = (uint8_t)(0x10 | (bKeyframe ? 0x40 : 0));
+                    PutPcr(p + 2, pcrBase);
+                    pStuffing += 6;
+                }
+                memset(pStuffing, 0xFF, p + adaptationSize - pStuffing);
+            }
+            p += adaptationSize;
+        }
+
+        // Payload: the rest of the prefix, then the access unit.
+        size_t fromPrefix = 0;
+        if (done < prefixSize)
+        {
+            fromPrefix = prefixSize - done < payloadSize ? prefixSize - done : payloadSize;
+            memcpy(p, aPrefix + done, fromPrefix);
+        }
+        if (payloadSize > fromPrefix)
+        {
+            memcpy(p + fromPrefix, pData + (done + fromPrefix - prefixSize), payloadSize - fromPrefix);
+        }
+        done += payloadSize;
+    }
+    return bKeyframe;
+}
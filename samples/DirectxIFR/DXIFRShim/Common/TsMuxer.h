@@ -0,0 +1,73 @@
+/*!
+ * \brief
+ * MPEG-2 transport stream muxer for one H.264 or HEVC elementary stream
+ *
+ * \file
+ *
+ * Each access unit becomes one PES packet with a PTS, split into 188 byte TS
+ * packets on TS_PID_VIDEO. The first TS packet of every PES carries the PCR
+ * in its adaptation field, flagged random access on IDR/IRAP pictures. A
+ * PAT and PMT go out before the first picture, before every keyframe and at
+ * least every TS_PSI_INTERVAL_MS so late joiners can start. An access unit
+ * delimiter is inserted when the encoder did not write one, as the TS
+ * mapping of H.264 and HEVC requires.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define TS_PACKET_SIZE      188
+#define TS_SYNC_BYTE        0x47
+
+#define TS_PID_PAT          0x0000
+#define TS_PID_PMT          0x1000
+#define TS_PID_VIDEO        0x0100
+#define TS_PROGRAM_NUMBER   1
+#define TS_STREAM_ID_VIDEO  0xE0
+
+// 90 kHz clock of PTS/DTS; PCR runs at 300 times that.
+#define TS_CLOCK_HZ         90000
+
+// PTS is this far ahead of PCR, which is how long the receiver buffers.
+#define TS_PTS_DELAY_MS     50
+
+#define TS_PSI_INTERVAL_MS  100
+
+enum TsStreamType
+{
+    TS_STREAM_H264 = 0x1B,
+    TS_STREAM_HEVC = 0x24,
+};
+
+// MPEG-2 CRC32 of PSI sections (polynomial 0x04C11DB7, no reflection).
+uint32_t TsCrc32(const uint8_t *pData, size_t size);
+
+class TsMuxer
+{
+public:
+    explicit TsMuxer(TsStreamType eStreamType = TS_STREAM_H264);
+
+    TsStreamType GetStreamType() const { return m_eStreamType; }
+
+    // Appends the TS packets of one Annex-B access unit to aOut. pts90k is
+    // the presentation time in 90 kHz units and must not go backwards.
+    // Returns whether the access unit is a keyframe.
+    bool MuxAccessUnit(const uint8_t *pData, size_t size, int64_t pts90k, std::vector<uint8_t> &aOut);
+
+    // True if the access unit holds an IDR (H.264) or IRAP (HEVC) picture.
+    static bool IsKeyframe(TsStreamType eStreamType, const uint8_t *pData, size_t size);
+
+private:
+    void WritePsi(std::vector<uint8_t> &aOut);
+    void WriteSection(uint16_t pid, uint8_t &cc, const uint8_t *pSection, size_t size, std::vector<uint8_t> &aOut);
+
+    TsStreamType    m_eStreamType;
+    uint8_t         m_ccPat;
+    uint8_t         m_ccPmt;
+    uint8_t         m_ccVideo;
+    bool            m_bPsiSent;
+    int64_t         m_lastPsiPts;
+};
@@ -66,30 +66,6 @@ HWND GetDeviceWindow(Vtbl &vtbl, Interface *This)
 	return dp.hDeviceWindow;
 }
 
-inline DWORD GetSleepTime(int nFrameRate)
-{
-	static DWORD tLast, tSleep;
-	static double dResidual;
-
-	if (nFrameRate <= 0 || nFrameRate > 1000) {
-		return 0;
-	}
-
-	DWORD t = timeGetTime();
-	double
-		dPeriod = 1000.0 / nFrameRate,
-		dSleep = dPeriod - (t - tLast - tSleep) + dResidual;
-	tSleep = (DWORD)dSleep;
-	if (tSleep > dPeriod) {
-		tSleep = (DWORD)dPeriod;
-		dResidual = 0;
-	} else {
-		dResidual = dSleep - tSleep;
-	}
-	tLast = t;
-	return tSleep;
-}
-
 inline BOOL WINAPI WaitOnAddress_BeforeWin8(
 	volatile VOID * Address,
 	PVOID CompareAddress,
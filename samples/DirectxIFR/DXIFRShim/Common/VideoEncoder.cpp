@@ -0,0 +1,61 @@
+/*!
+ * \brief
+ * Interface implemented by every encoder backend of the shim
+ *
+ * \file
+ *
+ * See VideoEncoder.h.
+ */
+
+#include "VideoEncoder.h"
+#include "NullVideoEncoder.h"
+#include "X264VideoEncoder.h"
+#if !defined(VIDEO_ENCODER_NO_NVENC)
+#include "../DXGI/NvEncoder.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char *s_aBackendNames[] = { "nvenc", "x264", "null" };
+
+VideoEncoderBackend GetVideoEncoderBackend()
+{
+    const char *szName = getenv(VIDEO_ENCODER_ENV);
+    if (szName)
+    {
+        for (int i = 0; i < (int)(sizeof(s_aBackendNames) / sizeof(s_aBackendNames[0])); i++)
+        {
+            if (!strcmp(szName, s_aBackendNames[i]))
+                return (VideoEncoderBackend)i;
+        }
+    }
+    return DEFAULT_VIDEO_ENCODER;
+}
+
+const char *GetVideoEncoderBackendName(VideoEncoderBackend eBackend)
+{
+    if (eBackend < 0 || eBackend >= (int)(sizeof(s_aBackendNames) / sizeof(s_aBackendNames[0])))
+        return "unknown";
+    return s_aBackendNames[eBackend];
+}
+
+IVideoEncoder *CreateVideoEncoder(VideoEncoderBackend eBackend, int index)
+{
+    (void)index;    // only NVENC sessions are per player
+    switch (eBackend)
+    {
+#if !defined(VIDEO_ENCODER_NO_NVENC)
+    case VIDEO_ENCODER_NVENC:
+        return new CNvEncoder(index);
+#endif
+#if defined(VIDEO_ENCODER_WITH_X264)
+    case VIDEO_ENCODER_X264:
+        return new CX264Encoder();
+#endif
+    case VIDEO_ENCODER_NULL:
+        return new CNullEncoder();
+    default:
+        return NULL;
+    }
+}
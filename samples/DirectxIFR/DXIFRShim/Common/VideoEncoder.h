@@ -0,0 +1,73 @@
+/*!
+ * \brief
+ * Interface implemented by every encoder backend of the shim
+ *
+ * \file
+ *
+ * The encoder thread only talks to IVideoEncoder, so the NVENC encoder can be
+ * swapped for a CPU one, or for a null encoder that produces a valid stream
+ * without touching the frame. The backend is picked with the DXIFRSHIM_ENCODER
+ * environment variable ("nvenc", "x264" or "null"); the last two run on
+ * machines without an NVIDIA GPU.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VIDEO_ENCODER_ENV "DXIFRSHIM_ENCODER"
+
+struct YuvI420View;
+
+typedef enum _VideoEncoderBackend
+{
+    VIDEO_ENCODER_NVENC = 0,
+    VIDEO_ENCODER_X264,
+    VIDEO_ENCODER_NULL,
+}VideoEncoderBackend;
+
+// Backend used when DXIFRSHIM_ENCODER is not set or not recognized.
+#define DEFAULT_VIDEO_ENCODER VIDEO_ENCODER_NVENC
+
+class IVideoEncoder
+{
+public:
+    virtual ~IVideoEncoder() {}
+
+    // Creates the encoder for player index and opens its output stream (see
+    // BitstreamOutput.h). Backends that can encode straight from the capture
+    // buffers may register ppCaptureBuffers. Returns 0 on success.
+    virtual int  EncodeMain(int index, int width, int height, int fps, int initialBitrate,
+                            uint8_t **ppCaptureBuffers = NULL, int nCaptureBuffers = 0) = 0;
+
+    // Encodes one I420 frame with pitch == width and writes it to the output.
+    // If isReconfiguringBitrate is set, later frames use targetBitrate.
+    virtual void EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, int index, int targetBitrate) = 0;
+
+    // Same, for a picture that may be a tile of a larger frame (see
+    // FrameTiler.h); it must be the size given to EncodeMain. Only the view
+    // is read, straight into the encoder's input.
+    virtual void EncodeView(const YuvI420View &view, bool isReconfiguringBitrate, int index, int targetBitrate) = 0;
+
+    // Called instead of EncodeFrameLoop when the frame is the same as the last
+    // one. Returns false if it has to be encoded anyway, for instance because
+    // a viewer is waiting for a keyframe.
+    virtual bool SkipFrame(int index) = 0;
+
+    // Tiles of the next frame that changed, one byte per TILE_HASH_SIZE tile
+    // row by row (see TileHash.h). Backends may ignore it.
+    virtual void SetChangedTiles(const uint8_t * /*pDirtyMask*/, int /*nTilesX*/, int /*nTilesY*/) {}
+
+    // Flushes the encoder and closes the output stream.
+    virtual void Shutdown() = 0;
+};
+
+// Reads DXIFRSHIM_ENCODER.
+VideoEncoderBackend GetVideoEncoderBackend();
+const char *GetVideoEncoderBackendName(VideoEncoderBackend eBackend);
+
+// Returns NULL if the backend was not built in. NVENC is left out when
+// VIDEO_ENCODER_NO_NVENC is defined, and x264 (through libavcodec) is only
+// built when VIDEO_ENCODER_WITH_X264 is defined.
+IVideoEncoder *CreateVideoEncoder(VideoEncoderBackend eBackend, int index);
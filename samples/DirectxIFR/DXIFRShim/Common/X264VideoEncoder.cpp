@@ -0,0 +1,193 @@
+/*!
+ * \brief
+ * CPU encoder backend using libx264 through libavcodec
+ *
+ * \file
+ *
+ * See X264VideoEncoder.h.
+ */
+
+#if defined(VIDEO_ENCODER_WITH_X264)
+
+#include "X264VideoEncoder.h"
+#include "BitstreamOutput.h"
+#include "FrameTiler.h"
+
+#include <limits.h>
+#include <mutex>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+#if defined(_MSC_VER)
+#pragma comment(lib, "avcodec.lib")
+#pragma comment(lib, "avutil.lib")
+#endif
+
+static std::mutex s_registerMutex;
+static bool s_bRegistered = false;
+
+CX264Encoder::CX264Encoder()
+{
+    m_pOutput = NULL;
+    m_pContext = NULL;
+    m_pFrame = NULL;
+    m_pPacket = NULL;
+    m_iPts = 0;
+}
+
+CX264Encoder::~CX264Encoder()
+{
+    Shutdown();
+}
+
+int CX264Encoder::EncodeMain(int index, int width, int height, int fps, int initialBitrate,
+                             uint8_t **ppCaptureBuffers, int nCaptureBuffers)
+{
+    {
+        std::lock_guard<std::mutex> lock(s_registerMutex);
+        if (!s_bRegistered)
+        {
+            avcodec_register_all();
+            s_bRegistered = true;
+        }
+    }
+
+    AVCodec *pCodec = avcodec_find_encoder_by_name("libx264");
+    if (!pCodec)
+        pCodec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!pCodec)
+        return 1;
+
+    m_pContext = avcodec_alloc_context3(pCodec);
+    m_pFrame = av_frame_alloc();
+    m_pPacket = av_packet_alloc();
+    if (!m_pContext || !m_pFrame || !m_pPacket)
+    {
+        Shutdown();
+        return 1;
+    }
+
+    AVRational timeBase = { 1, fps };
+    AVRational frameRate = { fps, 1 };
+    m_pContext->width = width;
+    m_pContext->height = height;
+    m_pContext->pix_fmt = AV_PIX_FMT_YUV420P;
+    m_pContext->time_base = timeBase;
+    m_pContext->framerate = frameRate;
+    m_pContext->gop_size = INT_MAX;
+    m_pContext->max_b_frames = 0;
+    m_pContext->thread_count = X264_ENCODER_THREADS;
+    SetBitrate(initialBitrate);
+
+    av_opt_set(m_pContext->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(m_pContext->priv_data, "tune", "zerolatency", 0);
+
+    if (avcodec_open2(m_pContext, pCodec, NULL) < 0)
+    {
+        Shutdown();
+        return 1;
+    }
+
+    m_pFrame->format = AV_PIX_FMT_YUV420P;
+    m_pFrame->width = width;
+    m_pFrame->height = height;
+    m_pFrame->linesize[0] = width;
+    m_pFrame->linesize[1] = width / 2;
+    m_pFrame->linesize[2] = width / 2;
+    m_iPts = 0;
+
+    m_pOutput = OpenBitstreamOutput(index);
+    if (!m_pOutput)
+    {
+        Shutdown();
+        return 1;
+    }
+    return 0;
+}
+
+// One frame of VBV, as low latency NVENC presets do. libavcodec reconfigures
+// libx264 on the next frame when these change.
+void CX264Encoder::SetBitrate(int bitrate)
+{
+    m_pContext->bit_rate = bitrate;
+    m_pContext->rc_max_rate = bitrate;
+    m_pContext->rc_buffer_size = (int)(bitrate / m_pContext->time_base.den);
+}
+
+void CX264Encoder::WritePackets()
+{
+    while (avcodec_receive_packet(m_pContext, m_pPacket) == 0)
+    {
+        if (m_pOutput)
+        {
+            m_pOutput->WriteAccessUnit(m_pPacket->data, m_pPacket->size);
+        }
+        av_packet_unref(m_pPacket);
+    }
+}
+
+void CX264Encoder::EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, int index, int targetBitrate)
+{
+    if (!m_pContext)
+        return;
+
+    EncodeView(YuvFrameView(buffer, m_pContext->width, m_pContext->height), isReconfiguringBitrate, index, targetBitrate);
+}
+
+void CX264Encoder::EncodeView(const YuvI420View &view, bool isReconfiguringBitrate, int index, int targetBitrate)
+{
+    if (!m_pContext)
+        return;
+
+    // The frame points into the capture buffer; libavcodec copies it because
+    // it is not reference counted.
+    m_pFrame->data[0] = (uint8_t *)view.pY;
+    m_pFrame->data[1] = (uint8_t *)view.pU;
+    m_pFrame->data[2] = (uint8_t *)view.pV;
+    m_pFrame->linesize[0] = view.strideY;
+    m_pFrame->linesize[1] = view.strideUV;
+    m_pFrame->linesize[2] = view.strideUV;
+    m_pFrame->pts = m_iPts++;
+    // An I picture becomes an IDR, since the GOP is closed.
+    m_pFrame->pict_type = (m_pOutput && m_pOutput->TakeKeyframeRequest()) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+    if (avcodec_send_frame(m_pContext, m_pFrame) == 0)
+    {
+        WritePackets();
+    }
+
+    if (isReconfiguringBitrate)
+    {
+        SetBitrate(targetBitrate);
+    }
+}
+
+bool CX264Encoder::SkipFrame(int index)
+{
+    return !m_pOutput || !m_pOutput->IsKeyframeRequested();
+}
+
+void CX264Encoder::Shutdown()
+{
+    if (m_pContext && avcodec_is_open(m_pContext))
+    {
+        avcodec_send_frame(m_pContext, NULL);
+        WritePackets();
+    }
+
+    avcodec_free_context(&m_pContext);
+    av_frame_free(&m_pFrame);
+    av_packet_free(&m_pPacket);
+
+    if (m_pOutput)
+    {
+        CloseBitstreamOutput(m_pOutput);
+        m_pOutput = NULL;
+    }
+}
+
+#endif
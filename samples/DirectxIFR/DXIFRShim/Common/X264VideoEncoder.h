@@ -0,0 +1,48 @@
+/*!
+ * \brief
+ * CPU encoder backend using libx264 through libavcodec
+ *
+ * \file
+ *
+ * Configured like the x264 command lines in StreamerFile: ultrafast preset,
+ * zerolatency tune, no B frames and an infinite GOP to match the NVENC setup.
+ * Only built when VIDEO_ENCODER_WITH_X264 is defined, since it makes the shim
+ * depend on the FFmpeg DLLs. Falls back to any other H.264 encoder libavcodec
+ * was built with if libx264 is missing.
+ */
+
+#pragma once
+
+#include "VideoEncoder.h"
+
+// Threads libx264 may use per player; 0 lets it decide.
+#define X264_ENCODER_THREADS 1
+
+class BitstreamOutput;
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+
+class CX264Encoder : public IVideoEncoder
+{
+public:
+    CX264Encoder();
+    virtual ~CX264Encoder();
+
+    virtual int  EncodeMain(int index, int width, int height, int fps, int initialBitrate,
+                            uint8_t **ppCaptureBuffers = NULL, int nCaptureBuffers = 0);
+    virtual void EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, int index, int targetBitrate);
+    virtual void EncodeView(const YuvI420View &view, bool isReconfiguringBitrate, int index, int targetBitrate);
+    virtual bool SkipFrame(int index);
+    virtual void Shutdown();
+
+private:
+    void SetBitrate(int bitrate);
+    void WritePackets();
+
+    BitstreamOutput *m_pOutput;
+    AVCodecContext  *m_pContext;
+    AVFrame         *m_pFrame;
+    AVPacket        *m_pPacket;
+    int64_t          m_iPts;
+};
@@ -9,6 +9,8 @@
  *
  */
 
+#pragma once
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
@@ -74,8 +76,22 @@ typedef struct _EncodeConfig
     char *encCmdFileName;
     int  enableMEOnly;
     int  preloadedFrameCount;
+    int  convertThreads;
+    int  zeroCopyInput;
+    int  encodeQueueDepth;
+    int  runtimeQpDeltaMap;
 }EncodeConfig;
 
+// Who owns an EncodeInputBuffer and what it is doing; see EncodeInputBinder.
+typedef enum _EncodeInputState
+{
+    ENCODE_INPUT_EMPTY = 0,             // nothing allocated or registered
+    ENCODE_INPUT_OWNED,                 // NvEncCreateInputBuffer, frame gets copied in
+    ENCODE_INPUT_OWNED_LOCKED,          // owned and locked for CPU writes
+    ENCODE_INPUT_REGISTERED,            // borrowed host buffer, registered but not mapped
+    ENCODE_INPUT_MAPPED,                // borrowed and mapped into hInputSurface
+}EncodeInputState;
+
 typedef struct _EncodeInputBuffer
 {
     unsigned int      dwWidth;
@@ -90,6 +106,9 @@ typedef struct _EncodeInputBuffer
     void*             nvRegisteredResource;
     NV_ENC_INPUT_PTR  hInputSurface;
     NV_ENC_BUFFER_FORMAT bufferFmt;
+    uint8_t          *pHostBuffer;
+    uint32_t          uHostPitch;
+    EncodeInputState  eState;
 }EncodeInputBuffer;
 
 typedef struct _EncodeOutputBuffer
@@ -99,6 +118,7 @@ typedef struct _EncodeOutputBuffer
     HANDLE                hOutputEvent;
     bool                  bWaitOnEvent;
     bool                  bEOSFlag;
+    uint32_t              uTraceFrame;      // frame of the trace events of whichever thread drains it
 }EncodeOutputBuffer;
 
 typedef struct _EncodeBuffer
@@ -143,12 +163,15 @@ struct MEOnlyConfig
     unsigned int referenceFrameIndex;
 };
 
+class BitstreamOutput;
+
 class CNvHWEncoder
 {
 public:
     uint32_t                                             m_EncodeIdx;
-    //FILE                                                *m_fOutput;
-    FILE                                                *m_fOutputArray[4];
+    // The output of the player the session serves, NULL between players.
+    FILE                                                *m_fOutput;
+    BitstreamOutput                                     *m_pOutput;
     uint32_t                                             m_uMaxWidth;
     uint32_t                                             m_uMaxHeight;
     uint32_t                                             m_uCurWidth;
@@ -196,7 +219,7 @@ public:
     NVENCSTATUS NvEncDestroyEncoder();
     NVENCSTATUS NvEncInvalidateRefFrames(const NvEncPictureCommand *pEncPicCommand);
     NVENCSTATUS NvEncOpenEncodeSessionEx(void* device, NV_ENC_DEVICE_TYPE deviceType);
-    NVENCSTATUS NvEncRegisterResource(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resourceToRegister, uint32_t width, uint32_t height, uint32_t pitch, void** registeredResource);
+    NVENCSTATUS NvEncRegisterResource(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resourceToRegister, uint32_t width, uint32_t height, uint32_t pitch, void** registeredResource, NV_ENC_BUFFER_FORMAT bufferFormat = NV_ENC_BUFFER_FORMAT_NV12_PL);
     NVENCSTATUS NvEncUnregisterResource(NV_ENC_REGISTERED_PTR registeredRes);
     NVENCSTATUS NvEncReconfigureEncoder(const NvEncPictureCommand *pEncPicCommand);
     NVENCSTATUS NvEncFlushEncoderQueue(void *hEOSEvent);
@@ -209,9 +232,16 @@ public:
                                                                           uint32_t width, uint32_t height,
                                                                           NV_ENC_PIC_STRUCT ePicStruct = NV_ENC_PIC_STRUCT_FRAME,
                                                                           int8_t *qpDeltaMapArray = NULL, uint32_t qpDeltaMapArraySize = 0);
+    // index < 0 leaves the session without an output until AttachOutput.
     NVENCSTATUS                                          CreateEncoder(const EncodeConfig *pEncCfg, int index);
+    NVENCSTATUS                                          AttachOutput(int index, const EncodeConfig *pEncCfg);
+    void                                                 DetachOutput();
+    // Hands the current SPS and PPS to the output, e.g. after a resolution
+    // change. Not while the output is writing.
+    void                                                 RefreshParameterSets();
+    NVENCSTATUS                                          ResetEncoder(const EncodeConfig *pEncCfg);
     GUID                                                 GetPresetGUID(char* encoderPreset, int codec);
-    NVENCSTATUS                                          ProcessOutput(const EncodeBuffer *pEncodeBuffer, int index);
+    NVENCSTATUS                                          ProcessOutput(const EncodeBuffer *pEncodeBuffer);
     NVENCSTATUS                                          FlushEncoder();
     NVENCSTATUS                                          ValidateEncodeGUID(GUID inputCodecGuid);
     NVENCSTATUS                                          ValidatePresetGUID(GUID presetCodecGuid, GUID inputCodecGuid);
@@ -10,16 +10,12 @@
  */
 
 #include "../inc/NvHWEncoder.h"
+#include "../BitstreamOutput.h"
+#include "../Logger.h"
+#include "FrameTrace.h"
 
-#include <iostream>
-#include <fstream>
-#include <sstream>
-
-std::ofstream NvHWEncoderLogFile;
-
-// Host IP address
-const std::string streamingIP = "http://magam001.d1.comp.nus.edu.sg:";
-const int firstPort = 30000;
+// Opened (and emptied) when the module loads; written by the log thread.
+simplelogger::Logger *NvHWEncoderLogger = simplelogger::LoggerFactory::CreateFileLogger("NvHWEncoderLogFile.txt");
 
 NVENCSTATUS CNvHWEncoder::NvEncOpenEncodeSession(void* device, uint32_t deviceType)
 {
@@ -28,9 +24,7 @@ NVENCSTATUS CNvHWEncoder::NvEncOpenEncodeSession(void* device, uint32_t deviceTy
     nvStatus = m_pEncodeAPI->nvEncOpenEncodeSession(device, deviceType, &m_hEncoder);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->NvEncOpenEncodeSession\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->NvEncOpenEncodeSession");
         assert(0);
     }
 
@@ -44,9 +38,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetEncodeGUIDCount(uint32_t* encodeGUIDCount)
     nvStatus = m_pEncodeAPI->nvEncGetEncodeGUIDCount(m_hEncoder, encodeGUIDCount);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->NvEncGetEncodeGUIDCount\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->NvEncGetEncodeGUIDCount");
         assert(0);
     }
 
@@ -60,9 +52,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetEncodeProfileGUIDCount(GUID encodeGUID, uint32
     nvStatus = m_pEncodeAPI->nvEncGetEncodeProfileGUIDCount(m_hEncoder, encodeGUID, encodeProfileGUIDCount);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->NvEncGetEncodeProfileGUIDCount\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->NvEncGetEncodeProfileGUIDCount");
         assert(0);
     }
 
@@ -76,9 +66,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetEncodeProfileGUIDs(GUID encodeGUID, GUID* prof
     nvStatus = m_pEncodeAPI->nvEncGetEncodeProfileGUIDs(m_hEncoder, encodeGUID, profileGUIDs, guidArraySize, GUIDCount);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->NvEncGetEncodeProfileGUIDs\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->NvEncGetEncodeProfileGUIDs");
         assert(0);
     }
 
@@ -92,9 +80,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetEncodeGUIDs(GUID* GUIDs, uint32_t guidArraySiz
     nvStatus = m_pEncodeAPI->nvEncGetEncodeGUIDs(m_hEncoder, GUIDs, guidArraySize, GUIDCount);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->NvEncGetEncodeGUIDs\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->NvEncGetEncodeGUIDs");
         assert(0);
     }
 
@@ -108,9 +94,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetInputFormatCount(GUID encodeGUID, uint32_t* in
     nvStatus = m_pEncodeAPI->nvEncGetInputFormatCount(m_hEncoder, encodeGUID, inputFmtCount);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->NvEncGetInputFormatCount\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->NvEncGetInputFormatCount");
         assert(0);
     }
 
@@ -124,9 +108,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetInputFormats(GUID encodeGUID, NV_ENC_BUFFER_FO
     nvStatus = m_pEncodeAPI->nvEncGetInputFormats(m_hEncoder, encodeGUID, inputFmts, inputFmtArraySize, inputFmtCount);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->NvEncGetInputFormats\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->NvEncGetInputFormats");
         assert(0);
     }
 
@@ -140,9 +122,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetEncodeCaps(GUID encodeGUID, NV_ENC_CAPS_PARAM*
     nvStatus = m_pEncodeAPI->nvEncGetEncodeCaps(m_hEncoder, encodeGUID, capsParam, capsVal);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->NvEncGetEncodeCaps\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->NvEncGetEncodeCaps");
         assert(0);
     }
 
@@ -156,9 +136,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetEncodePresetCount(GUID encodeGUID, uint32_t* e
     nvStatus = m_pEncodeAPI->nvEncGetEncodePresetCount(m_hEncoder, encodeGUID, encodePresetGUIDCount);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncGetEncodePresetCount\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncGetEncodePresetCount");
         assert(0);
     }
 
@@ -172,9 +150,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetEncodePresetGUIDs(GUID encodeGUID, GUID* prese
     nvStatus = m_pEncodeAPI->nvEncGetEncodePresetGUIDs(m_hEncoder, encodeGUID, presetGUIDs, guidArraySize, encodePresetGUIDCount);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncGetEncodePresetGUIDs\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncGetEncodePresetGUIDs");
         assert(0);
     }
 
@@ -188,9 +164,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetEncodePresetConfig(GUID encodeGUID, GUID  pres
     nvStatus = m_pEncodeAPI->nvEncGetEncodePresetConfig(m_hEncoder, encodeGUID, presetGUID, presetConfig);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncGetEncodePresetConfig\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncGetEncodePresetConfig");
         assert(0);
     }
 
@@ -213,9 +187,7 @@ NVENCSTATUS CNvHWEncoder::NvEncCreateInputBuffer(uint32_t width, uint32_t height
     nvStatus = m_pEncodeAPI->nvEncCreateInputBuffer(m_hEncoder, &createInputBufferParams);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncCreateInputBuffer\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncCreateInputBuffer");
         assert(0);
     }
 
@@ -233,9 +205,7 @@ NVENCSTATUS CNvHWEncoder::NvEncDestroyInputBuffer(NV_ENC_INPUT_PTR inputBuffer)
         nvStatus = m_pEncodeAPI->nvEncDestroyInputBuffer(m_hEncoder, inputBuffer);
         if (nvStatus != NV_ENC_SUCCESS)
         {
-            NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-            NvHWEncoderLogFile << "m_pEncodeAPI->nvEncDestroyInputBuffer\n";
-            NvHWEncoderLogFile.close();
+            LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncDestroyInputBuffer");
             assert(0);
         }
     }
@@ -252,9 +222,7 @@ NVENCSTATUS CNvHWEncoder::NvEncCreateMVBuffer(uint32_t size, void** bitstreamBuf
     status = m_pEncodeAPI->nvEncCreateMVBuffer(m_hEncoder, &stAllocMVBuffer);
     if (status != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncCreateMVBuffer\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncCreateMVBuffer");
         assert(0);
     }
     *bitstreamBuffer = stAllocMVBuffer.MVBuffer;
@@ -270,9 +238,7 @@ NVENCSTATUS CNvHWEncoder::NvEncDestroyMVBuffer(NV_ENC_OUTPUT_PTR bitstreamBuffer
     status = m_pEncodeAPI->nvEncDestroyMVBuffer(m_hEncoder, bitstreamBuffer);
     if (status != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncDestroyMVBuffer\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncDestroyMVBuffer");
         assert(0);
     }
     bitstreamBuffer = NULL;
@@ -292,19 +258,19 @@ NVENCSTATUS CNvHWEncoder::NvRunMotionEstimationOnly(EncodeBuffer *pEncodeBuffer[
     stMEOnlyParams.outputMV = pEncodeBuffer[0]->stOutputBfr.hBitstreamBuffer;
     nvStatus = m_pEncodeAPI->nvEncRunMotionEstimationOnly(m_hEncoder, &stMEOnlyParams);
 
-    if (m_fOutputArray[0])
+    if (m_fOutput)
     {
         unsigned int numMBs = ((m_uMaxWidth +15) >> 4) * ((m_uMaxHeight + 15) >> 4);
-        fprintf(m_fOutputArray[0], "Motion Vectors for input frame = %d, reference frame = %d\n", pMEOnly->inputFrameIndex, pMEOnly->referenceFrameIndex);
+        fprintf(m_fOutput, "Motion Vectors for input frame = %d, reference frame = %d\n", pMEOnly->inputFrameIndex, pMEOnly->referenceFrameIndex);
         NV_ENC_H264_MV_DATA *outputMV = (NV_ENC_H264_MV_DATA *)stMEOnlyParams.outputMV;
         for (unsigned int i = 0; i < numMBs; i++)
         {
-            fprintf(m_fOutputArray[0], "block = %d, mb_type = %d, partitionType = %d, MV[0].x = %d, MV[0].y = %d, MV[1].x = %d, MV[1].y = %d, MV[2].x = %d, MV[2].y = %d, MV[3].x = %d, MV[3].y = %d, cost=%d ", \
+            fprintf(m_fOutput, "block = %d, mb_type = %d, partitionType = %d, MV[0].x = %d, MV[0].y = %d, MV[1].x = %d, MV[1].y = %d, MV[2].x = %d, MV[2].y = %d, MV[3].x = %d, MV[3].y = %d, cost=%d ", \
                 i, outputMV[i].mb_type, outputMV[i].partitionType, outputMV[i].MV[0].mvx, outputMV[i].MV[0].mvy, outputMV[i].MV[1].mvx, outputMV[i].MV[1].mvy, \
                 outputMV[i].MV[2].mvx, outputMV[i].MV[2].mvy, outputMV[i].MV[3].mvx, outputMV[i].MV[3].mvy, outputMV[i].MBCost);
-            fprintf(m_fOutputArray[0], "\n");
+            fprintf(m_fOutput, "\n");
         }
-        fprintf(m_fOutputArray[0], "\n");
+        fprintf(m_fOutput, "\n");
     }
     return nvStatus;
 }
@@ -323,9 +289,7 @@ NVENCSTATUS CNvHWEncoder::NvEncCreateBitstreamBuffer(uint32_t size, void** bitst
     nvStatus = m_pEncodeAPI->nvEncCreateBitstreamBuffer(m_hEncoder, &createBitstreamBufferParams);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncCreateBitstreamBuffer\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncCreateBitstreamBuffer");
         assert(0);
     }
 
@@ -343,9 +307,7 @@ NVENCSTATUS CNvHWEncoder::NvEncDestroyBitstreamBuffer(NV_ENC_OUTPUT_PTR bitstrea
         nvStatus = m_pEncodeAPI->nvEncDestroyBitstreamBuffer(m_hEncoder, bitstreamBuffer);
         if (nvStatus != NV_ENC_SUCCESS)
         {
-            NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-            NvHWEncoderLogFile << "m_pEncodeAPI->nvEncDestroyBitstreamBuffer\n";
-            NvHWEncoderLogFile.close();
+            LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncDestroyBitstreamBuffer");
             assert(0);
         }
     }
@@ -360,9 +322,7 @@ NVENCSTATUS CNvHWEncoder::NvEncLockBitstream(NV_ENC_LOCK_BITSTREAM* lockBitstrea
     nvStatus = m_pEncodeAPI->nvEncLockBitstream(m_hEncoder, lockBitstreamBufferParams);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncLockBitstream\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncLockBitstream");
         assert(0);
     }
 
@@ -376,9 +336,7 @@ NVENCSTATUS CNvHWEncoder::NvEncUnlockBitstream(NV_ENC_OUTPUT_PTR bitstreamBuffer
     nvStatus = m_pEncodeAPI->nvEncUnlockBitstream(m_hEncoder, bitstreamBuffer);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncUnlockBitstream\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncUnlockBitstream");
         assert(0);
     }
 
@@ -397,9 +355,7 @@ NVENCSTATUS CNvHWEncoder::NvEncLockInputBuffer(void* inputBuffer, void** bufferD
     nvStatus = m_pEncodeAPI->nvEncLockInputBuffer(m_hEncoder, &lockInputBufferParams);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncLockInputBuffer\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncLockInputBuffer");
         assert(0);
     }
 
@@ -416,9 +372,7 @@ NVENCSTATUS CNvHWEncoder::NvEncUnlockInputBuffer(NV_ENC_INPUT_PTR inputBuffer)
     nvStatus = m_pEncodeAPI->nvEncUnlockInputBuffer(m_hEncoder, inputBuffer);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncUnlockInputBuffer\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncUnlockInputBuffer");
         assert(0);
     }
 
@@ -432,9 +386,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetEncodeStats(NV_ENC_STAT* encodeStats)
     nvStatus = m_pEncodeAPI->nvEncGetEncodeStats(m_hEncoder, encodeStats);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncGetEncodeStats\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncGetEncodeStats");
         assert(0);
     }
 
@@ -448,9 +400,7 @@ NVENCSTATUS CNvHWEncoder::NvEncGetSequenceParams(NV_ENC_SEQUENCE_PARAM_PAYLOAD*
     nvStatus = m_pEncodeAPI->nvEncGetSequenceParams(m_hEncoder, sequenceParamPayload);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncGetSequenceParams\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncGetSequenceParams");
         assert(0);
     }
 
@@ -473,9 +423,7 @@ NVENCSTATUS CNvHWEncoder::NvEncRegisterAsyncEvent(void** completionEvent)
     nvStatus = m_pEncodeAPI->nvEncRegisterAsyncEvent(m_hEncoder, &eventParams);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncRegisterAsyncEvent\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncRegisterAsyncEvent");
         assert(0);
     }
 
@@ -499,9 +447,7 @@ NVENCSTATUS CNvHWEncoder::NvEncUnregisterAsyncEvent(void* completionEvent)
         nvStatus = m_pEncodeAPI->nvEncUnregisterAsyncEvent(m_hEncoder, &eventParams);
         if (nvStatus != NV_ENC_SUCCESS)
         {
-            NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-            NvHWEncoderLogFile << "m_pEncodeAPI->nvEncUnregisterAsyncEvent\n";
-            NvHWEncoderLogFile.close();
+            LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncUnregisterAsyncEvent");
             assert(0);
         }
     }
@@ -522,9 +468,7 @@ NVENCSTATUS CNvHWEncoder::NvEncMapInputResource(void* registeredResource, void**
     nvStatus = m_pEncodeAPI->nvEncMapInputResource(m_hEncoder, &mapInputResParams);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncMapInputResource\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncMapInputResource");
         assert(0);
     }
 
@@ -542,9 +486,7 @@ NVENCSTATUS CNvHWEncoder::NvEncUnmapInputResource(NV_ENC_INPUT_PTR mappedInputBu
         nvStatus = m_pEncodeAPI->nvEncUnmapInputResource(m_hEncoder, mappedInputBuffer);
         if (nvStatus != NV_ENC_SUCCESS)
         {
-            NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-            NvHWEncoderLogFile << "m_pEncodeAPI->nvEncUnmapInputResource\n";
-            NvHWEncoderLogFile.close();
+            LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncUnmapInputResource");
             assert(0);
         }
     }
@@ -594,16 +536,14 @@ NVENCSTATUS CNvHWEncoder::NvEncOpenEncodeSessionEx(void* device, NV_ENC_DEVICE_T
     nvStatus = m_pEncodeAPI->nvEncOpenEncodeSessionEx(&openSessionExParams, &m_hEncoder);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncOpenEncodeSessionEx\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncOpenEncodeSessionEx");
         assert(0);
     }
 
     return nvStatus;
 }
 
-NVENCSTATUS CNvHWEncoder::NvEncRegisterResource(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resourceToRegister, uint32_t width, uint32_t height, uint32_t pitch, void** registeredResource)
+NVENCSTATUS CNvHWEncoder::NvEncRegisterResource(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resourceToRegister, uint32_t width, uint32_t height, uint32_t pitch, void** registeredResource, NV_ENC_BUFFER_FORMAT bufferFormat)
 {
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
     NV_ENC_REGISTER_RESOURCE registerResParams;
@@ -616,15 +556,13 @@ NVENCSTATUS CNvHWEncoder::NvEncRegisterResource(NV_ENC_INPUT_RESOURCE_TYPE resou
     registerResParams.width = width;
     registerResParams.height = height;
     registerResParams.pitch = pitch;
-    registerResParams.bufferFormat = NV_ENC_BUFFER_FORMAT_NV12_PL;
+    registerResParams.bufferFormat = bufferFormat;
 
     nvStatus = m_pEncodeAPI->nvEncRegisterResource(m_hEncoder, &registerResParams);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncRegisterResource\n";
-        NvHWEncoderLogFile.close();
-        assert(0);
+        // No assert: callers fall back to copying into owned input buffers.
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncRegisterResource");
     }
 
     *registeredResource = registerResParams.registeredResource;
@@ -639,9 +577,7 @@ NVENCSTATUS CNvHWEncoder::NvEncUnregisterResource(NV_ENC_REGISTERED_PTR register
     nvStatus = m_pEncodeAPI->nvEncUnregisterResource(m_hEncoder, registeredRes);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncUnregisterResource\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncUnregisterResource");
         assert(0);
     }
 
@@ -654,15 +590,17 @@ NVENCSTATUS CNvHWEncoder::NvEncReconfigureEncoder(const NvEncPictureCommand *pEn
 
     if (pEncPicCommand->bBitrateChangePending || pEncPicCommand->bResolutionChangePending)
     {
+        uint32_t uLastWidth = m_uCurWidth;
+        uint32_t uLastHeight = m_uCurHeight;
         if (pEncPicCommand->bResolutionChangePending)
         {
             m_uCurWidth = pEncPicCommand->newWidth;
             m_uCurHeight = pEncPicCommand->newHeight;
             if ((m_uCurWidth > m_uMaxWidth) || (m_uCurHeight > m_uMaxHeight))
             {
-                NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-                NvHWEncoderLogFile << "bResolutionChangePending NV_ENC_ERR_INVALID_PARAM\n";
-                NvHWEncoderLogFile.close();
+                m_uCurWidth = uLastWidth;
+                m_uCurHeight = uLastHeight;
+                LOG_ERROR(NvHWEncoderLogger, "bResolutionChangePending NV_ENC_ERR_INVALID_PARAM");
                 return NV_ENC_ERR_INVALID_PARAM;
             }
             m_stCreateEncodeParams.encodeWidth = m_uCurWidth;
@@ -688,10 +626,16 @@ NVENCSTATUS CNvHWEncoder::NvEncReconfigureEncoder(const NvEncPictureCommand *pEn
         nvStatus = m_pEncodeAPI->nvEncReconfigureEncoder(m_hEncoder, &stReconfigParams);
         if (nvStatus != NV_ENC_SUCCESS)
         {
-            NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-            NvHWEncoderLogFile << "m_pEncodeAPI->nvEncReconfigureEncoder\n";
-            NvHWEncoderLogFile.close();
+            LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncReconfigureEncoder");
             assert(0);
+
+            // Later bitrate changes must not carry the size that failed.
+            m_uCurWidth = uLastWidth;
+            m_uCurHeight = uLastHeight;
+            m_stCreateEncodeParams.encodeWidth = m_uCurWidth;
+            m_stCreateEncodeParams.encodeHeight = m_uCurHeight;
+            m_stCreateEncodeParams.darWidth = m_uCurWidth;
+            m_stCreateEncodeParams.darHeight = m_uCurHeight;
         }
     }
 
@@ -704,16 +648,14 @@ CNvHWEncoder::CNvHWEncoder(int index)
     m_bEncoderInitialized = false;
     m_pEncodeAPI = NULL;
     m_hinstLib = NULL;
-    m_fOutputArray[index] = NULL;
+    m_fOutput = NULL;
+    m_pOutput = NULL;
     m_EncodeIdx = 0;
     m_uCurWidth = 0;
     m_uCurHeight = 0;
     m_uMaxWidth = 0;
     m_uMaxHeight = 0;
 
-    NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::trunc);
-    NvHWEncoderLogFile.close();
-
     memset(&m_stCreateEncodeParams, 0, sizeof(m_stCreateEncodeParams));
     SET_VER(m_stCreateEncodeParams, NV_ENC_INITIALIZE_PARAMS);
 
@@ -751,9 +693,7 @@ NVENCSTATUS CNvHWEncoder::ValidateEncodeGUID (GUID inputCodecGuid)
     nvStatus = m_pEncodeAPI->nvEncGetEncodeGUIDCount(m_hEncoder, &encodeGUIDCount);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncGetEncodeGUIDCount\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncGetEncodeGUIDCount");
         assert(0);
         return nvStatus;
     }
@@ -765,9 +705,7 @@ NVENCSTATUS CNvHWEncoder::ValidateEncodeGUID (GUID inputCodecGuid)
     nvStatus = m_pEncodeAPI->nvEncGetEncodeGUIDs(m_hEncoder, encodeGUIDArray, encodeGUIDCount, &encodeGUIDArraySize);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncGetEncodeGUIDs\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncGetEncodeGUIDs");
         delete[] encodeGUIDArray;
         assert(0);
         return nvStatus;
@@ -793,9 +731,7 @@ NVENCSTATUS CNvHWEncoder::ValidateEncodeGUID (GUID inputCodecGuid)
     }
     else
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "codecFound NV_ENC_ERR_INVALID_PARAM\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "codecFound NV_ENC_ERR_INVALID_PARAM");
         return NV_ENC_ERR_INVALID_PARAM;
     }
 }
@@ -809,9 +745,7 @@ NVENCSTATUS CNvHWEncoder::ValidatePresetGUID(GUID inputPresetGuid, GUID inputCod
     nvStatus = m_pEncodeAPI->nvEncGetEncodePresetCount(m_hEncoder, inputCodecGuid, &presetGUIDCount);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncGetEncodePresetCount\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncGetEncodePresetCount");
         assert(0);
         return nvStatus;
     }
@@ -823,9 +757,7 @@ NVENCSTATUS CNvHWEncoder::ValidatePresetGUID(GUID inputPresetGuid, GUID inputCod
     nvStatus = m_pEncodeAPI->nvEncGetEncodePresetGUIDs(m_hEncoder, inputCodecGuid, presetGUIDArray, presetGUIDCount, &presetGUIDArraySize);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncGetEncodePresetGUIDs\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncGetEncodePresetGUIDs");
         assert(0);
         delete[] presetGUIDArray;
         return nvStatus;
@@ -851,9 +783,7 @@ NVENCSTATUS CNvHWEncoder::ValidatePresetGUID(GUID inputPresetGuid, GUID inputCod
     }
     else
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "presetFound: NV_ENC_ERR_INVALID_PARAM\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "presetFound: NV_ENC_ERR_INVALID_PARAM");
         return NV_ENC_ERR_INVALID_PARAM;
     }
 }
@@ -864,9 +794,7 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
 
     if (pEncCfg == NULL)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "pEncCfg == NULL. NV_ENC_ERR_INVALID_PARAM\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "pEncCfg == NULL. NV_ENC_ERR_INVALID_PARAM");
         return NV_ENC_ERR_INVALID_PARAM;
     }
 
@@ -877,42 +805,20 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
     m_uMaxHeight = (pEncCfg->maxHeight > 0 ? pEncCfg->maxHeight : pEncCfg->height);
 
     if ((m_uCurWidth > m_uMaxWidth) || (m_uCurHeight > m_uMaxHeight)) {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "(m_uCurWidth > m_uMaxWidth) || (m_uCurHeight > m_uMaxHeight). NV_ENC_ERR_INVALID_PARAM\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "(m_uCurWidth > m_uMaxWidth) || (m_uCurHeight > m_uMaxHeight). NV_ENC_ERR_INVALID_PARAM");
         return NV_ENC_ERR_INVALID_PARAM;
     }
 
-    m_fOutputArray[index] = pEncCfg->fOutput;
-
-    std::stringstream *StringStream = new std::stringstream();
-    *StringStream << "ffmpeg " \
-                "-i - " \
-                "-listen 1 -threads 1 -vcodec copy -preset ultrafast " \
-                "-an -tune zerolatency " \
-                "-f h264 " << streamingIP << firstPort + index;
-    //*StringStream << "ffmpeg " \
-    //            "-y -i - " \
-    //            "-listen 1 -threads 1 -vcodec copy -preset ultrafast " \
-    //            "-an -tune zerolatency " \
-    //            "-f h264 output" << index << ".h264";
-
-    m_fOutputArray[index] = _popen(StringStream->str().c_str(), "wb");
-
-    if (!pEncCfg->width || !pEncCfg->height || !m_fOutputArray[index])
+    if (!pEncCfg->width || !pEncCfg->height)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "(m_uCurWidth > m_uMaxWidth) || (m_uCurHeight > m_uMaxHeight). NV_ENC_ERR_INVALID_PARAM\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "Encode size " << pEncCfg->width << "x" << pEncCfg->height << " is empty. NV_ENC_ERR_INVALID_PARAM");
         return NV_ENC_ERR_INVALID_PARAM;
     }
 
     if (pEncCfg->isYuv444 && (pEncCfg->codec == NV_ENC_HEVC))
     {
         PRINTERR("444 is not supported with HEVC \n");
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "444 is not supported with HEVC\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "444 is not supported with HEVC");
         return NV_ENC_ERR_INVALID_PARAM;
     }
 
@@ -921,9 +827,7 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
     if (nvStatus != NV_ENC_SUCCESS)
     {
         PRINTERR("codec not supported \n");
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "codec not supported\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "codec not supported");
         return nvStatus;
     }
 
@@ -960,9 +864,7 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
     if (nvStatus != NV_ENC_SUCCESS)
     {
         PRINTERR("nvEncGetEncodePresetConfig returned failure");
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "nvEncGetEncodePresetConfig returned failure\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "nvEncGetEncodePresetConfig returned failure");
         return nvStatus;
     }
     memcpy(&m_stEncodeConfig, &stPresetCfg.presetCfg, sizeof(NV_ENC_CONFIG));
@@ -1051,7 +953,7 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
         }
     }
 
-    if (pEncCfg->qpDeltaMapFile)
+    if (pEncCfg->qpDeltaMapFile || pEncCfg->runtimeQpDeltaMap)
     {
         m_stEncodeConfig.rcParams.enableExtQPDeltaMap = 1;
     }
@@ -1068,13 +970,105 @@ NVENCSTATUS CNvHWEncoder::CreateEncoder(const EncodeConfig *pEncCfg, int index)
     if (nvStatus != NV_ENC_SUCCESS)
     {
         PRINTERR("Encode Session Initialization failed");
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "Encode Session Initialization failed (m_pEncodeAPI->nvEncInitializeEncoder)\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "Encode Session Initialization failed (m_pEncodeAPI->nvEncInitializeEncoder)");
         return nvStatus;
     }
     m_bEncoderInitialized = true;
 
+    if (index >= 0)
+    {
+        nvStatus = AttachOutput(index, pEncCfg);
+    }
+
+    return nvStatus;
+}
+
+// Opens the output of player index and gives it the parameter sets of the
+// session. A pooled session gets a new output for every player it serves.
+NVENCSTATUS CNvHWEncoder::AttachOutput(int index, const EncodeConfig *pEncCfg)
+{
+    DetachOutput();
+    m_fOutput = pEncCfg->fOutput;
+    m_pOutput = OpenBitstreamOutput(index, pEncCfg->codec == NV_ENC_HEVC ? TS_STREAM_HEVC : TS_STREAM_H264);
+    if (!m_pOutput)
+    {
+        LOG_ERROR(NvHWEncoderLogger, "OpenBitstreamOutput failed. NV_ENC_ERR_INVALID_PARAM");
+        return NV_ENC_ERR_INVALID_PARAM;
+    }
+
+    RefreshParameterSets();
+    return NV_ENC_SUCCESS;
+}
+
+// Late joiners need the parameter sets, which NVENC only puts in front of
+// the first IDR after they change.
+void CNvHWEncoder::RefreshParameterSets()
+{
+    if (!m_pOutput)
+        return;
+
+    uint8_t aSequenceParams[1024];
+    uint32_t uSequenceParamsSize = 0;
+    NV_ENC_SEQUENCE_PARAM_PAYLOAD sequenceParamPayload;
+    memset(&sequenceParamPayload, 0, sizeof(sequenceParamPayload));
+    SET_VER(sequenceParamPayload, NV_ENC_SEQUENCE_PARAM_PAYLOAD);
+    sequenceParamPayload.inBufferSize = sizeof(aSequenceParams);
+    sequenceParamPayload.spsppsBuffer = aSequenceParams;
+    sequenceParamPayload.outSPSPPSPayloadSize = &uSequenceParamsSize;
+    if (NvEncGetSequenceParams(&sequenceParamPayload) == NV_ENC_SUCCESS)
+    {
+        m_pOutput->SetParameterSets(aSequenceParams, uSequenceParamsSize);
+    }
+}
+
+void CNvHWEncoder::DetachOutput()
+{
+    CloseBitstreamOutput(m_pOutput);
+    m_pOutput = NULL;
+    m_fOutput = NULL;
+}
+
+// Starts a session over for a new player: the frame rate and bitrate of
+// pEncCfg, fresh rate control state and an IDR first. The size, codec and
+// buffers stay those CreateEncoder set up.
+NVENCSTATUS CNvHWEncoder::ResetEncoder(const EncodeConfig *pEncCfg)
+{
+    if (!m_bEncoderInitialized)
+    {
+        return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+    }
+
+    // The last player may have left it at a smaller size.
+    m_uCurWidth = pEncCfg->width;
+    m_uCurHeight = pEncCfg->height;
+    m_stCreateEncodeParams.encodeWidth = m_uCurWidth;
+    m_stCreateEncodeParams.encodeHeight = m_uCurHeight;
+    m_stCreateEncodeParams.darWidth = m_uCurWidth;
+    m_stCreateEncodeParams.darHeight = m_uCurHeight;
+    m_stCreateEncodeParams.frameRateNum = pEncCfg->fps;
+    m_stCreateEncodeParams.frameRateDen = 1;
+    if (pEncCfg->bitrate || pEncCfg->vbvMaxBitrate)
+    {
+        m_stEncodeConfig.rcParams.averageBitRate = pEncCfg->bitrate;
+        m_stEncodeConfig.rcParams.maxBitRate = pEncCfg->vbvMaxBitrate;
+        m_stEncodeConfig.rcParams.vbvBufferSize = pEncCfg->vbvSize;
+        m_stEncodeConfig.rcParams.vbvInitialDelay = pEncCfg->vbvSize * 9 / 10;
+    }
+
+    NV_ENC_RECONFIGURE_PARAMS stReconfigParams;
+    memset(&stReconfigParams, 0, sizeof(stReconfigParams));
+    memcpy(&stReconfigParams.reInitEncodeParams, &m_stCreateEncodeParams, sizeof(m_stCreateEncodeParams));
+    stReconfigParams.version = NV_ENC_RECONFIGURE_PARAMS_VER;
+    stReconfigParams.resetEncoder = 1;
+    stReconfigParams.forceIDR = 1;
+
+    NVENCSTATUS nvStatus = m_pEncodeAPI->nvEncReconfigureEncoder(m_hEncoder, &stReconfigParams);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        // No assert: the pool opens a new session instead.
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncReconfigureEncoder (reset)");
+    }
+
     return nvStatus;
 }
 
@@ -1107,9 +1101,7 @@ GUID CNvHWEncoder::GetPresetGUID(char* encoderPreset, int codec)
     {
         if (encoderPreset)
         {
-            NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-            NvHWEncoderLogFile << "Unsupported preset guid\n";
-            NvHWEncoderLogFile.close();
+            LOG_ERROR(NvHWEncoderLogger, "Unsupported preset guid");
             PRINTERR("Unsupported preset guid %s\n", encoderPreset);
         }
         presetGUID = NV_ENC_PRESET_DEFAULT_GUID;
@@ -1120,24 +1112,21 @@ GUID CNvHWEncoder::GetPresetGUID(char* encoderPreset, int codec)
     if (nvStatus != NV_ENC_SUCCESS)
     {
         presetGUID = NV_ENC_PRESET_DEFAULT_GUID;
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "ValidatePresetGUID fail\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "ValidatePresetGUID fail");
         PRINTERR("Unsupported preset guid %s\n", encoderPreset);
     }
 
     return presetGUID;
 }
 
-NVENCSTATUS CNvHWEncoder::ProcessOutput(const EncodeBuffer *pEncodeBuffer, int index)
+NVENCSTATUS CNvHWEncoder::ProcessOutput(const EncodeBuffer *pEncodeBuffer)
 {
+    FRAME_TRACE_SCOPE("ProcessOutput");
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
 
     if (pEncodeBuffer->stOutputBfr.hBitstreamBuffer == NULL && pEncodeBuffer->stOutputBfr.bEOSFlag == FALSE)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "pEncodeBuffer->stOutputBfr.hBitstreamBuffer == NULL && pEncodeBuffer->stOutputBfr.bEOSFlag == FALSE fail\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "pEncodeBuffer->stOutputBfr.hBitstreamBuffer == NULL && pEncodeBuffer->stOutputBfr.bEOSFlag == FALSE fail");
         return NV_ENC_ERR_INVALID_PARAM;
     }
 
@@ -1145,9 +1134,7 @@ NVENCSTATUS CNvHWEncoder::ProcessOutput(const EncodeBuffer *pEncodeBuffer, int i
     {
         if (!pEncodeBuffer->stOutputBfr.hOutputEvent)
         {
-            NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-            NvHWEncoderLogFile << "pEncodeBuffer->stOutputBfr.hOutputEvent\n";
-            NvHWEncoderLogFile.close();
+            LOG_ERROR(NvHWEncoderLogger, "pEncodeBuffer->stOutputBfr.hOutputEvent");
             return NV_ENC_ERR_INVALID_PARAM;
         }
 #if defined(NV_WINDOWS)
@@ -1168,14 +1155,14 @@ NVENCSTATUS CNvHWEncoder::ProcessOutput(const EncodeBuffer *pEncodeBuffer, int i
     nvStatus = m_pEncodeAPI->nvEncLockBitstream(m_hEncoder, &lockBitstreamData);
     if (nvStatus == NV_ENC_SUCCESS)
     {
-        fwrite(lockBitstreamData.bitstreamBufferPtr, 1, lockBitstreamData.bitstreamSizeInBytes, m_fOutputArray[index]);
+        // A pooled session between players has no output attached.
+        if (m_pOutput)
+            m_pOutput->WriteAccessUnit((const uint8_t *)lockBitstreamData.bitstreamBufferPtr, lockBitstreamData.bitstreamSizeInBytes);
         nvStatus = m_pEncodeAPI->nvEncUnlockBitstream(m_hEncoder, pEncodeBuffer->stOutputBfr.hBitstreamBuffer);
     }
     else
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "lock bitstream function failed\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "lock bitstream function failed");
         PRINTERR("lock bitstream function failed \n");
     }
 
@@ -1198,9 +1185,7 @@ NVENCSTATUS CNvHWEncoder::Initialize(void* device, NV_ENC_DEVICE_TYPE deviceType
 #endif
     if (m_hinstLib == NULL)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "NV_ENC_ERR_OUT_OF_MEMORY\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "NV_ENC_ERR_OUT_OF_MEMORY");
         return NV_ENC_ERR_OUT_OF_MEMORY;
     }
 
@@ -1212,18 +1197,14 @@ NVENCSTATUS CNvHWEncoder::Initialize(void* device, NV_ENC_DEVICE_TYPE deviceType
 
     if (nvEncodeAPICreateInstance == NULL)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "NV_ENC_ERR_OUT_OF_MEMORY 2\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "NV_ENC_ERR_OUT_OF_MEMORY 2");
         return NV_ENC_ERR_OUT_OF_MEMORY;
     }
 
     m_pEncodeAPI = new NV_ENCODE_API_FUNCTION_LIST;
     if (m_pEncodeAPI == NULL)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "NV_ENC_ERR_OUT_OF_MEMORY 3\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "NV_ENC_ERR_OUT_OF_MEMORY 3");
         return NV_ENC_ERR_OUT_OF_MEMORY;
     }
 
@@ -1232,18 +1213,14 @@ NVENCSTATUS CNvHWEncoder::Initialize(void* device, NV_ENC_DEVICE_TYPE deviceType
     nvStatus = nvEncodeAPICreateInstance(m_pEncodeAPI);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "nvEncodeAPICreateInstance\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "nvEncodeAPICreateInstance");
         return nvStatus;
     }
 
     nvStatus = NvEncOpenEncodeSessionEx(device, deviceType);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "NvEncOpenEncodeSessionEx\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "NvEncOpenEncodeSessionEx");
         return nvStatus;
     }
 
@@ -1254,6 +1231,7 @@ NVENCSTATUS CNvHWEncoder::NvEncEncodeFrame(EncodeBuffer *pEncodeBuffer, NvEncPic
                                            uint32_t width, uint32_t height, NV_ENC_PIC_STRUCT ePicStruct,
                                            int8_t *qpDeltaMapArray, uint32_t qpDeltaMapArraySize)
 {
+    FRAME_TRACE_SCOPE("Submit");
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
     NV_ENC_PIC_PARAMS encPicParams;
 
@@ -1295,9 +1273,7 @@ NVENCSTATUS CNvHWEncoder::NvEncEncodeFrame(EncodeBuffer *pEncodeBuffer, NvEncPic
     nvStatus = m_pEncodeAPI->nvEncEncodePicture(m_hEncoder, &encPicParams);
     if (nvStatus != NV_ENC_SUCCESS && nvStatus != NV_ENC_ERR_NEED_MORE_INPUT)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncEncodePicture\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncEncodePicture");
         assert(0);
         return nvStatus;
     }
@@ -1318,9 +1294,7 @@ NVENCSTATUS CNvHWEncoder::NvEncFlushEncoderQueue(void *hEOSEvent)
     nvStatus = m_pEncodeAPI->nvEncEncodePicture(m_hEncoder, &encPicParams);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvHWEncoderLogFile.open("NvHWEncoderLogFile.txt", std::ios::app);
-        NvHWEncoderLogFile << "m_pEncodeAPI->nvEncEncodePicture 2\n";
-        NvHWEncoderLogFile.close();
+        LOG_ERROR(NvHWEncoderLogger, "m_pEncodeAPI->nvEncEncodePicture 2");
         assert(0);
     }
     return nvStatus;
@@ -21,10 +21,11 @@
 #include <stdio.h>
 #include <string>
 #include <time.h>
-#include <algorithm>
 #include "IDXGISwapChain.h"
 #include "NvIFREncoderDXGI.h"
 #include "ReplaceVtbl.h"
+#include "PlayerSession.h"
+#include "FrameTrace.h"
 #include "Logger.h"
 
 extern simplelogger::Logger *logger;
@@ -32,11 +33,6 @@ extern AppParam *pAppParam;
 
 static IDXGISwapChainVtbl vtbl;
 
-std::vector<NvIFREncoder*> pEncoderArray;
-std::vector<IDXGISwapChain*> SwapChainArray;
-
-int index = 0;
-
 LONGLONG g_llBegin = 0;
 LONGLONG g_llPerfFrequency = 0;
 BOOL g_timeInitialized = FALSE;
@@ -69,11 +65,28 @@ inline HWND GetOutputWindow(IDXGISwapChain * This)
 
 static HRESULT STDMETHODCALLTYPE IDXGISwapChain_Present_Proxy(IDXGISwapChain * This, UINT SyncInterval, UINT Flags) 
 {
-    // "This" is different for each window. 
-    // We can do a comparison checking "This", then storing that and using 
-    // that variable to keep track of which variable belongs to which window.    
+    // "This" is different for each window, and each window is a player. The
+    // first Present of a window gives it a session, which every later one
+    // finds without a lock.
+    PlayerSessionRegistry *pRegistry = PlayerSessionRegistry::GetShared();
+    PlayerSession *pSession = pRegistry->Find(This);
+    if (!pSession) {
+        bool bNew;
+        pSession = pRegistry->Acquire(This, &bNew);
+        if (!pSession) {
+            return vtbl.Present(This, SyncInterval, Flags);
+        }
+        if (bNew) {
+            LOG_INFO(logger, "Window " << This << " is player " << pSession->index);
+            FRAME_TRACE_THREAD_NAME("Present");
+        }
+    }
+    pSession->nPresents.fetch_add(1, std::memory_order_relaxed);
+    FRAME_TRACE_FRAME((uint32_t)pSession->nPresents.load(std::memory_order_relaxed));
+    FRAME_TRACE_SCOPE("Present");
+    NvIFREncoder *pEncoder = (NvIFREncoder *)pSession->pEncoder;
+
     IUnknown *pIUnkown;
-    index = std::find(SwapChainArray.begin(), SwapChainArray.end(), This) - SwapChainArray.begin();
     vtbl.GetDevice(This, __uuidof(pIUnkown), reinterpret_cast<void **>(&pIUnkown));
 
     //ID3D10Device *pD3D10Device;
@@ -126,30 +139,37 @@ static HRESULT STDMETHODCALLTYPE IDXGISwapChain_Present_Proxy(IDXGISwapChain * T
         D3D11_TEXTURE2D_DESC desc;
         pBackBuffer->GetDesc(&desc);
 
-        if (pEncoderArray[index] && !pEncoderArray[index]->CheckSize(desc.Width, desc.Height)) {
+        // The encoder of the old size is stopped before the new one starts,
+        // since both would be this player.
+        if (pEncoder && !pEncoder->CheckSize(desc.Width, desc.Height)) {
             LOG_INFO(logger, "destroy d3d11 encoder, new size: " << desc.Width << "x" << desc.Height);
-            //delete pEncoder0;
-            pEncoderArray[index] = NULL;
+            delete pEncoder;
+            pEncoder = NULL;
+            pSession->pEncoder = NULL;
         }
 
         // This only runs once at the very beginning (startup code)
-        if (!pEncoderArray[index] && !(pAppParam && pAppParam->bDwm)
+        if (!pEncoder && !(pAppParam && pAppParam->bDwm)
             && !(pAppParam && pAppParam->bForceHwnd && (HWND)pAppParam->hwnd != GetOutputWindow(This))) {
 
             LOG_INFO(logger, "Window size: " << desc.Width << "x" << desc.Height);
-            pEncoderArray[index] = new NvIFREncoderDXGI<ID3D11Device, ID3D11Texture2D>(This, desc.Width, desc.Height,
+            pEncoder = new NvIFREncoderDXGI<ID3D11Device, ID3D11Texture2D>(This, desc.Width, desc.Height,
                 desc.Format, FALSE, pAppParam);
 
-            if (!pEncoderArray[index]->StartEncoder(index, desc.Width, desc.Height)) {
+            pSession->nEncoderStarts.fetch_add(1, std::memory_order_relaxed);
+            if (!pEncoder->StartEncoder(pSession->index, desc.Width, desc.Height)) {
                 LOG_WARN(logger, "failed to start d3d11 encoder");
-                //delete pEncoder0;
-                pEncoderArray[index] = NULL;
+                pSession->nEncoderFailures.fetch_add(1, std::memory_order_relaxed);
+                delete pEncoder;
+                pEncoder = NULL;
             }
+            pSession->pEncoder = pEncoder;
         }
 
-        if (pEncoderArray[index]) {
+        if (pEncoder) {
             // The pEncoder probably receives the pBackBuffer data here every frame.
-            if (!((NvIFREncoderDXGI<ID3D11Device, ID3D11Texture2D> *)pEncoderArray[index])->UpdateSharedSurface(pD3D11Device, pBackBuffer)) {
+            FRAME_TRACE_SCOPE("CopySurface");
+            if (!((NvIFREncoderDXGI<ID3D11Device, ID3D11Texture2D> *)pEncoder)->UpdateSharedSurface(pD3D11Device, pBackBuffer)) {
                 LOG_WARN(logger, "d3d11 UpdateSharedSurface failed");
             }
         }
@@ -180,21 +200,24 @@ static ULONG STDMETHODCALLTYPE IDXGISwapChain_Release_Proxy(IDXGISwapChain * Thi
     // 2nd window opened: prints 1st and 2nd window
     //LOG_INFO(logger, "IDXGISwapChain_Release_Proxy(IDXGISwapChain * This) : " << This);
 
-    // If no elements match, SwapChainArray.end() is returned.
-    if (std::find(SwapChainArray.begin(), SwapChainArray.end(), This) == SwapChainArray.end()) {
-        SwapChainArray.push_back(This);
-        static NvIFREncoder *pEncoder;
-        pEncoderArray.push_back(pEncoder);
-    }
-    
     LOG_TRACE(logger, __FUNCTION__);
     vtbl.AddRef(This);
     ULONG uRef = vtbl.Release(This) - 1;
-    if (uRef == 0 && pEncoderArray.size() != 0 && pEncoderArray[0]->CheckPresenter(This)) {
-        // This does not run at all.
-        LOG_DEBUG(logger, "delete pEncoder0 in Release(), pEncoder0=" << pEncoderArray[0]);
-        //delete pEncoder0;
-        pEncoderArray[0] = NULL;
+    if (uRef == 0) {
+        // The last reference is going, so nothing presents with This any
+        // more: the player's encoder stops and its index is free again.
+        PlayerSessionRegistry *pRegistry = PlayerSessionRegistry::GetShared();
+        PlayerSession *pSession = pRegistry->Find(This);
+        if (pSession) {
+            NvIFREncoder *pEncoder = (NvIFREncoder *)pSession->pEncoder;
+            LOG_DEBUG(logger, "delete encoder of player " << pSession->index << " in Release(), pEncoder=" << pEncoder
+                << ", " << pSession->nPresents.load(std::memory_order_relaxed) << " presents");
+            if (pEncoder && pEncoder->CheckPresenter(This)) {
+                delete pEncoder;
+            }
+            pSession->pEncoder = NULL;
+            pRegistry->Remove(This);
+        }
     }
     return vtbl.Release(This);
 }
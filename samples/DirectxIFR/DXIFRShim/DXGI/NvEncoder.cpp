@@ -12,86 +12,195 @@
 //
 ////////////////////////////////////////////////////////////////////////////
 
-#include "../common/inc/nvCPUOPSys.h"
-#include "../common/inc/nvEncodeAPI.h"
-#include "../common/inc/nvUtils.h"
+#include "../Common/inc/nvCPUOPSys.h"
+#include "../Common/inc/nvEncodeAPI.h"
+#include "../Common/inc/nvUtils.h"
 #include "NvEncoder.h"
-#include "../common/inc/nvFileIO.h"
+#include "../Common/inc/nvFileIO.h"
+#include "../Common/BitstreamOutput.h"
+#include "YuvConvert.h"
+#include "FrameTiler.h"
+#include "TileHash.h"
+#include "FrameTrace.h"
+#include "Metrics.h"
+#include "WorkerPool.h"
+#include "../Common/Logger.h"
 #include <new>
-
-#include <iostream>
-#include <fstream>
+#include <mutex>
 
 #define BITSTREAM_BUFFER_SIZE 2 * 1024 * 1024
 
-std::ofstream NvEncoderLogFile;
+// Opened (and emptied) when the module loads; written by the log thread.
+simplelogger::Logger *NvEncoderLogger = simplelogger::LoggerFactory::CreateFileLogger("NvEncoderLogFile.txt");
 
-void convertYUVpitchtoNV12(unsigned char *yuv_luma, unsigned char *yuv_cb, unsigned char *yuv_cr,
+// Both conversions dispatch to the SIMD kernels in Util/YuvConvert.cpp; the
+// scalar versions there are the reference the kernels are checked against.
+// Large frames are split into stripes across pPool.
+void convertYUVpitchtoNV12(WorkerPool *pPool, unsigned char *yuv_luma, unsigned char *yuv_cb, unsigned char *yuv_cr,
                            unsigned char *nv12_luma, unsigned char *nv12_chroma,
                            int width, int height, int srcStride, int dstStride)
 {
-    int y;
-    int x;
     if (srcStride == 0)
         srcStride = width;
     if (dstStride == 0)
         dstStride = width;
 
-   for (y = 0; y < height; y++)
-   {
-       // Just copying it over row by row directly. Simple and straightforward
-       memcpy(nv12_luma + (dstStride*y), yuv_luma + (srcStride*y), width);
-   }
+    YuvI420ToNV12Striped(pPool, yuv_luma, yuv_cb, yuv_cr, srcStride, srcStride / 2, nv12_luma, nv12_chroma, dstStride, width, height);
+}
+
+void convertYUVpitchtoYUV444(WorkerPool *pPool, unsigned char *yuv_luma, unsigned char *yuv_cb, unsigned char *yuv_cr,
+    unsigned char *surf_luma, unsigned char *surf_cb, unsigned char *surf_cr, int width, int height, int srcStride, int dstStride)
+{
+    YuvCopyYUV444Striped(pPool, yuv_luma, yuv_cb, yuv_cr, srcStride, surf_luma, surf_cb, surf_cr, dstStride, width, height);
+}
 
-    for (y = 0; y < height / 2; y++)
+NVENCSTATUS CNvEncodeResourceApi::CreateInputBuffer(uint32_t width, uint32_t height, NV_ENC_BUFFER_FORMAT bufferFmt, NV_ENC_INPUT_PTR *phInput)
+{
+    return m_pNvHWEncoder->NvEncCreateInputBuffer(width, height, phInput, bufferFmt == NV_ENC_BUFFER_FORMAT_YUV444_PL);
+}
+
+NVENCSTATUS CNvEncodeResourceApi::DestroyInputBuffer(NV_ENC_INPUT_PTR hInput)
+{
+    return m_pNvHWEncoder->NvEncDestroyInputBuffer(hInput);
+}
+
+NVENCSTATUS CNvEncodeResourceApi::LockInputBuffer(NV_ENC_INPUT_PTR hInput, void **ppData, uint32_t *pPitch)
+{
+    return m_pNvHWEncoder->NvEncLockInputBuffer(hInput, ppData, pPitch);
+}
+
+NVENCSTATUS CNvEncodeResourceApi::UnlockInputBuffer(NV_ENC_INPUT_PTR hInput)
+{
+    return m_pNvHWEncoder->NvEncUnlockInputBuffer(hInput);
+}
+
+NVENCSTATUS CNvEncodeResourceApi::RegisterHostBuffer(void *pHost, size_t nBytes, uint32_t width, uint32_t height, uint32_t pitch,
+                                                     NV_ENC_BUFFER_FORMAT bufferFmt, NV_ENC_REGISTERED_PTR *phRegistered)
+{
+    if (!m_cuContext)
     {
-        for (x = 0; x < width; x = x + 2)
+        return NV_ENC_ERR_INVALID_DEVICE;
+    }
+
+    CUresult cuResult = cuCtxPushCurrent(m_cuContext);
+    if (cuResult != CUDA_SUCCESS)
+    {
+        return NV_ENC_ERR_INVALID_DEVICE;
+    }
+
+    // NvIFR hands out page-locked buffers, which usually already have a device
+    // mapping. Otherwise pin and map the buffer ourselves.
+    bool bPinnedHere = false;
+    CUdeviceptr dptr = 0;
+    cuResult = cuMemHostGetDevicePointer(&dptr, pHost, 0);
+    if (cuResult != CUDA_SUCCESS)
+    {
+        cuResult = cuMemHostRegister(pHost, nBytes, CU_MEMHOSTREGISTER_DEVICEMAP);
+        if (cuResult == CUDA_SUCCESS)
         {
-            nv12_chroma[(y*dstStride) + x] = yuv_cb[((srcStride / 2)*y) + (x >> 1)];
-            nv12_chroma[(y*dstStride) + (x + 1)] = yuv_cr[((srcStride / 2)*y) + (x >> 1)];
+            bPinnedHere = true;
+            cuResult = cuMemHostGetDevicePointer(&dptr, pHost, 0);
         }
     }
+
+    NVENCSTATUS nvStatus = NV_ENC_ERR_RESOURCE_REGISTER_FAILED;
+    if (cuResult == CUDA_SUCCESS)
+    {
+        nvStatus = m_pNvHWEncoder->NvEncRegisterResource(NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR, (void *)dptr,
+            width, height, pitch, phRegistered, bufferFmt);
+    }
+
+    if (nvStatus == NV_ENC_SUCCESS)
+    {
+        HostRegistration stRegistration;
+        stRegistration.hRegistered = *phRegistered;
+        stRegistration.pHost = pHost;
+        stRegistration.bPinnedHere = bPinnedHere;
+        m_aRegistrations.push_back(stRegistration);
+    }
+    else if (bPinnedHere)
+    {
+        cuMemHostUnregister(pHost);
+    }
+
+    CUcontext cuContextCurr;
+    cuCtxPopCurrent(&cuContextCurr);
+    return nvStatus;
 }
 
-void convertYUVpitchtoYUV444(unsigned char *yuv_luma, unsigned char *yuv_cb, unsigned char *yuv_cr,
-    unsigned char *surf_luma, unsigned char *surf_cb, unsigned char *surf_cr, int width, int height, int srcStride, int dstStride)
+NVENCSTATUS CNvEncodeResourceApi::UnregisterHostBuffer(NV_ENC_REGISTERED_PTR hRegistered)
 {
-    int h;
+    NVENCSTATUS nvStatus = m_pNvHWEncoder->NvEncUnregisterResource(hRegistered);
 
-    for (h = 0; h < height; h++)
+    for (size_t i = 0; i < m_aRegistrations.size(); i++)
     {
-        memcpy(surf_luma + dstStride * h, yuv_luma + srcStride * h, width);
-        memcpy(surf_cb + dstStride * h, yuv_cb + srcStride * h, width);
-        memcpy(surf_cr + dstStride * h, yuv_cr + srcStride * h, width);
+        if (m_aRegistrations[i].hRegistered != hRegistered)
+            continue;
+
+        if (m_aRegistrations[i].bPinnedHere && cuCtxPushCurrent(m_cuContext) == CUDA_SUCCESS)
+        {
+            CUcontext cuContextCurr;
+            cuMemHostUnregister(m_aRegistrations[i].pHost);
+            cuCtxPopCurrent(&cuContextCurr);
+        }
+        m_aRegistrations.erase(m_aRegistrations.begin() + i);
+        break;
     }
+    return nvStatus;
+}
+
+NVENCSTATUS CNvEncodeResourceApi::MapInputResource(NV_ENC_REGISTERED_PTR hRegistered, NV_ENC_INPUT_PTR *phMapped)
+{
+    return m_pNvHWEncoder->NvEncMapInputResource(hRegistered, phMapped);
+}
+
+NVENCSTATUS CNvEncodeResourceApi::UnmapInputResource(NV_ENC_INPUT_PTR hMapped)
+{
+    return m_pNvHWEncoder->NvEncUnmapInputResource(hMapped);
 }
 
 CNvEncoder::CNvEncoder(int index)
 {
-    m_pNvHWEncoder = new CNvHWEncoder(index);
+    m_pNvHWEncoder = NULL;
+    m_pResourceApi = NULL;
+    m_pInputBinder = NULL;
+    m_pSession = NULL;
+    m_bPooledSession = false;
     m_pDevice = NULL;
 #if defined (NV_WINDOWS)
     m_pD3D = NULL;
 #endif
     m_cuContext = NULL;
+    m_pConvertPool = NULL;
 
     m_uEncodeBufferCount = 0;
+    m_iIndex = index;
     memset(&m_stEncoderInput, 0, sizeof(m_stEncoderInput));
-    memset(&m_stEOSOutputBfr, 0, sizeof(m_stEOSOutputBfr));
 
-    memset(&m_stEncodeBuffer, 0, sizeof(m_stEncodeBuffer));
+    m_uCaptureBufferCount = 0;
+    memset(&m_stCaptureBuffer, 0, sizeof(m_stCaptureBuffer));
+    m_pQpDeltaMap = NULL;
+    m_bAdaptiveResolution = false;
+    m_uEncodeWidth = 0;
+    m_uEncodeHeight = 0;
+    m_uTargetBps = 0;
+    m_nBytesReported = 0;
+    m_bResolutionChangePending = false;
+    m_pEncodeHeightMetric = NULL;
 }
 
 CNvEncoder::~CNvEncoder()
 {
-    if (m_pNvHWEncoder)
+    // The encoder thread deletes the encoder without Shutdown when it breaks
+    // off; the session still goes back to the pool.
+    if (m_pSession || m_pDevice)
     {
-        delete m_pNvHWEncoder;
-        m_pNvHWEncoder = NULL;
+        Deinitialize(encodeConfig.deviceType);
     }
 }
 
-NVENCSTATUS CNvEncoder::InitCuda(uint32_t deviceID)
+// Creates a context on GPU deviceID, not current on any thread.
+static NVENCSTATUS CreateCudaContext(uint32_t deviceID, CUcontext *pContext)
 {
     CUresult cuResult;
     CUdevice device;
@@ -109,9 +218,7 @@ NVENCSTATUS CNvEncoder::InitCuda(uint32_t deviceID)
     if (cuResult != CUDA_SUCCESS)
     {
         PRINTERR("cuInit error:0x%x\n", cuResult);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuResult != CUDA_SUCCESS.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "cuResult != CUDA_SUCCESS.");
         assert(0);
         return NV_ENC_ERR_NO_ENCODE_DEVICE;
     }
@@ -120,9 +227,7 @@ NVENCSTATUS CNvEncoder::InitCuda(uint32_t deviceID)
     if (cuResult != CUDA_SUCCESS)
     {
         PRINTERR("cuDeviceGetCount error:0x%x\n", cuResult);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuDeviceGetCount error.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "cuDeviceGetCount error.");
         assert(0);
         return NV_ENC_ERR_NO_ENCODE_DEVICE;
     }
@@ -134,9 +239,7 @@ NVENCSTATUS CNvEncoder::InitCuda(uint32_t deviceID)
     if (deviceID >(unsigned int)deviceCount - 1)
     {
         PRINTERR("Invalid Device Id = %d\n", deviceID);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "Invalid Device Id.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "Invalid Device Id.");
         return NV_ENC_ERR_INVALID_ENCODERDEVICE;
     }
 
@@ -144,9 +247,7 @@ NVENCSTATUS CNvEncoder::InitCuda(uint32_t deviceID)
     if (cuResult != CUDA_SUCCESS)
     {
         PRINTERR("cuDeviceGet error:0x%x\n", cuResult);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuDeviceGet error.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "cuDeviceGet error.");
         return NV_ENC_ERR_NO_ENCODE_DEVICE;
     }
 
@@ -154,28 +255,23 @@ NVENCSTATUS CNvEncoder::InitCuda(uint32_t deviceID)
     if (cuResult != CUDA_SUCCESS)
     {
         PRINTERR("cuDeviceComputeCapability error:0x%x\n", cuResult);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuDeviceComputeCapability error.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "cuDeviceComputeCapability error.");
         return NV_ENC_ERR_NO_ENCODE_DEVICE;
     }
 
     if (((SMmajor << 4) + SMminor) < 0x30)
     {
         PRINTERR("GPU %d does not have NVENC capabilities exiting\n", deviceID);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "GPU does not have NVENC capabilities exiting.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "GPU does not have NVENC capabilities exiting.");
         return NV_ENC_ERR_NO_ENCODE_DEVICE;
     }
 
-    cuResult = cuCtxCreate((CUcontext*)(&m_pDevice), 0, device);
+    // MAP_HOST lets capture buffers be registered as encoder input (zero-copy).
+    cuResult = cuCtxCreate(pContext, CU_CTX_MAP_HOST, device);
     if (cuResult != CUDA_SUCCESS)
     {
         PRINTERR("cuCtxCreate error:0x%x\n", cuResult);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuCtxCreate error.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "cuCtxCreate error.");
         assert(0);
         return NV_ENC_ERR_NO_ENCODE_DEVICE;
     }
@@ -184,10 +280,10 @@ NVENCSTATUS CNvEncoder::InitCuda(uint32_t deviceID)
     if (cuResult != CUDA_SUCCESS)
     {
         PRINTERR("cuCtxPopCurrent error:0x%x\n", cuResult);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "cuCtxPopCurrent error.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "cuCtxPopCurrent error.");
         assert(0);
+        cuCtxDestroy(*pContext);
+        *pContext = NULL;
         return NV_ENC_ERR_NO_ENCODE_DEVICE;
     }
     return NV_ENC_SUCCESS;
@@ -306,161 +402,446 @@ NVENCSTATUS CNvEncoder::InitD3D11(uint32_t deviceID)
 }
 #endif
 
-NVENCSTATUS CNvEncoder::AllocateIOBuffers(uint32_t uInputWidth, uint32_t uInputHeight, uint32_t isYuv444)
+static NVENCSTATUS AllocateOutputBuffer(NvEncodeSession *pSession, EncodeOutputBuffer *pOutputBfr)
 {
-    NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
+    NVENCSTATUS nvStatus = pSession->pNvHWEncoder->NvEncCreateBitstreamBuffer(BITSTREAM_BUFFER_SIZE, &pOutputBfr->hBitstreamBuffer);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        LOG_ERROR(NvEncoderLogger, "NvEncCreateBitstreamBuffer failed.");
+        return nvStatus;
+    }
+    pOutputBfr->dwBitstreamBufferSize = BITSTREAM_BUFFER_SIZE;
 
-    m_EncodeBufferQueue.Initialize(m_stEncodeBuffer, m_uEncodeBufferCount);
-    for (uint32_t i = 0; i < m_uEncodeBufferCount; i++)
+#if defined (NV_WINDOWS)
+    nvStatus = pSession->pNvHWEncoder->NvEncRegisterAsyncEvent(&pOutputBfr->hOutputEvent);
+    if (nvStatus != NV_ENC_SUCCESS)
     {
-        nvStatus = m_pNvHWEncoder->NvEncCreateInputBuffer(uInputWidth, uInputHeight, &m_stEncodeBuffer[i].stInputBfr.hInputSurface, isYuv444);
-        if (nvStatus != NV_ENC_SUCCESS)
-        {
-            NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-            NvEncoderLogFile << "m_pNvHWEncoder->NvEncCreateInputBuffer error.\n";
-            NvEncoderLogFile.close();
-            return nvStatus;
-        }
+        LOG_ERROR(NvEncoderLogger, "NvEncRegisterAsyncEvent failed.");
+        return nvStatus;
+    }
+    pOutputBfr->bWaitOnEvent = true;
+#else
+    pOutputBfr->hOutputEvent = NULL;
+#endif
 
-        m_stEncodeBuffer[i].stInputBfr.bufferFmt = isYuv444 ? NV_ENC_BUFFER_FORMAT_YUV444_PL : NV_ENC_BUFFER_FORMAT_NV12_PL;
-        //m_stEncodeBuffer[i].stInputBfr.bufferFmt = NV_ENC_BUFFER_FORMAT_IYUV_PL;
-        m_stEncodeBuffer[i].stInputBfr.dwWidth = uInputWidth;
-        m_stEncodeBuffer[i].stInputBfr.dwHeight = uInputHeight;
+    return NV_ENC_SUCCESS;
+}
 
-        //Allocate output surface
-        nvStatus = m_pNvHWEncoder->NvEncCreateBitstreamBuffer(BITSTREAM_BUFFER_SIZE, &m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer);
+static void ReleaseEncodeBuffer(NvEncodeSession *pSession, EncodeBuffer *pEncodeBuffer)
+{
+    pSession->pInputBinder->Release(&pEncodeBuffer->stInputBfr);
+
+    if (pEncodeBuffer->stOutputBfr.hBitstreamBuffer)
+    {
+        pSession->pNvHWEncoder->NvEncDestroyBitstreamBuffer(pEncodeBuffer->stOutputBfr.hBitstreamBuffer);
+        pEncodeBuffer->stOutputBfr.hBitstreamBuffer = NULL;
+    }
+
+#if defined(NV_WINDOWS)
+    if (pEncodeBuffer->stOutputBfr.hOutputEvent)
+    {
+        pSession->pNvHWEncoder->NvEncUnregisterAsyncEvent(pEncodeBuffer->stOutputBfr.hOutputEvent);
+        nvCloseFile(pEncodeBuffer->stOutputBfr.hOutputEvent);
+        pEncodeBuffer->stOutputBfr.hOutputEvent = NULL;
+    }
+#endif
+}
+
+static NVENCSTATUS AllocateSessionBuffers(NvEncodeSession *pSession, uint32_t uInputWidth, uint32_t uInputHeight, uint32_t isYuv444,
+                                          uint32_t nBuffers)
+{
+    NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
+
+    for (uint32_t i = 0; i < nBuffers; i++)
+    {
+        pSession->uEncodeBufferCount = i + 1;
+        nvStatus = pSession->pInputBinder->Allocate(&pSession->aEncodeBuffer[i].stInputBfr, uInputWidth, uInputHeight,
+            isYuv444 ? NV_ENC_BUFFER_FORMAT_YUV444_PL : NV_ENC_BUFFER_FORMAT_NV12_PL);
         if (nvStatus != NV_ENC_SUCCESS)
         {
-            NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-            NvEncoderLogFile << "NvEncCreateBitstreamBuffer failed.\n";
-            NvEncoderLogFile.close();
+            LOG_ERROR(NvEncoderLogger, "m_pNvHWEncoder->NvEncCreateInputBuffer error.");
             return nvStatus;
         }
-        m_stEncodeBuffer[i].stOutputBfr.dwBitstreamBufferSize = BITSTREAM_BUFFER_SIZE;
 
-#if defined (NV_WINDOWS)
-        nvStatus = m_pNvHWEncoder->NvEncRegisterAsyncEvent(&m_stEncodeBuffer[i].stOutputBfr.hOutputEvent);
+        //Allocate output surface
+        nvStatus = AllocateOutputBuffer(pSession, &pSession->aEncodeBuffer[i].stOutputBfr);
         if (nvStatus != NV_ENC_SUCCESS)
         {
-            NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-            NvEncoderLogFile << "NvEncRegisterAsyncEvent failed.\n";
-            NvEncoderLogFile.close();
             return nvStatus;
         }
-        if (m_stEncoderInput.enableMEOnly)
-        {
-            m_stEncodeBuffer[i].stOutputBfr.bWaitOnEvent = false;
-        }
-        else
-            m_stEncodeBuffer[i].stOutputBfr.bWaitOnEvent = true;
-#else
-        m_stEncodeBuffer[i].stOutputBfr.hOutputEvent = NULL;
-#endif
     }
 
-    m_stEOSOutputBfr.bEOSFlag = TRUE;
+    pSession->stEOSOutputBfr.bEOSFlag = TRUE;
 
 #if defined (NV_WINDOWS)
-    nvStatus = m_pNvHWEncoder->NvEncRegisterAsyncEvent(&m_stEOSOutputBfr.hOutputEvent);
+    nvStatus = pSession->pNvHWEncoder->NvEncRegisterAsyncEvent(&pSession->stEOSOutputBfr.hOutputEvent);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "NvEncRegisterAsyncEvent failed.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "NvEncRegisterAsyncEvent failed.");
         return nvStatus;
     }
 #else
-    m_stEOSOutputBfr.hOutputEvent = NULL;
+    pSession->stEOSOutputBfr.hOutputEvent = NULL;
 #endif
 
     return NV_ENC_SUCCESS;
 }
 
-NVENCSTATUS CNvEncoder::ReleaseIOBuffers()
+NvEncodeSession *OpenNvEncodeSession(void *pDevice, NV_ENC_DEVICE_TYPE deviceType, const EncodeConfig *pEncCfg, uint32_t nBuffers)
 {
-    for (uint32_t i = 0; i < m_uEncodeBufferCount; i++)
+    if (nBuffers > MAX_ENCODE_QUEUE)
+        nBuffers = MAX_ENCODE_QUEUE;
+
+    NvEncodeSession *pSession = new NvEncodeSession;
+    memset(pSession, 0, sizeof(*pSession));
+    pSession->pNvHWEncoder = new CNvHWEncoder(0);
+    pSession->pResourceApi = new CNvEncodeResourceApi(pSession->pNvHWEncoder);
+    pSession->pInputBinder = new EncodeInputBinder(pSession->pResourceApi);
+    if (deviceType == NV_ENC_DEVICE_TYPE_CUDA)
     {
-        m_pNvHWEncoder->NvEncDestroyInputBuffer(m_stEncodeBuffer[i].stInputBfr.hInputSurface);
-        m_stEncodeBuffer[i].stInputBfr.hInputSurface = NULL;
+        pSession->pResourceApi->SetCudaContext((CUcontext)pDevice);
+    }
 
-        if (m_stEncoderInput.enableMEOnly)
+    EncodeConfig stEncodeConfig = *pEncCfg;
+    NVENCSTATUS nvStatus = pSession->pNvHWEncoder->Initialize(pDevice, deviceType);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        LOG_ERROR(NvEncoderLogger, "m_pNvHWEncoder->Initialize failed.");
+    }
+    else
+    {
+        stEncodeConfig.presetGUID = pSession->pNvHWEncoder->GetPresetGUID(stEncodeConfig.encoderPreset, stEncodeConfig.codec);
+        nvStatus = pSession->pNvHWEncoder->CreateEncoder(&stEncodeConfig, -1);
+        if (nvStatus != NV_ENC_SUCCESS)
         {
-            m_pNvHWEncoder->NvEncDestroyMVBuffer(m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer);
-            m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer = NULL;
+            LOG_ERROR(NvEncoderLogger, "m_pNvHWEncoder->CreateEncoder failed.");
         }
-        else
+    }
+    if (nvStatus == NV_ENC_SUCCESS)
+    {
+        nvStatus = AllocateSessionBuffers(pSession, stEncodeConfig.width, stEncodeConfig.height, stEncodeConfig.isYuv444, nBuffers);
+        if (nvStatus != NV_ENC_SUCCESS)
         {
-            m_pNvHWEncoder->NvEncDestroyBitstreamBuffer(m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer);
-            m_stEncodeBuffer[i].stOutputBfr.hBitstreamBuffer = NULL;
+            LOG_ERROR(NvEncoderLogger, "AllocateSessionBuffers failed.");
         }
+    }
 
-#if defined(NV_WINDOWS)
-        m_pNvHWEncoder->NvEncUnregisterAsyncEvent(m_stEncodeBuffer[i].stOutputBfr.hOutputEvent);
-        nvCloseFile(m_stEncodeBuffer[i].stOutputBfr.hOutputEvent);
-        m_stEncodeBuffer[i].stOutputBfr.hOutputEvent = NULL;
-#endif
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        CloseNvEncodeSession(pSession);
+        return NULL;
     }
+    return pSession;
+}
+
+void CloseNvEncodeSession(NvEncodeSession *pSession)
+{
+    if (!pSession)
+        return;
 
-    if (m_stEOSOutputBfr.hOutputEvent)
+    for (uint32_t i = 0; i < pSession->uEncodeBufferCount; i++)
     {
+        ReleaseEncodeBuffer(pSession, &pSession->aEncodeBuffer[i]);
+    }
+
 #if defined(NV_WINDOWS)
-        m_pNvHWEncoder->NvEncUnregisterAsyncEvent(m_stEOSOutputBfr.hOutputEvent);
-        nvCloseFile(m_stEOSOutputBfr.hOutputEvent);
-        m_stEOSOutputBfr.hOutputEvent = NULL;
+    if (pSession->stEOSOutputBfr.hOutputEvent)
+    {
+        pSession->pNvHWEncoder->NvEncUnregisterAsyncEvent(pSession->stEOSOutputBfr.hOutputEvent);
+        nvCloseFile(pSession->stEOSOutputBfr.hOutputEvent);
+        pSession->stEOSOutputBfr.hOutputEvent = NULL;
+    }
 #endif
+
+    pSession->pNvHWEncoder->NvEncDestroyEncoder();
+    delete pSession->pInputBinder;
+    delete pSession->pResourceApi;
+    delete pSession->pNvHWEncoder;
+    delete pSession;
+}
+
+void *CNvEncodeSessionDevice::CreateContext(int iDevice)
+{
+    CUcontext cuContext = NULL;
+    if (CreateCudaContext((uint32_t)iDevice, &cuContext) != NV_ENC_SUCCESS)
+        return NULL;
+    return cuContext;
+}
+
+void CNvEncodeSessionDevice::DestroyContext(void *pContext)
+{
+    CUresult cuResult = cuCtxDestroy((CUcontext)pContext);
+    if (cuResult != CUDA_SUCCESS)
+    {
+        LOG_ERROR(NvEncoderLogger, "cuCtxDestroy() error.");
+        PRINTERR("cuCtxDestroy error:0x%x\n", cuResult);
+    }
+}
+
+void *CNvEncodeSessionDevice::OpenSession(void *pContext, const EncodeSessionKey &key, const void *pParams)
+{
+    return OpenNvEncodeSession(pContext, NV_ENC_DEVICE_TYPE_CUDA, (const EncodeConfig *)pParams, key.nBuffers);
+}
+
+bool CNvEncodeSessionDevice::ResetSession(void *pSession, const void *pParams)
+{
+    return ((NvEncodeSession *)pSession)->pNvHWEncoder->ResetEncoder((const EncodeConfig *)pParams) == NV_ENC_SUCCESS;
+}
+
+void CNvEncodeSessionDevice::CloseSession(void *pSession)
+{
+    CloseNvEncodeSession((NvEncodeSession *)pSession);
+}
+
+static std::mutex s_sessionPoolMutex;
+static EncodeSessionPool *s_pSessionPool = NULL;
+
+// CUDA sessions of every player of the process. Never destroyed, so the
+// contexts last as long as the process.
+static EncodeSessionPool *GetSessionPool()
+{
+    std::lock_guard<std::mutex> lock(s_sessionPoolMutex);
+    if (!s_pSessionPool)
+    {
+        s_pSessionPool = new EncodeSessionPool(new CNvEncodeSessionDevice());
+    }
+    return s_pSessionPool;
+}
+
+// Starts the pipeline over the first m_uEncodeBufferCount buffers of the
+// session; a recycled session may have more.
+NVENCSTATUS CNvEncoder::StartEncodePipeline()
+{
+    void *apItems[MAX_ENCODE_QUEUE];
+    for (uint32_t i = 0; i < m_uEncodeBufferCount; i++)
+    {
+        apItems[i] = &m_pSession->aEncodeBuffer[i];
+    }
+
+    MetricsRegistry *pMetrics = MetricsRegistry::GetShared();
+    char szLabels[32];
+    sprintf(szLabels, "player=\"%d\"", m_iIndex);
+    m_encodePipeline.SetMetrics(
+        pMetrics->GetHistogram("dxifrshim_pipeline_latency_seconds", "Time from submitting a frame to NVENC until its bitstream is written out.", szLabels),
+        pMetrics->GetGauge("dxifrshim_pipeline_queue_depth", "Frames submitted to NVENC and not yet written out.", szLabels));
+    m_encodePipeline.SetDrainedFunc(OnEncodeBufferDrained);
+    if (!m_encodePipeline.Start(apItems, m_uEncodeBufferCount, DrainEncodeBuffer, this))
+    {
+        LOG_ERROR(NvEncoderLogger, "m_encodePipeline.Start failed.");
+        return NV_ENC_ERR_GENERIC;
     }
 
     return NV_ENC_SUCCESS;
 }
 
-NVENCSTATUS CNvEncoder::FlushEncoder(int index)
+// Runs on the pipeline's drain thread: waits for one submitted frame and
+// writes its bitstream out.
+void CNvEncoder::DrainEncodeBuffer(void *pContext, void *pItem)
+{
+    CNvEncoder *pThis = (CNvEncoder *)pContext;
+    FRAME_TRACE_FRAME(((EncodeBuffer *)pItem)->stOutputBfr.uTraceFrame);
+    pThis->m_pNvHWEncoder->ProcessOutput((EncodeBuffer *)pItem);
+}
+
+// Runs on the drain thread once the frame is out, so the controller sees the
+// frame's Submit-to-output latency and exactly the bytes it produced. While a
+// change is pending the encoder thread owns the controller; the frames drained
+// meanwhile were encoded at the old size and are not reported.
+void CNvEncoder::OnEncodeBufferDrained(void *pContext, void * /*pItem*/, uint64_t uLatencyUs)
+{
+    CNvEncoder *pThis = (CNvEncoder *)pContext;
+    BitstreamOutput *pOutput = pThis->m_pNvHWEncoder->m_pOutput;
+    uint64_t nBytes = pOutput ? pOutput->GetBytesWritten() : 0;
+    uint32_t uBytes = (uint32_t)(nBytes - pThis->m_nBytesReported);
+    pThis->m_nBytesReported = nBytes;
+    if (pThis->m_bResolutionChangePending.load(std::memory_order_acquire) || !pThis->m_bAdaptiveResolution)
+        return;
+
+    if (pThis->m_resolution.Update(pThis->m_uTargetBps.load(std::memory_order_relaxed), uLatencyUs / 1000.0, uBytes))
+    {
+        pThis->m_bResolutionChangePending.store(true, std::memory_order_release);
+    }
+}
+
+void CNvEncoder::LogPipelineStats()
+{
+    EncodePipelineStats stats;
+    m_encodePipeline.GetStats(&stats);
+    if (!stats.nFrames)
+        return;
+
+    LOG_INFO(NvEncoderLogger, "Encode pipeline: depth " << stats.uDepth << ", " << stats.nFrames << " frames, "
+                              << stats.nFrames * 1000.0 / stats.fElapsedMs << " fps, latency avg "
+                              << stats.fLatencyAvgMs << " ms max " << stats.fLatencyMaxMs << " ms, blocked "
+                              << stats.fAcquireWaitMs << " ms.");
+}
+
+// Registers the NvIFR page-locked buffers (I420, pitch == width) so frames
+// can be encoded from them directly. On failure nothing stays registered and
+// every frame goes through the owned input buffers instead.
+NVENCSTATUS CNvEncoder::RegisterCaptureBuffers(uint8_t **ppCaptureBuffers, int nCaptureBuffers, uint32_t uWidth, uint32_t uHeight)
 {
-    NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-    NvEncoderLogFile << "FlushEncoder() error.\n";
-    NvEncoderLogFile.close();
+    if (nCaptureBuffers > MAX_CAPTURE_BUFFERS)
+        nCaptureBuffers = MAX_CAPTURE_BUFFERS;
+
+    EncodeInputBuffer *apInputs[MAX_CAPTURE_BUFFERS];
+    for (int i = 0; i < nCaptureBuffers; i++)
+    {
+        apInputs[i] = &m_stCaptureBuffer[i].stInputBfr;
+    }
+    m_uCaptureBufferCount = nCaptureBuffers;
+    NVENCSTATUS nvStatus = m_pInputBinder->RebindAll(apInputs, ppCaptureBuffers, nCaptureBuffers, uWidth, uHeight, uWidth,
+        NV_ENC_BUFFER_FORMAT_IYUV_PL);
+    for (int i = 0; i < nCaptureBuffers && nvStatus == NV_ENC_SUCCESS; i++)
+    {
+        nvStatus = AllocateOutputBuffer(m_pSession, &m_stCaptureBuffer[i].stOutputBfr);
+    }
 
-    NVENCSTATUS nvStatus = m_pNvHWEncoder->NvEncFlushEncoderQueue(m_stEOSOutputBfr.hOutputEvent);
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        assert(0);
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "m_pNvHWEncoder->NvEncFlushEncoderQueue error.\n";
-        NvEncoderLogFile.close();
+        LOG_WARN(NvEncoderLogger, "Registering capture buffers failed, copying frames instead. Error is " << nvStatus);
+
+        for (uint32_t i = 0; i < m_uCaptureBufferCount; i++)
+        {
+            ReleaseEncodeBuffer(m_pSession, &m_stCaptureBuffer[i]);
+        }
+        m_uCaptureBufferCount = 0;
+    }
+    return nvStatus;
+}
+
+// Unregisters the capture buffers. The session's own buffers stay with it.
+void CNvEncoder::ReleaseCaptureBuffers()
+{
+    for (uint32_t i = 0; i < m_uCaptureBufferCount; i++)
+    {
+        ReleaseEncodeBuffer(m_pSession, &m_stCaptureBuffer[i]);
+    }
+    m_uCaptureBufferCount = 0;
+}
+
+EncodeBuffer* CNvEncoder::FindCaptureBuffer(const uint8_t *pFrame)
+{
+    for (uint32_t i = 0; i < m_uCaptureBufferCount; i++)
+    {
+        if (m_stCaptureBuffer[i].stInputBfr.pHostBuffer == pFrame)
+            return &m_stCaptureBuffer[i];
+    }
+    return NULL;
+}
+
+// Forces an IDR when a viewer has joined since the last frame, so it can start
+// decoding right away. Returns NULL, meaning no command, otherwise. An IDR
+// rather than an intra refresh, because that is what the stream server waits
+// for before it starts sending to the viewer.
+NvEncPictureCommand *CNvEncoder::GetPictureCommand(int index, NvEncPictureCommand *pCommand)
+{
+    BitstreamOutput *pOutput = m_pNvHWEncoder->m_pOutput;
+    if (!pOutput || !pOutput->TakeKeyframeRequest())
+        return NULL;
+    memset(pCommand, 0, sizeof(*pCommand));
+    pCommand->bForceIDR = true;
+    return pCommand;
+}
+
+// Returns the QP delta map of the frame about to be submitted, if any. An IDR
+// goes without, so static areas a new viewer starts from are not coarse.
+int8_t *CNvEncoder::TakeQpDeltaMap(const NvEncPictureCommand *pCommand)
+{
+    const int8_t *pMap = m_pQpDeltaMap;
+    m_pQpDeltaMap = NULL;
+    if (pCommand && pCommand->bForceIDR)
+        return NULL;
+    // The map covers the captured picture, not a scaled one.
+    if (m_uEncodeWidth != (uint32_t)encodeConfig.width || m_uEncodeHeight != (uint32_t)encodeConfig.height)
+        return NULL;
+    return (int8_t *)pMap;
+}
+
+// Encodes straight from a registered capture buffer. NvIFR overwrites the
+// buffer on its next transfer, so the frame is encoded synchronously and the
+// buffer is unmapped before returning; frames still pending on the copy path
+// are drained first to keep the output in order.
+NVENCSTATUS CNvEncoder::EncodeCaptureBuffer(EncodeBuffer *pEncodeBuffer, int index, uint32_t width, uint32_t height)
+{
+    m_encodePipeline.WaitIdle();
+
+    NVENCSTATUS nvStatus = m_pInputBinder->Map(&pEncodeBuffer->stInputBfr);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        LOG_ERROR(NvEncoderLogger, "m_pInputBinder->Map error.");
         return nvStatus;
     }
 
-    EncodeBuffer *pEncodeBufer = m_EncodeBufferQueue.GetPending();
-    while (pEncodeBufer)
+    NvEncPictureCommand encPicCommand;
+    NvEncPictureCommand *pCommand = GetPictureCommand(index, &encPicCommand);
+    nvStatus = m_pNvHWEncoder->NvEncEncodeFrame(pEncodeBuffer, pCommand, width, height, (NV_ENC_PIC_STRUCT)m_uPicStruct,
+                                                TakeQpDeltaMap(pCommand), m_qpDeltaMapBuilder.GetMapSize());
+    if (nvStatus == NV_ENC_SUCCESS)
+    {
+        m_pNvHWEncoder->ProcessOutput(pEncodeBuffer);
+    }
+    else
     {
-        m_pNvHWEncoder->ProcessOutput(pEncodeBufer, index);
-        pEncodeBufer = m_EncodeBufferQueue.GetPending();
+        LOG_ERROR(NvEncoderLogger, "m_pNvHWEncoder->NvEncEncodeFrame");
     }
 
+    m_pInputBinder->Unmap(&pEncodeBuffer->stInputBfr);
+    return nvStatus;
+}
+
+NVENCSTATUS CNvEncoder::FlushEncoder(int index)
+{
+    NVENCSTATUS nvStatus = m_pNvHWEncoder->NvEncFlushEncoderQueue(m_pSession->stEOSOutputBfr.hOutputEvent);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        assert(0);
+        LOG_ERROR(NvEncoderLogger, "m_pNvHWEncoder->NvEncFlushEncoderQueue error.");
+        return nvStatus;
+    }
+
+    m_encodePipeline.WaitIdle();
+
 #if defined(NV_WINDOWS)
-    if (WaitForSingleObject(m_stEOSOutputBfr.hOutputEvent, 500) != WAIT_OBJECT_0)
+    if (WaitForSingleObject(m_pSession->stEOSOutputBfr.hOutputEvent, 500) != WAIT_OBJECT_0)
     {
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "WaitForSingleObject(m_stEOSOutputBfr.hOutputEvent, 500) error.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "WaitForSingleObject(m_pSession->stEOSOutputBfr.hOutputEvent, 500) error.");
         assert(0);
         nvStatus = NV_ENC_ERR_GENERIC;
     }
 #endif
 
+    if (nvStatus == NV_ENC_SUCCESS)
+    {
+        LOG_DEBUG(NvEncoderLogger, "Encoder " << index << " flushed.");
+    }
     return nvStatus;
 }
 
 NVENCSTATUS CNvEncoder::Deinitialize(uint32_t devicetype)
 {
-    NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-    NvEncoderLogFile << "Deinitialize() error.\n";
-    NvEncoderLogFile.close();
-
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
 
-    ReleaseIOBuffers();
+    // Writes out whatever is still in flight before the buffers go away.
+    m_encodePipeline.Stop();
+    LogPipelineStats();
+
+    // The session goes to the next player without this player's outputs and
+    // capture buffers.
+    if (m_pSession)
+    {
+        ReleaseCaptureBuffers();
+        m_pNvHWEncoder->DetachOutput();
 
-    nvStatus = m_pNvHWEncoder->NvEncDestroyEncoder();
+        if (m_bPooledSession)
+            GetSessionPool()->Recycle(m_pSession);
+        else
+            CloseNvEncodeSession(m_pSession);
+        m_pSession = NULL;
+        m_pNvHWEncoder = NULL;
+        m_pResourceApi = NULL;
+        m_pInputBinder = NULL;
+    }
 
     if (m_pDevice)
     {
@@ -481,15 +862,8 @@ NVENCSTATUS CNvEncoder::Deinitialize(uint32_t devicetype)
 #endif
 
         case NV_ENC_CUDA:
-            CUresult cuResult = CUDA_SUCCESS;
-            cuResult = cuCtxDestroy((CUcontext)m_pDevice);
-            if (cuResult != CUDA_SUCCESS)
-            {
-                NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-                NvEncoderLogFile << "cuCtxDestroy() error.\n";
-                NvEncoderLogFile.close();
-                PRINTERR("cuCtxDestroy error:0x%x\n", cuResult);
-            }
+            // The context belongs to the session pool.
+            break;
         }
 
         m_pDevice = NULL;
@@ -503,6 +877,7 @@ NVENCSTATUS CNvEncoder::Deinitialize(uint32_t devicetype)
     }
 #endif
 
+    LOG_DEBUG(NvEncoderLogger, "Encoder deinitialized.");
     return nvStatus;
 }
 
@@ -534,15 +909,13 @@ NVENCSTATUS loadframe(uint8_t *yuvInput[3], HANDLE hInputYUVFile, uint32_t frmId
 }
 int lumaPlaneSize, chromaPlaneSize;
 
-int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initialBitrate)
+int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initialBitrate,
+                           uint8_t **ppCaptureBuffers, int nCaptureBuffers)
 {
     uint8_t *yuv[3];
     
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
 
-    NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::trunc);
-    NvEncoderLogFile.close();
-
     memset(&encodeConfig, 0, sizeof(EncodeConfig));
 
     encodeConfig.endFrameIdx = INT_MAX;
@@ -564,50 +937,14 @@ int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initia
     encodeConfig.height = height;
     encodeConfig.vbvSize = 0;
     encodeConfig.numB = 0;
+    encodeConfig.convertThreads = DEFAULT_CONVERT_THREADS;
+    encodeConfig.zeroCopyInput = DEFAULT_ZERO_COPY_INPUT;
+    encodeConfig.encodeQueueDepth = DEFAULT_ENCODE_QUEUE_DEPTH;
+    encodeConfig.runtimeQpDeltaMap = IsQpDeltaMapEnabled() ? 1 : 0;
+    m_iIndex = index;
 
-    switch (encodeConfig.deviceType)
-    {
-#if defined(NV_WINDOWS)
-    case NV_ENC_DX9:
-        InitD3D9(encodeConfig.deviceID);
-        break;
-
-    case NV_ENC_DX10:
-        InitD3D10(encodeConfig.deviceID);
-        break;
-
-    case NV_ENC_DX11:
-        InitD3D11(encodeConfig.deviceID);
-        break;
-#endif
-    case NV_ENC_CUDA:
-        InitCuda(encodeConfig.deviceID);
-        break;
-    }
-
-    if (encodeConfig.deviceType != NV_ENC_CUDA)
-        nvStatus = m_pNvHWEncoder->Initialize(m_pDevice, NV_ENC_DEVICE_TYPE_DIRECTX);
-    else
-        nvStatus = m_pNvHWEncoder->Initialize(m_pDevice, NV_ENC_DEVICE_TYPE_CUDA);
-
-    if (nvStatus != NV_ENC_SUCCESS)
-    {
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "m_pNvHWEncoder->Initialize failed.\n";
-        NvEncoderLogFile.close();
-        return 1;
-    }
-
-    encodeConfig.presetGUID = m_pNvHWEncoder->GetPresetGUID(encodeConfig.encoderPreset, encodeConfig.codec);
+    m_pConvertPool = WorkerPool::GetShared(encodeConfig.convertThreads);
 
-    nvStatus = m_pNvHWEncoder->CreateEncoder(&encodeConfig, index);
-    if (nvStatus != NV_ENC_SUCCESS)
-    {
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "m_pNvHWEncoder->CreateEncoder failed.\n";
-        NvEncoderLogFile.close();
-        return 1;
-    }
     encodeConfig.maxWidth = encodeConfig.maxWidth ? encodeConfig.maxWidth : encodeConfig.width;
     encodeConfig.maxHeight = encodeConfig.maxHeight ? encodeConfig.maxHeight : encodeConfig.height;
 
@@ -627,19 +964,97 @@ int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initia
             NumIOBuffers = MAX_ENCODE_QUEUE / 2;
         else
             NumIOBuffers = MAX_ENCODE_QUEUE;
-        m_uEncodeBufferCount = 1;
-        //m_uEncodeBufferCount = NumIOBuffers;
+        if (encodeConfig.encodeQueueDepth > 0 && encodeConfig.encodeQueueDepth < NumIOBuffers)
+            m_uEncodeBufferCount = encodeConfig.encodeQueueDepth;
+        else
+            m_uEncodeBufferCount = NumIOBuffers;
+    }
+
+    // On CUDA the session, its buffers and the context come from the pool
+    // and go back to it when the player leaves.
+    if (encodeConfig.deviceType == NV_ENC_CUDA)
+    {
+        EncodeSessionKey key;
+        key.iDevice = encodeConfig.deviceID;
+        key.uWidth = encodeConfig.width;
+        key.uHeight = encodeConfig.height;
+        key.uCodec = encodeConfig.codec;
+        key.uFormat = encodeConfig.isYuv444;
+        key.nBuffers = m_uEncodeBufferCount;
+
+        m_pSession = (NvEncodeSession *)GetSessionPool()->Lease(key, &encodeConfig);
+        m_bPooledSession = true;
+
+        EncodeSessionPoolStats poolStats;
+        GetSessionPool()->GetStats(&poolStats);
+        LOG_INFO(NvEncoderLogger, "Encode sessions: " << poolStats.nLeased << " leased, " << poolStats.nIdle << " idle, "
+                                  << poolStats.nOpened << " opened and " << poolStats.nReused << " reused so far.");
+    }
+    else
+    {
+        switch (encodeConfig.deviceType)
+        {
+#if defined(NV_WINDOWS)
+        case NV_ENC_DX9:
+            InitD3D9(encodeConfig.deviceID);
+            break;
+
+        case NV_ENC_DX10:
+            InitD3D10(encodeConfig.deviceID);
+            break;
+
+        case NV_ENC_DX11:
+            InitD3D11(encodeConfig.deviceID);
+            break;
+#endif
+        }
+
+        m_pSession = OpenNvEncodeSession(m_pDevice, NV_ENC_DEVICE_TYPE_DIRECTX, &encodeConfig, m_uEncodeBufferCount);
+        m_bPooledSession = false;
+    }
+
+    if (!m_pSession)
+    {
+        LOG_ERROR(NvEncoderLogger, "No encode session.");
+        return 1;
+    }
+    m_pNvHWEncoder = m_pSession->pNvHWEncoder;
+    m_pResourceApi = m_pSession->pResourceApi;
+    m_pInputBinder = m_pSession->pInputBinder;
+
+    nvStatus = m_pNvHWEncoder->AttachOutput(index, &encodeConfig);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        LOG_ERROR(NvEncoderLogger, "m_pNvHWEncoder->AttachOutput failed.");
+        Deinitialize(encodeConfig.deviceType);
+        return 1;
     }
     m_uPicStruct = encodeConfig.pictureStruct;
-    nvStatus = AllocateIOBuffers(encodeConfig.width, encodeConfig.height, encodeConfig.isYuv444);
+
+    // A map is only rebuilt once every frame that could still read it is
+    // out of the encoder.
+    if (encodeConfig.runtimeQpDeltaMap)
+    {
+        QpDeltaConfig qpDeltaConfig;
+        GetDefaultQpDeltaConfig(&qpDeltaConfig);
+        m_qpDeltaMapBuilder.Init(encodeConfig.width, encodeConfig.height, m_uEncodeBufferCount + 1, qpDeltaConfig);
+        m_qpDeltaMapBuilder.AddHudRegionsFromEnv();
+    }
+    StartAdaptiveResolution();
+
+    nvStatus = StartEncodePipeline();
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "AllocateIOBuffers failed.\n";
-        NvEncoderLogFile.close();
+        Deinitialize(encodeConfig.deviceType);
         return 1;
     }
 
+    if (encodeConfig.zeroCopyInput && ppCaptureBuffers && nCaptureBuffers > 0 && !encodeConfig.isYuv444)
+    {
+        // Failure is not fatal; EncodeFrame copies whatever is not registered.
+        RegisterCaptureBuffers(ppCaptureBuffers, nCaptureBuffers, encodeConfig.width, encodeConfig.height);
+    }
+
     uint32_t  chromaFormatIDC = (encodeConfig.isYuv444 ? 3 : 1);
     lumaPlaneSize = encodeConfig.maxWidth * encodeConfig.maxHeight;
     chromaPlaneSize = (chromaFormatIDC == 3) ? lumaPlaneSize : (lumaPlaneSize >> 2);
@@ -651,16 +1066,14 @@ int CNvEncoder::EncodeMain(int index, int width, int height, int fps, int initia
     if (yuv[0] == NULL || yuv[1] == NULL || yuv[2] == NULL)
     {
         PRINTERR("\nvEncoder.exe Error: Failed to allocate memory for yuv array!\n");
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "Error: Failed to allocate memory for yuv array.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "Error: Failed to allocate memory for yuv array.");
         return 1;
     }
 
     return 0;
 }
 
-void CNvEncoder::ShutdownNvEncoder()
+void CNvEncoder::Shutdown()
 {
     if (encodeConfig.fOutput)
     {
@@ -677,20 +1090,37 @@ void CNvEncoder::EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, i
     //if (numBytesRead == 0)
     //    break;
 
+    EncodeView(YuvFrameView(buffer, encodeConfig.width, encodeConfig.height), isReconfiguringBitrate, index, targetBitrate);
+}
+
+void CNvEncoder::EncodeView(const YuvI420View &view, bool isReconfiguringBitrate, int index, int targetBitrate)
+{
+    // EncodeMain failed; the frame is dropped.
+    if (!m_pSession)
+        return;
+
+    YuvI420View input = view;
+    if (m_uEncodeWidth != (uint32_t)encodeConfig.width || m_uEncodeHeight != (uint32_t)encodeConfig.height)
+    {
+        FRAME_TRACE_SCOPE("Scale");
+        m_scaler.Scale(view, &m_aScaledFrame[0]);
+        input = YuvFrameView(&m_aScaledFrame[0], m_uEncodeWidth, m_uEncodeHeight);
+    }
+
     EncodeFrameConfig stEncodeFrame;
     memset(&stEncodeFrame, 0, sizeof(stEncodeFrame));
     
-    stEncodeFrame.stride[0] = encodeConfig.width;
-    stEncodeFrame.stride[1] = (encodeConfig.isYuv444) ? encodeConfig.width : encodeConfig.width / 2;
-    stEncodeFrame.stride[2] = (encodeConfig.isYuv444) ? encodeConfig.width : encodeConfig.width / 2;
-    stEncodeFrame.width = encodeConfig.width;
-    stEncodeFrame.height = encodeConfig.height;
+    stEncodeFrame.stride[0] = input.strideY;
+    stEncodeFrame.stride[1] = input.strideUV;
+    stEncodeFrame.stride[2] = input.strideUV;
+    stEncodeFrame.width = m_uEncodeWidth;
+    stEncodeFrame.height = m_uEncodeHeight;
 
-    stEncodeFrame.yuv[0] = buffer;//yuv[0];
-    stEncodeFrame.yuv[1] = buffer + (stEncodeFrame.stride[0] * encodeConfig.height);//yuv[1];
-    stEncodeFrame.yuv[2] = buffer + (stEncodeFrame.stride[0] * encodeConfig.height * 5 / 4);//yuv[2];
+    stEncodeFrame.yuv[0] = (uint8_t *)input.pY;
+    stEncodeFrame.yuv[1] = (uint8_t *)input.pU;
+    stEncodeFrame.yuv[2] = (uint8_t *)input.pV;
 
-    EncodeFrame(&stEncodeFrame, index, false, encodeConfig.width, encodeConfig.height);
+    EncodeFrame(&stEncodeFrame, index, false, m_uEncodeWidth, m_uEncodeHeight);
 
     if (isReconfiguringBitrate == true)
     {
@@ -700,20 +1130,120 @@ void CNvEncoder::EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, i
         encPicCommand.newVBVSize = 0;
         encPicCommand.newBitrate = targetBitrate;
     
+        // Resolution changes go through ChangeResolution.
         encPicCommand.bResolutionChangePending = false;
-        //encPicCommand.newHeight = 640;
-        //encPicCommand.newWidth = 480;
     
+        // Frames still queued must not be encoded against the new settings.
+        m_encodePipeline.WaitIdle();
+
         NVENCSTATUS status = m_pNvHWEncoder->NvEncReconfigureEncoder(&encPicCommand);
         if (status != NV_ENC_SUCCESS)
         {
             // Common error: NV_ENC_ERR_INVALID_PARAM (== 8)
-            printf("Bitrate changing failed! Error is %d\n", status);
-            NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-            NvEncoderLogFile << "Bitrate changing failed! Error is " << status << "\n";
-            NvEncoderLogFile.close();
+            LOG_ERROR(NvEncoderLogger, "Bitrate changing failed! Error is " << status);
+        }
+        else
+        {
+            m_uTargetBps = targetBitrate;
         }
     }
+
+    // The drain thread asked for a new step; it stays off the controller
+    // until the change is done.
+    if (m_bResolutionChangePending.load(std::memory_order_acquire))
+    {
+        ChangeResolution();
+        m_bResolutionChangePending.store(false, std::memory_order_release);
+    }
+}
+
+// The ladder starts at the capture size; DXIFRSHIM_ADAPTIVE_RESOLUTION=0
+// keeps it there.
+void CNvEncoder::StartAdaptiveResolution()
+{
+    m_uEncodeWidth = encodeConfig.width;
+    m_uEncodeHeight = encodeConfig.height;
+    m_uTargetBps = encodeConfig.bitrate;
+    BitstreamOutput *pOutput = m_pNvHWEncoder->m_pOutput;
+    m_nBytesReported = pOutput ? pOutput->GetBytesWritten() : 0;
+
+    char szLabels[32];
+    sprintf(szLabels, "player=\"%d\"", m_iIndex);
+    m_pEncodeHeightMetric = MetricsRegistry::GetShared()->GetGauge("dxifrshim_encode_height_pixels",
+        "Height of the picture the encoder is configured for.", szLabels);
+    m_pEncodeHeightMetric->Set(m_uEncodeHeight);
+
+    ResolutionStep aSteps[RESOLUTION_MAX_STEPS];
+    int nSteps = ResolutionGetLadder(encodeConfig.width, encodeConfig.height, aSteps);
+    ResolutionConfig config;
+    GetDefaultResolutionConfig(&config);
+    m_bAdaptiveResolution = nSteps > 1 && m_resolution.Init(aSteps, nSteps, encodeConfig.fps, config);
+    if (m_bAdaptiveResolution)
+    {
+        LOG_INFO(NvEncoderLogger, "Adaptive resolution: " << nSteps << " steps from " << aSteps[0].width << "x"
+                                  << aSteps[0].height << " down to " << aSteps[nSteps - 1].width << "x"
+                                  << aSteps[nSteps - 1].height << ".");
+    }
+}
+
+// Reconfigures NVENC for the controller's step. The frames in flight are
+// written out first, so the new parameter sets follow the old pictures.
+void CNvEncoder::ChangeResolution()
+{
+    const ResolutionStep &size = m_resolution.GetSize();
+    bool bScaled = size.width != (int)encodeConfig.width || size.height != (int)encodeConfig.height;
+    if (bScaled && !m_scaler.Init(encodeConfig.width, encodeConfig.height, size.width, size.height, SCALE_FILTER_BILINEAR))
+    {
+        m_bAdaptiveResolution = false;
+        return;
+    }
+
+    m_encodePipeline.WaitIdle();
+
+    NvEncPictureCommand encPicCommand;
+    memset(&encPicCommand, 0, sizeof(encPicCommand));
+    encPicCommand.bResolutionChangePending = true;
+    encPicCommand.newWidth = size.width;
+    encPicCommand.newHeight = size.height;
+    NVENCSTATUS status = m_pNvHWEncoder->NvEncReconfigureEncoder(&encPicCommand);
+    if (status != NV_ENC_SUCCESS)
+    {
+        // The encoder keeps its size; so does the player from now on.
+        LOG_WARN(NvEncoderLogger, "Resolution change to " << size.width << "x" << size.height << " failed with error "
+                                  << status << ", staying at " << m_uEncodeWidth << "x" << m_uEncodeHeight << ".");
+        m_bAdaptiveResolution = false;
+        return;
+    }
+
+    if (bScaled)
+    {
+        m_aScaledFrame.resize(m_scaler.GetFrameSize());
+    }
+    m_uEncodeWidth = size.width;
+    m_uEncodeHeight = size.height;
+    m_pNvHWEncoder->RefreshParameterSets();
+    m_pEncodeHeightMetric->Set(m_uEncodeHeight);
+    LOG_INFO(NvEncoderLogger, "Player " << m_iIndex << " encodes at " << m_uEncodeWidth << "x" << m_uEncodeHeight
+                              << " (" << GetResolutionReasonName(m_resolution.GetLastReason()) << ").");
+}
+
+void CNvEncoder::SetChangedTiles(const uint8_t *pDirtyMask, int nTilesX, int nTilesY)
+{
+    if (encodeConfig.runtimeQpDeltaMap && pDirtyMask)
+    {
+        m_pQpDeltaMap = m_qpDeltaMapBuilder.Build(pDirtyMask, nTilesX, nTilesY, TILE_HASH_SIZE);
+    }
+}
+
+// Nothing is queued for a skipped frame; the next frame that changes is
+// encoded as usual.
+bool CNvEncoder::SkipFrame(int index)
+{
+    if (!m_pSession)
+        return true;
+
+    BitstreamOutput *pOutput = m_pNvHWEncoder->m_pOutput;
+    return !pOutput || !pOutput->IsKeyframeRequested();
 }
 
 NVENCSTATUS CNvEncoder::EncodeFrame(EncodeFrameConfig *pEncodeFrame, int index, bool bFlush, uint32_t width, uint32_t height)
@@ -725,9 +1255,7 @@ NVENCSTATUS CNvEncoder::EncodeFrame(EncodeFrameConfig *pEncodeFrame, int index,
     if (bFlush)
     {
         // Does not run
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "if (bFlush).\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "if (bFlush).");
         FlushEncoder(index);
         return NV_ENC_SUCCESS;
     }
@@ -735,59 +1263,70 @@ NVENCSTATUS CNvEncoder::EncodeFrame(EncodeFrameConfig *pEncodeFrame, int index,
     if (!pEncodeFrame)
     {
         // Does not run
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "pEncodeFrame is NULL. NV_ENC_ERR_INVALID_PARAM.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "pEncodeFrame is NULL. NV_ENC_ERR_INVALID_PARAM.");
         return NV_ENC_ERR_INVALID_PARAM;
     }
 
-    pEncodeBuffer = m_EncodeBufferQueue.GetAvailable();
+    // A tile starts inside a capture buffer but is not one.
+    pEncodeBuffer = pEncodeFrame->stride[0] == width ? FindCaptureBuffer(pEncodeFrame->yuv[0]) : NULL;
+    if (pEncodeBuffer)
+    {
+        return EncodeCaptureBuffer(pEncodeBuffer, index, width, height);
+    }
+
+    // Blocks only while every buffer is still waiting for its output.
+    pEncodeBuffer = (EncodeBuffer *)m_encodePipeline.AcquireFree();
     if (!pEncodeBuffer)
     {
-        // This does run
-        m_pNvHWEncoder->ProcessOutput(m_EncodeBufferQueue.GetPending(), index);
-        pEncodeBuffer = m_EncodeBufferQueue.GetAvailable();
+        // Only once the pipeline has been stopped.
+        LOG_ERROR(NvEncoderLogger, "m_encodePipeline.AcquireFree returned no buffer.");
+        return NV_ENC_ERR_ENCODER_BUSY;
     }
 
+    pEncodeBuffer->stOutputBfr.uTraceFrame = FrameTraceGetFrame();
     unsigned char *pInputSurface;
 
-    nvStatus = m_pNvHWEncoder->NvEncLockInputBuffer(pEncodeBuffer->stInputBfr.hInputSurface, (void**)&pInputSurface, &lockedPitch);
+    nvStatus = m_pInputBinder->BeginWrite(&pEncodeBuffer->stInputBfr, &pInputSurface, &lockedPitch);
     if (nvStatus != NV_ENC_SUCCESS)
     {
         // Does not run
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "m_pNvHWEncoder->NvEncLockInputBuffer.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "m_pNvHWEncoder->NvEncLockInputBuffer.");
+        m_encodePipeline.CancelAcquire();
         return nvStatus;
     }
 
+    FRAME_TRACE_BEGIN_EVENT("Convert");
     if (pEncodeBuffer->stInputBfr.bufferFmt == NV_ENC_BUFFER_FORMAT_NV12_PL)
     {
         unsigned char *pInputSurfaceCh = pInputSurface + (pEncodeBuffer->stInputBfr.dwHeight*lockedPitch);
-        convertYUVpitchtoNV12(pEncodeFrame->yuv[0], pEncodeFrame->yuv[1], pEncodeFrame->yuv[2], pInputSurface, pInputSurfaceCh, width, height, width, lockedPitch);
+        convertYUVpitchtoNV12(m_pConvertPool, pEncodeFrame->yuv[0], pEncodeFrame->yuv[1], pEncodeFrame->yuv[2], pInputSurface, pInputSurfaceCh, width, height, pEncodeFrame->stride[0], lockedPitch);
     }
     else
     {
         // Does not run
         unsigned char *pInputSurfaceCb = pInputSurface + (pEncodeBuffer->stInputBfr.dwHeight * lockedPitch);
         unsigned char *pInputSurfaceCr = pInputSurfaceCb + (pEncodeBuffer->stInputBfr.dwHeight * lockedPitch);
-        convertYUVpitchtoYUV444(pEncodeFrame->yuv[0], pEncodeFrame->yuv[1], pEncodeFrame->yuv[2], pInputSurface, pInputSurfaceCb, pInputSurfaceCr, width, height, width, lockedPitch);
+        convertYUVpitchtoYUV444(m_pConvertPool, pEncodeFrame->yuv[0], pEncodeFrame->yuv[1], pEncodeFrame->yuv[2], pInputSurface, pInputSurfaceCb, pInputSurfaceCr, width, height, pEncodeFrame->stride[0], lockedPitch);
     }
-    nvStatus = m_pNvHWEncoder->NvEncUnlockInputBuffer(pEncodeBuffer->stInputBfr.hInputSurface);
+    nvStatus = m_pInputBinder->EndWrite(&pEncodeBuffer->stInputBfr);
+    FRAME_TRACE_END_EVENT("Convert");
     if (nvStatus != NV_ENC_SUCCESS)
     {
         // Does not run
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "m_pNvHWEncoder->NvEncUnlockInputBuffer.\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "m_pNvHWEncoder->NvEncUnlockInputBuffer.");
+        m_encodePipeline.CancelAcquire();
         return nvStatus;
     }
-    nvStatus = m_pNvHWEncoder->NvEncEncodeFrame(pEncodeBuffer, NULL, width, height, (NV_ENC_PIC_STRUCT)m_uPicStruct);
+    NvEncPictureCommand encPicCommand;
+    NvEncPictureCommand *pCommand = GetPictureCommand(index, &encPicCommand);
+    nvStatus = m_pNvHWEncoder->NvEncEncodeFrame(pEncodeBuffer, pCommand, width, height, (NV_ENC_PIC_STRUCT)m_uPicStruct,
+                                                TakeQpDeltaMap(pCommand), m_qpDeltaMapBuilder.GetMapSize());
     if (nvStatus != NV_ENC_SUCCESS)
     {
-        NvEncoderLogFile.open("NvEncoderLogFile.txt", std::ios::app);
-        NvEncoderLogFile << "m_pNvHWEncoder->NvEncEncodeFrame\n";
-        NvEncoderLogFile.close();
+        LOG_ERROR(NvEncoderLogger, "m_pNvHWEncoder->NvEncEncodeFrame");
+        m_encodePipeline.CancelAcquire();
+        return nvStatus;
     }
+    m_encodePipeline.Submit();
     return nvStatus;
 }
\ No newline at end of file
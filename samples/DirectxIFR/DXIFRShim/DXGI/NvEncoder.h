@@ -12,6 +12,8 @@
 //
 ////////////////////////////////////////////////////////////////////////////
 
+#pragma once
+
 #if defined(NV_WINDOWS)
 #include <d3d9.h>
 #include <d3d10_1.h>
@@ -19,72 +21,41 @@
 #pragma warning(disable : 4996)
 #endif
 
-#include "../common/inc/NvHWEncoder.h"
+#include "../Common/inc/NvHWEncoder.h"
+#include "../Common/EncodeInputBinder.h"
+#include "../Common/EncodePipeline.h"
+#include "../Common/EncodeSessionPool.h"
+#include "../Common/VideoEncoder.h"
+#include "../Common/QpDeltaMap.h"
+#include "../Common/ResolutionController.h"
+#include "FrameScaler.h"
+#include <atomic>
+#include <vector>
+
+class MetricGauge;
+class WorkerPool;
 
 #define MAX_ENCODE_QUEUE 32
 #define FRAME_QUEUE 240
 
-#define SET_VER(configStruct, type) {configStruct.version = type##_VER;}
+// Threads used to copy a frame into the encoder input surface, shared by
+// all players. 0 uses one thread per logical core.
+#define DEFAULT_CONVERT_THREADS 0
 
-template<class T>
-class CNvQueue {
-    T** m_pBuffer;
-    unsigned int m_uSize;
-    unsigned int m_uPendingCount;
-    unsigned int m_uAvailableIdx;
-    unsigned int m_uPendingndex;
-public:
-    CNvQueue() : m_pBuffer(NULL), m_uSize(0), m_uPendingCount(0), m_uAvailableIdx(0),
-        m_uPendingndex(0)
-    {
-    }
+// Encode straight from the capture buffers instead of copying each frame
+// into an encoder-owned surface. Falls back to copying if registration fails.
+#define DEFAULT_ZERO_COPY_INPUT 0
 
-    ~CNvQueue()
-    {
-        delete[] m_pBuffer;
-    }
+// Most capture buffers that can be registered as encoder input.
+#define MAX_CAPTURE_BUFFERS 4
 
-    bool Initialize(T *pItems, unsigned int uSize)
-    {
-        m_uSize = uSize;
-        m_uPendingCount = 0;
-        m_uAvailableIdx = 0;
-        m_uPendingndex = 0;
-        m_pBuffer = new T *[m_uSize];
-        for (unsigned int i = 0; i < m_uSize; i++)
-        {
-            m_pBuffer[i] = &pItems[i];
-        }
-        return true;
-    }
-
-
-    T * GetAvailable()
-    {
-        T *pItem = NULL;
-        if (m_uPendingCount == m_uSize)
-        {
-            return NULL;
-        }
-        pItem = m_pBuffer[m_uAvailableIdx];
-        m_uAvailableIdx = (m_uAvailableIdx + 1) % m_uSize;
-        m_uPendingCount += 1;
-        return pItem;
-    }
-
-    T* GetPending()
-    {
-        if (m_uPendingCount == 0)
-        {
-            return NULL;
-        }
-
-        T *pItem = m_pBuffer[m_uPendingndex];
-        m_uPendingndex = (m_uPendingndex + 1) % m_uSize;
-        m_uPendingCount -= 1;
-        return pItem;
-    }
-};
+// Frames that may be in flight between submission and bitstream output.
+// Output is written by a separate thread, so 1 serializes upload, encode and
+// output; each extra buffer adds up to one frame of latency when the encoder
+// falls behind. 0 uses as many as the resolution allows.
+#define DEFAULT_ENCODE_QUEUE_DEPTH 2
+
+#define SET_VER(configStruct, type) {configStruct.version = type##_VER;}
 
 typedef struct _EncodeFrameConfig
 {
@@ -102,15 +73,82 @@ typedef enum
     NV_ENC_DX10 = 3,
 } NvEncodeDeviceType;
 
-class CNvEncoder
+// IEncodeResourceApi on top of CNvHWEncoder and the encoder's CUDA context.
+// Host buffers are exposed to NVENC as mapped CUDA device pointers.
+class CNvEncodeResourceApi : public IEncodeResourceApi
+{
+public:
+    CNvEncodeResourceApi(CNvHWEncoder *pNvHWEncoder) : m_pNvHWEncoder(pNvHWEncoder), m_cuContext(NULL) {}
+
+    void SetCudaContext(CUcontext cuContext) { m_cuContext = cuContext; }
+
+    virtual NVENCSTATUS CreateInputBuffer(uint32_t width, uint32_t height, NV_ENC_BUFFER_FORMAT bufferFmt, NV_ENC_INPUT_PTR *phInput);
+    virtual NVENCSTATUS DestroyInputBuffer(NV_ENC_INPUT_PTR hInput);
+    virtual NVENCSTATUS LockInputBuffer(NV_ENC_INPUT_PTR hInput, void **ppData, uint32_t *pPitch);
+    virtual NVENCSTATUS UnlockInputBuffer(NV_ENC_INPUT_PTR hInput);
+    virtual NVENCSTATUS RegisterHostBuffer(void *pHost, size_t nBytes, uint32_t width, uint32_t height, uint32_t pitch,
+                                           NV_ENC_BUFFER_FORMAT bufferFmt, NV_ENC_REGISTERED_PTR *phRegistered);
+    virtual NVENCSTATUS UnregisterHostBuffer(NV_ENC_REGISTERED_PTR hRegistered);
+    virtual NVENCSTATUS MapInputResource(NV_ENC_REGISTERED_PTR hRegistered, NV_ENC_INPUT_PTR *phMapped);
+    virtual NVENCSTATUS UnmapInputResource(NV_ENC_INPUT_PTR hMapped);
+
+private:
+    struct HostRegistration
+    {
+        NV_ENC_REGISTERED_PTR hRegistered;
+        void                 *pHost;
+        bool                  bPinnedHere;      // cuMemHostRegister was called by us
+    };
+
+    CNvHWEncoder                  *m_pNvHWEncoder;
+    CUcontext                      m_cuContext;
+    std::vector<HostRegistration>  m_aRegistrations;
+};
+
+// An NVENC session with its input and bitstream buffers. Players lease them
+// from the shared EncodeSessionPool; a CNvEncoder only opens one of its own
+// on a D3D device.
+struct NvEncodeSession
+{
+    CNvHWEncoder                  *pNvHWEncoder;
+    CNvEncodeResourceApi          *pResourceApi;
+    EncodeInputBinder             *pInputBinder;
+    EncodeBuffer                   aEncodeBuffer[MAX_ENCODE_QUEUE];
+    uint32_t                       uEncodeBufferCount;
+    EncodeOutputBuffer             stEOSOutputBfr;
+};
+
+// Opens a session on pDevice for pEncCfg and allocates nBuffers buffer pairs
+// of its size. The session has no output until AttachOutput. Returns NULL on
+// failure.
+NvEncodeSession *OpenNvEncodeSession(void *pDevice, NV_ENC_DEVICE_TYPE deviceType, const EncodeConfig *pEncCfg, uint32_t nBuffers);
+void CloseNvEncodeSession(NvEncodeSession *pSession);
+
+// IEncodeSessionDevice on CUDA: a context per GPU, and sessions opened and
+// reset for the EncodeConfig passed to EncodeSessionPool::Lease.
+class CNvEncodeSessionDevice : public IEncodeSessionDevice
+{
+public:
+    virtual void *CreateContext(int iDevice);
+    virtual void DestroyContext(void *pContext);
+    virtual void *OpenSession(void *pContext, const EncodeSessionKey &key, const void *pParams);
+    virtual bool ResetSession(void *pSession, const void *pParams);
+    virtual void CloseSession(void *pSession);
+};
+
+class CNvEncoder : public IVideoEncoder
 {
 public:
     CNvEncoder(int index);
     virtual ~CNvEncoder();
 
-    int                                                  EncodeMain(int index, int width, int height, int fps, int initialBitrate);
-    void                                                 EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, int index, int targetBitrate);
-    void                                                 ShutdownNvEncoder();
+    virtual int                                          EncodeMain(int index, int width, int height, int fps, int initialBitrate,
+                                                                    uint8_t **ppCaptureBuffers = NULL, int nCaptureBuffers = 0);
+    virtual void                                         EncodeFrameLoop(uint8_t *buffer, bool isReconfiguringBitrate, int index, int targetBitrate);
+    virtual void                                         EncodeView(const YuvI420View &view, bool isReconfiguringBitrate, int index, int targetBitrate);
+    virtual bool                                         SkipFrame(int index);
+    virtual void                                         SetChangedTiles(const uint8_t *pDirtyMask, int nTilesX, int nTilesY);
+    virtual void                                         Shutdown();
     EncodeConfig                                         encodeConfig;
 
 protected:
@@ -124,9 +162,27 @@ protected:
 
     CUcontext                                            m_cuContext;
     EncodeConfig                                         m_stEncoderInput;
-    EncodeBuffer                                         m_stEncodeBuffer[MAX_ENCODE_QUEUE];
-    CNvQueue<EncodeBuffer>                               m_EncodeBufferQueue;
-    EncodeOutputBuffer                                   m_stEOSOutputBfr;
+    NvEncodeSession                                     *m_pSession;
+    bool                                                 m_bPooledSession;  // leased, not opened here
+    EncodePipeline                                       m_encodePipeline;
+    int                                                  m_iIndex;
+    WorkerPool                                          *m_pConvertPool;
+    CNvEncodeResourceApi                                *m_pResourceApi;      // these two and m_pNvHWEncoder
+    EncodeInputBinder                                   *m_pInputBinder;      // are m_pSession's
+    EncodeBuffer                                         m_stCaptureBuffer[MAX_CAPTURE_BUFFERS];
+    uint32_t                                             m_uCaptureBufferCount;
+    QpDeltaMapBuilder                                    m_qpDeltaMapBuilder;
+    const int8_t                                        *m_pQpDeltaMap;     // map of the next frame, or NULL
+    ResolutionController                                 m_resolution;
+    bool                                                 m_bAdaptiveResolution;
+    uint32_t                                             m_uEncodeWidth;    // what NVENC is configured for
+    uint32_t                                             m_uEncodeHeight;
+    FrameScaler                                          m_scaler;          // capture to m_uEncodeWidth
+    std::vector<unsigned char>                           m_aScaledFrame;
+    std::atomic<uint32_t>                                m_uTargetBps;      // read by the drain thread
+    uint64_t                                             m_nBytesReported;  // drain thread only
+    std::atomic<bool>                                    m_bResolutionChangePending;
+    MetricGauge                                         *m_pEncodeHeightMetric;
 
 protected:
     NVENCSTATUS                                          Deinitialize(uint32_t devicetype);
@@ -134,11 +190,20 @@ protected:
     NVENCSTATUS                                          InitD3D9(uint32_t deviceID = 0);
     NVENCSTATUS                                          InitD3D11(uint32_t deviceID = 0);
     NVENCSTATUS                                          InitD3D10(uint32_t deviceID = 0);
-    NVENCSTATUS                                          InitCuda(uint32_t deviceID = 0);
-    NVENCSTATUS                                          AllocateIOBuffers(uint32_t uInputWidth, uint32_t uInputHeight, uint32_t isYuv444);
-    NVENCSTATUS                                          ReleaseIOBuffers();
+    NVENCSTATUS                                          StartEncodePipeline();
+    NVENCSTATUS                                          RegisterCaptureBuffers(uint8_t **ppCaptureBuffers, int nCaptureBuffers, uint32_t uWidth, uint32_t uHeight);
+    void                                                 ReleaseCaptureBuffers();
+    EncodeBuffer*                                        FindCaptureBuffer(const uint8_t *pFrame);
+    NVENCSTATUS                                          EncodeCaptureBuffer(EncodeBuffer *pEncodeBuffer, int index, uint32_t width, uint32_t height);
+    NvEncPictureCommand*                                 GetPictureCommand(int index, NvEncPictureCommand *pCommand);
+    int8_t*                                              TakeQpDeltaMap(const NvEncPictureCommand *pCommand);
+    void                                                 StartAdaptiveResolution();
+    void                                                 ChangeResolution();
     unsigned char*                                       LockInputBuffer(void * hInputSurface, uint32_t *pLockedPitch);
     NVENCSTATUS                                          FlushEncoder(int index);
+    void                                                 LogPipelineStats();
+    static void                                          DrainEncodeBuffer(void *pContext, void *pItem);
+    static void                                          OnEncodeBufferDrained(void *pContext, void *pItem, uint64_t uLatencyUs);
     NVENCSTATUS                                          RunMotionEstimationOnly(MEOnlyConfig *pMEOnly, bool bFlush);
 };
 
@@ -38,6 +38,7 @@
 #include "helper_cuda_drvapi.h"
 
 #include <Timer.h>
+#include <FramePacer.h>
 
 #include <NvFBCLibrary.h>
 #include <NvFBC/nvFBCCuda.h>
@@ -53,11 +54,15 @@
 //! Starting encoder bitrate
 #define ENCODER_BITRATE 8000000
 
+//! Grab rate, the frame rate the encoder is set up with
+#define GRAB_FPS 30
+
 //! Command line arguments
 typedef struct
 {
     int         iFrameCnt; // Number of frames to encode
     int         iBitrate; // Bitrate to use
+    int         iFps; // Frames to grab per second, 0 for as fast as possible
     std::string sBaseName; // Basename for the output stream
 }AppArguments;
 
@@ -82,9 +87,10 @@ FILE *GetOutputFile(std::string baseName, DWORD width, DWORD height)
 
 void printHelp()
 {
-    printf("Usage NvFBCCudaNvEnc: [-bitrate bitrate] [-frames framecnt] [-output filename]\n");
+    printf("Usage NvFBCCudaNvEnc: [-bitrate bitrate] [-frames framecnt] [-fps fps] [-output filename]\n");
     printf("  -bitrate bitrate      The bitrate to encode at.\n");
     printf("  -frames framecnt      The number of frames to encode.\n");
+    printf("  -fps fps              The frames to grab per second, 0 for as fast as possible.\n");
     printf("  -output filename      The base name for output stream.\n");
 }
 
@@ -92,6 +98,7 @@ bool parseArgs(int argc, char **argv, AppArguments &args)
 {
     args.iBitrate = ENCODER_BITRATE;
     args.iFrameCnt = FRAME_COUNT;
+    args.iFps = GRAB_FPS;
     args.sBaseName = "NvFBCCudaNvEnc";
 
     for(int cnt = 1; cnt < argc; ++cnt)
@@ -126,6 +133,21 @@ bool parseArgs(int argc, char **argv, AppArguments &args)
                 return false;
             }
         }
+        else if(0 == STRCASECMP(argv[cnt], "-fps"))
+        {
+            ++cnt;
+
+            if(cnt < argc)
+            {
+                args.iFps = atoi(argv[cnt]);
+            }
+            else
+            {
+                printf("Missing fps argument\n");
+                printHelp();
+                return false;
+            }
+        }
         else if(0 == STRCASECMP(argv[cnt], "-output"))
         {
             ++cnt;
@@ -224,9 +246,13 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    //! Without pacing, NOWAIT grabs return as fast as they are called
+    FramePacer pacer(args.iFps > 0 ? args.iFps : 0);
+
     frameTimer.reset();
     for(int frameCnt = 0; frameCnt < args.iFrameCnt; ++frameCnt)
     {
+        pacer.Wait();
         grabTimer.reset();
 
         NVFBCRESULT fbcRes = NVFBC_SUCCESS;
@@ -309,6 +335,10 @@ int main(int argc, char *argv[])
         }
     }
 
+    FramePacerStats pacerStats;
+    pacer.GetStats(&pacerStats);
+    PrintFramePacerStats(stdout, pacerStats);
+
     //! Terminate the encoder
     encoder.TearDown();
 
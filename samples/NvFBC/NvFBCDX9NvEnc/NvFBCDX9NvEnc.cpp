@@ -34,6 +34,7 @@
 #include <string>
 
 #include <Timer.h>
+#include <FramePacer.h>
 #include <assert.h>
 #include <initguid.h>
 #include <d3d9.h>
@@ -53,11 +54,15 @@
 #define ENCODER_WIDTH  1920
 #define ENCODER_HEIGHT 1080
 
+//! Grab rate, the frame rate the encoder is set up with
+#define GRAB_FPS 30
+
 //! Command line arguments
 typedef struct
 {
     int         iFrameCnt; // Number of frames to encode
     int         iBitrate;  // Bitrate to use
+    int         iFps;      // Frames to grab per second, 0 for as fast as possible
 	bool        bYUV444;   // Use 4:4:4 YUV encode
 	int         iCodec;    // Codec format (H.264 or H.265)
 	std::string sBaseName; // Basename for the output stream
@@ -91,9 +96,10 @@ FILE *GetOutputFile(std::string baseName, DWORD width, DWORD height, bool bHEVC)
 
 void printHelp()
 {
-    printf("Usage NvFBCDX9NvEnc: [-bitrate bitrate] [-frames framecnt] [-output filename]\n");
+    printf("Usage NvFBCDX9NvEnc: [-bitrate bitrate] [-frames framecnt] [-fps fps] [-output filename]\n");
     printf("  -bitrate bitrate      The bitrate to encode at.\n");
     printf("  -frames framecnt      The number of frames to encode.\n");
+    printf("  -fps fps              The frames to grab per second, 0 for as fast as possible.\n");
     printf("  -output filename      The base name for output stream.\n");
     printf("  -yuv444               The encoder will use 4:4:4 sampled YUV.\n");
 	printf("  -codec  format        The Video Codec Format \"H264\" or \"HEVC\"");
@@ -103,6 +109,7 @@ bool parseArgs(int argc, char **argv, AppArguments &args)
 {
     args.iBitrate   = ENCODER_BITRATE;
     args.iFrameCnt  = FRAME_COUNT;
+    args.iFps       = GRAB_FPS;
     args.bYUV444    = false;
     args.iCodec = 0; // 0=H264, 1=HEVC
     args.sBaseName = "NvFBCDX9NvEnc";
@@ -139,6 +146,21 @@ bool parseArgs(int argc, char **argv, AppArguments &args)
                 return false;
             }
         }
+        else if (0 == STRCASECMP(argv[cnt], "-fps"))
+        {
+            ++cnt;
+
+            if (cnt < argc)
+            {
+                args.iFps = atoi(argv[cnt]);
+            }
+            else
+            {
+                printf("Missing fps argument\n");
+                printHelp();
+                return false;
+            }
+        }
         else if (0 == STRCASECMP(argv[cnt], "-output"))
         {
             ++cnt;
@@ -434,10 +456,14 @@ HRESULT InitD3D9Surfaces()
         return -1;
     }
 
+    //! Without pacing, NOWAIT grabs return as fast as they are called
+    FramePacer pacer(args.iFps > 0 ? args.iFps : 0);
+
     frameTimer.reset();
     for (int frameCnt = 0; frameCnt < args.iFrameCnt; ++frameCnt)
     {
         unsigned int frameIDX = frameCnt % MAX_BUF_QUEUE;
+        pacer.Wait();
         grabTimer.reset();
 
         // Setup NvFBC the DX9 Video Grab Parameters
@@ -526,6 +552,10 @@ HRESULT InitD3D9Surfaces()
         }
     }
 
+    FramePacerStats pacerStats;
+    pacer.GetStats(&pacerStats);
+    PrintFramePacerStats(stdout, pacerStats);
+
     Cleanup();
     return 0;
 }
@@ -13,6 +13,7 @@
 #include <process.h>
 
 #include "Timer.h"
+#include "FramePacer.h"
 #include "Encoder.h"
 
 
@@ -105,6 +106,8 @@ void Encoder::EncodeThreadProc(void *args)
 {
     Encoder *pEncoder = (Encoder *)args;
     Timer encodeTimer;
+    //! Encode at the frame rate the session was set up with
+    FramePacer pacer(pEncoder->m_stInitEncParams.frameRateNum, pEncoder->m_stInitEncParams.frameRateDen);
     for (int frameCnt = 0; frameCnt < pEncoder->m_iFrameCnt; ++frameCnt)
     {
         encodeTimer.reset();
@@ -125,8 +128,11 @@ void Encoder::EncodeThreadProc(void *args)
         printf("Encode %d: frame %d, encode time %.2f\n",
             frameCnt, frameCnt, encodeTime);
 
-        Sleep(15);
+        pacer.Wait();
     }
+    FramePacerStats pacerStats;
+    pacer.GetStats(&pacerStats);
+    PrintFramePacerStats(stdout, pacerStats);
     pEncoder->m_bDone = true;
 }
 
@@ -25,6 +25,7 @@
 
 #include <NvFBCLibrary.h>
 #include <NvFBC/nvFBCHwEnc.h>
+#include <FramePacer.h>
 
 #include <ctime>
 #include <sstream>
@@ -35,6 +36,7 @@ typedef struct
     int         iFrameCnt; // Number of frames to encode
     int         iBitrate;  // Bitrate to use
     int         iProfile;  // HWEnc encoding profile; BASELINE (66), MAIN (77) and HIGH (100)
+    int         iFps;      // Frames to grab per second, 0 for as fast as possible
     std::string sBaseName; // Basename for the output stream
     int         bLossless;
     int         bYUV444;
@@ -46,6 +48,7 @@ void printHelp()
 {
     printf("Usage: NvFBCHWEnc [options]\n");
     printf("  -frames framecnt           The number of frames to grab, defaults to 30.\n");
+    printf("  -fps fps                   The frames to grab per second, defaults to 30. 0 grabs as fast as possible.\n");
     printf("  -profile <BASE|MAIN|HIGH>  The encoding profile, defaults to MAIN.\n");
     printf("  -lossless                  The grabbed desktop images are encoded lossless if lossless encode feature is available.\n");
     printf("  -yuv444                    The grabbed desktop images are encoded without chroma subsampling.\n");
@@ -59,6 +62,7 @@ bool parseCmdLine(int argc, char **argv, AppArguments &args)
     args.iFrameCnt = 480;
     args.iBitrate = 8000000; // 8000000 bits per second
     args.iProfile = 77; // MAIN profile
+    args.iFps = 30; // The frame rate the encoder is set up with
     args.bLossless = false;
     args.bYUV444 = false;
     args.eCodec = NV_HW_ENC_H264;
@@ -82,6 +86,21 @@ bool parseCmdLine(int argc, char **argv, AppArguments &args)
             if (args.iFrameCnt < 1)
                 args.iFrameCnt = 1;
         }
+        else if (0 == _stricmp(argv[cnt], "-fps"))
+        {
+            ++cnt;
+
+            if (cnt >= argc)
+            {
+                printf("Missing -fps option\n");
+                printHelp();
+                return false;
+            }
+
+            args.iFps = atoi(argv[cnt]);
+            if (args.iFps < 0)
+                args.iFps = 0;
+        }
         else if (0 == _stricmp(argv[cnt], "-profile"))
         {
             ++cnt;
@@ -225,6 +244,9 @@ int main(int argc, char **argv)
     if (!parseCmdLine(argc, argv, args))
         return -1;
 
+    //! Without pacing, NOWAIT grabs return as fast as they are called
+    FramePacer pacer(args.iFps);
+
     //! Load the NvFBC library.
     if (!nvfbc.load())
     {
@@ -303,8 +325,10 @@ int main(int argc, char **argv)
         goto exit;
     }
     //! For each frame..
+    pacer.Reset();
     for (int i = 0; i < args.iFrameCnt; ++i)
     {
+        pacer.Wait();
         memset(&grabInfo, 0, sizeof(grabInfo));
         memset(&frameInfo, 0, sizeof(frameInfo));
         memset(&fbcHwEncGrabFrameParams, 0, sizeof(fbcHwEncGrabFrameParams));
@@ -405,6 +429,10 @@ exit:
 		clock_t end = clock();
 		double elapsed_secs = double(end - begin) / CLOCKS_PER_SEC;
 		fprintf(stderr, "Time taken: %f", elapsed_secs);
+
+        FramePacerStats pacerStats;
+        pacer.GetStats(&pacerStats);
+        PrintFramePacerStats(stderr, pacerStats);
     }
     if (encoder)
     {
@@ -26,6 +26,7 @@
 
 #include <NvFBCLibrary.h>
 #include <NvFBC/nvFBCToSys.h>
+#include <FramePacer.h>
 
 #include <sstream>
 #include <ctime>
@@ -49,6 +50,7 @@ struct AppArguments
 	int   numPlayers; // Number of players to stream to. // Defaults to 1
 	int   numRows; // Number of columns in the split screen
 	int   numCols; // Number of rows in the split screen
+	int   iFps; // Frames to grab per second, 0 for as fast as the streamers take them
 };
 
 // Prints the help message
@@ -75,6 +77,8 @@ void printHelp()
 	printf("  -players             The number of players to stream to. Defaults to 30000.\n");
 	printf("                       Should be between 1 and 6. Defaults to 1.");
     printf("  -nowait              Grab with the no wait flag\n");
+	printf("  -fps fps             The frames to grab and stream per second. Defaults to 25.\n");
+	printf("                       0 grabs as fast as the streamers take the frames.\n");
 }
 
 // Parse the command line arguments
@@ -95,6 +99,7 @@ bool parseCmdLine(int argc, char **argv, AppArguments &args)
 	args.numPlayers = 1;
 	args.numRows = 1;
 	args.numCols = 1;
+	args.iFps = 25; // The rate ffmpeg reads raw video at by default
 
     for(int cnt = 1; cnt < argc; ++cnt)
     {
@@ -247,6 +252,20 @@ bool parseCmdLine(int argc, char **argv, AppArguments &args)
 			}
 			args.numPlayers = atoi(argv[cnt]);
 		}
+		else if (0 == _stricmp(argv[cnt], "-fps"))
+		{
+			++cnt;
+
+			if (cnt >= argc)
+			{
+				printf("Missing -fps option\n");
+				printHelp();
+				return false;
+			}
+			args.iFps = atoi(argv[cnt]);
+			if (args.iFps < 0)
+				args.iFps = 0;
+		}
 		else if (0 == _stricmp(argv[cnt], "-layout"))
 		{
 			if ((cnt + 2) >= argc)
@@ -332,7 +351,10 @@ int main(int argc, char* argv[])
 		// Writing desktop capture to local disk. FFMPEG encoding.
 		//*StringStream << "ffmpeg -y -f rawvideo -pix_fmt yuv420p -r 25 -s 1024x768 -i - -r 25 -f mp4 -an foo.mp4";
 
-		*StringStream << "ffmpeg -y -f rawvideo -pix_fmt yuv420p -s " << args.iWidth << "x" << args.iHeight << " -re -i - -listen 1 -c:v libx264 -threads 1 -preset ultrafast -an -tune zerolatency -x264opts crf=2:vbv-maxrate=3000:vbv-bufsize=120:intra-refresh=1:slice-max-size=1500:keyint=30:ref=1 -f mpegts http://172.26.186.80:" << args.port + i;
+		*StringStream << "ffmpeg -y -f rawvideo -pix_fmt yuv420p -s " << args.iWidth << "x" << args.iHeight;
+		if (args.iFps)
+			*StringStream << " -framerate " << args.iFps;
+		*StringStream << " -re -i - -listen 1 -c:v libx264 -threads 1 -preset ultrafast -an -tune zerolatency -x264opts crf=2:vbv-maxrate=3000:vbv-bufsize=120:intra-refresh=1:slice-max-size=1500:keyint=30:ref=1 -f mpegts http://172.26.186.80:" << args.port + i;
 		//*StringStream << "ffmpeg -y -f rawvideo -pix_fmt yuv420p -s " << args.iWidth << "x" << args.iHeight << " -re -i - -listen 1 -c:v mpeg2video -an -q:v 2 -g 1 -f mpegts http://172.26.186.80:" << args.port + i;
 		//*StringStream << "ffmpeg -y -f rawvideo -pix_fmt yuv420p -s " << args.iWidth << "x" << args.iHeight << " -re -i - -listen 1 -c:v libvpx-vp9 -quality realtime -cpu-used 5 -b:v 3000k -an -f webm http://172.26.186.80:" << args.port + i;
 
@@ -346,11 +368,14 @@ int main(int argc, char* argv[])
         Sleep(100);
         
         NVFBC_TOSYS_GRAB_FRAME_PARAMS fbcSysGrabParams = {0};
+		//! Every player's tile is grabbed once per frame, on the streamers' clock
+		FramePacer pacer(args.iFps);
         //! For each frame to grab..
         //for(int cnt = 0; cnt < args.iFrameCnt; ++cnt)
 		int cnt = 0;
 		while (true)
         {
+			pacer.Wait();
 			++cnt;
             outName = args.sBaseName + "_" + _itoa(cnt, frameNo, 10) + ".bmp";
 
@@ -11,9 +11,11 @@
 #pragma warning(disable : 4995 4996)
 
 #include "Bitmap.h"
+#include "RgbConvert.h"
 
 #include <stdio.h>
 #include <string>
+#include <vector>
 
 // Macros to help with bitmap padding
 #define BITMAP_SIZE(width, height) ((((width) + 3) & ~3) * (height))
@@ -44,10 +46,36 @@ struct ARGBPixel
     unsigned char alpha;
 };
 
-bool SaveBitmap(const char *fileName, BYTE *data, int width, int height)
+// Writes the headers of a 24-bpp bitmap of size bytes of pixels
+static void WriteBitmapHeaders(FILE *outputFile, int width, int height, int size)
 {
     BITMAPFILEHEADER fileHeader;
     BITMAPINFOHEADER infoHeader;
+
+    fileHeader.bfType = 0x4D42;
+    fileHeader.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + size;
+    fileHeader.bfReserved1 = 0;
+    fileHeader.bfReserved2 = 0;
+    fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+
+    infoHeader.biSize = sizeof(BITMAPINFOHEADER);
+    infoHeader.biWidth = width;
+    infoHeader.biHeight = height;
+    infoHeader.biPlanes = 1;
+    infoHeader.biBitCount = 24;
+    infoHeader.biCompression = BI_RGB;
+    infoHeader.biSizeImage = size;
+    infoHeader.biXPelsPerMeter = 0;
+    infoHeader.biYPelsPerMeter = 0;
+    infoHeader.biClrUsed = 0;
+    infoHeader.biClrImportant = 0;
+
+    fwrite((unsigned char *)&fileHeader, 1, sizeof(BITMAPFILEHEADER), outputFile);
+    fwrite((unsigned char *)&infoHeader, 1, sizeof(BITMAPINFOHEADER), outputFile);
+}
+
+bool SaveBitmap(const char *fileName, BYTE *data, int width, int height)
+{
     FILE *outputFile;
     bool bRet = false;
 
@@ -58,24 +86,7 @@ bool SaveBitmap(const char *fileName, BYTE *data, int width, int height)
             width = (width + 3) & (~3);
             int size = width * height * 3; // 24 bits per pixel
 
-            fileHeader.bfType = 0x4D42;
-            fileHeader.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + size;
-            fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
-
-            infoHeader.biSize = sizeof(BITMAPINFOHEADER);
-            infoHeader.biWidth = width;
-            infoHeader.biHeight = height;
-            infoHeader.biPlanes = 1;
-            infoHeader.biBitCount = 24;
-            infoHeader.biCompression = BI_RGB;
-            infoHeader.biSizeImage = BITMAP_SIZE(width, height);
-            infoHeader.biXPelsPerMeter = 0;
-            infoHeader.biYPelsPerMeter = 0;
-            infoHeader.biClrUsed = 0;
-            infoHeader.biClrImportant = 0;
-
-            fwrite((unsigned char *)&fileHeader, 1, sizeof(BITMAPFILEHEADER), outputFile);
-            fwrite((unsigned char *)&infoHeader, 1, sizeof(BITMAPINFOHEADER), outputFile);
+            WriteBitmapHeaders(outputFile, width, height, size);
             fwrite(data, 1, size, outputFile);
 
             bRet = true;
@@ -347,128 +358,69 @@ bool SaveYUV(const char *fileName, BYTE *data, int width, int height)
     return true;
 }
 
-#define CLAMP_255(x)  ((x) > 255 ? 255 : ((x) < 0 ? 0 : (x)))
-bool SaveYUV444(const char *fileName, BYTE *data, int width, int height)
+// Converts a YUV picture to a 24-bpp bitmap one row at a time, bottom row
+// first as the bitmap stores them, so no converted copy of the frame is ever
+// held. Uses the BT709 equations; frames of 720p and up are taken to be
+// limited range and smaller ones full range.
+static bool SaveYUVRows(const char *fileName, const BYTE *pY, const BYTE *pU, const BYTE *pV, int strideY, int strideUV,
+                        YuvLayout eLayout, int width, int height)
 {
-    bool result = false;
-    bool bIsHD = (width*height < 1280*720);
-    BitmapPixel *output = new BitmapPixel[BITMAP_SIZE(width, height)];
-    BYTE *y = data;
-    BYTE *u = y + width*height;
-    BYTE *v = u + width*height;
-
-    // Pad bytes need to be set to zero, it's easier to just set the entire chunk of memory
-    memset(output, 0, BITMAP_SIZE(width, height) * sizeof(BitmapPixel));
-
-    for(int row = 0; row < height; ++row)
-    {
-        for(int col = 0; col < width; ++col)
-        {
-            // In a bitmap (0,0) is at the bottom left, in the frame buffer it is the top left.
-            int outputIdx = BITMAP_INDEX(col, row, width);
-            int inputIdx = ((height - row - 1) * width) + col;
-            if (!bIsHD)
-            {
-                output[outputIdx].red    = (BYTE)CLAMP_255(1.164*(y[inputIdx]-16) + 0.000*(u[inputIdx]-128) + 1.793*(v[inputIdx]-128));
-                output[outputIdx].green  = (BYTE)CLAMP_255(1.164*(y[inputIdx]-16) - 0.213*(u[inputIdx]-128) - 0.534*(v[inputIdx]-128));
-                output[outputIdx].blue   = (BYTE)CLAMP_255(1.164*(y[inputIdx]-16) + 2.115*(u[inputIdx]-128) + 0.000*(v[inputIdx]-128));
-            }
-            else
-            {
-                output[outputIdx].red    = (BYTE)CLAMP_255(1.0*(y[inputIdx]) + 0.0000*(u[inputIdx]-128) + 1.5400*(v[inputIdx]-128));
-                output[outputIdx].green  = (BYTE)CLAMP_255(1.0*(y[inputIdx]) - 0.1830*(u[inputIdx]-128) - 0.4590*(v[inputIdx]-128));
-                output[outputIdx].blue   = (BYTE)CLAMP_255(1.0*(y[inputIdx]) + 1.8160*(u[inputIdx]-128) + 0.0000*(v[inputIdx]-128));
-            }
-        }
-    }
-
-    result = SaveBitmap(fileName, (BYTE *)output, width, height);
-
-    delete [] output;
+    if (!pY)
+        return false;
 
-    return result;
-}
+    FILE *outputFile = fopen(fileName, "wb");
+    if (!outputFile)
+        return false;
 
-bool YUV420ToYUV444(BYTE* in, BYTE *out, int width, int height)
-{
-    int hWidth = width>>1;
-    int hHeight= height>>1;
-    BYTE *oY = out; BYTE *oU = oY+width*height; BYTE *oV = oU+width*height;
-    BYTE *iY = in;  BYTE *iU = iY+width*height; BYTE *iV = iU+hWidth*hHeight;
+    // Rows of a bitmap are padded to 4 bytes; the padding stays zero.
+    int rowSize = (width * 3 + 3) & ~3;
+    std::vector<BYTE> row(rowSize, 0);
+    YuvRange eRange = width * height < 1280 * 720 ? YUV_RANGE_FULL : YUV_RANGE_LIMITED;
 
-    for(int row = 0; row < height; ++row)
+    WriteBitmapHeaders(outputFile, width, height, rowSize * height);
+    bool bRet = true;
+    for (int y = height - 1; y >= 0 && bRet; --y)
     {
-        for(int col = 0; col < width; ++col)
-        {
-            int inputIdx = ((height - row - 1) * width) + col;
-            int outputIdx= ((height - row - 1) * width) + col;
-            int inputChIdx = ((hHeight - row/2 - 1) * hWidth) + col/2;
- 
-            oY[outputIdx] = iY[inputIdx];
-            oU[outputIdx] = iU[inputChIdx];
-            oV[outputIdx] = iV[inputChIdx];
-        }
+        int chromaRow = eLayout == YUV_LAYOUT_YUV444 ? y : y / 2;
+        YuvRowToBGR(pY + y * strideY, pU + chromaRow * strideUV, pV ? pV + chromaRow * strideUV : NULL, eLayout,
+                    &row[0], width, YUV_MATRIX_BT709, eRange);
+        bRet = fwrite(&row[0], 1, rowSize, outputFile) == (size_t)rowSize;
     }
-    return true;
+
+    fclose(outputFile);
+    return bRet;
 }
 
-bool NV12ToYUV444(BYTE* in, BYTE *out, int width, int height, int pitch)
+bool SaveYUV444(const char *fileName, BYTE *data, int width, int height)
 {
-    int hWidth = width >> 1;
-    int hHeight = height >> 1;
-    int hPitch = pitch >> 1;
-    BYTE *oY = out; BYTE *oU = oY + width*height; BYTE *oV = oU + width*height;
-    BYTE *iY = in;  BYTE *iU = iY + height*pitch; 
-
-    for (int row = 0; row < height; ++row)
-    {
-        for (int col = 0; col < width; ++col)
-        {
-            int inputIdx = ((height - row - 1) * pitch) + col;
-            int outputIdx = ((height - row - 1) * width) + col;
-            int inputChIdx = (((hHeight - row / 2 - 1) * hPitch) + col / 2)*2;
-
-            oY[outputIdx] =  iY[inputIdx];
-            oU[outputIdx] =  iU[inputChIdx];
-            oV[outputIdx] =  iU[inputChIdx + 1];
-        }
+    if (!data)
+        return false;
 
-    }
-    return true;
+    BYTE *y = data;
+    BYTE *u = y + width*height;
+    BYTE *v = u + width*height;
+    return SaveYUVRows(fileName, y, u, v, width, width, YUV_LAYOUT_YUV444, width, height);
 }
 
 bool SaveYUV420(const char *fileName, BYTE *data, int width, int height)
 {
-    bool result = false;
-
-    int hWidth = width>>1;
-    int hHeight= height>>1;
+    if (!data)
+        return false;
 
-    BYTE *yuv444 = new BYTE[width*height*3];
-    BYTE *y = yuv444;
+    int hWidth = (width + 1) >> 1;
+    int hHeight = (height + 1) >> 1;
+    BYTE *y = data;
     BYTE *u = y + width*height;
     BYTE *v = u + hWidth*hHeight;
-
-    YUV420ToYUV444(data, yuv444, width, height);
-    result = SaveYUV444(fileName, yuv444, width, height);
-    delete [] yuv444;
-    return result;
+    return SaveYUVRows(fileName, y, u, v, width, hWidth, YUV_LAYOUT_I420, width, height);
 }
 
 bool SaveNV12(const char *fileName, BYTE *data, int width, int height, int stride)
 {
-    bool result = false;
-
-    int hWidth = width >> 1;
-    int hHeight = height >> 1;
-
-    BYTE *yuv444 = new BYTE[width*height * 3];
-    BYTE *y = yuv444;
-    BYTE *u = y + width*height;
-    BYTE *v = u + hWidth*hHeight;
+    if (!data)
+        return false;
 
-    NV12ToYUV444(data, yuv444, width, height, stride);
-    result = SaveYUV444(fileName, yuv444, width, height);
-    delete[] yuv444;
-    return result;
-}
\ No newline at end of file
+    BYTE *y = data;
+    BYTE *uv = y + height*stride;
+    return SaveYUVRows(fileName, y, uv, NULL, stride, stride, YUV_LAYOUT_NV12, width, height);
+}
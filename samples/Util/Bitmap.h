@@ -28,10 +28,10 @@ bool SaveYUV(const char *fileName, BYTE *data, int width, int height);
 // Saves the YUV444 buffer as single bitmap after converting to RGB using BT709 equations
 bool SaveYUV444(const char *fileName, BYTE *data, int width, int height);
 
-// Saves the YUV420 buffer as single bitmap after converting to YUV444, then RGB using BT709 equations
+// Saves the YUV420 buffer as single bitmap, converting each row to RGB using BT709 equations
 bool SaveYUV420(const char *fileName, BYTE *data, int width, int height);
 
-// Saves the YUV420 buffer as single bitmap after converting to YUV444, then RGB using BT709 equations
+// Saves the NV12 buffer as single bitmap, converting each row to RGB using BT709 equations
 bool SaveNV12(const char *fileName, BYTE *data, int width, int height, int stride);
 
 // Saves the provided buffer as a bitmap, this method assumes the data is formated as a bitmap.
@@ -0,0 +1,138 @@
+/*
+ * Runtime CPU feature detection used to pick SIMD kernels.
+ */
+
+#include "CpuFeatures.h"
+
+#include <string.h>
+
+#if defined(SIMD_ARCH_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(SIMD_ARCH_X86)
+static void CpuId(int leaf, int subLeaf, int regs[4])
+{
+#if defined(_MSC_VER)
+    __cpuidex(regs, leaf, subLeaf);
+#else
+    unsigned int a, b, c, d;
+    __cpuid_count(leaf, subLeaf, a, b, c, d);
+    regs[0] = (int)a; regs[1] = (int)b; regs[2] = (int)c; regs[3] = (int)d;
+#endif
+}
+
+static unsigned long long ReadXCR0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+#endif
+
+static CpuFeatures DetectCpuFeatures()
+{
+    CpuFeatures f;
+    memset(&f, 0, sizeof(f));
+
+#if defined(SIMD_ARCH_X86)
+    int regs[4];
+    CpuId(0, 0, regs);
+    int nMaxLeaf = regs[0];
+    if (nMaxLeaf >= 1)
+    {
+        CpuId(1, 0, regs);
+        f.bSSE2  = (regs[3] & (1 << 26)) != 0;
+        f.bSSSE3 = (regs[2] & (1 << 9)) != 0;
+        f.bSSE41 = (regs[2] & (1 << 19)) != 0;
+        f.bSSE42 = (regs[2] & (1 << 20)) != 0;
+        bool bOSXSAVE = (regs[2] & (1 << 27)) != 0;
+        bool bAVX = (regs[2] & (1 << 28)) != 0;
+        if (nMaxLeaf >= 7 && bOSXSAVE && bAVX && (ReadXCR0() & 0x6) == 0x6)
+        {
+            CpuId(7, 0, regs);
+            f.bAVX2 = (regs[1] & (1 << 5)) != 0;
+        }
+    }
+#endif
+
+#if defined(SIMD_ARCH_NEON)
+    f.bNEON = true;
+#endif
+
+#if defined(_WIN32)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    f.nLogicalCores = (int)si.dwNumberOfProcessors;
+#else
+    f.nLogicalCores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (f.nLogicalCores < 1)
+    {
+        f.nLogicalCores = 1;
+    }
+    return f;
+}
+
+// Initialized during static construction so that readers never race on it.
+static const CpuFeatures s_cpuFeatures = DetectCpuFeatures();
+
+const CpuFeatures &GetCpuFeatures()
+{
+    return s_cpuFeatures;
+}
+
+SimdLevel GetBestSimdLevel()
+{
+    const CpuFeatures &f = GetCpuFeatures();
+    if (f.bNEON)
+        return SIMD_LEVEL_NEON;
+    if (f.bAVX2)
+        return SIMD_LEVEL_AVX2;
+    if (f.bSSE41)
+        return SIMD_LEVEL_SSE41;
+    if (f.bSSSE3)
+        return SIMD_LEVEL_SSSE3;
+    if (f.bSSE2)
+        return SIMD_LEVEL_SSE2;
+    return SIMD_LEVEL_SCALAR;
+}
+
+SimdLevel ClampSimdLevel(SimdLevel requested)
+{
+    SimdLevel best = GetBestSimdLevel();
+    if (requested == SIMD_LEVEL_NEON || best == SIMD_LEVEL_NEON)
+    {
+        return requested == best ? requested : SIMD_LEVEL_SCALAR;
+    }
+    return requested < best ? requested : best;
+}
+
+const char *GetSimdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+    case SIMD_LEVEL_SCALAR: return "scalar";
+    case SIMD_LEVEL_SSE2:   return "sse2";
+    case SIMD_LEVEL_SSSE3:  return "ssse3";
+    case SIMD_LEVEL_SSE41:  return "sse4.1";
+    case SIMD_LEVEL_AVX2:   return "avx2";
+    case SIMD_LEVEL_NEON:   return "neon";
+    }
+    return "unknown";
+}
@@ -0,0 +1,64 @@
+/*
+ * Runtime CPU feature detection used to pick SIMD kernels.
+ */
+
+#pragma once
+
+// Instruction set levels, ordered so that a higher level implies the lower ones
+// on the same architecture.
+enum SimdLevel
+{
+    SIMD_LEVEL_SCALAR = 0,
+    SIMD_LEVEL_SSE2   = 1,
+    SIMD_LEVEL_SSSE3  = 2,
+    SIMD_LEVEL_SSE41  = 3,
+    SIMD_LEVEL_AVX2   = 4,
+    SIMD_LEVEL_NEON   = 16,
+};
+
+struct CpuFeatures
+{
+    bool bSSE2;
+    bool bSSSE3;
+    bool bSSE41;
+    bool bSSE42;
+    bool bAVX2;         // includes OS support for saving the YMM state
+    bool bNEON;
+    int  nLogicalCores;
+};
+
+// Returns the features of the CPU the process runs on. Detection runs once.
+const CpuFeatures &GetCpuFeatures();
+
+// Returns the best SIMD level supported by this CPU.
+SimdLevel GetBestSimdLevel();
+
+// Returns the level a module runs at when asked for requested: that level if
+// the CPU has it, else the best one below it. NEON and the x86 levels do not
+// mix; asking for the other architecture's gets scalar.
+SimdLevel ClampSimdLevel(SimdLevel requested);
+
+// Returns a printable name for the SIMD level.
+const char *GetSimdLevelName(SimdLevel level);
+
+// Kernels compiled for AVX2 need a target attribute on GCC/Clang; MSVC emits
+// any intrinsic regardless of /arch, so the macro is empty there.
+#if defined(_MSC_VER)
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_SSSE3
+#define SIMD_TARGET_SSE41
+#define SIMD_TARGET_SSE42
+#else
+#define SIMD_TARGET_AVX2  __attribute__((target("avx2")))
+#define SIMD_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define SIMD_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define SIMD_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define SIMD_ARCH_X86 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define SIMD_ARCH_NEON 1
+#endif
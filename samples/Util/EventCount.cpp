@@ -0,0 +1,44 @@
+/*
+ * Futex or condition variable backed wait for lock-free state changes.
+ */
+
+#include "EventCount.h"
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
+
+void EventCount::Wait(uint32_t uKey)
+{
+#if defined(__linux__)
+    // Returns at once with EAGAIN if the epoch already moved on.
+    syscall(SYS_futex, (uint32_t *)&m_uEpoch, FUTEX_WAIT_PRIVATE, uKey, NULL, NULL, 0);
+#else
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_uEpoch.load() == uKey)
+        {
+            m_cv.wait(lock);
+        }
+    }
+#endif
+    m_nWaiters.fetch_sub(1);
+}
+
+void EventCount::WakeAll()
+{
+    m_uEpoch.fetch_add(1);
+#if defined(__linux__)
+    syscall(SYS_futex, (uint32_t *)&m_uEpoch, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    // Taking the lock orders the epoch change against a waiter that has
+    // checked the epoch but not yet gone to sleep.
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+    }
+    m_cv.notify_all();
+#endif
+}
@@ -0,0 +1,66 @@
+/*
+ * Lets a thread sleep until another thread changes some lock-free state,
+ * without a lock on the fast path. A waiter calls PrepareWait, re-checks its
+ * condition, then either CancelWait or Wait. A notifier changes the state and
+ * then calls Notify, which costs one load while nobody is waiting.
+ *
+ * On Linux Wait and Notify use a futex on the epoch; elsewhere they fall back
+ * to a mutex and condition variable that are only touched when someone waits.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+#if !defined(__linux__)
+#include <condition_variable>
+#include <mutex>
+#endif
+
+class EventCount
+{
+public:
+    EventCount() : m_uEpoch(0), m_nWaiters(0) {}
+
+    // Returns the key to pass to Wait. The caller must re-check its condition
+    // after this and before Wait.
+    uint32_t PrepareWait()
+    {
+        m_nWaiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return m_uEpoch.load();
+    }
+
+    void CancelWait()
+    {
+        m_nWaiters.fetch_sub(1);
+    }
+
+    // Sleeps unless Notify was called after the PrepareWait that returned
+    // uKey. Spurious returns are possible.
+    void Wait(uint32_t uKey);
+
+    // Wakes every thread between PrepareWait and Wait.
+    void Notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_nWaiters.load(std::memory_order_relaxed))
+        {
+            WakeAll();
+        }
+    }
+
+private:
+    void WakeAll();
+
+    std::atomic<uint32_t>       m_uEpoch;
+    std::atomic<int>            m_nWaiters;
+#if !defined(__linux__)
+    std::mutex                  m_mutex;
+    std::condition_variable     m_cv;
+#endif
+
+    EventCount(const EventCount &);
+    EventCount &operator=(const EventCount &);
+};
@@ -0,0 +1,219 @@
+/*
+ * Deadline based frame pacing with overrun policies and jitter statistics.
+ */
+
+#include "FramePacer.h"
+
+#include <math.h>
+#include <string.h>
+#if !defined(_MSC_VER) || _MSC_VER >= 1700
+#include <thread>
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <mmsystem.h>
+#pragma comment(lib, "winmm.lib")
+#else
+#include <time.h>
+#endif
+
+uint32_t GetFramePacerBinUs(int i)
+{
+    if (i < 0 || i >= FRAME_PACER_HISTOGRAM_BINS - 1)
+        return 0;
+    return 1u << i;
+}
+
+void PrintFramePacerStats(FILE *f, const FramePacerStats &stats)
+{
+    fprintf(f, "%llu frames, %llu overruns, %llu dropped, lateness mean %.1f us max %.1f us, interval jitter %.1f us\n",
+        (unsigned long long)stats.nFrames, (unsigned long long)stats.nOverruns, (unsigned long long)stats.nDropped,
+        stats.fMeanLatenessUs, stats.uMaxLatenessNs / 1000.0, stats.fIntervalJitterUs);
+    for (int i = 0; i < FRAME_PACER_HISTOGRAM_BINS; i++)
+    {
+        if (!stats.anLateness[i])
+            continue;
+        if (GetFramePacerBinUs(i))
+            fprintf(f, "  < %6u us: %u\n", GetFramePacerBinUs(i), stats.anLateness[i]);
+        else
+            fprintf(f, "  >=%6u us: %u\n", GetFramePacerBinUs(i - 1), stats.anLateness[i]);
+    }
+}
+
+uint64_t FramePacer::NowNs()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000000 + now.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart);
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static bool DefaultSleep(void *, uint32_t uMs)
+{
+#if defined(_WIN32)
+    Sleep(uMs);
+#else
+    timespec ts;
+    ts.tv_sec = uMs / 1000;
+    ts.tv_nsec = (long)(uMs % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+#endif
+    return true;
+}
+
+// VS2008 and VS2010 have no <thread>.
+static void YieldSpin()
+{
+#if defined(_MSC_VER) && _MSC_VER < 1700
+    if (!SwitchToThread())
+        Sleep(0);
+#else
+    std::this_thread::yield();
+#endif
+}
+
+FramePacer::FramePacer(uint32_t uFrameRateNum, uint32_t uFrameRateDen, FramePacerPolicy ePolicy)
+{
+    m_uFrameRateNum = uFrameRateNum;
+    m_uFrameRateDen = uFrameRateDen ? uFrameRateDen : 1;
+    m_uPeriodNs = uFrameRateNum ? 1000000000ull * m_uFrameRateDen / uFrameRateNum : 0;
+    m_ePolicy = ePolicy;
+    m_uSpinNs = FRAME_PACER_SPIN_NS;
+    m_nMaxCatchUp = FRAME_PACER_MAX_CATCH_UP;
+#if defined(_WIN32)
+    // Sleep otherwise rounds up to the 15.6 ms default timer tick.
+    timeBeginPeriod(1);
+#endif
+    Reset();
+}
+
+FramePacer::~FramePacer()
+{
+#if defined(_WIN32)
+    timeEndPeriod(1);
+#endif
+}
+
+void FramePacer::SetSpinNs(uint64_t uSpinNs)
+{
+    m_uSpinNs = uSpinNs;
+}
+
+void FramePacer::SetMaxCatchUp(uint32_t nMaxCatchUp)
+{
+    m_nMaxCatchUp = nMaxCatchUp;
+}
+
+void FramePacer::Reset()
+{
+    m_uStartNs = NowNs();
+    m_nFrame = 0;
+    m_uLastFrameNs = 0;
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_fLatenessSumUs = 0;
+    m_fIntervalSumUs = 0;
+    m_fIntervalSquaresUs = 0;
+    m_nIntervals = 0;
+}
+
+uint64_t FramePacer::Deadline(uint64_t nFrame) const
+{
+    return m_uStartNs + nFrame * 1000000000ull * m_uFrameRateDen / m_uFrameRateNum;
+}
+
+bool FramePacer::Wait(SleepFunc pfnSleep, void *pContext)
+{
+    uint64_t uNowNs = NowNs();
+    if (!m_uFrameRateNum)
+    {
+        Record(uNowNs, uNowNs);
+        return true;
+    }
+    if (!pfnSleep)
+        pfnSleep = DefaultSleep;
+
+    uint64_t nFrame = m_nFrame + 1;
+    uint64_t uDeadlineNs = Deadline(nFrame);
+    if (uNowNs >= uDeadlineNs)
+    {
+        // The last frame already due; the division may round one frame short.
+        uint64_t nLast = (uNowNs - m_uStartNs) * m_uFrameRateNum / (1000000000ull * m_uFrameRateDen);
+        if (nLast < nFrame)
+            nLast = nFrame;
+        uint64_t nKeep = m_ePolicy == FRAME_PACER_CATCH_UP && m_nMaxCatchUp ? m_nMaxCatchUp : 1;
+        if (nLast - nFrame + 1 > nKeep)
+        {
+            m_stats.nDropped += nLast - nFrame + 1 - nKeep;
+            nFrame = nLast + 1 - nKeep;
+            uDeadlineNs = Deadline(nFrame);
+        }
+        m_nFrame = nFrame;
+        m_stats.nOverruns++;
+        Record(uDeadlineNs, uNowNs);
+        return true;
+    }
+
+    m_nFrame = nFrame;
+    while (uNowNs < uDeadlineNs)
+    {
+        uint64_t uRemainingNs = uDeadlineNs - uNowNs;
+        if (uRemainingNs > m_uSpinNs + 1000000)
+        {
+            if (!pfnSleep(pContext, (uint32_t)((uRemainingNs - m_uSpinNs) / 1000000)))
+                return false;
+        }
+        else
+        {
+            YieldSpin();
+        }
+        uNowNs = NowNs();
+    }
+    Record(uDeadlineNs, uNowNs);
+    return true;
+}
+
+void FramePacer::Record(uint64_t uDeadlineNs, uint64_t uNowNs)
+{
+    uint64_t uLatenessNs = uNowNs - uDeadlineNs;
+    uint64_t uLatenessUs = uLatenessNs / 1000;
+    int iBin = 0;
+    while (uLatenessUs && iBin < FRAME_PACER_HISTOGRAM_BINS - 1)
+    {
+        uLatenessUs >>= 1;
+        iBin++;
+    }
+    m_stats.anLateness[iBin]++;
+    if (uLatenessNs > m_stats.uMaxLatenessNs)
+        m_stats.uMaxLatenessNs = uLatenessNs;
+    m_fLatenessSumUs += uLatenessNs / 1000.0;
+
+    if (m_stats.nFrames)
+    {
+        double fIntervalUs = (uNowNs - m_uLastFrameNs) / 1000.0;
+        m_fIntervalSumUs += fIntervalUs;
+        m_fIntervalSquaresUs += fIntervalUs * fIntervalUs;
+        m_nIntervals++;
+    }
+    m_uLastFrameNs = uNowNs;
+    m_stats.nFrames++;
+}
+
+void FramePacer::GetStats(FramePacerStats *pStats) const
+{
+    *pStats = m_stats;
+    pStats->fMeanLatenessUs = m_stats.nFrames ? m_fLatenessSumUs / m_stats.nFrames : 0;
+    double fVariance = 0;
+    if (m_nIntervals)
+    {
+        double fMean = m_fIntervalSumUs / m_nIntervals;
+        fVariance = m_fIntervalSquaresUs / m_nIntervals - fMean * fMean;
+    }
+    pStats->fIntervalJitterUs = fVariance > 0 ? sqrt(fVariance) : 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Paces a capture or encode loop to a fixed frame rate on a monotonic
+ * nanosecond clock.
+ *
+ * Frame k is due at the start time plus k periods. Deadlines are computed
+ * from the start and not accumulated, so rounding never drifts. Waiting
+ * sleeps until shortly before the deadline and spins the rest of the way,
+ * because Sleep wakes up late by up to a timer tick.
+ *
+ * When a frame overruns, the policy decides what happens to the deadlines
+ * that went by:
+ * - FRAME_PACER_DROP runs a frame less than a period late at once and skips
+ *   anything older, so the loop stays on its grid;
+ * - FRAME_PACER_CATCH_UP runs up to SetMaxCatchUp missed frames back to back
+ *   and skips the rest.
+ *
+ * Each pacer keeps its own state and statistics, including a histogram of
+ * how late frames started; it is meant for one thread.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define FRAME_PACER_HISTOGRAM_BINS  16
+#define FRAME_PACER_MAX_CATCH_UP    3
+
+#if defined(_WIN32)
+#define FRAME_PACER_SPIN_NS         2000000     // covers a 1 ms timer period
+#else
+#define FRAME_PACER_SPIN_NS         200000
+#endif
+
+enum FramePacerPolicy
+{
+    FRAME_PACER_DROP,
+    FRAME_PACER_CATCH_UP,
+};
+
+struct FramePacerStats
+{
+    uint64_t    nFrames;
+    uint64_t    nOverruns;          // frames that started after their deadline without waiting
+    uint64_t    nDropped;           // deadlines skipped
+    uint64_t    uMaxLatenessNs;
+    double      fMeanLatenessUs;
+    double      fIntervalJitterUs;  // standard deviation of the time between frames
+    // Bin 0 counts frames less than 1 us late, bin i frames less than 2^i us
+    // late, and the last bin the rest.
+    uint32_t    anLateness[FRAME_PACER_HISTOGRAM_BINS];
+};
+
+// Upper bound of histogram bin i in microseconds, or 0 for the last bin.
+uint32_t GetFramePacerBinUs(int i);
+
+void PrintFramePacerStats(FILE *f, const FramePacerStats &stats);
+
+class FramePacer
+{
+public:
+    // Returns false to give up waiting, for instance when the loop is asked
+    // to stop.
+    typedef bool (*SleepFunc)(void *pContext, uint32_t uMs);
+
+    // A frame rate of 0 does not pace at all.
+    FramePacer(uint32_t uFrameRateNum, uint32_t uFrameRateDen = 1, FramePacerPolicy ePolicy = FRAME_PACER_DROP);
+    ~FramePacer();
+
+    void SetSpinNs(uint64_t uSpinNs);
+    void SetMaxCatchUp(uint32_t nMaxCatchUp);
+
+    // Makes now the start of frame 0 and clears the statistics.
+    void Reset();
+
+    // Waits until the next frame is due. Sleeps through pfnSleep if given.
+    // Returns false if pfnSleep gave up.
+    bool Wait(SleepFunc pfnSleep = NULL, void *pContext = NULL);
+
+    void GetStats(FramePacerStats *pStats) const;
+
+    static uint64_t NowNs();
+
+private:
+    uint64_t Deadline(uint64_t nFrame) const;
+    void Record(uint64_t uDeadlineNs, uint64_t uNowNs);
+
+    uint32_t            m_uFrameRateNum;
+    uint32_t            m_uFrameRateDen;
+    uint64_t            m_uPeriodNs;
+    FramePacerPolicy    m_ePolicy;
+    uint64_t            m_uSpinNs;
+    uint32_t            m_nMaxCatchUp;
+
+    uint64_t            m_uStartNs;
+    uint64_t            m_nFrame;           // frame of the last Wait
+    uint64_t            m_uLastFrameNs;
+
+    FramePacerStats     m_stats;
+    double              m_fLatenessSumUs;
+    double              m_fIntervalSumUs;
+    double              m_fIntervalSquaresUs;
+    uint64_t            m_nIntervals;
+
+    FramePacer(const FramePacer &);
+    FramePacer &operator=(const FramePacer &);
+};
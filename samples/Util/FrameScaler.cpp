@@ -0,0 +1,587 @@
+/*
+ * See FrameScaler.h.
+ */
+
+#include "FrameScaler.h"
+#include "FrameTiler.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(SIMD_ARCH_X86)
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+#if defined(SIMD_ARCH_NEON)
+#include <arm_neon.h>
+#endif
+
+#define SCALE_ONE       (1 << SCALE_COEFF_BITS)
+#define SCALE_ROUND     (1 << (SCALE_COEFF_BITS - 1))
+
+// Horizontal taps are padded to a multiple of this, the pixels one 16-bit
+// multiply-add of 128 bits takes.
+#define SCALE_TAPS_MULTIPLE 8
+
+static const double SCALE_PI = 3.14159265358979323846;
+
+static volatile int s_nSimdLevel = -1;
+
+SimdLevel ScalerSetSimdLevel(SimdLevel level)
+{
+    SimdLevel clamped = ClampSimdLevel(level);
+    s_nSimdLevel = clamped;
+    return clamped;
+}
+
+SimdLevel ScalerGetSimdLevel()
+{
+    int level = s_nSimdLevel;
+    if (level < 0)
+    {
+        level = GetBestSimdLevel();
+        s_nSimdLevel = level;
+    }
+    return (SimdLevel)level;
+}
+
+static const char *s_aszFilterNames[] = { "box", "bilinear", "lanczos2" };
+
+bool ScaleFilterFromName(const char *szName, ScaleFilter *peFilter)
+{
+    for (int i = 0; i < (int)(sizeof(s_aszFilterNames) / sizeof(s_aszFilterNames[0])); i++)
+    {
+        if (szName && !strcmp(szName, s_aszFilterNames[i]))
+        {
+            *peFilter = (ScaleFilter)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *GetScaleFilterName(ScaleFilter eFilter)
+{
+    return (unsigned)eFilter < sizeof(s_aszFilterNames) / sizeof(s_aszFilterNames[0]) ? s_aszFilterNames[eFilter] : "unknown";
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Filter taps
+
+static double Sinc(double x)
+{
+    return x == 0.0 ? 1.0 : sin(SCALE_PI * x) / (SCALE_PI * x);
+}
+
+// Weight of source pixel j for an output pixel centred on center, both in
+// source pixels; stretch is how much the filter is widened.
+static double FilterWeight(ScaleFilter eFilter, double center, double stretch, int j)
+{
+    double d = (j - center) / stretch;
+    switch (eFilter)
+    {
+    case SCALE_FILTER_BOX:
+    {
+        // Overlap of the pixel with the area the output pixel covers.
+        double lo = j - 0.5 > center - 0.5 * stretch ? j - 0.5 : center - 0.5 * stretch;
+        double hi = j + 0.5 < center + 0.5 * stretch ? j + 0.5 : center + 0.5 * stretch;
+        return hi > lo ? hi - lo : 0.0;
+    }
+    case SCALE_FILTER_BILINEAR:
+        return d > -1.0 && d < 1.0 ? 1.0 - fabs(d) : 0.0;
+    default:
+        return d > -2.0 && d < 2.0 ? Sinc(d) * Sinc(d / 2) : 0.0;
+    }
+}
+
+static double FilterRadius(ScaleFilter eFilter)
+{
+    return eFilter == SCALE_FILTER_BOX ? 0.5 : eFilter == SCALE_FILTER_BILINEAR ? 1.0 : 2.0;
+}
+
+void PlaneScaler::MakeCoeffs(int srcSize, int dstSize, ScaleFilter eFilter, int tapsMultiple, Coeffs *pCoeffs)
+{
+    double scale = (double)srcSize / dstSize;
+    double stretch = scale > 1.0 ? scale : 1.0;
+    double radius = FilterRadius(eFilter) * stretch;
+    int taps = (int)ceil(2 * radius) + 1;
+    taps = (taps + tapsMultiple - 1) / tapsMultiple * tapsMultiple;
+
+    pCoeffs->taps = taps;
+    pCoeffs->aFirst.resize(dstSize);
+    pCoeffs->aWeights.assign((size_t)dstSize * taps, 0);
+    std::vector<double> aWeights(taps);
+    for (int i = 0; i < dstSize; i++)
+    {
+        // Pixel centres line up with the centre of the frame, not its corner.
+        double center = (i + 0.5) * scale - 0.5;
+        int first = (int)floor(center - radius) + 1;
+        if (eFilter == SCALE_FILTER_BOX)
+        {
+            // The area may reach halfway into one pixel more.
+            first = (int)floor(center - radius + 0.5);
+        }
+        double sum = 0.0;
+        for (int k = 0; k < taps; k++)
+        {
+            aWeights[k] = FilterWeight(eFilter, center, stretch, first + k);
+            sum += aWeights[k];
+        }
+
+        // Rounded taps are made to sum to exactly one by giving what is left
+        // to the largest.
+        short *pWeights = &pCoeffs->aWeights[(size_t)i * taps];
+        int total = 0, largest = 0;
+        for (int k = 0; k < taps; k++)
+        {
+            pWeights[k] = (short)floor(aWeights[k] / sum * SCALE_ONE + 0.5);
+            total += pWeights[k];
+            if (pWeights[k] > pWeights[largest])
+            {
+                largest = k;
+            }
+        }
+        pWeights[largest] = (short)(pWeights[largest] + SCALE_ONE - total);
+        pCoeffs->aFirst[i] = first;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Scalar kernels
+
+static inline int ClampByte(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Pixels [x, width) of the vertical pass: ppRows are the taps source rows.
+static void VerticalRow_C(const unsigned char *const *ppRows, const short *pWeights, int taps,
+                          unsigned char *pDst, int x, int width)
+{
+    for (; x < width; x++)
+    {
+        int sum = SCALE_ROUND;
+        for (int k = 0; k < taps; k++)
+        {
+            sum += ppRows[k][x] * pWeights[k];
+        }
+        pDst[x] = (unsigned char)ClampByte(sum >> SCALE_COEFF_BITS);
+    }
+}
+
+// Pixels [x, width) of the horizontal pass. pSrc is the row with its edges;
+// aFirst indexes it directly.
+static void HorizontalRow_C(const unsigned char *pSrc, const int *aFirst, const short *pWeights, int taps,
+                            unsigned char *pDst, int x, int width)
+{
+    for (; x < width; x++)
+    {
+        const unsigned char *p = pSrc + aFirst[x];
+        const short *w = pWeights + (size_t)x * taps;
+        int sum = SCALE_ROUND;
+        for (int k = 0; k < taps; k++)
+        {
+            sum += p[k] * w[k];
+        }
+        pDst[x] = (unsigned char)ClampByte(sum >> SCALE_COEFF_BITS);
+    }
+}
+
+static void VerticalRowFrom0_C(const unsigned char *const *ppRows, const short *pWeights, int taps,
+                               unsigned char *pDst, int width)
+{
+    VerticalRow_C(ppRows, pWeights, taps, pDst, 0, width);
+}
+
+static void HorizontalRowFrom0_C(const unsigned char *pSrc, const int *aFirst, const short *pWeights, int taps,
+                                 unsigned char *pDst, int width)
+{
+    HorizontalRow_C(pSrc, aFirst, pWeights, taps, pDst, 0, width);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// SIMD kernels
+//
+// The vertical pass multiplies pixels of two rows by their two taps in one
+// 16-bit multiply-add. The horizontal pass takes 8 pixels from where each
+// output pixel's taps start, multiplies them by its 8 taps and adds up the
+// lanes; the sums are the same integers as the scalar ones, in any order.
+
+#if defined(SIMD_ARCH_X86)
+// Two taps in each 32-bit lane, for pixels interleaved as 16-bit pairs.
+static inline __m128i TapPair_SSE2(const short *pWeights, int k, int taps)
+{
+    int w1 = k + 1 < taps ? pWeights[k + 1] : 0;
+    return _mm_set1_epi32((int)(((uint32_t)w1 << 16) | ((uint32_t)pWeights[k] & 0xFFFF)));
+}
+
+static void VerticalRow_SSE2(const unsigned char *const *ppRows, const short *pWeights, int taps,
+                             unsigned char *pDst, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(SCALE_ROUND);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+        for (int k = 0; k < taps; k += 2)
+        {
+            __m128i w = TapPair_SSE2(pWeights, k, taps);
+            __m128i a = _mm_loadu_si128((const __m128i *)(ppRows[k] + x));
+            __m128i b = k + 1 < taps ? _mm_loadu_si128((const __m128i *)(ppRows[k + 1] + x)) : zero;
+            __m128i lo = _mm_unpacklo_epi8(a, b), hi = _mm_unpackhi_epi8(a, b);
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+        }
+        __m128i lo16 = _mm_packs_epi32(_mm_srai_epi32(acc0, SCALE_COEFF_BITS), _mm_srai_epi32(acc1, SCALE_COEFF_BITS));
+        __m128i hi16 = _mm_packs_epi32(_mm_srai_epi32(acc2, SCALE_COEFF_BITS), _mm_srai_epi32(acc3, SCALE_COEFF_BITS));
+        _mm_storeu_si128((__m128i *)(pDst + x), _mm_packus_epi16(lo16, hi16));
+    }
+    VerticalRow_C(ppRows, pWeights, taps, pDst, x, width);
+}
+
+// Sum of the taps of one output pixel, in the four lanes.
+static inline __m128i TapSum_SSE2(const unsigned char *p, const short *w, int taps)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (int k = 0; k < taps; k += 8)
+    {
+        __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + k)), zero);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(v, _mm_loadu_si128((const __m128i *)(w + k))));
+    }
+    return acc;
+}
+
+// Without horizontal adds the four partial sums are transposed and added.
+static void HorizontalRow_SSE2(const unsigned char *pSrc, const int *aFirst, const short *pWeights, int taps,
+                               unsigned char *pDst, int width)
+{
+    const __m128i round = _mm_set1_epi32(SCALE_ROUND);
+    int x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        const short *w = pWeights + (size_t)x * taps;
+        __m128i s0 = TapSum_SSE2(pSrc + aFirst[x], w, taps);
+        __m128i s1 = TapSum_SSE2(pSrc + aFirst[x + 1], w + taps, taps);
+        __m128i s2 = TapSum_SSE2(pSrc + aFirst[x + 2], w + 2 * taps, taps);
+        __m128i s3 = TapSum_SSE2(pSrc + aFirst[x + 3], w + 3 * taps, taps);
+        __m128i s01 = _mm_add_epi32(_mm_unpacklo_epi32(s0, s1), _mm_unpackhi_epi32(s0, s1));
+        __m128i s23 = _mm_add_epi32(_mm_unpacklo_epi32(s2, s3), _mm_unpackhi_epi32(s2, s3));
+        __m128i sum = _mm_add_epi32(_mm_unpacklo_epi64(s01, s23), _mm_unpackhi_epi64(s01, s23));
+        sum = _mm_srai_epi32(_mm_add_epi32(sum, round), SCALE_COEFF_BITS);
+        __m128i packed = _mm_packs_epi32(sum, sum);
+        int out = _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+        memcpy(pDst + x, &out, 4);
+    }
+    HorizontalRow_C(pSrc, aFirst, pWeights, taps, pDst, x, width);
+}
+
+SIMD_TARGET_SSSE3
+static void HorizontalRow_SSSE3(const unsigned char *pSrc, const int *aFirst, const short *pWeights, int taps,
+                                unsigned char *pDst, int width)
+{
+    const __m128i round = _mm_set1_epi32(SCALE_ROUND);
+    int x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        const short *w = pWeights + (size_t)x * taps;
+        __m128i s0 = TapSum_SSE2(pSrc + aFirst[x], w, taps);
+        __m128i s1 = TapSum_SSE2(pSrc + aFirst[x + 1], w + taps, taps);
+        __m128i s2 = TapSum_SSE2(pSrc + aFirst[x + 2], w + 2 * taps, taps);
+        __m128i s3 = TapSum_SSE2(pSrc + aFirst[x + 3], w + 3 * taps, taps);
+        __m128i sum = _mm_hadd_epi32(_mm_hadd_epi32(s0, s1), _mm_hadd_epi32(s2, s3));
+        sum = _mm_srai_epi32(_mm_add_epi32(sum, round), SCALE_COEFF_BITS);
+        __m128i packed = _mm_packs_epi32(sum, sum);
+        int out = _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+        memcpy(pDst + x, &out, 4);
+    }
+    HorizontalRow_C(pSrc, aFirst, pWeights, taps, pDst, x, width);
+}
+
+SIMD_TARGET_AVX2
+static void VerticalRow_AVX2(const unsigned char *const *ppRows, const short *pWeights, int taps,
+                             unsigned char *pDst, int width)
+{
+    // In-lane unpacks and packs undo each other, so the pixels come out in
+    // order.
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(SCALE_ROUND);
+    int x = 0;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+        for (int k = 0; k < taps; k += 2)
+        {
+            int w1 = k + 1 < taps ? pWeights[k + 1] : 0;
+            __m256i w = _mm256_set1_epi32((int)(((uint32_t)w1 << 16) | ((uint32_t)pWeights[k] & 0xFFFF)));
+            __m256i a = _mm256_loadu_si256((const __m256i *)(ppRows[k] + x));
+            __m256i b = k + 1 < taps ? _mm256_loadu_si256((const __m256i *)(ppRows[k + 1] + x)) : zero;
+            __m256i lo = _mm256_unpacklo_epi8(a, b), hi = _mm256_unpackhi_epi8(a, b);
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), w));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), w));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), w));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), w));
+        }
+        __m256i lo16 = _mm256_packs_epi32(_mm256_srai_epi32(acc0, SCALE_COEFF_BITS), _mm256_srai_epi32(acc1, SCALE_COEFF_BITS));
+        __m256i hi16 = _mm256_packs_epi32(_mm256_srai_epi32(acc2, SCALE_COEFF_BITS), _mm256_srai_epi32(acc3, SCALE_COEFF_BITS));
+        _mm256_storeu_si256((__m256i *)(pDst + x), _mm256_packus_epi16(lo16, hi16));
+    }
+    VerticalRow_C(ppRows, pWeights, taps, pDst, x, width);
+}
+
+// Sums of the taps of two output pixels, one per 128-bit lane.
+SIMD_TARGET_AVX2
+static inline __m256i TapSum2_AVX2(const unsigned char *p0, const short *w0, const unsigned char *p1, const short *w1, int taps)
+{
+    __m256i acc = _mm256_setzero_si256();
+    for (int k = 0; k < taps; k += 8)
+    {
+        __m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(p0 + k)), _mm_loadl_epi64((const __m128i *)(p1 + k)));
+        __m256i w = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(w0 + k))),
+                                            _mm_loadu_si128((const __m128i *)(w1 + k)), 1);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_cvtepu8_epi16(v), w));
+    }
+    return acc;
+}
+
+SIMD_TARGET_AVX2
+static void HorizontalRow_AVX2(const unsigned char *pSrc, const int *aFirst, const short *pWeights, int taps,
+                               unsigned char *pDst, int width)
+{
+    // Pixel j goes with pixel j + 4, so the sums end up in order across the
+    // two lanes.
+    const __m256i round = _mm256_set1_epi32(SCALE_ROUND);
+    int x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        const short *w = pWeights + (size_t)x * taps;
+        __m256i s[4];
+        for (int j = 0; j < 4; j++)
+        {
+            s[j] = TapSum2_AVX2(pSrc + aFirst[x + j], w + j * taps, pSrc + aFirst[x + j + 4], w + (j + 4) * taps, taps);
+        }
+        __m256i sum = _mm256_hadd_epi32(_mm256_hadd_epi32(s[0], s[1]), _mm256_hadd_epi32(s[2], s[3]));
+        sum = _mm256_srai_epi32(_mm256_add_epi32(sum, round), SCALE_COEFF_BITS);
+        __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+        _mm_storel_epi64((__m128i *)(pDst + x), _mm_packus_epi16(packed, packed));
+    }
+    HorizontalRow_C(pSrc, aFirst, pWeights, taps, pDst, x, width);
+}
+#endif
+
+#if defined(SIMD_ARCH_NEON)
+static void VerticalRow_NEON(const unsigned char *const *ppRows, const short *pWeights, int taps,
+                             unsigned char *pDst, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        int32x4_t acc0 = vdupq_n_s32(0), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        for (int k = 0; k < taps; k++)
+        {
+            uint8x16_t a = vld1q_u8(ppRows[k] + x);
+            int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(a)));
+            int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(a)));
+            acc0 = vmlal_n_s16(acc0, vget_low_s16(lo), pWeights[k]);
+            acc1 = vmlal_n_s16(acc1, vget_high_s16(lo), pWeights[k]);
+            acc2 = vmlal_n_s16(acc2, vget_low_s16(hi), pWeights[k]);
+            acc3 = vmlal_n_s16(acc3, vget_high_s16(hi), pWeights[k]);
+        }
+        // The rounding shift adds SCALE_ROUND first, as the scalar code does.
+        int16x8_t lo16 = vcombine_s16(vqmovn_s32(vrshrq_n_s32(acc0, SCALE_COEFF_BITS)), vqmovn_s32(vrshrq_n_s32(acc1, SCALE_COEFF_BITS)));
+        int16x8_t hi16 = vcombine_s16(vqmovn_s32(vrshrq_n_s32(acc2, SCALE_COEFF_BITS)), vqmovn_s32(vrshrq_n_s32(acc3, SCALE_COEFF_BITS)));
+        vst1q_u8(pDst + x, vcombine_u8(vqmovun_s16(lo16), vqmovun_s16(hi16)));
+    }
+    VerticalRow_C(ppRows, pWeights, taps, pDst, x, width);
+}
+
+// Sum of the taps of one output pixel, folded into two lanes.
+static inline int32x2_t TapSum_NEON(const unsigned char *p, const short *w, int taps)
+{
+    int32x4_t acc = vdupq_n_s32(0);
+    for (int k = 0; k < taps; k += 8)
+    {
+        int16x8_t v = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p + k)));
+        int16x8_t c = vld1q_s16(w + k);
+        acc = vmlal_s16(acc, vget_low_s16(v), vget_low_s16(c));
+        acc = vmlal_s16(acc, vget_high_s16(v), vget_high_s16(c));
+    }
+    return vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+}
+
+static void HorizontalRow_NEON(const unsigned char *pSrc, const int *aFirst, const short *pWeights, int taps,
+                               unsigned char *pDst, int width)
+{
+    int x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        const short *w = pWeights + (size_t)x * taps;
+        int32x2_t s01 = vpadd_s32(TapSum_NEON(pSrc + aFirst[x], w, taps), TapSum_NEON(pSrc + aFirst[x + 1], w + taps, taps));
+        int32x2_t s23 = vpadd_s32(TapSum_NEON(pSrc + aFirst[x + 2], w + 2 * taps, taps), TapSum_NEON(pSrc + aFirst[x + 3], w + 3 * taps, taps));
+        int16x4_t sum = vqmovn_s32(vrshrq_n_s32(vcombine_s32(s01, s23), SCALE_COEFF_BITS));
+        unsigned char out[8];
+        vst1_u8(out, vqmovun_s16(vcombine_s16(sum, sum)));
+        memcpy(pDst + x, out, 4);
+    }
+    HorizontalRow_C(pSrc, aFirst, pWeights, taps, pDst, x, width);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+// Plane and frame loops
+
+struct ScaleKernels
+{
+    void (*pfnVerticalRow)(const unsigned char *const *ppRows, const short *pWeights, int taps,
+                           unsigned char *pDst, int width);
+    void (*pfnHorizontalRow)(const unsigned char *pSrc, const int *aFirst, const short *pWeights, int taps,
+                             unsigned char *pDst, int width);
+};
+
+namespace
+{
+const ScaleKernels s_kernelsC = { VerticalRowFrom0_C, HorizontalRowFrom0_C };
+#if defined(SIMD_ARCH_X86)
+const ScaleKernels s_kernelsSSE2 = { VerticalRow_SSE2, HorizontalRow_SSE2 };
+const ScaleKernels s_kernelsSSSE3 = { VerticalRow_SSE2, HorizontalRow_SSSE3 };
+const ScaleKernels s_kernelsAVX2 = { VerticalRow_AVX2, HorizontalRow_AVX2 };
+#endif
+#if defined(SIMD_ARCH_NEON)
+const ScaleKernels s_kernelsNEON = { VerticalRow_NEON, HorizontalRow_NEON };
+#endif
+
+const ScaleKernels &GetScaleKernels()
+{
+    switch (ScalerGetSimdLevel())
+    {
+#if defined(SIMD_ARCH_X86)
+    case SIMD_LEVEL_AVX2:
+        return s_kernelsAVX2;
+    case SIMD_LEVEL_SSE41:
+    case SIMD_LEVEL_SSSE3:
+        return s_kernelsSSSE3;
+    case SIMD_LEVEL_SSE2:
+        return s_kernelsSSE2;
+#endif
+#if defined(SIMD_ARCH_NEON)
+    case SIMD_LEVEL_NEON:
+        return s_kernelsNEON;
+#endif
+    default:
+        return s_kernelsC;
+    }
+}
+}
+
+PlaneScaler::PlaneScaler()
+{
+    m_srcWidth = 0;
+    m_srcHeight = 0;
+    m_dstWidth = 0;
+    m_dstHeight = 0;
+    m_vertical.taps = 0;
+    m_horizontal.taps = 0;
+    m_rowPad = 0;
+}
+
+bool PlaneScaler::Init(int srcWidth, int srcHeight, int dstWidth, int dstHeight, ScaleFilter eFilter)
+{
+    m_dstWidth = m_dstHeight = 0;
+    if (srcWidth < 1 || srcHeight < 1 || dstWidth < 1 || dstHeight < 1)
+    {
+        fprintf(stderr, "PlaneScaler: cannot scale %dx%d to %dx%d\n", srcWidth, srcHeight, dstWidth, dstHeight);
+        return false;
+    }
+    if (srcWidth > dstWidth * SCALE_MAX_RATIO || srcHeight > dstHeight * SCALE_MAX_RATIO ||
+        dstWidth > srcWidth * SCALE_MAX_RATIO || dstHeight > srcHeight * SCALE_MAX_RATIO)
+    {
+        fprintf(stderr, "PlaneScaler: %dx%d to %dx%d is more than %d times\n", srcWidth, srcHeight, dstWidth, dstHeight, SCALE_MAX_RATIO);
+        return false;
+    }
+
+    m_srcWidth = srcWidth;
+    m_srcHeight = srcHeight;
+    MakeCoeffs(srcHeight, dstHeight, eFilter, 1, &m_vertical);
+    MakeCoeffs(srcWidth, dstWidth, eFilter, SCALE_TAPS_MULTIPLE, &m_horizontal);
+
+    // Taps start at most a filter's width left of the row and the last one
+    // reads up to the padding past its end; the offsets are made relative to
+    // the start of the padded row.
+    m_rowPad = m_horizontal.taps;
+    for (int i = 0; i < dstWidth; i++)
+    {
+        m_horizontal.aFirst[i] += m_rowPad;
+    }
+    m_aRow.assign((size_t)srcWidth + 3 * m_rowPad, 0);
+    m_apRows.resize(m_vertical.taps);
+    m_dstWidth = dstWidth;
+    m_dstHeight = dstHeight;
+    return true;
+}
+
+void PlaneScaler::ScaleWith(const ScaleKernels &kernels, const unsigned char *pSrc, int srcStride, unsigned char *pDst, int dstStride)
+{
+    unsigned char *pRow = &m_aRow[m_rowPad];
+    int rightPad = (int)m_aRow.size() - m_rowPad - m_srcWidth;
+    for (int y = 0; y < m_dstHeight; y++)
+    {
+        // Rows past the top and bottom repeat the edge rows.
+        int first = m_vertical.aFirst[y];
+        for (int k = 0; k < m_vertical.taps; k++)
+        {
+            int sy = first + k;
+            sy = sy < 0 ? 0 : sy >= m_srcHeight ? m_srcHeight - 1 : sy;
+            m_apRows[k] = pSrc + (size_t)srcStride * sy;
+        }
+        kernels.pfnVerticalRow(&m_apRows[0], &m_vertical.aWeights[(size_t)y * m_vertical.taps], m_vertical.taps,
+                               pRow, m_srcWidth);
+        memset(&m_aRow[0], pRow[0], m_rowPad);
+        memset(pRow + m_srcWidth, pRow[m_srcWidth - 1], rightPad);
+        kernels.pfnHorizontalRow(&m_aRow[0], &m_horizontal.aFirst[0], &m_horizontal.aWeights[0], m_horizontal.taps,
+                                 pDst + (size_t)dstStride * y, m_dstWidth);
+    }
+}
+
+void PlaneScaler::Scale(const unsigned char *pSrc, int srcStride, unsigned char *pDst, int dstStride)
+{
+    ScaleWith(GetScaleKernels(), pSrc, srcStride, pDst, dstStride);
+}
+
+void PlaneScaler::Scale_C(const unsigned char *pSrc, int srcStride, unsigned char *pDst, int dstStride)
+{
+    ScaleWith(s_kernelsC, pSrc, srcStride, pDst, dstStride);
+}
+
+bool FrameScaler::Init(int srcWidth, int srcHeight, int dstWidth, int dstHeight, ScaleFilter eFilter)
+{
+    if ((srcWidth | srcHeight | dstWidth | dstHeight) & 1)
+    {
+        fprintf(stderr, "FrameScaler: %dx%d to %dx%d has an odd size\n", srcWidth, srcHeight, dstWidth, dstHeight);
+        return false;
+    }
+    return m_luma.Init(srcWidth, srcHeight, dstWidth, dstHeight, eFilter) &&
+           m_chroma.Init(srcWidth / 2, srcHeight / 2, dstWidth / 2, dstHeight / 2, eFilter);
+}
+
+void FrameScaler::Scale(const YuvI420View &src, unsigned char *pDst)
+{
+    int width = GetDstWidth(), height = GetDstHeight();
+    unsigned char *pDstU = pDst + width * height;
+    m_luma.Scale(src.pY, src.strideY, pDst, width);
+    m_chroma.Scale(src.pU, src.strideUV, pDstU, width / 2);
+    m_chroma.Scale(src.pV, src.strideUV, pDstU + width * height / 4, width / 2);
+}
+
+void FrameScaler::Scale_C(const YuvI420View &src, unsigned char *pDst)
+{
+    int width = GetDstWidth(), height = GetDstHeight();
+    unsigned char *pDstU = pDst + width * height;
+    m_luma.Scale_C(src.pY, src.strideY, pDst, width);
+    m_chroma.Scale_C(src.pU, src.strideUV, pDstU, width / 2);
+    m_chroma.Scale_C(src.pV, src.strideUV, pDstU + width * height / 4, width / 2);
+}
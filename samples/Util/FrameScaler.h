@@ -0,0 +1,122 @@
+/*
+ * Downscaling of captured I420 frames, for the lower renditions of a
+ * simulcast ladder.
+ *
+ * A plane is scaled in two separable passes per output row: a vertical pass
+ * that filters the source rows into one row of source width, then a
+ * horizontal pass from that row into the destination. The filter taps are
+ * worked out once in Init, in fixed point with 14 fractional bits; the taps
+ * of every output pixel sum to exactly one, so a flat area stays flat. Each
+ * pass rounds to 8 bits.
+ *
+ * Filters are widened by the scale factor when downscaling, so every source
+ * pixel counts and nothing aliases: box averages the area each output pixel
+ * covers, bilinear is a tent over it, and Lanczos-2 is sharper at the cost of
+ * more taps and a little ringing. Edges repeat the outermost pixels.
+ *
+ * Every scaler dispatches at runtime to the best kernels the CPU supports
+ * (AVX2, SSSE3, SSE2 or NEON). The scalar kernels are kept as the reference
+ * implementation; all SIMD kernels produce byte-identical output.
+ */
+
+#pragma once
+
+#include "CpuFeatures.h"
+
+#include <vector>
+
+struct ScaleKernels;
+struct YuvI420View;
+
+enum ScaleFilter
+{
+    SCALE_FILTER_BOX,
+    SCALE_FILTER_BILINEAR,
+    SCALE_FILTER_LANCZOS2,
+};
+
+// Largest factor a dimension can be scaled down or up by.
+#define SCALE_MAX_RATIO 8
+
+// Fractional bits of the filter taps.
+#define SCALE_COEFF_BITS 14
+
+// Parses "box", "bilinear" or "lanczos2". Returns false for anything else.
+bool ScaleFilterFromName(const char *szName, ScaleFilter *peFilter);
+const char *GetScaleFilterName(ScaleFilter eFilter);
+
+// Scales one 8-bit plane. Not thread-safe: it keeps the row between the two
+// passes, so each thread needs a scaler of its own.
+class PlaneScaler
+{
+public:
+    PlaneScaler();
+
+    // Returns false, and says why on stderr, if a size is not positive or the
+    // ratio is beyond SCALE_MAX_RATIO.
+    bool Init(int srcWidth, int srcHeight, int dstWidth, int dstHeight, ScaleFilter eFilter);
+
+    void Scale(const unsigned char *pSrc, int srcStride, unsigned char *pDst, int dstStride);
+
+    // Scalar reference implementation, used to verify the SIMD kernels.
+    void Scale_C(const unsigned char *pSrc, int srcStride, unsigned char *pDst, int dstStride);
+
+    int GetDstWidth() const { return m_dstWidth; }
+    int GetDstHeight() const { return m_dstHeight; }
+
+    // Taps per output pixel of the vertical and horizontal passes; the
+    // horizontal one is padded with zero taps to a multiple of 8.
+    int GetVerticalTaps() const { return m_vertical.taps; }
+    int GetHorizontalTaps() const { return m_horizontal.taps; }
+
+private:
+    // Taps of one direction: output pixel i reads taps source pixels from
+    // aFirst[i] on, weighted by aWeights[i * taps] onwards.
+    struct Coeffs
+    {
+        int                 taps;
+        std::vector<int>    aFirst;
+        std::vector<short>  aWeights;
+    };
+
+    static void MakeCoeffs(int srcSize, int dstSize, ScaleFilter eFilter, int tapsMultiple, Coeffs *pCoeffs);
+    void ScaleWith(const ScaleKernels &kernels, const unsigned char *pSrc, int srcStride, unsigned char *pDst, int dstStride);
+
+    int                                 m_srcWidth;
+    int                                 m_srcHeight;
+    int                                 m_dstWidth;
+    int                                 m_dstHeight;
+    Coeffs                              m_vertical;
+    Coeffs                              m_horizontal;
+    int                                 m_rowPad;       // edge pixels repeated left of the row
+    std::vector<unsigned char>          m_aRow;         // vertical pass output, with the edges
+    std::vector<const unsigned char *>  m_apRows;       // source rows of one output row
+};
+
+// Scales an I420 picture into a contiguous I420 frame with pitch == width,
+// the layout IVideoEncoder::EncodeFrameLoop takes.
+class FrameScaler
+{
+public:
+    // Sizes must be even, as I420 chroma needs.
+    bool Init(int srcWidth, int srcHeight, int dstWidth, int dstHeight, ScaleFilter eFilter);
+
+    // src must be the size given to Init. pDst gets GetFrameSize() bytes.
+    void Scale(const YuvI420View &src, unsigned char *pDst);
+    void Scale_C(const YuvI420View &src, unsigned char *pDst);
+
+    int GetDstWidth() const { return m_luma.GetDstWidth(); }
+    int GetDstHeight() const { return m_luma.GetDstHeight(); }
+    int GetFrameSize() const { return GetDstWidth() * GetDstHeight() * 3 / 2; }
+
+private:
+    PlaneScaler     m_luma;
+    PlaneScaler     m_chroma;
+};
+
+// Forces the kernels to a given level (clamped to what the CPU supports) and
+// returns the level now in use. Meant for benchmarks and verification only.
+SimdLevel ScalerSetSimdLevel(SimdLevel level);
+
+// Returns the level the dispatcher currently uses.
+SimdLevel ScalerGetSimdLevel();
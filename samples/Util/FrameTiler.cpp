@@ -0,0 +1,109 @@
+/*
+ * See FrameTiler.h.
+ */
+
+#include "FrameTiler.h"
+#include "TileHash.h"
+#include "YuvConvert.h"
+
+#include <stdio.h>
+
+YuvI420View YuvFrameView(const unsigned char *pFrame, int width, int height)
+{
+    YuvI420View view;
+    view.pY = pFrame;
+    view.pU = pFrame + width * height;
+    view.pV = view.pU + width * height / 4;
+    view.strideY = width;
+    view.strideUV = width / 2;
+    view.width = width;
+    view.height = height;
+    return view;
+}
+
+void YuvCopyView(const YuvI420View &view, unsigned char *pDst)
+{
+    int chromaWidth = view.width / 2, chromaHeight = view.height / 2;
+    unsigned char *pDstU = pDst + view.width * view.height;
+    unsigned char *pDstV = pDstU + chromaWidth * chromaHeight;
+    YuvCopyPlane(view.pY, view.strideY, pDst, view.width, view.width, view.height);
+    YuvCopyPlane(view.pU, view.strideUV, pDstU, chromaWidth, chromaWidth, chromaHeight);
+    YuvCopyPlane(view.pV, view.strideUV, pDstV, chromaWidth, chromaWidth, chromaHeight);
+}
+
+FrameTiler::FrameTiler()
+{
+    m_frameWidth = 0;
+    m_frameHeight = 0;
+    m_nTiles = 0;
+}
+
+bool FrameTiler::Init(int frameWidth, int frameHeight, int rows, int cols, int tileWidth, int tileHeight, int nTiles)
+{
+    m_nTiles = 0;
+    if (rows < 1 || cols < 1 || nTiles < 1 || nTiles > rows * cols || nTiles > MAX_TILES)
+    {
+        fprintf(stderr, "FrameTiler: %d tiles do not go on a %dx%d grid\n", nTiles, rows, cols);
+        return false;
+    }
+    if (tileWidth < 2 || tileHeight < 2)
+    {
+        fprintf(stderr, "FrameTiler: tiles of %dx%d are too small\n", tileWidth, tileHeight);
+        return false;
+    }
+
+    for (int i = 0; i < nTiles; i++)
+    {
+        // Odd cell sizes shift a tile to the even pixel before it.
+        FrameTile &tile = m_aTiles[i];
+        tile.x = (i % cols) * tileWidth & ~1;
+        tile.y = (i / cols) * tileHeight & ~1;
+        tile.width = tileWidth & ~1;
+        tile.height = tileHeight & ~1;
+        if (tile.x + tile.width > frameWidth || tile.y + tile.height > frameHeight)
+        {
+            fprintf(stderr, "FrameTiler: tile %d at %d,%d of %dx%d is outside the %dx%d frame\n",
+                    i, tile.x, tile.y, tile.width, tile.height, frameWidth, frameHeight);
+            return false;
+        }
+    }
+    m_frameWidth = frameWidth;
+    m_frameHeight = frameHeight;
+    m_nTiles = nTiles;
+    return true;
+}
+
+YuvI420View FrameTiler::GetTileView(const unsigned char *pFrame, int i) const
+{
+    const FrameTile &tile = m_aTiles[i];
+    YuvI420View frame = YuvFrameView(pFrame, m_frameWidth, m_frameHeight);
+    YuvI420View view;
+    view.pY = frame.pY + tile.y * frame.strideY + tile.x;
+    view.pU = frame.pU + tile.y / 2 * frame.strideUV + tile.x / 2;
+    view.pV = frame.pV + tile.y / 2 * frame.strideUV + tile.x / 2;
+    view.strideY = frame.strideY;
+    view.strideUV = frame.strideUV;
+    view.width = tile.width;
+    view.height = tile.height;
+    return view;
+}
+
+int FrameTiler::CountChangedHashTiles(int i, const TileChangeDetector &detector) const
+{
+    const unsigned char *pDirty = detector.GetDirtyMask();
+    if (!pDirty)
+        return 0;
+
+    const FrameTile &tile = m_aTiles[i];
+    int nTilesX = detector.GetTilesX(), nTilesY = detector.GetTilesY();
+    int x1 = (tile.x + tile.width - 1) / TILE_HASH_SIZE, y1 = (tile.y + tile.height - 1) / TILE_HASH_SIZE;
+    int nChanged = 0;
+    for (int y = tile.y / TILE_HASH_SIZE; y <= y1 && y < nTilesY; y++)
+    {
+        for (int x = tile.x / TILE_HASH_SIZE; x <= x1 && x < nTilesX; x++)
+        {
+            nChanged += pDirty[y * nTilesX + x] != 0;
+        }
+    }
+    return nChanged;
+}
@@ -0,0 +1,73 @@
+/*
+ * Split-screen layout: one captured I420 frame holds the pictures of several
+ * players on a rows x cols grid, and each player's encoder gets a view of its
+ * tile instead of a copy of the frame.
+ *
+ * A view is three plane pointers and their pitches into the captured frame,
+ * so cutting out a tile copies nothing; the only copy is the encoder's own,
+ * from the view into its input surface. Tiles start and end on even pixels,
+ * as the half-size I420 chroma planes need.
+ */
+
+#pragma once
+
+class TileChangeDetector;
+
+// Three planes of an I420 picture that may lie inside a larger frame. Owns
+// nothing.
+struct YuvI420View
+{
+    const unsigned char    *pY;
+    const unsigned char    *pU;
+    const unsigned char    *pV;
+    int                     strideY;
+    int                     strideUV;
+    int                     width;
+    int                     height;
+};
+
+// View of a whole I420 frame with pitch == width, as NvIFR captures it.
+YuvI420View YuvFrameView(const unsigned char *pFrame, int width, int height);
+
+// Copies a view into a contiguous I420 frame of view.width x view.height.
+void YuvCopyView(const YuvI420View &view, unsigned char *pDst);
+
+// Luma rectangle of one tile.
+struct FrameTile
+{
+    int     x;
+    int     y;
+    int     width;
+    int     height;
+};
+
+class FrameTiler
+{
+public:
+    FrameTiler();
+
+    // Lays out nTiles tiles row by row on a rows x cols grid whose cells are
+    // tileWidth x tileHeight, from the top left of a frameWidth x frameHeight
+    // frame; this is the layout the launcher's AppParam describes. Returns
+    // false, and says why on stderr, if the layout does not fit the frame.
+    bool Init(int frameWidth, int frameHeight, int rows, int cols, int tileWidth, int tileHeight, int nTiles);
+
+    int GetTileCount() const { return m_nTiles; }
+    const FrameTile &GetTile(int i) const { return m_aTiles[i]; }
+
+    // Tile i of pFrame, an I420 frame of the size given to Init with pitch
+    // == width.
+    YuvI420View GetTileView(const unsigned char *pFrame, int i) const;
+
+    // Number of TILE_HASH_SIZE hash tiles overlapping tile i that changed in
+    // the detector's last update.
+    int CountChangedHashTiles(int i, const TileChangeDetector &detector) const;
+
+private:
+    enum { MAX_TILES = 64 };
+
+    int             m_frameWidth;
+    int             m_frameHeight;
+    int             m_nTiles;
+    FrameTile       m_aTiles[MAX_TILES];
+};
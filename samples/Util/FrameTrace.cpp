@@ -0,0 +1,326 @@
+/*
+ * See FrameTrace.h.
+ */
+
+#include "FrameTrace.h"
+
+#if !defined(FRAME_TRACE_DISABLED)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+
+#if defined(_WIN32)
+#include <windows.h>
+#define FRAME_TRACE_TLS __declspec(thread)
+#else
+#include <time.h>
+#include <unistd.h>
+#define FRAME_TRACE_TLS __thread
+#endif
+
+#define FRAME_TRACE_CACHE_LINE 64
+
+// All atomic, so that what an export copies while the slot is overwritten is
+// not a data race; it is thrown away afterwards.
+struct FrameTraceSlot
+{
+    std::atomic<uint64_t>       uTicks;
+    std::atomic<const char *>   szName;
+    std::atomic<uint64_t>       uInfo;          // frame << 8 | phase
+};
+
+struct FrameTraceRing
+{
+    char                        aPadding0[FRAME_TRACE_CACHE_LINE];
+    std::atomic<uint64_t>       uWritten;       // events recorded so far
+    char                        aPadding1[FRAME_TRACE_CACHE_LINE];
+    FrameTraceSlot              aSlots[FRAME_TRACE_RING_EVENTS];
+    uint32_t                    uThread;
+    std::string                 name;           // guarded by s_mutex
+};
+
+static std::atomic<bool> s_bEnabled(false);
+static std::mutex s_mutex;
+static FrameTraceRing *s_apRings[FRAME_TRACE_MAX_THREADS];
+static std::atomic<int> s_nRings(0);
+
+static FRAME_TRACE_TLS FrameTraceRing *t_pRing;
+static FRAME_TRACE_TLS bool t_bNoRing;
+static FRAME_TRACE_TLS uint32_t t_uFrame;
+
+static inline uint64_t GetTicks()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)now.QuadPart;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t TicksToNs(uint64_t uTicks)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return uTicks / freq.QuadPart * 1000000000 + uTicks % freq.QuadPart * 1000000000 / freq.QuadPart;
+#else
+    return uTicks;
+#endif
+}
+
+// The ring of the calling thread, created on its first event.
+static FrameTraceRing *GetRing()
+{
+    if (t_pRing || t_bNoRing)
+        return t_pRing;
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+    int nRings = s_nRings.load(std::memory_order_relaxed);
+    if (nRings >= FRAME_TRACE_MAX_THREADS)
+    {
+        t_bNoRing = true;
+        return NULL;
+    }
+    FrameTraceRing *pRing = new FrameTraceRing;
+    pRing->uWritten.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < FRAME_TRACE_RING_EVENTS; i++)
+    {
+        pRing->aSlots[i].uTicks.store(0, std::memory_order_relaxed);
+        pRing->aSlots[i].szName.store(NULL, std::memory_order_relaxed);
+        pRing->aSlots[i].uInfo.store(0, std::memory_order_relaxed);
+    }
+    pRing->uThread = nRings + 1;
+    s_apRings[nRings] = pRing;
+    s_nRings.store(nRings + 1, std::memory_order_release);
+    t_pRing = pRing;
+    return pRing;
+}
+
+void FrameTraceEnable(bool bEnable)
+{
+    s_bEnabled.store(bEnable, std::memory_order_relaxed);
+}
+
+bool FrameTraceIsEnabled()
+{
+    return s_bEnabled.load(std::memory_order_relaxed);
+}
+
+const char *FrameTraceEnableFromEnv()
+{
+    const char *szPath = getenv(FRAME_TRACE_ENV);
+    if (!szPath || !*szPath)
+        return NULL;
+    FrameTraceEnable(true);
+    return szPath;
+}
+
+void FrameTraceRecord(FrameTracePhase phase, const char *szName)
+{
+    if (!s_bEnabled.load(std::memory_order_relaxed))
+        return;
+    FrameTraceRing *pRing = GetRing();
+    if (!pRing)
+        return;
+
+    uint64_t uTicks = GetTicks();
+    uint64_t i = pRing->uWritten.load(std::memory_order_relaxed);
+    // Orders the count published for the previous event before the slot is
+    // overwritten, so an export that copies a half-written slot sees the
+    // count move past it.
+    std::atomic_thread_fence(std::memory_order_release);
+    FrameTraceSlot &slot = pRing->aSlots[i & (FRAME_TRACE_RING_EVENTS - 1)];
+    slot.uTicks.store(uTicks, std::memory_order_relaxed);
+    slot.szName.store(szName, std::memory_order_relaxed);
+    slot.uInfo.store((uint64_t)t_uFrame << 8 | (uint8_t)phase, std::memory_order_relaxed);
+    pRing->uWritten.store(i + 1, std::memory_order_release);
+}
+
+void FrameTraceSetFrame(uint32_t uFrame)
+{
+    t_uFrame = uFrame;
+}
+
+uint32_t FrameTraceGetFrame()
+{
+    return t_uFrame;
+}
+
+void FrameTraceSetThreadName(const char *szName)
+{
+    FrameTraceRing *pRing = GetRing();
+    if (!pRing)
+        return;
+    std::lock_guard<std::mutex> lock(s_mutex);
+    pRing->name = szName;
+}
+
+// Copies the events of one ring that were not overwritten during the copy,
+// less the end events whose begin is gone.
+static void SnapshotRing(FrameTraceRing *pRing, std::vector<FrameTraceEvent> *pEvents)
+{
+    std::vector<FrameTraceEvent> aEvents;
+    uint64_t uEnd = pRing->uWritten.load(std::memory_order_acquire);
+    uint64_t uBegin = uEnd > FRAME_TRACE_RING_EVENTS ? uEnd - FRAME_TRACE_RING_EVENTS : 0;
+    aEvents.resize((size_t)(uEnd - uBegin));
+    for (uint64_t i = uBegin; i < uEnd; i++)
+    {
+        const FrameTraceSlot &slot = pRing->aSlots[i & (FRAME_TRACE_RING_EVENTS - 1)];
+        FrameTraceEvent &event = aEvents[(size_t)(i - uBegin)];
+        event.uTimeNs = slot.uTicks.load(std::memory_order_relaxed);
+        event.szName = slot.szName.load(std::memory_order_relaxed);
+        uint64_t uInfo = slot.uInfo.load(std::memory_order_relaxed);
+        event.uFrame = (uint32_t)(uInfo >> 8);
+        event.phase = (char)(uInfo & 0xff);
+        event.uThread = pRing->uThread;
+    }
+
+    // Event k is overwritten by event k + FRAME_TRACE_RING_EVENTS, which is
+    // only written once the count has reached it.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t uNow = pRing->uWritten.load(std::memory_order_relaxed);
+    uint64_t uIntact = uNow >= FRAME_TRACE_RING_EVENTS ? uNow - FRAME_TRACE_RING_EVENTS + 1 : 0;
+
+    int nDepth = 0;
+    for (uint64_t i = uBegin > uIntact ? uBegin : uIntact; i < uEnd; i++)
+    {
+        FrameTraceEvent &event = aEvents[(size_t)(i - uBegin)];
+        if (event.phase == FRAME_TRACE_BEGIN)
+        {
+            nDepth++;
+        }
+        else if (event.phase == FRAME_TRACE_END)
+        {
+            if (!nDepth)
+                continue;
+            nDepth--;
+        }
+        event.uTimeNs = TicksToNs(event.uTimeNs);
+        pEvents->push_back(event);
+    }
+}
+
+void FrameTraceSnapshot(std::vector<FrameTraceEvent> *pEvents, std::vector<FrameTraceThread> *pThreads)
+{
+    pEvents->clear();
+    if (pThreads)
+        pThreads->clear();
+
+    int nRings = s_nRings.load(std::memory_order_acquire);
+    for (int i = 0; i < nRings; i++)
+    {
+        SnapshotRing(s_apRings[i], pEvents);
+        if (pThreads)
+        {
+            FrameTraceThread thread;
+            thread.uThread = s_apRings[i]->uThread;
+            std::lock_guard<std::mutex> lock(s_mutex);
+            thread.name = s_apRings[i]->name;
+            pThreads->push_back(thread);
+        }
+    }
+}
+
+static void AppendJsonString(std::string *pJson, const char *sz)
+{
+    pJson->push_back('"');
+    for (; *sz; sz++)
+    {
+        if (*sz == '"' || *sz == '\\')
+        {
+            pJson->push_back('\\');
+            pJson->push_back(*sz);
+        }
+        else if ((unsigned char)*sz >= 0x20)
+        {
+            pJson->push_back(*sz);
+        }
+    }
+    pJson->push_back('"');
+}
+
+void FrameTraceWriteChromeJson(std::string *pJson)
+{
+    std::vector<FrameTraceEvent> aEvents;
+    std::vector<FrameTraceThread> aThreads;
+    FrameTraceSnapshot(&aEvents, &aThreads);
+
+#if defined(_WIN32)
+    unsigned long uPid = GetCurrentProcessId();
+#else
+    unsigned long uPid = (unsigned long)getpid();
+#endif
+
+    // Times are given relative to the first event, which keeps the numbers
+    // short.
+    uint64_t uOriginNs = aEvents.empty() ? 0 : aEvents[0].uTimeNs;
+    for (size_t i = 1; i < aEvents.size(); i++)
+    {
+        if (aEvents[i].uTimeNs < uOriginNs)
+            uOriginNs = aEvents[i].uTimeNs;
+    }
+
+    char szBuffer[128];
+    pJson->append("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    bool bFirst = true;
+    for (size_t i = 0; i < aThreads.size(); i++)
+    {
+        if (aThreads[i].name.empty())
+            continue;
+        sprintf(szBuffer, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%u,\"args\":{\"name\":",
+                bFirst ? "" : ",\n", uPid, aThreads[i].uThread);
+        pJson->append(szBuffer);
+        AppendJsonString(pJson, aThreads[i].name.c_str());
+        pJson->append("}}");
+        bFirst = false;
+    }
+    for (size_t i = 0; i < aEvents.size(); i++)
+    {
+        const FrameTraceEvent &event = aEvents[i];
+        pJson->append(bFirst ? "{\"name\":" : ",\n{\"name\":");
+        AppendJsonString(pJson, event.szName ? event.szName : "");
+        uint64_t uNs = event.uTimeNs - uOriginNs;
+        sprintf(szBuffer, ",\"ph\":\"%c\",%s\"ts\":%llu.%03u,\"pid\":%lu,\"tid\":%u,\"args\":{\"frame\":%u}}",
+                event.phase, event.phase == FRAME_TRACE_INSTANT ? "\"s\":\"t\"," : "",
+                (unsigned long long)(uNs / 1000), (unsigned)(uNs % 1000), uPid, event.uThread, event.uFrame);
+        pJson->append(szBuffer);
+        bFirst = false;
+    }
+    pJson->append("]}\n");
+}
+
+bool FrameTraceExport(const char *szPath)
+{
+    std::string json;
+    FrameTraceWriteChromeJson(&json);
+
+    FILE *f = fopen(szPath, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "FrameTrace: cannot open %s\n", szPath);
+        return false;
+    }
+    bool bOk = fwrite(json.data(), 1, json.size(), f) == json.size();
+    bOk = fclose(f) == 0 && bOk;
+    if (!bOk)
+        fprintf(stderr, "FrameTrace: cannot write %s\n", szPath);
+    return bOk;
+}
+
+void FrameTraceReset()
+{
+    int nRings = s_nRings.load(std::memory_order_acquire);
+    for (int i = 0; i < nRings; i++)
+    {
+        s_apRings[i]->uWritten.store(0, std::memory_order_release);
+    }
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Begin and end events of the stages a frame goes through, kept per thread
+ * and exported in the Chrome trace event format (chrome://tracing, Perfetto)
+ * to see where a frame's latency goes.
+ *
+ * Each thread that records gets a ring of FRAME_TRACE_RING_EVENTS events the
+ * first time it does. Recording writes the clock, the name and the frame
+ * into the ring without a lock or a system call other than reading the
+ * clock; once the ring is full the oldest events are overwritten. The frame
+ * is whatever the thread last set with FRAME_TRACE_FRAME, so stages deeper
+ * down need not be told, and a thread that takes over a frame from another
+ * sets it from what the other passed along.
+ *
+ * Export may run while threads record: it copies each ring and drops the
+ * events that were overwritten during the copy, and the end events whose
+ * begin is no longer in the ring.
+ *
+ * Nothing is recorded until FrameTraceEnable, so a build with tracing costs
+ * a load and a branch per event. Defining FRAME_TRACE_DISABLED removes the
+ * macros altogether and turns the functions into inline stubs that do
+ * nothing.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Events kept per thread; a power of two.
+#define FRAME_TRACE_RING_EVENTS     8192
+
+// Threads that can record at once; later ones record nothing.
+#define FRAME_TRACE_MAX_THREADS     256
+
+// Names the file traces are written to; setting it turns tracing on.
+#define FRAME_TRACE_ENV             "DXIFRSHIM_TRACE"
+
+enum FrameTracePhase
+{
+    FRAME_TRACE_BEGIN = 'B',
+    FRAME_TRACE_END = 'E',
+    FRAME_TRACE_INSTANT = 'i',
+};
+
+struct FrameTraceEvent
+{
+    uint64_t        uTimeNs;        // since an arbitrary point, the same for every thread
+    const char     *szName;
+    uint32_t        uFrame;
+    uint32_t        uThread;        // 1 for the first thread that recorded, and so on
+    char            phase;          // FrameTracePhase
+};
+
+struct FrameTraceThread
+{
+    uint32_t        uThread;
+    std::string     name;
+};
+
+#if defined(FRAME_TRACE_DISABLED)
+// Without tracing every call is inert and compiles to nothing: no events,
+// no path to export to, frame 0.
+inline void FrameTraceEnable(bool /*bEnable*/) {}
+inline bool FrameTraceIsEnabled() { return false; }
+inline const char *FrameTraceEnableFromEnv() { return NULL; }
+inline void FrameTraceRecord(FrameTracePhase /*phase*/, const char * /*szName*/) {}
+inline void FrameTraceSetFrame(uint32_t /*uFrame*/) {}
+inline uint32_t FrameTraceGetFrame() { return 0; }
+inline void FrameTraceSetThreadName(const char * /*szName*/) {}
+inline void FrameTraceSnapshot(std::vector<FrameTraceEvent> *pEvents, std::vector<FrameTraceThread> *pThreads)
+{
+    pEvents->clear();
+    pThreads->clear();
+}
+inline void FrameTraceWriteChromeJson(std::string *pJson) { pJson->append("{\"traceEvents\":[]}"); }
+inline bool FrameTraceExport(const char * /*szPath*/) { return false; }
+inline void FrameTraceReset() {}
+#else
+void FrameTraceEnable(bool bEnable);
+bool FrameTraceIsEnabled();
+
+// Enables tracing if DXIFRSHIM_TRACE is set, and returns the path it names
+// or NULL.
+const char *FrameTraceEnableFromEnv();
+
+// szName must outlive the trace: a string literal.
+void FrameTraceRecord(FrameTracePhase phase, const char *szName);
+
+void FrameTraceSetFrame(uint32_t uFrame);
+uint32_t FrameTraceGetFrame();
+
+// Names the calling thread in exported traces. Copied.
+void FrameTraceSetThreadName(const char *szName);
+
+// Copies every event still in the rings, thread by thread and oldest first
+// within a thread.
+void FrameTraceSnapshot(std::vector<FrameTraceEvent> *pEvents, std::vector<FrameTraceThread> *pThreads);
+
+// Appends the events in the Chrome trace event format, timestamps in
+// microseconds.
+void FrameTraceWriteChromeJson(std::string *pJson);
+
+// Writes the Chrome trace to szPath. Returns false if it cannot.
+bool FrameTraceExport(const char *szPath);
+
+// Forgets every event. Only for when no thread is recording.
+void FrameTraceReset();
+
+// Records the end of a stage when it goes out of scope.
+class FrameTraceScope
+{
+public:
+    FrameTraceScope(const char *szName) : m_szName(szName)
+    {
+        FrameTraceRecord(FRAME_TRACE_BEGIN, szName);
+    }
+
+    ~FrameTraceScope()
+    {
+        FrameTraceRecord(FRAME_TRACE_END, m_szName);
+    }
+
+private:
+    const char     *m_szName;
+
+    FrameTraceScope(const FrameTraceScope &);
+    FrameTraceScope &operator=(const FrameTraceScope &);
+};
+#endif
+
+#if defined(FRAME_TRACE_DISABLED)
+#define FRAME_TRACE_BEGIN_EVENT(szName)
+#define FRAME_TRACE_END_EVENT(szName)
+#define FRAME_TRACE_INSTANT_EVENT(szName)
+#define FRAME_TRACE_SCOPE(szName)
+#define FRAME_TRACE_FRAME(uFrame)           ((void)(uFrame))
+#define FRAME_TRACE_THREAD_NAME(szName)     ((void)(szName))
+#else
+#define FRAME_TRACE_CONCAT2(a, b)           a##b
+#define FRAME_TRACE_CONCAT(a, b)            FRAME_TRACE_CONCAT2(a, b)
+#define FRAME_TRACE_BEGIN_EVENT(szName)     FrameTraceRecord(FRAME_TRACE_BEGIN, szName)
+#define FRAME_TRACE_END_EVENT(szName)       FrameTraceRecord(FRAME_TRACE_END, szName)
+#define FRAME_TRACE_INSTANT_EVENT(szName)   FrameTraceRecord(FRAME_TRACE_INSTANT, szName)
+#define FRAME_TRACE_SCOPE(szName)           FrameTraceScope FRAME_TRACE_CONCAT(frameTraceScope, __LINE__)(szName)
+#define FRAME_TRACE_FRAME(uFrame)           FrameTraceSetFrame(uFrame)
+#define FRAME_TRACE_THREAD_NAME(szName)     FrameTraceSetThreadName(szName)
+#endif
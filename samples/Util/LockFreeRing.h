@@ -0,0 +1,444 @@
+/*
+ * Fixed pools of buffers handed between threads without a lock, replacing
+ * the single-threaded CNvQueue the encoder used to keep its buffers in.
+ *
+ * Every buffer cycles free -> pending -> free:
+ *   producer: GetAvailable (or WaitAvailable), fill it, PushPending
+ *   consumer: GetPending (or WaitPending), use it, ReleasePending
+ * CancelAvailable hands a buffer back to the free list without pushing it.
+ *
+ * SpscRing is for exactly one producer and one consumer thread; buffers come
+ * out in the order they went in and must be pushed and released in the order
+ * they were taken. MpmcRing allows any number of threads on either side and
+ * any release order, at the cost of a compare-and-swap per operation.
+ *
+ * The Wait functions spin briefly, then sleep on an EventCount. Close wakes
+ * every waiter; from then on they return NULL instead of sleeping.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+
+#include "EventCount.h"
+
+// Padding placed between data written by different threads.
+#define RING_CACHE_LINE 64
+
+// Failed attempts before a Wait function goes to sleep.
+#define RING_SPIN_COUNT 64
+
+// Shared by the Wait functions: retries pfnTry until it returns an item or
+// the ring is closed.
+template<class Ring, class T>
+T *RingWait(Ring *pRing, EventCount &event, T *(Ring::*pfnTry)())
+{
+    for (int i = 0; i < RING_SPIN_COUNT; i++)
+    {
+        T *pItem = (pRing->*pfnTry)();
+        if (pItem)
+            return pItem;
+    }
+
+    for (;;)
+    {
+        uint32_t uKey = event.PrepareWait();
+        T *pItem = (pRing->*pfnTry)();
+        if (pItem || pRing->IsClosed())
+        {
+            event.CancelWait();
+            return pItem;
+        }
+        event.Wait(uKey);
+    }
+}
+
+template<class T>
+class SpscRing
+{
+public:
+    SpscRing() : m_ppItems(NULL), m_uSize(0), m_nPushed(0), m_nReleased(0), m_bClosed(false)
+    {
+        ResetProducer();
+        ResetConsumer();
+    }
+
+    ~SpscRing()
+    {
+        delete[] m_ppItems;
+    }
+
+    // Puts all uSize items on the free list. Not thread safe.
+    bool Initialize(T *pItems, unsigned int uSize)
+    {
+        if (!uSize)
+            return false;
+
+        delete[] m_ppItems;
+        m_ppItems = new T *[uSize];
+        for (unsigned int i = 0; i < uSize; i++)
+        {
+            m_ppItems[i] = &pItems[i];
+        }
+        m_uSize = uSize;
+        m_nPushed.store(0);
+        m_nReleased.store(0);
+        m_bClosed.store(false);
+        ResetProducer();
+        ResetConsumer();
+        return true;
+    }
+
+    unsigned int GetSize() const { return m_uSize; }
+
+    // Producer side.
+
+    T *GetAvailable()
+    {
+        if (m_nReserved - m_nReleasedCache == m_uSize)
+        {
+            m_nReleasedCache = m_nReleased.load(std::memory_order_acquire);
+            if (m_nReserved - m_nReleasedCache == m_uSize)
+                return NULL;
+        }
+        T *pItem = m_ppItems[m_iReserveSlot];
+        m_iReserveSlot = Next(m_iReserveSlot);
+        m_nReserved++;
+        return pItem;
+    }
+
+    T *WaitAvailable()
+    {
+        return RingWait(this, m_freeEvent, &SpscRing::GetAvailable);
+    }
+
+    // Only the most recently taken item that has not been pushed yet.
+    void CancelAvailable(T *pItem)
+    {
+        assert(m_nReserved != m_nPushedLocal);
+        m_iReserveSlot = m_iReserveSlot ? m_iReserveSlot - 1 : m_uSize - 1;
+        m_nReserved--;
+        assert(m_ppItems[m_iReserveSlot] == pItem);
+    }
+
+    void PushPending(T *pItem)
+    {
+        assert(m_nReserved != m_nPushedLocal && m_ppItems[m_iPushSlot] == pItem);
+        m_iPushSlot = Next(m_iPushSlot);
+        m_nPushed.store(++m_nPushedLocal, std::memory_order_release);
+        m_pendingEvent.Notify();
+    }
+
+    // Blocks until the consumer has released everything pushed so far.
+    void WaitEmpty()
+    {
+        for (;;)
+        {
+            uint32_t uKey = m_freeEvent.PrepareWait();
+            if (m_nReleased.load(std::memory_order_acquire) == m_nPushedLocal || IsClosed())
+            {
+                m_freeEvent.CancelWait();
+                return;
+            }
+            m_freeEvent.Wait(uKey);
+        }
+    }
+
+    // Consumer side.
+
+    T *GetPending()
+    {
+        if (m_nTaken == m_nPushedCache)
+        {
+            m_nPushedCache = m_nPushed.load(std::memory_order_acquire);
+            if (m_nTaken == m_nPushedCache)
+                return NULL;
+        }
+        T *pItem = m_ppItems[m_iTakeSlot];
+        m_iTakeSlot = Next(m_iTakeSlot);
+        m_nTaken++;
+        return pItem;
+    }
+
+    T *WaitPending()
+    {
+        return RingWait(this, m_pendingEvent, &SpscRing::GetPending);
+    }
+
+    void ReleasePending(T *pItem)
+    {
+        assert(m_nReleasedLocal != m_nTaken && m_ppItems[m_iReleaseSlot] == pItem);
+        m_iReleaseSlot = Next(m_iReleaseSlot);
+        m_nReleased.store(++m_nReleasedLocal, std::memory_order_release);
+        m_freeEvent.Notify();
+    }
+
+    // Either side.
+
+    void Close()
+    {
+        m_bClosed.store(true);
+        m_pendingEvent.Notify();
+        m_freeEvent.Notify();
+    }
+
+    bool IsClosed() const { return m_bClosed.load(); }
+
+private:
+    unsigned int Next(unsigned int iSlot) const
+    {
+        return iSlot + 1 == m_uSize ? 0 : iSlot + 1;
+    }
+
+    void ResetProducer()
+    {
+        m_nReserved = 0;
+        m_nPushedLocal = 0;
+        m_nReleasedCache = 0;
+        m_iReserveSlot = 0;
+        m_iPushSlot = 0;
+    }
+
+    void ResetConsumer()
+    {
+        m_nTaken = 0;
+        m_nReleasedLocal = 0;
+        m_nPushedCache = 0;
+        m_iTakeSlot = 0;
+        m_iReleaseSlot = 0;
+    }
+
+    // Counters wrap; only their differences are used. Slots index m_ppItems.
+    T                         **m_ppItems;
+    unsigned int                m_uSize;
+    char                        m_pad0[RING_CACHE_LINE];
+
+    // Written by the producer.
+    std::atomic<uint32_t>       m_nPushed;
+    uint32_t                    m_nReserved;
+    uint32_t                    m_nPushedLocal;
+    uint32_t                    m_nReleasedCache;
+    unsigned int                m_iReserveSlot;
+    unsigned int                m_iPushSlot;
+    char                        m_pad1[RING_CACHE_LINE];
+
+    // Written by the consumer.
+    std::atomic<uint32_t>       m_nReleased;
+    uint32_t                    m_nTaken;
+    uint32_t                    m_nReleasedLocal;
+    uint32_t                    m_nPushedCache;
+    unsigned int                m_iTakeSlot;
+    unsigned int                m_iReleaseSlot;
+    char                        m_pad2[RING_CACHE_LINE];
+
+    std::atomic<bool>           m_bClosed;
+    EventCount                  m_pendingEvent;
+    EventCount                  m_freeEvent;
+
+    SpscRing(const SpscRing &);
+    SpscRing &operator=(const SpscRing &);
+};
+
+// Bounded MPMC queue of pointers (Vyukov): each cell carries a sequence
+// number telling whether it is ready to be written or read at a position.
+template<class T>
+class MpmcPointerQueue
+{
+public:
+    MpmcPointerQueue() : m_pCells(NULL), m_uMask(0), m_uEnqueuePos(0), m_uDequeuePos(0) {}
+
+    ~MpmcPointerQueue()
+    {
+        delete[] m_pCells;
+    }
+
+    // Capacity is uMinCapacity rounded up to a power of two.
+    void Initialize(unsigned int uMinCapacity)
+    {
+        uint32_t uCapacity = 1;
+        while (uCapacity < uMinCapacity)
+            uCapacity <<= 1;
+
+        delete[] m_pCells;
+        m_pCells = new Cell[uCapacity];
+        for (uint32_t i = 0; i < uCapacity; i++)
+        {
+            m_pCells[i].uSequence.store(i, std::memory_order_relaxed);
+            m_pCells[i].pItem = NULL;
+        }
+        m_uMask = uCapacity - 1;
+        m_uEnqueuePos.store(0, std::memory_order_relaxed);
+        m_uDequeuePos.store(0, std::memory_order_relaxed);
+    }
+
+    // Fails when full, and also for as long as a Pop from the previous lap of
+    // the cell it would use has not finished.
+    bool Push(T *pItem)
+    {
+        uint32_t uPos = m_uEnqueuePos.load(std::memory_order_relaxed);
+        Cell *pCell;
+        for (;;)
+        {
+            pCell = &m_pCells[uPos & m_uMask];
+            int32_t iDiff = (int32_t)(pCell->uSequence.load(std::memory_order_acquire) - uPos);
+            if (iDiff == 0)
+            {
+                if (m_uEnqueuePos.compare_exchange_weak(uPos, uPos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (iDiff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                uPos = m_uEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        pCell->pItem = pItem;
+        pCell->uSequence.store(uPos + 1, std::memory_order_release);
+        return true;
+    }
+
+    T *Pop()
+    {
+        uint32_t uPos = m_uDequeuePos.load(std::memory_order_relaxed);
+        Cell *pCell;
+        for (;;)
+        {
+            pCell = &m_pCells[uPos & m_uMask];
+            int32_t iDiff = (int32_t)(pCell->uSequence.load(std::memory_order_acquire) - (uPos + 1));
+            if (iDiff == 0)
+            {
+                if (m_uDequeuePos.compare_exchange_weak(uPos, uPos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (iDiff < 0)
+            {
+                return NULL;
+            }
+            else
+            {
+                uPos = m_uDequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        T *pItem = pCell->pItem;
+        pCell->uSequence.store(uPos + m_uMask + 1, std::memory_order_release);
+        return pItem;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<uint32_t>   uSequence;
+        T                      *pItem;
+    };
+
+    Cell                       *m_pCells;
+    uint32_t                    m_uMask;
+    char                        m_pad0[RING_CACHE_LINE];
+    std::atomic<uint32_t>       m_uEnqueuePos;
+    char                        m_pad1[RING_CACHE_LINE];
+    std::atomic<uint32_t>       m_uDequeuePos;
+    char                        m_pad2[RING_CACHE_LINE];
+
+    MpmcPointerQueue(const MpmcPointerQueue &);
+    MpmcPointerQueue &operator=(const MpmcPointerQueue &);
+};
+
+template<class T>
+class MpmcRing
+{
+public:
+    MpmcRing() : m_uSize(0), m_bClosed(false) {}
+
+    // Puts all uSize items on the free list. Not thread safe.
+    bool Initialize(T *pItems, unsigned int uSize)
+    {
+        if (!uSize)
+            return false;
+
+        m_free.Initialize(uSize);
+        m_pending.Initialize(uSize);
+        for (unsigned int i = 0; i < uSize; i++)
+        {
+            m_free.Push(&pItems[i]);
+        }
+        m_uSize = uSize;
+        m_bClosed.store(false);
+        return true;
+    }
+
+    unsigned int GetSize() const { return m_uSize; }
+
+    T *GetAvailable()
+    {
+        return m_free.Pop();
+    }
+
+    T *WaitAvailable()
+    {
+        return RingWait(this, m_freeEvent, &MpmcRing::GetAvailable);
+    }
+
+    void CancelAvailable(T *pItem)
+    {
+        ReleasePending(pItem);
+    }
+
+    void PushPending(T *pItem)
+    {
+        Push(m_pending, pItem);
+        m_pendingEvent.Notify();
+    }
+
+    T *GetPending()
+    {
+        return m_pending.Pop();
+    }
+
+    T *WaitPending()
+    {
+        return RingWait(this, m_pendingEvent, &MpmcRing::GetPending);
+    }
+
+    void ReleasePending(T *pItem)
+    {
+        Push(m_free, pItem);
+        m_freeEvent.Notify();
+    }
+
+    void Close()
+    {
+        m_bClosed.store(true);
+        m_pendingEvent.Notify();
+        m_freeEvent.Notify();
+    }
+
+    bool IsClosed() const { return m_bClosed.load(); }
+
+private:
+    // There are never more items than cells, so a failed push is a pop that
+    // is still finishing on another thread.
+    static void Push(MpmcPointerQueue<T> &queue, T *pItem)
+    {
+        while (!queue.Push(pItem))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    MpmcPointerQueue<T>         m_free;
+    MpmcPointerQueue<T>         m_pending;
+    unsigned int                m_uSize;
+    std::atomic<bool>           m_bClosed;
+    EventCount                  m_pendingEvent;
+    EventCount                  m_freeEvent;
+
+    MpmcRing(const MpmcRing &);
+    MpmcRing &operator=(const MpmcRing &);
+};
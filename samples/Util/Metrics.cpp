@@ -0,0 +1,424 @@
+/*
+ * See Metrics.h.
+ */
+
+#include "Metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static uint64_t NowNs()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)now.QuadPart / freq.QuadPart * 1000000000
+         + (uint64_t)now.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+MetricHistogram::MetricHistogram()
+{
+    m_uSumUs.store(0, std::memory_order_relaxed);
+    m_uMaxUs.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        m_anBuckets[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void MetricHistogram::GetSnapshot(MetricHistogramSnapshot *pSnapshot) const
+{
+    pSnapshot->nCount = 0;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        pSnapshot->anBuckets[i] = m_anBuckets[i].load(std::memory_order_relaxed);
+        pSnapshot->nCount += pSnapshot->anBuckets[i];
+    }
+    pSnapshot->uSumUs = m_uSumUs.load(std::memory_order_relaxed);
+    pSnapshot->uMaxUs = m_uMaxUs.load(std::memory_order_relaxed);
+}
+
+uint64_t MetricHistogram::GetBucketBoundUs(int i)
+{
+    if (i < 2 * METRICS_HISTOGRAM_SUB_COUNT)
+        return (uint64_t)i + 1;
+    int iShift = i / METRICS_HISTOGRAM_SUB_COUNT - 1;
+    uint64_t uMantissa = METRICS_HISTOGRAM_SUB_COUNT + i % METRICS_HISTOGRAM_SUB_COUNT + 1;
+    // The last bucket would end at 2^64.
+    if (i == METRICS_HISTOGRAM_BUCKETS - 1)
+        return UINT64_MAX;
+    return uMantissa << iShift;
+}
+
+uint64_t MetricHistogramSnapshot::GetQuantileUs(double q) const
+{
+    if (!nCount)
+        return 0;
+    uint64_t nRank = (uint64_t)(q * nCount);
+    if (nRank < q * nCount)
+        nRank++;
+    if (nRank < 1)
+        nRank = 1;
+    if (nRank > nCount)
+        nRank = nCount;
+
+    uint64_t n = 0;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        n += anBuckets[i];
+        if (n >= nRank)
+        {
+            uint64_t uBoundUs = MetricHistogram::GetBucketBoundUs(i);
+            return uBoundUs < uMaxUs ? uBoundUs : uMaxUs;
+        }
+    }
+    return uMaxUs;
+}
+
+uint64_t MetricHistogramSnapshot::CountAtOrBelow(uint64_t uUs) const
+{
+    uint64_t n = 0;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS && MetricHistogram::GetBucketBoundUs(i) <= uUs; i++)
+    {
+        n += anBuckets[i];
+    }
+    return n;
+}
+
+MetricsRegistry::MetricsRegistry()
+{
+    m_uLastSnapshotNs = NowNs();
+    m_bSnapshotThread = false;
+}
+
+MetricsRegistry::~MetricsRegistry()
+{
+    for (size_t i = 0; i < m_apFamilies.size(); i++)
+    {
+        Family *pFamily = m_apFamilies[i];
+        for (size_t j = 0; j < pFamily->aSeries.size(); j++)
+        {
+            void *pMetric = pFamily->aSeries[j].pMetric;
+            if (pFamily->eType == METRIC_COUNTER)
+                delete (MetricCounter *)pMetric;
+            else if (pFamily->eType == METRIC_GAUGE)
+                delete (MetricGauge *)pMetric;
+            else
+                delete (MetricHistogram *)pMetric;
+        }
+        delete pFamily;
+    }
+}
+
+static void *NewMetric(MetricType eType)
+{
+    if (eType == METRIC_COUNTER)
+        return new MetricCounter;
+    if (eType == METRIC_GAUGE)
+        return new MetricGauge;
+    return new MetricHistogram;
+}
+
+void *MetricsRegistry::GetMetric(MetricType eType, const char *szName, const char *szHelp, const char *szLabels)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    Family *pFamily = NULL;
+    for (size_t i = 0; i < m_apFamilies.size() && !pFamily; i++)
+    {
+        if (m_apFamilies[i]->name == szName)
+            pFamily = m_apFamilies[i];
+    }
+    if (pFamily && pFamily->eType != eType)
+    {
+        // Leaked on purpose; whoever asked for it keeps using it.
+        fprintf(stderr, "MetricsRegistry: %s is already registered as another type\n", szName);
+        return NewMetric(eType);
+    }
+    if (!pFamily)
+    {
+        pFamily = new Family;
+        pFamily->name = szName;
+        pFamily->help = szHelp;
+        pFamily->eType = eType;
+        m_apFamilies.push_back(pFamily);
+    }
+
+    for (size_t i = 0; i < pFamily->aSeries.size(); i++)
+    {
+        if (pFamily->aSeries[i].labels == szLabels)
+            return pFamily->aSeries[i].pMetric;
+    }
+    Series series;
+    series.labels = szLabels;
+    series.pMetric = NewMetric(eType);
+    series.uLastValue = 0;
+    pFamily->aSeries.push_back(series);
+    return series.pMetric;
+}
+
+MetricCounter *MetricsRegistry::GetCounter(const char *szName, const char *szHelp, const char *szLabels)
+{
+    return (MetricCounter *)GetMetric(METRIC_COUNTER, szName, szHelp, szLabels);
+}
+
+MetricGauge *MetricsRegistry::GetGauge(const char *szName, const char *szHelp, const char *szLabels)
+{
+    return (MetricGauge *)GetMetric(METRIC_GAUGE, szName, szHelp, szLabels);
+}
+
+MetricHistogram *MetricsRegistry::GetHistogram(const char *szName, const char *szHelp, const char *szLabels)
+{
+    return (MetricHistogram *)GetMetric(METRIC_HISTOGRAM, szName, szHelp, szLabels);
+}
+
+// name{labels} or name{labels,extra}, without the braces when both are empty.
+static void AppendSeries(std::string *pText, const std::string &name, const char *szSuffix,
+                         const std::string &labels, const char *szExtra)
+{
+    pText->append(name);
+    pText->append(szSuffix);
+    if (labels.empty() && !*szExtra)
+        return;
+    pText->push_back('{');
+    pText->append(labels);
+    if (!labels.empty() && *szExtra)
+        pText->push_back(',');
+    pText->append(szExtra);
+    pText->push_back('}');
+}
+
+// HELP text escapes backslashes and line feeds.
+static void AppendHelp(std::string *pText, const std::string &help)
+{
+    for (size_t i = 0; i < help.size(); i++)
+    {
+        if (help[i] == '\\')
+            pText->append("\\\\");
+        else if (help[i] == '\n')
+            pText->append("\\n");
+        else
+            pText->push_back(help[i]);
+    }
+}
+
+void MetricsRegistry::WritePrometheus(std::string *pText)
+{
+    static const char *s_aszTypes[] = { "counter", "gauge", "histogram" };
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    MetricHistogramSnapshot snapshot;
+    char szBuffer[64];
+    for (size_t i = 0; i < m_apFamilies.size(); i++)
+    {
+        const Family *pFamily = m_apFamilies[i];
+        pText->append("# HELP ");
+        pText->append(pFamily->name);
+        pText->push_back(' ');
+        AppendHelp(pText, pFamily->help);
+        pText->append("\n# TYPE ");
+        pText->append(pFamily->name);
+        pText->push_back(' ');
+        pText->append(s_aszTypes[pFamily->eType]);
+        pText->push_back('\n');
+
+        for (size_t j = 0; j < pFamily->aSeries.size(); j++)
+        {
+            const Series &series = pFamily->aSeries[j];
+            if (pFamily->eType == METRIC_COUNTER)
+            {
+                AppendSeries(pText, pFamily->name, "", series.labels, "");
+                sprintf(szBuffer, " %llu\n", (unsigned long long)((MetricCounter *)series.pMetric)->Get());
+                pText->append(szBuffer);
+                continue;
+            }
+            if (pFamily->eType == METRIC_GAUGE)
+            {
+                AppendSeries(pText, pFamily->name, "", series.labels, "");
+                sprintf(szBuffer, " %lld\n", (long long)((MetricGauge *)series.pMetric)->Get());
+                pText->append(szBuffer);
+                continue;
+            }
+
+            // One pass over the buckets for all the le bounds.
+            ((MetricHistogram *)series.pMetric)->GetSnapshot(&snapshot);
+            uint64_t nBelow = 0;
+            int iBucket = 0;
+            for (int k = METRICS_PROMETHEUS_FIRST_LE; k <= METRICS_PROMETHEUS_LAST_LE; k++)
+            {
+                uint64_t uBoundUs = (uint64_t)1 << k;
+                for (; MetricHistogram::GetBucketBoundUs(iBucket) <= uBoundUs; iBucket++)
+                {
+                    nBelow += snapshot.anBuckets[iBucket];
+                }
+                sprintf(szBuffer, "le=\"%.9g\"", uBoundUs / 1e6);
+                AppendSeries(pText, pFamily->name, "_bucket", series.labels, szBuffer);
+                sprintf(szBuffer, " %llu\n", (unsigned long long)nBelow);
+                pText->append(szBuffer);
+            }
+            AppendSeries(pText, pFamily->name, "_bucket", series.labels, "le=\"+Inf\"");
+            sprintf(szBuffer, " %llu\n", (unsigned long long)snapshot.nCount);
+            pText->append(szBuffer);
+            AppendSeries(pText, pFamily->name, "_sum", series.labels, "");
+            sprintf(szBuffer, " %.6f\n", snapshot.uSumUs / 1e6);
+            pText->append(szBuffer);
+            AppendSeries(pText, pFamily->name, "_count", series.labels, "");
+            sprintf(szBuffer, " %llu\n", (unsigned long long)snapshot.nCount);
+            pText->append(szBuffer);
+        }
+    }
+}
+
+void MetricsRegistry::WriteSnapshot(std::string *pText)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t uNowNs = NowNs();
+    double fSeconds = (uNowNs - m_uLastSnapshotNs) / 1e9;
+    m_uLastSnapshotNs = uNowNs;
+
+    MetricHistogramSnapshot snapshot;
+    char szBuffer[256];
+    sprintf(szBuffer, "# %.1f s since the previous snapshot; histograms in ms\n", fSeconds);
+    pText->append(szBuffer);
+    for (size_t i = 0; i < m_apFamilies.size(); i++)
+    {
+        Family *pFamily = m_apFamilies[i];
+        pText->push_back('\n');
+        pText->append(pFamily->name);
+        pText->push_back('\n');
+
+        for (size_t j = 0; j < pFamily->aSeries.size(); j++)
+        {
+            Series &series = pFamily->aSeries[j];
+            pText->append("  ");
+            pText->append(series.labels.empty() ? "-" : series.labels);
+            if (pFamily->eType == METRIC_GAUGE)
+            {
+                sprintf(szBuffer, "  %lld\n", (long long)((MetricGauge *)series.pMetric)->Get());
+                pText->append(szBuffer);
+                continue;
+            }
+
+            uint64_t uValue;
+            if (pFamily->eType == METRIC_COUNTER)
+            {
+                uValue = ((MetricCounter *)series.pMetric)->Get();
+                sprintf(szBuffer, "  %llu", (unsigned long long)uValue);
+            }
+            else
+            {
+                ((MetricHistogram *)series.pMetric)->GetSnapshot(&snapshot);
+                uValue = snapshot.nCount;
+                sprintf(szBuffer, "  count %llu mean %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f",
+                        (unsigned long long)snapshot.nCount,
+                        snapshot.nCount ? snapshot.uSumUs / 1e3 / snapshot.nCount : 0.0,
+                        snapshot.GetQuantileUs(0.5) / 1e3, snapshot.GetQuantileUs(0.9) / 1e3,
+                        snapshot.GetQuantileUs(0.99) / 1e3, snapshot.uMaxUs / 1e3);
+            }
+            pText->append(szBuffer);
+            sprintf(szBuffer, "  %.1f/s\n", fSeconds > 0 ? (uValue - series.uLastValue) / fSeconds : 0.0);
+            pText->append(szBuffer);
+            series.uLastValue = uValue;
+        }
+    }
+}
+
+bool MetricsRegistry::WriteSnapshotFile(const char *szPath)
+{
+    std::string text;
+    WriteSnapshot(&text);
+
+    // Written next to the file and moved over it, so a reader gets either
+    // snapshot but never a mix.
+    std::string tempPath(szPath);
+    tempPath.append(".tmp");
+    FILE *f = fopen(tempPath.c_str(), "wb");
+    if (!f)
+    {
+        fprintf(stderr, "MetricsRegistry: cannot open %s\n", tempPath.c_str());
+        return false;
+    }
+    bool bOk = fwrite(text.data(), 1, text.size(), f) == text.size();
+    bOk = fclose(f) == 0 && bOk;
+#if defined(_WIN32)
+    bOk = bOk && MoveFileExA(tempPath.c_str(), szPath, MOVEFILE_REPLACE_EXISTING);
+#else
+    bOk = bOk && rename(tempPath.c_str(), szPath) == 0;
+#endif
+    if (!bOk)
+        fprintf(stderr, "MetricsRegistry: cannot write %s\n", szPath);
+    return bOk;
+}
+
+void MetricsRegistry::SnapshotFileLoop(std::string path, uint32_t uIntervalMs)
+{
+    for (;;)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(uIntervalMs));
+        WriteSnapshotFile(path.c_str());
+    }
+}
+
+const char *MetricsRegistry::StartSnapshotFileFromEnv()
+{
+    const char *szPath = getenv(METRICS_FILE_ENV);
+    if (!szPath || !*szPath)
+        return NULL;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_bSnapshotThread)
+        return szPath;
+
+    int nIntervalMs = METRICS_INTERVAL_MS;
+    const char *szInterval = getenv(METRICS_INTERVAL_ENV);
+    if (szInterval && *szInterval)
+    {
+        nIntervalMs = atoi(szInterval);
+        if (nIntervalMs < 1)
+        {
+            fprintf(stderr, "MetricsRegistry: %s=%s is not a positive number of milliseconds, using %d\n",
+                    METRICS_INTERVAL_ENV, szInterval, METRICS_INTERVAL_MS);
+            nIntervalMs = METRICS_INTERVAL_MS;
+        }
+    }
+    // Runs as long as the process; the shared registry is never destroyed.
+    std::thread(&MetricsRegistry::SnapshotFileLoop, this, std::string(szPath), (uint32_t)nIntervalMs).detach();
+    m_bSnapshotThread = true;
+    return szPath;
+}
+
+// Created once and never destroyed, like the other shared objects of the
+// shim, so metrics can be updated until the process exits.
+static std::mutex s_sharedRegistryMutex;
+static std::atomic<MetricsRegistry *> s_pSharedRegistry(NULL);
+
+MetricsRegistry *MetricsRegistry::GetShared()
+{
+    MetricsRegistry *pRegistry = s_pSharedRegistry.load(std::memory_order_acquire);
+    if (pRegistry)
+        return pRegistry;
+
+    std::lock_guard<std::mutex> lock(s_sharedRegistryMutex);
+    pRegistry = s_pSharedRegistry.load(std::memory_order_relaxed);
+    if (!pRegistry)
+    {
+        pRegistry = new MetricsRegistry();
+        s_pSharedRegistry.store(pRegistry, std::memory_order_release);
+    }
+    return pRegistry;
+}
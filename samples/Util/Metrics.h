@@ -0,0 +1,238 @@
+/*
+ * Counters, gauges and latency histograms of the running players, exported
+ * in the Prometheus text format and as a readable snapshot file.
+ *
+ * Metrics are registered by name and labels, e.g. player="0", once, when a
+ * player starts; the same name and labels give back the same metric, so a
+ * player that restarts carries on counting where it left off. Registration
+ * and export take the registry's mutex. Updating a metric takes no lock: a
+ * counter or a gauge is one relaxed atomic operation, a histogram three and
+ * a comparison. Each metric has cache lines of its own and is, in practice,
+ * only updated by the thread of its player, so updates never contend.
+ * Metrics live as long as their registry, and the shared registry is never
+ * destroyed.
+ *
+ * Histograms are in the style of HdrHistogram: values are recorded in
+ * microseconds into buckets whose width doubles every
+ * 2^METRICS_HISTOGRAM_SUB_BITS buckets, so any value from 1 us to hours is
+ * kept to within 1 / 2^METRICS_HISTOGRAM_SUB_BITS of itself. Bucket bounds
+ * fall on powers of two, which is where the Prometheus le buckets are cut,
+ * so those counts are exact.
+ *
+ * If DXIFRSHIM_METRICS_FILE is set, StartSnapshotFileFromEnv starts a thread
+ * that rewrites that file every DXIFRSHIM_METRICS_INTERVAL_MS with the
+ * snapshot, replacing it whole so a reader never sees half of one.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define METRICS_CACHE_LINE          64
+
+// Buckets per doubling are 2^METRICS_HISTOGRAM_SUB_BITS.
+#define METRICS_HISTOGRAM_SUB_BITS  3
+#define METRICS_HISTOGRAM_SUB_COUNT (1 << METRICS_HISTOGRAM_SUB_BITS)
+#define METRICS_HISTOGRAM_BUCKETS   ((65 - METRICS_HISTOGRAM_SUB_BITS) * METRICS_HISTOGRAM_SUB_COUNT)
+
+// Prometheus le buckets, in microseconds: 2^FIRST_LE to 2^LAST_LE, then +Inf.
+#define METRICS_PROMETHEUS_FIRST_LE 4
+#define METRICS_PROMETHEUS_LAST_LE  22
+
+#define METRICS_FILE_ENV            "DXIFRSHIM_METRICS_FILE"
+#define METRICS_INTERVAL_ENV        "DXIFRSHIM_METRICS_INTERVAL_MS"
+#define METRICS_INTERVAL_MS         5000
+
+// Content type of WritePrometheus.
+#define METRICS_PROMETHEUS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+enum MetricType
+{
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+};
+
+// Only ever goes up.
+class MetricCounter
+{
+public:
+    MetricCounter() : m_uValue(0) {}
+
+    void Add(uint64_t n = 1) { m_uValue.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t Get() const { return m_uValue.load(std::memory_order_relaxed); }
+
+private:
+    char                    m_aPadding0[METRICS_CACHE_LINE];
+    std::atomic<uint64_t>   m_uValue;
+    char                    m_aPadding1[METRICS_CACHE_LINE];
+
+    MetricCounter(const MetricCounter &);
+    MetricCounter &operator=(const MetricCounter &);
+};
+
+// A value that goes up and down, such as a queue depth or a target.
+class MetricGauge
+{
+public:
+    MetricGauge() : m_iValue(0) {}
+
+    void Set(int64_t i) { m_iValue.store(i, std::memory_order_relaxed); }
+    void Add(int64_t i) { m_iValue.fetch_add(i, std::memory_order_relaxed); }
+    int64_t Get() const { return m_iValue.load(std::memory_order_relaxed); }
+
+private:
+    char                    m_aPadding0[METRICS_CACHE_LINE];
+    std::atomic<int64_t>    m_iValue;
+    char                    m_aPadding1[METRICS_CACHE_LINE];
+
+    MetricGauge(const MetricGauge &);
+    MetricGauge &operator=(const MetricGauge &);
+};
+
+struct MetricHistogramSnapshot
+{
+    uint64_t    nCount;
+    uint64_t    uSumUs;
+    uint64_t    uMaxUs;
+    uint64_t    anBuckets[METRICS_HISTOGRAM_BUCKETS];
+
+    // The smallest bucket bound that at least q of the values are at or
+    // below, no more than the largest value; 0 if there are none.
+    uint64_t GetQuantileUs(double q) const;
+
+    // How many values are at or below uUs, which must be a bucket bound
+    // such as a power of two for the count to be exact.
+    uint64_t CountAtOrBelow(uint64_t uUs) const;
+};
+
+class MetricHistogram
+{
+public:
+    MetricHistogram();
+
+    void Record(uint64_t uUs)
+    {
+        m_anBuckets[GetBucket(uUs)].fetch_add(1, std::memory_order_relaxed);
+        m_uSumUs.fetch_add(uUs, std::memory_order_relaxed);
+        uint64_t uMaxUs = m_uMaxUs.load(std::memory_order_relaxed);
+        while (uUs > uMaxUs && !m_uMaxUs.compare_exchange_weak(uMaxUs, uUs, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // Copies the histogram; the count is that of the buckets copied, so the
+    // two always agree even while values are recorded.
+    void GetSnapshot(MetricHistogramSnapshot *pSnapshot) const;
+
+    // Bucket of a value. Bucket i holds the values above GetBucketBoundUs(i - 1)
+    // up to GetBucketBoundUs(i).
+    static int GetBucket(uint64_t uUs)
+    {
+        // Shifted by one so that the bounds, rather than the lower ends, are
+        // the round numbers.
+        uint64_t v = uUs ? uUs - 1 : 0;
+        if (v < 2 * METRICS_HISTOGRAM_SUB_COUNT)
+            return (int)v;
+        int iMsb = GetMsb(v);
+        return (iMsb - METRICS_HISTOGRAM_SUB_BITS + 1) * METRICS_HISTOGRAM_SUB_COUNT
+             + (int)((v >> (iMsb - METRICS_HISTOGRAM_SUB_BITS)) & (METRICS_HISTOGRAM_SUB_COUNT - 1));
+    }
+
+    static uint64_t GetBucketBoundUs(int i);
+
+private:
+    // v is not 0.
+    static int GetMsb(uint64_t v)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        if (_BitScanReverse(&index, (unsigned long)(v >> 32)))
+            return (int)index + 32;
+        _BitScanReverse(&index, (unsigned long)v);
+        return (int)index;
+#else
+        return 63 - __builtin_clzll(v);
+#endif
+    }
+
+    char                    m_aPadding0[METRICS_CACHE_LINE];
+    std::atomic<uint64_t>   m_uSumUs;
+    std::atomic<uint64_t>   m_uMaxUs;
+    std::atomic<uint64_t>   m_anBuckets[METRICS_HISTOGRAM_BUCKETS];
+    char                    m_aPadding1[METRICS_CACHE_LINE];
+
+    MetricHistogram(const MetricHistogram &);
+    MetricHistogram &operator=(const MetricHistogram &);
+};
+
+class MetricsRegistry
+{
+public:
+    MetricsRegistry();
+    ~MetricsRegistry();
+
+    // szName follows the Prometheus conventions: counters end in _total and
+    // histograms, which are exported in seconds, in _seconds. szLabels is
+    // the inside of the braces, e.g. player="0", or "" for none. If szName
+    // is already registered as another type, the metric returned works but
+    // is not exported.
+    MetricCounter *GetCounter(const char *szName, const char *szHelp, const char *szLabels = "");
+    MetricGauge *GetGauge(const char *szName, const char *szHelp, const char *szLabels = "");
+    MetricHistogram *GetHistogram(const char *szName, const char *szHelp, const char *szLabels = "");
+
+    // Appends every metric in the Prometheus text format, version 0.0.4.
+    void WritePrometheus(std::string *pText);
+
+    // Appends every metric in a form meant to be read: counters with their
+    // rate since the previous snapshot, histograms as quantiles.
+    void WriteSnapshot(std::string *pText);
+
+    // Writes the snapshot to szPath through a temporary file. Returns false
+    // if it cannot.
+    bool WriteSnapshotFile(const char *szPath);
+
+    // Starts the thread that writes the snapshot file, if DXIFRSHIM_METRICS_FILE
+    // is set and the thread is not running yet. Returns the path or NULL.
+    // The registry must not be destroyed afterwards.
+    const char *StartSnapshotFileFromEnv();
+
+    // Registry shared by all players, created on the first call and never
+    // destroyed.
+    static MetricsRegistry *GetShared();
+
+private:
+    struct Series
+    {
+        std::string     labels;
+        void           *pMetric;
+        uint64_t        uLastValue;         // at the previous snapshot
+    };
+
+    struct Family
+    {
+        std::string             name;
+        std::string             help;
+        MetricType              eType;
+        std::vector<Series>     aSeries;
+    };
+
+    void *GetMetric(MetricType eType, const char *szName, const char *szHelp, const char *szLabels);
+    void SnapshotFileLoop(std::string path, uint32_t uIntervalMs);
+
+    std::mutex              m_mutex;
+    std::vector<Family *>   m_apFamilies;
+    uint64_t                m_uLastSnapshotNs;
+    bool                    m_bSnapshotThread;
+
+    MetricsRegistry(const MetricsRegistry &);
+    MetricsRegistry &operator=(const MetricsRegistry &);
+};
@@ -0,0 +1,181 @@
+/*
+ * Start code search and NAL unit iteration over Annex-B byte streams.
+ */
+
+#include "NalScanner.h"
+
+#if defined(SIMD_ARCH_X86)
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+#if defined(SIMD_ARCH_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static volatile int s_nSimdLevel = -1;
+
+SimdLevel NalSetSimdLevel(SimdLevel level)
+{
+    SimdLevel clamped = ClampSimdLevel(level);
+    s_nSimdLevel = clamped;
+    return clamped;
+}
+
+SimdLevel NalGetSimdLevel()
+{
+    int level = s_nSimdLevel;
+    if (level < 0)
+    {
+        level = GetBestSimdLevel();
+        s_nSimdLevel = level;
+    }
+    return (SimdLevel)level;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Scalar reference kernel
+
+size_t NalFindStartCode_C(const unsigned char *pData, size_t size)
+{
+    for (size_t i = 0; i + 2 < size; i++)
+    {
+        if (pData[i] == 0 && pData[i + 1] == 0 && pData[i + 2] == 1)
+            return i;
+    }
+    return size;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// SIMD kernels. Position i is a start code if bytes i, i + 1 and i + 2 are
+// 0, 0 and 1, so three overlapping loads give the three bytes of every
+// position in the block at once. The tail is left to the scalar kernel.
+
+static unsigned int LowestSetBit(unsigned int mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+#if defined(SIMD_ARCH_X86)
+static size_t FindStartCode_SSE2(const unsigned char *pData, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = 0;
+    for (; i + 18 <= size; i += 16)
+    {
+        __m128i b0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pData + i)), zero);
+        __m128i b1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pData + i + 1)), zero);
+        __m128i b2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pData + i + 2)), one);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(b0, b1), b2));
+        if (mask)
+            return i + LowestSetBit(mask);
+    }
+    return i + NalFindStartCode_C(pData + i, size - i);
+}
+
+SIMD_TARGET_AVX2
+static size_t FindStartCode_AVX2(const unsigned char *pData, size_t size)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    size_t i = 0;
+    for (; i + 34 <= size; i += 32)
+    {
+        __m256i b0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(pData + i)), zero);
+        __m256i b1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(pData + i + 1)), zero);
+        __m256i b2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(pData + i + 2)), one);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(b0, b1), b2));
+        if (mask)
+            return i + LowestSetBit(mask);
+    }
+    return i + NalFindStartCode_C(pData + i, size - i);
+}
+#endif
+
+#if defined(SIMD_ARCH_NEON)
+// NEON has no movemask; a block with any match is searched by the scalar
+// kernel, which is rare enough not to matter.
+static size_t FindStartCode_NEON(const unsigned char *pData, size_t size)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    size_t i = 0;
+    for (; i + 18 <= size; i += 16)
+    {
+        uint8x16_t b0 = vceqq_u8(vld1q_u8(pData + i), zero);
+        uint8x16_t b1 = vceqq_u8(vld1q_u8(pData + i + 1), zero);
+        uint8x16_t b2 = vceqq_u8(vld1q_u8(pData + i + 2), one);
+        uint8x16_t match = vandq_u8(vandq_u8(b0, b1), b2);
+        uint8x8_t any = vorr_u8(vget_low_u8(match), vget_high_u8(match));
+        if (vget_lane_u64(vreinterpret_u64_u8(any), 0))
+            return i + NalFindStartCode_C(pData + i, 18);
+    }
+    return i + NalFindStartCode_C(pData + i, size - i);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+// Dispatcher
+
+size_t NalFindStartCode(const unsigned char *pData, size_t size)
+{
+    switch (NalGetSimdLevel())
+    {
+#if defined(SIMD_ARCH_X86)
+    case SIMD_LEVEL_AVX2:
+        return FindStartCode_AVX2(pData, size);
+    case SIMD_LEVEL_SSE41:
+    case SIMD_LEVEL_SSSE3:
+    case SIMD_LEVEL_SSE2:
+        return FindStartCode_SSE2(pData, size);
+#endif
+#if defined(SIMD_ARCH_NEON)
+    case SIMD_LEVEL_NEON:
+        return FindStartCode_NEON(pData, size);
+#endif
+    default:
+        return NalFindStartCode_C(pData, size);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// NAL unit iteration
+
+NalScanner::NalScanner(const unsigned char *pData, size_t size)
+{
+    m_pData = pData;
+    m_size = size;
+    size_t start = NalFindStartCode(pData, size);
+    m_next = start < size ? start + 3 : size;
+}
+
+bool NalScanner::Next(const unsigned char **ppNal, size_t *pSize)
+{
+    while (m_next < m_size)
+    {
+        size_t start = m_next;
+        size_t end = start + NalFindStartCode(m_pData + start, m_size - start);
+        m_next = end < m_size ? end + 3 : m_size;
+
+        while (end > start && m_pData[end - 1] == 0)
+        {
+            end--;
+        }
+        if (end > start)
+        {
+            *ppNal = m_pData + start;
+            *pSize = end - start;
+            return true;
+        }
+    }
+    return false;
+}
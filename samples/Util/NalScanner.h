@@ -0,0 +1,45 @@
+/*
+ * Start code search and NAL unit iteration over Annex-B byte streams.
+ *
+ * The search dispatches at runtime to the best kernel the CPU supports
+ * (AVX2, SSE2 or NEON), which tests 16 or 32 positions at a time for a
+ * 00 00 01 sequence. The scalar kernel is kept as the reference; all kernels
+ * return the same offset.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "CpuFeatures.h"
+
+// Offset of the first three byte start code (00 00 01) in pData, or size if
+// there is none.
+size_t NalFindStartCode(const unsigned char *pData, size_t size);
+
+// Scalar reference implementation, used to verify the SIMD kernels.
+size_t NalFindStartCode_C(const unsigned char *pData, size_t size);
+
+// Walks the NAL units of an Annex-B buffer in place. Units come out without
+// their start code and without the zero bytes in front of the next one (a NAL
+// unit never ends in a zero byte); empty units are skipped.
+class NalScanner
+{
+public:
+    NalScanner(const unsigned char *pData, size_t size);
+
+    // Returns false after the last NAL unit.
+    bool Next(const unsigned char **ppNal, size_t *pSize);
+
+private:
+    const unsigned char    *m_pData;
+    size_t                  m_size;
+    size_t                  m_next;     // offset just past the next start code, or size
+};
+
+// Forces the kernels to a given level (clamped to what the CPU supports) and
+// returns the level now in use. Meant for benchmarks and verification only.
+SimdLevel NalSetSimdLevel(SimdLevel level);
+
+// Returns the level the dispatcher currently uses.
+SimdLevel NalGetSimdLevel();
@@ -0,0 +1,1136 @@
+/*
+ * See RgbConvert.h.
+ */
+
+#include "RgbConvert.h"
+
+#if defined(SIMD_ARCH_X86)
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+#if defined(SIMD_ARCH_NEON)
+#include <arm_neon.h>
+#endif
+
+// Fractional bits of the coefficients. Chroma is computed from the sum of
+// four pixels, so it has two more.
+#define RGB_COEFF_BITS  15
+#define RGB_CHROMA_BITS (RGB_COEFF_BITS + 2)
+
+// The coefficients of a conversion, by position of the colour byte in the
+// pixel rather than by colour, so the kernels never look at the format.
+struct RgbKernelParams
+{
+    int             bytesPerPixel;
+    int             firstByte;          // of the three colour bytes
+    int             ky[3];
+    int             ku[3];
+    int             kv[3];
+    int             yOffset;            // black level and rounding
+    int             uvOffset;           // 128 and rounding, for sums of four pixels
+    unsigned char   aShuffle[3][16];    // gathers colour byte k of 4 pixels into 16-bit lanes
+};
+
+static volatile int s_nSimdLevel = -1;
+
+SimdLevel RgbSetSimdLevel(SimdLevel level)
+{
+    SimdLevel clamped = ClampSimdLevel(level);
+    s_nSimdLevel = clamped;
+    return clamped;
+}
+
+SimdLevel RgbGetSimdLevel()
+{
+    int level = s_nSimdLevel;
+    if (level < 0)
+    {
+        level = GetBestSimdLevel();
+        s_nSimdLevel = level;
+    }
+    return (SimdLevel)level;
+}
+
+int RgbGetBytesPerPixel(RgbFormat eFormat)
+{
+    return eFormat == RGB_FORMAT_RGB || eFormat == RGB_FORMAT_BGR ? 3 : 4;
+}
+
+static void GetLumaWeights(YuvMatrix eMatrix, double *pKr, double *pKb)
+{
+    if (eMatrix == YUV_MATRIX_BT709)
+    {
+        *pKr = 0.2126;
+        *pKb = 0.0722;
+    }
+    else
+    {
+        *pKr = 0.299;
+        *pKb = 0.114;
+    }
+}
+
+void RgbToYuvReference(double r, double g, double b, YuvMatrix eMatrix, YuvRange eRange,
+                       double *pY, double *pU, double *pV)
+{
+    double kr, kb;
+    GetLumaWeights(eMatrix, &kr, &kb);
+    double luma = kr * r + (1.0 - kr - kb) * g + kb * b;
+    bool bLimited = eRange == YUV_RANGE_LIMITED;
+    double yScale = bLimited ? 219.0 / 255.0 : 1.0, cScale = bLimited ? 224.0 / 255.0 : 1.0;
+    *pY = (bLimited ? 16.0 : 0.0) + yScale * luma;
+    *pU = 128.0 + cScale * (b - luma) / (2.0 * (1.0 - kb));
+    *pV = 128.0 + cScale * (r - luma) / (2.0 * (1.0 - kr));
+}
+
+static int RoundCoeff(double k)
+{
+    return (int)(k * (1 << RGB_COEFF_BITS) + (k < 0 ? -0.5 : 0.5));
+}
+
+static void GetKernelParams(RgbFormat eFormat, YuvMatrix eMatrix, YuvRange eRange, RgbKernelParams *pParams)
+{
+    double kr, kb;
+    GetLumaWeights(eMatrix, &kr, &kb);
+    bool bLimited = eRange == YUV_RANGE_LIMITED;
+    double yScale = bLimited ? 219.0 / 255.0 : 1.0, cScale = bLimited ? 224.0 / 255.0 : 1.0;
+
+    // Green takes whatever rounding left, so that the luma weights add up to
+    // the scale and the chroma weights to 0: grey has no chroma.
+    int yr = RoundCoeff(kr * yScale), yb = RoundCoeff(kb * yScale);
+    int yg = RoundCoeff(yScale) - yr - yb;
+    int ur = RoundCoeff(-kr * cScale / (2.0 * (1.0 - kb))), ub = RoundCoeff(cScale / 2.0);
+    int ug = -ur - ub;
+    int vr = RoundCoeff(cScale / 2.0), vb = RoundCoeff(-kb * cScale / (2.0 * (1.0 - kr)));
+    int vg = -vr - vb;
+
+    // Byte positions of red and blue; green is always in the middle.
+    int iRed = 0, iBlue = 2;
+    pParams->bytesPerPixel = RgbGetBytesPerPixel(eFormat);
+    pParams->firstByte = eFormat == RGB_FORMAT_ARGB ? 1 : 0;
+    if (eFormat == RGB_FORMAT_BGRA || eFormat == RGB_FORMAT_BGR)
+    {
+        iRed = 2;
+        iBlue = 0;
+    }
+    pParams->ky[iRed] = yr; pParams->ky[1] = yg; pParams->ky[iBlue] = yb;
+    pParams->ku[iRed] = ur; pParams->ku[1] = ug; pParams->ku[iBlue] = ub;
+    pParams->kv[iRed] = vr; pParams->kv[1] = vg; pParams->kv[iBlue] = vb;
+    pParams->yOffset = ((bLimited ? 16 : 0) << RGB_COEFF_BITS) + (1 << (RGB_COEFF_BITS - 1));
+    pParams->uvOffset = (128 << RGB_CHROMA_BITS) + (1 << (RGB_CHROMA_BITS - 1));
+
+    for (int k = 0; k < 3; k++)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            int j = i / 2;
+            bool bLow = (i & 1) == 0 && j < 4;
+            pParams->aShuffle[k][i] = bLow ? (unsigned char)(j * pParams->bytesPerPixel + k) : 0x80;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Scalar reference kernels. Each converts a row from x (or chroma sample cx)
+// to the end, so the SIMD kernels use them for their tails.
+
+static inline int ClampByte(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static void RowY_C(const unsigned char *pSrc, const RgbKernelParams &p, unsigned char *pDstY, int x, int width)
+{
+    for (; x < width; x++)
+    {
+        const unsigned char *s = pSrc + x * p.bytesPerPixel + p.firstByte;
+        pDstY[x] = (unsigned char)ClampByte((p.ky[0] * s[0] + p.ky[1] * s[1] + p.ky[2] * s[2] + p.yOffset) >> RGB_COEFF_BITS);
+    }
+}
+
+// Chroma of the 2x2 blocks of two rows; pSrc1 is pSrc0 for a last odd row.
+// Sample cx goes to pDstU[cx * uvStep] and pDstV[cx * uvStep].
+static void RowUV_C(const unsigned char *pSrc0, const unsigned char *pSrc1, const RgbKernelParams &p,
+                    unsigned char *pDstU, unsigned char *pDstV, int uvStep, int cx, int width)
+{
+    int bpp = p.bytesPerPixel;
+    for (; 2 * cx < width; cx++)
+    {
+        int x0 = 2 * cx, x1 = x0 + 1 < width ? x0 + 1 : x0;
+        const unsigned char *a = pSrc0 + x0 * bpp + p.firstByte, *b = pSrc0 + x1 * bpp + p.firstByte;
+        const unsigned char *c = pSrc1 + x0 * bpp + p.firstByte, *d = pSrc1 + x1 * bpp + p.firstByte;
+        int s0 = a[0] + b[0] + c[0] + d[0];
+        int s1 = a[1] + b[1] + c[1] + d[1];
+        int s2 = a[2] + b[2] + c[2] + d[2];
+        pDstU[cx * uvStep] = (unsigned char)ClampByte((p.ku[0] * s0 + p.ku[1] * s1 + p.ku[2] * s2 + p.uvOffset) >> RGB_CHROMA_BITS);
+        pDstV[cx * uvStep] = (unsigned char)ClampByte((p.kv[0] * s0 + p.kv[1] * s1 + p.kv[2] * s2 + p.uvOffset) >> RGB_CHROMA_BITS);
+    }
+}
+
+// Chroma of every pixel, as the average of four copies of it.
+static void RowUV444_C(const unsigned char *pSrc, const RgbKernelParams &p,
+                       unsigned char *pDstU, unsigned char *pDstV, int x, int width)
+{
+    for (; x < width; x++)
+    {
+        const unsigned char *s = pSrc + x * p.bytesPerPixel + p.firstByte;
+        int s0 = 4 * s[0], s1 = 4 * s[1], s2 = 4 * s[2];
+        pDstU[x] = (unsigned char)ClampByte((p.ku[0] * s0 + p.ku[1] * s1 + p.ku[2] * s2 + p.uvOffset) >> RGB_CHROMA_BITS);
+        pDstV[x] = (unsigned char)ClampByte((p.kv[0] * s0 + p.kv[1] * s1 + p.kv[2] * s2 + p.uvOffset) >> RGB_CHROMA_BITS);
+    }
+}
+
+static void RowYFrom0_C(const unsigned char *pSrc, const RgbKernelParams &p, unsigned char *pDstY, int width)
+{
+    RowY_C(pSrc, p, pDstY, 0, width);
+}
+
+static void RowUVFrom0_C(const unsigned char *pSrc0, const unsigned char *pSrc1, const RgbKernelParams &p,
+                         unsigned char *pDstU, unsigned char *pDstV, int uvStep, int width)
+{
+    RowUV_C(pSrc0, pSrc1, p, pDstU, pDstV, uvStep, 0, width);
+}
+
+static void RowUV444From0_C(const unsigned char *pSrc, const RgbKernelParams &p,
+                            unsigned char *pDstU, unsigned char *pDstV, int width)
+{
+    RowUV444_C(pSrc, p, pDstU, pDstV, 0, width);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// SIMD kernels. Channels are gathered into 16-bit lanes, luma and chroma are
+// multiply-added in 32 bits exactly as the scalar kernels do, and the vector
+// body stops where a load would read past the row; the tail goes to the
+// scalar kernel, so any width and stride is accepted.
+
+#if defined(SIMD_ARCH_X86)
+// Byte k of 8 pixels, in 16-bit lanes. Reads 16 bytes from s + 4 * bpp.
+SIMD_TARGET_SSSE3
+static inline __m128i LoadChannel8_SSSE3(const unsigned char *s, int bpp, __m128i shuffle)
+{
+    __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)s), shuffle);
+    __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s + 4 * bpp)), shuffle);
+    return _mm_unpacklo_epi64(a, b);
+}
+
+// Pairs of 16-bit coefficients for _mm_madd_epi16 over (c0, c1) and (c2, 0).
+SIMD_TARGET_SSSE3
+static inline __m128i CoeffPair_SSSE3(int k0, int k1)
+{
+    return _mm_set1_epi32((int)(((unsigned)k1 << 16) | ((unsigned)k0 & 0xFFFF)));
+}
+
+// Weighted sum of three channels of 8 values, shifted and saturated to 16 bits.
+SIMD_TARGET_SSSE3
+static inline __m128i WeightedSum8_SSSE3(__m128i c0, __m128i c1, __m128i c2, __m128i k01, __m128i k2, __m128i offset, int shift)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(c0, c1), k01), _mm_madd_epi16(_mm_unpacklo_epi16(c2, zero), k2));
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(c0, c1), k01), _mm_madd_epi16(_mm_unpackhi_epi16(c2, zero), k2));
+    __m128i count = _mm_cvtsi32_si128(shift);
+    lo = _mm_sra_epi32(_mm_add_epi32(lo, offset), count);
+    hi = _mm_sra_epi32(_mm_add_epi32(hi, offset), count);
+    return _mm_packs_epi32(lo, hi);
+}
+
+SIMD_TARGET_SSSE3
+static void RowY_SSSE3(const unsigned char *pSrc, const RgbKernelParams &p, unsigned char *pDstY, int width)
+{
+    int bpp = p.bytesPerPixel;
+    const unsigned char *s = pSrc + p.firstByte;
+    __m128i m0 = _mm_loadu_si128((const __m128i *)p.aShuffle[0]);
+    __m128i m1 = _mm_loadu_si128((const __m128i *)p.aShuffle[1]);
+    __m128i m2 = _mm_loadu_si128((const __m128i *)p.aShuffle[2]);
+    __m128i k01 = CoeffPair_SSSE3(p.ky[0], p.ky[1]), k2 = CoeffPair_SSSE3(p.ky[2], 0);
+    __m128i offset = _mm_set1_epi32(p.yOffset);
+    int x = 0;
+    for (; (x + 4) * bpp + p.firstByte + 16 <= width * bpp; x += 8)
+    {
+        const unsigned char *px = s + x * bpp;
+        __m128i y = WeightedSum8_SSSE3(LoadChannel8_SSSE3(px, bpp, m0), LoadChannel8_SSSE3(px, bpp, m1),
+                                       LoadChannel8_SSSE3(px, bpp, m2), k01, k2, offset, RGB_COEFF_BITS);
+        _mm_storel_epi64((__m128i *)(pDstY + x), _mm_packus_epi16(y, y));
+    }
+    RowY_C(pSrc, p, pDstY, x, width);
+}
+
+// Stores 8 U and 8 V, interleaved for NV12 when uvStep is 2.
+SIMD_TARGET_SSSE3
+static inline void StoreUV8_SSSE3(__m128i u, __m128i v, unsigned char *pDstU, unsigned char *pDstV, int uvStep)
+{
+    __m128i uv = _mm_packus_epi16(u, v);
+    if (uvStep == 2)
+    {
+        _mm_storeu_si128((__m128i *)pDstU, _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 8)));
+    }
+    else
+    {
+        _mm_storel_epi64((__m128i *)pDstU, uv);
+        _mm_storel_epi64((__m128i *)pDstV, _mm_srli_si128(uv, 8));
+    }
+}
+
+SIMD_TARGET_SSSE3
+static void RowUV_SSSE3(const unsigned char *pSrc0, const unsigned char *pSrc1, const RgbKernelParams &p,
+                        unsigned char *pDstU, unsigned char *pDstV, int uvStep, int width)
+{
+    int bpp = p.bytesPerPixel;
+    const unsigned char *s0 = pSrc0 + p.firstByte, *s1 = pSrc1 + p.firstByte;
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i ku01 = CoeffPair_SSSE3(p.ku[0], p.ku[1]), ku2 = CoeffPair_SSSE3(p.ku[2], 0);
+    __m128i kv01 = CoeffPair_SSSE3(p.kv[0], p.kv[1]), kv2 = CoeffPair_SSSE3(p.kv[2], 0);
+    __m128i offset = _mm_set1_epi32(p.uvOffset);
+    int cx = 0;
+    for (; (2 * cx + 12) * bpp + p.firstByte + 16 <= width * bpp; cx += 8)
+    {
+        // Sums of the 2x2 blocks of 16 pixels, one channel at a time.
+        __m128i aSum[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m128i shuffle = _mm_loadu_si128((const __m128i *)p.aShuffle[k]);
+            const unsigned char *a = s0 + 2 * cx * bpp, *b = s1 + 2 * cx * bpp;
+            __m128i lo = _mm_add_epi16(LoadChannel8_SSSE3(a, bpp, shuffle), LoadChannel8_SSSE3(b, bpp, shuffle));
+            __m128i hi = _mm_add_epi16(LoadChannel8_SSSE3(a + 8 * bpp, bpp, shuffle), LoadChannel8_SSSE3(b + 8 * bpp, bpp, shuffle));
+            aSum[k] = _mm_packs_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones));
+        }
+        __m128i u = WeightedSum8_SSSE3(aSum[0], aSum[1], aSum[2], ku01, ku2, offset, RGB_CHROMA_BITS);
+        __m128i v = WeightedSum8_SSSE3(aSum[0], aSum[1], aSum[2], kv01, kv2, offset, RGB_CHROMA_BITS);
+        StoreUV8_SSSE3(u, v, pDstU + cx * uvStep, pDstV + cx * uvStep, uvStep);
+    }
+    RowUV_C(pSrc0, pSrc1, p, pDstU, pDstV, uvStep, cx, width);
+}
+
+SIMD_TARGET_SSSE3
+static void RowUV444_SSSE3(const unsigned char *pSrc, const RgbKernelParams &p,
+                           unsigned char *pDstU, unsigned char *pDstV, int width)
+{
+    int bpp = p.bytesPerPixel;
+    const unsigned char *s = pSrc + p.firstByte;
+    __m128i m0 = _mm_loadu_si128((const __m128i *)p.aShuffle[0]);
+    __m128i m1 = _mm_loadu_si128((const __m128i *)p.aShuffle[1]);
+    __m128i m2 = _mm_loadu_si128((const __m128i *)p.aShuffle[2]);
+    __m128i ku01 = CoeffPair_SSSE3(p.ku[0], p.ku[1]), ku2 = CoeffPair_SSSE3(p.ku[2], 0);
+    __m128i kv01 = CoeffPair_SSSE3(p.kv[0], p.kv[1]), kv2 = CoeffPair_SSSE3(p.kv[2], 0);
+    __m128i offset = _mm_set1_epi32(p.uvOffset);
+    int x = 0;
+    for (; (x + 4) * bpp + p.firstByte + 16 <= width * bpp; x += 8)
+    {
+        const unsigned char *px = s + x * bpp;
+        __m128i c0 = _mm_slli_epi16(LoadChannel8_SSSE3(px, bpp, m0), 2);
+        __m128i c1 = _mm_slli_epi16(LoadChannel8_SSSE3(px, bpp, m1), 2);
+        __m128i c2 = _mm_slli_epi16(LoadChannel8_SSSE3(px, bpp, m2), 2);
+        __m128i u = WeightedSum8_SSSE3(c0, c1, c2, ku01, ku2, offset, RGB_CHROMA_BITS);
+        __m128i v = WeightedSum8_SSSE3(c0, c1, c2, kv01, kv2, offset, RGB_CHROMA_BITS);
+        StoreUV8_SSSE3(u, v, pDstU + x, pDstV + x, 1);
+    }
+    RowUV444_C(pSrc, p, pDstU, pDstV, x, width);
+}
+
+// Byte k of 16 pixels, in 16-bit lanes and in order. Reads 16 bytes from
+// s + 12 * bpp.
+SIMD_TARGET_AVX2
+static inline __m256i LoadChannel16_AVX2(const unsigned char *s, int bpp, __m256i shuffle)
+{
+    __m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)s)),
+                                        _mm_loadu_si128((const __m128i *)(s + 4 * bpp)), 1);
+    __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(s + 8 * bpp))),
+                                        _mm_loadu_si128((const __m128i *)(s + 12 * bpp)), 1);
+    // The shuffle works per 128-bit lane, so the quarters come out as pixels
+    // 0-3, 8-11, 4-7 and 12-15; the permute puts them back in order.
+    __m256i v = _mm256_unpacklo_epi64(_mm256_shuffle_epi8(a, shuffle), _mm256_shuffle_epi8(b, shuffle));
+    return _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+SIMD_TARGET_AVX2
+static inline __m256i CoeffPair_AVX2(int k0, int k1)
+{
+    return _mm256_set1_epi32((int)(((unsigned)k1 << 16) | ((unsigned)k0 & 0xFFFF)));
+}
+
+// Same as WeightedSum8_SSSE3 for 16 values; the unpacks and the pack work
+// per lane, so the values stay in order.
+SIMD_TARGET_AVX2
+static inline __m256i WeightedSum16_AVX2(__m256i c0, __m256i c1, __m256i c2, __m256i k01, __m256i k2, __m256i offset, int shift)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(c0, c1), k01), _mm256_madd_epi16(_mm256_unpacklo_epi16(c2, zero), k2));
+    __m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(c0, c1), k01), _mm256_madd_epi16(_mm256_unpackhi_epi16(c2, zero), k2));
+    __m128i count = _mm_cvtsi32_si128(shift);
+    lo = _mm256_sra_epi32(_mm256_add_epi32(lo, offset), count);
+    hi = _mm256_sra_epi32(_mm256_add_epi32(hi, offset), count);
+    return _mm256_packs_epi32(lo, hi);
+}
+
+SIMD_TARGET_AVX2
+static inline __m256i LoadShuffle_AVX2(const unsigned char *pShuffle)
+{
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)pShuffle));
+}
+
+SIMD_TARGET_AVX2
+static void RowY_AVX2(const unsigned char *pSrc, const RgbKernelParams &p, unsigned char *pDstY, int width)
+{
+    int bpp = p.bytesPerPixel;
+    const unsigned char *s = pSrc + p.firstByte;
+    __m256i m0 = LoadShuffle_AVX2(p.aShuffle[0]), m1 = LoadShuffle_AVX2(p.aShuffle[1]), m2 = LoadShuffle_AVX2(p.aShuffle[2]);
+    __m256i k01 = CoeffPair_AVX2(p.ky[0], p.ky[1]), k2 = CoeffPair_AVX2(p.ky[2], 0);
+    __m256i offset = _mm256_set1_epi32(p.yOffset);
+    int x = 0;
+    for (; (x + 12) * bpp + p.firstByte + 16 <= width * bpp; x += 16)
+    {
+        const unsigned char *px = s + x * bpp;
+        __m256i y = WeightedSum16_AVX2(LoadChannel16_AVX2(px, bpp, m0), LoadChannel16_AVX2(px, bpp, m1),
+                                       LoadChannel16_AVX2(px, bpp, m2), k01, k2, offset, RGB_COEFF_BITS);
+        y = _mm256_permute4x64_epi64(_mm256_packus_epi16(y, y), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *)(pDstY + x), _mm256_castsi256_si128(y));
+    }
+    RowY_C(pSrc, p, pDstY, x, width);
+}
+
+// Stores 16 U and 16 V, interleaved for NV12 when uvStep is 2.
+SIMD_TARGET_AVX2
+static inline void StoreUV16_AVX2(__m256i u, __m256i v, unsigned char *pDstU, unsigned char *pDstV, int uvStep)
+{
+    // Per lane: 8 U then 8 V.
+    __m256i uv = _mm256_packus_epi16(u, v);
+    if (uvStep == 2)
+    {
+        __m256i interleave = _mm256_setr_epi8(0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15,
+                                              0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15);
+        _mm256_storeu_si256((__m256i *)pDstU, _mm256_shuffle_epi8(uv, interleave));
+    }
+    else
+    {
+        uv = _mm256_permute4x64_epi64(uv, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *)pDstU, _mm256_castsi256_si128(uv));
+        _mm_storeu_si128((__m128i *)pDstV, _mm256_extracti128_si256(uv, 1));
+    }
+}
+
+SIMD_TARGET_AVX2
+static void RowUV_AVX2(const unsigned char *pSrc0, const unsigned char *pSrc1, const RgbKernelParams &p,
+                       unsigned char *pDstU, unsigned char *pDstV, int uvStep, int width)
+{
+    int bpp = p.bytesPerPixel;
+    const unsigned char *s0 = pSrc0 + p.firstByte, *s1 = pSrc1 + p.firstByte;
+    __m256i ones = _mm256_set1_epi16(1);
+    __m256i ku01 = CoeffPair_AVX2(p.ku[0], p.ku[1]), ku2 = CoeffPair_AVX2(p.ku[2], 0);
+    __m256i kv01 = CoeffPair_AVX2(p.kv[0], p.kv[1]), kv2 = CoeffPair_AVX2(p.kv[2], 0);
+    __m256i offset = _mm256_set1_epi32(p.uvOffset);
+    int cx = 0;
+    for (; (2 * cx + 28) * bpp + p.firstByte + 16 <= width * bpp; cx += 16)
+    {
+        __m256i aSum[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m256i shuffle = LoadShuffle_AVX2(p.aShuffle[k]);
+            const unsigned char *a = s0 + 2 * cx * bpp, *b = s1 + 2 * cx * bpp;
+            __m256i lo = _mm256_add_epi16(LoadChannel16_AVX2(a, bpp, shuffle), LoadChannel16_AVX2(b, bpp, shuffle));
+            __m256i hi = _mm256_add_epi16(LoadChannel16_AVX2(a + 16 * bpp, bpp, shuffle), LoadChannel16_AVX2(b + 16 * bpp, bpp, shuffle));
+            // The pack interleaves the lanes: quarters 0, 2, 1, 3.
+            __m256i sum = _mm256_packs_epi32(_mm256_madd_epi16(lo, ones), _mm256_madd_epi16(hi, ones));
+            aSum[k] = _mm256_permute4x64_epi64(sum, _MM_SHUFFLE(3, 1, 2, 0));
+        }
+        __m256i u = WeightedSum16_AVX2(aSum[0], aSum[1], aSum[2], ku01, ku2, offset, RGB_CHROMA_BITS);
+        __m256i v = WeightedSum16_AVX2(aSum[0], aSum[1], aSum[2], kv01, kv2, offset, RGB_CHROMA_BITS);
+        StoreUV16_AVX2(u, v, pDstU + cx * uvStep, pDstV + cx * uvStep, uvStep);
+    }
+    RowUV_C(pSrc0, pSrc1, p, pDstU, pDstV, uvStep, cx, width);
+}
+
+SIMD_TARGET_AVX2
+static void RowUV444_AVX2(const unsigned char *pSrc, const RgbKernelParams &p,
+                          unsigned char *pDstU, unsigned char *pDstV, int width)
+{
+    int bpp = p.bytesPerPixel;
+    const unsigned char *s = pSrc + p.firstByte;
+    __m256i m0 = LoadShuffle_AVX2(p.aShuffle[0]), m1 = LoadShuffle_AVX2(p.aShuffle[1]), m2 = LoadShuffle_AVX2(p.aShuffle[2]);
+    __m256i ku01 = CoeffPair_AVX2(p.ku[0], p.ku[1]), ku2 = CoeffPair_AVX2(p.ku[2], 0);
+    __m256i kv01 = CoeffPair_AVX2(p.kv[0], p.kv[1]), kv2 = CoeffPair_AVX2(p.kv[2], 0);
+    __m256i offset = _mm256_set1_epi32(p.uvOffset);
+    int x = 0;
+    for (; (x + 12) * bpp + p.firstByte + 16 <= width * bpp; x += 16)
+    {
+        const unsigned char *px = s + x * bpp;
+        __m256i c0 = _mm256_slli_epi16(LoadChannel16_AVX2(px, bpp, m0), 2);
+        __m256i c1 = _mm256_slli_epi16(LoadChannel16_AVX2(px, bpp, m1), 2);
+        __m256i c2 = _mm256_slli_epi16(LoadChannel16_AVX2(px, bpp, m2), 2);
+        __m256i u = WeightedSum16_AVX2(c0, c1, c2, ku01, ku2, offset, RGB_CHROMA_BITS);
+        __m256i v = WeightedSum16_AVX2(c0, c1, c2, kv01, kv2, offset, RGB_CHROMA_BITS);
+        StoreUV16_AVX2(u, v, pDstU + x, pDstV + x, 1);
+    }
+    RowUV444_C(pSrc, p, pDstU, pDstV, x, width);
+}
+#endif
+
+#if defined(SIMD_ARCH_NEON)
+// The three colour bytes of 16 pixels, deinterleaved by the load.
+static inline void LoadChannels16_NEON(const unsigned char *s, const RgbKernelParams &p, uint8x16_t *pc)
+{
+    if (p.bytesPerPixel == 4)
+    {
+        uint8x16x4_t v = vld4q_u8(s);
+        uint8x16_t a[4] = { v.val[0], v.val[1], v.val[2], v.val[3] };
+        pc[0] = a[p.firstByte];
+        pc[1] = a[p.firstByte + 1];
+        pc[2] = a[p.firstByte + 2];
+    }
+    else
+    {
+        uint8x16x3_t v = vld3q_u8(s);
+        pc[0] = v.val[0];
+        pc[1] = v.val[1];
+        pc[2] = v.val[2];
+    }
+}
+
+// Weighted sum of three channels of 8 values, shifted and saturated to 16 bits.
+static inline int16x8_t WeightedSum8_NEON(uint16x8_t c0, uint16x8_t c1, uint16x8_t c2, const int *k, int offset, bool bChroma)
+{
+    int16x8_t s0 = vreinterpretq_s16_u16(c0), s1 = vreinterpretq_s16_u16(c1), s2 = vreinterpretq_s16_u16(c2);
+    int32x4_t lo = vdupq_n_s32(offset), hi = vdupq_n_s32(offset);
+    lo = vmlal_n_s16(lo, vget_low_s16(s0), (int16_t)k[0]);
+    lo = vmlal_n_s16(lo, vget_low_s16(s1), (int16_t)k[1]);
+    lo = vmlal_n_s16(lo, vget_low_s16(s2), (int16_t)k[2]);
+    hi = vmlal_n_s16(hi, vget_high_s16(s0), (int16_t)k[0]);
+    hi = vmlal_n_s16(hi, vget_high_s16(s1), (int16_t)k[1]);
+    hi = vmlal_n_s16(hi, vget_high_s16(s2), (int16_t)k[2]);
+    if (bChroma)
+    {
+        return vcombine_s16(vqmovn_s32(vshrq_n_s32(lo, RGB_CHROMA_BITS)), vqmovn_s32(vshrq_n_s32(hi, RGB_CHROMA_BITS)));
+    }
+    return vcombine_s16(vqmovn_s32(vshrq_n_s32(lo, RGB_COEFF_BITS)), vqmovn_s32(vshrq_n_s32(hi, RGB_COEFF_BITS)));
+}
+
+static void RowY_NEON(const unsigned char *pSrc, const RgbKernelParams &p, unsigned char *pDstY, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16_t c[3];
+        LoadChannels16_NEON(pSrc + x * p.bytesPerPixel, p, c);
+        uint8x8_t lo = vqmovun_s16(WeightedSum8_NEON(vmovl_u8(vget_low_u8(c[0])), vmovl_u8(vget_low_u8(c[1])),
+                                                     vmovl_u8(vget_low_u8(c[2])), p.ky, p.yOffset, false));
+        uint8x8_t hi = vqmovun_s16(WeightedSum8_NEON(vmovl_u8(vget_high_u8(c[0])), vmovl_u8(vget_high_u8(c[1])),
+                                                     vmovl_u8(vget_high_u8(c[2])), p.ky, p.yOffset, false));
+        vst1q_u8(pDstY + x, vcombine_u8(lo, hi));
+    }
+    RowY_C(pSrc, p, pDstY, x, width);
+}
+
+static inline void StoreUV8_NEON(uint8x8_t u, uint8x8_t v, unsigned char *pDstU, unsigned char *pDstV, int uvStep)
+{
+    if (uvStep == 2)
+    {
+        uint8x8x2_t uv;
+        uv.val[0] = u;
+        uv.val[1] = v;
+        vst2_u8(pDstU, uv);
+    }
+    else
+    {
+        vst1_u8(pDstU, u);
+        vst1_u8(pDstV, v);
+    }
+}
+
+static void RowUV_NEON(const unsigned char *pSrc0, const unsigned char *pSrc1, const RgbKernelParams &p,
+                       unsigned char *pDstU, unsigned char *pDstV, int uvStep, int width)
+{
+    int cx = 0;
+    for (; 2 * cx + 16 <= width; cx += 8)
+    {
+        uint8x16_t a[3], b[3];
+        LoadChannels16_NEON(pSrc0 + 2 * cx * p.bytesPerPixel, p, a);
+        LoadChannels16_NEON(pSrc1 + 2 * cx * p.bytesPerPixel, p, b);
+        uint16x8_t s0 = vpadalq_u8(vpaddlq_u8(a[0]), b[0]);
+        uint16x8_t s1 = vpadalq_u8(vpaddlq_u8(a[1]), b[1]);
+        uint16x8_t s2 = vpadalq_u8(vpaddlq_u8(a[2]), b[2]);
+        uint8x8_t u = vqmovun_s16(WeightedSum8_NEON(s0, s1, s2, p.ku, p.uvOffset, true));
+        uint8x8_t v = vqmovun_s16(WeightedSum8_NEON(s0, s1, s2, p.kv, p.uvOffset, true));
+        StoreUV8_NEON(u, v, pDstU + cx * uvStep, pDstV + cx * uvStep, uvStep);
+    }
+    RowUV_C(pSrc0, pSrc1, p, pDstU, pDstV, uvStep, cx, width);
+}
+
+static void RowUV444_NEON(const unsigned char *pSrc, const RgbKernelParams &p,
+                          unsigned char *pDstU, unsigned char *pDstV, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16_t c[3];
+        LoadChannels16_NEON(pSrc + x * p.bytesPerPixel, p, c);
+        for (int h = 0; h < 2; h++)
+        {
+            uint16x8_t s0 = vshll_n_u8(h ? vget_high_u8(c[0]) : vget_low_u8(c[0]), 2);
+            uint16x8_t s1 = vshll_n_u8(h ? vget_high_u8(c[1]) : vget_low_u8(c[1]), 2);
+            uint16x8_t s2 = vshll_n_u8(h ? vget_high_u8(c[2]) : vget_low_u8(c[2]), 2);
+            uint8x8_t u = vqmovun_s16(WeightedSum8_NEON(s0, s1, s2, p.ku, p.uvOffset, true));
+            uint8x8_t v = vqmovun_s16(WeightedSum8_NEON(s0, s1, s2, p.kv, p.uvOffset, true));
+            StoreUV8_NEON(u, v, pDstU + x + 8 * h, pDstV + x + 8 * h, 1);
+        }
+    }
+    RowUV444_C(pSrc, p, pDstU, pDstV, x, width);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+// Frame loops and dispatchers
+
+namespace
+{
+struct RowKernels
+{
+    void (*pfnRowY)(const unsigned char *pSrc, const RgbKernelParams &p, unsigned char *pDstY, int width);
+    void (*pfnRowUV)(const unsigned char *pSrc0, const unsigned char *pSrc1, const RgbKernelParams &p,
+                     unsigned char *pDstU, unsigned char *pDstV, int uvStep, int width);
+    void (*pfnRowUV444)(const unsigned char *pSrc, const RgbKernelParams &p,
+                        unsigned char *pDstU, unsigned char *pDstV, int width);
+};
+
+struct RgbFrame
+{
+    const unsigned char    *pSrc;
+    int                     srcStride;
+    unsigned char          *pDstY;
+    unsigned char          *pDstU;
+    unsigned char          *pDstV;
+    int                     dstStrideY;
+    int                     dstStrideUV;
+    int                     uvStep;         // 2 when U and V are interleaved
+    bool                    bYuv444;
+    int                     width;
+    int                     height;
+};
+
+const RowKernels s_kernelsC = { RowYFrom0_C, RowUVFrom0_C, RowUV444From0_C };
+#if defined(SIMD_ARCH_X86)
+const RowKernels s_kernelsSSSE3 = { RowY_SSSE3, RowUV_SSSE3, RowUV444_SSSE3 };
+const RowKernels s_kernelsAVX2 = { RowY_AVX2, RowUV_AVX2, RowUV444_AVX2 };
+#endif
+#if defined(SIMD_ARCH_NEON)
+const RowKernels s_kernelsNEON = { RowY_NEON, RowUV_NEON, RowUV444_NEON };
+#endif
+
+const RowKernels &GetRowKernels()
+{
+    switch (RgbGetSimdLevel())
+    {
+#if defined(SIMD_ARCH_X86)
+    case SIMD_LEVEL_AVX2:
+        return s_kernelsAVX2;
+    case SIMD_LEVEL_SSE41:
+    case SIMD_LEVEL_SSSE3:
+        return s_kernelsSSSE3;
+#endif
+#if defined(SIMD_ARCH_NEON)
+    case SIMD_LEVEL_NEON:
+        return s_kernelsNEON;
+#endif
+    default:
+        return s_kernelsC;
+    }
+}
+
+void ConvertFrame(const RgbFrame &frame, RgbFormat eFormat, YuvMatrix eMatrix, YuvRange eRange, const RowKernels &kernels)
+{
+    RgbKernelParams params;
+    GetKernelParams(eFormat, eMatrix, eRange, &params);
+    for (int y = 0; y < frame.height; y++)
+    {
+        const unsigned char *pRow = frame.pSrc + (size_t)frame.srcStride * y;
+        kernels.pfnRowY(pRow, params, frame.pDstY + (size_t)frame.dstStrideY * y, frame.width);
+        if (frame.bYuv444)
+        {
+            kernels.pfnRowUV444(pRow, params, frame.pDstU + (size_t)frame.dstStrideUV * y,
+                frame.pDstV + (size_t)frame.dstStrideUV * y, frame.width);
+        }
+        else if ((y & 1) == 0)
+        {
+            // Chroma is written with the first row of each pair, while both
+            // rows are still in the cache from the luma of this one.
+            const unsigned char *pNextRow = y + 1 < frame.height ? pRow + frame.srcStride : pRow;
+            size_t offset = (size_t)frame.dstStrideUV * (y / 2);
+            kernels.pfnRowUV(pRow, pNextRow, params, frame.pDstU + offset, frame.pDstV + offset, frame.uvStep, frame.width);
+        }
+    }
+}
+
+void MakeNV12Frame(const unsigned char *pSrc, int srcStride, unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+                   int width, int height, RgbFrame *pFrame)
+{
+    pFrame->pSrc = pSrc;
+    pFrame->srcStride = srcStride;
+    pFrame->pDstY = pDstY;
+    pFrame->pDstU = pDstUV;
+    pFrame->pDstV = pDstUV + 1;
+    pFrame->dstStrideY = pFrame->dstStrideUV = dstStride;
+    pFrame->uvStep = 2;
+    pFrame->bYuv444 = false;
+    pFrame->width = width;
+    pFrame->height = height;
+}
+
+void MakePlanarFrame(const unsigned char *pSrc, int srcStride,
+                     unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStrideY, int dstStrideUV,
+                     int width, int height, bool bYuv444, RgbFrame *pFrame)
+{
+    pFrame->pSrc = pSrc;
+    pFrame->srcStride = srcStride;
+    pFrame->pDstY = pDstY;
+    pFrame->pDstU = pDstU;
+    pFrame->pDstV = pDstV;
+    pFrame->dstStrideY = dstStrideY;
+    pFrame->dstStrideUV = dstStrideUV;
+    pFrame->uvStep = 1;
+    pFrame->bYuv444 = bYuv444;
+    pFrame->width = width;
+    pFrame->height = height;
+}
+}
+
+void RgbToNV12_C(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+                 unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+                 int width, int height, YuvMatrix eMatrix, YuvRange eRange)
+{
+    RgbFrame frame;
+    MakeNV12Frame(pSrc, srcStride, pDstY, pDstUV, dstStride, width, height, &frame);
+    ConvertFrame(frame, eFormat, eMatrix, eRange, s_kernelsC);
+}
+
+void RgbToI420_C(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+                 unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStrideY, int dstStrideUV,
+                 int width, int height, YuvMatrix eMatrix, YuvRange eRange)
+{
+    RgbFrame frame;
+    MakePlanarFrame(pSrc, srcStride, pDstY, pDstU, pDstV, dstStrideY, dstStrideUV, width, height, false, &frame);
+    ConvertFrame(frame, eFormat, eMatrix, eRange, s_kernelsC);
+}
+
+void RgbToYUV444_C(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+                   unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStride,
+                   int width, int height, YuvMatrix eMatrix, YuvRange eRange)
+{
+    RgbFrame frame;
+    MakePlanarFrame(pSrc, srcStride, pDstY, pDstU, pDstV, dstStride, dstStride, width, height, true, &frame);
+    ConvertFrame(frame, eFormat, eMatrix, eRange, s_kernelsC);
+}
+
+void RgbToNV12(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+               unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+               int width, int height, YuvMatrix eMatrix, YuvRange eRange)
+{
+    RgbFrame frame;
+    MakeNV12Frame(pSrc, srcStride, pDstY, pDstUV, dstStride, width, height, &frame);
+    ConvertFrame(frame, eFormat, eMatrix, eRange, GetRowKernels());
+}
+
+void RgbToI420(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+               unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStrideY, int dstStrideUV,
+               int width, int height, YuvMatrix eMatrix, YuvRange eRange)
+{
+    RgbFrame frame;
+    MakePlanarFrame(pSrc, srcStride, pDstY, pDstU, pDstV, dstStrideY, dstStrideUV, width, height, false, &frame);
+    ConvertFrame(frame, eFormat, eMatrix, eRange, GetRowKernels());
+}
+
+void RgbToYUV444(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+                 unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStride,
+                 int width, int height, YuvMatrix eMatrix, YuvRange eRange)
+{
+    RgbFrame frame;
+    MakePlanarFrame(pSrc, srcStride, pDstY, pDstU, pDstV, dstStride, dstStride, width, height, true, &frame);
+    ConvertFrame(frame, eFormat, eMatrix, eRange, GetRowKernels());
+}
+
+////////////////////////////////////////////////////////////////////////////
+// YUV to BGR rows
+
+// Fractional bits of the YUV to RGB coefficients; the largest, blue from U
+// in limited range, is 2.11 and has to fit in 16 bits.
+#define YUV_COEFF_BITS  13
+
+struct YuvKernelParams
+{
+    int     yOffset;
+    int     ky;
+    int     kvr;        // red from V
+    int     kug;        // green from U
+    int     kvg;        // green from V
+    int     kub;        // blue from U
+};
+
+void YuvToRgbReference(double y, double u, double v, YuvMatrix eMatrix, YuvRange eRange,
+                       double *pR, double *pG, double *pB)
+{
+    double kr, kb;
+    GetLumaWeights(eMatrix, &kr, &kb);
+    bool bLimited = eRange == YUV_RANGE_LIMITED;
+    double yScale = bLimited ? 219.0 / 255.0 : 1.0, cScale = bLimited ? 224.0 / 255.0 : 1.0;
+    double luma = (y - (bLimited ? 16.0 : 0.0)) / yScale;
+    *pB = luma + (u - 128.0) / cScale * 2.0 * (1.0 - kb);
+    *pR = luma + (v - 128.0) / cScale * 2.0 * (1.0 - kr);
+    *pG = (luma - kr * *pR - kb * *pB) / (1.0 - kr - kb);
+}
+
+static int RoundYuvCoeff(double k)
+{
+    return (int)(k * (1 << YUV_COEFF_BITS) + (k < 0 ? -0.5 : 0.5));
+}
+
+static void GetYuvKernelParams(YuvMatrix eMatrix, YuvRange eRange, YuvKernelParams *pParams)
+{
+    double kr, kb;
+    GetLumaWeights(eMatrix, &kr, &kb);
+    double kg = 1.0 - kr - kb;
+    bool bLimited = eRange == YUV_RANGE_LIMITED;
+    double yScale = bLimited ? 219.0 / 255.0 : 1.0, cScale = bLimited ? 224.0 / 255.0 : 1.0;
+    pParams->yOffset = bLimited ? 16 : 0;
+    pParams->ky = RoundYuvCoeff(1.0 / yScale);
+    pParams->kvr = RoundYuvCoeff(2.0 * (1.0 - kr) / cScale);
+    pParams->kug = RoundYuvCoeff(-2.0 * (1.0 - kb) * kb / (kg * cScale));
+    pParams->kvg = RoundYuvCoeff(-2.0 * (1.0 - kr) * kr / (kg * cScale));
+    pParams->kub = RoundYuvCoeff(2.0 * (1.0 - kb) / cScale);
+}
+
+// Pixels x to width of a row.
+static void YuvRowToBGRFrom_C(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, YuvLayout eLayout,
+                              const YuvKernelParams &p, unsigned char *pDst, int x, int width)
+{
+    for (; x < width; x++)
+    {
+        int u, v;
+        if (eLayout == YUV_LAYOUT_I420)
+        {
+            u = pU[x / 2];
+            v = pV[x / 2];
+        }
+        else if (eLayout == YUV_LAYOUT_NV12)
+        {
+            u = pU[x & ~1];
+            v = pU[(x & ~1) + 1];
+        }
+        else
+        {
+            u = pU[x];
+            v = pV[x];
+        }
+        int y = p.ky * (pY[x] - p.yOffset) + (1 << (YUV_COEFF_BITS - 1));
+        u -= 128;
+        v -= 128;
+        pDst[3 * x] = (unsigned char)ClampByte((y + p.kub * u) >> YUV_COEFF_BITS);
+        pDst[3 * x + 1] = (unsigned char)ClampByte((y + p.kug * u + p.kvg * v) >> YUV_COEFF_BITS);
+        pDst[3 * x + 2] = (unsigned char)ClampByte((y + p.kvr * v) >> YUV_COEFF_BITS);
+    }
+}
+
+#if defined(SIMD_ARCH_X86)
+// Where each byte of the three 16-byte blocks of 16 BGR pixels comes from,
+// for the B, G and R vectors in turn.
+static const unsigned char s_aBgrShuffle[3][3][16] =
+{
+    {
+        { 0, 0x80, 0x80, 1, 0x80, 0x80, 2, 0x80, 0x80, 3, 0x80, 0x80, 4, 0x80, 0x80, 5 },
+        { 0x80, 0, 0x80, 0x80, 1, 0x80, 0x80, 2, 0x80, 0x80, 3, 0x80, 0x80, 4, 0x80, 0x80 },
+        { 0x80, 0x80, 0, 0x80, 0x80, 1, 0x80, 0x80, 2, 0x80, 0x80, 3, 0x80, 0x80, 4, 0x80 },
+    },
+    {
+        { 0x80, 0x80, 6, 0x80, 0x80, 7, 0x80, 0x80, 8, 0x80, 0x80, 9, 0x80, 0x80, 10, 0x80 },
+        { 5, 0x80, 0x80, 6, 0x80, 0x80, 7, 0x80, 0x80, 8, 0x80, 0x80, 9, 0x80, 0x80, 10 },
+        { 0x80, 5, 0x80, 0x80, 6, 0x80, 0x80, 7, 0x80, 0x80, 8, 0x80, 0x80, 9, 0x80, 0x80 },
+    },
+    {
+        { 0x80, 11, 0x80, 0x80, 12, 0x80, 0x80, 13, 0x80, 0x80, 14, 0x80, 0x80, 15, 0x80, 0x80 },
+        { 0x80, 0x80, 11, 0x80, 0x80, 12, 0x80, 0x80, 13, 0x80, 0x80, 14, 0x80, 0x80, 15, 0x80 },
+        { 10, 0x80, 0x80, 11, 0x80, 0x80, 12, 0x80, 0x80, 13, 0x80, 0x80, 14, 0x80, 0x80, 15 },
+    },
+};
+
+SIMD_TARGET_SSSE3
+static inline void StoreBGR16_SSSE3(__m128i b, __m128i g, __m128i r, unsigned char *pDst)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        __m128i out = _mm_or_si128(_mm_shuffle_epi8(b, _mm_loadu_si128((const __m128i *)s_aBgrShuffle[i][0])),
+                      _mm_or_si128(_mm_shuffle_epi8(g, _mm_loadu_si128((const __m128i *)s_aBgrShuffle[i][1])),
+                                   _mm_shuffle_epi8(r, _mm_loadu_si128((const __m128i *)s_aBgrShuffle[i][2]))));
+        _mm_storeu_si128((__m128i *)(pDst + 16 * i), out);
+    }
+}
+
+// Coefficient pairs for _mm_madd_epi16 over (y, u), (y, v) and (v, 0).
+struct YuvCoeffs_SSSE3
+{
+    __m128i yu_b;
+    __m128i yv_r;
+    __m128i yu_g;
+    __m128i v0_g;
+    __m128i round;
+};
+
+// B, G and R of 8 pixels from luma and chroma with their offsets removed, in
+// 16-bit lanes.
+SIMD_TARGET_SSSE3
+static inline void YuvToBGR8_SSSE3(__m128i y, __m128i u, __m128i v, const YuvCoeffs_SSSE3 &k,
+                                   __m128i *pB, __m128i *pG, __m128i *pR)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i yuLo = _mm_unpacklo_epi16(y, u), yuHi = _mm_unpackhi_epi16(y, u);
+    __m128i yvLo = _mm_unpacklo_epi16(y, v), yvHi = _mm_unpackhi_epi16(y, v);
+    __m128i v0Lo = _mm_unpacklo_epi16(v, zero), v0Hi = _mm_unpackhi_epi16(v, zero);
+    *pB = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yuLo, k.yu_b), k.round), YUV_COEFF_BITS),
+                          _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yuHi, k.yu_b), k.round), YUV_COEFF_BITS));
+    *pR = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yvLo, k.yv_r), k.round), YUV_COEFF_BITS),
+                          _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yvHi, k.yv_r), k.round), YUV_COEFF_BITS));
+    __m128i gLo = _mm_add_epi32(_mm_madd_epi16(yuLo, k.yu_g), _mm_madd_epi16(v0Lo, k.v0_g));
+    __m128i gHi = _mm_add_epi32(_mm_madd_epi16(yuHi, k.yu_g), _mm_madd_epi16(v0Hi, k.v0_g));
+    *pG = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(gLo, k.round), YUV_COEFF_BITS),
+                          _mm_srai_epi32(_mm_add_epi32(gHi, k.round), YUV_COEFF_BITS));
+}
+
+SIMD_TARGET_SSSE3
+static void YuvRowToBGR_SSSE3(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, YuvLayout eLayout,
+                              const YuvKernelParams &p, unsigned char *pDst, int width)
+{
+    YuvCoeffs_SSSE3 k;
+    k.yu_b = CoeffPair_SSSE3(p.ky, p.kub);
+    k.yv_r = CoeffPair_SSSE3(p.ky, p.kvr);
+    k.yu_g = CoeffPair_SSSE3(p.ky, p.kug);
+    k.v0_g = CoeffPair_SSSE3(p.kvg, 0);
+    k.round = _mm_set1_epi32(1 << (YUV_COEFF_BITS - 1));
+    __m128i zero = _mm_setzero_si128();
+    __m128i yOffset = _mm_set1_epi16((short)p.yOffset), uvOffset = _mm_set1_epi16(128);
+    __m128i evenBytes = _mm_setr_epi8(0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14);
+    __m128i oddBytes = _mm_setr_epi8(1, 1, 3, 3, 5, 5, 7, 7, 9, 9, 11, 11, 13, 13, 15, 15);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        // One U and one V per pixel.
+        __m128i u, v;
+        if (eLayout == YUV_LAYOUT_I420)
+        {
+            u = _mm_loadl_epi64((const __m128i *)(pU + x / 2));
+            v = _mm_loadl_epi64((const __m128i *)(pV + x / 2));
+            u = _mm_unpacklo_epi8(u, u);
+            v = _mm_unpacklo_epi8(v, v);
+        }
+        else if (eLayout == YUV_LAYOUT_NV12)
+        {
+            __m128i uv = _mm_loadu_si128((const __m128i *)(pU + x));
+            u = _mm_shuffle_epi8(uv, evenBytes);
+            v = _mm_shuffle_epi8(uv, oddBytes);
+        }
+        else
+        {
+            u = _mm_loadu_si128((const __m128i *)(pU + x));
+            v = _mm_loadu_si128((const __m128i *)(pV + x));
+        }
+        __m128i y = _mm_loadu_si128((const __m128i *)(pY + x));
+
+        __m128i bLo, gLo, rLo, bHi, gHi, rHi;
+        YuvToBGR8_SSSE3(_mm_sub_epi16(_mm_unpacklo_epi8(y, zero), yOffset), _mm_sub_epi16(_mm_unpacklo_epi8(u, zero), uvOffset),
+                        _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), uvOffset), k, &bLo, &gLo, &rLo);
+        YuvToBGR8_SSSE3(_mm_sub_epi16(_mm_unpackhi_epi8(y, zero), yOffset), _mm_sub_epi16(_mm_unpackhi_epi8(u, zero), uvOffset),
+                        _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), uvOffset), k, &bHi, &gHi, &rHi);
+        StoreBGR16_SSSE3(_mm_packus_epi16(bLo, bHi), _mm_packus_epi16(gLo, gHi), _mm_packus_epi16(rLo, rHi), pDst + 3 * x);
+    }
+    YuvRowToBGRFrom_C(pY, pU, pV, eLayout, p, pDst, x, width);
+}
+
+struct YuvCoeffs_AVX2
+{
+    __m256i yu_b;
+    __m256i yv_r;
+    __m256i yu_g;
+    __m256i v0_g;
+    __m256i round;
+};
+
+// Same as YuvToBGR8_SSSE3 for 16 pixels; the unpacks and packs work per
+// lane, so the pixels stay in order.
+SIMD_TARGET_AVX2
+static inline void YuvToBGR16_AVX2(__m256i y, __m256i u, __m256i v, const YuvCoeffs_AVX2 &k,
+                                   __m256i *pB, __m256i *pG, __m256i *pR)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i yuLo = _mm256_unpacklo_epi16(y, u), yuHi = _mm256_unpackhi_epi16(y, u);
+    __m256i yvLo = _mm256_unpacklo_epi16(y, v), yvHi = _mm256_unpackhi_epi16(y, v);
+    __m256i v0Lo = _mm256_unpacklo_epi16(v, zero), v0Hi = _mm256_unpackhi_epi16(v, zero);
+    *pB = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yuLo, k.yu_b), k.round), YUV_COEFF_BITS),
+                             _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yuHi, k.yu_b), k.round), YUV_COEFF_BITS));
+    *pR = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yvLo, k.yv_r), k.round), YUV_COEFF_BITS),
+                             _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(yvHi, k.yv_r), k.round), YUV_COEFF_BITS));
+    __m256i gLo = _mm256_add_epi32(_mm256_madd_epi16(yuLo, k.yu_g), _mm256_madd_epi16(v0Lo, k.v0_g));
+    __m256i gHi = _mm256_add_epi32(_mm256_madd_epi16(yuHi, k.yu_g), _mm256_madd_epi16(v0Hi, k.v0_g));
+    *pG = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(gLo, k.round), YUV_COEFF_BITS),
+                             _mm256_srai_epi32(_mm256_add_epi32(gHi, k.round), YUV_COEFF_BITS));
+}
+
+// Packs two vectors of 16 values to 32 bytes in order.
+SIMD_TARGET_AVX2
+static inline __m256i PackBytes32_AVX2(__m256i a, __m256i b)
+{
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+SIMD_TARGET_AVX2
+static void YuvRowToBGR_AVX2(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, YuvLayout eLayout,
+                             const YuvKernelParams &p, unsigned char *pDst, int width)
+{
+    YuvCoeffs_AVX2 k;
+    k.yu_b = CoeffPair_AVX2(p.ky, p.kub);
+    k.yv_r = CoeffPair_AVX2(p.ky, p.kvr);
+    k.yu_g = CoeffPair_AVX2(p.ky, p.kug);
+    k.v0_g = CoeffPair_AVX2(p.kvg, 0);
+    k.round = _mm256_set1_epi32(1 << (YUV_COEFF_BITS - 1));
+    __m256i yOffset = _mm256_set1_epi16((short)p.yOffset), uvOffset = _mm256_set1_epi16(128);
+    __m128i evenBytes = _mm_setr_epi8(0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14);
+    __m128i oddBytes = _mm_setr_epi8(1, 1, 3, 3, 5, 5, 7, 7, 9, 9, 11, 11, 13, 13, 15, 15);
+    int x = 0;
+    for (; x + 32 <= width; x += 32)
+    {
+        // U and V of pixels 0-15 and 16-31, one per pixel.
+        __m128i u0, u1, v0, v1;
+        if (eLayout == YUV_LAYOUT_I420)
+        {
+            __m128i u = _mm_loadu_si128((const __m128i *)(pU + x / 2));
+            __m128i v = _mm_loadu_si128((const __m128i *)(pV + x / 2));
+            u0 = _mm_unpacklo_epi8(u, u);
+            u1 = _mm_unpackhi_epi8(u, u);
+            v0 = _mm_unpacklo_epi8(v, v);
+            v1 = _mm_unpackhi_epi8(v, v);
+        }
+        else if (eLayout == YUV_LAYOUT_NV12)
+        {
+            __m128i uvA = _mm_loadu_si128((const __m128i *)(pU + x));
+            __m128i uvB = _mm_loadu_si128((const __m128i *)(pU + x + 16));
+            u0 = _mm_shuffle_epi8(uvA, evenBytes);
+            v0 = _mm_shuffle_epi8(uvA, oddBytes);
+            u1 = _mm_shuffle_epi8(uvB, evenBytes);
+            v1 = _mm_shuffle_epi8(uvB, oddBytes);
+        }
+        else
+        {
+            u0 = _mm_loadu_si128((const __m128i *)(pU + x));
+            u1 = _mm_loadu_si128((const __m128i *)(pU + x + 16));
+            v0 = _mm_loadu_si128((const __m128i *)(pV + x));
+            v1 = _mm_loadu_si128((const __m128i *)(pV + x + 16));
+        }
+
+        __m256i b0, g0, r0, b1, g1, r1;
+        YuvToBGR16_AVX2(_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(pY + x))), yOffset),
+                        _mm256_sub_epi16(_mm256_cvtepu8_epi16(u0), uvOffset),
+                        _mm256_sub_epi16(_mm256_cvtepu8_epi16(v0), uvOffset), k, &b0, &g0, &r0);
+        YuvToBGR16_AVX2(_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(pY + x + 16))), yOffset),
+                        _mm256_sub_epi16(_mm256_cvtepu8_epi16(u1), uvOffset),
+                        _mm256_sub_epi16(_mm256_cvtepu8_epi16(v1), uvOffset), k, &b1, &g1, &r1);
+        __m256i b = PackBytes32_AVX2(b0, b1), g = PackBytes32_AVX2(g0, g1), r = PackBytes32_AVX2(r0, r1);
+        StoreBGR16_SSSE3(_mm256_castsi256_si128(b), _mm256_castsi256_si128(g), _mm256_castsi256_si128(r), pDst + 3 * x);
+        StoreBGR16_SSSE3(_mm256_extracti128_si256(b, 1), _mm256_extracti128_si256(g, 1), _mm256_extracti128_si256(r, 1),
+                         pDst + 3 * x + 48);
+    }
+    YuvRowToBGRFrom_C(pY, pU, pV, eLayout, p, pDst, x, width);
+}
+#endif
+
+#if defined(SIMD_ARCH_NEON)
+// One channel of 8 pixels: (y * ky + c0 * k0 + c1 * k1) rounded, shifted and
+// saturated to bytes.
+static inline uint8x8_t YuvChannel8_NEON(int16x8_t y, int16x8_t c0, int16x8_t c1, const YuvKernelParams &p, int k0, int k1)
+{
+    int32x4_t lo = vdupq_n_s32(1 << (YUV_COEFF_BITS - 1)), hi = lo;
+    lo = vmlal_n_s16(lo, vget_low_s16(y), (int16_t)p.ky);
+    hi = vmlal_n_s16(hi, vget_high_s16(y), (int16_t)p.ky);
+    lo = vmlal_n_s16(lo, vget_low_s16(c0), (int16_t)k0);
+    hi = vmlal_n_s16(hi, vget_high_s16(c0), (int16_t)k0);
+    lo = vmlal_n_s16(lo, vget_low_s16(c1), (int16_t)k1);
+    hi = vmlal_n_s16(hi, vget_high_s16(c1), (int16_t)k1);
+    return vqmovun_s16(vcombine_s16(vqmovn_s32(vshrq_n_s32(lo, YUV_COEFF_BITS)), vqmovn_s32(vshrq_n_s32(hi, YUV_COEFF_BITS))));
+}
+
+static void YuvRowToBGR_NEON(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, YuvLayout eLayout,
+                             const YuvKernelParams &p, unsigned char *pDst, int width)
+{
+    uint8x8_t yOffset = vdup_n_u8((uint8_t)p.yOffset), uvOffset = vdup_n_u8(128);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16_t u, v;
+        if (eLayout == YUV_LAYOUT_I420)
+        {
+            uint8x8x2_t uu = vzip_u8(vld1_u8(pU + x / 2), vld1_u8(pU + x / 2));
+            uint8x8x2_t vv = vzip_u8(vld1_u8(pV + x / 2), vld1_u8(pV + x / 2));
+            u = vcombine_u8(uu.val[0], uu.val[1]);
+            v = vcombine_u8(vv.val[0], vv.val[1]);
+        }
+        else if (eLayout == YUV_LAYOUT_NV12)
+        {
+            uint8x8x2_t uv = vld2_u8(pU + x);
+            uint8x8x2_t uu = vzip_u8(uv.val[0], uv.val[0]);
+            uint8x8x2_t vv = vzip_u8(uv.val[1], uv.val[1]);
+            u = vcombine_u8(uu.val[0], uu.val[1]);
+            v = vcombine_u8(vv.val[0], vv.val[1]);
+        }
+        else
+        {
+            u = vld1q_u8(pU + x);
+            v = vld1q_u8(pV + x);
+        }
+        uint8x16_t y = vld1q_u8(pY + x);
+
+        uint8x16x3_t bgr;
+        uint8x8_t aB[2], aG[2], aR[2];
+        for (int h = 0; h < 2; h++)
+        {
+            // Wrapping subtractions reinterpreted as signed give the offsets removed.
+            int16x8_t ys = vreinterpretq_s16_u16(vsubl_u8(h ? vget_high_u8(y) : vget_low_u8(y), yOffset));
+            int16x8_t us = vreinterpretq_s16_u16(vsubl_u8(h ? vget_high_u8(u) : vget_low_u8(u), uvOffset));
+            int16x8_t vs = vreinterpretq_s16_u16(vsubl_u8(h ? vget_high_u8(v) : vget_low_u8(v), uvOffset));
+            aB[h] = YuvChannel8_NEON(ys, us, vs, p, p.kub, 0);
+            aG[h] = YuvChannel8_NEON(ys, us, vs, p, p.kug, p.kvg);
+            aR[h] = YuvChannel8_NEON(ys, us, vs, p, 0, p.kvr);
+        }
+        bgr.val[0] = vcombine_u8(aB[0], aB[1]);
+        bgr.val[1] = vcombine_u8(aG[0], aG[1]);
+        bgr.val[2] = vcombine_u8(aR[0], aR[1]);
+        vst3q_u8(pDst + 3 * x, bgr);
+    }
+    YuvRowToBGRFrom_C(pY, pU, pV, eLayout, p, pDst, x, width);
+}
+#endif
+
+void YuvRowToBGR_C(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, YuvLayout eLayout,
+                   unsigned char *pDst, int width, YuvMatrix eMatrix, YuvRange eRange)
+{
+    YuvKernelParams params;
+    GetYuvKernelParams(eMatrix, eRange, &params);
+    YuvRowToBGRFrom_C(pY, pU, pV, eLayout, params, pDst, 0, width);
+}
+
+void YuvRowToBGR(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, YuvLayout eLayout,
+                 unsigned char *pDst, int width, YuvMatrix eMatrix, YuvRange eRange)
+{
+    YuvKernelParams params;
+    GetYuvKernelParams(eMatrix, eRange, &params);
+    switch (RgbGetSimdLevel())
+    {
+#if defined(SIMD_ARCH_X86)
+    case SIMD_LEVEL_AVX2:
+        YuvRowToBGR_AVX2(pY, pU, pV, eLayout, params, pDst, width);
+        break;
+    case SIMD_LEVEL_SSE41:
+    case SIMD_LEVEL_SSSE3:
+        YuvRowToBGR_SSSE3(pY, pU, pV, eLayout, params, pDst, width);
+        break;
+#endif
+#if defined(SIMD_ARCH_NEON)
+    case SIMD_LEVEL_NEON:
+        YuvRowToBGR_NEON(pY, pU, pV, eLayout, params, pDst, width);
+        break;
+#endif
+    default:
+        YuvRowToBGRFrom_C(pY, pU, pV, eLayout, params, pDst, 0, width);
+        break;
+    }
+}
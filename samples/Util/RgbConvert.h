@@ -0,0 +1,106 @@
+/*
+ * Packed RGB to YUV conversion kernels, for RGB captures (NvFBC ARGB or RGB,
+ * B8G8R8A8 back buffers) that have to be fed to an encoder, and YUV to BGR
+ * rows for the bitmap dumps in Bitmap.cpp.
+ *
+ * One pass over the source writes luma and chroma together; chroma is the
+ * average of each 2x2 block for NV12 and I420, or of each pixel for YUV444.
+ * The matrix (BT.601 or BT.709) and the range (limited 16-235 or full 0-255)
+ * are chosen per call. The arithmetic is fixed point with 15 fractional bits
+ * and every result is within 1 of the exact value; grey stays exactly grey.
+ *
+ * Every entry point dispatches at runtime to the best kernel the CPU supports
+ * (AVX2, SSSE3 or NEON). The scalar kernels are kept as the reference
+ * implementation; all SIMD kernels produce byte-identical output. Strides
+ * are in bytes and need not be multiples of anything.
+ */
+
+#pragma once
+
+#include "CpuFeatures.h"
+
+// Formats are named by their byte order in memory. RGB_FORMAT_BGRA is what
+// NvFBC and Bitmap.cpp call ARGB, and what D3DFMT_A8R8G8B8 and
+// DXGI_FORMAT_B8G8R8A8_UNORM hold; RGB_FORMAT_RGBA is DXGI_FORMAT_R8G8B8A8_UNORM.
+// Alpha is ignored.
+enum RgbFormat
+{
+    RGB_FORMAT_BGRA,
+    RGB_FORMAT_RGBA,
+    RGB_FORMAT_ARGB,
+    RGB_FORMAT_RGB,
+    RGB_FORMAT_BGR,
+};
+
+enum YuvMatrix
+{
+    YUV_MATRIX_BT601,
+    YUV_MATRIX_BT709,
+};
+
+enum YuvRange
+{
+    YUV_RANGE_LIMITED,      // Y 16-235, U and V 16-240
+    YUV_RANGE_FULL,         // all 0-255
+};
+
+// Bytes per pixel of a format.
+int RgbGetBytesPerPixel(RgbFormat eFormat);
+
+// Chroma planes are (width + 1) / 2 by (height + 1) / 2; a last odd column
+// or row is averaged with itself.
+void RgbToNV12(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+               unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+               int width, int height, YuvMatrix eMatrix, YuvRange eRange);
+void RgbToI420(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+               unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStrideY, int dstStrideUV,
+               int width, int height, YuvMatrix eMatrix, YuvRange eRange);
+void RgbToYUV444(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+                 unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStride,
+                 int width, int height, YuvMatrix eMatrix, YuvRange eRange);
+
+// Exact value of one pixel, or of the average of several for chroma, in
+// floating point; what the kernels are checked against.
+void RgbToYuvReference(double r, double g, double b, YuvMatrix eMatrix, YuvRange eRange,
+                       double *pY, double *pU, double *pV);
+
+// Scalar reference implementations, used to verify the SIMD kernels.
+void RgbToNV12_C(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+                 unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+                 int width, int height, YuvMatrix eMatrix, YuvRange eRange);
+void RgbToI420_C(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+                 unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStrideY, int dstStrideUV,
+                 int width, int height, YuvMatrix eMatrix, YuvRange eRange);
+void RgbToYUV444_C(const unsigned char *pSrc, int srcStride, RgbFormat eFormat,
+                   unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStride,
+                   int width, int height, YuvMatrix eMatrix, YuvRange eRange);
+
+// Chroma layouts YuvRowToBGR reads.
+enum YuvLayout
+{
+    YUV_LAYOUT_I420,        // U and V planes of (width + 1) / 2 samples per row
+    YUV_LAYOUT_NV12,        // one plane of interleaved U and V
+    YUV_LAYOUT_YUV444,      // U and V planes of width samples per row
+};
+
+// Converts one row of a YUV picture to packed B, G, R bytes, the pixel order
+// of a 24-bit bitmap, writing 3 * width bytes to pDst. pY is the luma row and
+// pU and pV the chroma rows that go with it; for NV12 pU is the interleaved
+// row and pV is not used. Every result is within 1 of the exact value.
+void YuvRowToBGR(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, YuvLayout eLayout,
+                 unsigned char *pDst, int width, YuvMatrix eMatrix, YuvRange eRange);
+
+// Scalar reference implementation of YuvRowToBGR.
+void YuvRowToBGR_C(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV, YuvLayout eLayout,
+                   unsigned char *pDst, int width, YuvMatrix eMatrix, YuvRange eRange);
+
+// Exact inverse of RgbToYuvReference, unclamped.
+void YuvToRgbReference(double y, double u, double v, YuvMatrix eMatrix, YuvRange eRange,
+                       double *pR, double *pG, double *pB);
+
+// Forces the kernels to a given level (clamped to what the CPU supports) and
+// returns the level now in use. Meant for benchmarks and verification only.
+SimdLevel RgbSetSimdLevel(SimdLevel level);
+
+// Returns the level the dispatcher currently uses.
+SimdLevel RgbGetSimdLevel();
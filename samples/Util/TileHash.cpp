@@ -0,0 +1,285 @@
+/*
+ * Block hashing of I420 frames to find the tiles that changed.
+ */
+
+#include "TileHash.h"
+
+#include <string.h>
+
+#if defined(SIMD_ARCH_X86)
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+#if defined(SIMD_ARCH_NEON)
+#include <arm_neon.h>
+#endif
+
+// Odd multiplier of the lane mix and prime of the fold.
+#define TILE_HASH_LANE_MUL  0x9E3779B1u
+#define TILE_HASH_FOLD_MUL  0x100000001B3ull
+
+static volatile int s_nSimdLevel = -1;
+
+SimdLevel TileHashSetSimdLevel(SimdLevel level)
+{
+    SimdLevel clamped = ClampSimdLevel(level);
+    s_nSimdLevel = clamped;
+    return clamped;
+}
+
+SimdLevel TileHashGetSimdLevel()
+{
+    int level = s_nSimdLevel;
+    if (level < 0)
+    {
+        level = GetBestSimdLevel();
+        s_nSimdLevel = level;
+    }
+    return (SimdLevel)level;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Scalar reference kernel. A lane takes a word w as
+//     x = (lane ^ w) * TILE_HASH_LANE_MUL
+//     lane = x ^ (x >> 15)
+// and both steps can be undone, so a different word always gives a
+// different lane.
+
+static inline uint32_t MixLane(uint32_t lane, uint32_t w)
+{
+    uint32_t x = (lane ^ w) * TILE_HASH_LANE_MUL;
+    return x ^ (x >> 15);
+}
+
+// Mixes bytes x to width - 1 of a row into their lanes.
+static inline void HashRowTail(const unsigned char *pRow, int x, int width, uint32_t *pLanes)
+{
+    for (; x < width; x += 4)
+    {
+        uint32_t w = 0;
+        for (int i = 0; i < 4 && x + i < width; i++)
+        {
+            w |= (uint32_t)pRow[x + i] << (8 * i);
+        }
+        pLanes[x / 4] = MixLane(pLanes[x / 4], w);
+    }
+}
+
+void TileHashRows_C(const unsigned char *pSrc, int stride, int width, int height, uint32_t *pLanes)
+{
+    for (int y = 0; y < height; y++)
+    {
+        HashRowTail(pSrc + stride * y, 0, width, pLanes);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// SIMD kernels. Each kernel mixes the vector-sized body of a row and leaves
+// the tail to the scalar loop; the lanes stay in L1 between rows. Words are
+// loaded little-endian, as the scalar kernel assembles them.
+
+#if defined(SIMD_ARCH_X86)
+// SSE2 only multiplies the even 32-bit lanes into 64 bits, so the odd lanes
+// take a second multiply and the low halves are put back together.
+static inline __m128i MulLo32_SSE2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static void HashRows_SSE2(const unsigned char *pSrc, int stride, int width, int height, uint32_t *pLanes)
+{
+    const __m128i mul = _mm_set1_epi32((int)TILE_HASH_LANE_MUL);
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char *s = pSrc + stride * y;
+        int x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i lane = _mm_loadu_si128((const __m128i *)(pLanes + x / 4));
+            __m128i m = MulLo32_SSE2(_mm_xor_si128(lane, _mm_loadu_si128((const __m128i *)(s + x))), mul);
+            _mm_storeu_si128((__m128i *)(pLanes + x / 4), _mm_xor_si128(m, _mm_srli_epi32(m, 15)));
+        }
+        HashRowTail(s, x, width, pLanes);
+    }
+}
+
+SIMD_TARGET_SSE41
+static void HashRows_SSE41(const unsigned char *pSrc, int stride, int width, int height, uint32_t *pLanes)
+{
+    const __m128i mul = _mm_set1_epi32((int)TILE_HASH_LANE_MUL);
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char *s = pSrc + stride * y;
+        int x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i lane = _mm_loadu_si128((const __m128i *)(pLanes + x / 4));
+            __m128i m = _mm_mullo_epi32(_mm_xor_si128(lane, _mm_loadu_si128((const __m128i *)(s + x))), mul);
+            _mm_storeu_si128((__m128i *)(pLanes + x / 4), _mm_xor_si128(m, _mm_srli_epi32(m, 15)));
+        }
+        HashRowTail(s, x, width, pLanes);
+    }
+}
+
+SIMD_TARGET_AVX2
+static void HashRows_AVX2(const unsigned char *pSrc, int stride, int width, int height, uint32_t *pLanes)
+{
+    const __m256i mul = _mm256_set1_epi32((int)TILE_HASH_LANE_MUL);
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char *s = pSrc + stride * y;
+        int x = 0;
+        for (; x + 32 <= width; x += 32)
+        {
+            __m256i lane = _mm256_loadu_si256((const __m256i *)(pLanes + x / 4));
+            __m256i m = _mm256_mullo_epi32(_mm256_xor_si256(lane, _mm256_loadu_si256((const __m256i *)(s + x))), mul);
+            _mm256_storeu_si256((__m256i *)(pLanes + x / 4), _mm256_xor_si256(m, _mm256_srli_epi32(m, 15)));
+        }
+        HashRowTail(s, x, width, pLanes);
+    }
+}
+#endif
+
+#if defined(SIMD_ARCH_NEON)
+static void HashRows_NEON(const unsigned char *pSrc, int stride, int width, int height, uint32_t *pLanes)
+{
+    const uint32x4_t mul = vdupq_n_u32(TILE_HASH_LANE_MUL);
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char *s = pSrc + stride * y;
+        int x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            uint32x4_t lane = vld1q_u32(pLanes + x / 4);
+            uint32x4_t m = vmulq_u32(veorq_u32(lane, vreinterpretq_u32_u8(vld1q_u8(s + x))), mul);
+            vst1q_u32(pLanes + x / 4, veorq_u32(m, vshrq_n_u32(m, 15)));
+        }
+        HashRowTail(s, x, width, pLanes);
+    }
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+// Dispatcher
+
+void TileHashRows(const unsigned char *pSrc, int stride, int width, int height, uint32_t *pLanes)
+{
+    switch (TileHashGetSimdLevel())
+    {
+#if defined(SIMD_ARCH_X86)
+    case SIMD_LEVEL_AVX2:
+        HashRows_AVX2(pSrc, stride, width, height, pLanes);
+        break;
+    case SIMD_LEVEL_SSE41:
+        HashRows_SSE41(pSrc, stride, width, height, pLanes);
+        break;
+    case SIMD_LEVEL_SSSE3:
+    case SIMD_LEVEL_SSE2:
+        HashRows_SSE2(pSrc, stride, width, height, pLanes);
+        break;
+#endif
+#if defined(SIMD_ARCH_NEON)
+    case SIMD_LEVEL_NEON:
+        HashRows_NEON(pSrc, stride, width, height, pLanes);
+        break;
+#endif
+    default:
+        TileHashRows_C(pSrc, stride, width, height, pLanes);
+        break;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Change detector
+
+// Folds nLanes lanes into h. Each step can be undone for a given h, so a
+// single different lane always gives a different hash.
+static uint64_t FoldLanes(uint64_t h, const uint32_t *pLanes, int nLanes)
+{
+    for (int i = 0; i < nLanes; i++)
+    {
+        h = (h ^ pLanes[i]) * TILE_HASH_FOLD_MUL;
+    }
+    return h;
+}
+
+static int Lanes(int width)
+{
+    return (width + 3) / 4;
+}
+
+TileChangeDetector::TileChangeDetector()
+{
+    m_width = 0;
+    m_height = 0;
+    m_nTilesX = 0;
+    m_nTilesY = 0;
+}
+
+void TileChangeDetector::Init(int width, int height)
+{
+    m_width = width;
+    m_height = height;
+    m_nTilesX = (width + TILE_HASH_SIZE - 1) / TILE_HASH_SIZE;
+    m_nTilesY = (height + TILE_HASH_SIZE - 1) / TILE_HASH_SIZE;
+    m_aHashes.assign(m_nTilesX * m_nTilesY, 0);
+    m_aDirty.assign(m_nTilesX * m_nTilesY, 1);
+    m_aStale.assign(m_nTilesY, 1);
+    m_aLanes.resize(Lanes(width) + 2 * Lanes((width + 1) / 2));
+}
+
+void TileChangeDetector::Invalidate()
+{
+    m_aStale.assign(m_nTilesY, 1);
+}
+
+int TileChangeDetector::UpdateTileRows(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV,
+                                       int strideY, int strideUV, int iFirstRow, int nRows)
+{
+    const int chromaWidth = (m_width + 1) / 2, chromaHeight = (m_height + 1) / 2;
+    const int nLanesY = Lanes(m_width), nLanesUV = Lanes(chromaWidth);
+    const int tileLanesY = TILE_HASH_SIZE / 4, tileLanesUV = TILE_HASH_SIZE / 8;
+    uint32_t *pLanesY = &m_aLanes[0], *pLanesU = pLanesY + nLanesY, *pLanesV = pLanesU + nLanesUV;
+    int nDirty = 0;
+
+    for (int ty = iFirstRow; ty < iFirstRow + nRows && ty < m_nTilesY; ty++)
+    {
+        int y = ty * TILE_HASH_SIZE, cy = ty * TILE_HASH_SIZE / 2;
+        int rows = m_height - y < TILE_HASH_SIZE ? m_height - y : TILE_HASH_SIZE;
+        int chromaRows = chromaHeight - cy < TILE_HASH_SIZE / 2 ? chromaHeight - cy : TILE_HASH_SIZE / 2;
+
+        for (size_t i = 0; i < m_aLanes.size(); i++)
+        {
+            m_aLanes[i] = TILE_HASH_SEED;
+        }
+        TileHashRows(pY + strideY * y, strideY, m_width, rows, pLanesY);
+        TileHashRows(pU + strideUV * cy, strideUV, chromaWidth, chromaRows, pLanesU);
+        TileHashRows(pV + strideUV * cy, strideUV, chromaWidth, chromaRows, pLanesV);
+
+        for (int tx = 0; tx < m_nTilesX; tx++)
+        {
+            int laneY = tx * tileLanesY, laneUV = tx * tileLanesUV;
+            int nY = nLanesY - laneY < tileLanesY ? nLanesY - laneY : tileLanesY;
+            int nUV = nLanesUV - laneUV < tileLanesUV ? nLanesUV - laneUV : tileLanesUV;
+            uint64_t h = FoldLanes(TILE_HASH_FOLD_MUL, pLanesY + laneY, nY);
+            h = FoldLanes(h, pLanesU + laneUV, nUV);
+            h = FoldLanes(h, pLanesV + laneUV, nUV);
+
+            int i = ty * m_nTilesX + tx;
+            m_aDirty[i] = m_aStale[ty] || h != m_aHashes[i];
+            m_aHashes[i] = h;
+            nDirty += m_aDirty[i];
+        }
+        m_aStale[ty] = 0;
+    }
+    return nDirty;
+}
+
+int TileChangeDetector::Update(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV,
+                               int strideY, int strideUV)
+{
+    return UpdateTileRows(pY, pU, pV, strideY, strideUV, 0, m_nTilesY);
+}
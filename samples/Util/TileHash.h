@@ -0,0 +1,92 @@
+/*
+ * Block hashing of I420 frames to find the 64x64 tiles that changed since the
+ * previous frame.
+ *
+ * Every 32-bit word of a row has a lane of its own, and the rows of a tile
+ * are mixed into the lanes one after the other; a tile's hash folds its
+ * lanes. Both steps are invertible in the word and the lane, so any change
+ * confined to one word of a column is always seen; anything else is missed
+ * with a probability around 2^-32. Rows are walked in memory order, a tile
+ * row at a time, so the detector streams through the frame once.
+ *
+ * The row kernel dispatches at runtime to the best kernel the CPU supports
+ * (AVX2, SSE4.1, SSE2 or NEON). The scalar kernel is kept as the reference;
+ * all kernels produce the same lanes.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "CpuFeatures.h"
+
+// Edge of a tile in luma pixels; chroma tiles are half that.
+#define TILE_HASH_SIZE  64
+
+// Value every lane starts a tile row with.
+#define TILE_HASH_SEED  0x811C9DC5u
+
+// Mixes height rows of width bytes into pLanes, which holds one lane per
+// 32-bit word of a row, (width + 3) / 4 in all. A partial last word is padded
+// with zeros.
+void TileHashRows(const unsigned char *pSrc, int stride, int width, int height, uint32_t *pLanes);
+
+// Scalar reference implementation, used to verify the SIMD kernels.
+void TileHashRows_C(const unsigned char *pSrc, int stride, int width, int height, uint32_t *pLanes);
+
+// Forces the kernels to a given level (clamped to what the CPU supports) and
+// returns the level now in use. Meant for benchmarks and verification only.
+SimdLevel TileHashSetSimdLevel(SimdLevel level);
+
+// Returns the level the dispatcher currently uses.
+SimdLevel TileHashGetSimdLevel();
+
+// Keeps the tile hashes of the last frame and marks the tiles of each new
+// frame that differ. A tile covers TILE_HASH_SIZE luma rows and columns and
+// the matching U and V samples; the tiles on the right and bottom edges may
+// be smaller.
+class TileChangeDetector
+{
+public:
+    TileChangeDetector();
+
+    // Sizes the tile grid for width x height frames. Every tile of the next
+    // frame is dirty.
+    void Init(int width, int height);
+
+    // Makes every tile of the next frame dirty, for instance after the
+    // encoder was reset.
+    void Invalidate();
+
+    // Hashes tile rows iFirstRow to iFirstRow + nRows - 1 and updates their
+    // part of the dirty mask, so a frame can be checked as it comes in.
+    // Returns the number of dirty tiles among them.
+    int UpdateTileRows(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV,
+                       int strideY, int strideUV, int iFirstRow, int nRows);
+
+    // Same for the whole frame. Returns the number of dirty tiles.
+    int Update(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV,
+               int strideY, int strideUV);
+
+    int GetTilesX() const { return m_nTilesX; }
+    int GetTilesY() const { return m_nTilesY; }
+
+    // One byte per tile, row by row, 1 if the tile changed in the last
+    // update.
+    const unsigned char *GetDirtyMask() const { return m_aDirty.empty() ? NULL : &m_aDirty[0]; }
+
+private:
+    int                         m_width;
+    int                         m_height;
+    int                         m_nTilesX;
+    int                         m_nTilesY;
+    std::vector<uint64_t>       m_aHashes;
+    std::vector<unsigned char>  m_aDirty;
+    std::vector<unsigned char>  m_aStale;   // per tile row; its hashes are not from the last frame
+    std::vector<uint32_t>       m_aLanes;   // Y, U and V lanes of the tile row being hashed
+
+    TileChangeDetector(const TileChangeDetector &);
+    TileChangeDetector &operator=(const TileChangeDetector &);
+};
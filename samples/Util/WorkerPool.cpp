@@ -0,0 +1,160 @@
+/*
+ * Persistent pool of worker threads used to split per-frame CPU work into stripes.
+ */
+
+#include "WorkerPool.h"
+#include "CpuFeatures.h"
+
+WorkerPool::WorkerPool(int nThreads)
+    : m_bStop(false)
+{
+    if (nThreads <= 0)
+    {
+        nThreads = GetCpuFeatures().nLogicalCores;
+    }
+    for (int i = 1; i < nThreads; i++)
+    {
+        m_aThreads.push_back(std::thread(&WorkerPool::WorkerLoop, this));
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bStop = true;
+    }
+    m_cvWork.notify_all();
+    for (size_t i = 0; i < m_aThreads.size(); i++)
+    {
+        m_aThreads[i].join();
+    }
+}
+
+// Namespace scope because VS2013 does not initialize function-local statics
+// thread-safely. The shared pool is never destroyed: its threads cannot be
+// joined safely once DllMain has started running process detach.
+static std::mutex s_sharedPoolMutex;
+static WorkerPool *s_pSharedPool = NULL;
+
+WorkerPool *WorkerPool::GetShared(int nThreads)
+{
+    std::lock_guard<std::mutex> lock(s_sharedPoolMutex);
+    if (!s_pSharedPool)
+    {
+        s_pSharedPool = new WorkerPool(nThreads);
+    }
+    return s_pSharedPool;
+}
+
+// Claims the next unclaimed task, either from pOnly or, when pOnly is NULL,
+// from the oldest queued job. Must be called with m_mutex held.
+bool WorkerPool::ClaimTask(Job *pOnly, Job **ppJob, int *piTask)
+{
+    Job *pJob = pOnly;
+    if (!pJob)
+    {
+        if (m_jobs.empty())
+            return false;
+        pJob = m_jobs.front();
+    }
+    if (pJob->nNextTask >= pJob->nTasks)
+        return false;
+
+    *ppJob = pJob;
+    *piTask = pJob->nNextTask++;
+    if (pJob->nNextTask == pJob->nTasks)
+    {
+        // Fully claimed jobs leave the queue; the submitter still waits for
+        // the tasks in flight through nDone.
+        for (std::deque<Job *>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it)
+        {
+            if (*it == pJob)
+            {
+                m_jobs.erase(it);
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+void WorkerPool::FinishTask(Job *pJob)
+{
+    // The job lives on the submitter's stack and may be gone as soon as the
+    // last task is counted, so nothing in it may be touched after fetch_add.
+    int nTasks = pJob->nTasks;
+    if (pJob->nDone.fetch_add(1) + 1 == nTasks)
+    {
+        // Taking the lock orders the notify after the submitter's predicate check.
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cvDone.notify_all();
+    }
+}
+
+void WorkerPool::ParallelFor(int nTasks, TaskFunc pfnTask, void *pContext)
+{
+    if (nTasks <= 0)
+        return;
+    if (nTasks == 1 || m_aThreads.empty())
+    {
+        for (int i = 0; i < nTasks; i++)
+        {
+            pfnTask(pContext, i);
+        }
+        return;
+    }
+
+    Job job;
+    job.pfnTask = pfnTask;
+    job.pContext = pContext;
+    job.nTasks = nTasks;
+    job.nNextTask = 0;
+    job.nDone = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(&job);
+    }
+    m_cvWork.notify_all();
+
+    for (;;)
+    {
+        Job *pJob = NULL;
+        int iTask = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!ClaimTask(&job, &pJob, &iTask))
+                break;
+        }
+        pfnTask(pContext, iTask);
+        FinishTask(&job);
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (job.nDone.load() != nTasks)
+    {
+        m_cvDone.wait(lock);
+    }
+}
+
+void WorkerPool::WorkerLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        Job *pJob = NULL;
+        int iTask = 0;
+        while (!m_bStop && !ClaimTask(NULL, &pJob, &iTask))
+        {
+            m_cvWork.wait(lock);
+        }
+        if (m_bStop)
+            return;
+
+        lock.unlock();
+        pJob->pfnTask(pJob->pContext, iTask);
+        FinishTask(pJob);
+        lock.lock();
+    }
+}
@@ -0,0 +1,74 @@
+/*
+ * Persistent pool of worker threads used to split per-frame CPU work into
+ * stripes. Several threads may submit work to the same pool at once; every
+ * submitting thread also works on its own tasks, so a job always progresses
+ * even when all workers are busy with other jobs.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool
+{
+public:
+    typedef void (*TaskFunc)(void *pContext, int iTask);
+
+    // nThreads is the total number of threads working on a job, including
+    // the submitting thread; 0 or less picks one per logical core.
+    explicit WorkerPool(int nThreads = 0);
+    ~WorkerPool();
+
+    // Number of threads that can work on one job, including the caller.
+    int GetThreadCount() const { return (int)m_aThreads.size() + 1; }
+
+    // Runs pfnTask(pContext, i) for every i in [0, nTasks) and returns once
+    // they have all finished.
+    void ParallelFor(int nTasks, TaskFunc pfnTask, void *pContext);
+
+    // Same as above for any callable taking the task index.
+    template<class F>
+    void ParallelFor(int nTasks, F &func)
+    {
+        ParallelFor(nTasks, &CallFunctor<F>, &func);
+    }
+
+    // Process-wide pool shared by all encoder threads. The first call decides
+    // the thread count; later calls return the same pool.
+    static WorkerPool *GetShared(int nThreads = 0);
+
+private:
+    struct Job
+    {
+        TaskFunc          pfnTask;
+        void             *pContext;
+        int               nTasks;
+        int               nNextTask;        // guarded by m_mutex
+        std::atomic<int>  nDone;
+    };
+
+    template<class F>
+    static void CallFunctor(void *pContext, int iTask)
+    {
+        (*(F *)pContext)(iTask);
+    }
+
+    bool ClaimTask(Job *pOnly, Job **ppJob, int *piTask);
+    void FinishTask(Job *pJob);
+    void WorkerLoop();
+
+    std::vector<std::thread>    m_aThreads;
+    std::deque<Job *>           m_jobs;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_cvWork;
+    std::condition_variable     m_cvDone;
+    bool                        m_bStop;
+
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator=(const WorkerPool &);
+};
@@ -0,0 +1,323 @@
+/*
+ * Planar YUV copy and repacking kernels used to fill encoder input surfaces.
+ */
+
+#include "YuvConvert.h"
+#include "WorkerPool.h"
+
+#include <string.h>
+
+#if defined(SIMD_ARCH_X86)
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+#if defined(SIMD_ARCH_NEON)
+#include <arm_neon.h>
+#endif
+
+static volatile int s_nSimdLevel = -1;
+
+SimdLevel YuvSetSimdLevel(SimdLevel level)
+{
+    SimdLevel clamped = ClampSimdLevel(level);
+    s_nSimdLevel = clamped;
+    return clamped;
+}
+
+SimdLevel YuvGetSimdLevel()
+{
+    int level = s_nSimdLevel;
+    if (level < 0)
+    {
+        level = GetBestSimdLevel();
+        s_nSimdLevel = level;
+    }
+    return (SimdLevel)level;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Scalar reference kernels
+
+void YuvInterleaveUV_C(const unsigned char *pU, const unsigned char *pV, int srcStrideUV,
+                       unsigned char *pDstUV, int dstStride,
+                       int chromaWidth, int chromaHeight)
+{
+    for (int y = 0; y < chromaHeight; y++)
+    {
+        const unsigned char *u = pU + srcStrideUV * y;
+        const unsigned char *v = pV + srcStrideUV * y;
+        unsigned char *d = pDstUV + dstStride * y;
+        for (int x = 0; x < chromaWidth; x++)
+        {
+            d[2 * x] = u[x];
+            d[2 * x + 1] = v[x];
+        }
+    }
+}
+
+void YuvI420ToNV12_C(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV,
+                     int srcStrideY, int srcStrideUV,
+                     unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+                     int width, int height)
+{
+    for (int y = 0; y < height; y++)
+    {
+        memcpy(pDstY + dstStride * y, pY + srcStrideY * y, width);
+    }
+    YuvInterleaveUV_C(pU, pV, srcStrideUV, pDstUV, dstStride, (width + 1) / 2, height / 2);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// SIMD kernels. Each kernel handles the vector-sized body of a row and
+// leaves the tail to the scalar loop, so any width and stride is accepted.
+
+#if defined(SIMD_ARCH_X86)
+static void InterleaveUV_SSE2(const unsigned char *pU, const unsigned char *pV, int srcStrideUV,
+                              unsigned char *pDstUV, int dstStride,
+                              int chromaWidth, int chromaHeight)
+{
+    for (int y = 0; y < chromaHeight; y++)
+    {
+        const unsigned char *u = pU + srcStrideUV * y;
+        const unsigned char *v = pV + srcStrideUV * y;
+        unsigned char *d = pDstUV + dstStride * y;
+        int x = 0;
+        for (; x + 16 <= chromaWidth; x += 16)
+        {
+            __m128i mu = _mm_loadu_si128((const __m128i *)(u + x));
+            __m128i mv = _mm_loadu_si128((const __m128i *)(v + x));
+            _mm_storeu_si128((__m128i *)(d + 2 * x), _mm_unpacklo_epi8(mu, mv));
+            _mm_storeu_si128((__m128i *)(d + 2 * x + 16), _mm_unpackhi_epi8(mu, mv));
+        }
+        for (; x < chromaWidth; x++)
+        {
+            d[2 * x] = u[x];
+            d[2 * x + 1] = v[x];
+        }
+    }
+}
+
+SIMD_TARGET_AVX2
+static void InterleaveUV_AVX2(const unsigned char *pU, const unsigned char *pV, int srcStrideUV,
+                              unsigned char *pDstUV, int dstStride,
+                              int chromaWidth, int chromaHeight)
+{
+    for (int y = 0; y < chromaHeight; y++)
+    {
+        const unsigned char *u = pU + srcStrideUV * y;
+        const unsigned char *v = pV + srcStrideUV * y;
+        unsigned char *d = pDstUV + dstStride * y;
+        int x = 0;
+        for (; x + 32 <= chromaWidth; x += 32)
+        {
+            __m256i mu = _mm256_loadu_si256((const __m256i *)(u + x));
+            __m256i mv = _mm256_loadu_si256((const __m256i *)(v + x));
+            // unpack works per 128-bit lane, so lo holds samples 0-7 and 16-23
+            // and hi holds 8-15 and 24-31; the permutes put them back in order.
+            __m256i lo = _mm256_unpacklo_epi8(mu, mv);
+            __m256i hi = _mm256_unpackhi_epi8(mu, mv);
+            _mm256_storeu_si256((__m256i *)(d + 2 * x), _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i *)(d + 2 * x + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+        for (; x + 16 <= chromaWidth; x += 16)
+        {
+            __m128i mu = _mm_loadu_si128((const __m128i *)(u + x));
+            __m128i mv = _mm_loadu_si128((const __m128i *)(v + x));
+            _mm_storeu_si128((__m128i *)(d + 2 * x), _mm_unpacklo_epi8(mu, mv));
+            _mm_storeu_si128((__m128i *)(d + 2 * x + 16), _mm_unpackhi_epi8(mu, mv));
+        }
+        for (; x < chromaWidth; x++)
+        {
+            d[2 * x] = u[x];
+            d[2 * x + 1] = v[x];
+        }
+    }
+}
+#endif
+
+#if defined(SIMD_ARCH_NEON)
+static void InterleaveUV_NEON(const unsigned char *pU, const unsigned char *pV, int srcStrideUV,
+                              unsigned char *pDstUV, int dstStride,
+                              int chromaWidth, int chromaHeight)
+{
+    for (int y = 0; y < chromaHeight; y++)
+    {
+        const unsigned char *u = pU + srcStrideUV * y;
+        const unsigned char *v = pV + srcStrideUV * y;
+        unsigned char *d = pDstUV + dstStride * y;
+        int x = 0;
+        for (; x + 16 <= chromaWidth; x += 16)
+        {
+            uint8x16x2_t uv;
+            uv.val[0] = vld1q_u8(u + x);
+            uv.val[1] = vld1q_u8(v + x);
+            vst2q_u8(d + 2 * x, uv);
+        }
+        for (; x < chromaWidth; x++)
+        {
+            d[2 * x] = u[x];
+            d[2 * x + 1] = v[x];
+        }
+    }
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+// Dispatchers
+
+void YuvCopyPlane(const unsigned char *pSrc, int srcStride,
+                  unsigned char *pDst, int dstStride,
+                  int widthBytes, int height)
+{
+    // Row copies are already vectorized by the CRT memcpy; the only thing
+    // worth doing here is collapsing tightly packed planes into one call.
+    if (srcStride == widthBytes && dstStride == widthBytes)
+    {
+        memcpy(pDst, pSrc, (size_t)widthBytes * height);
+        return;
+    }
+    for (int y = 0; y < height; y++)
+    {
+        memcpy(pDst + (size_t)dstStride * y, pSrc + (size_t)srcStride * y, widthBytes);
+    }
+}
+
+void YuvInterleaveUV(const unsigned char *pU, const unsigned char *pV, int srcStrideUV,
+                     unsigned char *pDstUV, int dstStride,
+                     int chromaWidth, int chromaHeight)
+{
+    switch (YuvGetSimdLevel())
+    {
+#if defined(SIMD_ARCH_X86)
+    case SIMD_LEVEL_AVX2:
+        InterleaveUV_AVX2(pU, pV, srcStrideUV, pDstUV, dstStride, chromaWidth, chromaHeight);
+        return;
+    case SIMD_LEVEL_SSE41:
+    case SIMD_LEVEL_SSSE3:
+    case SIMD_LEVEL_SSE2:
+        InterleaveUV_SSE2(pU, pV, srcStrideUV, pDstUV, dstStride, chromaWidth, chromaHeight);
+        return;
+#endif
+#if defined(SIMD_ARCH_NEON)
+    case SIMD_LEVEL_NEON:
+        InterleaveUV_NEON(pU, pV, srcStrideUV, pDstUV, dstStride, chromaWidth, chromaHeight);
+        return;
+#endif
+    default:
+        YuvInterleaveUV_C(pU, pV, srcStrideUV, pDstUV, dstStride, chromaWidth, chromaHeight);
+        return;
+    }
+}
+
+void YuvI420ToNV12(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV,
+                   int srcStrideY, int srcStrideUV,
+                   unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+                   int width, int height)
+{
+    YuvCopyPlane(pY, srcStrideY, pDstY, dstStride, width, height);
+    YuvInterleaveUV(pU, pV, srcStrideUV, pDstUV, dstStride, (width + 1) / 2, height / 2);
+}
+
+void YuvCopyYUV444(const unsigned char *pSrcY, const unsigned char *pSrcU, const unsigned char *pSrcV, int srcStride,
+                   unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStride,
+                   int width, int height)
+{
+    YuvCopyPlane(pSrcY, srcStride, pDstY, dstStride, width, height);
+    YuvCopyPlane(pSrcU, srcStride, pDstU, dstStride, width, height);
+    YuvCopyPlane(pSrcV, srcStride, pDstV, dstStride, width, height);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Stripe-parallel variants
+
+namespace
+{
+struct StripeJob
+{
+    const unsigned char *pSrc[3];
+    unsigned char       *pDst[3];
+    int                  srcStride[3];
+    int                  dstStride;
+    int                  width;
+    int                  height;
+    int                  nStripes;
+    int                  rowsPerStripe;     // always even so chroma rows split cleanly
+    bool                 bYuv444;
+
+    void operator()(int iStripe) const
+    {
+        int y0 = iStripe * rowsPerStripe;
+        int y1 = (iStripe == nStripes - 1) ? height : y0 + rowsPerStripe;
+        if (bYuv444)
+        {
+            for (int p = 0; p < 3; p++)
+            {
+                YuvCopyPlane(pSrc[p] + (size_t)srcStride[p] * y0, srcStride[p],
+                    pDst[p] + (size_t)dstStride * y0, dstStride, width, y1 - y0);
+            }
+            return;
+        }
+        YuvCopyPlane(pSrc[0] + (size_t)srcStride[0] * y0, srcStride[0],
+            pDst[0] + (size_t)dstStride * y0, dstStride, width, y1 - y0);
+        int c0 = y0 / 2;
+        int c1 = y1 / 2;
+        YuvInterleaveUV(pSrc[1] + (size_t)srcStride[1] * c0, pSrc[2] + (size_t)srcStride[2] * c0, srcStride[1],
+            pDst[1] + (size_t)dstStride * c0, dstStride, (width + 1) / 2, c1 - c0);
+    }
+};
+
+int GetStripeCount(WorkerPool *pPool, int width, int height)
+{
+    if (!pPool || width * height < YUV_STRIPE_MIN_PIXELS)
+        return 1;
+    int nStripes = height / YUV_STRIPE_MIN_ROWS;
+    if (nStripes > pPool->GetThreadCount())
+        nStripes = pPool->GetThreadCount();
+    return nStripes < 1 ? 1 : nStripes;
+}
+
+void RunStripes(WorkerPool *pPool, StripeJob &job)
+{
+    job.nStripes = GetStripeCount(pPool, job.width, job.height);
+    job.rowsPerStripe = (job.height / job.nStripes) & ~1;
+    if (job.nStripes == 1)
+    {
+        job(0);
+        return;
+    }
+    pPool->ParallelFor(job.nStripes, job);
+}
+}
+
+void YuvI420ToNV12Striped(WorkerPool *pPool,
+                          const unsigned char *pY, const unsigned char *pU, const unsigned char *pV,
+                          int srcStrideY, int srcStrideUV,
+                          unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+                          int width, int height)
+{
+    StripeJob job;
+    job.pSrc[0] = pY; job.pSrc[1] = pU; job.pSrc[2] = pV;
+    job.pDst[0] = pDstY; job.pDst[1] = pDstUV; job.pDst[2] = NULL;
+    job.srcStride[0] = srcStrideY; job.srcStride[1] = srcStrideUV; job.srcStride[2] = srcStrideUV;
+    job.dstStride = dstStride;
+    job.width = width;
+    job.height = height;
+    job.bYuv444 = false;
+    RunStripes(pPool, job);
+}
+
+void YuvCopyYUV444Striped(WorkerPool *pPool,
+                          const unsigned char *pSrcY, const unsigned char *pSrcU, const unsigned char *pSrcV, int srcStride,
+                          unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStride,
+                          int width, int height)
+{
+    StripeJob job;
+    job.pSrc[0] = pSrcY; job.pSrc[1] = pSrcU; job.pSrc[2] = pSrcV;
+    job.pDst[0] = pDstY; job.pDst[1] = pDstU; job.pDst[2] = pDstV;
+    job.srcStride[0] = job.srcStride[1] = job.srcStride[2] = srcStride;
+    job.dstStride = dstStride;
+    job.width = width;
+    job.height = height;
+    job.bYuv444 = true;
+    RunStripes(pPool, job);
+}
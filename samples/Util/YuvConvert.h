@@ -0,0 +1,72 @@
+/*
+ * Planar YUV copy and repacking kernels used to fill encoder input surfaces.
+ *
+ * Every entry point dispatches at runtime to the best kernel the CPU supports
+ * (AVX2, SSE2 or NEON). The scalar kernels are kept as the reference
+ * implementation; all SIMD kernels produce byte-identical output.
+ */
+
+#pragma once
+
+#include "CpuFeatures.h"
+
+class WorkerPool;
+
+// Frames below this many pixels are converted on the calling thread only;
+// waking workers costs more than the copy itself.
+#define YUV_STRIPE_MIN_PIXELS (640 * 360)
+
+// Minimum number of luma rows given to one stripe.
+#define YUV_STRIPE_MIN_ROWS 32
+
+// Copies a plane of widthBytes x height bytes between two pitched buffers.
+void YuvCopyPlane(const unsigned char *pSrc, int srcStride,
+                  unsigned char *pDst, int dstStride,
+                  int widthBytes, int height);
+
+// Interleaves planar U and V into the NV12 UV plane. chromaWidth is the number
+// of U (and V) samples per row, so each destination row gets 2 * chromaWidth bytes.
+void YuvInterleaveUV(const unsigned char *pU, const unsigned char *pV, int srcStrideUV,
+                     unsigned char *pDstUV, int dstStride,
+                     int chromaWidth, int chromaHeight);
+
+// Converts I420 to NV12. Odd widths round the chroma width up and odd heights
+// drop the last chroma row, which matches how the encoder sample always did it.
+void YuvI420ToNV12(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV,
+                   int srcStrideY, int srcStrideUV,
+                   unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+                   int width, int height);
+
+// Copies the three planes of a YUV444 frame.
+void YuvCopyYUV444(const unsigned char *pSrcY, const unsigned char *pSrcU, const unsigned char *pSrcV, int srcStride,
+                   unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStride,
+                   int width, int height);
+
+// Same as YuvI420ToNV12 and YuvCopyYUV444, but the planes are split into
+// horizontal stripes converted in parallel on pPool. A NULL pool or a small
+// frame runs everything on the calling thread.
+void YuvI420ToNV12Striped(WorkerPool *pPool,
+                          const unsigned char *pY, const unsigned char *pU, const unsigned char *pV,
+                          int srcStrideY, int srcStrideUV,
+                          unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+                          int width, int height);
+void YuvCopyYUV444Striped(WorkerPool *pPool,
+                          const unsigned char *pSrcY, const unsigned char *pSrcU, const unsigned char *pSrcV, int srcStride,
+                          unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int dstStride,
+                          int width, int height);
+
+// Scalar reference implementations, used to verify the SIMD kernels.
+void YuvInterleaveUV_C(const unsigned char *pU, const unsigned char *pV, int srcStrideUV,
+                       unsigned char *pDstUV, int dstStride,
+                       int chromaWidth, int chromaHeight);
+void YuvI420ToNV12_C(const unsigned char *pY, const unsigned char *pU, const unsigned char *pV,
+                     int srcStrideY, int srcStrideUV,
+                     unsigned char *pDstY, unsigned char *pDstUV, int dstStride,
+                     int width, int height);
+
+// Forces the kernels to a given level (clamped to what the CPU supports) and
+// returns the level now in use. Meant for benchmarks and verification only.
+SimdLevel YuvSetSimdLevel(SimdLevel level);
+
+// Returns the level the dispatcher currently uses.
+SimdLevel YuvGetSimdLevel();